@@ -235,8 +235,20 @@ struct apic_dev {
     uint64_t ps_per_tick;
     uint64_t cycles_per_us;
     uint64_t cycles_per_tick;
+    uint64_t tsc_freq_hz;
+    // fixed-point conversions computed at calibration time so that
+    // the fast paths never divide:  out = (in * mult) >> shift
+    uint64_t ns_mult;       // cycles -> ns
+    uint32_t ns_shift;
+    uint64_t cyc_mult;      // ns -> cycles
+    uint32_t cyc_shift;
+    uint64_t tick_mult;     // ns -> apic ticks
+    uint32_t tick_shift;
+    sint64_t tsc_offset;    // local TSC + offset = BSP TSC
+    uint8_t  tsc_deadline;  // timer is running in TSC-deadline mode
     uint8_t  timer_set;
     uint32_t current_ticks; // timeout currently being computed
+    uint64_t current_deadline; // same, in TSC-deadline mode (local TSC)
     uint64_t timer_count;
     int      in_timer_interrupt;
     int      in_kick_interrupt;
@@ -355,6 +367,23 @@ int apic_read_timer(struct apic_dev * apic);
 uint32_t apic_wait_for_send(struct apic_dev* apic);
 
 
+static inline uint64_t apic_mul_shift(uint64_t x, uint64_t mult, uint32_t shift)
+{
+    // 64x64->128 multiply, so no intermediate overflow
+    return (uint64_t)(((unsigned __int128)x * mult) >> shift);
+}
+
+// divide-free conversions for the scheduler's fast paths
+static inline uint64_t apic_tsc_to_ns(struct apic_dev *apic, uint64_t cycles)
+{
+    return apic_mul_shift(cycles, apic->ns_mult, apic->ns_shift);
+}
+
+static inline uint64_t apic_ns_to_tsc(struct apic_dev *apic, uint64_t ns)
+{
+    return apic_mul_shift(ns, apic->cyc_mult, apic->cyc_shift);
+}
+
 uint32_t apic_cycles_to_ticks(struct apic_dev *apic, uint64_t cycles);
 
 uint32_t apic_realtime_to_ticks(struct apic_dev *apic, uint64_t ns);
@@ -373,6 +402,13 @@ void     apic_set_oneshot_timer(struct apic_dev *apic, uint32_t ticks);
 typedef enum {UNCOND, IF_EARLIER, IF_LATER} nk_timer_condition_t;
 void     apic_update_oneshot_timer(struct apic_dev *apic,  uint32_t ticks, 
 				   nk_timer_condition_t cond);
+
+// TSC-deadline mode, if the timer is in it (apic->tsc_deadline)
+// the deadline is an absolute value of this core's TSC
+// in this mode, the oneshot functions above are translated to deadlines
+void     apic_set_deadline_timer(struct apic_dev *apic, uint64_t tsc);
+void     apic_update_deadline_timer(struct apic_dev *apic, uint64_t tsc,
+				    nk_timer_condition_t cond);
 			       
 
 
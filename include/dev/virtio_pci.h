@@ -31,7 +31,7 @@
 #include <dev/virtqueue.h>
 #include <nautilus/nautilus.h>
 
-#define MAX_VIRTQS 4
+#define MAX_VIRTQS 64   // enough for one queue per CPU on multiqueue devices
 #define VIRTIO_MSI_NO_VECTOR 0xffff
 
 enum virtio_pci_dev_model {
@@ -52,4 +52,66 @@ int  nk_gc_pdsgc_leak_detect(struct nk_gc_pdsgc_stats *stats);
 // Assorted tests
 int  nk_gc_pdsgc_test();
 
+#ifdef NAUT_CONFIG_INCREMENTAL_PDSGC
+
+// Incremental collection marks in a low-priority background
+// thread.  The world is stopped only at the beginning of a cycle
+// (to clear marks) and at the end (to rescan data roots, mark from
+// the thread stacks, and revisit the pointers logged by the write
+// barrier).  Thread stacks are not scanned concurrently, so what is
+// reachable only from them is marked in the final pause.
+// Blocks allocated during a cycle are treated as live.
+//
+// This is a Dijkstra-style insertion barrier - any store of a
+// heap pointer into the heap while a cycle is in progress must
+// go through it, for example:
+//
+//     NK_GC_PDSGC_WRITE(node->next, new_node);
+//
+// Stores to thread stacks and to the data segment need no barrier
+// since those are rescanned during the final pause.  Nothing
+// enforces this, so incremental collection is refused unless
+// NAUT_CONFIG_INCREMENTAL_PDSGC_ANNOTATED_HEAP asserts it.
+
+struct nk_gc_pdsgc_incr_stats
+{
+    struct nk_gc_pdsgc_stats freed;
+    uint64_t initial_pause_ns;
+    uint64_t final_pause_ns;
+    uint64_t max_pause_ns;        // largest pause of any incremental cycle so far
+    uint64_t concurrent_mark_ns;
+    uint64_t concurrent_sweep_ns;
+    uint64_t barrier_log_entries; // pointers logged by the write barrier
+    uint64_t barrier_log_overflow;// nonzero => final pause did a full mark
+};
+
+extern volatile int nk_gc_pdsgc_marking;
+
+void _nk_gc_pdsgc_write_barrier_slow(void *val);
+
+static inline void nk_gc_pdsgc_write_barrier(void *val)
+{
+    if (__builtin_expect(nk_gc_pdsgc_marking,0)) {
+	_nk_gc_pdsgc_write_barrier_slow(val);
+    }
+}
+
+#define NK_GC_PDSGC_WRITE(lhs, rhs) ({ typeof(rhs) ____gc_val = (rhs); nk_gc_pdsgc_write_barrier((void*)____gc_val); (lhs) = ____gc_val; })
+
+// Start an incremental cycle in the background - returns nonzero
+// if a cycle is already in progress
+int  nk_gc_pdsgc_incremental_start();
+// Wait for the current incremental cycle to finish
+int  nk_gc_pdsgc_incremental_wait(struct nk_gc_pdsgc_incr_stats *stats);
+// start + wait
+int  nk_gc_pdsgc_collect_incremental(struct nk_gc_pdsgc_incr_stats *stats);
+
+int  nk_gc_pdsgc_incremental_test();
+
+#else
+
+#define NK_GC_PDSGC_WRITE(lhs, rhs) ((lhs) = (rhs))
+
+#endif
+
 #endif
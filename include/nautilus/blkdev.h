@@ -37,6 +37,26 @@ typedef enum {
     NK_BLOCK_DEV_STATUS_ERROR
 } nk_block_dev_status_t;
 
+// A scatter-gather request, as passed to a driver's submit_batch.
+// The segments are transferred to/from consecutive blocks starting
+// at blocknum.  Each segment is a multiple of the block size.
+#define NK_BLOCK_DEV_MAX_SEGS 16
+
+struct nk_block_dev_seg {
+    void     *addr;
+    uint64_t len;       // bytes
+};
+
+struct nk_block_dev_req {
+    int      write;
+    uint64_t blocknum;
+    uint64_t count;     // blocks, over all segments
+    uint32_t nsegs;
+    struct nk_block_dev_seg seg[NK_BLOCK_DEV_MAX_SEGS];
+    void (*callback)(nk_block_dev_status_t status, void *context);
+    void *context;
+};
+
 struct nk_block_dev_int {
     // this must be first so it derives cleanly
     // from nk_dev_int
@@ -48,6 +68,16 @@ struct nk_block_dev_int {
     int (*get_characteristics)(void *state, struct nk_block_dev_characteristics *c);
     int (*read_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(nk_block_dev_status_t status, void *context), void *context);
     int (*write_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *src, void (*callback)(nk_block_dev_status_t status, void *context), void *context);
+    // only for devices whose contents are memory resident (e.g., ramdisks) 
+    // returns a pointer to the memory holding the blocks, which stays valid
+    // for the life of the device
+    int (*map_blocks)(void *state, uint64_t blocknum, uint64_t count, void **addr);
+    // optional - start reqs[0..n) with a single notification of the
+    // device, returning how many were started (fewer than n if the
+    // device is out of room).  Each started request completes via its
+    // callback, including requests the driver rejects.  Devices without
+    // it are driven through read_blocks/write_blocks, one segment at a time
+    int (*submit_batch)(void *state, struct nk_block_dev_req **reqs, uint32_t n);
 };
 
 
@@ -67,6 +97,9 @@ struct nk_block_dev * nk_block_dev_find(char *name);
 
 int nk_block_dev_get_characteristics(struct nk_block_dev *d, struct nk_block_dev_characteristics *c);
 
+// fails if the device is not memory resident
+int nk_block_dev_map(struct nk_block_dev *d, uint64_t blocknum, uint64_t count, void **addr);
+
 int nk_block_dev_read(struct nk_block_dev *dev, 
 		      uint64_t blocknum, 
 		      uint64_t count, 
@@ -85,5 +118,60 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 
 
 
+//
+// Asynchronous submission/completion rings
+//
+// A ring belongs to one thread, which queues requests in the submission
+// ring (get_sqe), hands everything queued to the driver in one batch
+// (submit), and reaps completions from the completion ring (peek_cqe,
+// cqe_seen), either polling or sleeping in wait.  Queued requests of the
+// same direction to adjacent blocks are merged into one device request.
+// A ring never holds more than its number of entries of queued, in-flight,
+// and unreaped requests together, so the completion ring cannot overflow.
+//
+#define NK_BLOCK_DEV_SQE_SEGS     4
+
+#define NK_BLOCK_DEV_RING_POLL    1   // wait spins rather than sleeps
+#define NK_BLOCK_DEV_RING_NOMERGE 2   // do not merge adjacent requests
+
+struct nk_block_dev_sqe {
+    int      write;
+    uint64_t blocknum;
+    uint32_t nsegs;
+    struct nk_block_dev_seg seg[NK_BLOCK_DEV_SQE_SEGS];
+    uint64_t user_data;   // returned in the completion
+};
+
+struct nk_block_dev_cqe {
+    uint64_t              user_data;
+    nk_block_dev_status_t status;
+};
+
+struct nk_block_dev_ring_stats {
+    uint64_t submitted;   // submission entries
+    uint64_t requests;    // device requests they became
+    uint64_t batches;     // calls to the driver
+};
+
+struct nk_block_dev_ring;
+
+// entries is rounded up to a power of two
+struct nk_block_dev_ring *nk_block_dev_ring_create(struct nk_block_dev *dev, uint32_t entries, int flags);
+void                      nk_block_dev_ring_destroy(struct nk_block_dev_ring *r);
+
+// returns 0 if the ring is full
+struct nk_block_dev_sqe  *nk_block_dev_ring_get_sqe(struct nk_block_dev_ring *r);
+// returns the number of entries handed to the driver (invalid entries
+// are completed with an error rather than handed over)
+int                       nk_block_dev_ring_submit(struct nk_block_dev_ring *r);
+// waits until at least min_complete completions are available (or
+// nothing more is in flight), and returns the number available
+uint32_t                  nk_block_dev_ring_wait(struct nk_block_dev_ring *r, uint32_t min_complete);
+// returns 0 if no completion is available
+struct nk_block_dev_cqe  *nk_block_dev_ring_peek_cqe(struct nk_block_dev_ring *r);
+void                      nk_block_dev_ring_cqe_seen(struct nk_block_dev_ring *r);
+
+void                      nk_block_dev_ring_get_stats(struct nk_block_dev_ring *r, struct nk_block_dev_ring_stats *s);
+
 #endif
 
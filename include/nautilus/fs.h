@@ -56,6 +56,10 @@ struct nk_fs_int {
     ssize_t  (*read_file)(void *state, void *file, void *dest, off_t offset, size_t n);
     ssize_t  (*write_file)(void *state, void *file, void *src, off_t offset, size_t n);
     void  (*close_file)(void *state, void *file);
+    // optional - pointer to memory-resident, contiguous file data
+    int   (*map_file)(void *state, void *file, off_t offset, size_t n, void **addr);
+    // optional - write back anything the filesystem is caching
+    int   (*sync)(void *state);
 };
 
 // This is the class for a filesystem.  It should be the first
@@ -118,6 +122,15 @@ ssize_t    nk_fs_read(nk_fs_fd_t fd, void *buf, size_t len);
 ssize_t    nk_fs_write(nk_fs_fd_t fd, void *buf, size_t len);
 int        nk_fs_close(nk_fs_fd_t fd);
 
+// Get a direct pointer to bytes [offset,offset+n) of an open file
+// This only works if the file's data is already in memory (e.g., it
+// is on a ramdisk) and is laid out contiguously there.  The mapping is
+// of the backing store itself - callers must treat it as read-only.
+int        nk_fs_map(nk_fs_fd_t fd, off_t offset, size_t n, void **addr);
+
+// Write back cached state of all filesystems
+int        nk_fs_sync(void);
+
 
 void test_fs(void);
 void init_fs(void);
@@ -30,6 +30,23 @@
 
 typedef struct nk_thread_group nk_thread_group_t;
 
+// how group reductions combine the members' values
+typedef enum {
+  NK_THREAD_GROUP_SUM,
+  NK_THREAD_GROUP_MIN,
+  NK_THREAD_GROUP_MAX,
+  NK_THREAD_GROUP_AND,
+  NK_THREAD_GROUP_OR,
+} nk_thread_group_op_t;
+
+// time members have spent in collectives (barrier, broadcast, reduce),
+// from arriving to being released
+typedef struct nk_thread_group_stats {
+  uint64_t waits;     // member arrivals
+  uint64_t wait_sum;  // ns, summed over arrivals
+  uint64_t wait_max;  // ns, longest single wait
+} nk_thread_group_stats_t;
+
 // init of module
 int nk_thread_group_init(void);
 
@@ -51,13 +68,15 @@ void *nk_thread_group_get_state(nk_thread_group_t *group);
 // search for a thread group by name
 nk_thread_group_t *nk_thread_group_find(char *name);
 
-// current thread joins a group
+// current thread joins a group, not while the group is in a collective
+// (barrier, broadcast, reduce)
 int nk_thread_group_join(nk_thread_group_t *group);
 
-// current thread leaves a group
+// current thread leaves a group, not while the group is in a collective
 int nk_thread_group_leave(nk_thread_group_t *group);
 
 // all threads in the group call to synchronize
+// returns NK_BARRIER_LAST to exactly one of them
 int nk_thread_group_barrier(nk_thread_group_t *group);
 
 // all threads in the group call to select one thread as leader
@@ -69,8 +88,17 @@ int nk_thread_group_reset_leader(nk_thread_group_t *group);
 //  check if I'm the leader
 int nk_thread_group_check_leader(nk_thread_group_t *group);
 
-// broadcast a message to all members of the thread group
-int nk_thread_group_broadcast(nk_thread_group_t *group, void *message, uint64_t tid, uint64_t src);
+// broadcast a message from the root to all members of the thread group
+// all members call; the root passes *message, the others receive it there
+int nk_thread_group_broadcast(nk_thread_group_t *group, void **message, int root);
+
+// all threads in the group call to combine their values, the root gets the result
+int nk_thread_group_reduce(nk_thread_group_t *group, nk_thread_group_op_t op,
+                           sint64_t value, sint64_t *result, int root);
+
+// all threads in the group call to combine their values, all get the result
+int nk_thread_group_allreduce(nk_thread_group_t *group, nk_thread_group_op_t op,
+                              sint64_t value, sint64_t *result);
 
 // terminate the bcast, then nobody will be waiting for sending or recieving
 int nk_thread_group_broadcast_terminate(nk_thread_group_t *group);
@@ -81,4 +109,7 @@ int nk_thread_group_delete(nk_thread_group_t *group);
 // return the size of a group
 uint64_t nk_thread_group_get_size(nk_thread_group_t *group);
 
+// collective wait statistics of a group since it was created
+int nk_thread_group_get_stats(nk_thread_group_t *group, nk_thread_group_stats_t *stats);
+
 #endif /* _GROUP_H */
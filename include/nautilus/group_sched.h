@@ -38,4 +38,10 @@ int nk_group_sched_deinit(void);
 int nk_group_sched_change_constraints(nk_thread_group_t *group,
                                      struct nk_sched_constraints *group_constraints);
 
+// cooperatively change the constraints in a group to a gang, which the
+// scheduler releases and preempts on all members' cpus at once
+// constraints must be periodic, and the members on different cpus
+int nk_group_sched_change_constraints_gang(nk_thread_group_t *group,
+                                          struct nk_sched_constraints *group_constraints);
+
 #endif /* _GROUP_SCHED_H_ */
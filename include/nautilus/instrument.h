@@ -50,12 +50,10 @@ extern "C" {
 #define NK_FREE_PROF_EXIT() 
 #endif
 
-struct nk_hashtable;
-
 struct malloc_data {
     uint64_t count;
     uint64_t start_count;
-    uint64_t avg_latency;
+    uint64_t total_latency;
     uint64_t max_latency;
     uint64_t min_latency;
 };
@@ -63,7 +61,7 @@ struct malloc_data {
 struct free_data {
     uint64_t count;
     uint64_t start_count;
-    uint64_t avg_latency;
+    uint64_t total_latency;
     uint64_t max_latency;
     uint64_t min_latency;
 };
@@ -71,7 +69,7 @@ struct free_data {
 struct irq_data {
     uint64_t count;
     uint64_t start_count;
-    uint64_t avg_latency;
+    uint64_t total_latency;
     uint64_t max_latency;
     uint64_t min_latency;
 };
@@ -79,13 +77,53 @@ struct irq_data {
 struct thread_switch_data {
     uint64_t count;
     uint64_t start_count;
-    uint64_t avg_latency;
+    uint64_t total_latency;
     uint64_t max_latency;
     uint64_t min_latency;
 };
 
+/*
+ * Function profiles are kept per CPU in a fixed-size open-addressed
+ * table keyed by function address (or, for NK_PROFILE_ENTRY(), by the
+ * address of the function's __func__ string).  Entry pushes a frame on
+ * a per-CPU shadow call stack, and exit pops it, charging the
+ * inclusive time to the function and to its caller's children, so
+ * exclusive time falls out as inclusive minus children.  All times
+ * are in TSC cycles.
+ */
+#define NK_PROF_STACK_DEPTH 256
+#define NK_PROF_TABLE_SIZE  (1UL << NAUT_CONFIG_PROFILE_TABLE_ORDER)
+#define NK_PROF_TABLE_MASK  (NK_PROF_TABLE_SIZE - 1)
+
+struct nk_prof_frame {
+    addr_t       key;
+    const char * name;
+    uint64_t     start;
+    uint64_t     child;   // inclusive cycles of our callees
+};
+
+struct nk_prof_func {
+    addr_t       key;     // 0 => empty slot
+    const char * name;    // NULL => symbolize key at dump time
+    uint64_t     calls;
+    uint64_t     incl;
+    uint64_t     excl;
+    uint64_t     max_incl;
+    uint64_t     min_incl;
+};
+
+struct nk_prof_table {
+    uint32_t depth;
+    uint64_t overflows;   // calls deeper than the shadow stack
+    uint64_t unmatched;   // exits with no matching entry
+    uint64_t orphaned;    // frames abandoned by an exit further down
+    uint64_t full;        // calls not recorded because the table was full
+    struct nk_prof_frame stack[NK_PROF_STACK_DEPTH];
+    struct nk_prof_func  funcs[0];
+};
+
 struct nk_instr_data {
-    struct nk_hashtable * func_htable;
+    struct nk_prof_table * func_table;
     struct irq_data irqstat;
     struct malloc_data mallocstat;
     struct free_data freestat;
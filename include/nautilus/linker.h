@@ -40,14 +40,49 @@ struct symtab_info {
     char * strtab;
 };
 
+/*
+ * GNU-hash style index over the kernel symbol table, built
+ * at boot. A bloom filter rejects most names we do not have,
+ * and each hash bucket is a contiguous run in the chain array
+ * (the low bit of a chain hash marks the end of the run).
+ * by_addr holds symbol indices sorted by address for reverse
+ * lookups (backtraces, profilers).
+ */
+struct symtab_index {
+    uint32_t   nbuckets;
+    uint32_t   bloom_words;  // power of two
+    uint32_t   bloom_shift;
+    uint64_t * bloom;
+    uint32_t * buckets;      // first chain slot of each bucket, or -1
+    uint32_t * chain;        // symbol hashes, grouped by bucket
+    uint32_t * order;        // symbol index for each chain slot
+    uint32_t * by_addr;      // symbol indices sorted by value
+};
+
+struct nk_link_stats {
+    uint64_t lookups;        // kernel symbol lookups
+    uint64_t bloom_rejects;  // lookups answered by the bloom filter alone
+    uint64_t chain_probes;   // chain entries visited
+    uint64_t strcmps;        // full name comparisons
+    uint64_t last_link_relocs;
+    uint64_t last_link_cycles;
+};
+
 struct nk_link_info {
     int ready;
     struct symtab_info symtab;
+    struct symtab_index index;
+    struct nk_link_stats stats;
 };
 
 
 int nk_link_prog (struct nk_link_info * linfo, struct nk_prog_info * prog);
 int nk_linker_init (struct naut_info * naut);
 
+// find the address of the named kernel symbol, 0 on success
+int nk_linker_lookup_symbol (struct nk_link_info * linfo, const char * name, uint64_t * addr);
+// find the kernel symbol containing addr, 0 on success
+int nk_linker_addr_to_symbol (struct nk_link_info * linfo, uint64_t addr, char ** name, uint64_t * offset);
+
 
 #endif
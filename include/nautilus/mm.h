@@ -116,6 +116,9 @@ void   kmem_free(void * addr);
 int  kmem_find_block(void *any_addr, void **block_addr, uint64_t *block_size, uint64_t *flags);
 // set the flags of an allocated block
 int  kmem_set_block_flags(void *block_addr, uint64_t flags);
+// set the flags that newly allocated blocks will have
+// this can be done with the world running
+void kmem_set_new_block_flags(uint64_t flags);
 // apply an mask to all the blocks (and mask unless or=1)
 int  kmem_mask_all_blocks_flags(uint64_t mask, int ormask);
 
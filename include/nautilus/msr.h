@@ -35,6 +35,11 @@ extern "C" {
 #define     MSR_APIC_IS_BSP(x)   (x & 0x100)
 #define     MSR_APIC_GET_ADDR(x) ((x >> 12) & 0xfffff) 
 #define IA32_MISC_ENABLES  0x1a0
+#define IA32_TSC_DEADLINE  0x6e0
+
+#define IA32_PERF_GLOBAL_STATUS   0x38e
+#define IA32_PERF_GLOBAL_CTRL     0x38f
+#define IA32_PERF_GLOBAL_OVF_CTRL 0x390
 
 #define MSR_FS_BASE 0xc0000100
 #define MSR_GS_BASE 0xc0000101
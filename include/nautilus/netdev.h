@@ -28,13 +28,64 @@
 
 #define ETHER_MAC_LEN 6
 
+// offloads a device can perform (characteristics.offloads)
+#define NK_NET_DEV_OFFLOAD_TX_CSUM 0x1  // completes partial checksums on send
+#define NK_NET_DEV_OFFLOAD_RX_CSUM 0x2  // validates checksums, may hand up partial ones
+#define NK_NET_DEV_OFFLOAD_TSO4    0x4  // segments TCP/IPv4 on send
+#define NK_NET_DEV_OFFLOAD_LRO4    0x8  // may coalesce TCP/IPv4 on receive
+#define NK_NET_DEV_OFFLOAD_SG      0x10 // can gather a send from segments
+
+#define NK_NET_DEV_MAX_QUEUES 16
+
 struct nk_net_dev_characteristics {
     uint8_t  mac[ETHER_MAC_LEN];
     uint64_t min_tu;
     uint64_t max_tu;
     uint64_t (*packet_size_to_buffer_size)(uint64_t packet_size);
+    uint64_t offloads;    // NK_NET_DEV_OFFLOAD_*
+    uint64_t max_tso;     // largest frame that can be sent with NK_NET_PKT_TSO4
+    uint64_t num_queues;  // independent send/receive queue pairs
+    // cpu that takes the interrupts of each queue pair below num_queues
+    int      queue_cpu[NK_NET_DEV_MAX_QUEUES];
+};
+
+// Per-packet offload information.  It is handed to the device with a
+// send, and filled in by the device on a receive.  Offsets are from
+// the start of the frame.
+//
+// CSUM_PARTIAL: the checksum over [csum_start, end of frame) belongs
+//   at csum_start+csum_offset, and that field currently holds the
+//   (uncomplemented) pseudo-header sum
+// CSUM_VALID:   (receive) the device has verified the checksums
+// TSO4:         (send) cut the TCP payload into mss-sized segments,
+//   each carrying a copy of the first hdr_len bytes of headers
+//               (receive) the frame coalesces several segments
+// QUEUE:        (send, receive post) use queue pair queue instead of
+//   letting the device choose; devices with one queue ignore it
+//               (receive) the frame arrived on queue pair queue
+#define NK_NET_PKT_CSUM_PARTIAL 0x1
+#define NK_NET_PKT_CSUM_VALID   0x2
+#define NK_NET_PKT_TSO4         0x4
+#define NK_NET_PKT_QUEUE        0x8
+
+struct nk_net_dev_pkt_info {
+    uint32_t flags;        // NK_NET_PKT_*
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t hdr_len;
+    uint16_t mss;
+    uint32_t len;          // receive: length of the frame, 0 if unknown
+    uint16_t queue;        // with NK_NET_PKT_QUEUE
 };
 
+// one piece of a gathered send
+struct nk_net_dev_seg {
+    uint8_t  *addr;
+    uint64_t len;
+};
+
+#define NK_NET_DEV_MAX_SEGS 16
+
 
 typedef enum {
     NK_NET_DEV_STATUS_SUCCESS=0,
@@ -53,6 +104,13 @@ struct nk_net_dev_int {
     // callback can be null
     int (*post_receive)(void *state, uint8_t *dest, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
     int (*post_send)(void *state, uint8_t *src, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
+    // optional variants for devices with offloads, as above but with per-packet
+    // info, which must stay valid until the callback for a receive
+    int (*post_receive_info)(void *state, uint8_t *dest, uint64_t len, struct nk_net_dev_pkt_info *info, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
+    int (*post_send_info)(void *state, uint8_t *src, uint64_t len, struct nk_net_dev_pkt_info *info, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
+    // optional gathered send, for devices with NK_NET_DEV_OFFLOAD_SG
+    // segments must stay valid until the callback, info may be null
+    int (*post_send_sg)(void *state, struct nk_net_dev_seg *segs, uint32_t num_segs, struct nk_net_dev_pkt_info *info, void (*callback)(nk_net_dev_status_t status, void *context), void *context);
 };
 
 
@@ -88,6 +146,42 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
                                             void *state),  // for callback reqs
 			   void *state);                  // for callback reqs
 
+// as above, with per-packet offload info (see struct nk_net_dev_pkt_info)
+// a send asking for offloads the device does not have fails
+// a receive on a device without offload support returns zeroed info
+int nk_net_dev_receive_packet_info(struct nk_net_dev *dev,
+				   uint8_t *dest,
+				   uint64_t len,
+				   struct nk_net_dev_pkt_info *info,
+				   nk_dev_request_type_t type,
+				   void (*callback)(nk_net_dev_status_t status,
+						    void *state),
+				   void *state);
+
+int nk_net_dev_send_packet_info(struct nk_net_dev *dev,
+				uint8_t *src,
+				uint64_t len,
+				struct nk_net_dev_pkt_info *info,
+				nk_dev_request_type_t type,
+				void (*callback)(nk_net_dev_status_t status,
+						 void *state),
+				void *state);
+
+// send a frame gathered from up to NK_NET_DEV_MAX_SEGS segments
+// fails if the device cannot gather (NK_NET_DEV_OFFLOAD_SG)
+int nk_net_dev_send_packet_sg(struct nk_net_dev *dev,
+			      struct nk_net_dev_seg *segs,
+			      uint32_t num_segs,
+			      struct nk_net_dev_pkt_info *info,
+			      nk_dev_request_type_t type,
+			      void (*callback)(nk_net_dev_status_t status,
+					       void *state),
+			      void *state);
+
+// finish a CSUM_PARTIAL checksum in software, e.g. for a receiver
+// that cannot accept partial checksums
+int nk_net_dev_complete_csum(uint8_t *frame, uint64_t len, struct nk_net_dev_pkt_info *info);
+
 
 #endif
 
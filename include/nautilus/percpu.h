@@ -118,6 +118,78 @@ do { \
     } \
      } while (0)
 
+
+
+/*
+ * Per-CPU variables outside of struct cpu
+ *
+ * NK_DEFINE_PER_CPU(type, name) defines a variable of which each CPU
+ * has its own instance.  The variables are gathered by the linker
+ * into an ELF TLS segment (.tdata/.tbss), and each CPU gets a copy of
+ * it placed directly below its struct cpu, which is where %gs points.
+ * The linker thus computes each variable's offset from %gs, and the
+ * accessors below are each a single %gs-relative instruction.
+ *
+ * Never reference such a variable directly in C - the compiler would
+ * generate an %fs-relative TLS access.   this_cpu_read/write/add work
+ * on 1, 2, 4, and 8 byte scalars and pointers.   this_cpu_add is a
+ * single read-modify-write instruction, so it is atomic with respect
+ * to interrupts on the local CPU (but not with respect to other CPUs).
+ * Use this_cpu_ptr() or per_cpu_ptr() for anything larger.
+ *
+ * Per-CPU variables must not require more than cache line alignment.
+ */
+#define NK_DEFINE_PER_CPU(type, name)  __thread type name __attribute__((used))
+#define NK_DECLARE_PER_CPU(type, name) extern __thread type name
+
+// offset of the variable from this CPU's %gs base (negative)
+#define __per_cpu_offset(name)                                        \
+    ({                                                                \
+    long __o;                                                         \
+    asm ("movq $" #name "@tpoff, %[_o]" : [_o] "=r" (__o));           \
+    __o;                                                              \
+    })
+
+#define this_cpu_read(name)                                           \
+    ({                                                                \
+    typeof(name) __r;                                                 \
+    asm volatile ("mov " __xpand_str(__percpu_seg) ":" #name "@tpoff, %[_r]" \
+                  : [_r] "=r" (__r));                                 \
+    __r;                                                              \
+    })
+
+#define this_cpu_write(name, val)                                     \
+    asm volatile ("mov %[_v], " __xpand_str(__percpu_seg) ":" #name "@tpoff" \
+                  : /* no outputs */                                  \
+                  : [_v] "r" ((typeof(name))(val))                    \
+                  : "memory")
+
+#define this_cpu_add(name, val)                                       \
+    asm volatile ("add %[_v], " __xpand_str(__percpu_seg) ":" #name "@tpoff" \
+                  : /* no outputs */                                  \
+                  : [_v] "r" ((typeof(name))(val))                    \
+                  : "cc", "memory")
+
+#define this_cpu_sub(name, val) this_cpu_add(name, -(val))
+#define this_cpu_inc(name)      this_cpu_add(name, 1)
+#define this_cpu_dec(name)      this_cpu_add(name, -1)
+
+// pointer to the instance that belongs to the given struct cpu 
+#define cpu_ptr(core, name) \
+    ((typeof(name) *)((char *)(core) + __per_cpu_offset(name)))
+
+// pointer to this CPU's instance
+#define this_cpu_ptr(name) cpu_ptr(per_cpu_get(self), name)
+
+// pointer to the instance of CPU number cpu 
+#define per_cpu_ptr(name, cpu) cpu_ptr(per_cpu_get(system)->cpus[(cpu)], name)
+
+// allocate a zeroed struct cpu together with its per-CPU variable area
+struct cpu *nk_per_cpu_alloc_cpu(void);
+
+// size of the per-CPU variable area of each CPU
+unsigned long nk_per_cpu_area_size(void);
+
     
 #define my_cpu_id() per_cpu_get(id)
 
@@ -42,6 +42,8 @@
 #define AMD_PERF_CTR4_MSR 0xc0010209
 #define AMD_PERF_CTR5_MSR 0xc001020b
 
+#define AMD_PERF_CTR_MASK ((1ULL << 48) - 1)
+
 #define AMD_PERF_CTL_MSR_N(n) (AMD_PERF_CTL0_MSR + 2*(n))
 #define AMD_PERF_CTR_MSR_N(n) (AMD_PERF_CTR0_MSR + 2*(n))
 
@@ -193,6 +195,12 @@ struct pmc_ops {
     int      (*init)(struct pmc_info * pmc);
     void     (*event_init)(perf_event_t * event);
 
+    /* overflow sampling: arm the bound slot to interrupt every period
+       events on this CPU, re-arm it from the interrupt, and disarm it */
+    void     (*sample_arm)(perf_event_t * event, uint64_t period);
+    void     (*sample_rearm)(perf_event_t * event, uint64_t period);
+    void     (*sample_disarm)(perf_event_t * event);
+
     int      (*version)();
     int      (*msr_cnt)();
     int      (*msr_width)();
@@ -236,4 +244,44 @@ void     nk_pmc_write(perf_event_t * event, uint64_t val);
 
 void     nk_pmc_report(void);
 
+
+#ifdef NAUT_CONFIG_PMC_SAMPLE
+
+/*
+ * Statistical sampling: every CPU takes a performance counter
+ * overflow interrupt every "period" occurrences of the event and
+ * records the interrupted RIP, the frame pointer call chain, and the
+ * current thread into its own sample buffer.
+ */
+
+#define NK_PMC_SAMPLE_DEPTH 16
+#define NK_PMC_SAMPLE_NO_THREAD ((uint64_t)-1)   // tid when no thread was running
+
+struct nk_pmc_sample {
+    uint64_t rip;
+    uint64_t tid;
+    uint32_t depth;
+    uint32_t rsvd;
+    uint64_t chain[NK_PMC_SAMPLE_DEPTH];  // return addresses, innermost first
+};
+
+struct nk_pmc_sample_buf {
+    uint64_t head;      // next free sample, advanced only after it is written
+    uint64_t size;
+    uint64_t dropped;   // buffer was full
+    uint64_t count;     // overflow interrupts taken
+    struct nk_pmc_sample samples[0];
+};
+
+struct excp_entry_state;
+
+int  nk_pmc_sample_start(uint32_t event_id, uint64_t period, uint64_t samples_per_cpu);
+int  nk_pmc_sample_stop(void);
+void nk_pmc_sample_report(unsigned top);
+
+// called from the LAPIC performance counter interrupt
+int  nk_pmc_sample_intr(struct excp_entry_state * excp);
+
+#endif
+
 #endif /* !__PMC_H__! */
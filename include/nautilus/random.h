@@ -29,6 +29,7 @@ extern "C" {
 
 
 #include <nautilus/spinlock.h>
+#include <nautilus/percpu.h>
 
 struct nk_rand_info {
     spinlock_t lock;
@@ -37,6 +38,9 @@ struct nk_rand_info {
     uint64_t n;
 };
 
+// each CPU has its own generator state
+NK_DECLARE_PER_CPU(struct nk_rand_info, nk_rand_state);
+
 struct cpu;
 int nk_rand_init(struct cpu * cpu);
 void nk_rand_set_xi(uint64_t xi);
@@ -116,6 +116,50 @@ int nk_sched_thread_pre_destroy(struct nk_thread *thread);
 // nonzero return => failed
 int    nk_sched_thread_change_constraints(struct nk_sched_constraints *constraints);
 
+//
+// Gangs are periodic threads on different CPUs that are released and
+// preempted together.  Every member gets the gang's period and slice,
+// and runs in the same window [T+k*period, T+k*period+slice) on the
+// common timeline.  Admission reserves that window on the member's
+// CPU, so two gangs whose windows overlap cannot share a CPU.  Within
+// its window a member runs ahead of any other RT thread, and it is
+// preempted when the window closes even if it has slice left.
+//
+struct nk_sched_gang;
+
+// The number of candidate windows per period that a gang can use
+#define NK_SCHED_GANG_SLOTS 64
+
+struct nk_sched_gang_stats {
+    uint64_t members;       // threads currently in the gang
+    uint64_t dispatches;    // member dispatches at a release
+    uint64_t latency_sum;   // ns from release to dispatch, summed
+    uint64_t latency_max;   // ns
+    uint64_t releases;      // releases at which every member was dispatched
+    uint64_t skew_sum;      // ns from first to last member dispatch, summed
+    uint64_t skew_max;      // ns
+};
+
+// create a gang for the given (periodic) constraints, NULL on failure
+// the caller holds a reference, which it drops with nk_sched_gang_put
+struct nk_sched_gang *nk_sched_gang_create(struct nk_sched_constraints *constraints);
+void   nk_sched_gang_put(struct nk_sched_gang *gang);
+
+// bitmap of the windows (bit i = NK_SCHED_GANG_SLOTS ths of the period)
+// that the gang could use on the calling thread's CPU
+uint64_t nk_sched_gang_free_slots(struct nk_sched_gang *gang);
+
+// The calling thread changes its constraints to the gang's and joins it
+// The first member to join fixes the gang's window to slot, with the
+// first release no earlier than after+phase.  Everyone should pass the
+// same slot and after (typically agreed on through the thread group)
+// nonzero return => failed, and the thread is back to its old constraints
+int    nk_sched_thread_join_gang(struct nk_sched_gang *gang, int slot, uint64_t after);
+
+// dispatch statistics of the calling thread's gang
+// nonzero return => the thread is not in a gang
+int    nk_sched_thread_get_gang_stats(struct nk_sched_gang_stats *stats);
+
 // Move the thread to the new cpu
 // a thread cannot move itself
 // a running thread cannot be moved
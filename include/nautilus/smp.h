@@ -71,7 +71,16 @@ struct nk_xcall {
     struct nk_instr_data;
 #endif
 
+// struct cpu is split into cache lines by who writes them, so that
+// other CPUs writing to their part (e.g., posting an xcall) do not
+// cause false sharing with the fields this CPU updates on every
+// interrupt and context switch.  Small, hot state that is purely
+// local is better defined with NK_DEFINE_PER_CPU (see percpu.h)
+#define CPU_CACHE_LINE_SIZE 64
+
 struct cpu {
+    // Written only by this CPU, on its hot paths
+    
     struct nk_thread * cur_thread;             /* +0  KCH: this must be first! */
     // track whether we are in an interrupt, nested or otherwise
     // this is intended for use by the scheduler (any scheduler)
@@ -92,6 +101,10 @@ struct cpu {
     struct nk_fiber_percpu_state *f_state; /* Fiber state for each CPU */
     #endif
 
+    // Read-mostly, set up at boot
+
+    struct cpu * self __attribute__((aligned(CPU_CACHE_LINE_SIZE)));
+
     cpu_id_t id;
     uint32_t lapic_id;   
     uint8_t enabled;
@@ -99,18 +112,13 @@ struct cpu {
     uint32_t cpu_sig;
     uint32_t feat_flags;
 
-    volatile uint8_t booted;
-
     struct apic_dev * apic;
 
     struct sys_info * system;
 
-    spinlock_t lock;
-
     struct nk_sched_percpu_state *sched_state;
 
     nk_queue_t * xcall_q;
-    struct nk_xcall xcall_nowait_info;
 
     ulong_t cpu_khz; 
     
@@ -121,14 +129,20 @@ struct cpu {
 
     struct kmem_data kmem;
 
-
-    struct nk_rand_info * rand;
-
     /* temporary */
 #ifdef NAUT_CONFIG_PROFILE
     struct nk_instr_data * instr_data;
 #endif
-};
+
+    // Written by other CPUs
+
+    spinlock_t lock __attribute__((aligned(CPU_CACHE_LINE_SIZE)));
+
+    volatile uint8_t booted;
+
+    struct nk_xcall xcall_nowait_info;
+
+} __attribute__((aligned(CPU_CACHE_LINE_SIZE)));
 
 
 struct ap_init_area {
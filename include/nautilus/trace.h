@@ -0,0 +1,157 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2015, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __NK_TRACE_H__
+#define __NK_TRACE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+//
+// Binary event tracing
+//
+// A tracepoint, NK_TRACE(EVENT, a, b, c), appends a fixed-size
+// binary record (TSC, CPU, event, three arguments) to a per-CPU
+// ring buffer.   Nothing is formatted at the tracepoint - the "trace"
+// shell command drains the buffers of all CPUs, merges them by TSC,
+// and formats the records using the per-event format strings below.
+//
+// With NAUT_CONFIG_TRACE off, tracepoints compile to nothing (and
+// their arguments are not evaluated).
+//
+// To add an event, add a line to NK_TRACE_EVENTS.  The format string
+// receives the three arguments as uint64_ts.
+//
+#define NK_TRACE_EVENTS(E)                                                \
+    E(SCHED_SWITCH,  "switch from thread %lu to thread %lu (status %lu)") \
+    E(TIMER,         "timer interrupt %lu, next in %ld ns")              \
+    E(KMEM_MALLOC,   "kmem malloc %lu bytes (cpu %ld) -> %p")             \
+    E(XCALL,         "xcall to cpu %lu func %p wait %lu")
+
+#define NK_TRACE_ENUM(name, fmt) NK_TRACE_##name,
+typedef enum {
+    NK_TRACE_EVENTS(NK_TRACE_ENUM)
+    NK_TRACE_NUM_EVENTS
+} nk_trace_event_t;
+#undef NK_TRACE_ENUM
+
+struct nk_trace_rec {
+    uint64_t seq;      // slot number + 1, written last
+    uint64_t tsc;
+    uint16_t event;
+    uint16_t cpu;
+    uint32_t rsvd;
+    uint64_t arg[3];
+};
+
+struct nk_trace_buf {
+    // written by the local CPU only
+    uint64_t head;         // next slot to write
+    uint64_t dropped;      // records dropped because the buffer was full
+    uint16_t cpu;
+    // written by the drainer
+    uint64_t tail __attribute__((aligned(64)));  // next slot to read
+    struct nk_trace_rec recs[0] __attribute__((aligned(64)));
+};
+
+int  nk_trace_init(void);
+void nk_trace_deinit(void);
+
+#ifdef NAUT_CONFIG_TRACE
+
+#include <nautilus/percpu.h>
+
+#define NK_TRACE_ENTRIES (1UL << NAUT_CONFIG_TRACE_ENTRIES_ORDER)
+#define NK_TRACE_MASK    (NK_TRACE_ENTRIES - 1)
+
+NK_DECLARE_PER_CPU(struct nk_trace_buf *, nk_trace_buf);
+
+extern volatile int nk_trace_enabled;
+
+static inline uint64_t _nk_trace_rdtsc(void)
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo | ((uint64_t)hi << 32);
+}
+
+static inline void nk_trace_record(uint16_t event, uint64_t a0, uint64_t a1, uint64_t a2)
+{
+    struct nk_trace_buf *b = this_cpu_read(nk_trace_buf);
+    struct nk_trace_rec *r;
+    uint64_t slot;
+
+    if (!b || !nk_trace_enabled) {
+        return;
+    }
+
+    // Claim a slot.  Only this CPU writes head, so it is enough to
+    // make the claim atomic with respect to interrupts here, which
+    // an unlocked xadd/cmpxchg does
+#ifdef NAUT_CONFIG_TRACE_OVERWRITE
+    slot = 1;
+    asm volatile ("xaddq %[_s], %[_h]" : [_s] "+r" (slot), [_h] "+m" (b->head) : : "memory");
+#else
+    uint64_t next;
+    do {
+        slot = b->head;
+        if (slot - b->tail >= NK_TRACE_ENTRIES) {
+            b->dropped++;
+            return;
+        }
+        next = slot + 1;
+        asm volatile ("cmpxchgq %[_n], %[_h]"
+                      : "+a" (slot), [_h] "+m" (b->head)
+                      : [_n] "r" (next)
+                      : "memory", "cc");
+    } while (slot != next - 1);
+#endif
+
+    r = &b->recs[slot & NK_TRACE_MASK];
+
+    // invalidate the slot while we fill it in
+    r->seq = 0;
+    __asm__ __volatile__ ("" : : : "memory");
+    r->tsc    = _nk_trace_rdtsc();
+    r->event  = event;
+    r->cpu    = b->cpu;
+    r->arg[0] = a0;
+    r->arg[1] = a1;
+    r->arg[2] = a2;
+    __asm__ __volatile__ ("" : : : "memory");
+    r->seq = slot + 1;
+}
+
+#define NK_TRACE(ev, a0, a1, a2) \
+    nk_trace_record(NK_TRACE_##ev, (uint64_t)(a0), (uint64_t)(a1), (uint64_t)(a2))
+
+#else
+
+#define NK_TRACE(ev, a0, a1, a2)
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
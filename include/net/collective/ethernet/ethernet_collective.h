@@ -29,7 +29,9 @@
 #include <net/ethernet/ethernet_packet.h>
 #include <net/ethernet/ethernet_agent.h>
 
-// Fast L2 collective communication, currently just barriers and rings
+// Fast L2 collective communication: barriers, rings, broadcasts,
+// reductions, and allgathers.  Payloads larger than a packet are split
+// into fragments that are pipelined through the collective
 
 struct nk_net_ethernet_collective;
 
@@ -57,6 +59,54 @@ int nk_net_ethernet_collective_ring(struct nk_net_ethernet_collective *col, void
 
 #define NET_ETHERNET_COLLECTIVE_MAX_TOKEN_LEN 512
 
+typedef enum {
+    NK_NET_ETHERNET_COLLECTIVE_INT32 = 0,
+    NK_NET_ETHERNET_COLLECTIVE_UINT32,
+    NK_NET_ETHERNET_COLLECTIVE_INT64,
+    NK_NET_ETHERNET_COLLECTIVE_UINT64,
+    NK_NET_ETHERNET_COLLECTIVE_DOUBLE,
+} nk_net_ethernet_collective_type_t;
+
+// BAND and BOR are bitwise, and only for the integer types
+typedef enum {
+    NK_NET_ETHERNET_COLLECTIVE_SUM = 0,
+    NK_NET_ETHERNET_COLLECTIVE_MIN,
+    NK_NET_ETHERNET_COLLECTIVE_MAX,
+    NK_NET_ETHERNET_COLLECTIVE_BAND,
+    NK_NET_ETHERNET_COLLECTIVE_BOR,
+} nk_net_ethernet_collective_op_t;
+
+// the algorithm for each of the following is chosen by the
+// size of the payload and of the collective
+
+// send len bytes of buf from root to everyone else's buf
+int nk_net_ethernet_collective_broadcast(struct nk_net_ethernet_collective *col,
+					 void *buf, uint64_t len, uint32_t root);
+
+// combine count elements of send from every node with op into root's recv
+// recv is needed on every node (as scratch), and may be the same as send
+int nk_net_ethernet_collective_reduce(struct nk_net_ethernet_collective *col,
+				      void *send, void *recv, uint64_t count,
+				      nk_net_ethernet_collective_type_t type,
+				      nk_net_ethernet_collective_op_t op,
+				      uint32_t root);
+
+// like reduce, but everyone gets the result
+int nk_net_ethernet_collective_allreduce(struct nk_net_ethernet_collective *col,
+					 void *send, void *recv, uint64_t count,
+					 nk_net_ethernet_collective_type_t type,
+					 nk_net_ethernet_collective_op_t op);
+
+// everyone gets everyone's len bytes of send, in rank order, in recv,
+// which holds len*num_nodes bytes
+int nk_net_ethernet_collective_allgather(struct nk_net_ethernet_collective *col,
+					 void *send, uint64_t len, void *recv);
+
+// operations fail if a peer is silent for this long (0, the default,
+// waits forever).  A failed operation leaves the collective unusable
+// unless every node fails it the same way
+int nk_net_ethernet_collective_set_timeout(struct nk_net_ethernet_collective *col, uint64_t timeout_ns);
+
 
 int nk_net_ethernet_collective_destroy(struct nk_net_ethernet_collective *col);
 
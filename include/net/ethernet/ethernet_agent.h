@@ -49,6 +49,13 @@ int                nk_net_ethernet_agent_unregister(struct nk_net_dev *dev);
 int nk_net_ethernet_agent_start(struct nk_net_ethernet_agent *agent);
 int nk_net_ethernet_agent_stop(struct nk_net_ethernet_agent *agent);
 
+// Received packets are spread by flow over num_shards shards, shard i
+// delivering its packets on cpu i, so the packets of a flow stay in
+// order.  With one shard (the default), packets are delivered on the
+// cpu the device completes them on.  num_shards <= 0 means one per cpu.
+// The agent must be stopped.
+int nk_net_ethernet_agent_set_shards(struct nk_net_ethernet_agent *agent, int num_shards);
+
 
 // the user can find the agented network device for a given type
 // by its device name, which will give him the basic
@@ -55,6 +55,18 @@ int nk_net_ethernet_arper_remove(struct nk_net_ethernet_arper *arper, ipv4_addr_
 // if it is a hard failure, a negative return value is given
 int nk_net_ethernet_arp_lookup(struct nk_net_ethernet_arper *arper, ipv4_addr_t ip_addr, ethernet_mac_addr_t mac_addr);
 
+// Like lookup, but waits for the answer, retrying as needed
+// Must be called from a thread.  0 => found, positive => nothing
+// within the timeout (0 = wait until we give up on the address),
+// negative => hard failure, including nobody answering
+int nk_net_ethernet_arp_resolve(struct nk_net_ethernet_arper *arper, ipv4_addr_t ip_addr, ethernet_mac_addr_t mac_addr, uint64_t timeout_ns);
+
+// Put a mapping in the cache, as if it had been announced with a
+// gratuitous ARP.   It ages like any other entry
+int nk_net_ethernet_arp_preload(ipv4_addr_t ip_addr, ethernet_mac_addr_t mac_addr);
+
+void nk_net_ethernet_arp_dump();
+
 int  nk_net_ethernet_arp_init();
 void nk_net_ethernet_arp_deinit();
 
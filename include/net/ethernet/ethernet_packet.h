@@ -54,6 +54,9 @@ typedef struct nk_ethernet_packet {
 
     void             *metadata;      // for external use
 
+    struct nk_net_dev_pkt_info info; // offloads requested on send, reported on receive
+
+    // raw starts on a cache line so devices can DMA straight into it
     union {
 	uint8_t raw[MAX_ETHERNET_PACKET_LEN];
 	struct {
@@ -64,7 +67,7 @@ typedef struct nk_ethernet_packet {
 	    } __packed          header;
 	    uint8_t             data[MAX_ETHERNET_PACKET_DATA_LEN];
 	} __packed;
-    } __packed;  // probably should also align to a cache line
+    } __packed __attribute__((aligned(64)));
 } nk_ethernet_packet_t;
 
 
@@ -0,0 +1,157 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#ifndef __NET_FAST__
+#define __NET_FAST__
+
+#include <nautilus/naut_types.h>
+#include <net/ethernet/ethernet_agent.h>
+#include <net/ethernet/ethernet_arp.h>
+
+//
+// A small UDP and TCP stack for code that lives in the kernel and
+// wants its messages without going through LWIP's thread or a socket.
+//
+// There are no sockets to read from.  Instead, the application hands
+// callbacks to each endpoint, and they are invoked in whatever context
+// received the frame: the device's completion, an agent shard, or, for
+// loopback, the sender.  Callbacks must not block, and should be short,
+// as they hold up everything else the device has received.
+//
+// An interface sits on an ethernet agent, and claims only the TCP and
+// UDP ports that are open on it.  Everything else, including ARP, ICMP,
+// and other ports, is left to whoever else is registered with the agent,
+// so the fast path can share a device, and even an address, with LWIP.
+// To do so, create the interface after LWIP's, on "<dev>-agent-lwip".
+// Peers are resolved through the shared ARP cache, so an interface on
+// an agent of its own wants an arper on that agent too.
+//
+// Addresses and ports are in host order
+//
+
+struct nk_net_fast_if;
+struct nk_net_fast_udp;
+struct nk_net_fast_tcp;
+
+// agent == 0 gives an interface that can only talk to itself
+struct nk_net_fast_if *nk_net_fast_if_create(char *name,
+					     struct nk_net_ethernet_agent *agent,
+					     ipv4_addr_t ip,
+					     ipv4_addr_t netmask,
+					     ipv4_addr_t gateway);
+struct nk_net_fast_if *nk_net_fast_if_find(char *name);
+// fails if anything is still open on the interface
+int                    nk_net_fast_if_destroy(struct nk_net_fast_if *fi);
+
+void                   nk_net_fast_dump();
+
+
+//
+// UDP
+//
+// data is only valid during the callback.   The callback may send,
+// including on the socket it was called for
+typedef void (*nk_net_fast_udp_recv_t)(struct nk_net_fast_udp *s,
+				       ipv4_addr_t src_ip,
+				       uint16_t src_port,
+				       void *data,
+				       uint32_t len,
+				       void *state);
+
+// port 0 => pick one
+struct nk_net_fast_udp *nk_net_fast_udp_open(struct nk_net_fast_if *fi,
+					     uint16_t port,
+					     nk_net_fast_udp_recv_t recv,
+					     void *state);
+uint16_t                nk_net_fast_udp_port(struct nk_net_fast_udp *s);
+
+// the data is copied, so the buffer is free on return
+// 0 => sent, positive => the destination is being resolved, try again,
+// negative => error
+int nk_net_fast_udp_sendto(struct nk_net_fast_udp *s,
+			   ipv4_addr_t ip,
+			   uint16_t port,
+			   void *data,
+			   uint32_t len);
+
+// a callback already running on another cpu may still finish
+int nk_net_fast_udp_close(struct nk_net_fast_udp *s);
+
+
+//
+// TCP
+//
+// Callbacks on a connection are serialized and in order, except
+// for sent, which may come from the device's send completion at any
+// time.   They may send on, or close, any connection.
+//
+struct nk_net_fast_tcp_ops {
+    // a listener has a new connection c
+    // return 0 to take it, giving the state for c's callbacks in *state
+    int  (*accept)(struct nk_net_fast_tcp *c, void *listener_state, void **state);
+    // a connect has completed
+    void (*connected)(struct nk_net_fast_tcp *c, void *state);
+    // in-order data, valid only during the callback
+    // len == 0 => the peer is done sending
+    void (*recv)(struct nk_net_fast_tcp *c, void *data, uint32_t len, void *state);
+    // the stack is done with a buffer given to send, which has either
+    // been acknowledged or will never be, because the connection is gone
+    void (*sent)(struct nk_net_fast_tcp *c, void *buf, void *state);
+    // the connection is gone: reset, timed out, or closed on both sides
+    // error == 0 => orderly close
+    void (*closed)(struct nk_net_fast_tcp *c, int error, void *state);
+};
+
+// accept is required
+struct nk_net_fast_tcp *nk_net_fast_tcp_listen(struct nk_net_fast_if *fi,
+					       uint16_t port,
+					       struct nk_net_fast_tcp_ops *ops,
+					       void *state);
+
+// returns once the SYN is out; connected or closed tells how it went
+// must be called from a thread, as it may need to resolve the peer
+struct nk_net_fast_tcp *nk_net_fast_tcp_connect(struct nk_net_fast_if *fi,
+						ipv4_addr_t ip,
+						uint16_t port,
+						struct nk_net_fast_tcp_ops *ops,
+						void *state);
+
+// Queue buf for sending without copying it.  The stack references buf
+// until the sent callback for it, and the device may gather straight
+// from it, so it must be in the identity-mapped kernel address space
+// and must not change until then
+int nk_net_fast_tcp_send(struct nk_net_fast_tcp *c, void *buf, uint32_t len);
+
+// bytes queued but not yet acknowledged
+uint32_t nk_net_fast_tcp_unacked(struct nk_net_fast_tcp *c);
+
+// Let go of c.  Queued data is still delivered, and then the connection
+// is shut down.  No callbacks are made after this, except sent for the
+// buffers still queued, and c must not be used again
+int nk_net_fast_tcp_close(struct nk_net_fast_tcp *c);
+
+
+int  nk_net_fast_init();
+void nk_net_fast_deinit();
+
+#endif
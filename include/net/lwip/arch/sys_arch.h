@@ -3,7 +3,6 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/semaphore.h>
-#include <nautilus/msg_queue.h>
 #include <nautilus/thread.h>
 #include "arch/cc.h"
 
@@ -11,7 +10,8 @@
 typedef struct nk_semaphore sys_sem;
 typedef sys_sem sys_mutex;
 typedef nk_thread_id_t sys_thread_t;
-typedef struct nk_msg_queue sys_mbox;
+// bounded lock-free ring, see sys_arch.c
+typedef struct sys_mbox sys_mbox;
 
 typedef struct{
 	sys_sem* sem;
@@ -22,4 +22,11 @@ typedef struct {
 	sys_mbox* mq;
 } sys_mbox_t;
 
+// per-CPU memp caches (MEMP_PCPU_CACHE) only need to
+// keep interrupts off on the local CPU, not the big lock
+u32_t      sys_arch_cpu(void);
+u32_t      sys_arch_num_cpus(void);
+sys_prot_t sys_arch_local_protect(void);
+void       sys_arch_local_unprotect(sys_prot_t pval);
+
 #endif
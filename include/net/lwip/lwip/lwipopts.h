@@ -10,11 +10,40 @@
 // We want the embedded loopback interface
 #define LWIP_HAVE_LOOPIF 1
 
-// We want it to use NK's malloc
-// not that MEM_USE_POOLS/etc is off, so all allocation goes via NK
-// we're not concerned about speed yet
+// We want it to use NK's malloc for variable sized allocations
+// (PBUF_RAM and friends)
 #define MEM_LIBC_MALLOC 1
 
+// Fixed-size objects (pbufs, segments, pcbs, messages) come from
+// lwIP's static pools, each fronted by per-CPU caches so that the
+// common alloc/free does not take the big lock (see memp.c)
+#define MEMP_MEM_MALLOC      0
+#define MEM_ALIGNMENT        8
+#define MEMP_PCPU_CACHE      1
+#define MEMP_PCPU_CACHE_SIZE 32
+#define MEMP_PCPU_CACHE_CPUS NAUT_CONFIG_MAX_CPUS
+
+// Pool sizes - pools of at least 8 elements per CPU get caches
+#define PBUF_POOL_SIZE           1024
+#define MEMP_NUM_PBUF            512
+#define MEMP_NUM_TCP_SEG         512
+#define MEMP_NUM_TCPIP_MSG_INPKT 512
+#define MEMP_NUM_TCPIP_MSG_API   128
+#define MEMP_NUM_NETBUF          128
+#define MEMP_NUM_TCP_PCB         64
+#define MEMP_NUM_TCP_PCB_LISTEN  16
+#define MEMP_NUM_UDP_PCB         16
+#define MEMP_NUM_NETCONN         64
+
+// Full sized segments and windows that can keep a link busy
+#define TCP_MSS          1460
+#define TCP_WND          (32*TCP_MSS)
+#define TCP_SND_BUF      (32*TCP_MSS)
+#define TCP_SND_QUEUELEN (4*TCP_SND_BUF/TCP_MSS)
+
+// ethernetif hands received frames to lwIP in place
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+
 // ?
 //#define LWIP_DBG_TYPES_ON 1
 
@@ -35,4 +64,7 @@
 #define DEFAULT_UDP_RECVMBOX_SIZE 128
 #define DEFAULT_TCP_RECVMBOX_SIZE 128
 #define DEFAULT_ACCEPTMBOX_SIZE   128
+
+// let interfaces whose devices offload checksums skip them
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
 #endif
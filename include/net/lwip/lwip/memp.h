@@ -99,6 +99,8 @@ extern const struct memp_desc* const memp_pools[MEMP_MAX];
     \
   static struct memp *memp_tab_ ## name; \
     \
+  LWIP_MEMPOOL_DECLARE_CACHE_INSTANCE(memp_cache_ ## name) \
+    \
   const struct memp_desc memp_ ## name = { \
     DECLARE_LWIP_MEMPOOL_DESC(desc) \
     LWIP_MEMPOOL_DECLARE_STATS_REFERENCE(memp_stats_ ## name) \
@@ -106,6 +108,7 @@ extern const struct memp_desc* const memp_pools[MEMP_MAX];
     (num), \
     memp_memory_ ## name ## _base, \
     &memp_tab_ ## name \
+    LWIP_MEMPOOL_DECLARE_CACHE_REFERENCE(memp_cache_ ## name) \
   };
 
 #endif /* MEMP_MEM_MALLOC */
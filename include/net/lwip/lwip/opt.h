@@ -239,6 +239,35 @@
 #define MEMP_MEM_MALLOC                 0
 #endif
 
+/**
+ * MEMP_PCPU_CACHE==1: (Nautilus port) keep a small cache of free elements
+ * per CPU in front of each pool so that memp_malloc()/memp_free() only take
+ * the global SYS_ARCH_PROTECT lock to move batches of elements.  The port
+ * must provide sys_arch_cpu(), sys_arch_num_cpus(), sys_arch_local_protect()
+ * and sys_arch_local_unprotect().  Ignored with MEMP_MEM_MALLOC or
+ * MEMP_OVERFLOW_CHECK.
+ */
+#if !defined MEMP_PCPU_CACHE || defined __DOXYGEN__
+#define MEMP_PCPU_CACHE                 0
+#endif
+
+/**
+ * MEMP_PCPU_CACHE_SIZE: maximum number of free elements a CPU caches per
+ * pool.  A CPU caches fewer if needed so that the caches of all CPUs
+ * together hold at most a quarter of the pool, and pools with fewer than
+ * 8 elements per CPU are not cached at all.
+ */
+#if !defined MEMP_PCPU_CACHE_SIZE || defined __DOXYGEN__
+#define MEMP_PCPU_CACHE_SIZE            16
+#endif
+
+/**
+ * MEMP_PCPU_CACHE_CPUS: number of per-CPU caches each pool carries
+ */
+#if !defined MEMP_PCPU_CACHE_CPUS || defined __DOXYGEN__
+#define MEMP_PCPU_CACHE_CPUS            1
+#endif
+
 /**
  * MEM_ALIGNMENT: should be set to the alignment of the CPU
  *    4 byte alignment -> \#define MEM_ALIGNMENT 4
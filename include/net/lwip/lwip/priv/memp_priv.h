@@ -97,6 +97,16 @@ struct memp {
 };
 #endif /* !MEMP_MEM_MALLOC || MEMP_OVERFLOW_CHECK */
 
+#define MEMP_USE_PCPU_CACHE (MEMP_PCPU_CACHE && !MEMP_MEM_MALLOC && !MEMP_OVERFLOW_CHECK)
+
+#if MEMP_USE_PCPU_CACHE
+/** Free elements of one pool held by one CPU */
+struct memp_cache {
+  u16_t count;
+  struct memp *elems[MEMP_PCPU_CACHE_SIZE];
+};
+#endif /* MEMP_USE_PCPU_CACHE */
+
 #if MEM_USE_POOLS && MEMP_USE_CUSTOM_POOLS
 /* Use a helper type to get the start and end of the user "memory pools" for mem_malloc */
 typedef enum {
@@ -149,6 +159,11 @@ struct memp_desc {
 
   /** First free element of each pool. Elements form a linked list. */
   struct memp **tab;
+
+#if MEMP_USE_PCPU_CACHE
+  /** Per-CPU caches of free elements, MEMP_PCPU_CACHE_CPUS entries */
+  struct memp_cache *cache;
+#endif /* MEMP_USE_PCPU_CACHE */
 #endif /* MEMP_MEM_MALLOC */
 };
 
@@ -166,6 +181,14 @@ struct memp_desc {
 #define LWIP_MEMPOOL_DECLARE_STATS_REFERENCE(name)
 #endif
 
+#if MEMP_USE_PCPU_CACHE
+#define LWIP_MEMPOOL_DECLARE_CACHE_INSTANCE(name) static struct memp_cache name[MEMP_PCPU_CACHE_CPUS];
+#define LWIP_MEMPOOL_DECLARE_CACHE_REFERENCE(name) , name
+#else
+#define LWIP_MEMPOOL_DECLARE_CACHE_INSTANCE(name)
+#define LWIP_MEMPOOL_DECLARE_CACHE_REFERENCE(name)
+#endif
+
 void memp_init_pool(const struct memp_desc *desc);
 
 #if MEMP_OVERFLOW_CHECK
@@ -40,4 +40,54 @@ int nk_test_init(struct naut_info * naut);
         aligned(sizeof(void*)))) \
     = &t;
 
+
+/*
+ * Benchmarks
+ *
+ * A benchmark supplies a function that performs one repetition of
+ * the thing being measured and returns its cost (in whatever unit
+ * it declares, typically cycles or ns).  The harness does the
+ * warmup, the repetitions, the CPU placement, and the statistics,
+ * and emits one machine-readable record per result on the serial
+ * port, like so:
+ *
+ *   BENCH_CSV name,mode,cpu,reps,unit,min,median,p90,p99,max,mean,stddev
+ *   BENCH_JSON {"name":...}
+ *
+ * setup() is invoked once before each run, and its state is shared
+ * by all of the CPUs taking part in the run, so a multi-CPU run of
+ * a lock benchmark contends on the same lock.  setup() and
+ * teardown() are optional.
+ *
+ * run() returns NK_BENCH_FAILED if the repetition could not be done
+ * (e.g., an allocation failed), which fails the whole run rather than
+ * reporting a bogus timing.
+ */
+#define NK_BENCH_FAILED     ((uint64_t)-1)
+
+#define NK_BENCH_PER_CPU    0x1   // may run alone on each selected CPU in turn
+#define NK_BENCH_MULTI_CPU  0x2   // may run on all selected CPUs at once
+#define NK_BENCH_NEEDS_PEER 0x4   // talks to another CPU, so needs at least two
+#define NK_BENCH_ONCE       0x8   // starts its own threads, so runs once, not per CPU
+
+struct nk_bench_impl {
+    char * name;
+    char * unit;
+    int    flags;
+    int    reps;      // default number of measured repetitions
+    int    warmup;    // default number of discarded repetitions
+    int      (*setup)(void ** state);
+    uint64_t (*run)(void * state, int cpu);
+    void     (*teardown)(void * state);
+};
+
+int nk_run_bench(char * name, int reps, int warmup, int cpu, int json);
+
+#define nk_register_bench(b) \
+    static struct nk_bench_impl * _nk_bench_##b \
+    __attribute__((used)) \
+    __attribute__((unused, __section__(".benches"), \
+        aligned(sizeof(void*)))) \
+    = &b;
+
 #endif
@@ -0,0 +1,92 @@
+#!/usr/bin/python
+#
+# Collect benchmark results from a Nautilus serial log
+#
+# The kernel's benchmark harness (src/test/test.c) prints one record per
+# result, as either
+#
+#   BENCH_CSV name,mode,cpu,reps,unit,min,median,p90,p99,max,mean,stddev
+#   BENCH_JSON {"name": ..., ...}
+#
+# This gathers those records from a log (or from the output of a command,
+# e.g. a QEMU run with -serial stdio and "-bench all" on the kernel
+# command line) and writes them out as a single CSV or JSON document,
+# optionally tagged with a label such as a commit id, so that runs can
+# be compared across commits.
+#
+# e.g. scripts/collect_bench.py -l $(git rev-parse --short HEAD) serial.log > results.csv
+#
+
+import sys
+import json
+import argparse
+import subprocess
+
+fields  = ['name', 'mode', 'cpu', 'reps', 'unit',
+           'min', 'median', 'p90', 'p99', 'max', 'mean', 'stddev']
+numeric = ['reps', 'min', 'median', 'p90', 'p99', 'max', 'mean', 'stddev']
+
+
+def parse_line(line):
+    if 'BENCH_CSV ' in line:
+        vals = line.split('BENCH_CSV ', 1)[1].strip().split(',')
+        if len(vals) != len(fields) or vals[0] == 'name':
+            return None
+        rec = dict(zip(fields, vals))
+    elif 'BENCH_JSON ' in line:
+        try:
+            rec = json.loads(line.split('BENCH_JSON ', 1)[1].strip())
+        except ValueError:
+            return None
+    else:
+        return None
+
+    for f in numeric:
+        rec[f] = int(rec[f])
+
+    return rec
+
+
+def collect(stream):
+    recs = []
+    for line in stream:
+        if not isinstance(line, str):
+            line = line.decode('utf-8', 'replace')
+        rec = parse_line(line)
+        if rec:
+            recs.append(rec)
+    return recs
+
+
+parser = argparse.ArgumentParser(description='Collect Nautilus benchmark results.')
+parser.add_argument('log', nargs='?', help='serial log to read (default: stdin)')
+parser.add_argument('-c', '--command', help='run this command and read its output instead of a log')
+parser.add_argument('-f', '--format', choices=['csv', 'json'], default='csv', help='output format')
+parser.add_argument('-l', '--label', default='', help='label (e.g. commit id) to attach to each record')
+
+args = parser.parse_args()
+
+if args.command:
+    proc = subprocess.Popen(args.command, shell=True, stdout=subprocess.PIPE)
+    recs = collect(proc.stdout)
+    proc.wait()
+elif args.log:
+    with open(args.log, 'r') as fd:
+        recs = collect(fd)
+else:
+    recs = collect(sys.stdin)
+
+for r in recs:
+    r['label'] = args.label
+
+if args.format == 'json':
+    json.dump(recs, sys.stdout, indent=1)
+    sys.stdout.write('\n')
+else:
+    sys.stdout.write(','.join(['label'] + fields) + '\n')
+    for r in recs:
+        sys.stdout.write(','.join([r['label']] + [str(r[f]) for f in fields]) + '\n')
+
+if not recs:
+    sys.stderr.write('no benchmark records found\n')
+    sys.exit(1)
@@ -61,6 +61,7 @@
 #include <nautilus/fs.h>
 #include <nautilus/loader.h>
 #include <nautilus/shell.h>
+#include <nautilus/trace.h>
 
 #ifdef NAUT_CONFIG_ENABLE_REMOTE_DEBUGGING 
 #include <nautilus/gdb-stub.h>
@@ -76,6 +77,10 @@
 #include <net/collective/ethernet/ethernet_collective.h>
 #endif
 
+#ifdef NAUT_CONFIG_NET_FAST
+#include <net/fast/fast.h>
+#endif
+
 #include <dev/apic.h>
 #include <dev/pci.h>
 #include <dev/hpet.h>
@@ -396,6 +401,10 @@ init (unsigned long mbd,
 
     nk_rand_init(naut->sys.cpus[0]);
 
+#ifdef NAUT_CONFIG_TRACE
+    nk_trace_init();
+#endif
+
     nk_semaphore_init();
     
     nk_msg_queue_init();
@@ -513,6 +522,10 @@ init (unsigned long mbd,
 #ifdef NAUT_CONFIG_NET_COLLECTIVE_ETHERNET
     nk_net_ethernet_collective_init();
 #endif
+
+#ifdef NAUT_CONFIG_NET_FAST
+    nk_net_fast_init();
+#endif
     
     nk_fs_init();
 
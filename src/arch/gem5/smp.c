@@ -57,10 +57,9 @@ parse_mptable_cpu (struct sys_info * sys, struct mp_table_entry_cpu * cpu)
         panic("CPU count exceeded max (check your .config)\n");
     }
 
-    if(!(new_cpu = mm_boot_alloc(sizeof(struct cpu)))) {
+    if(!(new_cpu = nk_per_cpu_alloc_cpu())) {
         panic("Couldn't allocate CPU struct\n");
     } 
-    memset(new_cpu, 0, sizeof(struct cpu));
 
     new_cpu->id         = sys->num_cpus;
     new_cpu->lapic_id   = cpu->lapic_id;
@@ -328,10 +327,9 @@ acpi_parse_lapic (struct acpi_subtable_header * hdr,
 		panic("CPU count exceeded max (check your .config)\n");
 	}
 
-	if (!(new_cpu = mm_boot_alloc(sizeof(struct cpu)))) {
+	if (!(new_cpu = nk_per_cpu_alloc_cpu())) {
 		panic("Couldn't allocate CPU struct\n");
 	}
-	memset(new_cpu, 0, sizeof(struct cpu));
 
 	new_cpu->id         = sys->num_cpus;
 	new_cpu->lapic_id   = p->id;
@@ -373,11 +371,10 @@ static int acpi_parse_local_x2apic (struct acpi_subtable_header * hdr,
 	panic("CPU count exceeded max (check your .config)\n");
     }
 
-    if (!(new_cpu = mm_boot_alloc(sizeof(struct cpu)))) {
+    if (!(new_cpu = nk_per_cpu_alloc_cpu())) {
 	panic("Couldn't allocate CPU struct\n");
     }
 
-    memset(new_cpu, 0, sizeof(struct cpu));
 
     new_cpu->id         = sys->num_cpus;
     new_cpu->lapic_id   = p->local_apic_id;
@@ -221,13 +221,12 @@ hrt_init_cpus (struct sys_info * sys)
     HRT_PRINT("HRT detected %u CPUs\n", sys->num_cpus);
 
     for (i = 0; i < sys->num_cpus; i++) {
-        struct cpu * new_cpu = mm_boot_alloc(sizeof(struct cpu));
+        struct cpu * new_cpu = nk_per_cpu_alloc_cpu();
 
         if (!new_cpu) {
             ERROR_PRINT("Could not allocate CPU struct\n");
             return -1;
         }
-        memset(new_cpu, 0, sizeof(struct cpu));
 
         if (i == sys->bsp_id) {
             new_cpu->is_bsp = 1;
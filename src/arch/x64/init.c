@@ -62,6 +62,7 @@
 #include <nautilus/loader.h>
 #include <nautilus/linker.h>
 #include <nautilus/shell.h>
+#include <nautilus/trace.h>
 #include <nautilus/pmc.h>
 #include <nautilus/prog.h>
 #include <nautilus/cmdline.h>
@@ -85,6 +86,10 @@
 #include <net/collective/ethernet/ethernet_collective.h>
 #endif
 
+#ifdef NAUT_CONFIG_NET_FAST
+#include <net/fast/fast.h>
+#endif
+
 #include <dev/apic.h>
 #include <dev/pci.h>
 #include <dev/hpet.h>
@@ -389,6 +394,10 @@ init (unsigned long mbd,
 
     nk_rand_init(naut->sys.cpus[0]);
 
+#ifdef NAUT_CONFIG_TRACE
+    nk_trace_init();
+#endif
+
     nk_semaphore_init();
     
     nk_msg_queue_init();
@@ -508,6 +517,10 @@ init (unsigned long mbd,
 #ifdef NAUT_CONFIG_NET_COLLECTIVE_ETHERNET
     nk_net_ethernet_collective_init();
 #endif
+
+#ifdef NAUT_CONFIG_NET_FAST
+    nk_net_fast_init();
+#endif
     
     nk_fs_init();
 
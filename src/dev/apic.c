@@ -30,6 +30,8 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/mm.h>
 #include <nautilus/shell.h>
+#include <nautilus/trace.h>
+#include <nautilus/pmc.h>
 #include <nautilus/timer.h>
 #include <nautilus/dev.h>
 #include <dev/apic.h>
@@ -214,6 +216,10 @@ dummy_int_handler (excp_entry_t * excp, excp_vec_t v, void *state)
 static int
 pc_int_handler (excp_entry_t * excp, excp_vec_t v, void *state)
 {
+#ifdef NAUT_CONFIG_PMC_SAMPLE
+    return nk_pmc_sample_intr(excp);
+#endif
+
     panic("Received a performance counter interrupt from the LAPIC (0x%x) on core %u (Should be masked)\n",
         per_cpu_get(apic)->id,
         my_cpu_id());
@@ -486,6 +492,20 @@ apic_timer_setup (struct apic_dev * apic, uint32_t quantum_ms)
 
     calibrate_apic_timer(apic);
 
+#ifdef NAUT_CONFIG_APIC_TIMER_TSC_DEADLINE
+    if (tscdeadline) {
+	// The LVT write must be globally visible before the first
+	// write to the deadline MSR, otherwise the write may be
+	// treated as one to the previous (oneshot) mode
+	apic_write(apic, APIC_REG_LVTT, APIC_TIMER_TSCDLINE | APIC_DEL_MODE_FIXED | APIC_TIMER_INT_VEC);
+	mbarrier();
+	apic->tsc_deadline = 1;
+	APIC_DEBUG("APIC 0x%x timer using TSC-deadline mode\n", apic->id);
+    } else {
+	APIC_DEBUG("APIC 0x%x timer using oneshot mode (no TSC-deadline support)\n", apic->id);
+    }
+#endif
+
     apic_set_oneshot_timer(apic,apic_realtime_to_ticks(apic,quantum_ms*1000000ULL));
 }
 
@@ -955,8 +975,54 @@ apic_init (struct cpu * core)
 
 
 
+void apic_set_deadline_timer(struct apic_dev *apic, uint64_t tsc)
+{
+    // a zero deadline disarms the timer
+    if (!tsc) {
+	tsc=1;
+    }
+    _apic_msr_write(IA32_TSC_DEADLINE, tsc);
+    apic->timer_set = 1;
+    apic->current_deadline = tsc;
+}
+
+void apic_update_deadline_timer(struct apic_dev *apic, uint64_t tsc,
+				nk_timer_condition_t cond)
+{
+    if (!apic->timer_set) { 
+	apic_set_deadline_timer(apic,tsc);
+    } else {
+	switch (cond) { 
+	case UNCOND:
+	    apic_set_deadline_timer(apic,tsc);
+	    break;
+	case IF_EARLIER:
+	    if (tsc < apic->current_deadline) { apic_set_deadline_timer(apic,tsc);}
+	    break;
+	case IF_LATER:
+	    if (tsc > apic->current_deadline) { apic_set_deadline_timer(apic,tsc);}
+	    break;
+	}
+    }
+    // see apic_update_oneshot_timer
+    apic->in_timer_interrupt=0;
+    apic->in_kick_interrupt=0;
+}
+
+// in TSC-deadline mode, a relative timeout in ticks becomes an
+// absolute deadline
+static inline uint64_t ticks_to_deadline(struct apic_dev *apic, uint32_t ticks)
+{
+    return rdtsc() + (uint64_t)ticks * apic->cycles_per_tick;
+}
+
 void apic_set_oneshot_timer(struct apic_dev *apic, uint32_t ticks) 
 {
+    if (apic->tsc_deadline) {
+	apic_set_deadline_timer(apic,ticks_to_deadline(apic,ticks ? ticks : 1));
+	return;
+    }
+
     apic_write(apic, APIC_REG_LVTT, APIC_TIMER_ONESHOT | APIC_DEL_MODE_FIXED | APIC_TIMER_INT_VEC);
     apic_write(apic, APIC_REG_TMDCR, APIC_TIMER_DIVCODE);
 
@@ -971,6 +1037,11 @@ void apic_set_oneshot_timer(struct apic_dev *apic, uint32_t ticks)
 void apic_update_oneshot_timer(struct apic_dev *apic, uint32_t ticks,
 			       nk_timer_condition_t cond)
 {
+    if (apic->tsc_deadline) {
+	apic_update_deadline_timer(apic,ticks_to_deadline(apic,ticks ? ticks : 1),cond);
+	return;
+    }
+
     if (!apic->timer_set) { 
 	apic_set_oneshot_timer(apic,ticks);
     } else {
@@ -1002,18 +1073,50 @@ uint32_t apic_cycles_to_ticks(struct apic_dev *apic, uint64_t cycles)
 
 uint32_t apic_realtime_to_ticks(struct apic_dev *apic, uint64_t ns)
 {
-    return ((ns*1000ULL)/apic->ps_per_tick);
+    return apic_mul_shift(ns, apic->tick_mult, apic->tick_shift);
 }
 
 
 uint64_t apic_realtime_to_cycles(struct apic_dev *apic, uint64_t ns)
 {
-    return (ns*apic->cycles_per_us)/1000ULL;
+    return apic_ns_to_tsc(apic, ns);
 }
 
 uint64_t apic_cycles_to_realtime(struct apic_dev *apic, uint64_t cycles)
 {
-    return 1000ULL*(cycles/(apic->cycles_per_us));
+    return apic_tsc_to_ns(apic, cycles);
+}
+
+// Find mult and shift such that (x*mult)>>shift ~= (x*to)/from
+// We use the largest shift (up to 32) for which to<<shift does not
+// overflow, which gives ~9 significant digits for the clock rates 
+// we see.   The runtime multiply is 64x64->128, so mult can be large.
+static void calc_mult_shift(uint64_t from, uint64_t to, uint64_t *mult, uint32_t *shift)
+{
+    uint32_t s;
+
+    for (s=32; s>0; s--) {
+	if (!(to >> (64-s))) {
+	    break;
+	}
+    }
+
+    *mult = ((to << s) + from/2) / from;
+    *shift = s;
+}
+
+static void compute_conversions(struct apic_dev *apic)
+{
+    // ns = cycles * 10^9 / tsc_freq_hz
+    calc_mult_shift(apic->tsc_freq_hz, 1000000000ULL, &apic->ns_mult, &apic->ns_shift);
+    // cycles = ns * tsc_freq_hz / 10^9
+    calc_mult_shift(1000000000ULL, apic->tsc_freq_hz, &apic->cyc_mult, &apic->cyc_shift);
+    // ticks = ns * 1000 / ps_per_tick 
+    calc_mult_shift(apic->ps_per_tick, 1000ULL, &apic->tick_mult, &apic->tick_shift);
+
+    APIC_DEBUG("APIC 0x%x conversions: ns=(cyc*%lu)>>%u  cyc=(ns*%lu)>>%u  ticks=(ns*%lu)>>%u\n",
+	       apic->id, apic->ns_mult, apic->ns_shift, apic->cyc_mult, apic->cyc_shift,
+	       apic->tick_mult, apic->tick_shift);
 }
 
 
@@ -1226,9 +1329,11 @@ try_once:
 
 #ifdef NAUT_CONFIG_GEM5_FORCE_APIC_TIMER_CALIBRATION
     apic->cycles_per_us = NAUT_CONFIG_GEM5_APIC_CYCLES_PER_US;
+    apic->tsc_freq_hz = apic->cycles_per_us * 1000000ULL;
 #else
-    // us are used here to also keep precision for cycle->ns and ns->cycles conversions
-    apic->cycles_per_us = ((end - start) * TEST_TIME_SEC_RECIP)/1000000ULL;
+    // the full rate is kept for the fixed-point cycle<->ns conversions
+    apic->tsc_freq_hz = (end - start) * TEST_TIME_SEC_RECIP;
+    apic->cycles_per_us = apic->tsc_freq_hz/1000000ULL;
 #endif
 
     APIC_DEBUG("Detected APIC 0x%x cycles per us as %lu (core at %lu Hz)\n",apic->id,apic->cycles_per_us,apic->cycles_per_us*1000000); 
@@ -1238,6 +1343,8 @@ try_once:
 	return -1;
     }
 
+    compute_conversions(apic);
+
     APIC_DEBUG("Succeeded in calibration with mode %d - spun for %d iterations\n", mode,count);
     
     return 0;
@@ -1256,6 +1363,8 @@ static void calibrate_apic_timer(struct apic_dev *apic)
 	apic->ps_per_tick = bsp_apic->ps_per_tick;
 	apic->cycles_per_us = bsp_apic->cycles_per_us;
 	apic->cycles_per_tick = bsp_apic->cycles_per_tick;
+	apic->tsc_freq_hz = bsp_apic->tsc_freq_hz;
+	compute_conversions(apic);
 	
 	APIC_DEBUG("AP APIC id=0x%x cloned BSP APIC's timer configuration\n",
 		   apic->id);
@@ -1360,6 +1469,8 @@ static int apic_timer_handler(excp_entry_t * excp, excp_vec_t vec, void *state)
     // note that currently all cores see the events
     time_to_next_ns = nk_timer_handler();
 
+    NK_TRACE(TIMER, apic->timer_count, time_to_next_ns, 0);
+
     // note that the low-level interrupt handler code in excp_early.S
     // takes care of invoking the scheduler if needed, and the scheduler
     // will in turn change the time after we leave - it may set the
@@ -33,6 +33,10 @@
 #include <dev/e1000_pci.h>
 #include <nautilus/irq.h>             // interrupt register
 #include <nautilus/naut_string.h>     // memset, memcpy
+#include <nautilus/spinlock.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/thread.h>
+#include <nautilus/shell.h>
 
 
 
@@ -85,14 +89,15 @@
 
 
 // Constants
-// These are configurable, and they will change the number of descriptors
-// and the packet buffer pointed by the descriptors.
-// The number of descriptors is always a multiple of eight.
+// The ring sizes come from the configuration.  The number of descriptors
+// is always a multiple of eight, since TDLEN and RDLEN must be multiples
+// of 128 bytes, so the configured sizes are rounded up.
 
-#define TX_DSC_COUNT          128
+#define TX_DSC_COUNT          ((NAUT_CONFIG_E1000_PCI_TX_RING_SIZE + 7) & ~7)
 #define TX_BLOCKSIZE          256 // bytes available per DMA block
-#define RX_DSC_COUNT          128 // equal to DMA block count
+#define RX_DSC_COUNT          ((NAUT_CONFIG_E1000_PCI_RX_RING_SIZE + 7) & ~7)
 #define RX_BLOCKSIZE          256 // bytes available per DMA block
+#define DONE_BATCH            32  // completions reaped per lock hold
 
 // After this line, PLEASE DO NOT CHANGE ANYTHING.
 // transmission unit
@@ -129,6 +134,7 @@
 #define RDT_OFFSET            0x2818   // receive descriptor tail
 #define RCTL_OFFSET           0x0100   // receive control
 #define E1000_RDTR_OFFSET     0x2820   // receive delay timer
+#define E1000_RADV_OFFSET     0x282C   // receive interrupt absolute delay timer
 #define E1000_RSRPD_OFFSET    0x02C00  // receive small packet detect interrupt r/w
 
 #define E1000_TPT_OFFSET      0x40D4   // total package transmit
@@ -142,6 +148,8 @@
 #define E1000_IMS_OFFSET      0x000D0  /* interrupt mask set/read register */
 #define E1000_IMC_OFFSET      0x000D8  /* interrupt mask clear */
 #define E1000_TIDV_OFFSET     0x03820  /* transmit interrupt delay value r/w */
+#define E1000_TADV_OFFSET     0x0382C  /* transmit absolute interrupt delay value */
+#define E1000_ITR_OFFSET      0x000C4  /* interrupt throttling rate r/w */
 
 // REGISTER BIT MASKS **********************************
 // E1000 Transmit Control Register
@@ -209,6 +217,9 @@
 #define E1000_ICR_RXO               (1 << 6)   // receive overrun 
 #define E1000_ICR_LSC               (1 << 2)   // link state change 
 
+#define E1000_ITR_INTERVAL_MASK     0xffff     // in units of 256 ns
+#define E1000_ITR_UNIT_NS           256
+
 
 struct e1000_desc_ring {
   void *ring_buffer;
@@ -303,6 +314,41 @@ struct e1000_state {
   // a circular queue mapping between callback funtion and rx descriptor
   struct e1000_map_ring *rx_map;
   uint64_t rx_buffer_size;
+  // interrupts we enable
+  uint32_t ims_reg;
+
+  // protects the descriptor rings and the callback maps
+  spinlock_t lock;
+  // tx descriptors filled in but not yet given to the device
+  uint32_t tx_pending;
+  // tx descriptors given to the device and not yet reaped
+  uint32_t tx_inflight;
+  // most tx descriptors held back while others are in flight
+  uint32_t tx_batch;
+  // rx descriptors filled in but not yet given to the device
+  uint32_t rx_pending;
+  // nonzero while completions run; receive tail writes wait for them
+  uint32_t rx_deferring;
+
+  // interrupt throttling, interrupts per second (0 = unthrottled)
+  uint32_t itr;
+
+  // NAPI-style polling: the interrupt handler masks the device and
+  // wakes the poller, which unmasks it once it catches up
+  int poll;
+  uint32_t poll_budget;
+  volatile int poll_pending;
+  nk_wait_queue_t *poll_wq;
+  int poll_started;
+
+  struct {
+    uint64_t intrs;
+    uint64_t polls;
+    uint64_t tx;
+    uint64_t rx;
+    uint64_t tx_tail_writes;
+    uint64_t rx_tail_writes;
+  } stats;
 };
 
 static struct list_head dev_list;
@@ -442,13 +488,38 @@ static int e1000_init_receive_ring(struct e1000_state *state)
   return 0;
 }
 
+// give the filled in tx descriptors to the device
+// the caller holds the lock
+static void e1000_flush_tx(struct e1000_state *state)
+{
+  if (state->tx_pending) {
+    // descriptors must be visible before the tail moves
+    mbarrier();
+    WRITE_MEM(state, TDT_OFFSET, TXD_TAIL);
+    state->tx_inflight += state->tx_pending;
+    state->tx_pending = 0;
+    state->stats.tx_tail_writes++;
+  }
+}
+
+// give the filled in rx descriptors to the device
+// the caller holds the lock
+static void e1000_flush_rx(struct e1000_state *state)
+{
+  if (state->rx_pending) {
+    mbarrier();
+    WRITE_MEM(state, RDT_OFFSET, RXD_TAIL);
+    state->rx_pending = 0;
+    state->stats.rx_tail_writes++;
+  }
+}
+
 static int e1000_send_packet(uint8_t* packet_addr,
                              uint64_t packet_size,
                              struct e1000_state *state) 
 {
   DEBUG("e1000_send_packet fn\n");
   DEBUG("packet_addr 0x%p packet_size: %d\n", packet_addr, packet_size);
-  TXD_TAIL = READ_MEM(state, TDT_OFFSET);
   DEBUG("status before sending a packet: TDH = %d TDT = %d tail_pos = %d\n",
         READ_MEM(state, TDH_OFFSET),
         READ_MEM(state, TDT_OFFSET),
@@ -478,9 +549,16 @@ static int e1000_send_packet(uint8_t* packet_addr,
   TXD_CMD(TXD_TAIL).rs = 1;
   
   // increment transmit descriptor list tail by 1
-  DEBUG("moving the tail\n");
   TXD_TAIL = TXD_INC(1, TXD_TAIL);
-  WRITE_MEM(state, TDT_OFFSET, TXD_TAIL);
+  state->tx_pending++;
+
+  // An idle device gets the descriptor at once.  A busy one will raise a
+  // completion soon, so we hold descriptors back until then or until
+  // tx_batch of them have built up, saving tail register writes.
+  if (!state->tx_inflight || state->tx_pending >= state->tx_batch) {
+    DEBUG("moving the tail\n");
+    e1000_flush_tx(state);
+  }
   DEBUG("status after moving tail: TDH = %d TDT = %d tail_pos = %d\n",
         READ_MEM(state, TDH_OFFSET),
         READ_MEM(state, TDT_OFFSET),
@@ -534,14 +612,18 @@ static int e1000_receive_packet(uint8_t* buffer,
     state->rx_buffer_size = buffer_size;
   }
         
-  RXD_PREV_HEAD = READ_MEM(state, RDH_OFFSET);
-  RXD_TAIL = READ_MEM(state, RDT_OFFSET);
   // e1000_init_single_rxd(RXD_TAIL, state);
   memset(((struct e1000_rx_desc *)RXD_RING_BUFFER + RXD_TAIL),
          0, sizeof(struct e1000_rx_desc));
   RXD_ADDR(RXD_TAIL) = (uint64_t*) buffer;
-  WRITE_MEM(state, RDT_OFFSET, RXD_INC(RXD_TAIL, 1));
   RXD_TAIL = RXD_INC(RXD_TAIL, 1);
+  state->rx_pending++;
+
+  // buffers posted from completion callbacks go out together
+  // once the callbacks are done
+  if (!state->rx_deferring) {
+    e1000_flush_rx(state);
+  }
   DEBUG("after moving tail head: %d, prev_head: %d tail: %d\n",
         READ_MEM(state, RDH_OFFSET), RXD_PREV_HEAD,
         READ_MEM(state, RDT_OFFSET));
@@ -636,25 +718,33 @@ static int e1000_map_callback(struct e1000_map_ring* map,
   return 0;
 }
 
-static int e1000_post_send(void *state,
+static int e1000_post_send(void *vstate,
 			   uint8_t *src,
 			   uint64_t len,
 			   void (*callback)(nk_net_dev_status_t, void *),
 			   void *context) 
 {
   // always map callback
+  struct e1000_state *state = (struct e1000_state*) vstate;
   int result = 0;
   DEBUG("post send fn callback 0x%p\n", callback);
-  result = e1000_map_callback(((struct e1000_state*)state)->tx_map, callback, context);
+  uint8_t flags = spin_lock_irq_save(&state->lock);
+  result = e1000_map_callback(state->tx_map, callback, context);
 
   if (!result) {
-    result = e1000_send_packet(src, len, (struct e1000_state*) state);
+    result = e1000_send_packet(src, len, state);
+    if (result) {
+      // completions are matched to descriptors in order, so the
+      // mapping must not outlive a failed send
+      TXMAP->tail_pos = (TXMAP->tail_pos + TXMAP->ring_len - 1) % TXMAP->ring_len;
+    }
   }
+  spin_unlock_irq_restore(&state->lock, flags);
   DEBUG("post send fn end\n");
   return result;
 }
 
-static int e1000_post_receive(void *state,
+static int e1000_post_receive(void *vstate,
 			      uint8_t *src,
 			      uint64_t len,
 			      void (*callback)(nk_net_dev_status_t, void *),
@@ -662,72 +752,233 @@ static int e1000_post_receive(void *state,
 {
   // mapping the callback always
   // if result != -1 receive packet
+  struct e1000_state *state = (struct e1000_state*) vstate;
   int result = 0;
-  result  = e1000_map_callback(((struct e1000_state*)state)->rx_map, callback, context);
+  uint8_t flags = spin_lock_irq_save(&state->lock);
+  result  = e1000_map_callback(state->rx_map, callback, context);
 
   if(!result) {
-    result = e1000_receive_packet(src, len, (struct e1000_state*) state);
+    result = e1000_receive_packet(src, len, state);
+    if (result) {
+      RXMAP->tail_pos = (RXMAP->tail_pos + RXMAP->ring_len - 1) % RXMAP->ring_len;
+    }
   }
+  spin_unlock_irq_restore(&state->lock, flags);
   return result;
 }
 
-static int e1000_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s) 
-{
-  DEBUG("e1000_irq_handler fn vector: 0x%x rip: 0x%p\n", vec, excp->rip);
+// a reaped descriptor whose callback is run after the lock is dropped
+struct e1000_done {
+  void (*callback)(nk_net_dev_status_t, void *);
+  void *context;
+  nk_net_dev_status_t status;
+};
 
-  struct e1000_state* state = (struct e1000_state *)s;
+#define TXD_DONE(i) (*(volatile uint8_t *)&TXD_STATUS(i) & 0x1)
+#define RXD_DONE(i) (*(volatile uint8_t *)&RXD_STATUS(i) & 0x1)
 
-  uint32_t icr = READ_MEM(state, E1000_ICR_OFFSET);
-  uint32_t ims = READ_MEM(state, E1000_IMS_OFFSET);
-  uint32_t mask_int = icr & ims;
-  DEBUG("ICR: 0x%08x IMS: 0x%08x mask_int: 0x%08x\n", icr, ims, mask_int);
-  DEBUG("ICR: 0x%08x icr should be zero.\n",
-        READ_MEM(state, E1000_ICR_OFFSET));
-  
-  void (*callback)(nk_net_dev_status_t, void*) = NULL;
-  void *context = NULL;
-  nk_net_dev_status_t status = NK_NET_DEV_STATUS_SUCCESS;
-  
-  if(mask_int & E1000_ICR_TXDW) {
-    // transmit interrupt
-    DEBUG("handle the txdw interrupt\n");
-    e1000_unmap_callback(state->tx_map, (uint64_t **)&callback, (void **)&context);
+// reap up to max transmit descriptors the device has written back
+// the caller holds the lock
+static int e1000_reap_tx(struct e1000_state *state, struct e1000_done *done, int max)
+{
+  int n = 0;
+
+  while (n < max && TXD_PREV_HEAD != TXD_TAIL && TXD_DONE(TXD_PREV_HEAD)) {
+    e1000_unmap_callback(state->tx_map, (uint64_t **)&done[n].callback, &done[n].context);
     // if there is an error while sending a packet, set the error status
     if(TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
       ERROR("transmit errors\n");
-      status = NK_NET_DEV_STATUS_ERROR;
+      done[n].status = NK_NET_DEV_STATUS_ERROR;
+    } else {
+      done[n].status = NK_NET_DEV_STATUS_SUCCESS;
     }
-
-    // update the head of the ring buffer
     TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
-    DEBUG("total packet transmitted = %d\n",
-          READ_MEM(state, E1000_TPT_OFFSET));    
+    n++;
   }
+  state->tx_inflight -= n;
+  state->stats.tx += n;
+  return n;
+}
+
+// reap up to max receive descriptors the device has written back
+// the caller holds the lock
+static int e1000_reap_rx(struct e1000_state *state, struct e1000_done *done, int max)
+{
+  int n = 0;
 
-  if(mask_int & E1000_ICR_RXT0) {
-    // receive interrupt
-    DEBUG("handle the rxt0 interrupt\n");
-    e1000_unmap_callback(state->rx_map, (uint64_t **)&callback, (void **)&context);
+  while (n < max && RXD_PREV_HEAD != RXD_TAIL && RXD_DONE(RXD_PREV_HEAD)) {
+    e1000_unmap_callback(state->rx_map, (uint64_t **)&done[n].callback, &done[n].context);
     // checking errors
     if(RXD_ERRORS(RXD_PREV_HEAD)) {
       ERROR("receive an error packet\n");
-      status = NK_NET_DEV_STATUS_ERROR;
+      done[n].status = NK_NET_DEV_STATUS_ERROR;
+    } else {
+      done[n].status = NK_NET_DEV_STATUS_SUCCESS;
+    }
+    RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);
+    n++;
+  }
+  state->stats.rx += n;
+  return n;
+}
+
+static void e1000_complete(struct e1000_done *done, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (done[i].callback) {
+      DEBUG("invoke callback function callback: 0x%p\n", done[i].callback);
+      done[i].callback(done[i].status, done[i].context);
+    }
+  }
+}
+
+// Complete every finished transmit and up to budget receives, returning
+// the number of receives.  Callbacks run without the lock held so they
+// can post new buffers; the receive buffers they post reach the device
+// with a single tail write per batch.
+static int e1000_clean_rings(struct e1000_state *state, uint32_t budget)
+{
+  struct e1000_done done[DONE_BATCH];
+  uint32_t work = 0;
+  int n, max;
+  uint8_t flags;
+
+  do {
+    flags = spin_lock_irq_save(&state->lock);
+    n = e1000_reap_tx(state, done, DONE_BATCH);
+    // anything held back is now due
+    e1000_flush_tx(state);
+    spin_unlock_irq_restore(&state->lock, flags);
+    e1000_complete(done, n);
+  } while (n == DONE_BATCH);
+
+  do {
+    max = budget - work < DONE_BATCH ? budget - work : DONE_BATCH;
+    flags = spin_lock_irq_save(&state->lock);
+    n = e1000_reap_rx(state, done, max);
+    if (!n) {
+      spin_unlock_irq_restore(&state->lock, flags);
+      break;
+    }
+    state->rx_deferring++;
+    spin_unlock_irq_restore(&state->lock, flags);
+
+    e1000_complete(done, n);
+
+    flags = spin_lock_irq_save(&state->lock);
+    if (!--state->rx_deferring) {
+      e1000_flush_rx(state);
+    }
+    spin_unlock_irq_restore(&state->lock, flags);
+    work += n;
+  } while (n == max && work < budget);
+
+  return work;
+}
+
+static int e1000_poll_cond(void *s)
+{
+  return ((struct e1000_state *)s)->poll_pending;
+}
+
+// The poller drains the rings while the device's interrupts are masked.
+// A pass that uses up the whole budget means more work is likely queued,
+// so we yield and go again; otherwise we have caught up and unmask.  A
+// packet that lands in between latches its cause in ICR and interrupts
+// as soon as IMS is written, so nothing is lost.
+static void e1000_poll_thread(void *in, void **out)
+{
+  struct e1000_state *state = (struct e1000_state *)in;
+  char name[MAX_THREAD_NAME];
+  uint32_t work;
+
+  snprintf(name, MAX_THREAD_NAME, "%s-poll", state->name);
+  nk_thread_name(get_cur_thread(), name);
+
+  while (1) {
+    nk_wait_queue_sleep_extended(state->poll_wq, e1000_poll_cond, state);
+    state->poll_pending = 0;
+    state->stats.polls++;
+
+    work = e1000_clean_rings(state, state->poll_budget);
+
+    if (state->poll && work >= state->poll_budget) {
+      state->poll_pending = 1;
+      nk_yield();
+      continue;
+    }
+
+    WRITE_MEM(state, E1000_IMS_OFFSET, state->ims_reg);
+  }
+}
+
+static int e1000_start_poller(struct e1000_state *state)
+{
+  if (state->poll_started) {
+    return 0;
+  }
+
+  state->poll_wq = nk_wait_queue_create(0);
+  if (!state->poll_wq) {
+    ERROR("Cannot allocate poll wait queue for %s\n", state->name);
+    return -1;
+  }
+
+  // the legacy interrupt may land anywhere, so the poller is not bound
+  if (nk_thread_start(e1000_poll_thread, state, 0, 1, TSTACK_1MB, 0, CPU_ANY)) {
+    ERROR("Cannot start poll thread for %s\n", state->name);
+    nk_wait_queue_destroy(state->poll_wq);
+    state->poll_wq = 0;
+    return -1;
+  }
+
+  state->poll_started = 1;
+  return 0;
+}
+
+// program the interrupt throttling rate, in interrupts per second
+static void e1000_set_itr(struct e1000_state *state, uint32_t rate)
+{
+  uint32_t interval = 0;
+
+  if (rate) {
+    interval = 1000000000UL / ((uint64_t)rate * E1000_ITR_UNIT_NS);
+    if (!interval) {
+      interval = 1;
+    }
+    if (interval > E1000_ITR_INTERVAL_MASK) {
+      interval = E1000_ITR_INTERVAL_MASK;
     }
-    DEBUG("RDLEN=0x%08x, RDH=0x%08x, RDT=0x%08x, RCTL=0x%08x\n",
-		    READ_MEM(state, RDLEN_OFFSET),
-		    READ_MEM(state, RDH_OFFSET),
-		    READ_MEM(state, RDT_OFFSET),
-		    READ_MEM(state, RCTL_OFFSET));
-    
-    // in the irq, update only the head of the buffer
-    RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);    
-    DEBUG("total packet received = %d\n",
-          READ_MEM(state, E1000_TPR_OFFSET));
   }
 
-  if(callback) {
-    DEBUG("invoke callback function callback: 0x%p\n", callback);
-    callback(status, context);
+  WRITE_MEM(state, E1000_ITR_OFFSET, interval);
+  state->itr = rate;
+  DEBUG("%u interrupts/s, ITR = 0x%08x\n", rate, READ_MEM(state, E1000_ITR_OFFSET));
+}
+
+static int e1000_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s) 
+{
+  DEBUG("e1000_irq_handler fn vector: 0x%x rip: 0x%p\n", vec, excp->rip);
+
+  struct e1000_state* state = (struct e1000_state *)s;
+
+  uint32_t icr = READ_MEM(state, E1000_ICR_OFFSET);
+  uint32_t mask_int = icr & state->ims_reg;
+  DEBUG("ICR: 0x%08x IMS: 0x%08x mask_int: 0x%08x\n", icr, state->ims_reg, mask_int);
+
+  state->stats.intrs++;
+
+  if (mask_int) {
+    if (state->poll) {
+      // keep the device quiet until the poller catches up
+      WRITE_MEM(state, E1000_IMC_OFFSET, state->ims_reg);
+      state->poll_pending = 1;
+      nk_wait_queue_wake_one(state->poll_wq);
+    } else {
+      e1000_clean_rings(state, RXD_COUNT);
+    }
   }
 
   DEBUG("end irq\n\n\n");
@@ -789,6 +1040,12 @@ int e1000_pci_init(struct naut_info * naut)
         }
 
         memset(state,0,sizeof(*state));
+        spinlock_init(&state->lock);
+        state->tx_batch = NAUT_CONFIG_E1000_PCI_TX_BATCH;
+        state->poll_budget = NAUT_CONFIG_E1000_PCI_POLL_BUDGET;
+#ifdef NAUT_CONFIG_E1000_PCI_POLL
+        state->poll = 1;
+#endif
         state->pci_dev = pdev;
 
         // PCI Interrupt (A..D)
@@ -882,7 +1139,7 @@ int e1000_pci_init(struct naut_info * naut)
         DEBUG("e1000 mac_high = 0x%x mac_low = 0x%x\n", mac_high, mac_low);
         memcpy(state->mac_addr, &mac_all, ETHER_MAC_LEN);
 
-        list_add(&dev_list, &state->e1000_node);
+        list_add(&state->e1000_node, &dev_list);
         sprintf(state->name, "e1000-%d", num);
         num++;
 
@@ -893,17 +1150,37 @@ int e1000_pci_init(struct naut_info * naut)
           return -1;
         }
 
+	// the rings must be in place before the handler can run
+	if (e1000_init_transmit_ring(state)) { 
+	    ERROR("Failed to init transmit descriptor ring\n");
+	    return -1;
+	} 
+	if (e1000_init_receive_ring(state)) {
+	    ERROR("Failed to init receive descriptor ring\n");
+	    return -1;
+	}
+
+	if (state->poll && e1000_start_poller(state)) {
+	    ERROR("Falling back to interrupt per completion for %s\n", state->name);
+	    state->poll = 0;
+	}
+
 	// register the interrupt handler
 	register_irq_handler(state->intr_vec, e1000_irq_handler, state);
 	nk_unmask_irq(state->intr_vec);
 
 	// interrupt delay value = 0 -> does not delay
 	WRITE_MEM(state, E1000_TIDV_OFFSET, 0);
+	WRITE_MEM(state, E1000_TADV_OFFSET, 0);
 	// receive interrupt delay timer = 0
 	// -> interrupt when the device receives a package
 	WRITE_MEM(state, E1000_RDTR_OFFSET, 0);
+	WRITE_MEM(state, E1000_RADV_OFFSET, 0);
+	// bound the interrupt rate instead
+	e1000_set_itr(state, NAUT_CONFIG_E1000_PCI_ITR);
 	// enable only transmit descriptor written back and receive interrupt timer
-	WRITE_MEM(state, E1000_IMS_OFFSET, E1000_ICR_TXDW | E1000_ICR_RXT0);
+	state->ims_reg = E1000_ICR_TXDW | E1000_ICR_RXT0;
+	WRITE_MEM(state, E1000_IMS_OFFSET, state->ims_reg);
 	// after the interrupt is turned on, the interrupt handler is called
 	// due to the transmit descriptor queue empty.
 	
@@ -912,14 +1189,6 @@ int e1000_pci_init(struct naut_info * naut)
 	      READ_MEM(state, E1000_IMS_OFFSET), icr);
 	DEBUG("TXQE 0x%08x TXD_LOW 0x%08x TXDW 0x%08x\n",
 	      icr, E1000_ICR_TXQE & icr, E1000_ICR_TXD_LOW & icr, E1000_ICR_TXDW & icr);
-	if (e1000_init_transmit_ring(state)) { 
-	    ERROR("Failed to init transmit descriptor ring\n");
-	    return -1;
-	} 
-	if (e1000_init_receive_ring(state)) {
-	    ERROR("Failed to init receive descriptor ring\n");
-	    return -1;
-	}
       }
     }
   }
@@ -932,3 +1201,105 @@ int e1000_pci_deinit()
   INFO("deinited\n");
   return 0;
 }
+
+static struct e1000_state *e1000_find(char *name)
+{
+  struct list_head *cur;
+
+  list_for_each(cur, &dev_list) {
+    struct e1000_state *state = list_entry(cur, struct e1000_state, e1000_node);
+    if (!strcmp(state->name, name)) {
+      return state;
+    }
+  }
+  return 0;
+}
+
+static void e1000_show(struct e1000_state *state)
+{
+  nk_vc_printf("%s: %s, itr %u/s, tx batch %u, %lu interrupts, %lu polls\n",
+               state->name,
+               state->poll ? "polling" : "interrupt per completion",
+               state->itr, state->tx_batch,
+               state->stats.intrs, state->stats.polls);
+  nk_vc_printf("  poll budget %u, rings tx %u rx %u\n",
+               state->poll_budget, TXD_COUNT, RXD_COUNT);
+  nk_vc_printf("  tx %lu packets in %lu tail writes, rx %lu packets in %lu tail writes\n",
+               state->stats.tx, state->stats.tx_tail_writes,
+               state->stats.rx, state->stats.rx_tail_writes);
+}
+
+static int handle_e1000(char * buf, void * priv)
+{
+  char name[DEV_NAME_LEN];
+  char mode[8];
+  struct e1000_state *state;
+  struct list_head *cur;
+  uint32_t val;
+
+  if (sscanf(buf, "e1000 itr %s %u", name, &val) == 2) {
+    if (!(state = e1000_find(name))) {
+      nk_vc_printf("no device %s\n", name);
+      return 0;
+    }
+    e1000_set_itr(state, val);
+    e1000_show(state);
+    return 0;
+  }
+
+  if (sscanf(buf, "e1000 batch %s %u", name, &val) == 2) {
+    if (!(state = e1000_find(name))) {
+      nk_vc_printf("no device %s\n", name);
+      return 0;
+    }
+    state->tx_batch = val ? val : 1;
+    e1000_show(state);
+    return 0;
+  }
+
+  if (sscanf(buf, "e1000 poll %s %7s %u", name, mode, &val) >= 2) {
+    if (!(state = e1000_find(name))) {
+      nk_vc_printf("no device %s\n", name);
+      return 0;
+    }
+    if (sscanf(buf, "e1000 poll %s %7s %u", name, mode, &val) == 3) {
+      state->poll_budget = val ? val : 1;
+    }
+    if (!strcmp(mode, "on")) {
+      if (!e1000_start_poller(state)) {
+        state->poll = 1;
+      }
+    } else if (!strcmp(mode, "off")) {
+      state->poll = 0;
+      // pick up anything that arrived while the poller had us masked
+      WRITE_MEM(state, E1000_IMS_OFFSET, state->ims_reg);
+    } else {
+      nk_vc_printf("poll mode is on or off\n");
+      return 0;
+    }
+    e1000_show(state);
+    return 0;
+  }
+
+  if (sscanf(buf, "e1000 %s", name) == 1) {
+    if (!(state = e1000_find(name))) {
+      nk_vc_printf("no device %s\n", name);
+      return 0;
+    }
+    e1000_show(state);
+    return 0;
+  }
+
+  list_for_each(cur, &dev_list) {
+    e1000_show(list_entry(cur, struct e1000_state, e1000_node));
+  }
+  return 0;
+}
+
+static struct shell_cmd_impl e1000_impl = {
+  .cmd      = "e1000",
+  .help_str = "e1000 [dev] | e1000 itr dev ints/s | e1000 batch dev n\n"
+              "  e1000 poll dev on|off [budget]",
+  .handler  = handle_e1000,
+};
+nk_register_shell_cmd(e1000_impl);
@@ -36,6 +36,10 @@
 #include <nautilus/dev.h>             // NK_DEV_REQ_*
 #include <nautilus/timer.h>           // nk_sleep(ns);
 #include <nautilus/cpu.h>             // udelay
+#include <nautilus/spinlock.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/thread.h>
+#include <nautilus/shell.h>
 
 #ifndef NAUT_CONFIG_DEBUG_E1000E_PCI
 #undef DEBUG_PRINT
@@ -52,7 +56,7 @@
 #define READ_MEM64(d, o)       (*((volatile uint64_t*)((d)->mem_start + (o))))
 #define WRITE_MEM64(d, o, v)     ((*((volatile uint64_t*)(((d)->mem_start)+(o))))=(v))
 
-#define RXD_RING (state->rxd_ring) // e1000e_ring *
+#define RXD_RING (q->rxd_ring) // e1000e_ring *
 #define RXD_PREV_HEAD (RXD_RING->head_prev)
 #define RXD_TAIL (RXD_RING->tail_pos)
 #define RX_PACKET_BUFFER (RXD_RING->packet_buffer) // void *, packet buff addr
@@ -66,7 +70,7 @@
 #define RXD_COUNT (RXD_RING->count)
 #define RXD_INC(a,b) (((a) + (b)) % RXD_RING->count) // modular increment rxd index
 
-#define TXD_RING (state->tx_ring) // e1000e_ring *
+#define TXD_RING (q->tx_ring) // e1000e_ring *
 #define TXD_PREV_HEAD (TXD_RING->head_prev)
 #define TXD_TAIL (TXD_RING->tail_pos)
 #define TX_PACKET_BUFFER (TXD_RING->packet_buffer) // void *, packet buff addr
@@ -80,24 +84,29 @@
 #define TXD_INC(a,b) (((a) + (b)) % TXD_RING->count) // modular increment txd index
 
 // a is old index, b is incr amount, c is queue size
-#define TXMAP (state->tx_map)
-#define RXMAP (state->rx_map)
+#define TXMAP (q->tx_map)
+#define RXMAP (q->rx_map)
+// receive buffers mapped on queue q and not yet completed
+#define RXMAP_POSTED(q) (((q)->rx_map->tail_pos + (q)->rx_map->ring_len - \
+                          (q)->rx_map->head_pos) % (q)->rx_map->ring_len)
 
 
 
     
 
 // Constant variables
-// These variables are configurable, and they will change the number of descriptors.
-// The number of descriptors is always a multiple of eight.
-// both tx_dsc_count and rx_dsc_count should be multiple of 16.
+// The ring sizes come from the configuration.  The number of descriptors
+// is always a multiple of eight, since TDLEN and RDLEN must be multiples
+// of 128 bytes, so the configured sizes are rounded up.
 
-#define TX_DSC_COUNT          128     
+#define TX_DSC_COUNT          ((NAUT_CONFIG_E1000E_PCI_TX_RING_SIZE + 7) & ~7)
 #define TX_BLOCKSIZE          256      // bytes available per DMA block
-#define RX_DSC_COUNT          128      // equal to DMA block count
+#define RX_DSC_COUNT          ((NAUT_CONFIG_E1000E_PCI_RX_RING_SIZE + 7) & ~7)
 #define RX_BLOCKSIZE          256      // bytes available per DMA block
 #define RESTART_DELAY         5        // usec = 5 us 
 #define RX_PACKET_BUFFER_SIZE 2048     // the size of the packet buffer
+#define DONE_BATCH            32       // completions reaped per lock hold
+#define E1000E_MAX_QUEUES     2        // rx/tx queue pairs on the 82574
 
 // After this line, PLEASE DO NOT CHANGE ANYTHING.
 
@@ -129,6 +138,7 @@
 // REGISTER OFFSETS ************************************
 #define E1000E_CTRL_OFFSET    0x00000
 #define E1000E_STATUS_OFFSET  0x00008
+#define E1000E_CTRL_EXT_OFFSET 0x00018
 #define E1000E_GCR_OFFSET     0x05B00
 // flow control address
 #define E1000E_FCAL_OFFSET    0x00028
@@ -144,6 +154,7 @@
 #define E1000E_TCTL_OFFSET    0x0400   // transmit control check check
 #define E1000E_TIPG_OFFSET    0x0410   // transmit interpacket gap check
 #define E1000E_TXDCTL_OFFSET  0x03828  // transmit descriptor control r/w check
+#define E1000E_TARC_OFFSET    0x03840  // transmit arbitration count
 
 // receive
 #define E1000E_RAL_OFFSET     0x5400   // receive address low check
@@ -159,6 +170,13 @@
 #define E1000E_RSRPD_OFFSET   0x02C00  // rx small packet detect interrupt r/w
 #define E1000E_RXDCTL_OFFSET  0x2828   // receive descriptor control
 #define E1000E_RADV_OFFSET    0x282C   // receive interrupt absolute delay timer
+#define E1000E_RXCSUM_OFFSET  0x5000   // receive checksum control
+#define E1000E_MRQC_OFFSET    0x5818   // multiple receive queues command
+#define E1000E_RETA_OFFSET    0x5C00   // redirection table, 32 registers
+#define E1000E_RSSRK_OFFSET   0x5C80   // rss random key, 10 registers
+
+// the descriptor ring registers of queue n are 0x100 past those of queue n-1
+#define E1000E_QUEUE_OFFSET(o, n) ((o) + 0x100 * (n))
 
 // statistics error
 #define E1000E_CRCERRS_OFFSET 0x04000  // crc error count
@@ -187,6 +205,10 @@
 #define E1000E_IMS_OFFSET     0x000D0  /* interrupt mask set/read register */
 #define E1000E_IMC_OFFSET     0x000D8  /* interrupt mask clear */
 #define E1000E_TIDV_OFFSET    0x03820  /* transmit interrupt delay value r/w */
+#define E1000E_ITR_OFFSET     0x000C4  /* interrupt throttling rate r/w */
+#define E1000E_EIAC_OFFSET    0x000DC  /* msi-x interrupt auto clear */
+#define E1000E_IVAR_OFFSET    0x000E4  /* interrupt vector allocation */
+#define E1000E_EITR_OFFSET(n) (0x000E8 + 4 * (n)) /* msi-x vector throttling */
 
 #define E1000E_AIT_OFFSET     0x00458  /* Adaptive IFS Throttle r/w */
 #define E1000E_TADV_OFFSET    0x0382C  /* transmit absolute interrupt delay value */ 
@@ -323,9 +345,39 @@
 #define E1000E_ICR_OTHER             (1 << 24)  // other interrupts
 #define E1000E_ICR_INT_ASSERTED      (1 << 31)  // interrupt asserted
 #define E1000E_RDTR_FPD              (1 << 31)  // flush partial descriptor block
+#define E1000E_ICR_RXQ(n)            (E1000E_ICR_RXQ0 << (n))
+#define E1000E_ICR_TXQ(n)            (E1000E_ICR_TXQ0 << (n))
+#define E1000E_ITR_INTERVAL_MASK     0xffff     // in units of 256 ns
+#define E1000E_ITR_UNIT_NS           256
 
 #define E1000E_RSPD_MASK             (0xfff)  // 
 
+// CTRL_EXT
+#define E1000E_CTRL_EXT_PBA_CLR      (1 << 31)  // clear msi-x pending bits on read
+
+// TARC
+#define E1000E_TARC_ENABLE           (1 << 10)  // queue takes part in arbitration
+
+// RXCSUM
+#define E1000E_RXCSUM_PCSD           (1 << 13)  // no packet checksum, needed for rss
+
+// MRQC
+#define E1000E_MRQC_RSS              0x1        // multiple queues through rss
+#define E1000E_MRQC_TCPIPV4          (1 << 16)  // hash tcp/ipv4 on addresses and ports
+#define E1000E_MRQC_IPV4             (1 << 17)  // hash other ipv4 on addresses
+#define E1000E_MRQC_TCPIPV6          (1 << 18)
+#define E1000E_MRQC_IPV6             (1 << 20)
+
+#define E1000E_RETA_ENTRIES          128
+#define E1000E_RETA_QUEUE_SHIFT      7          // bit 7 of an entry picks the queue
+#define E1000E_RSSRK_LEN             40
+
+// IVAR, one 4 bit field per cause: vector in bits 2:0, valid in bit 3
+#define E1000E_IVAR_RXQ_SHIFT(n)     (4 * (n))
+#define E1000E_IVAR_TXQ_SHIFT(n)     (8 + 4 * (n))
+#define E1000E_IVAR_VALID            0x8
+#define E1000E_IVAR_TX_EVERY_WB      (1 << 31)  // tx interrupt on every write back
+
 // the same encoding for status.speed, status.asdv, and ctrl.speed
 #define E1000E_SPEED_ENCODING_10M     0
 #define E1000E_SPEED_ENCODING_100M    1
@@ -404,6 +456,8 @@ struct e1000e_tx_desc {
 struct e1000e_fn_map {
   void (*callback)(nk_net_dev_status_t, void *);
   uint64_t *context;
+  // filled in on receive, if the poster asked
+  struct nk_net_dev_pkt_info *info;
 };
 
 struct e1000e_map_ring {
@@ -458,6 +512,53 @@ typedef struct iteration iteration_t;
 #define TIMING_DIFF_TSC(r,s,e)              
 #endif
 
+struct e1000e_state;
+
+// a pair of hardware receive and transmit queues with their own
+// interrupt vector when we have MSI-X
+struct e1000e_queue {
+  struct e1000e_state *state;
+  int idx;
+  // the cpu its interrupts go to
+  int cpu;
+
+  struct e1000e_desc_ring *tx_ring;
+  struct e1000e_desc_ring *rxd_ring;
+  // a circular queue mapping between callback function and tx descriptor
+  struct e1000e_map_ring *tx_map;
+  // a circular queue mapping between callback funtion and rx descriptor
+  struct e1000e_map_ring *rx_map;
+
+  // protects the descriptor rings and the callback maps
+  spinlock_t lock;
+  // tx descriptors filled in but not yet given to the device
+  uint32_t tx_pending;
+  // tx descriptors given to the device and not yet reaped
+  uint32_t tx_inflight;
+  // rx descriptors filled in but not yet given to the device
+  uint32_t rx_pending;
+  // nonzero while completions run; receive tail writes wait for them
+  uint32_t rx_deferring;
+
+  // interrupt causes that belong to this queue
+  uint32_t ims_bits;
+
+  // NAPI-style polling: the interrupt handler masks the queue and
+  // wakes the poller, which unmasks it once it catches up
+  volatile int poll_pending;
+  nk_wait_queue_t *poll_wq;
+  int poll_started;
+
+  struct {
+    uint64_t intrs;
+    uint64_t polls;
+    uint64_t tx;
+    uint64_t rx;
+    uint64_t tx_tail_writes;
+    uint64_t rx_tail_writes;
+  } stats;
+};
+
 struct e1000e_state {
   // a pointer to the base class
   struct nk_net_dev *netdev;
@@ -477,17 +578,24 @@ struct e1000e_state {
   char name[DEV_NAME_LEN];
   uint8_t mac_addr[6];
 
-  struct e1000e_desc_ring *tx_ring;
-  struct e1000e_desc_ring *rxd_ring;
-  // a circular queue mapping between callback function and tx descriptor
-  struct e1000e_map_ring *tx_map;
-  // a circular queue mapping between callback funtion and rx descriptor
-  struct e1000e_map_ring *rx_map;
+  // queue pairs in use; more than one only with MSI-X and RSS
+  int num_queues;
+  // each queue has its own MSI-X vector
+  int msix;
+  struct e1000e_queue queues[E1000E_MAX_QUEUES];
   // the size of receive buffers
   uint64_t rx_buffer_size;
   // interrupt mark set
   uint32_t ims_reg;
 
+  // most tx descriptors held back while others are in flight
+  uint32_t tx_batch;
+  // interrupt throttling, interrupts per second (0 = unthrottled)
+  uint32_t itr;
+  // polling mode, and the most receives a queue's poller takes per pass
+  int poll;
+  uint32_t poll_budget;
+
 #if TIMING
   volatile iteration_t measure;
 #endif
@@ -498,8 +606,10 @@ static struct list_head dev_list;
 
 
 // initialize the tx ring buffer to store transmit descriptors
-static int e1000e_init_transmit_ring(struct e1000e_state *state)
+static int e1000e_init_transmit_ring(struct e1000e_queue *q)
 {
+  struct e1000e_state *state = q->state;
+
   TXMAP = malloc(sizeof(struct e1000e_map_ring));
   if (!TXMAP) {
     ERROR("Cannot allocate txmap\n");
@@ -532,26 +642,26 @@ static int e1000e_init_transmit_ring(struct e1000e_state *state)
   TXD_COUNT = TX_DSC_COUNT;
 
   // store the address of the memory in TDBAL/TDBAH
-  WRITE_MEM(state, E1000E_TDBAL_OFFSET,
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDBAL_OFFSET, q->idx),
             (uint32_t)( 0x00000000ffffffff & (uint64_t) TXD_RING_BUFFER));
-  WRITE_MEM(state, E1000E_TDBAH_OFFSET,
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDBAH_OFFSET, q->idx),
             (uint32_t)((0xffffffff00000000 & (uint64_t) TXD_RING_BUFFER) >> 32));
   DEBUG("TXD_RING_BUFFER=0x%p, TDBAH=0x%08x, TDBAL=0x%08x\n",
         TXD_RING_BUFFER, 
-        READ_MEM(state, E1000E_TDBAH_OFFSET),
-        READ_MEM(state, E1000E_TDBAL_OFFSET));
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDBAH_OFFSET, q->idx)),
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDBAL_OFFSET, q->idx)));
 
   // write tdlen: transmit descriptor length
-  WRITE_MEM(state, E1000E_TDLEN_OFFSET,
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDLEN_OFFSET, q->idx),
             sizeof(struct e1000e_tx_desc) * TX_DSC_COUNT);
 
   // write the tdh, tdt with 0
-  WRITE_MEM(state, E1000E_TDT_OFFSET, 0);
-  WRITE_MEM(state, E1000E_TDH_OFFSET, 0);
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDT_OFFSET, q->idx), 0);
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDH_OFFSET, q->idx), 0);
   DEBUG("init tx fn: TDLEN = 0x%08x, TDH = 0x%08x, TDT = 0x%08x\n",
-        READ_MEM(state, E1000E_TDLEN_OFFSET),
-        READ_MEM(state, E1000E_TDH_OFFSET),
-        READ_MEM(state, E1000E_TDT_OFFSET));
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDLEN_OFFSET, q->idx)),
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDH_OFFSET, q->idx)),
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDT_OFFSET, q->idx)));
 
   TXD_PREV_HEAD = 0;
   TXD_TAIL = 0;
@@ -565,8 +675,11 @@ static int e1000e_init_transmit_ring(struct e1000e_state *state)
 
   // TXDCTL Reg: set WTHRESH = 1b, GRAN = 1b,
   // other fields = 0b except bit 22th = 1b
-  WRITE_MEM(state, E1000E_TXDCTL_OFFSET,
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TXDCTL_OFFSET, q->idx),
             E1000E_TXDCTL_GRAN | E1000E_TXDCTL_WTHRESH | (1<<22));
+  // a queue only sends once it takes part in arbitration
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TARC_OFFSET, q->idx),
+            READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TARC_OFFSET, q->idx)) | E1000E_TARC_ENABLE);
   // write tipg register
   // 00,00 0000 0110,0000 0010 00,00 0000 1010 = 0x0060200a
   // will be zero when emulating hardware
@@ -615,8 +728,10 @@ static int e1000e_set_receive_buffer_size(struct e1000e_state* state, uint32_t b
 }
 
 // initialize the rx ring buffer to store receive descriptors
-static int e1000e_init_receive_ring(struct e1000e_state *state)
+static int e1000e_init_receive_ring(struct e1000e_queue *q)
 {
+  struct e1000e_state *state = q->state;
+
   RXMAP = malloc(sizeof(struct e1000e_map_ring));
   if (!RXMAP) {
     ERROR("Cannot allocate rxmap\n");
@@ -652,35 +767,40 @@ static int e1000e_init_receive_ring(struct e1000e_state *state)
   memset(RXD_RING_BUFFER, 0, rx_desc_size);
 
   // store the address of the memory in TDBAL/TDBAH
-  WRITE_MEM(state, E1000E_RDBAL_OFFSET,
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDBAL_OFFSET, q->idx),
             (uint32_t)(0x00000000ffffffff & (uint64_t) RXD_RING_BUFFER));
-  WRITE_MEM(state, E1000E_RDBAH_OFFSET,
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDBAH_OFFSET, q->idx),
             (uint32_t)((0xffffffff00000000 & (uint64_t) RXD_RING_BUFFER) >> 32));
   DEBUG("init rx fn: RDBAH = 0x%08x, RDBAL = 0x%08x = rd_buffer\n",
-        READ_MEM(state, E1000E_RDBAH_OFFSET),
-        READ_MEM(state, E1000E_RDBAL_OFFSET));
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDBAH_OFFSET, q->idx)),
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDBAL_OFFSET, q->idx)));
   DEBUG("init rx fn: rd_buffer = 0x%016lx\n", RXD_RING_BUFFER);
 
   // write rdlen
-  WRITE_MEM(state, E1000E_RDLEN_OFFSET, rx_desc_size);
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDLEN_OFFSET, q->idx), rx_desc_size);
   DEBUG("init rx fn: RDLEN=0x%08x should be 0x%08x\n",
-        READ_MEM(state, E1000E_RDLEN_OFFSET), rx_desc_size);
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDLEN_OFFSET, q->idx)), rx_desc_size);
 
   // write the rdh, rdt with 0
-  WRITE_MEM(state, E1000E_RDH_OFFSET, 0);
-  WRITE_MEM(state, E1000E_RDT_OFFSET, 0);
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDH_OFFSET, q->idx), 0);
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDT_OFFSET, q->idx), 0);
   DEBUG("init rx fn: RDH=0x%08x, RDT=0x%08x expects 0\n",
-        READ_MEM(state, E1000E_RDH_OFFSET),
-        READ_MEM(state, E1000E_RDT_OFFSET));
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDH_OFFSET, q->idx)),
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDT_OFFSET, q->idx)));
   RXD_PREV_HEAD = 0;
   RXD_TAIL = 0;
 
-  WRITE_MEM(state, E1000E_RXDCTL_OFFSET,
+  WRITE_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RXDCTL_OFFSET, q->idx),
             E1000E_RXDCTL_GRAN | E1000E_RXDCTL_WTHRESH);
   DEBUG("init rx fn: RXDCTL=0x%08x expects 0x%08x\n",
-        READ_MEM(state, E1000E_RXDCTL_OFFSET),
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RXDCTL_OFFSET, q->idx)),
         E1000E_RXDCTL_GRAN | E1000E_RXDCTL_WTHRESH);
 
+  // the receive control register is shared by the queues
+  if (q->idx) {
+    return 0;
+  }
+
   // write rctl register specifing the receive mode
   uint32_t rctl_reg = E1000E_RCTL_EN | E1000E_RCTL_SBP | E1000E_RCTL_UPE | E1000E_RCTL_LPE | E1000E_RCTL_DTYP_LEGACY | E1000E_RCTL_BAM | E1000E_RCTL_RDMTS_HALF | E1000E_RCTL_PMCF;
    
@@ -696,15 +816,43 @@ static int e1000e_init_receive_ring(struct e1000e_state *state)
   return 0;
 }
 
+// give the filled in tx descriptors to the device
+// the caller holds the lock
+static void e1000e_flush_tx(struct e1000e_queue *q)
+{
+  if (q->tx_pending) {
+    // descriptors must be visible before the tail moves
+    mbarrier();
+    WRITE_MEM(q->state, E1000E_QUEUE_OFFSET(E1000E_TDT_OFFSET, q->idx), TXD_TAIL);
+    q->tx_inflight += q->tx_pending;
+    q->tx_pending = 0;
+    q->stats.tx_tail_writes++;
+  }
+}
+
+// give the filled in rx descriptors to the device
+// the caller holds the lock
+static void e1000e_flush_rx(struct e1000e_queue *q)
+{
+  if (q->rx_pending) {
+    mbarrier();
+    WRITE_MEM(q->state, E1000E_QUEUE_OFFSET(E1000E_RDT_OFFSET, q->idx), RXD_TAIL);
+    q->rx_pending = 0;
+    q->stats.rx_tail_writes++;
+  }
+}
+
 static int e1000e_send_packet(uint8_t* packet_addr,
                               uint64_t packet_size,
-                              struct e1000e_state *state)
+                              struct e1000e_queue *q)
 {
+  struct e1000e_state *state = q->state;
+
   DEBUG("send pkt fn: pkt_addr 0x%p pkt_size: %d\n", packet_addr, packet_size);
 
   DEBUG("send pkt fn: before sending TDH = %d TDT = %d tail_pos = %d\n",
-        READ_MEM(state, E1000E_TDH_OFFSET),
-        READ_MEM(state, E1000E_TDT_OFFSET),
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDH_OFFSET, q->idx)),
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDT_OFFSET, q->idx)),
         TXD_TAIL);
   DEBUG("send pkt fn: tpt total packet transmit: %d\n",
         READ_MEM(state, E1000E_TPT_OFFSET));
@@ -733,12 +881,19 @@ static int e1000e_send_packet(uint8_t* packet_addr,
   TXD_CMD(TXD_TAIL).byte = E1000E_TXD_CMD_EOP | E1000E_TXD_CMD_IFCS | E1000E_TXD_CMD_RS; 
 
   // increment transmit descriptor list tail by 1
-  DEBUG("send pkt fn: moving the tail\n");
   TXD_TAIL = TXD_INC(1, TXD_TAIL);
-  WRITE_MEM(state, E1000E_TDT_OFFSET, TXD_TAIL);
+  q->tx_pending++;
+
+  // An idle device gets the descriptor at once.  A busy one will raise a
+  // completion soon, so we hold descriptors back until then or until
+  // tx_batch of them have built up, saving tail register writes.
+  if (!q->tx_inflight || q->tx_pending >= state->tx_batch) {
+    DEBUG("send pkt fn: moving the tail\n");
+    e1000e_flush_tx(q);
+  }
   DEBUG("send pkt fn: after moving tail TDH = %d TDT = %d tail_pos = %d\n",
-        READ_MEM(state, E1000E_TDH_OFFSET),
-        READ_MEM(state, E1000E_TDT_OFFSET),
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDH_OFFSET, q->idx)),
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_TDT_OFFSET, q->idx)),
         TXD_TAIL);
 
   DEBUG("send pkt fn: transmit error %d\n",
@@ -776,13 +931,15 @@ static void e1000e_enable_receive(struct e1000e_state* state)
 
 static int e1000e_receive_packet(uint8_t* buffer,
                                  uint64_t buffer_size,
-                                 struct e1000e_state *state)
+                                 struct e1000e_queue *q)
 {
+  struct e1000e_state *state = q->state;
+
   DEBUG("e1000e receive packet fn: buffer = 0x%p, len = %lu\n",
         buffer, buffer_size);
   DEBUG("e1000e receive pkt fn: before moving tail head: %d, tail: %d\n",
-        READ_MEM(state, E1000E_RDH_OFFSET), 
-        READ_MEM(state, E1000E_RDT_OFFSET)); 
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDH_OFFSET, q->idx)), 
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDT_OFFSET, q->idx))); 
 
   memset(((struct e1000e_rx_desc *) RXD_RING_BUFFER + RXD_TAIL),
          0, sizeof(struct e1000e_rx_desc));
@@ -790,12 +947,18 @@ static int e1000e_receive_packet(uint8_t* buffer,
   RXD_ADDR(RXD_TAIL) = (uint64_t*) buffer;
 
   RXD_TAIL = RXD_INC(RXD_TAIL, 1);
-  WRITE_MEM(state, E1000E_RDT_OFFSET, RXD_TAIL);
+  q->rx_pending++;
+
+  // buffers posted from completion callbacks go out together
+  // once the callbacks are done
+  if (!q->rx_deferring) {
+    e1000e_flush_rx(q);
+  }
 
   DEBUG("e1000e receive pkt fn: after moving tail head: %d, prev_head: %d tail: %d\n",
-        READ_MEM(state, E1000E_RDH_OFFSET), 
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDH_OFFSET, q->idx)), 
         RXD_PREV_HEAD, 
-        READ_MEM(state, E1000E_RDT_OFFSET)); 
+        READ_MEM(state, E1000E_QUEUE_OFFSET(E1000E_RDT_OFFSET, q->idx))); 
 
   return 0;
 }
@@ -838,18 +1001,25 @@ static int e1000e_get_characteristics(void *vstate, struct nk_net_dev_characteri
   }
 
   struct e1000e_state *state=(struct e1000e_state*)vstate;
+  uint32_t i;
+
   memcpy(c->mac, (void *) state->mac_addr, MAC_LEN);
   // minimum and the maximum transmission unit
   c->min_tu = MIN_TU;
   c->max_tu = MAX_TU;
   c->packet_size_to_buffer_size = e1000e_packet_size_to_buffer_size;
+  c->num_queues = state->num_queues;
+  for (i = 0; i < state->num_queues; i++) {
+    c->queue_cpu[i] = state->queues[i].cpu;
+  }
   return 0;
 }
 
 
 static int e1000e_unmap_callback(struct e1000e_map_ring* map,
                                  uint64_t** callback,
-                                 void** context)
+                                 void** context,
+                                 struct nk_net_dev_pkt_info **info)
 {
   // callback is a function pointer
   DEBUG("unmap callback fn head_pos %d tail_pos %d\n",
@@ -867,8 +1037,10 @@ static int e1000e_unmap_callback(struct e1000e_map_ring* map,
 
   *callback = (uint64_t *) map->map_ring[i].callback;
   *context =  map->map_ring[i].context;
+  *info = map->map_ring[i].info;
   map->map_ring[i].callback = NULL;
   map->map_ring[i].context = NULL;
+  map->map_ring[i].info = NULL;
   map->head_pos = (1 + map->head_pos) % map->ring_len;
 
   DEBUG("unmap callback fn: callback 0x%p, context 0x%p\n",
@@ -880,7 +1052,8 @@ static int e1000e_unmap_callback(struct e1000e_map_ring* map,
 
 static int e1000e_map_callback(struct e1000e_map_ring* map,
                                void (*callback)(nk_net_dev_status_t, void*),
-                               void* context)
+                               void* context,
+                               struct nk_net_dev_pkt_info *info)
 {
   DEBUG("map callback fn: head_pos %d tail_pos %d\n", map->head_pos, map->tail_pos);
   if (map->head_pos == ((map->tail_pos + 1) % map->ring_len)) {
@@ -895,6 +1068,7 @@ static int e1000e_map_callback(struct e1000e_map_ring* map,
   struct e1000e_fn_map *fnmap = (map->map_ring + i);
   fnmap->callback = callback;
   fnmap->context = (uint64_t *)context;
+  fnmap->info = info;
   map->tail_pos = (1 + map->tail_pos) % map->ring_len;
   DEBUG("map callback fn: callback 0x%p, context 0x%p\n",
         callback, context);
@@ -938,60 +1112,381 @@ static void e1000e_interpret_icr(struct e1000e_state* state)
   e1000e_interpret_int(state, icr_reg);
 }
 
-static int e1000e_post_send(void *vstate,
-			    uint8_t *src,
-			    uint64_t len,
-			    void (*callback)(nk_net_dev_status_t, void *),
-			    void *context)
+// Sends go out on the queue whose interrupts land on the sending CPU, so
+// the completion runs where the packet came from.  Receive buffers go to
+// whichever queue holds the fewest, preferring our own, since RSS picks
+// the receive queue by flow and every queue needs to be stocked.  A
+// caller running a receive path per queue names the queue instead.
+static struct e1000e_queue *e1000e_select_queue(struct e1000e_state *state,
+                                                int send,
+                                                struct nk_net_dev_pkt_info *info)
+{
+  int cpu = my_cpu_id();
+  uint32_t i, pick = cpu % state->num_queues;
+  uint64_t posted, best;
+
+  if (info && (info->flags & NK_NET_PKT_QUEUE) && info->queue < state->num_queues) {
+    return &state->queues[info->queue];
+  }
+
+  for (i = 0; i < state->num_queues; i++) {
+    if (state->queues[i].cpu == cpu) {
+      pick = i;
+      break;
+    }
+  }
+
+  if (!send) {
+    best = RXMAP_POSTED(&state->queues[pick]);
+    for (i = 0; i < state->num_queues; i++) {
+      posted = RXMAP_POSTED(&state->queues[i]);
+      if (posted < best) {
+        best = posted;
+        pick = i;
+      }
+    }
+  }
+
+  return &state->queues[pick];
+}
+
+static int e1000e_post_send_info(void *vstate,
+                                 uint8_t *src,
+                                 uint64_t len,
+                                 struct nk_net_dev_pkt_info *info,
+                                 void (*callback)(nk_net_dev_status_t, void *),
+                                 void *context)
 {
   // always map callback
   struct e1000e_state* state = (struct e1000e_state*) vstate;
   DEBUG("post tx fn: callback 0x%p context 0x%p\n", callback, context);
 
+  if (info && (info->flags & ~NK_NET_PKT_QUEUE)) {
+    DEBUG("post tx fn: cannot offload (flags=%x)\n", info->flags);
+    return -1;
+  }
+
+  struct e1000e_queue *q = e1000e_select_queue(state, 1, info);
+
+  uint8_t flags = spin_lock_irq_save(&q->lock);
+
   // #measure
   TIMING_GET_TSC(state->measure.tx.postx_map.start);
-  int result = e1000e_map_callback(state->tx_map, callback, context);
+  int result = e1000e_map_callback(TXMAP, callback, context, 0);
   TIMING_GET_TSC(state->measure.tx.postx_map.end);
 
   // #measure
   TIMING_GET_TSC(state->measure.tx.xpkt.start);
   if (!result) {
-    result = e1000e_send_packet(src, len, (struct e1000e_state*) state);
+    result = e1000e_send_packet(src, len, q);
+    if (result) {
+      // completions are matched to descriptors in order, so the
+      // mapping must not outlive a failed send
+      TXMAP->tail_pos = (TXMAP->tail_pos + TXMAP->ring_len - 1) % TXMAP->ring_len;
+    }
   }
   TIMING_GET_TSC(state->measure.tx.xpkt.end);
 
+  spin_unlock_irq_restore(&q->lock, flags);
+
   DEBUG("post tx fn: end\n");
   return result;
 }
 
-static int e1000e_post_receive(void *vstate,
-			       uint8_t *src,
-			       uint64_t len,
-			       void (*callback)(nk_net_dev_status_t, void *),
-			       void *context)
+static int e1000e_post_send(void *vstate,
+			    uint8_t *src,
+			    uint64_t len,
+			    void (*callback)(nk_net_dev_status_t, void *),
+			    void *context)
+{
+  return e1000e_post_send_info(vstate, src, len, 0, callback, context);
+}
+
+static int e1000e_post_receive_info(void *vstate,
+                                    uint8_t *src,
+                                    uint64_t len,
+                                    struct nk_net_dev_pkt_info *info,
+                                    void (*callback)(nk_net_dev_status_t, void *),
+                                    void *context)
 {
   // mapping the callback always
   // if result != -1 receive packet
   struct e1000e_state* state = (struct e1000e_state*) vstate;
   DEBUG("post rx fn: callback 0x%p, context 0x%p\n", callback, context);
 
+  struct e1000e_queue *q = e1000e_select_queue(state, 0, info);
+
+  uint8_t flags = spin_lock_irq_save(&q->lock);
+
   // #measure
   TIMING_GET_TSC(state->measure.rx.postx_map.start);
-  int result = e1000e_map_callback(state->rx_map, callback, context);
+  int result = e1000e_map_callback(RXMAP, callback, context, info);
   TIMING_GET_TSC(state->measure.rx.postx_map.end);
 
   // #measure
   TIMING_GET_TSC(state->measure.rx.xpkt.start);
   if (!result) {
-    result = e1000e_receive_packet(src, len, state);
+    result = e1000e_receive_packet(src, len, q);
   }
   TIMING_GET_TSC(state->measure.rx.xpkt.end);
 
+  spin_unlock_irq_restore(&q->lock, flags);
+
   DEBUG("post rx fn: end --------------------\n");
   return result;
 }
 
-enum pkt_op { op_unknown, op_tx, op_rx };
+static int e1000e_post_receive(void *vstate,
+			       uint8_t *src,
+			       uint64_t len,
+			       void (*callback)(nk_net_dev_status_t, void *),
+			       void *context)
+{
+  return e1000e_post_receive_info(vstate, src, len, 0, callback, context);
+}
+
+// a reaped descriptor whose callback is run after the lock is dropped
+struct e1000e_done {
+  void (*callback)(nk_net_dev_status_t, void *);
+  void *context;
+  nk_net_dev_status_t status;
+};
+
+#define TXD_DONE(i) (*(volatile uint8_t *)&TXD_STATUS(i) & 0x1)
+#define RXD_DONE(i) (*(volatile uint8_t *)&RXD_STATUS(i) & 0x1)
+
+// reap up to max transmit descriptors the device has written back
+// the caller holds the queue lock
+static int e1000e_reap_tx(struct e1000e_queue *q, struct e1000e_done *done, int max)
+{
+  struct nk_net_dev_pkt_info *info;
+  int n = 0;
+
+  while (n < max && TXD_PREV_HEAD != TXD_TAIL && TXD_DONE(TXD_PREV_HEAD)) {
+    e1000e_unmap_callback(TXMAP,
+                          (uint64_t **)&done[n].callback,
+                          &done[n].context,
+                          &info);
+    // if there is an error while sending a packet, set the error status
+    if (TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
+      ERROR("reap tx fn: transmit errors\n");
+      done[n].status = NK_NET_DEV_STATUS_ERROR;
+    } else {
+      done[n].status = NK_NET_DEV_STATUS_SUCCESS;
+    }
+    TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
+    n++;
+  }
+  q->tx_inflight -= n;
+  q->stats.tx += n;
+  return n;
+}
+
+// reap up to max receive descriptors the device has written back
+// the caller holds the queue lock
+static int e1000e_reap_rx(struct e1000e_queue *q, struct e1000e_done *done, int max)
+{
+  struct nk_net_dev_pkt_info *info;
+  int n = 0;
+
+  while (n < max && RXD_PREV_HEAD != RXD_TAIL && RXD_DONE(RXD_PREV_HEAD)) {
+    e1000e_unmap_callback(RXMAP,
+                          (uint64_t **)&done[n].callback,
+                          &done[n].context,
+                          &info);
+    // checking errors
+    if (RXD_ERRORS(RXD_PREV_HEAD)) {
+      ERROR("reap rx fn: receive an error packet\n");
+      done[n].status = NK_NET_DEV_STATUS_ERROR;
+    } else {
+      done[n].status = NK_NET_DEV_STATUS_SUCCESS;
+    }
+    if (info) {
+      memset(info, 0, sizeof(*info));
+      info->len = RXD_LENGTH(RXD_PREV_HEAD);
+      info->flags = NK_NET_PKT_QUEUE;
+      info->queue = q->idx;
+    }
+    RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);
+    n++;
+  }
+  q->stats.rx += n;
+  return n;
+}
+
+static void e1000e_complete(struct e1000e_done *done, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (done[i].callback) {
+      DEBUG("complete fn: invoke callback function callback: 0x%p\n", done[i].callback);
+      done[i].callback(done[i].status, done[i].context);
+    }
+  }
+}
+
+// Complete every finished transmit and up to budget receives, returning
+// the number of receives.  Callbacks run without the lock held so they
+// can post new buffers; the receive buffers they post reach the device
+// with a single tail write per batch.
+static int e1000e_clean_rings(struct e1000e_queue *q, uint32_t budget)
+{
+  struct e1000e_done done[DONE_BATCH];
+  uint32_t work = 0;
+  int n, max;
+  uint8_t flags;
+
+  do {
+    flags = spin_lock_irq_save(&q->lock);
+    n = e1000e_reap_tx(q, done, DONE_BATCH);
+    // anything held back is now due
+    e1000e_flush_tx(q);
+    spin_unlock_irq_restore(&q->lock, flags);
+    e1000e_complete(done, n);
+  } while (n == DONE_BATCH);
+
+  do {
+    max = budget - work < DONE_BATCH ? budget - work : DONE_BATCH;
+    flags = spin_lock_irq_save(&q->lock);
+    n = e1000e_reap_rx(q, done, max);
+    if (!n) {
+      spin_unlock_irq_restore(&q->lock, flags);
+      break;
+    }
+    q->rx_deferring++;
+    spin_unlock_irq_restore(&q->lock, flags);
+
+    e1000e_complete(done, n);
+
+    flags = spin_lock_irq_save(&q->lock);
+    if (!--q->rx_deferring) {
+      e1000e_flush_rx(q);
+    }
+    spin_unlock_irq_restore(&q->lock, flags);
+    work += n;
+  } while (n == max && work < budget);
+
+  return work;
+}
+
+static int e1000e_poll_cond(void *s)
+{
+  return ((struct e1000e_queue *)s)->poll_pending;
+}
+
+// The poller drains its queue while the queue's interrupts are masked.
+// A pass that uses up the whole budget means more work is likely queued,
+// so we yield and go again; otherwise we have caught up and unmask.  A
+// packet that lands in between latches its cause in ICR and interrupts
+// as soon as IMS is written, so nothing is lost.
+static void e1000e_poll_thread(void *in, void **out)
+{
+  struct e1000e_queue *q = (struct e1000e_queue *)in;
+  struct e1000e_state *state = q->state;
+  char name[MAX_THREAD_NAME];
+  uint32_t work;
+
+  snprintf(name, MAX_THREAD_NAME, "%s-poll%d", state->name, q->idx);
+  nk_thread_name(get_cur_thread(), name);
+
+  while (1) {
+    nk_wait_queue_sleep_extended(q->poll_wq, e1000e_poll_cond, q);
+    q->poll_pending = 0;
+    q->stats.polls++;
+
+    work = e1000e_clean_rings(q, state->poll_budget);
+
+    if (state->poll && work >= state->poll_budget) {
+      q->poll_pending = 1;
+      nk_yield();
+      continue;
+    }
+
+    WRITE_MEM(state, E1000E_IMS_OFFSET, q->ims_bits);
+  }
+}
+
+static int e1000e_start_poller(struct e1000e_queue *q)
+{
+  struct e1000e_state *state = q->state;
+
+  if (q->poll_started) {
+    return 0;
+  }
+
+  q->poll_wq = nk_wait_queue_create(0);
+  if (!q->poll_wq) {
+    ERROR("Cannot allocate poll wait queue for %s queue %d\n", state->name, q->idx);
+    return -1;
+  }
+
+  if (nk_thread_start(e1000e_poll_thread, q, 0, 1, TSTACK_1MB, 0, q->cpu)) {
+    ERROR("Cannot start poll thread for %s queue %d\n", state->name, q->idx);
+    nk_wait_queue_destroy(q->poll_wq);
+    q->poll_wq = 0;
+    return -1;
+  }
+
+  q->poll_started = 1;
+  return 0;
+}
+
+static int e1000e_start_pollers(struct e1000e_state *state)
+{
+  uint32_t i;
+
+  for (i = 0; i < state->num_queues; i++) {
+    if (e1000e_start_poller(&state->queues[i])) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// program the interrupt throttling rate, in interrupts per second
+static void e1000e_set_itr(struct e1000e_state *state, uint32_t rate)
+{
+  uint32_t interval = 0;
+  int i;
+
+  if (rate) {
+    interval = 1000000000UL / ((uint64_t)rate * E1000E_ITR_UNIT_NS);
+    if (!interval) {
+      interval = 1;
+    }
+    if (interval > E1000E_ITR_INTERVAL_MASK) {
+      interval = E1000E_ITR_INTERVAL_MASK;
+    }
+  }
+
+  WRITE_MEM(state, E1000E_ITR_OFFSET, interval);
+  if (state->msix) {
+    for (i = 0; i < state->num_queues; i++) {
+      WRITE_MEM(state, E1000E_EITR_OFFSET(i), interval);
+    }
+  }
+  state->itr = rate;
+  DEBUG("set itr fn: %u interrupts/s, ITR = 0x%08x\n", rate,
+        READ_MEM(state, E1000E_ITR_OFFSET));
+}
+
+// a queue has work; either clean it here or hand it to its poller
+static void e1000e_service(struct e1000e_queue *q)
+{
+  struct e1000e_state *state = q->state;
+
+  q->stats.intrs++;
+
+  if (state->poll) {
+    // keep the queue quiet until the poller catches up
+    WRITE_MEM(state, E1000E_IMC_OFFSET, q->ims_bits);
+    q->poll_pending = 1;
+    nk_wait_queue_wake_one(q->poll_wq);
+  } else {
+    e1000e_clean_rings(q, RXD_COUNT);
+  }
+}
 
 static int e1000e_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
 {
@@ -1000,106 +1495,201 @@ static int e1000e_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
 
   // #measure
   uint64_t irq_start = 0;
-  uint64_t irq_end = 0;
-  uint64_t callback_start = 0;
-  uint64_t callback_end = 0;
-  enum pkt_op which_op = op_unknown; 
   
   TIMING_GET_TSC(irq_start);
   struct e1000e_state* state = s;
   uint32_t icr = READ_MEM(state, E1000E_ICR_OFFSET);
   uint32_t mask_int = icr & state->ims_reg;
+  int i;
   DEBUG("irq_handler fn: ICR: 0x%08x IMS: 0x%08x mask_int: 0x%08x\n",
         icr, state->ims_reg, mask_int);
 
-  void (*callback)(nk_net_dev_status_t, void*) = NULL;
-  void *context = NULL;
-  nk_net_dev_status_t status = NK_NET_DEV_STATUS_SUCCESS;
+  for (i = 0; i < state->num_queues; i++) {
+    if (mask_int & state->queues[i].ims_bits) {
+      e1000e_service(&state->queues[i]);
+    }
+  }
 
-  if (mask_int & (E1000E_ICR_TXDW | E1000E_ICR_TXQ0)) {
-    
-    which_op = op_tx;
-    // transmit interrupt
-    DEBUG("irq_handler fn: handle the txdw interrupt\n");
-    TIMING_GET_TSC(state->measure.tx.irq_unmap.start);
-    e1000e_unmap_callback(state->tx_map,
-                          (uint64_t **)&callback,
-                          (void **)&context);
-    TIMING_GET_TSC(state->measure.tx.irq_unmap.end);
-    
-    // if there is an error while sending a packet, set the error status
-    if (TXD_STATUS(TXD_PREV_HEAD).ec || TXD_STATUS(TXD_PREV_HEAD).lc) {
-      ERROR("irq_handler fn: transmit errors\n");
-      status = NK_NET_DEV_STATUS_ERROR;
+  DEBUG("irq_handler fn: end irq\n\n\n");
+  // DO NOT DELETE THIS LINE.
+  // must have this line at the end of the handler
+  IRQ_HANDLER_END();
+
+#if TIMING
+  // #measure
+  state->measure.rx.irq.start = irq_start;
+  state->measure.rx.irq.end = rdtsc();
+#endif
+  
+  return 0;
+}
+
+// With MSI-X each queue has its own vector, so there is no need to read
+// ICR to find out why we are here.  EIAC clears the queue's causes as the
+// message goes out.
+static int e1000e_queue_irq_handler(excp_entry_t * excp, excp_vec_t vec, void *s)
+{
+  struct e1000e_queue *q = s;
+
+  DEBUG("queue irq_handler fn: vector: 0x%x queue %d\n", vec, q->idx);
+
+  e1000e_service(q);
+
+  // DO NOT DELETE THIS LINE.
+  // must have this line at the end of the handler
+  IRQ_HANDLER_END();
+  return 0;
+}
+
+// Give each queue pair its own MSI-X vector, delivered to the queue's cpu,
+// and spread received flows over the queues with RSS.  On failure, the
+// vectors are released and MSI-X and RSS are off again, so the caller
+// can fall back to MSI.
+static int e1000e_setup_msi_x(struct e1000e_state *state)
+{
+  struct pci_dev *pdev = state->pci_dev;
+  // the usual Toeplitz key, so hashes match what other stacks compute
+  static const uint8_t rss_key[E1000E_RSSRK_LEN] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+  };
+  uint32_t ivar = E1000E_IVAR_TX_EVERY_WB;
+  uint32_t eiac = 0;
+  uint32_t reta;
+  ulong_t vecs[E1000E_MAX_QUEUES];
+  ulong_t vec;
+  int nvecs = 0;
+  int i, j;
+
+  for (i = 0; i < state->num_queues; i++) {
+    struct e1000e_queue *q = &state->queues[i];
+
+    if (idt_find_and_reserve_range(1, 0, &vec)) {
+      ERROR("Cannot get a vector for %s queue %d\n", state->name, i);
+      goto fail;
+    }
+    vecs[nvecs++] = vec;
+    if (register_int_handler(vec, e1000e_queue_irq_handler, q)) {
+      ERROR("Failed to register handler for vector %lu on %s\n", vec, state->name);
+      goto fail;
+    }
+    if (pci_dev_set_msi_x_entry(pdev, i, vec, q->cpu)) {
+      ERROR("Failed to set MSI-X entry %d on %s\n", i, state->name);
+      goto fail;
+    }
+    if (pci_dev_unmask_msi_x_entry(pdev, i)) {
+      ERROR("Failed to unmask MSI-X entry %d on %s\n", i, state->name);
+      goto fail;
     }
 
-    // update the head of the ring buffer
-    TXD_PREV_HEAD = TXD_INC(1, TXD_PREV_HEAD);
-    DEBUG("irq_handler fn: total packet transmitted = %d\n",
-          READ_MEM(state, E1000E_TPT_OFFSET));
+    ivar |= (E1000E_IVAR_VALID | i) << E1000E_IVAR_RXQ_SHIFT(i);
+    ivar |= (E1000E_IVAR_VALID | i) << E1000E_IVAR_TXQ_SHIFT(i);
+    q->ims_bits = E1000E_ICR_RXQ(i) | E1000E_ICR_TXQ(i);
+    eiac |= q->ims_bits;
+    DEBUG("%s queue %d is on vector %lu, cpu %d\n", state->name, i, vec, q->cpu);
   }
 
-  if (mask_int & (E1000E_ICR_RXT0 | E1000E_ICR_RXO | E1000E_ICR_RXQ0)) {
-    which_op = op_rx;
-    // receive interrupt
-    /* if (mask_int & E1000E_ICR_RXT0) { */
-    /*   DEBUG("irq_handler fn: handle the rxt0 interrupt\n"); */
-    /* } */
+  WRITE_MEM(state, E1000E_IVAR_OFFSET, ivar);
+  WRITE_MEM(state, E1000E_CTRL_EXT_OFFSET,
+            READ_MEM(state, E1000E_CTRL_EXT_OFFSET) | E1000E_CTRL_EXT_PBA_CLR);
+  WRITE_MEM(state, E1000E_EIAC_OFFSET, eiac);
 
-    /* if (mask_int & E1000E_ICR_RXO) { */
-    /*   DEBUG("irq_handler fn: handle the rx0 interrupt\n"); */
-    /* } */
-   
-    // INFO("rx length %d\n", RXD_LENGTH(RXD_PREV_HEAD));
-    TIMING_GET_TSC(state->measure.rx.irq_unmap.start);
-    e1000e_unmap_callback(state->rx_map,
-                          (uint64_t **)&callback,
-                          (void **)&context);
-    TIMING_GET_TSC(state->measure.rx.irq_unmap.end);
-
-    // e1000e_interpret_ims(state);
-    // TODO: check if we need this line
-    // WRITE_MEM(state, E1000E_IMC_OFFSET, E1000E_ICR_RXO);
-    
-    // checking errors
-    if (RXD_ERRORS(RXD_PREV_HEAD)) {
-      ERROR("irq_handler fn: receive an error packet\n");
-      status = NK_NET_DEV_STATUS_ERROR;
+  for (i = 0; i < E1000E_RSSRK_LEN; i += 4) {
+    WRITE_MEM(state, E1000E_RSSRK_OFFSET + i,
+              rss_key[i] | rss_key[i+1] << 8 | rss_key[i+2] << 16 | (uint32_t)rss_key[i+3] << 24);
+  }
+  for (i = 0; i < E1000E_RETA_ENTRIES; i += 4) {
+    reta = 0;
+    for (j = 0; j < 4; j++) {
+      reta |= (uint32_t)(((i + j) % state->num_queues) << E1000E_RETA_QUEUE_SHIFT) << (8 * j);
     }
+    WRITE_MEM(state, E1000E_RETA_OFFSET + i, reta);
+  }
+  WRITE_MEM(state, E1000E_RXCSUM_OFFSET,
+            READ_MEM(state, E1000E_RXCSUM_OFFSET) | E1000E_RXCSUM_PCSD);
+  WRITE_MEM(state, E1000E_MRQC_OFFSET,
+            E1000E_MRQC_RSS | E1000E_MRQC_TCPIPV4 | E1000E_MRQC_IPV4 |
+            E1000E_MRQC_TCPIPV6 | E1000E_MRQC_IPV6);
+
+  if (pci_dev_enable_msi_x(pdev)) {
+    ERROR("Failed to enable MSI-X for %s\n", state->name);
+    goto fail;
+  }
+  if (pci_dev_unmask_msi_x_all(pdev)) {
+    ERROR("Failed to unmask MSI-X for %s\n", state->name);
+    goto fail;
+  }
 
-    // in the irq, update only the head of the buffer
-    RXD_PREV_HEAD = RXD_INC(1, RXD_PREV_HEAD);
+  state->ims_reg = eiac;
+  state->msix = 1;
+  return 0;
+
+ fail:
+  pci_dev_mask_msi_x_all(pdev);
+  pci_dev_disable_msi_x(pdev);
+  WRITE_MEM(state, E1000E_MRQC_OFFSET, 0);
+  WRITE_MEM(state, E1000E_EIAC_OFFSET, 0);
+  WRITE_MEM(state, E1000E_IVAR_OFFSET, 0);
+  for (i = 0; i < nvecs; i++) {
+    idt_assign_entry(vecs[i], (ulong_t)null_irq_handler, 0);
+  }
+  for (i = 0; i < state->num_queues; i++) {
+    state->queues[i].ims_bits = 0;
   }
+  return -1;
+}
+
+// one queue pair with every cause on the device's single MSI vector
+static int e1000e_setup_msi(struct e1000e_state *state)
+{
+  struct pci_dev *pdev = state->pci_dev;
 
-  TIMING_GET_TSC(callback_start);
-  if (callback) {
-    DEBUG("irq_handler fn: invoke callback function callback: 0x%p\n", callback);
-    callback(status, context);
+  if (pdev->msi.type == PCI_MSI_NONE) {
+    ERROR("Device %s does not support MSI - skipping\n", state->name);
+    return -1;
   }
-  TIMING_GET_TSC(callback_end);
 
-  DEBUG("irq_handler fn: end irq\n\n\n");
-  // DO NOT DELETE THIS LINE.
-  // must have this line at the end of the handler
-  IRQ_HANDLER_END();
+  uint64_t num_vecs = pdev->msi.num_vectors_needed;
+  uint64_t base_vec = 0;
 
-#if TIMING
-  // #measure
-  irq_end = rdtsc();
-  
-  if (which_op == op_tx) {
-    state->measure.tx.irq_callback.start = callback_start;
-    state->measure.tx.irq_callback.end = callback_end;
-    state->measure.tx.irq.start = irq_start;
-    state->measure.tx.irq.end = irq_end;
-  } else {
-    state->measure.rx.irq_callback.start = callback_start;
-    state->measure.rx.irq_callback.end = callback_end;
-    state->measure.rx.irq.start = irq_start;
-    state->measure.rx.irq.end = irq_end;
+  if (idt_find_and_reserve_range(num_vecs,1,&base_vec)) {
+    ERROR("Cannot find %d vectors for %s - skipping\n",num_vecs,state->name);
+    return -1;
   }
-#endif
-  
+
+  DEBUG("%s vectors are %d..%d\n",state->name,base_vec,base_vec+num_vecs-1);
+
+  if (pci_dev_enable_msi(pdev, base_vec, num_vecs, 0)) {
+    ERROR("Failed to enable MSI for device %s - skipping\n", state->name);
+    return -1;
+  }
+
+  // interrupts go to cpu 0, so that is where the poller runs
+  state->queues[0].cpu = 0;
+
+  int i;
+
+  for (i=base_vec;i<(base_vec+num_vecs);i++) {
+    if (register_int_handler(i, e1000e_irq_handler, state)) {
+      ERROR("Failed to register handler for vector %d on device %s - skipping\n",i,state->name);
+      return -1;
+    }
+  }
+
+  for (i=base_vec; i<(base_vec+num_vecs);i++) {
+    if (pci_dev_unmask_msi(pdev, i)) {
+      ERROR("Failed to unmask interrupt %d for device %s\n",i,state->name);
+      return -1;
+    }
+  }
+
+  // enable only transmit descriptor written back, receive interrupt timer
+  // rx queue 0
+  state->queues[0].ims_bits = E1000E_ICR_TXDW | E1000E_ICR_TXQ0 | E1000E_ICR_RXT0 | E1000E_ICR_RXQ0;
+  state->ims_reg = state->queues[0].ims_bits;
   return 0;
 }
 
@@ -1133,12 +1723,15 @@ static struct nk_net_dev_int ops = {
   .get_characteristics = e1000e_get_characteristics,
   .post_receive        = e1000e_post_receive,
   .post_send           = e1000e_post_send,
+  .post_receive_info   = e1000e_post_receive_info,
+  .post_send_info      = e1000e_post_send_info,
 };
 
 
 int e1000e_pci_init(struct naut_info * naut)
 {
-  struct pci_info *pci = naut->sys.pci;
+  struct sys_info *sys = &naut->sys;
+  struct pci_info *pci = sys->pci;
   struct list_head *curbus, *curdev;
   uint16_t num = 0;
 
@@ -1176,6 +1769,11 @@ int e1000e_pci_init(struct naut_info * naut)
         }
 
         memset(state,0,sizeof(*state));
+        state->tx_batch = NAUT_CONFIG_E1000E_PCI_TX_BATCH;
+        state->poll_budget = NAUT_CONFIG_E1000E_PCI_POLL_BUDGET;
+#ifdef NAUT_CONFIG_E1000E_PCI_POLL
+        state->poll = 1;
+#endif
 	
 	// We will only support MSI for now
 
@@ -1253,7 +1851,7 @@ int e1000e_pci_init(struct naut_info * naut)
         DEBUG("init fn: pci status 0x%04x\n",
               pci_cfg_readw(bus->num,pdev->num, 0, E1000E_PCI_STATUS_OFFSET));
 	
-        list_add(&dev_list, &state->node);
+        list_add(&state->node, &dev_list);
         sprintf(state->name, "e1000e-%d", num);
         num++;
         
@@ -1342,10 +1940,25 @@ int e1000e_pci_init(struct naut_info * naut)
 	DEBUG("init fn: status.phyra %s Does the device require PHY initialization?\n",
 	      status_reg & E1000E_STATUS_PHYRA ? "1 Yes": "0 No");
 	
-	DEBUG("init fn: init receive ring\n");
-	e1000e_init_receive_ring(state);
-	DEBUG("init fn: init transmit ring\n");
-	e1000e_init_transmit_ring(state);
+	// One queue pair per vector needs MSI-X.  The 82574 has two pairs,
+	// and a second one is only worth it with a second cpu.
+	state->num_queues = 1;
+#ifdef NAUT_CONFIG_E1000E_PCI_RSS
+	if (pdev->msix.type == PCI_MSI_X && pdev->msix.size >= E1000E_MAX_QUEUES &&
+	    sys->num_cpus > 1) {
+	    state->num_queues = E1000E_MAX_QUEUES;
+	}
+#endif
+
+	int i;
+
+	for (i = 0; i < state->num_queues; i++) {
+	    struct e1000e_queue *q = &state->queues[i];
+	    q->state = state;
+	    q->idx = i;
+	    q->cpu = i % sys->num_cpus;
+	    spinlock_init(&q->lock);
+	}
 	
 	WRITE_MEM(state, E1000E_IMC_OFFSET, 0);
 	DEBUG("init fn: IMC = 0x%08x expects 0x%08x\n",
@@ -1353,89 +1966,63 @@ int e1000e_pci_init(struct naut_info * naut)
 	
 	DEBUG("init fn: interrupt driven\n");
 
-	
-	if (pdev->msi.type == PCI_MSI_NONE) {
-	    ERROR("Device %s does not support MSI - skipping\n", state->name);
-	    continue;
+	// vectors come before rings, so that falling back to a single
+	// queue leaves no rings behind.  Nothing is delivered until IMS
+	// is written below.
+	if (state->num_queues > 1 && e1000e_setup_msi_x(state)) {
+	    ERROR("Cannot set up MSI-X for %s - falling back to one queue with MSI\n", state->name);
+	    state->num_queues = 1;
 	}
 
-	uint64_t num_vecs = pdev->msi.num_vectors_needed;
-	uint64_t base_vec = 0;
-
-	if (idt_find_and_reserve_range(num_vecs,1,&base_vec)) {
-	    ERROR("Cannot find %d vectors for %s - skipping\n",num_vecs,state->name);
+	if (state->num_queues == 1 && e1000e_setup_msi(state)) {
 	    continue;
 	}
 
-	DEBUG("%s vectors are %d..%d\n",state->name,base_vec,base_vec+num_vecs-1);
-
-	if (pci_dev_enable_msi(pdev, base_vec, num_vecs, 0)) {
-	    ERROR("Failed to enable MSI for device %s - skipping\n", state->name);
-	    continue;
+	for (i = 0; i < state->num_queues; i++) {
+	    DEBUG("init fn: init receive ring %d\n", i);
+	    e1000e_init_receive_ring(&state->queues[i]);
+	    DEBUG("init fn: init transmit ring %d\n", i);
+	    e1000e_init_transmit_ring(&state->queues[i]);
 	}
 
-	int i;
-	int failed=0;
-
-	for (i=base_vec;i<(base_vec+num_vecs);i++) {
-	    if (register_int_handler(i, e1000e_irq_handler, state)) {
-		ERROR("Failed to register handler for vector %d on device %s - skipping\n",i,state->name);
-		failed=1;
-		break;
-	    }
+	if (state->poll && e1000e_start_pollers(state)) {
+	    ERROR("Falling back to interrupt per completion for %s\n", state->name);
+	    state->poll = 0;
 	}
 
-	if (!failed) { 
-	    for (i=base_vec; i<(base_vec+num_vecs);i++) {
-		if (pci_dev_unmask_msi(pdev, i)) {
-		    ERROR("Failed to unmask interrupt %d for device %s\n",i,state->name);
-		    failed = 1;
-		    break;
-		}
-	    }
-	}
-
-
-	if (!failed) { 
-	    // interrupts should now be occuring
-	    
-	    // now configure device
-	    // interrupt delay value = 0 -> does not delay
-	    WRITE_MEM(state, E1000E_TIDV_OFFSET, 0);
-	    // receive interrupt delay timer = 0
-	    // -> interrupt when the device receives a package
-	    WRITE_MEM(state, E1000E_RDTR_OFFSET_NEW, E1000E_RDTR_FPD);
-	    DEBUG("init fn: RDTR new 0x%08x alias 0x%08x expect 0x%08x\n",
+	// interrupts should now be occuring
+	
+	// now configure device
+	// interrupt delay value = 0 -> does not delay
+	WRITE_MEM(state, E1000E_TIDV_OFFSET, 0);
+	// receive interrupt delay timer = 0
+	// -> interrupt when the device receives a package
+	WRITE_MEM(state, E1000E_RDTR_OFFSET_NEW, E1000E_RDTR_FPD);
+	DEBUG("init fn: RDTR new 0x%08x alias 0x%08x expect 0x%08x\n",
 		  READ_MEM(state, E1000E_RDTR_OFFSET_NEW),
 		  READ_MEM(state, E1000E_RDTR_OFFSET_ALIAS),
 		  E1000E_RDTR_FPD);
-	    WRITE_MEM(state, E1000E_RADV_OFFSET, 0);
-	    
-	    // enable only transmit descriptor written back, receive interrupt timer
-	    // rx queue 0
-	    uint32_t ims_reg = 0;
-	    ims_reg = E1000E_ICR_TXDW | E1000E_ICR_TXQ0 | E1000E_ICR_RXT0 | E1000E_ICR_RXQ0;
-	    WRITE_MEM(state, E1000E_IMS_OFFSET, ims_reg);
-	    state->ims_reg = ims_reg;
-	    e1000e_interpret_ims(state);
-	    // after the interrupt is turned on, the interrupt handler is called
-	    // due to the transmit descriptor queue empty.
-	    
-	    uint32_t icr_reg = READ_MEM(state, E1000E_ICR_OFFSET);
-	    // e1000e_interpret_ims(state);
-	    DEBUG("init fn: ICR before writting with 0xffffffff\n");
-	    // e1000e_interpret_icr(state);
-	    WRITE_MEM(state, E1000E_ICR_OFFSET, 0xffffffff);
-	    // e1000e_interpret_icr(state);
-	    DEBUG("init fn: finished writting ICR with 0xffffffff\n");
-	    
-	    // optimization 
-	    WRITE_MEM(state, E1000E_AIT_OFFSET, 0);
-	    WRITE_MEM(state, E1000E_TADV_OFFSET, 0);
-	    DEBUG("init fn: end init fn --------------------\n");
-
-	    INFO("%s operational\n",state->name);
-	}
+	WRITE_MEM(state, E1000E_RADV_OFFSET, 0);
+	// bound the interrupt rate instead
+	e1000e_set_itr(state, NAUT_CONFIG_E1000E_PCI_ITR);
+	
+	WRITE_MEM(state, E1000E_IMS_OFFSET, state->ims_reg);
+	e1000e_interpret_ims(state);
+	// after the interrupt is turned on, the interrupt handler is called
+	// due to the transmit descriptor queue empty.
+	
+	DEBUG("init fn: ICR before writting with 0xffffffff\n");
+	// e1000e_interpret_icr(state);
+	WRITE_MEM(state, E1000E_ICR_OFFSET, 0xffffffff);
+	// e1000e_interpret_icr(state);
+	DEBUG("init fn: finished writting ICR with 0xffffffff\n");
+	
+	// optimization 
+	WRITE_MEM(state, E1000E_AIT_OFFSET, 0);
+	WRITE_MEM(state, E1000E_TADV_OFFSET, 0);
+	DEBUG("init fn: end init fn --------------------\n");
+
+	INFO("%s operational\n",state->name);
       }
     }
   }
@@ -1449,6 +2036,116 @@ int e1000e_pci_deinit() {
   return 0;
 }
 
+static struct e1000e_state *e1000e_find(char *name)
+{
+  struct list_head *cur;
+
+  list_for_each(cur, &dev_list) {
+    struct e1000e_state *state = list_entry(cur, struct e1000e_state, node);
+    if (!strcmp(state->name, name)) {
+      return state;
+    }
+  }
+  return 0;
+}
+
+static void e1000e_show(struct e1000e_state *state)
+{
+  struct e1000e_queue *q;
+  int i;
+
+  nk_vc_printf("%s: %s, %d queue%s (%s), itr %u/s, tx batch %u\n",
+               state->name,
+               state->poll ? "polling" : "interrupt per completion",
+               state->num_queues, state->num_queues > 1 ? "s" : "",
+               state->msix ? "msi-x, rss" : "msi",
+               state->itr, state->tx_batch);
+  for (i = 0; i < state->num_queues; i++) {
+    q = &state->queues[i];
+    nk_vc_printf("  queue %d on cpu %d: %lu interrupts, %lu polls, poll budget %u, rings tx %u rx %u\n",
+                 i, q->cpu, q->stats.intrs, q->stats.polls,
+                 state->poll_budget, TXD_COUNT, RXD_COUNT);
+    nk_vc_printf("    tx %lu packets in %lu tail writes, rx %lu packets in %lu tail writes\n",
+                 q->stats.tx, q->stats.tx_tail_writes,
+                 q->stats.rx, q->stats.rx_tail_writes);
+  }
+}
+
+static int handle_e1000e(char * buf, void * priv)
+{
+  char name[DEV_NAME_LEN];
+  char mode[8];
+  struct e1000e_state *state;
+  struct list_head *cur;
+  uint32_t val;
+
+  if (sscanf(buf, "e1000e itr %s %u", name, &val) == 2) {
+    if (!(state = e1000e_find(name))) {
+      nk_vc_printf("no device %s\n", name);
+      return 0;
+    }
+    e1000e_set_itr(state, val);
+    e1000e_show(state);
+    return 0;
+  }
+
+  if (sscanf(buf, "e1000e batch %s %u", name, &val) == 2) {
+    if (!(state = e1000e_find(name))) {
+      nk_vc_printf("no device %s\n", name);
+      return 0;
+    }
+    state->tx_batch = val ? val : 1;
+    e1000e_show(state);
+    return 0;
+  }
+
+  if (sscanf(buf, "e1000e poll %s %7s %u", name, mode, &val) >= 2) {
+    if (!(state = e1000e_find(name))) {
+      nk_vc_printf("no device %s\n", name);
+      return 0;
+    }
+    if (sscanf(buf, "e1000e poll %s %7s %u", name, mode, &val) == 3) {
+      state->poll_budget = val ? val : 1;
+    }
+    if (!strcmp(mode, "on")) {
+      if (!e1000e_start_pollers(state)) {
+        state->poll = 1;
+      }
+    } else if (!strcmp(mode, "off")) {
+      state->poll = 0;
+      // pick up anything that arrived while the poller had us masked
+      WRITE_MEM(state, E1000E_IMS_OFFSET, state->ims_reg);
+    } else {
+      nk_vc_printf("poll mode is on or off\n");
+      return 0;
+    }
+    e1000e_show(state);
+    return 0;
+  }
+
+  if (sscanf(buf, "e1000e %s", name) == 1) {
+    if (!(state = e1000e_find(name))) {
+      nk_vc_printf("no device %s\n", name);
+      return 0;
+    }
+    e1000e_show(state);
+    return 0;
+  }
+
+  list_for_each(cur, &dev_list) {
+    e1000e_show(list_entry(cur, struct e1000e_state, node));
+  }
+  return 0;
+}
+
+static struct shell_cmd_impl e1000e_impl = {
+  .cmd      = "e1000e",
+  .help_str = "e1000e [dev] | e1000e itr dev ints/s | e1000e batch dev n\n"
+              "  e1000e poll dev on|off [budget]",
+  .handler  = handle_e1000e,
+};
+nk_register_shell_cmd(e1000e_impl);
+
 //
 // DEBUGGING AND TIMING ROUTINES FOLLOW
 //
@@ -1690,6 +2387,8 @@ static void e1000e_interpret_int_shell(struct e1000e_state* state)
 
 static void e1000e_interpret_rxd(struct e1000e_state* state)
 {
+  struct e1000e_queue *q = &state->queues[0];
+
   INFO("interpret rxd: head %d tail %d\n",
         READ_MEM(state, E1000E_RDH_OFFSET),
         READ_MEM(state, E1000E_RDT_OFFSET));
@@ -109,12 +109,74 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
 }
 
 
+static int map_blocks(void *state, uint64_t blocknum, uint64_t count, void **addr)
+{
+    struct ramdisk_state *s = (struct ramdisk_state *)state;
+
+    DEBUG("map_blocks on device %s starting at %lu for %lu blocks\n",
+	  s->blkdev->dev.name, blocknum, count);
+
+    // the data never moves, so no lock is needed
+    if (blocknum+count >= s->num_blocks) { 
+	ERROR("Illegal map past end of disk\n");
+	return -1;
+    }
+
+    *addr = s->data+blocknum*s->block_size;
+
+    return 0;
+}
+
+// All the copies of a batch happen under one lock acquisition, and
+// then all the callbacks run
+static int submit_batch(void *state, struct nk_block_dev_req **reqs, uint32_t n)
+{
+    STATE_LOCK_CONF;
+    struct ramdisk_state *s = (struct ramdisk_state *)state;
+    uint32_t i, j;
+
+    DEBUG("submit_batch on device %s of %u requests\n", s->blkdev->dev.name, n);
+
+    STATE_LOCK(s);
+    for (i = 0; i < n; i++) {
+	struct nk_block_dev_req *r = reqs[i];
+	uint8_t *cur = s->data + r->blocknum*s->block_size;
+
+	if (r->blocknum+r->count > s->num_blocks) {
+	    continue;
+	}
+	for (j = 0; j < r->nsegs; j++) {
+	    if (r->write) {
+		memcpy(cur,r->seg[j].addr,r->seg[j].len);
+	    } else {
+		memcpy(r->seg[j].addr,cur,r->seg[j].len);
+	    }
+	    cur += r->seg[j].len;
+	}
+    }
+    STATE_UNLOCK(s);
+
+    for (i = 0; i < n; i++) {
+	struct nk_block_dev_req *r = reqs[i];
+	if (r->blocknum+r->count > s->num_blocks) {
+	    ERROR("Illegal access past end of disk\n");
+	    r->callback(NK_BLOCK_DEV_STATUS_ERROR,r->context);
+	} else {
+	    r->callback(NK_BLOCK_DEV_STATUS_SUCCESS,r->context);
+	}
+    }
+
+    return n;
+}
+
 
 static struct nk_block_dev_int inter = 
 {
     .get_characteristics = get_characteristics,
     .read_blocks = read_blocks,
     .write_blocks = write_blocks,
+    .map_blocks = map_blocks,
+    .submit_batch = submit_batch,
 };
 
 static int discover_ramdisks()
@@ -26,6 +26,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/blkdev.h>
 #include <nautilus/irq.h>
+#include <nautilus/numa.h>
 
 #include <dev/pci.h>
 #include <dev/virtio_blk.h>
@@ -52,7 +53,6 @@
 
 #define VIRTIO_BLK_OFF_CONFIG(v)     (virtio_pci_device_regs_start_legacy(v) + 0)
 
-#define VIRTIO_BLK_REQUEST_QUEUE  0 // virtqueue index 
 
 #define VIRTIO_BLK_T_IN           0 // read request
 #define VIRTIO_BLK_T_OUT          1 // write request
@@ -91,6 +91,9 @@
 /* Device can toggle its cache between writeback andw ritethrough modes. */
 #define VIRTIO_BLK_F_CONFIG_WCE  	11   
 
+/* Device supports multiple request queues, count in "num_queues" */
+#define VIRTIO_BLK_F_MQ          	12
+
 /* Legacy Interface: Feature bits */
 
 /* Host supports request barriers */ 
@@ -102,11 +105,46 @@
 
 static uint64_t num_devs = 0;
 
+#define QUEUE_LOCK_CONF uint8_t _queue_lock_flags
+#define QUEUE_LOCK(q) _queue_lock_flags = spin_lock_irq_save(&(q)->lock)
+#define QUEUE_UNLOCK(q) spin_unlock_irq_restore(&(q)->lock, _queue_lock_flags)
+
+struct virtio_blk_req {
+    uint32_t type;      // read or write request
+    uint32_t reserved;  // write back feature
+    uint64_t sector;    // offset for read or write to occur
+};
+
+// Per-request state.  Each queue preallocates one of these for
+// each of its descriptors, and a request uses the one belonging to
+// the head descriptor of its chain, so there is nothing to allocate
+// or free per request.  With indirect descriptors, the whole chain
+// lives here too, and the request takes a single ring descriptor.
+struct virtio_blk_slot {
+    struct virtq_desc        indirect[NK_BLOCK_DEV_MAX_SEGS+2];
+    struct virtio_blk_req    hdr;
+    uint8_t                  status;      // written by device
+    void                     (*callback)(nk_block_dev_status_t, void *);
+    void                     *context;
+} __attribute__((aligned(16)));
+
+struct virtio_blk_queue {
+    struct virtio_blk_dev    *dev;
+    uint16_t                 qidx;        // virtqueue index
+    int                      cpu;         // where its interrupts go
+    spinlock_t               lock;        // serializes submitters
+    struct virtio_blk_slot   *slots;      // one per descriptor
+} __attribute__((aligned(64)));
+
 struct virtio_blk_dev {
     struct nk_block_dev         *blk_dev;     // nautilus block device
     struct virtio_pci_dev       *virtio_dev;  // nautilus pci device
     struct virtio_blk_config    *blk_config;  // virtio blk configuration
-    struct virtio_blk_callb     *blk_callb;   // virtio blk callbacks
+    int                         indirect;     // VIRTIO_F_INDIRECT_DESC negotiated
+    int                         event_idx;    // VIRTIO_F_EVENT_IDX negotiated
+    uint16_t                    num_queues;   // request queues in use
+    struct virtio_blk_queue     *queues;
+    uint16_t                    *cpu_queue;   // cpu -> queue
 };
 
 struct virtio_blk_config {
@@ -119,19 +157,7 @@ struct virtio_blk_config {
         uint8_t sectors;
     } geometry;         // device geometry 
     uint32_t blk_size;  // optimal sector size
-};
-
-struct virtio_blk_req {
-    uint32_t type;      // read or write request
-    uint32_t reserved;  // write back feature
-    uint64_t sector;    // offset for read or write to occur
-    uint8_t *data;      // ... not used
-    uint8_t status;     // written by device
-};
-
-struct virtio_blk_callb {
-    void *context;
-    void (*callback)(nk_block_dev_status_t, void *);
+    uint16_t num_queues; // number of request queues
 };
 
 /************************************************************
@@ -151,114 +177,199 @@ static int get_characteristics(void *state, struct nk_block_dev_characteristics
     return 0;
 }
 
-static void fill_hdr_desc(struct virtq *vq, struct virtio_blk_req *hdr, uint16_t hdr_index, uint16_t buf_index)
+static void fill_desc(struct virtq_desc *desc, void *addr, uint32_t len, uint16_t flags, uint16_t next)
+{
+    desc->addr = (uint64_t) addr;
+    desc->len = len;
+    desc->flags = flags;
+    desc->next = next;
+}
+
+// header, buffer(s), status chain, either in the ring (next = ring indices)
+// or in an indirect table (next = table indices)
+static void fill_chain(struct virtq_desc *table, uint16_t *idx, struct virtio_blk_slot *slot, struct nk_block_dev_seg *seg, uint32_t nsegs, uint8_t write)
 {
-    struct virtq_desc *hdr_desc = &vq->desc[hdr_index];
+    uint32_t i;
 
-    hdr_desc->addr = (uint64_t) hdr;
-    hdr_desc->len = HEADER_DESC_LEN;
-    hdr_desc->flags = 0;
-    hdr_desc->next = buf_index;
-    hdr_desc->flags |= VIRTQ_DESC_F_NEXT;
+    fill_desc(&table[idx[0]], &slot->hdr, HEADER_DESC_LEN, VIRTQ_DESC_F_NEXT, idx[1]);
+    for (i = 0; i < nsegs; i++) {
+        fill_desc(&table[idx[i+1]], seg[i].addr, seg[i].len, VIRTQ_DESC_F_NEXT | (write ? 0 : VIRTQ_DESC_F_WRITE), idx[i+2]);
+    }
+    fill_desc(&table[idx[nsegs+1]], &slot->status, STATUS_DESC_LEN, VIRTQ_DESC_F_WRITE, 0);
+}
+
+static inline struct virtio_blk_queue *select_queue(struct virtio_blk_dev *dev)
+{
+    return &dev->queues[dev->cpu_queue[my_cpu_id()]];
 }
 
-static void fill_buf_desc(struct virtq *vq, uint32_t size, uint64_t count, uint8_t *dest, uint16_t buf_index, uint16_t stat_index, uint8_t write)
+// Does the device want to hear about the buffers we just made available?
+static int need_kick(struct virtio_blk_dev *dev, struct virtq *vq, uint16_t old_idx, uint16_t new_idx)
 {
-    struct virtq_desc *buf_desc = &vq->desc[buf_index];
+    // the new avail index must be visible before we look at what the device wants
+    mbarrier();
 
-    buf_desc->addr = (uint64_t) dest;
-    buf_desc->len = size * count;
-    buf_desc->flags |= write ? 0 : VIRTQ_DESC_F_WRITE;
-    buf_desc->next = stat_index;
-    buf_desc->flags |= VIRTQ_DESC_F_NEXT;
+    if (dev->event_idx) {
+        return virtq_need_event(*virtq_avail_event(vq), new_idx, old_idx);
+    } else {
+        return !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
 }
 
-static void fill_stat_desc(struct virtq *vq, uint8_t *status, uint16_t stat_index)
+// Build a request in the queue's descriptors, returning the head of
+// its chain.  The caller holds the queue lock and makes it available.
+static int build_request(struct virtio_blk_dev *dev, struct virtio_blk_queue *q, struct virtq *vq, uint8_t write, uint64_t blocknum, struct nk_block_dev_seg *seg, uint32_t nsegs, void (*callback)(nk_block_dev_status_t, void *), void *context, uint16_t *head)
 {
-    struct virtq_desc *stat_desc = &vq->desc[stat_index];
+    struct virtio_blk_slot *slot;
+    uint16_t desc[NK_BLOCK_DEV_MAX_SEGS+2];
+    uint32_t i;
 
-    stat_desc->addr = (uint64_t) status;  
-    stat_desc->flags = 0;
-    stat_desc->flags |= VIRTQ_DESC_F_WRITE;
-    stat_desc->len = STATUS_DESC_LEN;
-    stat_desc->next = 0;
+    if (dev->indirect) {
+        if (virtio_pci_desc_alloc(dev->virtio_dev,q->qidx,head)) {
+            return -1;
+        }
+        slot = &q->slots[*head];
+        for (i = 0; i < nsegs + 2; i++) {
+            desc[i] = i;
+        }
+        fill_chain(slot->indirect, desc, slot, seg, nsegs, write);
+        fill_desc(&vq->desc[*head], slot->indirect, (nsegs + 2) * sizeof(struct virtq_desc), VIRTQ_DESC_F_INDIRECT, 0);
+    } else {
+        if (virtio_pci_desc_chain_alloc(dev->virtio_dev,q->qidx,desc,nsegs+2)) {
+            return -1;
+        }
+        *head = desc[0];
+        slot = &q->slots[*head];
+        fill_chain(vq->desc, desc, slot, seg, nsegs, write);
+    }
+
+    slot->hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    slot->hdr.reserved = 0;
+    slot->hdr.sector = blocknum;
+    slot->status = 0;
+    slot->callback = callback;
+    slot->context = context;
+
+    DEBUG("request in head index %u\n", *head);
+
+    return 0;
+}
+
+// beyond capacity, writing a read-only device, or too many segments
+// (for the device, or to ever fit in the ring as a direct chain)
+static int request_valid(struct virtio_blk_dev *dev, uint8_t write, uint64_t blocknum, uint64_t count, uint32_t nsegs)
+{
+    return blocknum + count <= dev->blk_config->capacity &&
+        !(write && FBIT_ISSET(dev->virtio_dev->feat_accepted,VIRTIO_BLK_F_RO)) &&
+        nsegs && nsegs <= NK_BLOCK_DEV_MAX_SEGS &&
+        !(dev->blk_config->seg_max && nsegs > dev->blk_config->seg_max) &&
+        (dev->indirect || nsegs + 2 <= dev->virtio_dev->virtq[0].vq.qsz);
 }
 
 static int read_write_blocks(struct virtio_blk_dev *dev, uint64_t blocknum, uint64_t count, uint8_t *src_dest, void (*callback)(nk_block_dev_status_t, void *), void *context, uint8_t write) 
 {
+    QUEUE_LOCK_CONF;
+    struct virtio_blk_queue *q;
+    struct virtq *vq;
+    struct nk_block_dev_seg seg = { .addr = src_dest, .len = dev->blk_config->blk_size * count };
+    uint16_t head, old_idx;
+    int kick;
+
     DEBUG("%s blocknum = %lu count = %lu buf = %p callback = %p context = %p\n", write ? "write" : "read", blocknum, count, src_dest, callback, context);
     
-    if (blocknum + count > dev->blk_config->capacity) {
-        ERROR("request goes beyond device capacity\n");
+    if (!request_valid(dev, write, blocknum, count, 1)) {
+        ERROR("invalid %s of %lu blocks at %lu\n", write ? "write" : "read", count, blocknum);
         return -1;
     }
 
-    if (write && (FBIT_ISSET(dev->virtio_dev->feat_accepted,VIRTIO_BLK_F_RO))) {
-	ERROR("attempt to write read-only device\n");
-	return -1;
-    }
+    q = select_queue(dev);
+    vq = &dev->virtio_dev->virtq[q->qidx].vq;
 
-    DEBUG("[build request header]\n");
+    QUEUE_LOCK(q);
 
-    struct virtio_blk_req *hdr = malloc(sizeof(struct virtio_blk_req));
+    DEBUG("[allocate descriptors on queue %u]\n", q->qidx);
 
-    if (!hdr) {
-	ERROR("Failed to allocate request header\n");
-	return -1;
+    if (build_request(dev, q, vq, write, blocknum, &seg, 1, callback, context, &head)) {
+        QUEUE_UNLOCK(q);
+        ERROR("Failed to allocate descriptors\n");
+        return -1;
     }
-    
-    memset(hdr, 0, sizeof(struct virtio_blk_req));
 
-    hdr->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    hdr->sector = blocknum;
-    hdr->reserved = 0;
-    hdr->status = 0;
+    // update avail ring
+    old_idx = vq->avail->idx;
+    vq->avail->ring[old_idx % vq->qsz] = head;
+    mbarrier();
+    vq->avail->idx = old_idx + 1;
 
-    DEBUG("[allocate descriptors]\n");
+    kick = need_kick(dev, vq, old_idx, old_idx + 1);
 
-    uint16_t desc[3];
+    QUEUE_UNLOCK(q);
 
-    if (virtio_pci_desc_chain_alloc(dev->virtio_dev,VIRTIO_BLK_REQUEST_QUEUE,desc,3)) {
-	ERROR("Failed to allocate descriptor chain\n");
-	free(hdr);
-	return -1;
+    if (kick) {
+        DEBUG("[notify device]\n");
+        virtio_pci_virtqueue_notify(dev->virtio_dev, q->qidx);
     }
     
-    uint16_t hdr_index = desc[0];
-    uint16_t buf_index = desc[1];
-    uint16_t stat_index = desc[2];
+    return 0;
+}
 
-    struct virtq *vq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq;
+// Put as many of the requests as fit in the avail ring, then publish
+// them and notify the device once for all of them
+static int submit_batch(void *state, struct nk_block_dev_req **reqs, uint32_t n)
+{
+    QUEUE_LOCK_CONF;
+    struct virtio_blk_dev *dev = (struct virtio_blk_dev *) state;
+    struct virtio_blk_queue *q = select_queue(dev);
+    struct virtq *vq = &dev->virtio_dev->virtq[q->qidx].vq;
+    uint16_t head, old_idx, idx;
+    uint32_t i, j;
+    int kick = 0;
 
-    DEBUG("[create descriptors]\n");
+    DEBUG("submitting batch of %u requests on queue %u\n", n, q->qidx);
 
-    DEBUG("[create header descriptor]\n");
-    fill_hdr_desc(vq, hdr, hdr_index, buf_index);
+    QUEUE_LOCK(q);
 
-    DEBUG("[create buffer descriptor]\n");
-    fill_buf_desc(vq, dev->blk_config->blk_size, count, src_dest, buf_index, stat_index, write);
+    old_idx = idx = vq->avail->idx;
 
-    DEBUG("[create status descriptor]\n");
-    fill_stat_desc(vq, &hdr->status, stat_index);
+    for (i = 0; i < n; i++) {
+        struct nk_block_dev_req *r = reqs[i];
 
-    dev->blk_callb[hdr_index].callback = callback;
-    dev->blk_callb[hdr_index].context = context;
+        if (!request_valid(dev, r->write, r->blocknum, r->count, r->nsegs)) {
+            // failed below, once we are out of the lock
+            continue;
+        }
 
-    DEBUG("request in indexes: header = %d, buffer = %d, status = %d\n", hdr_index, buf_index, stat_index);
+        if (build_request(dev, q, vq, r->write, r->blocknum, r->seg, r->nsegs, r->callback, r->context, &head)) {
+            DEBUG("queue %u full after %u requests\n", q->qidx, i);
+            break;
+        }
 
-    // update avail ring
-    vq->avail->ring[vq->avail->idx % vq->qsz] = hdr_index;
-    mbarrier();
-    vq->avail->idx++;
-    mbarrier();
-    
-    DEBUG("available ring's hdr index = %d, at ring index %d\n", hdr_index, vq->avail->idx - 1);
-    DEBUG("available ring's ring index for next hdr = %u\n", vq->avail->idx);
+        vq->avail->ring[idx % vq->qsz] = head;
+        idx++;
+    }
 
-    DEBUG("[notify device]\n");
-    virtio_pci_write_regw(dev->virtio_dev, QUEUE_NOTIFY, VIRTIO_BLK_REQUEST_QUEUE);
-    
-    return 0;
+    if (idx != old_idx) {
+        mbarrier();
+        vq->avail->idx = idx;
+        kick = need_kick(dev, vq, old_idx, idx);
+    }
+
+    QUEUE_UNLOCK(q);
+
+    if (kick) {
+        DEBUG("[notify device]\n");
+        virtio_pci_virtqueue_notify(dev->virtio_dev, q->qidx);
+    }
+
+    for (j = 0; j < i; j++) {
+        struct nk_block_dev_req *r = reqs[j];
+        if (!request_valid(dev, r->write, r->blocknum, r->count, r->nsegs)) {
+            ERROR("invalid %s of %lu blocks at %lu\n", r->write ? "write" : "read", r->count, r->blocknum);
+            r->callback(NK_BLOCK_DEV_STATUS_ERROR, r->context);
+        }
+    }
+
+    return i;
 }
 
 static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(nk_block_dev_status_t, void *), void *context)
@@ -279,6 +390,7 @@ static struct nk_block_dev_int ops = {
     .get_characteristics = get_characteristics,
     .read_blocks = read_blocks,
     .write_blocks = write_blocks,
+    .submit_batch = submit_batch,
 };
 
 /************************************************************
@@ -290,89 +402,112 @@ static void teardown(struct virtio_pci_dev *dev)
     virtio_pci_virtqueue_deinit(dev);
 }
 
-static int process_used_ring(struct virtio_blk_dev *dev) 
+static int process_used_ring(struct virtio_blk_queue *q) 
 {
-    uint16_t hdr_desc_idx; 
+    struct virtio_blk_dev *dev = q->dev;
+    struct virtio_pci_virtq *virtq = &dev->virtio_dev->virtq[q->qidx];
+    struct virtq *vq = &virtq->vq;
     void (*callback)(nk_block_dev_status_t, void *);
     void *context;
-    struct virtio_pci_virtq *virtq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE];
-    struct virtq *vq = &dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq;
+    uint16_t head;
+    uint8_t status;
      
-    DEBUG("[processing used ring]\n");
+    DEBUG("[processing used ring of queue %u]\n", q->qidx);
     DEBUG("current virtq used index = %d\n", virtq->vq.used->idx);
     DEBUG("last seen used index = %d\n", virtq->last_seen_used);
-     
-    for (; virtq->last_seen_used != virtq->vq.used->idx; virtq->last_seen_used++) {
+
+    while (1) {
+        for (; virtq->last_seen_used != vq->used->idx; virtq->last_seen_used++) {
 	
-	// grab the head of used descriptor chain
-	hdr_desc_idx = vq->used->ring[virtq->last_seen_used % virtq->vq.qsz].id;
+            // grab the head of used descriptor chain
+            head = vq->used->ring[virtq->last_seen_used % vq->qsz].id;
 	 
-	if (vq->desc[hdr_desc_idx].flags != VIRTQ_DESC_F_NEXT)  {
-	    ERROR("Huh? head in the used ring is not a header descriptor\n");
-	    return -1;
-	}
-	 
-	struct virtq_desc *hdr_desc = &vq->desc[hdr_desc_idx];
-	struct virtio_blk_req *hdr = (struct virtio_blk_req *)hdr_desc->addr;
-	uint8_t status = hdr->status;
+            if (head >= vq->qsz) {
+                ERROR("Huh? used ring entry %u is not a descriptor\n", head);
+                return -1;
+            }
+
+            struct virtio_blk_slot *slot = &q->slots[head];
+
+            status = slot->status;
+            callback = slot->callback;
+            context = slot->context;
+            slot->callback = 0;
+            slot->context = 0;
 	 
-	DEBUG("completion for descriptor at index %d with status: %d\n", hdr_desc_idx, status);
+            DEBUG("completion for descriptor at index %d with status: %d\n", head, status);
 	 
-	// grab corresponding callback
-	callback = dev->blk_callb[hdr_desc_idx].callback;
-	context = dev->blk_callb[hdr_desc_idx].context;
+            if (virtio_pci_desc_chain_free(dev->virtio_dev, q->qidx, head)) {
+                ERROR("error freeing descriptors\n");
+                return -1;
+            }
 	 
-	memset(&dev->blk_callb[hdr_desc_idx],0,sizeof(dev->blk_callb[hdr_desc_idx]));
-	 
-	free(hdr);
+            if (callback) {
+                DEBUG("[issuing callback]\n");
+                callback(status ? NK_BLOCK_DEV_STATUS_ERROR : NK_BLOCK_DEV_STATUS_SUCCESS,context);
+            }
+        }
 
-	DEBUG("descriptor hdr index = %u, callback = %p, context = %p\n", hdr_desc_idx, callback, context);
-	 
-	DEBUG("free used descriptors\n");
+        if (!dev->event_idx) {
+            break;
+        }
 
-	if (virtio_pci_desc_chain_free(dev->virtio_dev, VIRTIO_BLK_REQUEST_QUEUE, hdr_desc_idx)) {
-	    ERROR("error freeing descriptors\n");
-	    return -1;
-	}
-	 
-	if (callback) {
-	    DEBUG("[issuing callback]\n");
-	    callback(status ? NK_BLOCK_DEV_STATUS_ERROR : NK_BLOCK_DEV_STATUS_SUCCESS,context);
-	}
+        // Ask for an interrupt only when the device gets past what we
+        // have processed, then recheck in case it already has.  Under
+        // load, we take one interrupt per batch instead of per request.
+        *virtq_used_event(vq) = virtq->last_seen_used;
+        mbarrier();
+
+        if (virtq->last_seen_used == vq->used->idx) {
+            break;
+        }
     }
      
     return 0;
 }
 
+// MSI-X - one vector per queue
+static int queue_handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
+{
+    struct virtio_blk_queue *q = (struct virtio_blk_queue *) priv_data;
+
+    DEBUG("[received an interrupt for queue %u]\n", q->qidx);
+
+    if (process_used_ring(q)) {
+	ERROR("failed to process used ring\n");
+	IRQ_HANDLER_END();
+	return -1;
+    }
+
+    IRQ_HANDLER_END();
+    return 0;
+}
+
+// legacy - one interrupt for all queues
 static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
 {
     DEBUG("[received an interrupt!]\n");
     struct virtio_blk_dev *dev = (struct virtio_blk_dev *) priv_data;
+    uint16_t i;
     
-    // only for legacy style interrupt
-    if (dev->virtio_dev->itype == VIRTIO_PCI_LEGACY_INTERRUPT) {
-        DEBUG("using legacy style interrupt\n");
-        // read the interrupt status register, which will reset it to zero
-        uint8_t isr = virtio_pci_read_regb(dev->virtio_dev, ISR_STATUS);
+    DEBUG("using legacy style interrupt\n");
+    // read the interrupt status register, which will reset it to zero
+    uint8_t isr = virtio_pci_read_regb(dev->virtio_dev, ISR_STATUS);
 	
-        // if the lower bit is not set, not my interrupt
-        if (!(isr & 0x1))  {
-	    DEBUG("not my interrupt\n");
-	    IRQ_HANDLER_END();
-	    return 0;
-        }
+    // if the lower bit is not set, not my interrupt
+    if (!(isr & 0x1))  {
+        DEBUG("not my interrupt\n");
+        IRQ_HANDLER_END();
+        return 0;
     }
     
-    if (process_used_ring(dev)) {
-	ERROR("failed to process used ring\n");
-	IRQ_HANDLER_END();
-	return -1;
-    } 
-
-    // print used for test
-    //DEBUG("free count after = %d\n", dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].nfree);
-    //uint8_t used_index = dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].vq.used->idx;
-    //DEBUG("used ring next index = %d\n", used_index);
+    for (i = 0; i < dev->num_queues; i++) {
+        if (process_used_ring(&dev->queues[i])) {
+            ERROR("failed to process used ring\n");
+            IRQ_HANDLER_END();
+            return -1;
+        }
+    }
 
     DEBUG("[interrupt handler finished]\n");
     IRQ_HANDLER_END();
@@ -404,7 +539,7 @@ static int test_read(struct virtio_blk_dev *dev)
 	return -1;
     }
     
-    DEBUG("free count before = %d\n", dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].nfree);
+    DEBUG("free count before = %d\n", dev->virtio_dev->virtq[0].nfree);
     
     uint16_t i;
     for (i = 0; i < 16; i++) {
@@ -443,7 +578,7 @@ static int test_write(struct virtio_blk_dev *dev)
 	return -1;
     }
     
-    DEBUG("free count before = %d\n", dev->virtio_dev->virtq[VIRTIO_BLK_REQUEST_QUEUE].nfree);
+    DEBUG("free count before = %d\n", dev->virtio_dev->virtq[0].nfree);
     
     memset(src, 1, count * blk_size);
 
@@ -484,6 +619,7 @@ uint64_t select_features(uint64_t features)
     DEBUG_FBIT(features, VIRTIO_BLK_F_FLUSH);
     DEBUG_FBIT(features, VIRTIO_BLK_F_TOPOLOGY);
     DEBUG_FBIT(features, VIRTIO_BLK_F_CONFIG_WCE);
+    DEBUG_FBIT(features, VIRTIO_BLK_F_MQ);
     DEBUG_FBIT(features, VIRTIO_BLK_F_BARRIER);
     DEBUG_FBIT(features, VIRTIO_BLK_F_SCSI);
     DEBUG_FBIT(features, VIRTIO_F_NOTIFY_ON_EMPTY);
@@ -499,6 +635,9 @@ uint64_t select_features(uint64_t features)
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_GEOMETRY);
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_RO);
     FBIT_SETIF(accepted,features,VIRTIO_BLK_F_BLK_SIZE);
+    FBIT_SETIF(accepted,features,VIRTIO_BLK_F_MQ);
+    FBIT_SETIF(accepted,features,VIRTIO_F_INDIRECT_DESC);
+    FBIT_SETIF(accepted,features,VIRTIO_F_EVENT_IDX);
     
     DEBUG("features accepted: 0x%0lx\n", accepted);
     return accepted;
@@ -512,22 +651,27 @@ static void parse_config(struct virtio_blk_dev *d)
     
     // must have capacity...
     d->blk_config->capacity = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 0);
-    if (dev->feat_accepted & VIRTIO_BLK_F_SIZE_MAX) { 
+    if (FBIT_ISSET(dev->feat_accepted,VIRTIO_BLK_F_SIZE_MAX)) { 
 	d->blk_config->size_max = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 8);
     }
-    if (dev->feat_accepted & VIRTIO_BLK_F_SEG_MAX) { 
+    if (FBIT_ISSET(dev->feat_accepted,VIRTIO_BLK_F_SEG_MAX)) { 
 	d->blk_config->seg_max = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 12);
     }
-    if (dev->feat_accepted & VIRTIO_BLK_F_GEOMETRY) { 
-	d->blk_config->geometry.cylinders = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 16);
+    if (FBIT_ISSET(dev->feat_accepted,VIRTIO_BLK_F_GEOMETRY)) { 
+	d->blk_config->geometry.cylinders = virtio_pci_read_regw(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 16);
 	d->blk_config->geometry.heads = virtio_pci_read_regb(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 18);
 	d->blk_config->geometry.sectors = virtio_pci_read_regb(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 19);
     }
-    if (dev->feat_accepted & VIRTIO_BLK_F_BLK_SIZE) { 
+    if (FBIT_ISSET(dev->feat_accepted,VIRTIO_BLK_F_BLK_SIZE)) { 
 	d->blk_config->blk_size = virtio_pci_read_regl(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 20);
     } else {
 	d->blk_config->blk_size = 512; // presumably...
     }
+    if (FBIT_ISSET(dev->feat_accepted,VIRTIO_BLK_F_MQ)) { 
+	d->blk_config->num_queues = virtio_pci_read_regw(dev, VIRTIO_BLK_OFF_CONFIG(dev) + 34);
+    } else {
+	d->blk_config->num_queues = 1;
+    }
     
     DEBUG("block device configuration layout\n");
     DEBUG("capacity           = %d\n", d->blk_config->capacity);
@@ -537,6 +681,114 @@ static void parse_config(struct virtio_blk_dev *d)
     DEBUG("geometry_heads     = %d\n", d->blk_config->geometry.heads);
     DEBUG("geometry_sectors   = %d\n", d->blk_config->geometry.sectors);
     DEBUG("blk_size           = %d\n", d->blk_config->blk_size);
+    DEBUG("num_queues         = %d\n", d->blk_config->num_queues);
+}
+
+// Decide how many request queues to use, and which CPUs use which
+// queue.  We use one queue per CPU (or per NUMA domain), as far as
+// the device, our virtqueue setup, and the interrupt vectors allow.
+static int setup_queues(struct virtio_blk_dev *d)
+{
+    struct virtio_pci_dev *dev = d->virtio_dev;
+    struct sys_info *sys = per_cpu_get(system);
+    uint16_t nq = d->blk_config->num_queues;
+    uint16_t i;
+    int c;
+
+#ifdef NAUT_CONFIG_VIRTIO_BLK_QUEUE_PER_NODE
+    uint16_t want = nk_get_num_domains();
+#else
+    uint16_t want = sys->num_cpus;
+#endif
+
+    if (nq > dev->num_virtqs) {
+        nq = dev->num_virtqs;
+    }
+    if (nq > want) {
+        nq = want;
+    }
+    if (dev->itype==VIRTIO_PCI_MSI_X_INTERRUPT && nq > dev->pci_dev->msix.size) {
+        nq = dev->pci_dev->msix.size;
+    }
+    if (!nq) {
+        nq = 1;
+    }
+
+    d->num_queues = nq;
+    d->queues = malloc(nq * sizeof(struct virtio_blk_queue));
+    d->cpu_queue = malloc(sys->num_cpus * sizeof(uint16_t));
+
+    if (!d->queues || !d->cpu_queue) {
+        ERROR("cannot allocate queues\n");
+        goto out_err;
+    }
+
+    memset(d->queues, 0, nq * sizeof(struct virtio_blk_queue));
+
+    for (i = 0; i < nq; i++) {
+        struct virtio_blk_queue *q = &d->queues[i];
+        uint16_t qsz = dev->virtq[i].vq.qsz;
+
+        q->dev = d;
+        q->qidx = i;
+        q->cpu = -1;
+        spinlock_init(&q->lock);
+
+        q->slots = malloc(qsz * sizeof(struct virtio_blk_slot));
+        if (!q->slots) {
+            ERROR("cannot allocate request slots for queue %u\n", i);
+            goto out_err;
+        }
+        memset(q->slots, 0, qsz * sizeof(struct virtio_blk_slot));
+    }
+
+    for (c = 0; c < sys->num_cpus; c++) {
+#ifdef NAUT_CONFIG_VIRTIO_BLK_QUEUE_PER_NODE
+        i = (sys->cpus[c]->domain ? sys->cpus[c]->domain->id : 0) % nq;
+#else
+        i = c % nq;
+#endif
+        d->cpu_queue[c] = i;
+        // the queue's interrupts go to the first CPU that uses it
+        if (d->queues[i].cpu < 0) {
+            d->queues[i].cpu = c;
+        }
+    }
+
+    for (i = 0; i < nq; i++) {
+        if (d->queues[i].cpu < 0) {
+            d->queues[i].cpu = 0;
+        }
+    }
+
+    return 0;
+
+ out_err:
+    if (d->queues) {
+        for (i = 0; i < nq; i++) {
+            if (d->queues[i].slots) {
+                free(d->queues[i].slots);
+            }
+        }
+        free(d->queues);
+        d->queues = 0;
+    }
+    if (d->cpu_queue) {
+        free(d->cpu_queue);
+        d->cpu_queue = 0;
+    }
+    return -1;
+}
+
+static void free_queues(struct virtio_blk_dev *d)
+{
+    uint16_t i;
+
+    for (i = 0; i < d->num_queues; i++) {
+        free(d->queues[i].slots);
+    }
+    free(d->queues);
+    free(d->cpu_queue);
 }
 
 int virtio_blk_init(struct virtio_pci_dev *dev)
@@ -589,33 +841,30 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
     dev->state = d;
     dev->teardown = teardown;
     d->virtio_dev = dev;
-    
-    // allocate callback array
-    d->blk_callb = malloc(dev->virtq[0].vq.qsz * sizeof(struct virtio_blk_callb));
-    
-    DEBUG("allocated %d callbacks at %p\n", dev->virtq[0].vq.qsz, d->blk_callb);
-    
-    if (!d->blk_callb) {
-	ERROR("failed to allocate callback array\n");
-	virtio_pci_virtqueue_deinit(dev);
-	free(d);
-	return -1;
-    }
+    d->indirect = FBIT_ISSET(dev->feat_accepted, VIRTIO_F_INDIRECT_DESC) ? 1 : 0;
+    d->event_idx = FBIT_ISSET(dev->feat_accepted, VIRTIO_F_EVENT_IDX) ? 1 : 0;
     
     // allocate virtio block configuration
     d->blk_config = malloc(sizeof(struct virtio_blk_config));
     
-    DEBUG("allocated virtio block config struct at %p for %hhx bytes\n", d->blk_callb, sizeof(struct virtio_blk_config));
+    DEBUG("allocated virtio block config struct at %p for %hhx bytes\n", d->blk_config, sizeof(struct virtio_blk_config));
     
     if (!d->blk_config) {
 	ERROR("failed to allocate virtio block config struct\n");
 	virtio_pci_virtqueue_deinit(dev);
-	free(d->blk_callb);
 	free(d);
 	return -1;
     }
     
     parse_config(d);
+
+    if (setup_queues(d)) {
+	ERROR("failed to set up request queues\n");
+	virtio_pci_virtqueue_deinit(dev);
+	free(d->blk_config);
+	free(d);
+	return -1;
+    }
     
     // register virtio block device
     snprintf(buf,DEV_NAME_LEN,"virtio-blk%u",__sync_fetch_and_add(&num_devs,1));
@@ -624,11 +873,15 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
     if (!d->blk_dev) {
 	ERROR("failed to register block device\n");
 	virtio_pci_virtqueue_deinit(dev);
+	free_queues(d);
 	free(d->blk_config);
-	free(d->blk_callb);
 	free(d);
 	return -1;
     }
+
+    INFO("%s: %u request queue(s)%s%s\n", buf, d->num_queues,
+         d->indirect ? ", indirect descriptors" : "",
+         d->event_idx ? ", event index" : "");
     
     // We assume that interrupt allocations will not fail...
     // if we do fail, the rest of this code will leak
@@ -645,19 +898,9 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 
 	DEBUG("setting up interrupts via MSI-X\n");
 	
-	if (dev->num_virtqs != p->msix.size) {
-	    ERROR("weird mismatch: numqueues=%u msixsize=%u\n", dev->num_virtqs, p->msix.size);
-	    // continue for now...
-	    // return -1;
-	}
-	
-	// this should really go by virtqueue, not entry
-	// and ideally pulled into a per-queue setup routine
-	// in virtio_pci...
-	uint16_t num_vec = p->msix.size;
-        
-	// now fill out the device's MSI-X table
-	for (i=0;i<num_vec;i++) {
+	// one vector per request queue, delivered to a CPU that uses the queue
+	for (i=0;i<d->num_queues;i++) {
+	    struct virtio_blk_queue *q = &d->queues[i];
 	    // find a free vector
 	    // note that prioritization here is your problem
 	    if (idt_find_and_reserve_range(1,0,&vec)) {
@@ -665,13 +908,13 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 		return -1;
 	    }
 	    // register your handler for that vector
-	    if (register_int_handler(vec, handler, d)) {
+	    if (register_int_handler(vec, queue_handler, q)) {
 		ERROR("failed to register int handler\n");
 		return -1;
 		// failed....
 	    }
 	    // set the table entry to point to your handler
-	    if (pci_dev_set_msi_x_entry(p,i,vec,0)) {
+	    if (pci_dev_set_msi_x_entry(p,i,vec,q->cpu)) {
 		ERROR("failed to set MSI-X entry\n");
 		return -1;
 	    }
@@ -680,7 +923,7 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 		ERROR("failed to unmask entry\n");
 		return -1;
 	    }
-	    DEBUG("finished setting up entry %d for vector %u on cpu 0\n",i,vec);
+	    DEBUG("finished setting up entry %d for vector %u on cpu %d\n",i,vec,q->cpu);
 	}
 	
 	// unmask entire function
@@ -710,6 +953,11 @@ int virtio_blk_init(struct virtio_pci_dev *dev)
 	
     }
     
+    if (virtio_pci_start_device(dev)) {
+	ERROR("failed to start device\n");
+	return -1;
+    }
+
     DEBUG("device inited\n");
     
     /*************************************************
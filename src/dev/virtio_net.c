@@ -27,6 +27,7 @@
 #include <nautilus/netdev.h>
 #include <nautilus/irq.h>
 #include <nautilus/backtrace.h>
+#include <nautilus/scheduler.h>
 
 #include <dev/pci.h>
 #include <dev/virtio_net.h>
@@ -54,14 +55,16 @@
 #define MIN_TU 48
 #define MAX_TU 1522
 
-// virtqueue indices
-#define VIRTIO_NET_RECVQ_IDX  0
-#define VIRTIO_NET_SENDQ_IDX  1
-#define VIRTIO_NET_CTRLQ_IDX  2
+// virtqueue indices - with multiqueue, pair i uses 2i (receive)
+// and 2i+1 (send), and the control queue follows the last pair
+// the device supports
+#define VIRTIO_NET_RECVQ_IDX(pair)  (2*(pair))
+#define VIRTIO_NET_SENDQ_IDX(pair)  (2*(pair)+1)
 
 // legacy register offsets
 #define VIRTIO_NET_OFF_MAC(v)     (virtio_pci_device_regs_start_legacy(v) + 0)
 #define VIRTIO_NET_OFF_STATUS(v)  (virtio_pci_device_regs_start_legacy(v) + 6)
+#define VIRTIO_NET_OFF_MAX_PAIRS(v) (virtio_pci_device_regs_start_legacy(v) + 8)
 
 // feature bits
 
@@ -140,24 +143,87 @@ struct virtio_net_hdr {
     uint16_t csum_offset;
 } __packed;
 
+// the header used in both directions once MRG_RXBUF is negotiated
+struct virtio_net_hdr_mrg {
+    struct virtio_net_hdr hdr;
+    uint16_t num_buffers;
+} __packed;
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM  1
+#define VIRTIO_NET_HDR_F_DATA_VALID  2
+
+#define VIRTIO_NET_HDR_GSO_NONE      0
+#define VIRTIO_NET_HDR_GSO_TCPV4     1
+
+// largest frame the device will segment for us
+#define MAX_TSO 65535
+
+// control virtqueue commands
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
+} __packed;
+
+#define VIRTIO_NET_CTRL_OK                0
+#define VIRTIO_NET_CTRL_MQ                4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET   0
+
+// how long to wait for the device to answer a control command
+#define CTRL_TIMEOUT_NS 1000000000ULL
+
 
 // our state
 
 static uint64_t num_devs=0;
 
-struct callback_info {
-    void *context;
-    void (*callback)(nk_net_dev_status_t status, void *context);
-};
+#define QUEUE_LOCK_CONF uint8_t _queue_lock_flags
+#define QUEUE_LOCK(q) _queue_lock_flags = spin_lock_irq_save(&(q)->lock)
+#define QUEUE_UNLOCK(q) spin_unlock_irq_restore(&(q)->lock, _queue_lock_flags)
+
+// Per-packet state.  Each queue preallocates one of these for each
+// of its descriptors, and a packet uses the one belonging to the head
+// of its chain, so the virtio header needs no allocation.
+struct virtio_net_slot {
+    struct virtio_net_hdr_mrg   hdr;
+    void                        (*callback)(nk_net_dev_status_t status, void *context);
+    void                        *context;
+    struct nk_net_dev_pkt_info  *info;     // receive only
+} __attribute__((aligned(16)));
+
+struct virtio_net_queue {
+    struct virtio_net_dev    *dev;
+    uint16_t                 qidx;      // virtqueue index
+    int                      recv;
+    int                      cpu;       // where its interrupts go
+    spinlock_t               lock;      // serializes posters
+    uint64_t                 posted;    // buffers the device holds
+    uint16_t                 drop;      // buffers left of a packet being dropped
+    struct virtio_net_slot   *slots;    // one per descriptor
+} __attribute__((aligned(64)));
 
 struct virtio_net_dev {
     struct nk_net_dev     *net_dev;
     struct virtio_pci_dev *virtio_dev;
 
     uint8_t mac[ETHER_MAC_LEN];
-    struct callback_info *callbacks[2];
-};
 
+    uint16_t hdr_len;        // size of the virtio header we use
+    int      mrg_rxbuf;      // VIRTIO_NET_F_MRG_RXBUF negotiated
+    uint64_t offloads;       // NK_NET_DEV_OFFLOAD_*
+
+    uint16_t num_pairs;      // queue pairs set up
+    uint16_t active_pairs;   // queue pairs the device is using
+    uint16_t max_pairs;      // queue pairs the device has
+    struct virtio_net_queue *queues;   // recv0, send0, recv1, send1, ...
+    uint16_t *cpu_pair;      // cpu -> queue pair
+
+    int      ctrlq;          // control virtqueue index, -1 if none
+    struct {
+        struct virtio_net_ctrl_hdr hdr;
+        uint8_t                    data[8];
+        uint8_t                    ack;
+    } __packed ctrl;
+};
 
 // interface to kernel
 
@@ -179,81 +245,154 @@ static int get_characteristics(void *state, struct nk_net_dev_characteristics *c
     }
 
     struct virtio_net_dev *d = (struct virtio_net_dev *) state;
+    uint64_t i;
 
     memcpy(c->mac, d->mac, ETHER_MAC_LEN);
 
     c->min_tu = MIN_TU;
     c->max_tu = MAX_TU;
     c->packet_size_to_buffer_size = packet_size_to_buffer_size;
+    c->offloads = d->offloads;
+    c->max_tso = (d->offloads & NK_NET_DEV_OFFLOAD_TSO4) ? MAX_TSO : 0;
+    c->num_queues = d->active_pairs < NK_NET_DEV_MAX_QUEUES ? d->active_pairs : NK_NET_DEV_MAX_QUEUES;
+    for (i = 0; i < c->num_queues; i++) {
+        c->queue_cpu[i] = d->queues[VIRTIO_NET_RECVQ_IDX(i)].cpu;
+    }
 
     return 0;
 }
 
-static int post(void *state, uint8_t *buf, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int send)
+// Sends go out on the queue pair of the sending CPU.  Receive buffers
+// go to whichever receive queue holds the fewest, preferring our own,
+// since the device picks the receive queue by flow and not by who
+// posted the buffer, so every queue in use needs to be stocked.
+// A caller running a receive path per queue names the queue instead.
+static inline struct virtio_net_queue *select_queue(struct virtio_net_dev *d, int send, struct nk_net_dev_pkt_info *info)
 {
-    uint16_t qidx = send ? VIRTIO_NET_SENDQ_IDX : VIRTIO_NET_RECVQ_IDX;
+    uint16_t pair = d->cpu_pair[my_cpu_id()];
+    uint16_t i;
+
+    if (info && (info->flags & NK_NET_PKT_QUEUE) && info->queue < d->active_pairs) {
+        pair = info->queue;
+    } else if (!send) {
+        for (i = 0; i < d->active_pairs; i++) {
+            if (d->queues[VIRTIO_NET_RECVQ_IDX(i)].posted < d->queues[VIRTIO_NET_RECVQ_IDX(pair)].posted) {
+                pair = i;
+            }
+        }
+    }
+
+    return &d->queues[send ? VIRTIO_NET_SENDQ_IDX(pair) : VIRTIO_NET_RECVQ_IDX(pair)];
+}
+
+static int fill_send_hdr(struct virtio_net_dev *d, struct virtio_net_hdr *h, uint64_t len, struct nk_net_dev_pkt_info *info)
+{
+    if (!info || !info->flags) {
+        return 0;
+    }
+
+    if (info->flags & NK_NET_PKT_CSUM_PARTIAL) {
+        if (!(d->offloads & NK_NET_DEV_OFFLOAD_TX_CSUM)) {
+            DEBUG("checksum offload not negotiated\n");
+            return -1;
+        }
+        h->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        h->csum_start = info->csum_start;
+        h->csum_offset = info->csum_offset;
+    }
+
+    if (info->flags & NK_NET_PKT_TSO4) {
+        if (!(d->offloads & NK_NET_DEV_OFFLOAD_TSO4) ||
+            !(info->flags & NK_NET_PKT_CSUM_PARTIAL) ||
+            !info->mss || len > MAX_TSO) {
+            DEBUG("unusable segmentation request\n");
+            return -1;
+        }
+        h->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        h->gso_size = info->mss;
+        h->hdr_len = info->hdr_len;
+    }
+
+    return 0;
+}
+
+// A packet is a header descriptor followed by one descriptor per
+// segment - more than one only for gathered sends
+static int post(void *state, struct nk_net_dev_seg *segs, uint32_t num_segs, struct nk_net_dev_pkt_info *info, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int send)
+{
+    QUEUE_LOCK_CONF;
     struct virtio_net_dev *d = (struct virtio_net_dev *) state;
-    struct virtq *vq = &d->virtio_dev->virtq[qidx].vq;
+    struct virtio_net_queue *q = select_queue(d, send, info);
+    struct virtq *vq = &d->virtio_dev->virtq[q->qidx].vq;
+    struct virtio_net_slot *slot;
+    uint16_t idx[1 + NK_NET_DEV_MAX_SEGS];
+    uint64_t len = 0;
+    uint32_t i;
+    uint16_t avail;
+    int kick;
 
-    // alloc descriptor for header
-    uint16_t header_idx;
-    if (virtio_pci_desc_alloc(d->virtio_dev, qidx, &header_idx)) {
-        ERROR("descriptor alloc failed\n");
+    if (!num_segs || num_segs > NK_NET_DEV_MAX_SEGS) {
+        ERROR("unsupported number of segments (%u)\n", num_segs);
         return -1;
     }
-    DEBUG("allocated descriptor %d\n", header_idx);
 
-    // alloc descriptor for packet
-    uint16_t packet_idx;
-    if (virtio_pci_desc_alloc(d->virtio_dev, qidx, &packet_idx)) {
+    // header and packet descriptors
+    if (virtio_pci_desc_chain_alloc(d->virtio_dev, q->qidx, idx, 1 + num_segs)) {
         ERROR("descriptor alloc failed\n");
-        virtio_pci_desc_free(d->virtio_dev, qidx, header_idx);
         return -1;
     }
-    DEBUG("allocated descriptor %d\n", packet_idx);
+    DEBUG("allocated %u descriptors starting with %d on queue %d\n", 1 + num_segs, idx[0], q->qidx);
+
+    for (i = 0; i < num_segs; i++) {
+        len += segs[i].len;
+    }
 
-    // create buffer for header
-    uint8_t *header = malloc(sizeof(struct virtio_net_hdr));
-    if (!header) {
-        virtio_pci_desc_free(d->virtio_dev, qidx, header_idx);
-        virtio_pci_desc_free(d->virtio_dev, qidx, packet_idx);
-        ERROR("couldn't allocate buffer for virtio-net header\n");
+    slot = &q->slots[idx[0]];
+    memset(&slot->hdr, 0, sizeof(slot->hdr));
+
+    if (send && fill_send_hdr(d, &slot->hdr.hdr, len, info)) {
+        virtio_pci_desc_chain_free(d->virtio_dev, q->qidx, idx[0]);
         return -1;
     }
-    memset(header, 0, sizeof(struct virtio_net_hdr));
-    DEBUG("malloc header %x\n", (uint64_t) header);
+
+    slot->callback = callback;
+    slot->context = context;
+    slot->info = send ? 0 : info;
 
     // setup header descriptor
-    struct virtq_desc *header_desc = &vq->desc[header_idx];
-    header_desc->addr = (uint64_t) header;
-    header_desc->len = sizeof(struct virtio_net_hdr);
-    header_desc->flags = VIRTQ_DESC_F_NEXT;
-    if (!send) {
-        header_desc->flags |= VIRTQ_DESC_F_WRITE;
+    struct virtq_desc *header_desc = &vq->desc[idx[0]];
+    header_desc->addr = (uint64_t) &slot->hdr;
+    header_desc->len = d->hdr_len;
+    header_desc->flags = VIRTQ_DESC_F_NEXT | (send ? 0 : VIRTQ_DESC_F_WRITE);
+    header_desc->next = idx[1];
+
+    // setup packet descriptors
+    for (i = 0; i < num_segs; i++) {
+        struct virtq_desc *packet_desc = &vq->desc[idx[1 + i]];
+        packet_desc->addr = (uint64_t) segs[i].addr;
+        packet_desc->len = segs[i].len;
+        packet_desc->flags = (send ? 0 : VIRTQ_DESC_F_WRITE) | (i + 1 < num_segs ? VIRTQ_DESC_F_NEXT : 0);
+        packet_desc->next = i + 1 < num_segs ? idx[2 + i] : 0;
     }
-    header_desc->next = packet_idx;
 
-    // setup packet descriptor
-    struct virtq_desc *packet_desc = &vq->desc[packet_idx];
-    packet_desc->addr = (uint64_t) buf;
-    packet_desc->len = len;
     if (!send) {
-        packet_desc->flags = VIRTQ_DESC_F_WRITE;
+        __sync_fetch_and_add(&q->posted, 1);
     }
-    packet_desc->next = 0;
 
-    // stash the callback and context
-    d->callbacks[qidx][header_idx].callback = callback;
-    d->callbacks[qidx][header_idx].context = context;
-    
     // put header descriptor in virtq
-    vq->avail->ring[vq->avail->idx % vq->qsz] = header_idx;
+    QUEUE_LOCK(q);
+    avail = vq->avail->idx;
+    vq->avail->ring[avail % vq->qsz] = idx[0];
     mbarrier();
-    vq->avail->idx++;
+    vq->avail->idx = avail + 1;
     mbarrier();
+    kick = !(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    QUEUE_UNLOCK(q);
 
-    // notify device (needs to be turned off for recv?)
-    virtio_pci_write_regw(d->virtio_dev, QUEUE_NOTIFY, qidx);
+    // notify device
+    if (kick) {
+        virtio_pci_virtqueue_notify(d->virtio_dev, q->qidx);
+    }
 
     return 0;
 }
@@ -262,7 +401,9 @@ static int post_receive(void *state, uint8_t *dest, uint64_t len, void (*callbac
 {
     DEBUG("post_receive\n");
 
-    if (post(state, dest, len, callback, context, 0)) {
+    struct nk_net_dev_seg seg = { dest, len };
+
+    if (post(state, &seg, 1, 0, callback, context, 0)) {
         return -1;
     }
     
@@ -273,7 +414,46 @@ static int post_send(void *state, uint8_t *src, uint64_t len, void (*callback)(n
 {
     DEBUG("post_send\n");
 
-    if (post(state, src, len, callback, context, 1)) {
+    struct nk_net_dev_seg seg = { src, len };
+
+    if (post(state, &seg, 1, 0, callback, context, 1)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int post_receive_info(void *state, uint8_t *dest, uint64_t len, struct nk_net_dev_pkt_info *info, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    DEBUG("post_receive_info\n");
+
+    struct nk_net_dev_seg seg = { dest, len };
+
+    if (post(state, &seg, 1, info, callback, context, 0)) {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int post_send_info(void *state, uint8_t *src, uint64_t len, struct nk_net_dev_pkt_info *info, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    DEBUG("post_send_info\n");
+
+    struct nk_net_dev_seg seg = { src, len };
+
+    if (post(state, &seg, 1, info, callback, context, 1)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int post_send_sg(void *state, struct nk_net_dev_seg *segs, uint32_t num_segs, struct nk_net_dev_pkt_info *info, void (*callback)(nk_net_dev_status_t status, void *context), void *context)
+{
+    DEBUG("post_send_sg (%u segments)\n", num_segs);
+
+    if (post(state, segs, num_segs, info, callback, context, 1)) {
         return -1;
     }
 
@@ -284,98 +464,164 @@ static struct nk_net_dev_int ops =  {
     .get_characteristics = get_characteristics,
     .post_receive = post_receive,
     .post_send = post_send,
+    .post_receive_info = post_receive_info,
+    .post_send_info = post_send_info,
+    .post_send_sg = post_send_sg,
 };
 
 
 // interrupt handling
 
-static int process_used_ring(struct virtio_net_dev *d, int qidx)
+// Work out how a completed receive went, and fill in its info.
+// With MRG_RXBUF the device may spread a packet over several of our
+// buffers, but each buffer belongs to a different caller, so we
+// cannot hand such a packet up - it and its buffers are dropped.
+// Callers avoid this by posting buffers of at least max_tu (or
+// max_tso with guest segmentation offload).
+static nk_net_dev_status_t complete_receive(struct virtio_net_queue *q, struct virtio_net_slot *slot, uint32_t len)
 {
-    uint16_t curr_idx, desc_idx, len;
-    uint32_t i;
-    uint8_t *header;
-    struct virtq_desc *head, *body;
-    struct virtio_pci_virtq *virtq = &d->virtio_dev->virtq[qidx];
+    struct virtio_net_dev *d = q->dev;
+    struct virtio_net_hdr *h = &slot->hdr.hdr;
+    struct nk_net_dev_pkt_info *info = slot->info;
+
+    if (q->drop) {
+        // continuation of a dropped packet - the "header" is packet data
+        q->drop--;
+        return NK_NET_DEV_STATUS_ERROR;
+    }
+
+    if (d->mrg_rxbuf && slot->hdr.num_buffers > 1) {
+        DEBUG("dropping packet spread over %u buffers\n", slot->hdr.num_buffers);
+        q->drop = slot->hdr.num_buffers - 1;
+        return NK_NET_DEV_STATUS_ERROR;
+    }
+
+    if (info) {
+        memset(info, 0, sizeof(*info));
+        info->len = len > d->hdr_len ? len - d->hdr_len : 0;
+        info->flags = NK_NET_PKT_QUEUE;
+        info->queue = q->qidx / 2;
+        if (h->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+            info->flags |= NK_NET_PKT_CSUM_PARTIAL;
+            info->csum_start = h->csum_start;
+            info->csum_offset = h->csum_offset;
+        }
+        if (h->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+            info->flags |= NK_NET_PKT_CSUM_VALID;
+        }
+        if ((h->gso_type & 0x7f) == VIRTIO_NET_HDR_GSO_TCPV4) {
+            info->flags |= NK_NET_PKT_TSO4;
+            info->mss = h->gso_size;
+            info->hdr_len = h->hdr_len;
+        }
+    }
+
+    return NK_NET_DEV_STATUS_SUCCESS;
+}
+
+static int process_used_ring(struct virtio_net_queue *q)
+{
+    struct virtio_net_dev *d = q->dev;
+    struct virtio_pci_virtq *virtq = &d->virtio_dev->virtq[q->qidx];
+    struct virtq *vq = &virtq->vq;
+    uint16_t curr_idx, desc_idx;
+    uint32_t len;
 
     mbarrier();
 
-    DEBUG("processing used ring for virtq %d\n", qidx);
-    DEBUG("used idx = %d\n", virtq->vq.used->idx);
+    DEBUG("processing used ring for virtq %d\n", q->qidx);
+    DEBUG("used idx = %d\n", vq->used->idx);
     DEBUG("last seen used = %d\n", virtq->last_seen_used);
 
-    for (; virtq->last_seen_used != virtq->vq.used->idx; virtq->last_seen_used++) {
-        curr_idx = virtq->last_seen_used % virtq->vq.qsz;
-        desc_idx = (uint16_t) virtq->vq.used->ring[curr_idx].id;
-        len = (uint16_t) virtq->vq.used->ring[curr_idx].len;
+    for (; virtq->last_seen_used != vq->used->idx; virtq->last_seen_used++) {
+        curr_idx = virtq->last_seen_used % vq->qsz;
+        desc_idx = (uint16_t) vq->used->ring[curr_idx].id;
+        len = vq->used->ring[curr_idx].len;
 
-        head = &virtq->vq.desc[desc_idx];
-        header = (uint8_t *) head->addr;
-        if (!(head->flags & VIRTQ_DESC_F_NEXT)) {
-            ERROR("head in used ring does not have next flag\n");
+        if (desc_idx >= vq->qsz) {
+            ERROR("used ring entry %u is not a descriptor\n", desc_idx);
             return -1;
         }
-        body = &virtq->vq.desc[head->next];
 
         DEBUG("head = %d\n", desc_idx);
-        DEBUG("body = %d\n", head->next);
         DEBUG("len = %d\n", len);
-#ifdef NAUT_CONFIG_DEBUG_VIRTIO_NET
-        //nk_dump_mem((uint8_t *) body->addr, len - sizeof(struct virtio_net_hdr));
-#endif
-        // free the header buffer (this is the only buffer we allocated)
-        free(header);
+
+        struct virtio_net_slot *slot = &q->slots[desc_idx];
+        nk_net_dev_status_t status = NK_NET_DEV_STATUS_SUCCESS;
+
+        if (q->recv) {
+            status = complete_receive(q, slot, len);
+            __sync_fetch_and_sub(&q->posted, 1);
+        }
 
 	// grab the callback info
-        void (*callback)(nk_net_dev_status_t, void *) = d->callbacks[qidx][desc_idx].callback;
-        void *context = d->callbacks[qidx][desc_idx].context;
+        void (*callback)(nk_net_dev_status_t, void *) = slot->callback;
+        void *context = slot->context;
 
-        memset(&d->callbacks[qidx][desc_idx], 0, sizeof(struct callback_info));
+        slot->callback = 0;
+        slot->context = 0;
+        slot->info = 0;
 
         // free the descriptor chain
-        if (virtio_pci_desc_chain_free(d->virtio_dev, qidx, desc_idx)) {
+        if (virtio_pci_desc_chain_free(d->virtio_dev, q->qidx, desc_idx)) {
             ERROR("error freeing descriptors\n");
             return -1;
         }
 
         // call the corresponding callback
         if (callback) {
-            callback(NK_NET_DEV_STATUS_SUCCESS, context);
+            callback(status, context);
         }
     }
 
     return 0;
 }
 
+// MSI-X - one vector per queue
+static int queue_handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
+{
+    int rc = 0;
+    struct virtio_net_queue *q = (struct virtio_net_queue *) priv_data;
+
+    DEBUG("interrupt for queue %u\n", q->qidx);
+
+    if (process_used_ring(q)) {
+        ERROR("error processing used ring for queue %u\n", q->qidx);
+        rc = -1;
+    }
+
+    IRQ_HANDLER_END();
+    return rc;
+}
+
+// legacy - one interrupt for all queues
 static int handler(excp_entry_t *exp, excp_vec_t vec, void *priv_data)
 {
     int rc = 0;
+    uint16_t i;
     
     DEBUG("interrupt\n");
 
     struct virtio_net_dev *d = (struct virtio_net_dev *) priv_data;
 
-    if (d->virtio_dev->itype == VIRTIO_PCI_LEGACY_INTERRUPT) {
-        // read ISR status field
-        uint8_t isr = virtio_pci_read_regb(d->virtio_dev, ISR_STATUS);
+    // read ISR status field
+    uint8_t isr = virtio_pci_read_regb(d->virtio_dev, ISR_STATUS);
 
-        // if bit 0 not set, ignore
-        if (!(isr & 0x01)) {
-            DEBUG("interrupt not for me\n");
-            IRQ_HANDLER_END();
-            return 0;
-        }
-
-        // need to check bit 1 for config change
+    // if bit 0 not set, ignore
+    if (!(isr & 0x01)) {
+        DEBUG("interrupt not for me\n");
+        IRQ_HANDLER_END();
+        return 0;
     }
 
+    // need to check bit 1 for config change
+
     // scan used rings
-    if (process_used_ring(d, VIRTIO_NET_RECVQ_IDX)) {
-        ERROR("error processing used ring for recvq\n");
-	rc = -1;
-    }
-    if (process_used_ring(d, VIRTIO_NET_SENDQ_IDX)) {
-        ERROR("error processing used ring for sendq\n");
-	rc = -1;
+    for (i = 0; i < 2*d->num_pairs; i++) {
+        if (process_used_ring(&d->queues[i])) {
+            ERROR("error processing used ring for queue %u\n", i);
+            rc = -1;
+        }
     }
 
     DEBUG("interrupt done\n");
@@ -427,12 +673,246 @@ static uint64_t select_features(uint64_t features)
     uint64_t accepted = 0;
 
     FBIT_SETIF(accepted,features,VIRTIO_NET_F_MAC);
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_MRG_RXBUF);
+
+    // the device completes checksums and segments TCP for us
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_CSUM);
+    if (FBIT_ISSET(features,VIRTIO_NET_F_CSUM)) {
+        FBIT_SETIF(accepted,features,VIRTIO_NET_F_HOST_TSO4);
+    }
+
+#ifdef NAUT_CONFIG_VIRTIO_NET_GUEST_OFFLOADS
+    // the device may hand us partially checksummed and coalesced packets,
+    // which only receivers that look at the packet info can cope with
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_GUEST_CSUM);
+    if (FBIT_ISSET(features,VIRTIO_NET_F_GUEST_CSUM)) {
+        FBIT_SETIF(accepted,features,VIRTIO_NET_F_GUEST_TSO4);
+    }
+#endif
+
+    // multiqueue is configured over the control queue
+    FBIT_SETIF(accepted,features,VIRTIO_NET_F_CTRL_VQ);
+    if (FBIT_ISSET(features,VIRTIO_NET_F_CTRL_VQ)) {
+        FBIT_SETIF(accepted,features,VIRTIO_NET_F_MQ);
+    }
 
     DEBUG("features accepted: 0x%0lx\n", accepted);
 
     return accepted;
 }
 
+// Decide how many queue pairs to use and which CPUs use which pair.
+// We use one pair per CPU, as far as the device, our virtqueue setup,
+// and the interrupt vectors allow.
+static int setup_queues(struct virtio_net_dev *d)
+{
+    struct virtio_pci_dev *dev = d->virtio_dev;
+    struct sys_info *sys = per_cpu_get(system);
+    uint16_t np = 1;
+    uint16_t i;
+    int c;
+
+    d->max_pairs = 1;
+    d->ctrlq = -1;
+
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_MQ)) {
+        d->max_pairs = virtio_pci_read_regw(dev, VIRTIO_NET_OFF_MAX_PAIRS(dev));
+        if (!d->max_pairs) {
+            d->max_pairs = 1;
+        }
+        np = d->max_pairs;
+    }
+
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_CTRL_VQ)) {
+        d->ctrlq = 2*d->max_pairs;
+        if (d->ctrlq >= dev->num_virtqs) {
+            // beyond the queues we set up, so no way to turn on more pairs
+            DEBUG("control queue %d not available\n", d->ctrlq);
+            d->ctrlq = -1;
+            np = 1;
+        }
+    }
+
+    if (np > sys->num_cpus) {
+        np = sys->num_cpus;
+    }
+    if (dev->itype==VIRTIO_PCI_MSI_X_INTERRUPT && 2*np > dev->pci_dev->msix.size) {
+        np = dev->pci_dev->msix.size / 2;
+    }
+    if (2*np > dev->num_virtqs) {
+        np = dev->num_virtqs / 2;
+    }
+    if (!np) {
+        ERROR("device does not have a send and a receive queue\n");
+        return -1;
+    }
+
+    d->num_pairs = np;
+    d->active_pairs = 1;
+    d->queues = malloc(2 * np * sizeof(struct virtio_net_queue));
+    d->cpu_pair = malloc(sys->num_cpus * sizeof(uint16_t));
+
+    if (!d->queues || !d->cpu_pair) {
+        ERROR("cannot allocate queues\n");
+        goto out_err;
+    }
+
+    memset(d->queues, 0, 2 * np * sizeof(struct virtio_net_queue));
+
+    for (i = 0; i < 2*np; i++) {
+        struct virtio_net_queue *q = &d->queues[i];
+        uint16_t qsz = dev->virtq[i].vq.qsz;
+
+        q->dev = d;
+        q->qidx = i;
+        q->recv = (i == VIRTIO_NET_RECVQ_IDX(i/2));
+        q->cpu = -1;
+        spinlock_init(&q->lock);
+
+        q->slots = malloc(qsz * sizeof(struct virtio_net_slot));
+        if (!q->slots) {
+            ERROR("cannot allocate packet slots for queue %u\n", i);
+            goto out_err;
+        }
+        memset(q->slots, 0, qsz * sizeof(struct virtio_net_slot));
+    }
+
+    for (c = 0; c < sys->num_cpus; c++) {
+        i = c % np;
+        d->cpu_pair[c] = 0;   // until the device agrees to more pairs
+        // the pair's interrupts go to the first CPU that uses it
+        if (d->queues[VIRTIO_NET_RECVQ_IDX(i)].cpu < 0) {
+            d->queues[VIRTIO_NET_RECVQ_IDX(i)].cpu = c;
+            d->queues[VIRTIO_NET_SENDQ_IDX(i)].cpu = c;
+        }
+    }
+
+    return 0;
+
+ out_err:
+    if (d->queues) {
+        for (i = 0; i < 2*np; i++) {
+            if (d->queues[i].slots) {
+                free(d->queues[i].slots);
+            }
+        }
+        free(d->queues);
+        d->queues = 0;
+    }
+    if (d->cpu_pair) {
+        free(d->cpu_pair);
+        d->cpu_pair = 0;
+    }
+    return -1;
+}
+
+static void free_queues(struct virtio_net_dev *d)
+{
+    uint16_t i;
+
+    for (i = 0; i < 2*d->num_pairs; i++) {
+        free(d->queues[i].slots);
+    }
+    free(d->queues);
+    free(d->cpu_pair);
+}
+
+// Issue a command on the control queue and wait for the device's answer.
+// This is only done during bringup, so we simply poll for completion.
+static int ctrl_cmd(struct virtio_net_dev *d, uint8_t class, uint8_t cmd, void *data, uint16_t len)
+{
+    struct virtio_pci_dev *dev = d->virtio_dev;
+    struct virtio_pci_virtq *virtq;
+    struct virtq *vq;
+    uint16_t idx[3];
+    uint64_t start;
+    int rc = -1;
+
+    if (d->ctrlq < 0 || len > sizeof(d->ctrl.data)) {
+        return -1;
+    }
+
+    virtq = &dev->virtq[d->ctrlq];
+    vq = &virtq->vq;
+
+    if (virtio_pci_desc_chain_alloc(dev, d->ctrlq, idx, 3)) {
+        ERROR("control descriptor alloc failed\n");
+        return -1;
+    }
+
+    d->ctrl.hdr.class = class;
+    d->ctrl.hdr.cmd = cmd;
+    memcpy(d->ctrl.data, data, len);
+    d->ctrl.ack = 0xff;
+
+    vq->desc[idx[0]].addr = (uint64_t) &d->ctrl.hdr;
+    vq->desc[idx[0]].len = sizeof(d->ctrl.hdr);
+    vq->desc[idx[0]].flags = VIRTQ_DESC_F_NEXT;
+    vq->desc[idx[0]].next = idx[1];
+
+    vq->desc[idx[1]].addr = (uint64_t) d->ctrl.data;
+    vq->desc[idx[1]].len = len;
+    vq->desc[idx[1]].flags = VIRTQ_DESC_F_NEXT;
+    vq->desc[idx[1]].next = idx[2];
+
+    vq->desc[idx[2]].addr = (uint64_t) &d->ctrl.ack;
+    vq->desc[idx[2]].len = sizeof(d->ctrl.ack);
+    vq->desc[idx[2]].flags = VIRTQ_DESC_F_WRITE;
+    vq->desc[idx[2]].next = 0;
+
+    vq->avail->ring[vq->avail->idx % vq->qsz] = idx[0];
+    mbarrier();
+    vq->avail->idx++;
+    mbarrier();
+
+    virtio_pci_virtqueue_notify(dev, d->ctrlq);
+
+    start = nk_sched_get_realtime();
+    while (*(volatile uint16_t *)&vq->used->idx == virtq->last_seen_used) {
+        if (nk_sched_get_realtime() - start > CTRL_TIMEOUT_NS) {
+            // the chain is the device's now, so we leave it be
+            ERROR("control command %u/%u timed out\n", class, cmd);
+            return -1;
+        }
+    }
+    mbarrier();
+    virtq->last_seen_used++;
+
+    if (d->ctrl.ack == VIRTIO_NET_CTRL_OK) {
+        rc = 0;
+    } else {
+        ERROR("control command %u/%u failed (ack=%u)\n", class, cmd, d->ctrl.ack);
+    }
+
+    virtio_pci_desc_chain_free(dev, d->ctrlq, idx[0]);
+
+    return rc;
+}
+
+// The device starts out using only the first queue pair, and so
+// do we until it has agreed to use the rest
+static void enable_queue_pairs(struct virtio_net_dev *d)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint16_t pairs = d->num_pairs;
+    int c;
+
+    if (pairs == 1) {
+        return;
+    }
+
+    if (ctrl_cmd(d, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &pairs, sizeof(pairs))) {
+        ERROR("cannot enable %u queue pairs, using one\n", pairs);
+        return;
+    }
+
+    for (c = 0; c < sys->num_cpus; c++) {
+        d->cpu_pair[c] = c % pairs;
+    }
+    mbarrier();
+    d->active_pairs = pairs;
+}
+
 static void test_callback(nk_net_dev_status_t status, void *context)
 {
     DEBUG("callback called: status=%d, context=%s\n", status, (const char *) context);
@@ -590,36 +1070,37 @@ int virtio_net_init(struct virtio_pci_dev *dev)
         return -1;
     }
 
-    // allocate memory for callbacks (this memory leaks, needs to be freed)
-    uint32_t send_callbacks_size = sizeof(struct callback_info) * dev->virtq[VIRTIO_NET_SENDQ_IDX].vq.qsz;
-    uint32_t recv_callbacks_size = sizeof(struct callback_info) * dev->virtq[VIRTIO_NET_RECVQ_IDX].vq.qsz;
+    d->virtio_dev = dev;
+    d->mrg_rxbuf = FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_MRG_RXBUF) ? 1 : 0;
+    d->hdr_len = d->mrg_rxbuf ? sizeof(struct virtio_net_hdr_mrg) : sizeof(struct virtio_net_hdr);
 
-    d->callbacks[VIRTIO_NET_SENDQ_IDX] = malloc(send_callbacks_size);
-    if (!d->callbacks[VIRTIO_NET_SENDQ_IDX]) {
-        ERROR("can't allocate send callbacks\n");
-	virtio_pci_virtqueue_deinit(dev);
-        free(d);
-        return -1;
+    // descriptor chains can always gather a send
+    d->offloads = NK_NET_DEV_OFFLOAD_SG;
+
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_CSUM)) {
+        d->offloads |= NK_NET_DEV_OFFLOAD_TX_CSUM;
+    }
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_HOST_TSO4)) {
+        d->offloads |= NK_NET_DEV_OFFLOAD_TSO4;
+    }
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_GUEST_CSUM)) {
+        d->offloads |= NK_NET_DEV_OFFLOAD_RX_CSUM;
+    }
+    if (FBIT_ISSET(dev->feat_accepted, VIRTIO_NET_F_GUEST_TSO4)) {
+        d->offloads |= NK_NET_DEV_OFFLOAD_LRO4;
     }
 
-    d->callbacks[VIRTIO_NET_RECVQ_IDX] = malloc(recv_callbacks_size);
-    if (!d->callbacks[VIRTIO_NET_RECVQ_IDX]) {
-        ERROR("can't allocate recv callbacks\n");
+    if (setup_queues(d)) {
+        ERROR("Failed to set up queues\n");
 	virtio_pci_virtqueue_deinit(dev);
-        free(d->callbacks[VIRTIO_NET_SENDQ_IDX]);
         free(d);
         return -1;
     }
 
-    memset(d->callbacks[VIRTIO_NET_SENDQ_IDX], 0, send_callbacks_size);
-    memset(d->callbacks[VIRTIO_NET_RECVQ_IDX], 0, recv_callbacks_size);
-
     // fill out pci dev state
     dev->state = d;
     dev->teardown = teardown;
 
-    d->virtio_dev = dev;
-
     // register net dev
     snprintf(buf,DEV_NAME_LEN,"virtio-net%u",__sync_fetch_and_add(&num_devs,1));
     d->net_dev = nk_net_dev_register(buf,0,&ops,d);
@@ -627,8 +1108,7 @@ int virtio_net_init(struct virtio_pci_dev *dev)
     if (!d->net_dev) {
         ERROR("Failed to register network device\n");
         virtio_pci_virtqueue_deinit(dev);
-	free(d->callbacks[VIRTIO_NET_RECVQ_IDX]);
-	free(d->callbacks[VIRTIO_NET_SENDQ_IDX]);
+	free_queues(d);
         free(d);
         return -1;
     }
@@ -637,7 +1117,6 @@ int virtio_net_init(struct virtio_pci_dev *dev)
     // if we do fail, the rest of this code will leak
 
     struct pci_dev *p = dev->pci_dev;
-    uint16_t num_vec = p->msix.size;
     ulong_t vec;
     uint16_t i;
 
@@ -650,16 +1129,10 @@ int virtio_net_init(struct virtio_pci_dev *dev)
 
         DEBUG("setting up interrupts via MSI-X\n");
 
-        if (dev->num_virtqs != num_vec) {
-            ERROR("weird mismatch: numqueues=%u msixsize=%u\n",
-                dev->num_virtqs, p->msix.size);
-            //continue for now...
-	    //return -1;
-	    
-        }
-
-        // now fill out the device's MSI-X table
-        for (i=0;i<num_vec;i++) {
+        // one vector per data queue, delivered to the CPU of its pair
+        // the control queue is polled, so its entry stays masked
+        for (i=0;i<2*d->num_pairs;i++) {
+            struct virtio_net_queue *q = &d->queues[i];
             // find a free vector
             // note that prioritization here is your problem
             if (idt_find_and_reserve_range(1,0,&vec)) {
@@ -667,13 +1140,13 @@ int virtio_net_init(struct virtio_pci_dev *dev)
                 return -1;
             }
             // register your handler for that vector
-            if (register_int_handler(vec, handler, d)) {
+            if (register_int_handler(vec, queue_handler, q)) {
                 ERROR("Failed to register int handler\n");
                 return -1;
                 // failed....
             }
             // set the table entry to point to your handler
-            if (pci_dev_set_msi_x_entry(p,i,vec,0)) {
+            if (pci_dev_set_msi_x_entry(p,i,vec,q->cpu)) {
                 ERROR("Failed to set MSI-X entry\n");
                 return -1;
             }
@@ -682,7 +1155,7 @@ int virtio_net_init(struct virtio_pci_dev *dev)
                 ERROR("Failed to unmask entry\n");
                 return -1;
             }
-            DEBUG("Finished setting up entry %d for vector %u on cpu 0\n",i,vec);
+            DEBUG("Finished setting up entry %d for vector %u on cpu %d\n",i,vec,q->cpu);
         }
 
         // unmask entire function
@@ -728,6 +1201,15 @@ int virtio_net_init(struct virtio_pci_dev *dev)
         return -1;
     }
 
+    enable_queue_pairs(d);
+
+    INFO("%s: %u queue pair(s)%s%s%s%s%s\n", buf, d->active_pairs,
+         d->mrg_rxbuf ? ", mergeable rx buffers" : "",
+         (d->offloads & NK_NET_DEV_OFFLOAD_TX_CSUM) ? ", tx csum" : "",
+         (d->offloads & NK_NET_DEV_OFFLOAD_TSO4) ? ", tso4" : "",
+         (d->offloads & NK_NET_DEV_OFFLOAD_RX_CSUM) ? ", rx csum" : "",
+         (d->offloads & NK_NET_DEV_OFFLOAD_LRO4) ? ", lro4" : "");
+
     // now try to poke device
     // test_send(d);
     // for (i = 0; i < 128; i++) {
@@ -616,8 +616,8 @@ static int virtqueue_init_legacy(struct virtio_pci_dev *dev)
   }
   
   if (i==MAX_VIRTQS) { 
-      ERROR("Device needs too many virtqueues!\n");
-      return -1;
+      // queues beyond these are left unconfigured and unused
+      DEBUG("Device may have more than %u virtqueues\n",MAX_VIRTQS);
   }
   
   return 0;
@@ -642,6 +642,11 @@ static int virtqueue_init_modern(struct virtio_pci_dev *dev)
 
     dev->num_virtqs = 0;
 
+    if (num>MAX_VIRTQS) {
+        DEBUG("only using %u of the device's %u virtqueues\n",MAX_VIRTQS,num);
+        num = MAX_VIRTQS;
+    }
+
     for (i=0;i<num;i++) {
 	
 	virtio_pci_atomic_store(&dev->common->queue_select,i);
@@ -717,8 +722,8 @@ static int virtqueue_init_modern(struct virtio_pci_dev *dev)
   }
   
   if (i==MAX_VIRTQS) { 
-      ERROR("Device needs too many virtqueues!\n");
-      return -1;
+      // queues beyond these are left unconfigured and unused
+      DEBUG("Device may have more than %u virtqueues\n",MAX_VIRTQS);
   }
   
   return 0;
@@ -27,6 +27,7 @@
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
 #include <nautilus/fs.h>
+#include <nautilus/semaphore.h>
 
 #include <fs/ext2/ext2.h>
 #include "ext2fs.h"
@@ -53,8 +54,10 @@ struct ext2_state {
     struct nk_block_dev *dev;
     struct nk_fs        *fs;
     struct ext2_super_block super;
+    struct ext2_cache   *cache;
 };
 
+#include "ext2_cache.c"
 #include "ext2_access.c"
 
 static size_t get_file_size(struct ext2_state *fs, struct ext2_inode *inode) 
@@ -94,6 +97,10 @@ static void ext2_close(void *state, void *file)
 
     DEBUG("closing inode %u\n",(uint32_t)(uint64_t)file);
 
+    if (icache_flush(fs,(uint32_t)(uint64_t)file)) {
+	ERROR("Failed to write back inode %u on close\n",(uint32_t)(uint64_t)file);
+    }
+
     // ideally FS would track this here so that we can handle multiple
     // opens, locking, etc correctly, but that's outside of scope for now
 
@@ -618,6 +625,64 @@ static ssize_t ext2_write(void *state, void *file, void *srcdest, off_t offset,
     return ext2_read_write(state,file,srcdest,offset,num_bytes,1);
 }
 
+// Succeeds only if the range is backed by physically contiguous blocks
+// on a memory-resident device
+static int ext2_map(void *state, void *file, off_t offset, size_t num_bytes, void **addr)
+{
+    struct ext2_state *fs = (struct ext2_state *)state;
+    uint64_t block_size = get_block_size(fs);
+    uint64_t dev_per_block = FLOOR_DIV(block_size,fs->chars.block_size);
+    uint32_t inode_num = (uint32_t)(uint64_t)file;
+    struct ext2_inode inode;   
+    uint32_t first_logical, last_logical, cur_logical;
+    uint32_t first_physical = 0, cur_physical;
+    void *base;
+
+    DEBUG("mapping inode %u %lu bytes at offset %lu\n", inode_num, num_bytes, offset);
+
+    if (!num_bytes) { 
+	return -1;
+    }
+
+    if (read_inode(fs,inode_num,&inode)) { 
+	ERROR("Failed to read inode %u\n",inode_num);
+	return -1;
+    }
+
+    if (offset+num_bytes > get_file_size(fs,&inode)) { 
+	DEBUG("Map extends past end of file\n");
+	return -1;
+    }
+
+    first_logical = FLOOR_DIV(offset,block_size);
+    last_logical = FLOOR_DIV(offset+num_bytes-1,block_size);
+
+    for (cur_logical=first_logical; cur_logical<=last_logical; cur_logical++) { 
+	if (map_logical_to_physical_get(fs,inode_num,&inode,cur_logical,&cur_physical)) { 
+	    ERROR("Unable to map logical block %u\n", cur_logical);
+	    return -1;
+	}
+	if (cur_logical==first_logical) { 
+	    first_physical = cur_physical;
+	} else if (cur_physical != first_physical + (cur_logical-first_logical)) {
+	    DEBUG("Logical block %u is not contiguous (physical block %u)\n", cur_logical, cur_physical);
+	    return -1;
+	}
+    }
+
+    if (nk_block_dev_map(fs->dev,
+			 (uint64_t)first_physical*dev_per_block,
+			 (uint64_t)(last_logical-first_logical+1)*dev_per_block,
+			 &base)) {
+	DEBUG("Device %s cannot be mapped\n", fs->dev->dev.name);
+	return -1;
+    }
+
+    *addr = base + offset % block_size;
+
+    return 0;
+}
+
 
 /*
 static uint16_t dentry_find_len(struct ext2_dir_entry_2 *dentry) 
@@ -745,9 +810,9 @@ static int dentry_get_put_del(struct ext2_state      *fs,
 	}
     }
 	
-    // reached end of line...
+    // reached end of line... the entry is not there
     if (op!=PUT) { 
-	return -1;
+	return 1;
     }
     
     // We are now in an add, so we need allocate new block and put
@@ -1121,6 +1186,8 @@ static void *ext2_create(void *state, char *path, int dir)
 	return 0;
     }
 
+    dcache_update(fs, dir_num, name, inode_num);
+
     //fill in inode with stuff
     newinode.i_mode = dir ? EXT2_S_IFDIR : EXT2_S_IFREG;
     newinode.i_size = 0;
@@ -1224,9 +1291,13 @@ int ext2_remove(void *state, char *path)
     // remove dentry 
     if (dentry_remove(fs, dir_num, inum)) { 
 	ERROR("Failed to remove directory entry\n");
+	free_split_path(parts,num_parts);
 	return -1;
     }
 
+    dcache_update(fs, dir_num, name, 0);
+    free_split_path(parts,num_parts);
+
     // truncate file
     if (ext2_truncate(fs, (void*)(uint64_t)inum, 0)) {
 	ERROR("Failed to truncate file during removal\n");
@@ -1238,6 +1309,8 @@ int ext2_remove(void *state, char *path)
 	return -1;
     }
 
+    icache_drop(fs, inum);
+
     return 0;
 }
 
@@ -1270,6 +1343,15 @@ static int ext2_stat_path(void *state, char *path, struct nk_fs_stat *st)
     return ext2_stat(state,(void*)(uint64_t)inum,st);
 }
 
+static int ext2_sync(void *state)
+{
+    struct ext2_state *fs = (struct ext2_state *)state;
+
+    DEBUG("sync of %s\n",fs->fs->name);
+
+    return icache_flush(fs,0);
+}
+
 
 static struct nk_fs_int ext2_inter = {
     .stat_path = ext2_stat_path,
@@ -1283,6 +1365,8 @@ static struct nk_fs_int ext2_inter = {
     .close_file = ext2_close,
     .read_file = ext2_read,
     .write_file = ext2_write,
+    .map_file = ext2_map,
+    .sync = ext2_sync,
 };
 
 
@@ -1322,10 +1406,17 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 	return -1;
     }
     
+    if (cache_init(s)) {
+	ERROR("Cannot set up caches for fs %s\n", fsname);
+	free(s);
+	return -1;
+    }
+    
     s->fs = nk_fs_register(fsname, flags, &ext2_inter, s);
 
     if (!s->fs) { 
 	ERROR("Unable to register filesystem %s\n", fsname);
+	cache_deinit(s);
 	free(s);
 	return -1;
     }
@@ -1338,11 +1429,32 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 int nk_fs_ext2_detach(char *fsname)
 {
     struct nk_fs *fs = nk_fs_find(fsname);
+    struct ext2_state *s;
+
     if (!fs) { 
 	return -1;
-    } else {
-	return nk_fs_unregister(fs);
     }
+
+    s = (struct ext2_state *)fs->state;
+
+    if (ext2_sync(s)) {
+	ERROR("Failed to write back inodes of %s\n", fsname);
+    }
+
+    // the caches stay up until nothing can reach them via the fs
+    if (nk_fs_unregister(fs)) {
+	ERROR("Failed to unregister %s\n", fsname);
+	return -1;
+    }
+
+    // unregistering freed the nk_fs
+    s->fs = 0;
+
+    cache_deinit(s);
+
+    free(s);
+
+    return 0;
 }
 
 /*
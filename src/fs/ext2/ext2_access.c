@@ -234,8 +234,9 @@ static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ex
     }
 }
 
-#define read_inode(fs,inode_num,dest)  read_write_inode(fs,inode_num,dest,0)
-#define write_inode(fs,inode_num,src)  read_write_inode(fs,inode_num,src,1)
+// everything else goes through the inode cache
+#define read_inode(fs,inode_num,dest)  read_write_inode_cached(fs,inode_num,dest,0)
+#define write_inode(fs,inode_num,src)  read_write_inode_cached(fs,inode_num,src,1)
 
 /* split_path
  *
@@ -278,19 +279,11 @@ static void free_split_path(char **list, int n)
     free(list);
 }
 
-/* get_root_dir_inode
- *
- * Convenience function to get pointer to inode of the root directory.
- */
-static int get_root_dir_inode(void * fs, struct ext2_inode *inode) 
-{
-    return read_inode(fs, EXT2_ROOT_INO, inode);
-}
-
 
 
 enum dentry_op {GET,PUT,DEL_BY_NAME,DEL_BY_INODE};
 
+// returns 0 on success, 1 if there is no such entry, -1 on error
 static int dentry_get_put_del(struct ext2_state      *fs,
 			      uint32_t                inode_num,
 			      struct ext2_inode       *their_inode,
@@ -309,18 +302,33 @@ static uint32_t get_inode_num_from_dir(struct ext2_state *fs,
 {
     struct ext2_dir_entry_2 dentry;
     uint32_t inum;
+    uint64_t gen = 0;
+    int rc;
 
     DEBUG("get_inode_num_from_dir on %s, inode_num=%u, dir=%p, search=%s\n",
 	  fs->fs->name,inode_num,dir,name);
 
+    if (dcache_lookup(fs,inode_num,name,&inum,&gen)) {
+	DEBUG("directory entry cache has %s -> %u\n",name,inum);
+	return inum;
+    }
+
     strcpy(dentry.name,name);
     dentry.name_len=strlen(name);
     dentry.rec_len=EXT2_DIR_REC_LEN(dentry.name_len);
     
-    if (dentry_get_put_del(fs,inode_num,dir,&dentry,GET)) { 
+    rc = dentry_get_put_del(fs,inode_num,dir,&dentry,GET);
+
+    if (rc<0) { 
+	// an error is not a miss, so nothing is cached
 	ERROR("Failed to get directory entry for %s\n",name);
 	return 0;
+    } else if (rc>0) {
+	DEBUG("No directory entry for %s\n",name);
+	dcache_insert(fs,inode_num,name,0,gen);
+	return 0;
     } else {
+	dcache_insert(fs,inode_num,name,dentry.inode,gen);
 	return dentry.inode;
     }
 
@@ -397,37 +405,22 @@ static uint32_t get_inode_num_by_path(struct ext2_state *fs, char *path)
     char *cur_part = *parts;
 
     int i;
-    struct ext2_inode cur_inode;
     uint32_t new_inode_num = 0;
-    uint32_t cur_inode_num;
-
-    if (get_root_dir_inode(fs,&cur_inode)) { 
-	ERROR("Cannot get root directory inode\n");
-	free_split_path(parts,num_parts);
-	return 0;
-    }
-    cur_inode_num=EXT2_ROOT_INO;
-
-    DEBUG("Root inode fetched has mode %u, uid %u, size %u, blocks %u\n",
-	  cur_inode.i_mode, cur_inode.i_uid, cur_inode.i_size, cur_inode.i_blocks);
+    uint32_t cur_inode_num = EXT2_ROOT_INO;
 
     DEBUG("%s has %d parts\n", path, num_parts);
     
     for(i = 1; i <= num_parts; i++) {   // HUH?  PAD (<=)
 	//treat current inode as directory, and search for inode of next part
+	//the directory inode is only read if the entry is not cached
 	DEBUG("Considering part %s\n",cur_part);
-	new_inode_num = get_inode_num_from_dir(fs, cur_inode_num, &cur_inode, cur_part);
+	new_inode_num = get_inode_num_from_dir(fs, cur_inode_num, 0, cur_part);
 	if (!new_inode_num) {
 	    ERROR("Finished search and did not find element %s\n",cur_part);
 	    free_split_path(parts,num_parts);
 	    return 0;
 	}
 	DEBUG("GET INODE found: %d, %s\n", new_inode_num, cur_part);
-	if (read_inode(fs, new_inode_num, &cur_inode)) { 
-	    ERROR("Failed to read inode...\n");
-	    free_split_path(parts,num_parts);
-	    return 0;
-	}
 	cur_inode_num = new_inode_num;
 	cur_part = *(parts+i);
     }
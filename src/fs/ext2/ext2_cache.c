@@ -0,0 +1,446 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2016, Peter Dinda
+ * Copyright (c) 2016, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+/* ext2_cache.c
+ *
+ * Inode and directory entry caches for an ext2 filesystem
+ *
+ * The inode cache holds copies of on-disk inodes, hashed by inode
+ * number and bounded by LRU replacement.  Writes only update the
+ * cached copy and mark it dirty; dirty inodes go back to disk when
+ * they are evicted, when the file is closed, and on sync.
+ *
+ * The directory entry cache maps (parent inode, name) to the child's
+ * inode number.  It also remembers names that were not found
+ * (negative entries, inode number 0), so repeated lookups of missing
+ * paths do not rescan directories.  Create and remove update it.
+ *
+ * The inode cache lock is a semaphore, as misses and write-backs do
+ * device I/O while holding it.  The directory entry cache is only
+ * locked while being looked at - a miss scans the directory without
+ * the lock, and its result is only inserted if nothing was
+ * invalidated in the meantime.
+ */
+
+static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ext2_inode *srcdest, int write);
+
+#ifdef NAUT_CONFIG_EXT2_CACHE
+
+#define ICACHE_SIZE NAUT_CONFIG_EXT2_INODE_CACHE_SIZE
+#define DCACHE_SIZE NAUT_CONFIG_EXT2_DENTRY_CACHE_SIZE
+
+struct ext2_icache_entry {
+    uint32_t          inode_num;   // 0 => unused
+    int               dirty;
+    struct ext2_inode inode;
+    struct list_head  hash_node;
+    struct list_head  lru_node;    // most recently used first
+};
+
+struct ext2_dcache_entry {
+    uint32_t          parent;      // 0 => unused
+    uint32_t          inode_num;   // 0 => name does not exist
+    uint8_t           name_len;
+    char              name[EXT2_NAME_LEN];
+    struct list_head  hash_node;
+    struct list_head  lru_node;
+};
+
+struct ext2_cache {
+    struct nk_semaphore      *ilock;
+    struct ext2_icache_entry *inodes;
+    struct list_head         inode_hash[ICACHE_SIZE];
+    struct list_head         inode_lru;
+
+    spinlock_t               dlock;
+    uint64_t                 dgen;        // bumped on every invalidation
+    struct ext2_dcache_entry *dentries;
+    struct list_head         dentry_hash[DCACHE_SIZE];
+    struct list_head         dentry_lru;
+
+    uint64_t                 ihits, imisses, writebacks;
+    uint64_t                 dhits, dmisses;
+};
+
+#define DCACHE_LOCK_CONF uint8_t _dcache_lock_flags
+#define DCACHE_LOCK(c) _dcache_lock_flags = spin_lock_irq_save(&(c)->dlock)
+#define DCACHE_UNLOCK(c) spin_unlock_irq_restore(&(c)->dlock, _dcache_lock_flags)
+
+
+static int cache_init(struct ext2_state *fs)
+{
+    struct ext2_cache *c = malloc(sizeof(*c));
+    int i;
+
+    if (!c) {
+	ERROR("Cannot allocate caches\n");
+	return -1;
+    }
+
+    memset(c,0,sizeof(*c));
+
+    c->ilock = nk_semaphore_create(0,1,NK_SEMAPHORE_DEFAULT,0);
+    c->inodes = malloc(ICACHE_SIZE*sizeof(struct ext2_icache_entry));
+    c->dentries = malloc(DCACHE_SIZE*sizeof(struct ext2_dcache_entry));
+
+    if (!c->ilock || !c->inodes || !c->dentries) {
+	ERROR("Cannot allocate cache entries\n");
+	if (c->ilock) { nk_semaphore_release(c->ilock); }
+	if (c->inodes) { free(c->inodes); }
+	if (c->dentries) { free(c->dentries); }
+	free(c);
+	return -1;
+    }
+
+    memset(c->inodes,0,ICACHE_SIZE*sizeof(struct ext2_icache_entry));
+    memset(c->dentries,0,DCACHE_SIZE*sizeof(struct ext2_dcache_entry));
+
+    spinlock_init(&c->dlock);
+
+    INIT_LIST_HEAD(&c->inode_lru);
+    INIT_LIST_HEAD(&c->dentry_lru);
+
+    for (i=0;i<ICACHE_SIZE;i++) {
+	INIT_LIST_HEAD(&c->inode_hash[i]);
+	INIT_LIST_HEAD(&c->inodes[i].hash_node);
+	list_add_tail(&c->inodes[i].lru_node,&c->inode_lru);
+    }
+
+    for (i=0;i<DCACHE_SIZE;i++) {
+	INIT_LIST_HEAD(&c->dentry_hash[i]);
+	INIT_LIST_HEAD(&c->dentries[i].hash_node);
+	list_add_tail(&c->dentries[i].lru_node,&c->dentry_lru);
+    }
+
+    fs->cache = c;
+
+    DEBUG("Caches for %u inodes and %u directory entries\n", ICACHE_SIZE, DCACHE_SIZE);
+
+    return 0;
+}
+
+static void cache_deinit(struct ext2_state *fs)
+{
+    struct ext2_cache *c = fs->cache;
+
+    if (!c) {
+	return;
+    }
+
+    INFO("%s: inode cache %lu hits %lu misses %lu writebacks, dentry cache %lu hits %lu misses\n",
+	 fs->dev->dev.name, c->ihits, c->imisses, c->writebacks, c->dhits, c->dmisses);
+
+    spinlock_deinit(&c->dlock);
+    nk_semaphore_release(c->ilock);
+    free(c->dentries);
+    free(c->inodes);
+    free(c);
+    fs->cache = 0;
+}
+
+
+/*
+ * Inode cache
+ */
+
+static struct ext2_icache_entry *icache_find(struct ext2_cache *c, uint32_t inode_num)
+{
+    struct list_head *cur;
+
+    list_for_each(cur,&c->inode_hash[inode_num % ICACHE_SIZE]) {
+	struct ext2_icache_entry *e = list_entry(cur,struct ext2_icache_entry,hash_node);
+	if (e->inode_num==inode_num) {
+	    return e;
+	}
+    }
+    return 0;
+}
+
+static int icache_writeback(struct ext2_state *fs, struct ext2_icache_entry *e)
+{
+    if (!e->inode_num || !e->dirty) {
+	return 0;
+    }
+
+    DEBUG("Writing back inode %u\n", e->inode_num);
+
+    if (read_write_inode(fs,e->inode_num,&e->inode,1)) {
+	ERROR("Failed to write back inode %u\n", e->inode_num);
+	return -1;
+    }
+
+    e->dirty = 0;
+    fs->cache->writebacks++;
+
+    return 0;
+}
+
+// Returns the entry for the inode, filling it in from disk (if
+// fill is set) on a miss.  Caller holds the lock.
+static struct ext2_icache_entry *icache_get(struct ext2_state *fs, uint32_t inode_num, int fill)
+{
+    struct ext2_cache *c = fs->cache;
+    struct ext2_icache_entry *e = icache_find(c,inode_num);
+
+    if (e) {
+	c->ihits++;
+    } else {
+	c->imisses++;
+
+	struct list_head *cur;
+
+	// recycle the least recently used entry, passing over any
+	// that cannot be written back rather than losing them
+	e = 0;
+	list_for_each_prev(cur,&c->inode_lru) {
+	    struct ext2_icache_entry *v = list_entry(cur,struct ext2_icache_entry,lru_node);
+	    if (!icache_writeback(fs,v)) {
+		e = v;
+		break;
+	    }
+	}
+
+	if (!e) {
+	    ERROR("No inode cache entry can be recycled\n");
+	    return 0;
+	}
+
+	list_del_init(&e->hash_node);
+	e->inode_num = 0;
+
+	if (fill && read_write_inode(fs,inode_num,&e->inode,0)) {
+	    return 0;
+	}
+
+	e->inode_num = inode_num;
+	e->dirty = 0;
+	list_add(&e->hash_node,&c->inode_hash[inode_num % ICACHE_SIZE]);
+    }
+
+    list_move(&e->lru_node,&c->inode_lru);
+
+    return e;
+}
+
+static int read_write_inode_cached(struct ext2_state *fs, uint32_t inode_num, struct ext2_inode *srcdest, int write)
+{
+    struct ext2_icache_entry *e;
+
+    write &= 0x1;
+
+    nk_semaphore_down(fs->cache->ilock);
+
+    // a whole-inode write need not read the old one
+    e = icache_get(fs,inode_num,!write);
+
+    if (!e) {
+	nk_semaphore_up(fs->cache->ilock);
+	return -1;
+    }
+
+    if (write) {
+	e->inode = *srcdest;
+	e->dirty = 1;
+    } else {
+	*srcdest = e->inode;
+    }
+
+    nk_semaphore_up(fs->cache->ilock);
+
+    return 0;
+}
+
+// write back one inode, or all of them (inode_num==0)
+static int icache_flush(struct ext2_state *fs, uint32_t inode_num)
+{
+    struct ext2_cache *c = fs->cache;
+    int rc = 0;
+    int i;
+
+    nk_semaphore_down(c->ilock);
+
+    if (inode_num) {
+	struct ext2_icache_entry *e = icache_find(c,inode_num);
+	if (e) {
+	    rc = icache_writeback(fs,e);
+	}
+    } else {
+	for (i=0;i<ICACHE_SIZE;i++) {
+	    rc |= icache_writeback(fs,&c->inodes[i]);
+	}
+    }
+
+    nk_semaphore_up(c->ilock);
+
+    return rc;
+}
+
+// forget a freed inode without writing it back
+static void icache_drop(struct ext2_state *fs, uint32_t inode_num)
+{
+    struct ext2_cache *c = fs->cache;
+    struct ext2_icache_entry *e;
+
+    nk_semaphore_down(c->ilock);
+
+    e = icache_find(c,inode_num);
+    if (e) {
+	list_del_init(&e->hash_node);
+	e->inode_num = 0;
+	e->dirty = 0;
+	list_move_tail(&e->lru_node,&c->inode_lru);
+    }
+
+    nk_semaphore_up(c->ilock);
+}
+
+
+/*
+ * Directory entry cache
+ */
+
+static uint32_t dcache_hash(uint32_t parent, char *name, uint8_t len)
+{
+    uint32_t h = 2166136261U ^ parent;   // FNV-1a
+    uint8_t i;
+
+    for (i=0;i<len;i++) {
+	h ^= (uint8_t)name[i];
+	h *= 16777619U;
+    }
+
+    return h % DCACHE_SIZE;
+}
+
+static struct ext2_dcache_entry *dcache_find(struct ext2_cache *c, uint32_t parent, char *name, uint8_t len)
+{
+    struct list_head *cur;
+
+    list_for_each(cur,&c->dentry_hash[dcache_hash(parent,name,len)]) {
+	struct ext2_dcache_entry *e = list_entry(cur,struct ext2_dcache_entry,hash_node);
+	if (e->parent==parent && e->name_len==len && !memcmp(e->name,name,len)) {
+	    return e;
+	}
+    }
+    return 0;
+}
+
+// Returns 1 and the inode number (0 if the name does not exist) if
+// the entry is cached.  Otherwise returns 0 and the generation to
+// hand to dcache_insert once the directory has been scanned.
+static int dcache_lookup(struct ext2_state *fs, uint32_t parent, char *name, uint32_t *inode_num, uint64_t *gen)
+{
+    DCACHE_LOCK_CONF;
+    struct ext2_cache *c = fs->cache;
+    size_t len = strlen(name);
+    struct ext2_dcache_entry *e;
+
+    if (len > EXT2_NAME_LEN) {
+	return 0;
+    }
+
+    DCACHE_LOCK(c);
+
+    e = dcache_find(c,parent,name,len);
+
+    if (e) {
+	c->dhits++;
+	*inode_num = e->inode_num;
+	list_move(&e->lru_node,&c->dentry_lru);
+    } else {
+	c->dmisses++;
+	*gen = c->dgen;
+    }
+
+    DCACHE_UNLOCK(c);
+
+    return e!=0;
+}
+
+static void __dcache_insert(struct ext2_cache *c, uint32_t parent, char *name, uint8_t len, uint32_t inode_num)
+{
+    struct ext2_dcache_entry *e = dcache_find(c,parent,name,len);
+
+    if (!e) {
+	e = list_entry(c->dentry_lru.prev,struct ext2_dcache_entry,lru_node);
+	list_del_init(&e->hash_node);
+	e->parent = parent;
+	e->name_len = len;
+	memcpy(e->name,name,len);
+	list_add(&e->hash_node,&c->dentry_hash[dcache_hash(parent,name,len)]);
+    }
+
+    e->inode_num = inode_num;
+    list_move(&e->lru_node,&c->dentry_lru);
+}
+
+// Record the result of a directory scan, unless the directory may
+// have changed since the lookup that missed
+static void dcache_insert(struct ext2_state *fs, uint32_t parent, char *name, uint32_t inode_num, uint64_t gen)
+{
+    DCACHE_LOCK_CONF;
+    struct ext2_cache *c = fs->cache;
+    size_t len = strlen(name);
+
+    if (len > EXT2_NAME_LEN) {
+	return;
+    }
+
+    DCACHE_LOCK(c);
+    if (c->dgen==gen) {
+	__dcache_insert(c,parent,name,len,inode_num);
+    }
+    DCACHE_UNLOCK(c);
+}
+
+// The directory has changed - name now maps to inode_num (0 if removed)
+static void dcache_update(struct ext2_state *fs, uint32_t parent, char *name, uint32_t inode_num)
+{
+    DCACHE_LOCK_CONF;
+    struct ext2_cache *c = fs->cache;
+    size_t len = strlen(name);
+
+    DCACHE_LOCK(c);
+    c->dgen++;
+    if (len <= EXT2_NAME_LEN) {
+	__dcache_insert(c,parent,name,len,inode_num);
+    }
+    DCACHE_UNLOCK(c);
+}
+
+#else
+
+static int cache_init(struct ext2_state *fs) { return 0; }
+static void cache_deinit(struct ext2_state *fs) { }
+
+static int read_write_inode_cached(struct ext2_state *fs, uint32_t inode_num, struct ext2_inode *srcdest, int write)
+{
+    return read_write_inode(fs,inode_num,srcdest,write);
+}
+
+static int icache_flush(struct ext2_state *fs, uint32_t inode_num) { return 0; }
+static void icache_drop(struct ext2_state *fs, uint32_t inode_num) { }
+
+static int dcache_lookup(struct ext2_state *fs, uint32_t parent, char *name, uint32_t *inode_num, uint64_t *gen) { return 0; }
+static void dcache_insert(struct ext2_state *fs, uint32_t parent, char *name, uint32_t inode_num, uint64_t gen) { }
+static void dcache_update(struct ext2_state *fs, uint32_t parent, char *name, uint32_t inode_num) { }
+
+#endif
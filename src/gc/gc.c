@@ -82,6 +82,31 @@ handle_leaks (char * buf, void * priv)
 #endif
 }
 
+static int 
+handle_collect_incr (char * buf, void * priv)
+{
+#ifdef NAUT_CONFIG_INCREMENTAL_PDSGC
+    nk_vc_printf("Doing PDSGC incremental garbage collection\n");
+    struct nk_gc_pdsgc_incr_stats s;
+    int rc = nk_gc_pdsgc_collect_incremental(&s);
+    nk_vc_printf("PDSGC incremental garbage collection done result: %d\n",rc);
+    if (rc) {
+	return 0;
+    }
+    nk_vc_printf("%lu blocks / %lu bytes freed\n",
+		 s.freed.num_blocks, s.freed.total_bytes);
+    nk_vc_printf("pauses: initial %lu ns, final %lu ns, max so far %lu ns\n",
+		 s.initial_pause_ns, s.final_pause_ns, s.max_pause_ns);
+    nk_vc_printf("concurrent mark %lu ns, concurrent sweep %lu ns, %lu barrier log entries%s\n",
+		 s.concurrent_mark_ns, s.concurrent_sweep_ns, s.barrier_log_entries,
+		 s.barrier_log_overflow ? " (overflowed)" : "");
+    return 0;
+#else
+    nk_vc_printf("Incremental garbage collection is not enabled...\n");
+    return 0;
+#endif
+}
+
 static int
 handle_bdwgc (char * buf, void * priv)
 {
@@ -98,7 +123,14 @@ handle_pdsgc (char * buf, void * priv)
 {
 #ifdef NAUT_CONFIG_TEST_PDSGC
     nk_vc_printf("Testing PDSGC garbage collector\n");
+#ifdef NAUT_CONFIG_INCREMENTAL_PDSGC
+    if (nk_gc_pdsgc_test()) {
+	return -1;
+    }
+    return nk_gc_pdsgc_incremental_test();
+#else
     return nk_gc_pdsgc_test();
+#endif
 #else
     return 0;
 #endif
@@ -111,6 +143,13 @@ static struct shell_cmd_impl collect_impl = {
 };
 nk_register_shell_cmd(collect_impl);
 
+static struct shell_cmd_impl collect_incr_impl = {
+    .cmd      = "collect-incr",
+    .help_str = "collect-incr",
+    .handler  = handle_collect_incr,
+};
+nk_register_shell_cmd(collect_incr_impl);
+
 static struct shell_cmd_impl leaks_impl = {
     .cmd      = "leaks",
     .help_str = "leaks",
@@ -68,6 +68,26 @@ static struct thread_stack_limits {
 
 static void *kmem_internal_start, *kmem_internal_end;
 
+// the stack the marker is currently running on, for overflow checks
+static void *mark_stack = 0;
+
+#ifdef NAUT_CONFIG_INCREMENTAL_PDSGC
+#define INCR_LOG_ENTRIES NAUT_CONFIG_INCREMENTAL_PDSGC_LOG_ENTRIES
+// the marker stops draining the log concurrently and does the final
+// pause once fewer than this many entries are outstanding
+#define INCR_DRAIN_THRESHOLD 64
+#define INCR_DRAIN_ROUNDS    16
+
+volatile int nk_gc_pdsgc_marking = 0;
+
+// write barrier log - entries are zero unless they have been
+// written and not yet drained
+static void * volatile *incr_log = 0;
+static volatile uint64_t incr_log_next = 0;
+static volatile uint64_t incr_log_overflow = 0;
+static uint64_t incr_log_drained = 0;
+#endif
+
 int  nk_gc_pdsgc_init()
 {
     gc_stack = kmem_mallocz(GC_STACK_SIZE);
@@ -80,6 +100,13 @@ int  nk_gc_pdsgc_init()
 	ERROR("Failed to allocate GC thread stack limits array\n");
 	return -1;
     } 
+#ifdef NAUT_CONFIG_INCREMENTAL_PDSGC
+    incr_log = kmem_mallocz(sizeof(void*)*INCR_LOG_ENTRIES);
+    if (!incr_log) {
+	ERROR("Failed to allocate write barrier log\n");
+	return -1;
+    }
+#endif
     INFO("init\n");
     return 0;
 }
@@ -88,6 +115,9 @@ void nk_gc_bdsgc_deinit()
 {
     kmem_free(gc_stack);
     kmem_free(gc_thread_stack_limits);
+#ifdef NAUT_CONFIG_INCREMENTAL_PDSGC
+    kmem_free((void*)incr_log);
+#endif
     INFO("deinit\n");
 }
 
@@ -219,7 +249,7 @@ static inline int handle_address(void *start)
 	return 0;
     }
 
-    if ((addr_t)approx_rsp < (addr_t)(gc_stack+4096)) { 
+    if ((addr_t)approx_rsp < (addr_t)(mark_stack+4096)) { 
 	ERROR("Ran out of room in the GC stack!\n");
 	return -1;
     }
@@ -329,6 +359,18 @@ static int mark_gc_state()
 	return -1;
     }
 
+#ifdef NAUT_CONFIG_INCREMENTAL_PDSGC
+    if (kmem_find_block((void*)incr_log,&block_addr,&block_size,&flags)) { 
+	ERROR("Could not find write barrier log?!\n");
+	return -1;
+    }
+
+    if (kmem_set_block_flags(block_addr, flags | VISITED)) {
+	ERROR("Failed to set visited on write barrier log\n");
+	return -1;
+    }
+#endif
+
     return 0;
 }
 
@@ -448,6 +490,10 @@ static int  _nk_gc_pdsgc_handle(int (*handle_unvisited)(void *block, void *state
 {
     nk_sched_stop_world();
 
+    // an incremental marker may have been stopped mid-flight on its own stack
+    void *old_mark_stack = mark_stack;
+    mark_stack = gc_stack;
+
     blocks_freed=0;
 
     kmem_get_internal_pointer_range(&kmem_internal_start,&kmem_internal_end);
@@ -489,12 +535,14 @@ static int  _nk_gc_pdsgc_handle(int (*handle_unvisited)(void *block, void *state
 // out_good:
     DEBUG("Pass succeeded - pass %lu freed/detected %lu blocks\n", num_gc, blocks_freed);
     num_gc++;
+    mark_stack = old_mark_stack;
     nk_sched_start_world();
     return 0;
 
  out_bad:
     ERROR("Pass failed\n");
     num_gc++;
+    mark_stack = old_mark_stack;
     nk_sched_start_world();
     return -1;
 }
@@ -567,6 +615,365 @@ int  nk_gc_pdsgc_leak_detect(struct nk_gc_pdsgc_stats *s)
     return rc;
 }
 
+#ifdef NAUT_CONFIG_INCREMENTAL_PDSGC
+
+static volatile int incr_active = 0;
+static nk_thread_id_t incr_tid;
+static int incr_rc;
+static struct nk_gc_pdsgc_incr_stats incr_stats;
+static uint64_t incr_max_pause_ns = 0;
+
+void _nk_gc_pdsgc_write_barrier_slow(void *val)
+{
+    uint64_t i;
+    uint8_t flags;
+
+    if (!val) { 
+	return;
+    }
+
+    // with interrupts off we cannot be stopped by a world stop
+    // between reserving the entry and filling it in
+    flags = irq_disable_save();
+
+    // recheck now that the final pause cannot intervene
+    if (nk_gc_pdsgc_marking) { 
+	i = __sync_fetch_and_add(&incr_log_next,1);
+	if (i < INCR_LOG_ENTRIES) {
+	    incr_log[i] = val;
+	} else {
+	    incr_log_overflow = 1;
+	}
+    }
+
+    irq_enable_restore(flags);
+}
+
+// visit logged pointers - with the world running, a zero entry is a
+// writer on another cpu that has reserved it but not yet filled it in,
+// so we stop there and come back later
+static int incr_drain_log(uint64_t *outstanding)
+{
+    uint64_t limit = incr_log_next;
+    void *p;
+
+    if (limit > INCR_LOG_ENTRIES) {
+	limit = INCR_LOG_ENTRIES;
+    }
+
+    while (incr_log_drained < limit) {
+	if (!(p = incr_log[incr_log_drained])) {
+	    break;
+	}
+	incr_log[incr_log_drained++] = 0;
+	if (handle_address(p)) { 
+	    ERROR("Failed to handle logged address %p\n",p);
+	    return -1;
+	}
+    }
+
+    if (outstanding) {
+	*outstanding = limit - incr_log_drained;
+    }
+
+    return 0;
+}
+
+static void incr_note_pause(uint64_t *which, uint64_t ns)
+{
+    *which = ns;
+    if (ns > incr_max_pause_ns) { 
+	incr_max_pause_ns = ns;
+    }
+}
+
+static int incr_dealloc(void *block, void *state)
+{
+    struct nk_gc_pdsgc_stats *s = (struct nk_gc_pdsgc_stats *)state;
+    void *block_addr;
+    uint64_t block_size, flags;
+
+    if (kmem_find_block(block,&block_addr,&block_size,&flags)) { 
+	ERROR("Unable to find block %p on free\n",block);
+	return -1;
+    }
+
+    if (block_addr!=block) {
+	ERROR("Deallocation is not using the enclosing block (dealloc %p but enclosing block is %p (%lu bytes)\n", block, block_addr, block_size);
+	return -1;
+    }
+
+    DEBUG("Freeing garbage block %p (%lu bytes, flags=0x%lx)\n",block_addr,block_size,flags);
+
+    kmem_free(block);
+
+    s->num_blocks++;
+    s->total_bytes += block_size;
+    if (block_size < s->min_block) { s->min_block=block_size; }
+    if (block_size > s->max_block) { s->max_block=block_size; }
+
+    return 0;
+}
+
+static int incr_initial_pause()
+{
+    nk_sched_stop_world();
+
+    kmem_get_internal_pointer_range(&kmem_internal_start,&kmem_internal_end);
+
+    if (kmem_mask_all_blocks_flags(~VISITED,0)) { 
+	ERROR("Failed to clear visit flags...\n");
+	goto out_bad;
+    }
+
+    if (mark_gc_state()) { 
+	ERROR("Failed to mark GC state\n");
+	goto out_bad;
+    }
+
+    // stacks are not scanned concurrently - the final pause marks
+    // from them - but the concurrent marker can still reach a stack
+    // block through the heap, and this snapshot lets it skip the
+    // dead part.  It is redone in the final pause.
+    if (capture_thread_stack_limits()) { 
+	ERROR("Cannot capture thread stack limits\n");
+	goto out_bad;
+    }
+
+    incr_log_next = 0;
+    incr_log_drained = 0;
+    incr_log_overflow = 0;
+
+    // allocate black - anything allocated from here on is live
+    kmem_set_new_block_flags(VISITED);
+
+    nk_gc_pdsgc_marking = 1;
+    __sync_synchronize();
+
+    nk_sched_start_world();
+    return 0;
+
+ out_bad:
+    nk_sched_start_world();
+    return -1;
+}
+
+static int incr_final_pause()
+{
+    uint64_t i;
+
+    nk_sched_stop_world();
+
+    if (capture_thread_stack_limits()) { 
+	ERROR("Cannot capture thread stack limits\n");
+	goto out_bad;
+    }
+
+    if (incr_log_overflow) { 
+	// we have lost track of some stores, so do a full mark
+	DEBUG("Write barrier log overflowed - doing full mark\n");
+	for (i=incr_log_drained;i<INCR_LOG_ENTRIES;i++) {
+	    incr_log[i] = 0;
+	}
+	incr_log_drained = INCR_LOG_ENTRIES;
+	if (kmem_mask_all_blocks_flags(~VISITED,0) || mark_gc_state()) { 
+	    ERROR("Failed to reset marks\n");
+	    goto out_bad;
+	}
+    }
+
+    if (handle_data_roots()) {
+	ERROR("Failed to rescan data segment roots\n");
+	goto out_bad;
+    }
+
+    if (handle_thread_stack_roots()) { 
+	ERROR("Failed to rescan thread stack roots\n");
+	goto out_bad;
+    }
+
+    // no barrier can be in flight now, so every reserved entry is filled in
+    if (incr_drain_log(0)) { 
+	ERROR("Failed to drain write barrier log\n");
+	goto out_bad;
+    }
+
+    incr_stats.barrier_log_entries = incr_log_next;
+    incr_stats.barrier_log_overflow = incr_log_overflow;
+
+    nk_gc_pdsgc_marking = 0;
+    __sync_synchronize();
+
+    nk_sched_start_world();
+    return 0;
+
+ out_bad:
+    nk_gc_pdsgc_marking = 0;
+    nk_sched_start_world();
+    return -1;
+}
+
+static int incr_cycle()
+{
+    uint64_t start, end, outstanding;
+    int i;
+
+    mark_stack = get_cur_thread()->stack;
+
+    start = nk_sched_get_realtime();
+    if (incr_initial_pause()) {
+	ERROR("Initial pause failed\n");
+	kmem_set_new_block_flags(0);
+	return -1;
+    }
+    end = nk_sched_get_realtime();
+    incr_note_pause(&incr_stats.initial_pause_ns,end-start);
+
+    DEBUG("Concurrent mark starting\n");
+
+    start = end;
+
+    if (handle_data_roots()) { 
+	ERROR("Failed to handle data segment roots\n");
+	goto out_bad;
+    }
+
+    // keep up with the mutators so that the final pause has little to do
+    for (i=0;i<INCR_DRAIN_ROUNDS;i++) {
+	if (incr_drain_log(&outstanding)) { 
+	    goto out_bad;
+	}
+	if (outstanding < INCR_DRAIN_THRESHOLD) { 
+	    break;
+	}
+	nk_yield();
+    }
+
+    end = nk_sched_get_realtime();
+    incr_stats.concurrent_mark_ns = end-start;
+
+    start = end;
+    if (incr_final_pause()) { 
+	ERROR("Final pause failed\n");
+	kmem_set_new_block_flags(0);
+	return -1;
+    }
+    end = nk_sched_get_realtime();
+    incr_note_pause(&incr_stats.final_pause_ns,end-start);
+
+    // unmarked blocks are unreachable, so they can be freed with the
+    // world running.  New blocks are still allocated black until we are done.
+    DEBUG("Concurrent sweep starting\n");
+    start = end;
+    incr_stats.freed.min_block = -1;
+    if (kmem_apply_to_matching_blocks(VISITED,0,incr_dealloc,&incr_stats.freed)) { 
+	ERROR("Failed to complete concurrent sweep\n");
+	kmem_set_new_block_flags(0);
+	return -1;
+    }
+    kmem_set_new_block_flags(0);
+    end = nk_sched_get_realtime();
+    incr_stats.concurrent_sweep_ns = end-start;
+
+    if (!incr_stats.freed.num_blocks) { 
+	incr_stats.freed.min_block=0;
+    }
+
+    incr_stats.max_pause_ns = incr_max_pause_ns;
+
+    DEBUG("Incremental cycle succeeded - freed %lu blocks\n", incr_stats.freed.num_blocks);
+
+    return 0;
+
+ out_bad:
+    // abandon the cycle - stop marking without freeing anything
+    nk_sched_stop_world();
+    nk_gc_pdsgc_marking = 0;
+    nk_sched_start_world();
+    kmem_set_new_block_flags(0);
+    return -1;
+}
+
+static void incr_marker(void *in, void **out)
+{
+    struct nk_sched_constraints c = { .type=APERIODIC,
+				      .interrupt_priority_class=0x0, 
+				      .aperiodic.priority=NAUT_CONFIG_INCREMENTAL_PDSGC_PRIORITY };
+
+    if (nk_thread_name(get_cur_thread(),"(pdsgc-mark)")) { 
+	WARN("Failed to name marker thread\n");
+    }
+
+    if (nk_sched_thread_change_constraints(&c)) { 
+	WARN("Unable to lower priority of marker thread\n");
+    }
+
+    incr_rc = incr_cycle();
+    num_gc++;
+}
+
+int  nk_gc_pdsgc_incremental_start()
+{
+#ifndef NAUT_CONFIG_INCREMENTAL_PDSGC_ANNOTATED_HEAP
+    ERROR("Heap pointer stores do not use the write barrier - refusing incremental collection\n");
+    return -1;
+#endif
+
+    if (!incr_log) { 
+	ERROR("Write barrier log is not allocated\n");
+	return -1;
+    }
+
+    if (!__sync_bool_compare_and_swap(&incr_active,0,1)) { 
+	DEBUG("Incremental collection already in progress\n");
+	return -1;
+    }
+
+    INFO("Starting incremental garbage collection\n");
+
+    memset(&incr_stats,0,sizeof(incr_stats));
+    incr_rc = -1;
+
+    if (nk_thread_start(incr_marker,0,0,0,GC_STACK_SIZE,&incr_tid,-1)) { 
+	ERROR("Failed to start marker thread\n");
+	incr_active = 0;
+	return -1;
+    }
+
+    return 0;
+}
+
+int  nk_gc_pdsgc_incremental_wait(struct nk_gc_pdsgc_incr_stats *s)
+{
+    if (!incr_active) { 
+	ERROR("No incremental collection is in progress\n");
+	return -1;
+    }
+
+    if (nk_join(incr_tid,0)) { 
+	ERROR("Failed to join marker thread\n");
+	return -1;
+    }
+
+    if (s) { 
+	*s = incr_stats;
+    }
+
+    incr_active = 0;
+
+    return incr_rc;
+}
+
+int  nk_gc_pdsgc_collect_incremental(struct nk_gc_pdsgc_incr_stats *s)
+{
+    if (nk_gc_pdsgc_incremental_start()) { 
+	return -1;
+    }
+    return nk_gc_pdsgc_incremental_wait(s);
+}
+
+#endif
+
 #define NUM_ALLOCS 8
 
 static uint64_t num_bytes_alloced = 0;
@@ -686,3 +1093,132 @@ int  nk_gc_pdsgc_test()
 
     return rc;
 }
+
+#ifdef NAUT_CONFIG_INCREMENTAL_PDSGC
+
+#define INCR_TEST_OBJS    64
+#define INCR_TEST_BATCH   1024
+#define INCR_TEST_BATCHES 4096
+
+int  nk_gc_pdsgc_incremental_test()
+{
+    int rc = 0;
+    uint64_t i, j, start, end;
+    uint64_t idle_cycles=0, idle_stores=0, active_cycles=0, active_stores=0;
+    struct nk_gc_pdsgc_stats before, after;
+    struct nk_gc_pdsgc_incr_stats s;
+    void **a, **b;
+
+    nk_vc_printf("Testing incremental PDSGC\n");
+
+#ifndef NAUT_CONFIG_INCREMENTAL_PDSGC_ANNOTATED_HEAP
+    nk_vc_printf("Heap is not annotated with the write barrier - skipping\n");
+    return 0;
+#endif
+
+    if (nk_gc_pdsgc_leak_detect(&before)) { 
+	nk_vc_printf("Leak detection failed\n");
+	return -1;
+    }
+
+    __asm__ __volatile__ ("call _nk_gc_pdsgc_test_inner" : : : 
+			  "cc", "memory", "rax", "rbx", "rcx", "rdx",
+			  "rsi","rdi","r8","r9","r10","r11", "r12",
+			  "r13", "r14", "r15");
+
+    // two live tables whose entries we will shuffle between
+    // each other (through the barrier) while marking is going on
+    a = malloc(sizeof(void*)*INCR_TEST_OBJS);
+    b = malloc(sizeof(void*)*INCR_TEST_OBJS);
+    if (!a || !b) { 
+	nk_vc_printf("Failed to allocate test tables\n");
+	return -1;
+    }
+    for (i=0;i<INCR_TEST_OBJS;i++) { 
+	a[i] = malloc(64);
+	b[i] = 0;
+	if (!a[i]) { 
+	    nk_vc_printf("Failed to allocate test object\n");
+	    return -1;
+	}
+    }
+
+    if (nk_gc_pdsgc_incremental_start()) { 
+	nk_vc_printf("Failed to start incremental collection\n");
+	return -1;
+    }
+
+    for (i=0;i<INCR_TEST_BATCHES;i++) { 
+	int marking = nk_gc_pdsgc_marking;
+	start = rdtsc();
+	for (j=0;j<INCR_TEST_BATCH;j++) { 
+	    uint64_t k = j % INCR_TEST_OBJS;
+	    if (a[k]) { 
+		NK_GC_PDSGC_WRITE(b[k],a[k]);
+		a[k] = 0;
+	    } else {
+		NK_GC_PDSGC_WRITE(a[k],b[k]);
+		b[k] = 0;
+	    }
+	}
+	end = rdtsc();
+	if (marking && nk_gc_pdsgc_marking) { 
+	    active_cycles += end-start;
+	    active_stores += INCR_TEST_BATCH;
+	} else if (!marking && !nk_gc_pdsgc_marking) {
+	    idle_cycles += end-start;
+	    idle_stores += INCR_TEST_BATCH;
+	}
+	if (!(i%64)) { 
+	    nk_yield();
+	}
+    }
+
+    rc = nk_gc_pdsgc_incremental_wait(&s);
+    if (rc) { 
+	nk_vc_printf("Incremental collection failed\n");
+	return -1;
+    }
+
+    nk_vc_printf("%lu blocks / %lu bytes were collected\n",
+		 s.freed.num_blocks, s.freed.total_bytes);
+    nk_vc_printf("pauses: initial %lu ns, final %lu ns, max so far %lu ns\n",
+		 s.initial_pause_ns, s.final_pause_ns, s.max_pause_ns);
+    nk_vc_printf("concurrent mark %lu ns, concurrent sweep %lu ns\n",
+		 s.concurrent_mark_ns, s.concurrent_sweep_ns);
+    nk_vc_printf("barrier logged %lu pointers%s\n",
+		 s.barrier_log_entries, s.barrier_log_overflow ? " (overflowed)" : "");
+    nk_vc_printf("barriered store: %lu cycles idle, %lu cycles while marking\n",
+		 idle_stores ? idle_cycles/idle_stores : 0,
+		 active_stores ? active_cycles/active_stores : 0);
+
+    // everything we shuffled around must have survived
+    for (i=0;i<INCR_TEST_OBJS;i++) { 
+	void *p = a[i] ? a[i] : b[i];
+	void *block_addr;
+	uint64_t block_size, flags;
+	if (kmem_find_block(p,&block_addr,&block_size,&flags) || block_addr!=p) { 
+	    nk_vc_printf("Error: live object %p was collected\n",p);
+	    rc = -1;
+	}
+    }
+
+    if (s.freed.num_blocks < NUM_ALLOCS) { 
+	nk_vc_printf("Error: intentionally leaked %lu blocks, but only %lu blocks were collected\n", NUM_ALLOCS, s.freed.num_blocks);
+	rc = -1;
+    }
+
+    if (nk_gc_pdsgc_leak_detect(&after)) { 
+	nk_vc_printf("Leak detection failed\n");
+	return -1;
+    }
+
+    if (after.num_blocks > before.num_blocks) { 
+	nk_vc_printf("Error: %lu blocks leaked before, %lu after\n", before.num_blocks, after.num_blocks);
+	rc = -1;
+    }
+
+    return rc;
+}
+
+#endif
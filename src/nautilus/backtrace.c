@@ -24,6 +24,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/cpu.h>
 #include <nautilus/thread.h>
+#include <nautilus/linker.h>
 
 extern int printk (const char * fmt, ...);
 
@@ -35,7 +36,14 @@ __do_backtrace (void ** fp, unsigned depth)
         return;
     }
     
-    printk("[%2u] RIP: %p RBP: %p\n", depth, *(fp+1), *fp);
+    char * sym;
+    uint64_t off;
+
+    if (!nk_linker_addr_to_symbol(nk_get_nautilus_info()->sys.linker_info, (uint64_t)*(fp+1), &sym, &off)) {
+        printk("[%2u] RIP: %p RBP: %p <%s+0x%lx>\n", depth, *(fp+1), *fp, sym, off);
+    } else {
+        printk("[%2u] RIP: %p RBP: %p\n", depth, *(fp+1), *fp);
+    }
 
     __do_backtrace(*fp, depth+1);
 }
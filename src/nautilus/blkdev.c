@@ -25,6 +25,12 @@
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
 #include <nautilus/shell.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/random.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/waitqueue.h>
+#include <test/test.h>
 
 #ifndef NAUT_CONFIG_DEBUG_BLKDEV
 #undef DEBUG_PRINT
@@ -91,6 +97,20 @@ int nk_block_dev_get_characteristics(struct nk_block_dev *dev, struct nk_block_d
     return di->get_characteristics(d->state,c);
 }
 
+int nk_block_dev_map(struct nk_block_dev *dev, uint64_t blocknum, uint64_t count, void **addr)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+
+    DEBUG("map of %s blocks %lu-%lu\n",d->name,blocknum,blocknum+count);
+
+    if (!di->map_blocks) {
+        return -1;
+    }
+
+    return di->map_blocks(d->state,blocknum,count,addr);
+}
+
 struct op {
     int                 completed;
     nk_block_dev_status_t status;
@@ -245,6 +265,450 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 
 }
 
+/*
+ * Submission/completion rings
+ */
+
+// A device request built from one or more merged submission entries
+struct ring_req {
+    struct nk_block_dev_req  req;         // what the driver sees
+    struct nk_block_dev_ring *ring;
+    uint32_t                 first_sqe;   // where its entries start in the submission ring
+    uint32_t                 nsqes;       // how many entries were merged into it
+    uint64_t                 user_data[NK_BLOCK_DEV_MAX_SEGS];
+    // for devices without submit_batch
+    uint32_t                 segs_left;
+    nk_block_dev_status_t    status;
+    struct ring_req          *next_free;
+};
+
+struct nk_block_dev_ring {
+    struct nk_block_dev      *dev;
+    uint64_t                 block_size;
+    uint64_t                 num_blocks;
+    uint32_t                 entries;
+    uint32_t                 mask;
+    int                      flags;
+
+    // submission side, touched only by the owning thread
+    uint32_t                 sq_head;
+    uint32_t                 sq_tail;
+    struct nk_block_dev_sqe  *sqes;
+    struct nk_block_dev_req  **batch;
+
+    // completion side, filled in by completion callbacks
+    spinlock_t               lock;
+    volatile uint32_t        cq_head;
+    volatile uint32_t        cq_tail;
+    volatile uint32_t        inflight;    // entries handed to the driver, not yet completed
+    volatile int             waiting;
+    struct nk_block_dev_cqe  *cqes;
+    struct ring_req          *reqs;
+    struct ring_req          *free_reqs;
+    nk_wait_queue_t          *wq;
+
+    struct nk_block_dev_ring_stats stats;
+};
+
+#define RING_LOCK_CONF uint8_t _ring_lock_flags
+#define RING_LOCK(r) _ring_lock_flags = spin_lock_irq_save(&(r)->lock)
+#define RING_UNLOCK(r) spin_unlock_irq_restore(&(r)->lock, _ring_lock_flags)
+
+
+struct nk_block_dev_ring *nk_block_dev_ring_create(struct nk_block_dev *dev, uint32_t entries, int flags)
+{
+    struct nk_block_dev_characteristics c;
+    struct nk_block_dev_ring *r;
+    uint32_t n = 1;
+    uint32_t i;
+
+    if (nk_block_dev_get_characteristics(dev,&c)) {
+        ERROR("cannot get characteristics of %s\n",dev->dev.name);
+        return 0;
+    }
+
+    while (n < entries) {
+        n <<= 1;
+    }
+
+    r = malloc(sizeof(*r));
+    if (!r) {
+        ERROR("cannot allocate ring\n");
+        return 0;
+    }
+    memset(r,0,sizeof(*r));
+
+    r->dev = dev;
+    r->block_size = c.block_size;
+    r->num_blocks = c.num_blocks;
+    r->entries = n;
+    r->mask = n - 1;
+    r->flags = flags;
+    spinlock_init(&r->lock);
+
+    r->sqes = malloc(n * sizeof(struct nk_block_dev_sqe));
+    r->cqes = malloc(n * sizeof(struct nk_block_dev_cqe));
+    r->reqs = malloc(n * sizeof(struct ring_req));
+    r->batch = malloc(n * sizeof(struct nk_block_dev_req *));
+    r->wq = nk_wait_queue_create(0);
+
+    if (!r->sqes || !r->cqes || !r->reqs || !r->batch || !r->wq) {
+        ERROR("cannot allocate ring of %u entries\n",n);
+        nk_block_dev_ring_destroy(r);
+        return 0;
+    }
+
+    memset(r->reqs,0,n * sizeof(struct ring_req));
+
+    for (i = 0; i < n; i++) {
+        r->reqs[i].ring = r;
+        r->reqs[i].next_free = i+1 < n ? &r->reqs[i+1] : 0;
+    }
+    r->free_reqs = &r->reqs[0];
+
+    DEBUG("created ring of %u entries for %s\n",n,dev->dev.name);
+
+    return r;
+}
+
+void nk_block_dev_ring_destroy(struct nk_block_dev_ring *r)
+{
+    if (r->inflight) {
+        ERROR("destroying ring with %u requests in flight\n",r->inflight);
+        nk_block_dev_ring_wait(r,r->entries);
+    }
+    if (r->wq) { nk_wait_queue_destroy(r->wq); }
+    if (r->batch) { free(r->batch); }
+    if (r->reqs) { free(r->reqs); }
+    if (r->cqes) { free(r->cqes); }
+    if (r->sqes) { free(r->sqes); }
+    free(r);
+}
+
+struct nk_block_dev_sqe *nk_block_dev_ring_get_sqe(struct nk_block_dev_ring *r)
+{
+    RING_LOCK_CONF;
+    struct nk_block_dev_sqe *sqe;
+    uint32_t used;
+
+    // a completion moves entries from inflight to the completion ring
+    // under the lock, so only there do the two add up consistently
+    RING_LOCK(r);
+    used = (r->sq_tail - r->sq_head) + r->inflight + (r->cq_tail - r->cq_head);
+    RING_UNLOCK(r);
+
+    if (used >= r->entries) {
+        return 0;
+    }
+
+    sqe = &r->sqes[r->sq_tail & r->mask];
+    memset(sqe,0,sizeof(*sqe));
+    r->sq_tail++;
+
+    return sqe;
+}
+
+// post completions for all the entries of a request and recycle it
+static void ring_req_done(struct ring_req *rr, nk_block_dev_status_t status)
+{
+    RING_LOCK_CONF;
+    struct nk_block_dev_ring *r = rr->ring;
+    uint32_t i;
+
+    RING_LOCK(r);
+    for (i = 0; i < rr->nsqes; i++) {
+        struct nk_block_dev_cqe *cqe = &r->cqes[r->cq_tail & r->mask];
+        cqe->user_data = rr->user_data[i];
+        cqe->status = status;
+        __asm__ __volatile__ ("" : : : "memory");
+        r->cq_tail++;
+    }
+    __sync_fetch_and_sub(&r->inflight,rr->nsqes);
+    rr->next_free = r->free_reqs;
+    r->free_reqs = rr;
+    RING_UNLOCK(r);
+
+    mbarrier();
+
+    if (r->waiting) {
+        nk_wait_queue_wake_all(r->wq);
+    }
+}
+
+static void ring_req_callback(nk_block_dev_status_t status, void *context)
+{
+    ring_req_done((struct ring_req *)context, status);
+}
+
+// fallback for devices without submit_batch - a request completes when
+// the last of its segments does
+static void ring_seg_done(struct ring_req *rr, nk_block_dev_status_t status)
+{
+    if (status != NK_BLOCK_DEV_STATUS_SUCCESS) {
+        rr->status = status;
+    }
+    if (!__sync_sub_and_fetch(&rr->segs_left,1)) {
+        ring_req_done(rr,rr->status);
+    }
+}
+
+static void ring_seg_callback(nk_block_dev_status_t status, void *context)
+{
+    ring_seg_done((struct ring_req *)context, status);
+}
+
+static uint32_t ring_issue_by_segment(struct nk_block_dev_ring *r, struct nk_block_dev_req **batch, uint32_t n)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(r->dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+    uint32_t i, j;
+
+    for (i = 0; i < n; i++) {
+        struct ring_req *rr = (struct ring_req *)batch[i];
+        uint64_t blocknum = rr->req.blocknum;
+
+        rr->status = NK_BLOCK_DEV_STATUS_SUCCESS;
+        // the extra count keeps the request alive until all segments are issued
+        rr->segs_left = rr->req.nsegs + 1;
+
+        for (j = 0; j < rr->req.nsegs; j++) {
+            struct nk_block_dev_seg *seg = &rr->req.seg[j];
+            uint64_t count = seg->len / r->block_size;
+            int rc;
+
+            if (rr->req.write) {
+                rc = di->write_blocks ? di->write_blocks(d->state,blocknum,count,seg->addr,ring_seg_callback,rr) : -1;
+            } else {
+                rc = di->read_blocks ? di->read_blocks(d->state,blocknum,count,seg->addr,ring_seg_callback,rr) : -1;
+            }
+
+            if (rc) {
+                // this and the remaining segments will never complete
+                rr->status = NK_BLOCK_DEV_STATUS_ERROR;
+                __sync_fetch_and_sub(&rr->segs_left, rr->req.nsegs - j);
+                break;
+            }
+
+            blocknum += count;
+        }
+
+        ring_seg_done(rr, NK_BLOCK_DEV_STATUS_SUCCESS);
+    }
+
+    return n;
+}
+
+static int sqe_valid(struct nk_block_dev_ring *r, struct nk_block_dev_sqe *sqe, uint64_t *count)
+{
+    uint32_t i;
+
+    *count = 0;
+
+    if (!sqe->nsegs || sqe->nsegs > NK_BLOCK_DEV_SQE_SEGS) {
+        return 0;
+    }
+
+    for (i = 0; i < sqe->nsegs; i++) {
+        if (!sqe->seg[i].len || sqe->seg[i].len % r->block_size) {
+            return 0;
+        }
+        *count += sqe->seg[i].len / r->block_size;
+    }
+
+    return sqe->blocknum + *count <= r->num_blocks;
+}
+
+static struct ring_req *ring_req_alloc(struct nk_block_dev_ring *r)
+{
+    RING_LOCK_CONF;
+    struct ring_req *rr;
+
+    // cannot run out, as each holds at least one of the ring's entries
+    RING_LOCK(r);
+    rr = r->free_reqs;
+    r->free_reqs = rr->next_free;
+    RING_UNLOCK(r);
+
+    return rr;
+}
+
+// Turn queued submission entries, starting at sq_head, into a batch of
+// device requests, merging where possible.  Stops at an invalid entry.
+static uint32_t ring_build_batch(struct nk_block_dev_ring *r, uint32_t *nsqes)
+{
+    struct ring_req *rr = 0;
+    uint32_t head = r->sq_head;
+    uint32_t n = 0;
+
+    *nsqes = 0;
+
+    while (head != r->sq_tail) {
+        struct nk_block_dev_sqe *sqe = &r->sqes[head & r->mask];
+        uint64_t count;
+
+        if (!sqe_valid(r,sqe,&count)) {
+            break;
+        }
+
+        if (rr && !(r->flags & NK_BLOCK_DEV_RING_NOMERGE) &&
+            rr->req.write == sqe->write &&
+            rr->req.blocknum + rr->req.count == sqe->blocknum &&
+            rr->req.nsegs + sqe->nsegs <= NK_BLOCK_DEV_MAX_SEGS) {
+            // adjacent to the previous request - merge
+            DEBUG("merging block %lu into request at %lu\n",sqe->blocknum,rr->req.blocknum);
+        } else {
+            rr = ring_req_alloc(r);
+
+            rr->req.write = sqe->write;
+            rr->req.blocknum = sqe->blocknum;
+            rr->req.count = 0;
+            rr->req.nsegs = 0;
+            rr->req.callback = ring_req_callback;
+            rr->req.context = rr;
+            rr->first_sqe = head;
+            rr->nsqes = 0;
+
+            r->batch[n++] = &rr->req;
+        }
+
+        memcpy(&rr->req.seg[rr->req.nsegs],sqe->seg,sqe->nsegs*sizeof(struct nk_block_dev_seg));
+        rr->req.nsegs += sqe->nsegs;
+        rr->req.count += count;
+        rr->user_data[rr->nsqes++] = sqe->user_data;
+
+        head++;
+        (*nsqes)++;
+    }
+
+    return n;
+}
+
+int nk_block_dev_ring_submit(struct nk_block_dev_ring *r)
+{
+    RING_LOCK_CONF;
+    struct nk_dev *d = (struct nk_dev *)(&(r->dev->dev));
+    struct nk_block_dev_int *di = (struct nk_block_dev_int *)(d->interface);
+    struct ring_req *rr;
+    uint32_t total = 0;
+    uint32_t n, nsqes, started, i;
+
+    while (r->sq_head != r->sq_tail) {
+
+        n = ring_build_batch(r,&nsqes);
+
+        if (!n) {
+            // invalid entry at the head - fail it
+            struct nk_block_dev_sqe *sqe = &r->sqes[r->sq_head & r->mask];
+
+            ERROR("invalid request for block %lu\n",sqe->blocknum);
+
+            rr = ring_req_alloc(r);
+            rr->nsqes = 1;
+            rr->user_data[0] = sqe->user_data;
+            __sync_fetch_and_add(&r->inflight,1);
+            r->sq_head++;
+            total++;
+            ring_req_done(rr,NK_BLOCK_DEV_STATUS_ERROR);
+            continue;
+        }
+
+        // completions may arrive before the driver returns
+        __sync_fetch_and_add(&r->inflight,nsqes);
+
+        if (di->submit_batch) {
+            started = di->submit_batch(d->state,r->batch,n);
+        } else {
+            started = ring_issue_by_segment(r,r->batch,n);
+        }
+
+        r->stats.batches++;
+        r->stats.requests += started;
+
+        if (started < n) {
+            // the device is full - the rest stay queued for the next submit
+            uint32_t left = r->sq_head + nsqes - ((struct ring_req *)r->batch[started])->first_sqe;
+
+            nsqes -= left;
+            __sync_fetch_and_sub(&r->inflight,left);
+
+            RING_LOCK(r);
+            for (i = started; i < n; i++) {
+                rr = (struct ring_req *)r->batch[i];
+                rr->next_free = r->free_reqs;
+                r->free_reqs = rr;
+            }
+            RING_UNLOCK(r);
+        }
+
+        r->sq_head += nsqes;
+        r->stats.submitted += nsqes;
+        total += nsqes;
+
+        if (started < n) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+static int ring_wait_check(void *state)
+{
+    struct nk_block_dev_ring *r = (struct nk_block_dev_ring *)state;
+    uint32_t avail = r->cq_tail - r->cq_head;
+
+    return avail >= r->waiting || !r->inflight;
+}
+
+uint32_t nk_block_dev_ring_wait(struct nk_block_dev_ring *r, uint32_t min_complete)
+{
+    uint32_t avail = r->cq_tail - r->cq_head;
+
+    if (avail + r->inflight < min_complete) {
+        min_complete = avail + r->inflight;
+    }
+
+    if (!min_complete || avail >= min_complete) {
+        return avail;
+    }
+
+    if (r->flags & NK_BLOCK_DEV_RING_POLL) {
+        while ((r->cq_tail - r->cq_head) < min_complete && r->inflight) {
+            asm volatile ("pause");
+        }
+    } else {
+        // waiting doubles as the number of completions we want
+        r->waiting = min_complete;
+        mbarrier();
+        while (!ring_wait_check(r)) {
+            nk_wait_queue_sleep_extended(r->wq,ring_wait_check,r);
+        }
+        r->waiting = 0;
+    }
+
+    return r->cq_tail - r->cq_head;
+}
+
+struct nk_block_dev_cqe *nk_block_dev_ring_peek_cqe(struct nk_block_dev_ring *r)
+{
+    if (r->cq_head == r->cq_tail) {
+        return 0;
+    }
+    __asm__ __volatile__ ("" : : : "memory");
+    return &r->cqes[r->cq_head & r->mask];
+}
+
+void nk_block_dev_ring_cqe_seen(struct nk_block_dev_ring *r)
+{
+    r->cq_head++;
+}
+
+void nk_block_dev_ring_get_stats(struct nk_block_dev_ring *r, struct nk_block_dev_ring_stats *s)
+{
+    *s = r->stats;
+}
+
+
 static int 
 handle_blktest (char * buf, void * priv)
 {
@@ -301,3 +765,236 @@ static struct shell_cmd_impl blktest_impl = {
     .handler  = handle_blktest,
 };
 nk_register_shell_cmd(blktest_impl);
+
+
+/*
+ * Read benchmarks: each repetition is one single-block read of a
+ * random (or the next sequential) block, and costs its latency in ns.
+ * The qd variants keep that many reads in flight on a ring per CPU,
+ * so a repetition is the latency of one read at that queue depth.
+ * The device is ramdisk0 unless changed with the blkbench command.
+ */
+#define BLKBENCH_QD 32
+
+static char blkbench_dev[DEV_NAME_LEN] = "ramdisk0";
+
+struct blkbench_cpu {
+    struct nk_block_dev_ring *ring;    // qd > 1 only
+    uint8_t                  *bufs;    // qd blocks
+    uint64_t                 *starts;  // per slot, ns
+    uint64_t                 *free_slots;
+    uint64_t                 nfree;
+    uint64_t                 next;     // next block when sequential
+};
+
+struct blkbench {
+    struct nk_block_dev *dev;
+    uint64_t            num_blocks;
+    uint64_t            block_size;
+    uint64_t            qd;
+    int                 seq;
+    int                 ncpus;
+    struct blkbench_cpu *cpus;
+};
+
+static uint64_t blkbench_next_block(struct blkbench *b, struct blkbench_cpu *c)
+{
+    uint64_t block;
+
+    if (b->seq) {
+        if (c->next >= b->num_blocks) {
+            c->next = 0;
+        }
+        block = c->next++;
+    } else {
+        nk_get_rand_bytes((uint8_t *)&block, sizeof(block));
+        block %= b->num_blocks;
+    }
+
+    return block;
+}
+
+static void blkbench_teardown(void *state)
+{
+    struct blkbench *b = (struct blkbench *)state;
+    int i;
+
+    for (i = 0; i < b->ncpus; i++) {
+        struct blkbench_cpu *c = &b->cpus[i];
+        if (c->ring) {
+            // the buffers must outlive any reads still in flight
+            nk_block_dev_ring_wait(c->ring, b->qd);
+            nk_block_dev_ring_destroy(c->ring);
+        }
+        if (c->bufs) { free(c->bufs); }
+        if (c->starts) { free(c->starts); }
+        if (c->free_slots) { free(c->free_slots); }
+    }
+
+    free(b->cpus);
+    free(b);
+}
+
+static int blkbench_setup(void **state, uint64_t qd, int seq)
+{
+    struct nk_block_dev *d;
+    struct nk_block_dev_characteristics chars;
+    struct blkbench *b;
+    uint64_t j;
+    int i;
+
+    if (!(d = nk_block_dev_find(blkbench_dev))) {
+        ERROR("Can't find block device %s for benchmark\n", blkbench_dev);
+        return -1;
+    }
+
+    if (nk_block_dev_get_characteristics(d, &chars) || !chars.num_blocks) {
+        ERROR("Can't get characteristics of %s\n", blkbench_dev);
+        return -1;
+    }
+
+    b = malloc(sizeof(*b));
+    if (!b) {
+        ERROR("Can't allocate benchmark state\n");
+        return -1;
+    }
+    memset(b, 0, sizeof(*b));
+
+    b->dev = d;
+    b->num_blocks = chars.num_blocks;
+    b->block_size = chars.block_size;
+    b->qd = qd;
+    b->seq = seq;
+    b->ncpus = nk_get_num_cpus();
+    b->cpus = malloc(b->ncpus * sizeof(*b->cpus));
+
+    if (!b->cpus) {
+        ERROR("Can't allocate benchmark state\n");
+        free(b);
+        return -1;
+    }
+    memset(b->cpus, 0, b->ncpus * sizeof(*b->cpus));
+
+    for (i = 0; i < b->ncpus; i++) {
+        struct blkbench_cpu *c = &b->cpus[i];
+
+        c->bufs = malloc(qd * b->block_size);
+        c->starts = malloc(qd * sizeof(uint64_t));
+        c->free_slots = malloc(qd * sizeof(uint64_t));
+        if (qd > 1) {
+            c->ring = nk_block_dev_ring_create(d, qd, 0);
+        }
+
+        if (!c->bufs || !c->starts || !c->free_slots || (qd > 1 && !c->ring)) {
+            ERROR("Can't allocate benchmark buffers\n");
+            blkbench_teardown(b);
+            return -1;
+        }
+
+        for (j = 0; j < qd; j++) {
+            c->free_slots[j] = j;
+        }
+        c->nfree = qd;
+
+        // sequential readers each start at a random place
+        nk_get_rand_bytes((uint8_t *)&c->next, sizeof(c->next));
+        c->next %= b->num_blocks;
+    }
+
+    *state = b;
+
+    return 0;
+}
+
+static uint64_t blkbench_run(void *state, int cpu)
+{
+    struct blkbench *b = (struct blkbench *)state;
+    struct blkbench_cpu *c = &b->cpus[cpu];
+    struct nk_block_dev_sqe *sqe;
+    struct nk_block_dev_cqe *cqe;
+    uint64_t start, slot;
+    int failed;
+
+    if (!c->ring) {
+        uint64_t block = blkbench_next_block(b, c);
+
+        start = nk_sched_get_realtime();
+        if (nk_block_dev_read(b->dev, block, 1, c->bufs, NK_DEV_REQ_BLOCKING, 0, 0)) {
+            return NK_BENCH_FAILED;
+        }
+        return nk_sched_get_realtime() - start;
+    }
+
+    // keep the queue full, then take one completion
+    while (c->nfree && (sqe = nk_block_dev_ring_get_sqe(c->ring))) {
+        slot = c->free_slots[--c->nfree];
+        sqe->write = 0;
+        sqe->blocknum = blkbench_next_block(b, c);
+        sqe->nsegs = 1;
+        sqe->seg[0].addr = c->bufs + slot * b->block_size;
+        sqe->seg[0].len = b->block_size;
+        sqe->user_data = slot;
+        c->starts[slot] = nk_sched_get_realtime();
+    }
+
+    nk_block_dev_ring_submit(c->ring);
+
+    if (!nk_block_dev_ring_wait(c->ring, 1) || !(cqe = nk_block_dev_ring_peek_cqe(c->ring))) {
+        return NK_BENCH_FAILED;
+    }
+
+    slot = cqe->user_data;
+    failed = cqe->status != NK_BLOCK_DEV_STATUS_SUCCESS;
+    nk_block_dev_ring_cqe_seen(c->ring);
+    c->free_slots[c->nfree++] = slot;
+
+    return failed ? NK_BENCH_FAILED : nk_sched_get_realtime() - c->starts[slot];
+}
+
+#define BLKBENCH(_name, _qd, _seq)                                  \
+    static int blkbench_setup_##_name(void **state)                  \
+    {                                                                \
+        return blkbench_setup(state, _qd, _seq);                     \
+    }                                                                \
+    static struct nk_bench_impl blkbench_##_name##_impl = {          \
+        .name     = "blkdev_" #_name,                                \
+        .unit     = "ns",                                            \
+        .flags    = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,           \
+        .reps     = 1000,                                            \
+        .warmup   = 10,                                              \
+        .setup    = blkbench_setup_##_name,                          \
+        .run      = blkbench_run,                                    \
+        .teardown = blkbench_teardown,                               \
+    };                                                               \
+    nk_register_bench(blkbench_##_name##_impl);
+
+BLKBENCH(read_rand, 1, 0)
+BLKBENCH(read_seq, 1, 1)
+BLKBENCH(read_rand_qd32, BLKBENCH_QD, 0)
+BLKBENCH(read_seq_qd32, BLKBENCH_QD, 1)
+
+
+static int
+handle_blkbench (char * buf, void * priv)
+{
+    char name[DEV_NAME_LEN];
+
+    if (sscanf(buf,"blkbench %31s",name) == 1) {
+        if (!nk_block_dev_find(name)) {
+            nk_vc_printf("Can't find %s\n",name);
+            return -1;
+        }
+        strncpy(blkbench_dev,name,DEV_NAME_LEN);
+    }
+
+    nk_vc_printf("blkdev_read_* benchmarks use %s\n",blkbench_dev);
+
+    return 0;
+}
+
+static struct shell_cmd_impl blkbench_impl = {
+    .cmd      = "blkbench",
+    .help_str = "blkbench [dev]",
+    .handler  = handle_blkbench,
+};
+nk_register_shell_cmd(blkbench_impl);
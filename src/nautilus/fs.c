@@ -28,6 +28,8 @@
 #include <nautilus/testfs.h>
 #include <nautilus/shell.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/scheduler.h>
+#include <test/test.h>
 
 #define INFO(fmt, args...)  INFO_PRINT("fs: " fmt, ##args)
 #define DEBUG(fmt, args...) DEBUG_PRINT("fs: " fmt, ##args)
@@ -126,6 +128,13 @@ static void *file_create(struct nk_fs *fs, char* path)
     }
 }
 
+static void file_close(struct nk_fs *fs, void *file)
+{
+    if (fs && fs->interface && fs->interface->close_file) {
+	fs->interface->close_file(fs->state, file);
+    }
+}
+
 static int file_trunc(nk_fs_fd_t fd, off_t len)
 {
     if (fd && fd->fs && fd->fs->interface && fd->fs->interface->trunc_file) {
@@ -411,11 +420,51 @@ int nk_fs_close(nk_fs_fd_t fd)
     list_del(&fd->file_node);
     STATE_UNLOCK();
 
+    file_close(fd->fs, fd->file);
+
     free(fd);
     
     return 0;
 }
 
+int nk_fs_sync(void)
+{
+    STATE_LOCK_CONF;
+    struct list_head *cur;
+    struct nk_fs **fses;
+    int n = 0, i, rc = 0;
+
+    // syncing does I/O, so we cannot hold the lock while doing it
+    STATE_LOCK();
+    list_for_each(cur,&fs_list) {
+	n++;
+    }
+    fses = malloc((n+1)*sizeof(struct nk_fs *));
+    if (fses) {
+	n = 0;
+	list_for_each(cur,&fs_list) {
+	    fses[n++] = list_entry(cur,struct nk_fs,fs_list_node);
+	}
+    }
+    STATE_UNLOCK();
+
+    if (!fses) {
+	ERROR("Cannot allocate space to sync filesystems\n");
+	return -1;
+    }
+
+    for (i=0;i<n;i++) {
+	if (fses[i]->interface->sync && fses[i]->interface->sync(fses[i]->state)) {
+	    ERROR("Failed to sync filesystem %s\n",fses[i]->name);
+	    rc = -1;
+	}
+    }
+
+    free(fses);
+
+    return rc;
+}
+
 ssize_t nk_fs_read(nk_fs_fd_t fd, void *buf, size_t num_bytes) 
 {
     FILE_LOCK_CONF;
@@ -484,6 +533,20 @@ int nk_fs_fstat(nk_fs_fd_t fd, struct nk_fs_stat *st)
     return file_stat(fd->fs,fd->file,st);
 }
 
+int nk_fs_map(nk_fs_fd_t fd, off_t offset, size_t n, void **addr)
+{
+    if (FS_FD_ERR(fd) || !(fd->flags & O_RDONLY)) {
+	ERROR("Cannot map file not opened for reading\n");
+	return -1;
+    }
+
+    if (fd->fs && fd->fs->interface && fd->fs->interface->map_file) {
+	return fd->fs->interface->map_file(fd->fs->state, fd->file, offset, n, addr);
+    } else {
+	return -1;
+    }
+}
+
 static ssize_t __seek(nk_fs_fd_t fd, size_t offset, int whence) 
 {
     if (whence == 0) {
@@ -594,6 +657,137 @@ static struct shell_cmd_impl attach_impl = {
 };
 nk_register_shell_cmd(attach_impl);
 
+static int
+handle_sync (char * buf, void * priv)
+{
+    if (nk_fs_sync()) {
+        nk_vc_printf("Sync failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static struct shell_cmd_impl sync_impl = {
+    .cmd      = "sync",
+    .help_str = "sync",
+    .handler  = handle_sync,
+};
+nk_register_shell_cmd(sync_impl);
+
+
+/*
+ * Path lookup benchmarks: each repetition opens, fstats, and closes
+ * the selected path (fs_open), stats it (fs_stat), or stats a name
+ * that does not exist in its directory (fs_stat_miss), and costs its
+ * latency in ns.  The path is selected with the fsbench command.
+ */
+static char fsbench_path[SHELL_MAX_CMD];
+static char fsbench_miss_path[SHELL_MAX_CMD+16];
+
+static int fsbench_setup(void **state)
+{
+    struct nk_fs_stat st;
+
+    if (!fsbench_path[0]) {
+        ERROR("No path selected for benchmark (use fsbench path)\n");
+        return -1;
+    }
+
+    if (nk_fs_stat(fsbench_path,&st)) {
+        ERROR("Cannot stat %s\n",fsbench_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+static uint64_t fsbench_open(void *state, int cpu)
+{
+    struct nk_fs_stat st;
+    uint64_t start = nk_sched_get_realtime();
+    nk_fs_fd_t fd = nk_fs_open(fsbench_path,O_RDONLY,0);
+
+    if (FS_FD_ERR(fd)) {
+        return NK_BENCH_FAILED;
+    }
+    if (nk_fs_fstat(fd,&st)) {
+        nk_fs_close(fd);
+        return NK_BENCH_FAILED;
+    }
+    nk_fs_close(fd);
+
+    return nk_sched_get_realtime() - start;
+}
+
+static uint64_t fsbench_stat(void *state, int cpu)
+{
+    struct nk_fs_stat st;
+    uint64_t start = nk_sched_get_realtime();
+
+    if (nk_fs_stat(fsbench_path,&st)) {
+        return NK_BENCH_FAILED;
+    }
+
+    return nk_sched_get_realtime() - start;
+}
+
+static uint64_t fsbench_stat_miss(void *state, int cpu)
+{
+    struct nk_fs_stat st;
+    uint64_t start = nk_sched_get_realtime();
+
+    if (!nk_fs_stat(fsbench_miss_path,&st)) {
+        return NK_BENCH_FAILED;
+    }
+
+    return nk_sched_get_realtime() - start;
+}
+
+#define FSBENCH(_name)                                      \
+    static struct nk_bench_impl fsbench_##_name##_impl = {   \
+        .name     = "fs_" #_name,                            \
+        .unit     = "ns",                                    \
+        .flags    = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,   \
+        .reps     = 1000,                                    \
+        .warmup   = 10,                                      \
+        .setup    = fsbench_setup,                           \
+        .run      = fsbench_##_name,                         \
+    };                                                       \
+    nk_register_bench(fsbench_##_name##_impl);
+
+FSBENCH(open)
+FSBENCH(stat)
+FSBENCH(stat_miss)
+
+static int
+handle_fsbench (char * buf, void * priv)
+{
+    char path[SHELL_MAX_CMD];
+    char *sep;
+
+    if (sscanf(buf,"fsbench %s",path)==1) {
+        strcpy(fsbench_path,path);
+        // a sibling of the path that is not there
+        strcpy(fsbench_miss_path,path);
+        if (!(sep = strrchr(fsbench_miss_path,'/'))) {
+            sep = strchr(fsbench_miss_path,':');
+        }
+        strcpy(sep ? sep+1 : fsbench_miss_path, "fsbench-missing");
+    }
+
+    nk_vc_printf("fs_* benchmarks use %s\n",
+                 fsbench_path[0] ? fsbench_path : "(no path selected)");
+
+    return 0;
+}
+
+static struct shell_cmd_impl fsbench_impl = {
+    .cmd      = "fsbench",
+    .help_str = "fsbench [path]",
+    .handler  = handle_fsbench,
+};
+nk_register_shell_cmd(fsbench_impl);
+
 
 
 #if 0
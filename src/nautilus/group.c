@@ -25,6 +25,7 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
 #include <nautilus/atomic.h>
 #include <nautilus/list.h>
 
@@ -64,6 +65,40 @@ typedef struct group_member {
   struct list_head group_member_node;
 } group_member_t;
 
+// The group's collectives (barrier, broadcast, reduce) all run over a
+// combining tree.  Each cpu with members arrives at one leaf.  The last
+// arrival at a node carries on to the node's parent, and the last
+// arrival at the root ends the episode by bumping the group's epoch,
+// which everyone else is spinning on.  The tree is rebuilt whenever
+// the membership changes, so join and leave must not overlap a
+// collective of the same group.
+#define GROUP_TREE_FANIN 4
+
+// no combining, just a barrier
+#define GROUP_OP_NONE -1
+
+typedef struct group_tree_node {
+  int lock;                 // only taken by reductions
+  volatile uint32_t count;  // arrivals still missing this episode
+  uint32_t fanin;           // arrivals per episode
+  int parent;               // -1 at the root
+  sint64_t value;           // combined so far (reductions)
+} __attribute__((aligned(64))) group_tree_node_t;
+
+typedef struct group_tree {
+  int num_nodes;
+  group_tree_node_t *nodes;
+  int leaf[MAX_CPU_NUM];    // leaf each cpu arrives at, -1 if it has no members
+} group_tree_t;
+
+// time spent waiting in collectives, kept per cpu so that accounting
+// for it doesn't put every member on one cache line
+typedef struct group_wait_stats {
+  volatile uint64_t waits;
+  volatile uint64_t wait_sum;
+  volatile uint64_t wait_max;
+} __attribute__((aligned(64))) group_wait_stats_t;
+
 typedef struct nk_thread_group {
   char group_name[MAX_GROUP_NAME];
   uint64_t group_id;
@@ -72,16 +107,26 @@ typedef struct nk_thread_group {
   uint64_t next_id;
 
   struct list_head group_member_array[MAX_CPU_NUM];
+  uint32_t cpu_members[MAX_CPU_NUM];
 
-  nk_barrier_t group_barrier;
+  group_tree_t *tree;
 
   spinlock_t group_lock;
 
-  void *message;
-  int   msg_flag;
-  uint64_t msg_count;
+  // the number of finished collectives; a member can read it on entry
+  // as the current episode since it can't move until it has arrived
+  volatile uint64_t epoch __attribute__((aligned(64)));
   int terminate_bcast;
 
+  // written by the root (message) or the last arrival (result) and read
+  // by everyone after the release.  Episode e uses slot e&1, which can't
+  // be written again before everyone has arrived at episode e+1, and so
+  // has read it
+  void * volatile message[2];
+  volatile sint64_t result[2];
+
+  group_wait_stats_t wait_stats[MAX_CPU_NUM];
+
   void *state;
 
   struct list_head thread_group_node;
@@ -185,74 +230,282 @@ thread_group_get_next_group_id(void) {
 }
 
 static void
-thread_group_barrier_init (nk_barrier_t *barrier) {
-  DEBUG_BARRIER("Initializing group barrier, group barrier at %p, count=%u\n", (void*)barrier, 0);
+thread_group_tree_destroy (group_tree_t *tree) {
+  if (tree) {
+    if (tree->nodes) {
+      FREE(tree->nodes);
+    }
+    FREE(tree);
+  }
+}
 
-  if (memset(barrier, 0, sizeof(nk_barrier_t)) == NULL) {
-    ERROR("Fail to memset barrier\n");
+// order cpus by NUMA domain and then APIC id, which keeps hyperthreads,
+// cores, and packages together
+static int
+thread_group_cpu_before (int a, int b) {
+  struct cpu *ca = nk_get_nautilus_info()->sys.cpus[a];
+  struct cpu *cb = nk_get_nautilus_info()->sys.cpus[b];
+  uint32_t da = ca->domain ? ca->domain->id : 0;
+  uint32_t db = cb->domain ? cb->domain->id : 0;
+
+  if (da != db) {
+    return da < db;
   }
 
-  barrier->lock = 0;
-  barrier->notify = 0;
-  barrier->init_count = 0;
-  barrier->remaining  = 0;
+  return ca->lapic_id < cb->lapic_id;
 }
 
+// whether two cpus are in the same domain and package, which a leaf
+// should not span
 static int
-thread_group_barrier_wait (nk_barrier_t *barrier) {
-  int res = 0;
+thread_group_cpu_near (int a, int b) {
+  struct cpu *ca = nk_get_nautilus_info()->sys.cpus[a];
+  struct cpu *cb = nk_get_nautilus_info()->sys.cpus[b];
 
-  bspin_lock(&barrier->lock);
+  return ca->domain == cb->domain &&
+    (!ca->coord || !cb->coord || ca->coord->pkg_id == cb->coord->pkg_id);
+}
 
-  DEBUG_BARRIER("Thread (%p) entering barrier (%p)\n", (void*)get_cur_thread(), (void*)barrier);
+// lay a combining tree out over the cpus that currently have members,
+// called with the group lock held.  Leaves take up to GROUP_TREE_FANIN
+// neighboring cpus, and every level above combines up to
+// GROUP_TREE_FANIN nodes of the level below.  Returns NULL on an
+// empty group or on failure (with *fail set)
+static group_tree_t *
+thread_group_tree_build (nk_thread_group_t *group, int *fail) {
+  group_tree_t *tree = NULL;
+  int *cpus = NULL;
+  int num_cpus = 0;
+  int num_leaves = 0;
+  int leaf_cpus = 0;
+  int i, j, lo, hi;
+
+  *fail = 0;
+
+  for (i = 0; i < MAX_CPU_NUM; i++) {
+    if (group->cpu_members[i]) {
+      num_cpus++;
+    }
+  }
 
-  if (--barrier->remaining == 0) {
-    res = NK_BARRIER_LAST;
-    atomic_cmpswap(barrier->notify, 0, 1); // the last thread comes in set notify
-    DEBUG_BARRIER("Thread (%p): notify\n", (void*)get_cur_thread());
-  } else {
-    DEBUG_BARRIER("Thread (%p): remaining count = %d\n", (void*)get_cur_thread(), barrier->remaining);
-    bspin_unlock(&barrier->lock);
-    BARRIER_WHILE (barrier->notify != 1);
+  if (!num_cpus) {
+    return NULL;
   }
 
-  if (atomic_inc_val(barrier->remaining) == barrier->init_count) {
-    atomic_cmpswap(barrier->notify, 1, 0); // the last thread goes out reset notify
-    DEBUG_BARRIER("Thread (%p): reset notify\n", (void*)get_cur_thread());
-    bspin_unlock(&barrier->lock);
+  tree = (group_tree_t *)MALLOC(sizeof(group_tree_t));
+  cpus = (int *)MALLOC(num_cpus * sizeof(int));
+  if (tree) {
+    // a tree over n leaves has fewer than 2n nodes
+    tree->nodes = (group_tree_node_t *)MALLOC(2 * num_cpus * sizeof(group_tree_node_t));
   }
 
-  DEBUG_BARRIER("Thread (%p) exiting barrier (%p)\n", (void*)get_cur_thread(), (void*)barrier);
+  if (!tree || !cpus || !tree->nodes) {
+    ERROR("Fail to malloc space for group tree!\n");
+    if (tree) {
+      thread_group_tree_destroy(tree);
+    }
+    if (cpus) {
+      FREE(cpus);
+    }
+    *fail = 1;
+    return NULL;
+  }
 
-  return res;
+  memset(tree->nodes, 0, 2 * num_cpus * sizeof(group_tree_node_t));
+
+  // insertion sort the cpus with members into topology order
+  num_cpus = 0;
+  for (i = 0; i < MAX_CPU_NUM; i++) {
+    tree->leaf[i] = -1;
+    if (group->cpu_members[i]) {
+      for (j = num_cpus; j > 0 && thread_group_cpu_before(i, cpus[j-1]); j--) {
+        cpus[j] = cpus[j-1];
+      }
+      cpus[j] = i;
+      num_cpus++;
+    }
+  }
+
+  // leaves
+  for (i = 0; i < num_cpus; i++) {
+    if (!num_leaves || leaf_cpus == GROUP_TREE_FANIN || !thread_group_cpu_near(cpus[i], cpus[i-1])) {
+      num_leaves++;
+      leaf_cpus = 0;
+    }
+    tree->leaf[cpus[i]] = num_leaves - 1;
+    tree->nodes[num_leaves - 1].fanin += group->cpu_members[cpus[i]];
+    leaf_cpus++;
+  }
+
+  FREE(cpus);
+
+  // interior levels, each level occupying [lo,hi)
+  lo = 0;
+  hi = num_leaves;
+  while (hi - lo > 1) {
+    for (i = lo; i < hi; i++) {
+      j = hi + (i - lo) / GROUP_TREE_FANIN;
+      tree->nodes[i].parent = j;
+      tree->nodes[j].fanin++;
+    }
+    lo = hi;
+    hi = j + 1;
+  }
+  tree->nodes[lo].parent = -1;
+  tree->num_nodes = hi;
+
+  for (i = 0; i < tree->num_nodes; i++) {
+    tree->nodes[i].count = tree->nodes[i].fanin;
+  }
+
+  DEBUG_BARRIER("Group %s: tree of %d nodes over %d cpus (%d leaves)\n",
+                group->group_name, tree->num_nodes, num_cpus, num_leaves);
+
+  return tree;
+}
+
+// replace the group's tree after a membership change, called with the
+// group lock held
+static int
+thread_group_tree_rebuild (nk_thread_group_t *group) {
+  group_tree_t *old = group->tree;
+  int fail;
+  group_tree_t *tree = thread_group_tree_build(group, &fail);
+
+  if (fail) {
+    return -1;
+  }
+
+  group->tree = tree;
+  thread_group_tree_destroy(old);
+
+  return 0;
+}
+
+static sint64_t
+thread_group_combine (int op, sint64_t a, sint64_t b) {
+  switch (op) {
+  case NK_THREAD_GROUP_SUM: return a + b;
+  case NK_THREAD_GROUP_MIN: return a < b ? a : b;
+  case NK_THREAD_GROUP_MAX: return a > b ? a : b;
+  case NK_THREAD_GROUP_AND: return a & b;
+  case NK_THREAD_GROUP_OR:  return a | b;
+  default:                  return a;
+  }
+}
+
+// arrive at the tree, combining *value on the way up unless op is
+// GROUP_OP_NONE.  Returns NK_BARRIER_LAST to the arrival that completes
+// the root, with the combination of everyone's values in *value, 0 to
+// everyone else, and -1 if this cpu has no members
+static int
+thread_group_tree_arrive (group_tree_t *tree, int op, sint64_t *value) {
+  int n = tree->leaf[my_cpu_id()];
+
+  if (n < 0) {
+    ERROR("No members of the group on cpu %d\n", my_cpu_id());
+    return -1;
+  }
+
+  while (n >= 0) {
+    group_tree_node_t *node = &tree->nodes[n];
+
+    if (op == GROUP_OP_NONE) {
+      if (atomic_dec_val(node->count)) {
+        return 0;
+      }
+    } else {
+      bspin_lock(&node->lock);
+      if (node->count == node->fanin) {
+        node->value = *value;
+      } else {
+        node->value = thread_group_combine(op, node->value, *value);
+      }
+      if (--node->count) {
+        bspin_unlock(&node->lock);
+        return 0;
+      }
+      *value = node->value;
+      bspin_unlock(&node->lock);
+    }
+
+    // everyone has arrived here, so nobody else touches the node
+    // until the next episode, which can't start before we release
+    node->count = node->fanin;
+    n = node->parent;
+  }
+
+  return NK_BARRIER_LAST;
 }
 
 static void
-thread_group_barrier_join (nk_barrier_t *barrier) {
-  bspin_lock(&barrier->lock);
-  DEBUG_BARRIER("Thread (%p) joining barrier \n", (void*)get_cur_thread());
-  atomic_inc(barrier->init_count);
-  atomic_inc(barrier->remaining);
-  bspin_unlock(&barrier->lock);
+thread_group_account_wait (nk_thread_group_t *group, uint64_t wait) {
+  group_wait_stats_t *s = &group->wait_stats[my_cpu_id()];
+  uint64_t max;
+
+  atomic_inc(s->waits);
+  atomic_add(s->wait_sum, wait);
+  while ((max = s->wait_max) < wait && atomic_cmpswap(s->wait_max, max, wait) != max) {
+  }
 }
 
+// one episode of the group's collectives.  The root's *message (if
+// any) is handed to everyone else, and *value is combined with op and
+// the result handed to everyone (unless op is GROUP_OP_NONE).  An
+// abortable episode gives up with -1 once the broadcasts are
+// terminated.  Returns NK_BARRIER_LAST to exactly one member
 static int
-thread_group_barrier_leave (nk_barrier_t *barrier) {
-  int res = 0;
+thread_group_collective (nk_thread_group_t *group, int op, sint64_t *value,
+                         void **message, int root, int abortable) {
+  group_tree_t *tree = group->tree;
+  uint64_t epoch = group->epoch;
+  int slot = epoch & 1;
+  uint64_t start = nk_sched_get_realtime();
+  int res;
+
+  if (!tree) {
+    ERROR("Collective on empty group %s\n", group->group_name);
+    return -1;
+  }
+
+  DEBUG_BARRIER("Thread (%p) entering episode %lu of group %s\n",
+                (void*)get_cur_thread(), epoch, group->group_name);
 
-  DEBUG_BARRIER("Thread (%p) leaving barrier (%p)\n", (void*)get_cur_thread(), (void*)barrier);
+  if (message && root) {
+    group->message[slot] = *message;
+  }
 
-  bspin_lock(&barrier->lock);
+  res = thread_group_tree_arrive(tree, op, value);
 
-  atomic_dec(barrier->init_count);
+  if (res < 0) {
+    return -1;
+  }
 
-  if (--barrier->remaining == 0) {
-    res = NK_BARRIER_LAST;
-    atomic_cmpswap(barrier->notify, 0, 1); // if I'm the last one, I should set notify
-    DEBUG_BARRIER("Thread (%p): notify\n", (void*)get_cur_thread());
+  if (res == NK_BARRIER_LAST) {
+    if (op != GROUP_OP_NONE) {
+      group->result[slot] = *value;
+    }
+    // release everyone
+    group->epoch = epoch + 1;
+  } else {
+    PAUSE_WHILE(group->epoch == epoch && !(abortable && group->terminate_bcast));
+    if (group->epoch == epoch) {
+      return -1;
+    }
   }
 
-  bspin_unlock(&barrier->lock);
+  if (op != GROUP_OP_NONE) {
+    *value = group->result[slot];
+  }
+
+  if (message && !root) {
+    *message = group->message[slot];
+  }
+
+  thread_group_account_wait(group, nk_sched_get_realtime() - start);
+
+  DEBUG_BARRIER("Thread (%p) exiting episode %lu of group %s\n",
+                (void*)get_cur_thread(), epoch, group->group_name);
 
   return res;
 }
@@ -325,8 +578,6 @@ nk_thread_group_create(char *name) {
     return NULL;
   }
 
-  thread_group_barrier_init(&new_group->group_barrier);
-
   return new_group;
 }
 
@@ -389,15 +640,26 @@ nk_thread_group_join(nk_thread_group_t *group) {
     return -1;
   }
 
-  thread_group_barrier_join(&group->group_barrier);
-
-  atomic_inc(group->group_size);
-  int id = atomic_inc(group->next_id);
-
   spin_lock(&group->group_lock);
+
   list_add(&group_member->group_member_node, &group->group_member_array[my_cpu_id()]);
+  group->cpu_members[my_cpu_id()]++;
+
+  if (thread_group_tree_rebuild(group)) {
+    group->cpu_members[my_cpu_id()]--;
+    thread_group_member_destroy(group_member);
+    spin_unlock(&group->group_lock);
+    ERROR("Fail to add member to group tree!\n");
+    return -1;
+  }
+
   spin_unlock(&group->group_lock);
 
+  int id = atomic_inc(group->next_id);
+
+  // last, so that anyone waiting for the group to fill up sees the tree
+  atomic_inc(group->group_size);
+
   return id;
 }
 
@@ -421,25 +683,27 @@ nk_thread_group_leave(nk_thread_group_t *group) {
   if (!leaving_member) {
       ERROR("Unable to find self within thread group\n");
       spin_unlock(&group->group_lock);
-      thread_group_barrier_leave(&group->group_barrier);
       return -1;
   }
 
   if (cur == &group->group_member_array[my_cpu_id()]) {
     ERROR("Fail to find leaving member in group_member_array!\n");
     spin_unlock(&group->group_lock);
-    thread_group_barrier_leave(&group->group_barrier);
     return -1;
   }
 
   list_del(&leaving_member->group_member_node);
+  group->cpu_members[my_cpu_id()]--;
+
+  if (thread_group_tree_rebuild(group)) {
+    // the old tree still counts us, so the others' collectives would hang
+    panic("Fail to remove member from group tree!\n");
+  }
 
   spin_unlock(&group->group_lock);
 
   FREE(leaving_member);
 
-  thread_group_barrier_leave(&group->group_barrier);
-
   atomic_dec(group->group_size);
 
   return 0;
@@ -456,6 +720,7 @@ nk_thread_group_delete(nk_thread_group_t *group) {
   list_del(&group->thread_group_node);
 
   //All group members should have been freed.
+  thread_group_tree_destroy(group->tree);
   FREE(group);
 
   return 0;
@@ -464,7 +729,7 @@ nk_thread_group_delete(nk_thread_group_t *group) {
 // all threads in the group call to synchronize
 int
 nk_thread_group_barrier(nk_thread_group_t *group) {
-  return thread_group_barrier_wait(&group->group_barrier);
+  return thread_group_collective(group, GROUP_OP_NONE, NULL, NULL, 0, 0);
 }
 
 // all threads in the group call to select one thread as leader
@@ -472,6 +737,11 @@ int
 nk_thread_group_election(nk_thread_group_t *group) {
   nk_thread_t *c = get_cur_thread();
 
+  // once there is a leader, don't fight over its cache line
+  if (group->group_leader != -1) {
+    return 0;
+  }
+
   int leader = atomic_cmpswap(group->group_leader, -1, c->tid);
   if (leader == -1){
     return 1;
@@ -500,51 +770,50 @@ nk_thread_group_check_leader(nk_thread_group_t *group) {
   return 0;
 }
 
-// broadcast a message to all members of the thread group be waiting here
-// if some threads don't get this message, they just enter the next round
-// need to be further flushed out
+// broadcast a message from one member (the root) to all members of the group
+// every member must call this; the root passes the message in *message and
+// everyone else gets it back there.  Returns -1 if the bcast was terminated
 int
-nk_thread_group_broadcast(nk_thread_group_t *group, void *message, uint64_t tid, uint64_t src) {
-  if (tid != src) {
-    // receiver
-    int ret = atomic_inc_val(group->msg_count);
-    DEBUG("msg_count = %d\n", group->msg_count);
-
-    while (group->msg_flag == 0) {
-      DEBUG("t%d is waiting\n", tid);
-      if (group->terminate_bcast) {
-        return 0;
-      }
-    }
+nk_thread_group_broadcast(nk_thread_group_t *group, void **message, int root) {
+  int res = thread_group_collective(group, GROUP_OP_NONE, NULL, message, root, 1);
 
-    message = group->message;
-    DEBUG("Recv: %s", (char *)message);
+  if (res < 0) {
+    return -1;
+  }
 
-    if (atomic_dec_val(group->msg_count) == 0) {
-      group->message = NULL;
-      group->msg_flag = 0;
-      DEBUG("Reset msg\n");
-    }
+  DEBUG("%s: %p\n", root ? "Send" : "Recv", *message);
 
-    DEBUG("msg_count = %d\n", group->msg_count);
-  } else {
-    // sender
-    while (group->msg_flag == 1) {
-      DEBUG("t%d is sending\n", tid);
-      if (group->terminate_bcast) {
-        return 0;
-      }
-    }
+  return 0;
+}
+
+// combine a value from every member of the group with op, the root gets the result
+int
+nk_thread_group_reduce(nk_thread_group_t *group, nk_thread_group_op_t op,
+                       sint64_t value, sint64_t *result, int root) {
+  if (thread_group_collective(group, op, &value, NULL, 0, 0) < 0) {
+    return -1;
+  }
 
-    group->message = message;
-    group->msg_flag = 1;
-    DEBUG("Msg sent\n");
-    DEBUG("Send: %s", (char *)message);
+  if (root) {
+    *result = value;
   }
 
   return 0;
 }
 
+// combine a value from every member of the group with op, everyone gets the result
+int
+nk_thread_group_allreduce(nk_thread_group_t *group, nk_thread_group_op_t op,
+                          sint64_t value, sint64_t *result) {
+  if (thread_group_collective(group, op, &value, NULL, 0, 0) < 0) {
+    return -1;
+  }
+
+  *result = value;
+
+  return 0;
+}
+
 // terminate the bcast, then nobody will be waiting for sending or recieving
 int
 nk_thread_group_broadcast_terminate(nk_thread_group_t *group) {
@@ -558,3 +827,21 @@ uint64_t
 nk_thread_group_get_size(nk_thread_group_t *group) {
   return group->group_size;
 }
+
+// sum up the time members have spent waiting in collectives
+int
+nk_thread_group_get_stats(nk_thread_group_t *group, nk_thread_group_stats_t *stats) {
+  int i;
+
+  memset(stats, 0, sizeof(*stats));
+
+  for (i = 0; i < MAX_CPU_NUM; i++) {
+    stats->waits += group->wait_stats[i].waits;
+    stats->wait_sum += group->wait_stats[i].wait_sum;
+    if (group->wait_stats[i].wait_max > stats->wait_max) {
+      stats->wait_max = group->wait_stats[i].wait_max;
+    }
+  }
+
+  return 0;
+}
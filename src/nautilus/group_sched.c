@@ -41,16 +41,6 @@
 #define ERROR(fmt, args...) ERROR_PRINT("group_sched: " fmt, ##args)
 #define INFO(fmt, args...) INFO_PRINT("group_sched: " fmt, ##args)
 
-typedef struct group_state {
-  struct nk_sched_constraints group_constraints;
-  int changing_fail;
-  int roll_back_to_old_fail;
-  int roll_back_to_default_fail;
-  uint64_t changing_count;
-} group_state_t;
-
-static group_state_t group_state;
-static spinlock_t group_change_constraint_lock;
 static struct nk_sched_constraints roll_back_constraints = { .type=APERIODIC,
                                                              .aperiodic.priority=DEFAULT_PRIORITY};
 
@@ -58,44 +48,38 @@ static struct nk_sched_constraints roll_back_constraints = { .type=APERIODIC,
 /***************Below are Internal APIs***************/
 /*****************************************************/
 
-// set the global group state with given constraints and group
+// roll back ro default constraints, must succeed
 static int
-group_sched_set_state(nk_thread_group_t *group, struct nk_sched_constraints *constraints) {
-  group_state.group_constraints = *constraints;
-  group_state.changing_fail = 0;
-  group_state.roll_back_to_old_fail = 0;
-  group_state.roll_back_to_default_fail = 0;
-  group_state.changing_count = nk_thread_group_get_size(group);
+group_sched_roll_back_constraint() {
+  if (nk_sched_thread_change_constraints(&roll_back_constraints) != 0) {
+    return -1;
+  }
 
   return 0;
 }
 
-// reset the global group state
-static int
-group_sched_reset_state(void) {
-  int res = 0;
-
-  if (memset(&group_state.group_constraints, 0, sizeof(struct nk_sched_constraints)) == NULL) {
-    ERROR("Fail to clear memory for group constraints!\n");
-    res = 1;
+// after a failed change, everyone goes back to their old constraints,
+// or to the default ones if anyone can't
+static void
+group_sched_roll_back(nk_thread_group_t *group, struct nk_sched_constraints *old) {
+  sint64_t fail;
+
+  //try to roll back to old constraints first
+  DEBUG("Change constraints failed, roll back to old constraints!\n");
+  fail = nk_sched_thread_change_constraints(old) != 0;
+  if (fail) {
+    ERROR("Unable to roll back to old constraints!\n");
   }
 
-  group_state.changing_fail = 0;
-  group_state.roll_back_to_old_fail = 0;
-  group_state.roll_back_to_default_fail = 0;
-  group_state.changing_count = 0;
+  nk_thread_group_allreduce(group, NK_THREAD_GROUP_OR, fail, &fail);
 
-  return res;
-}
-
-// roll back ro default constraints, must succeed
-static int
-group_sched_roll_back_constraint() {
-  if (nk_sched_thread_change_constraints(&roll_back_constraints) != 0) {
-    return -1;
+  //if there is any failure, roll back to default constraints
+  if (fail) {
+    DEBUG("Fail to roll back to old constraints, roll back to default constraints!\n");
+    if(group_sched_roll_back_constraint() != 0) {
+      panic("Roll back to default constraints should not fail!\n");
+    }
   }
-
-  return 0;
 }
 
 /*****************************************************/
@@ -105,13 +89,6 @@ group_sched_roll_back_constraint() {
 // init module, called in init.c
 int
 nk_group_sched_init(void) {
-  if (memset(&group_state, 0, sizeof(group_state)) == NULL) {
-    ERROR("Fail to clear memory for group_state!\n");
-    return -1;
-  }
-
-  spinlock_init(&group_change_constraint_lock);
-
   INFO("Inited\n");
 
   return 0;
@@ -120,77 +97,115 @@ nk_group_sched_init(void) {
 // deinit module, haven't beed used yet
 int
 nk_group_sched_deinit(void) {
-  if (memset(&group_state, 0, sizeof(group_state)) == NULL) {
-    ERROR("Fail to clear memory for group_state!\n");
-    return -1;
-  }
-
-  spinlock_deinit(&group_change_constraint_lock);
-
   INFO("Deinited\n");
 
   return 0;
 }
 
 // cooperatively change the constraints in a group
+//
+// All of the state of a change lives in the group's own collectives:
+// the leader's constraints go out in a broadcast, and whether anyone
+// failed comes back in an allreduce, so changes in different groups
+// don't serialize, and the common case costs two episodes of the group
 int
 nk_group_sched_change_constraints(nk_thread_group_t *group, struct nk_sched_constraints *constraints)
 {
   struct nk_thread *t = get_cur_thread();
   struct nk_sched_constraints old;
-  
+  void *group_constraints = constraints;
+  sint64_t fail;
+
   //get old constraints in case we need to roll back to them
   nk_sched_thread_get_constraints(t, &old);
 
   nk_thread_group_election(group);
-  
-  if (nk_thread_group_check_leader(group) == 1) {
-    spin_lock(&group_change_constraint_lock);
-    group_sched_set_state(group, constraints);
-    nk_thread_group_attach_state(group, &group_state);
+
+  // everyone takes the leader's constraints
+  if (nk_thread_group_broadcast(group, &group_constraints,
+                                nk_thread_group_check_leader(group) == 1)) {
+    ERROR("Unable to get group constraints!\n");
+    return -1;
   }
 
-  nk_thread_group_barrier(group);
+  fail = nk_sched_thread_change_constraints((struct nk_sched_constraints *)group_constraints) != 0;
 
-  if (group_state.changing_fail == 0) {
-    if (nk_sched_thread_change_constraints(&group_state.group_constraints) != 0) {
-      //if fail, set the failure flag
-      atomic_cmpswap(group_state.changing_fail, 0, 1);
-    }
+  nk_thread_group_allreduce(group, NK_THREAD_GROUP_OR, fail, &fail);
+
+  if (!fail) {
+    return 0;
   }
 
-  nk_thread_group_barrier(group);
+  group_sched_roll_back(group, &old);
 
-  int res = 0;
-  //check if there is failure, of so, start roll back
-  if (group_state.changing_fail) {
-    //try to roll back to old constraints first
-    DEBUG("Change constraints failed, roll back to old constraints!\n");
-    if (nk_sched_thread_change_constraints(&old) != 0) {
-      atomic_cmpswap(group_state.roll_back_to_old_fail, 0, 1);
-      ERROR("Unable to roll back to old constraints!\n");
-    }
+  return -1;
+}
 
-    nk_thread_group_barrier(group);
+// cooperatively change the constraints in a group to a gang, which the
+// scheduler releases and preempts on all the members' cpus together
+//
+// The leader makes the gang and broadcasts it.  The members then agree
+// on a window that is free on all of their cpus (an AND of each cpu's
+// free windows) and on when to start (the latest of their clocks), and
+// all join.  A group with two members on one cpu can't be a gang, as
+// they can't both run in the same window
+int
+nk_group_sched_change_constraints_gang(nk_thread_group_t *group, struct nk_sched_constraints *constraints)
+{
+  struct nk_thread *t = get_cur_thread();
+  struct nk_sched_constraints old;
+  struct nk_sched_gang *gang = NULL;
+  void *group_gang;
+  int leader;
+  sint64_t slots, after, fail;
 
-    //if there is any failure, roll back to default constraints
-    if (group_state.roll_back_to_old_fail) {
-      DEBUG("Fail to roll back to old constraints, roll back to default constraints!\n");
-      if(group_sched_roll_back_constraint() != 0) {
-        panic("Roll back to default constraints should not fail!\n");
-        return -1;
-      }
-    }
+  nk_sched_thread_get_constraints(t, &old);
 
-    res = -1;
+  nk_thread_group_election(group);
+  leader = nk_thread_group_check_leader(group) == 1;
+
+  if (leader) {
+    gang = nk_sched_gang_create(constraints);
+  }
+
+  group_gang = gang;
+  if (nk_thread_group_broadcast(group, &group_gang, leader)) {
+    ERROR("Unable to get group gang!\n");
+    nk_sched_gang_put(gang);
+    return -1;
+  }
+
+  if (!group_gang) {
+    ERROR("Leader failed to create gang!\n");
+    return -1;
+  }
+  gang = (struct nk_sched_gang *)group_gang;
+
+  nk_thread_group_allreduce(group, NK_THREAD_GROUP_AND,
+                            (sint64_t)nk_sched_gang_free_slots(gang), &slots);
+  nk_thread_group_allreduce(group, NK_THREAD_GROUP_MAX,
+                            (sint64_t)nk_sched_get_realtime(), &after);
+
+  if (!slots) {
+    DEBUG("No window is free on every member's cpu\n");
+    fail = 1;
+  } else {
+    fail = nk_sched_thread_join_gang(gang, __builtin_ctzll((uint64_t)slots), (uint64_t)after) != 0;
+  }
+
+  nk_thread_group_allreduce(group, NK_THREAD_GROUP_OR, fail, &fail);
+
+  // everyone is done with the leader's reference, and members
+  // hold their own
+  if (leader) {
+    nk_sched_gang_put(gang);
   }
 
-  //finally leave this stage and dec counter, if I'm the last one, unlock the group and reset state
-  if(atomic_dec_val(group_state.changing_count) == 0) {
-    nk_thread_group_detach_state(group);
-    group_sched_reset_state();
-    spin_unlock(&group_change_constraint_lock);
+  if (!fail) {
+    return 0;
   }
 
-  return res;
+  group_sched_roll_back(group, &old);
+
+  return -1;
 }
@@ -30,6 +30,7 @@
 #include <nautilus/libccompat.h>
 #include <nautilus/shell.h>
 #include <nautilus/irq.h>
+#include <nautilus/linker.h>
 
 #include <nautilus/instrument.h>
 
@@ -43,494 +44,559 @@
 #define DEBUG(fmt, args...) 
 #endif
 
+// Everything on the entry/exit path must stay out of reach of
+// -finstrument-functions, including helpers we would otherwise
+// pull in from headers (e.g., rdtsc() in cpu.h), or the hooks
+// would recurse
+#define NO_INSTR __attribute__((no_instrument_function))
+
+#define instr_rdtsc()                                        \
+    ({                                                       \
+        uint32_t __lo, __hi;                                 \
+        asm volatile ("rdtsc" : "=a" (__lo), "=d" (__hi));   \
+        ((uint64_t)__hi << 32) | __lo;                       \
+    })
+
+// give up on an insertion after this many probes
+#define PROF_MAX_PROBES 32
 
 static uint8_t instr_active = 0;
 static uint64_t instr_start_count = 0;
 static uint64_t instr_end_count = 0;
-
-struct func_data {
-    uint64_t call_count;
-    uint64_t avg_nsec;
-    uint64_t max_nsec;
-    uint64_t min_nsec;
-    uint64_t start_count;
-    uint64_t total_count;
-};
-
-
-static unsigned 
-instr_hash_fn(addr_t key) {
-    char * name = (char *)key;
-    return nk_hash_buffer((uint8_t *)name, strlen(name));
-}
+static uint64_t instr_overhead = 0;
 
 
-static int 
-instr_eq_fn (addr_t key1, addr_t key2) {
-    char * name1 = (char *)key1;
-    char * name2 = (char *)key2;
-
-    return (strcmp(name1, name2) == 0);
+static inline NO_INSTR unsigned long
+prof_hash (addr_t key)
+{
+    return (key * 0x9e3779b97f4a7c15ULL) >> (64 - NAUT_CONFIG_PROFILE_TABLE_ORDER);
 }
 
 
-static void 
-instr_calibrate (void)
+static inline NO_INSTR struct nk_prof_func *
+prof_lookup (struct nk_prof_table * t, addr_t key, const char * name)
 {
-    NK_PROFILE_ENTRY();
+    unsigned long h = prof_hash(key);
+    int i;
 
-    NK_PROFILE_EXIT();
+    for (i = 0; i < PROF_MAX_PROBES; i++, h = (h + 1) & NK_PROF_TABLE_MASK) {
+        struct nk_prof_func * f = &t->funcs[h];
+        if (f->key == key) {
+            return f;
+        }
+        if (!f->key) {
+            f->name = name;
+            f->min_incl = ULONG_MAX;
+            f->key = key;
+            return f;
+        }
+    }
+
+    return NULL;
 }
 
 
-void 
-nk_profile_func_enter (const char  *func)
+static inline NO_INSTR void
+prof_enter (addr_t key, const char * name)
 {
-    struct func_data * new = NULL;
-    struct timespec ts;
+    struct nk_instr_data * d;
+    struct nk_prof_table * t;
+    uint32_t i;
 
     if (!instr_active) {
         return;
     }
 
-    if (!(per_cpu_get(instr_data)->func_htable)) {
+    d = per_cpu_get(instr_data);
+
+    if (!d || !(t = d->func_table)) {
         return;
     }
 
-    new = (struct func_data*)nk_htable_search(per_cpu_get(instr_data)->func_htable, (addr_t)(func));
-
-    if (!new) {
-
-        new = malloc(sizeof(struct func_data));
-        memset(new, 0, sizeof(struct func_data));
+    // An interrupt arriving in the middle of this leaves the stack
+    // as it found it, so there is no need to disable interrupts
+    i = t->depth++;
 
-        new->call_count  = 1;
-        new->min_nsec = ULONG_MAX;
-
-        nk_htable_insert(per_cpu_get(instr_data)->func_htable, (addr_t)func, (addr_t)new);
+    if (i < NK_PROF_STACK_DEPTH) {
+        struct nk_prof_frame * f = &t->stack[i];
+        f->key   = key;
+        f->name  = name;
+        f->child = 0;
+        f->start = instr_rdtsc();
     } else {
-        new->call_count++;
+        t->overflows++;
     }
-
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    new->start_count = ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 
-void 
-nk_profile_func_exit (const char *func)
+static inline NO_INSTR void
+prof_exit (addr_t key)
 {
-    struct timespec te;
-    struct func_data * data = NULL;
-    uint64_t end;
-    uint64_t time;
+    uint64_t now = instr_rdtsc();
+    struct nk_instr_data * d;
+    struct nk_prof_table * t;
+    struct nk_prof_frame * fr;
+    struct nk_prof_func * fn;
+    uint64_t incl, excl;
+    uint32_t depth, i;
 
     if (!instr_active) {
         return;
     }
 
-    if (!(per_cpu_get(instr_data)->func_htable)) {
+    d = per_cpu_get(instr_data);
+
+    if (!d || !(t = d->func_table)) {
         return;
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &te);
+    depth = t->depth;
 
-    data = (struct func_data*)nk_htable_search(per_cpu_get(instr_data)->func_htable, (addr_t)func);
+    if (!depth) {
+        t->unmatched++;
+        return;
+    }
 
-    if (!data) {
+    i = depth - 1;
+
+    if (i >= NK_PROF_STACK_DEPTH) {
+        // this call was never pushed
+        t->depth = i;
         return;
-    } else {
-        end = 1000000000 * te.tv_sec + te.tv_nsec;
-        if (end < data->start_count) {
+    }
+
+    // Normally the matching frame is on top.  It is not if a thread
+    // switch interleaved another thread's calls with ours on this
+    // CPU, or if we started profiling in the middle of a call.
+    while (t->stack[i].key != key) {
+        if (!i) {
+            t->unmatched++;
             return;
         }
-        time = end - data->start_count;
-        data->total_count += time;
-        if (time < data->min_nsec) {
-            data->min_nsec = time;
-        }
-        if (time > data->max_nsec) {
-            data->max_nsec = time;
-        }
-        data->avg_nsec = (((data->avg_nsec * (data->call_count - 1)) + time )/ data->call_count);
+        i--;
+    }
+
+    t->orphaned += depth - 1 - i;
+    t->depth = i;
+
+    fr = &t->stack[i];
+
+    incl = now - fr->start;
+    excl = incl > fr->child ? incl - fr->child : 0;
+
+    if (i) {
+        t->stack[i-1].child += incl;
     }
+
+    fn = prof_lookup(t, fr->key, fr->name);
+
+    if (!fn) {
+        t->full++;
+        return;
+    }
+
+    fn->calls++;
+    fn->incl += incl;
+    fn->excl += excl;
+    if (incl > fn->max_incl) {
+        fn->max_incl = incl;
+    }
+    if (incl < fn->min_incl) {
+        fn->min_incl = incl;
+    }
+}
+
+
+static void 
+instr_calibrate (void)
+{
+    NK_PROFILE_ENTRY();
+
+    NK_PROFILE_EXIT();
+}
+
+
+NO_INSTR void 
+nk_profile_func_enter (const char  *func)
+{
+    prof_enter((addr_t)func, func);
+}
+
+
+NO_INSTR void 
+nk_profile_func_exit (const char *func)
+{
+    prof_exit((addr_t)func);
 }
 
 
+// Hooks for -finstrument-functions (NAUT_CONFIG_PROFILE_INSTRUMENT_FUNCTIONS)
+NO_INSTR void
+__cyg_profile_func_enter (void * fn, void * site)
+{
+    prof_enter((addr_t)fn, NULL);
+}
+
+
+NO_INSTR void
+__cyg_profile_func_exit (void * fn, void * site)
+{
+    prof_exit((addr_t)fn);
+}
+
+
+#define RESET_LAT(s)                                         \
+    memset(&(s), 0, sizeof(s));                              \
+    (s).min_latency = ULONG_MAX;
+
 void 
 nk_instrument_clear (void) 
 {
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    uint64_t table_size = sizeof(struct nk_prof_table) + NK_PROF_TABLE_SIZE * sizeof(struct nk_prof_func);
     int i;
 
     DEBUG("Clearing Instrumentation\n");
 
-    uint8_t flags = irq_disable_save();
-    
-    for (i = 0; i < nk_get_nautilus_info()->sys.num_cpus; i++) {
-        struct cpu * this_cpu = nk_get_nautilus_info()->sys.cpus[i];
-        int flags2 = spin_lock_irq_save(&this_cpu->lock);
+    for (i = 0; i < sys->num_cpus; i++) {
+        struct cpu * this_cpu = sys->cpus[i];
+        struct nk_instr_data * d;
+
         if (!this_cpu) {
             ERROR("Could not get CPU\n");
-            spin_unlock_irq_restore(&this_cpu->lock, flags2);
             return;
         }
 
-	if (!this_cpu->instr_data) { 
-	    // first time
-
-	    this_cpu->instr_data = malloc(sizeof(struct nk_instr_data));
-	    memset(this_cpu->instr_data, 0, sizeof(struct nk_instr_data));
-	    this_cpu->instr_data->mallocstat.min_latency = ULONG_MAX;
-	    this_cpu->instr_data->freestat.min_latency = ULONG_MAX;
-	    this_cpu->instr_data->irqstat.min_latency    = ULONG_MAX;
-	    this_cpu->instr_data->thr_switch.min_latency = ULONG_MAX;
-
-	    this_cpu->instr_data->func_htable = nk_create_htable(0, instr_hash_fn, instr_eq_fn);
-	    if (!this_cpu->instr_data->func_htable) {
-		ERROR("Could not create instrumentation hash table for core %u\n",
-		      i);
-		spin_unlock_irq_restore(&this_cpu->lock, flags2);
-		return;
-	    }
-	    
-	} else {
-	    // reinit
-	    memset(&this_cpu->instr_data->mallocstat, 0, sizeof(struct malloc_data));
-	    memset(&this_cpu->instr_data->freestat, 0, sizeof(struct free_data));
-	    memset(&this_cpu->instr_data->irqstat,0,sizeof(struct irq_data));
-	    memset(&this_cpu->instr_data->thr_switch,0,sizeof(struct thread_switch_data));
-	    this_cpu->instr_data->mallocstat.min_latency = ULONG_MAX;
-	    this_cpu->instr_data->freestat.min_latency = ULONG_MAX;
-	    this_cpu->instr_data->irqstat.min_latency    = ULONG_MAX;
-	    this_cpu->instr_data->thr_switch.min_latency = ULONG_MAX;
-	    
-	    // blow away htable and delete values (keys are just func addresses, so not freed)
-	    nk_free_htable(this_cpu->instr_data->func_htable, 1, 0);
-
-	    this_cpu->instr_data->func_htable = nk_create_htable(0, instr_hash_fn, instr_eq_fn);
-
-	    if (!this_cpu->instr_data->func_htable) {
-		ERROR("Could not create instrumentation hash table for core %u\n",
-		      i);
-		spin_unlock_irq_restore(&this_cpu->lock, flags2);
-		return;
-	    }
-	}
-	spin_unlock_irq_restore(&this_cpu->lock, flags2);
-    }
+        d = this_cpu->instr_data;
 
-    irq_enable_restore(flags);
+        if (!d) {
+            // first time
+            d = malloc_specific(sizeof(struct nk_instr_data), i);
+            if (!d) {
+                ERROR("Could not allocate instrumentation data for core %u\n", i);
+                return;
+            }
+            memset(d, 0, sizeof(struct nk_instr_data));
+
+            d->func_table = malloc_specific(table_size, i);
+            if (!d->func_table) {
+                ERROR("Could not allocate function table for core %u\n", i);
+                free(d);
+                return;
+            }
+        }
+
+        // The owning CPU may be updating these concurrently if we are
+        // active, which will at worst leave a little garbage behind
+        memset(d->func_table, 0, table_size);
+
+        RESET_LAT(d->mallocstat);
+        RESET_LAT(d->freestat);
+        RESET_LAT(d->irqstat);
+        RESET_LAT(d->thr_switch);
+
+        this_cpu->instr_data = d;
+    }
 }
 
-/* TODO: calibrate and subtract the overhead of instrumentation */
 void 
 nk_instrument_init (void) 
 {
     nk_instrument_clear();
-    INFO("inited\n");
+    INFO("inited (%lu functions per cpu, shadow stack depth %d)\n",
+         NK_PROF_TABLE_SIZE, NK_PROF_STACK_DEPTH);
 }
 
 void
 nk_instrument_start (void)
 {
-    struct timespec ts;
     DEBUG("Beginning Instrumentation\n");
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    instr_start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    instr_start_count = instr_rdtsc();
     atomic_cmpswap(instr_active, 0, 1);
 }
 
 void 
 nk_instrument_end (void) 
 {
-    struct timespec te;
-    clock_gettime(CLOCK_MONOTONIC, &te);
-    instr_end_count = 1000000000 * te.tv_sec + te.tv_nsec;
+    instr_end_count = instr_rdtsc();
     DEBUG("Deactivating instrumentation\n");
     atomic_cmpswap(instr_active, 1, 0);
 }
 
-void
-nk_malloc_enter (void)
-{
-    struct malloc_data * md = NULL;
-    struct timespec ts;
 
-    if (!instr_active) {
-        return;
+#define LAT_ENTER(s)                                         \
+    if (!instr_active) {                                     \
+        return;                                              \
+    }                                                        \
+    (s)->count++;                                            \
+    (s)->start_count = instr_rdtsc();
+
+#define LAT_EXIT(s)                                          \
+    uint64_t __time;                                         \
+    if (!instr_active || !(s)->count) {                      \
+        return;                                              \
+    }                                                        \
+    __time = instr_rdtsc() - (s)->start_count;               \
+    (s)->total_latency += __time;                            \
+    if (__time < (s)->min_latency) {                         \
+        (s)->min_latency = __time;                           \
+    }                                                        \
+    if (__time > (s)->max_latency) {                         \
+        (s)->max_latency = __time;                           \
     }
 
-    md = &(per_cpu_get(instr_data)->mallocstat);
-    md->count++;
-
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-
-    md->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+NO_INSTR void
+nk_malloc_enter (void)
+{
+    LAT_ENTER(&(per_cpu_get(instr_data)->mallocstat));
 }
 
-void
+NO_INSTR void
 nk_malloc_exit (void)
 {
-    struct malloc_data * md = NULL;
-    struct timespec te;
-    uint64_t end;
-    uint64_t time;
-
-    if (!instr_active) {
-        return;
-    }
-
-    md = &(per_cpu_get(instr_data)->mallocstat);
-    
-    clock_gettime(CLOCK_MONOTONIC, &te);
-
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
-    if (end < md->start_count) {
-        return;
-    }
-    time = end - md->start_count;
-    if (time < md->min_latency) {
-        md->min_latency = time;
-    }
-    if (time > md->max_latency) {
-        md->max_latency = time;
-    }
-    md->avg_latency = (((md->avg_latency * (md->count - 1)) + time)/ md->count);
+    LAT_EXIT(&(per_cpu_get(instr_data)->mallocstat));
 }
 
-void
+NO_INSTR void
 nk_free_enter (void)
 {
-    struct free_data * md = NULL;
-    struct timespec ts;
-
-    if (!instr_active) {
-        return;
-    }
-
-    md = &(per_cpu_get(instr_data)->freestat);
-    md->count++;
-
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-
-    md->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    LAT_ENTER(&(per_cpu_get(instr_data)->freestat));
 }
 
-void
+NO_INSTR void
 nk_free_exit (void)
 {
-    struct free_data * md = NULL;
-    struct timespec te;
-    uint64_t end;
-    uint64_t time;
-
-    if (!instr_active) {
-        return;
-    }
-
-    md = &(per_cpu_get(instr_data)->freestat);
-    
-    clock_gettime(CLOCK_MONOTONIC, &te);
-
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
-    if (end < md->start_count) {
-        return;
-    }
-    time = end - md->start_count;
-    if (time < md->min_latency) {
-        md->min_latency = time;
-    }
-    if (time > md->max_latency) {
-        md->max_latency = time;
-    }
-    md->avg_latency = (((md->avg_latency * (md->count - 1)) + time)/ md->count);
+    LAT_EXIT(&(per_cpu_get(instr_data)->freestat));
 }
 
 
-void
+NO_INSTR void
 nk_irq_prof_enter (void)
 {
-    struct irq_data * irq = NULL;
-    struct timespec ts;
-
-    if (!instr_active) {
-        return;
-    }
-
-    irq = &(per_cpu_get(instr_data)->irqstat);
-    irq->count++;
-
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-
-    irq->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    LAT_ENTER(&(per_cpu_get(instr_data)->irqstat));
 }
 
 
-void
+NO_INSTR void
 nk_irq_prof_exit (void)
 {
-    struct irq_data * irq = NULL;
-    struct timespec te;
-    uint64_t end;
-    uint64_t time;
-
-    if (!instr_active) {
-        return;
-    }
-
-    irq = &(per_cpu_get(instr_data)->irqstat);
-    
-    clock_gettime(CLOCK_MONOTONIC, &te);
-
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
-    if (end < irq->start_count) {
-        return;
-    }
-    time = end - irq->start_count;
-    if (time < irq->min_latency) {
-        irq->min_latency = time;
-    }
-    if (time > irq->max_latency) {
-        irq->max_latency = time;
-    }
-    irq->avg_latency = (((irq->avg_latency * (irq->count - 1)) + time)/ irq->count);
+    LAT_EXIT(&(per_cpu_get(instr_data)->irqstat));
 }
 
 
-void
+NO_INSTR void
 nk_thr_switch_prof_enter (void)
 {
-    struct thread_switch_data * thr = NULL;
-    struct timespec ts;
-
-    if (!instr_active) {
-        return;
-    }
-
-    thr = &(per_cpu_get(instr_data)->thr_switch);
-    thr->count++;
+    LAT_ENTER(&(per_cpu_get(instr_data)->thr_switch));
+}
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    thr->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+NO_INSTR void
+nk_thr_switch_prof_exit (void)
+{
+    LAT_EXIT(&(per_cpu_get(instr_data)->thr_switch));
 }
 
 
-void
-nk_thr_switch_prof_exit (void)
+// Functions named by NK_PROFILE_ENTRY() in static inlines get a
+// __func__ string, and so a key, per translation unit.  When
+// merging the CPUs' tables we fold these together by name.
+static unsigned long
+merge_hash (struct nk_prof_func * f)
 {
-    struct thread_switch_data * thr = NULL;
-    struct timespec te;
-    uint64_t end;
-    uint64_t time;
+    if (f->name) {
+        return nk_hash_buffer((uchar_t *)f->name, strlen(f->name)) & NK_PROF_TABLE_MASK;
+    } else {
+        return prof_hash(f->key);
+    }
+}
 
-    if (!instr_active) {
-        return;
+static int
+merge_eq (struct nk_prof_func * a, struct nk_prof_func * b)
+{
+    if (a->name && b->name) {
+        return !strcmp(a->name, b->name);
+    } else {
+        return !a->name && !b->name && a->key == b->key;
     }
+}
 
-    thr = &(per_cpu_get(instr_data)->thr_switch);
+static int
+merge_func (struct nk_prof_func * m, struct nk_prof_func * f)
+{
+    unsigned long h = merge_hash(f);
+    uint64_t n;
 
-    if (thr->count == 0) {
-        return;
+    for (n = 0; n < NK_PROF_TABLE_SIZE; n++, h = (h + 1) & NK_PROF_TABLE_MASK) {
+        if (!m[h].key) {
+            m[h] = *f;
+            return 0;
+        }
+        if (merge_eq(&m[h], f)) {
+            m[h].calls += f->calls;
+            m[h].incl  += f->incl;
+            m[h].excl  += f->excl;
+            if (f->max_incl > m[h].max_incl) {
+                m[h].max_incl = f->max_incl;
+            }
+            if (f->min_incl < m[h].min_incl) {
+                m[h].min_incl = f->min_incl;
+            }
+            return 0;
+        }
     }
-    
-    clock_gettime(CLOCK_MONOTONIC, &te);
 
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
-    if (end < thr->start_count) {
-        return;
-    }
-    time = end - thr->start_count;
-    if (time < thr->min_latency) {
-        thr->min_latency = time;
-    }
-    if (time > thr->max_latency) {
-        thr->max_latency = time;
-    }
-    thr->avg_latency = (((thr->avg_latency * (thr->count - 1)) + time)/ thr->count);
+    return -1;
 }
 
+static void
+print_lat (char * what, uint64_t count, uint64_t total, uint64_t max, uint64_t min)
+{
+    printk("%-14s Count: %16lu Cycles - Avg: %12lu Max: %12lu Min: %12lu\n",
+           what, count, count ? total / count : 0, max, count ? min : 0);
+}
 
 void 
 nk_instrument_query (void)
 {
-    int i;
+    struct sys_info * sys = &(nk_get_nautilus_info()->sys);
+    struct nk_link_info * linfo = sys->linker_info;
+    struct nk_prof_func * merged;
+    struct nk_prof_func ** sorted;
+    uint64_t overflows = 0, unmatched = 0, orphaned = 0, full = 0, lost = 0;
+    uint64_t window, gap, i, j, n = 0;
+    int c;
+
+    merged = malloc(NK_PROF_TABLE_SIZE * sizeof(struct nk_prof_func));
+    sorted = malloc(NK_PROF_TABLE_SIZE * sizeof(struct nk_prof_func *));
+
+    if (!merged || !sorted) {
+        ERROR("Could not allocate space to merge profiles\n");
+        goto out;
+    }
+
+    memset(merged, 0, NK_PROF_TABLE_SIZE * sizeof(struct nk_prof_func));
 
     printk("Dumping instrumentation data...\n");
-    for (i = 0; i < nk_get_nautilus_info()->sys.num_cpus; i++) {
-        struct cpu * this_cpu = nk_get_nautilus_info()->sys.cpus[i];
 
+    for (c = 0; c < sys->num_cpus; c++) {
+        struct nk_instr_data * d = sys->cpus[c]->instr_data;
 
-        printk("Function Table Stats for Core %u:\n", i);
-        struct nk_hashtable_iter * iter = nk_create_htable_iter(this_cpu->instr_data->func_htable);
-        if (!iter) {
-            ERROR("Could not iterate over function htable on core %u\n", i);
+        if (!d) {
             continue;
         }
 
-        do {
-            char * func = (void*)nk_htable_get_iter_key(iter);
-            struct func_data * data = (struct func_data*)nk_htable_get_iter_value(iter);
-
-            uint64_t total_nsec = (instr_end_count - instr_start_count);
-
-            if (data->call_count > 0) {
-                printk("\t%lu.%lu\% Func: %s\n\tCount: %16u Lat - Avg: %16llunsec Max: %16llunsec Min: %16llunsec\n", 
-                        data->total_count / total_nsec,
-                        data->total_count % total_nsec,
-                        func,
-                        data->call_count,
-                        data->avg_nsec,
-                        data->max_nsec,
-                        data->min_nsec);
+        printk("Core %d:\n", c);
+
+        print_lat("Malloc", d->mallocstat.count, d->mallocstat.total_latency,
+                  d->mallocstat.max_latency, d->mallocstat.min_latency);
+        print_lat("Free", d->freestat.count, d->freestat.total_latency,
+                  d->freestat.max_latency, d->freestat.min_latency);
+        print_lat("IRQ", d->irqstat.count, d->irqstat.total_latency,
+                  d->irqstat.max_latency, d->irqstat.min_latency);
+        print_lat("Thread Switch", d->thr_switch.count, d->thr_switch.total_latency,
+                  d->thr_switch.max_latency, d->thr_switch.min_latency);
+
+        overflows += d->func_table->overflows;
+        unmatched += d->func_table->unmatched;
+        orphaned  += d->func_table->orphaned;
+        full      += d->func_table->full;
+
+        for (i = 0; i < NK_PROF_TABLE_SIZE; i++) {
+            struct nk_prof_func * f = &d->func_table->funcs[i];
+            if (f->key && f->calls && merge_func(merged, f)) {
+                lost++;
             }
+        }
+    }
+
+    for (i = 0; i < NK_PROF_TABLE_SIZE; i++) {
+        if (merged[i].key) {
+            sorted[n++] = &merged[i];
+        }
+    }
+
+    // shell sort by exclusive time, descending
+    for (gap = n / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < n; i++) {
+            struct nk_prof_func * tmp = sorted[i];
+            for (j = i; j >= gap && sorted[j-gap]->excl < tmp->excl; j -= gap) {
+                sorted[j] = sorted[j-gap];
+            }
+            sorted[j] = tmp;
+        }
+    }
+
+    window = (instr_active ? instr_rdtsc() : instr_end_count) - instr_start_count;
+    window *= sys->num_cpus;
+
+    printk("Function profile (all cores, cycles, %% is of %lu cpu cycles profiled):\n", window);
+    printk("%6s %12s %16s %16s %12s %12s %12s  %s\n",
+           "%excl", "calls", "exclusive", "inclusive", "avg incl", "max incl", "min incl", "function");
+
+    for (i = 0; i < n; i++) {
+        struct nk_prof_func * f = sorted[i];
+        const char * name = f->name;
+        char * sym = NULL;
+        uint64_t off = 0;
+        uint64_t pct = window ? (f->excl * 10000) / window : 0;
+
+        if (!name) {
+            if (!nk_linker_addr_to_symbol(linfo, f->key, &sym, &off) && !off) {
+                name = sym;
+            }
+        }
 
+        printk("%3lu.%02lu %12lu %16lu %16lu %12lu %12lu %12lu  ",
+               pct / 100, pct % 100, f->calls, f->excl, f->incl,
+               f->incl / f->calls, f->max_incl, f->min_incl);
 
-        } while (nk_htable_iter_advance(iter) != 0);
-
-        printk("Malloc Stats for Core %u:\n", i);
-
-        /* print malloc data */
-        printk("\tCount: %16u Lat - Avg: %16llunsec, Max: %16llunsec Min: %16llunsec\n", 
-                this_cpu->instr_data->mallocstat.count,
-                this_cpu->instr_data->mallocstat.avg_latency,
-                this_cpu->instr_data->mallocstat.max_latency,
-                this_cpu->instr_data->mallocstat.min_latency);
-
-        printk("Free Stats for Core %u:\n", i);
-
-        /* print free data */
-        printk("\tCount: %16u Lat - Avg: %16llunsec, Max: %16llunsec Min: %16llunsec\n", 
-                this_cpu->instr_data->freestat.count,
-                this_cpu->instr_data->freestat.avg_latency,
-                this_cpu->instr_data->freestat.max_latency,
-                this_cpu->instr_data->freestat.min_latency);
-
-        printk("IRQ Stats for Core %u:\n", i);
-        printk("\tCount: %16u Lat - Avg: %16llunsec Max: %16llunsec Min: %16llunsec\n", 
-                this_cpu->instr_data->irqstat.count,
-                this_cpu->instr_data->irqstat.avg_latency,
-                this_cpu->instr_data->irqstat.max_latency,
-                this_cpu->instr_data->irqstat.min_latency);
-        printk("Thread Switch Stats for Core %u:\n", i);
-        printk("\tCount: %16u Lat - Avg: %16llunsec Max: %16llunsec Min: %16llunsec\n", 
-                
-                this_cpu->instr_data->thr_switch.count,
-                this_cpu->instr_data->thr_switch.avg_latency,
-                this_cpu->instr_data->thr_switch.max_latency,
-                this_cpu->instr_data->thr_switch.min_latency);
+        if (name) {
+            printk("%s\n", name);
+        } else if (sym) {
+            printk("%s+0x%lx\n", sym, off);
+        } else {
+            printk("%p\n", (void *)f->key);
+        }
+    }
+
+    printk("%lu functions, instrumentation overhead ~%lu cycles per call\n", n, instr_overhead);
+
+    if (overflows || unmatched || orphaned || full || lost) {
+        printk("%lu calls too deep, %lu unmatched exits, %lu orphaned frames, "
+               "%lu calls dropped (table full), %lu functions not merged\n",
+               overflows, unmatched, orphaned, full, lost);
+    }
 
+ out:
+    if (merged) {
+        free(merged);
+    }
+    if (sorted) {
+        free(sorted);
     }
 }
 
 
+// Estimate the cost of an instrumented call (entry and exit
+// hooks around an empty function) on the calling CPU
 void
 nk_instrument_calibrate (unsigned loops)
 {
+    uint64_t start, end;
     int i; 
+
+    if (!instr_active || !loops) {
+        return;
+    }
+
+    start = instr_rdtsc();
     for (i = 0; i < loops; i++) {
         instr_calibrate();
     }
+    end = instr_rdtsc();
+
+    instr_overhead = (end - start) / loops;
 }
 
 
@@ -249,7 +249,7 @@ static inline uint64_t _pump_rand(uint64_t xi, uint64_t a, uint64_t c)
 // x_i value (48 bit value)
 static inline uint64_t pump_rand()
 {
-    struct nk_rand_info * rand = per_cpu_get(rand);
+    struct nk_rand_info * rand = this_cpu_ptr(nk_rand_state);
 
     uint64_t xi_new = _pump_rand(rand->xi, 0x5deece66dULL, 0xbULL);
     
@@ -29,6 +29,8 @@
 #include <nautilus/vc.h>
 #include <nautilus/mm.h>
 #include <nautilus/prog.h>
+#include <nautilus/shell.h>
+#include <nautilus/cpu.h>
 
 #define ERROR(fmt, args...) ERROR_PRINT("LINKER: " fmt, ##args)
 #define DEBUG(fmt, args...) DEBUG_PRINT("LINKER: " fmt, ##args)
@@ -43,6 +45,280 @@
 #endif
 
 
+#define SYM_NAME(linfo, i) (&((linfo)->symtab.strtab[(linfo)->symtab.entries[i].offset]))
+
+/* the hash function used by GNU-style .gnu.hash sections */
+static inline uint32_t
+gnu_hash (const char * name)
+{
+    uint32_t h = 5381;
+
+    for (; *name; name++) {
+        h = (h << 5) + h + (uint8_t)*name;
+    }
+
+    return h;
+}
+
+
+static int
+linear_lookup (struct nk_link_info * linfo, const char * name, uint64_t * addr)
+{
+    for (int i = 0; i < linfo->symtab.sym_count; i++) {
+        if (strncmp(name, SYM_NAME(linfo, i), MAX_SYM_LEN) == 0) {
+            *addr = linfo->symtab.entries[i].value;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+
+int
+nk_linker_lookup_symbol (struct nk_link_info * linfo, const char * name, uint64_t * addr)
+{
+    struct symtab_index * idx = &linfo->index;
+    uint32_t h, b, i;
+    uint64_t word;
+
+    if (!linfo->ready) {
+        return -1;
+    }
+
+    if (!idx->buckets) {
+        // index could not be built, so do it the slow way
+        return linear_lookup(linfo, name, addr);
+    }
+
+    linfo->stats.lookups++;
+
+    h    = gnu_hash(name);
+    word = idx->bloom[(h / 64) & (idx->bloom_words - 1)];
+
+    if (!((word >> (h % 64)) & (word >> ((h >> idx->bloom_shift) % 64)) & 1)) {
+        linfo->stats.bloom_rejects++;
+        return -1;
+    }
+
+    b = idx->buckets[h % idx->nbuckets];
+
+    if (b == (uint32_t)-1) {
+        return -1;
+    }
+
+    for (i = b; ; i++) {
+
+        linfo->stats.chain_probes++;
+
+        if ((idx->chain[i] | 1) == (h | 1)) {
+            linfo->stats.strcmps++;
+            if (strncmp(name, SYM_NAME(linfo, idx->order[i]), MAX_SYM_LEN) == 0) {
+                *addr = linfo->symtab.entries[idx->order[i]].value;
+                return 0;
+            }
+        }
+
+        if (idx->chain[i] & 1) {
+            break;
+        }
+    }
+
+    return -1;
+}
+
+
+int
+nk_linker_addr_to_symbol (struct nk_link_info * linfo, uint64_t addr, char ** name, uint64_t * offset)
+{
+    struct symtab_index * idx;
+    uint32_t lo, hi, mid;
+
+    if (!linfo || !linfo->ready || !linfo->index.by_addr || !linfo->symtab.sym_count) {
+        return -1;
+    }
+
+    idx = &linfo->index;
+
+    if (addr < linfo->symtab.entries[idx->by_addr[0]].value) {
+        return -1;
+    }
+
+    // find the last symbol whose value is <= addr
+    lo = 0;
+    hi = linfo->symtab.sym_count;
+
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (linfo->symtab.entries[idx->by_addr[mid]].value <= addr) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    *name   = SYM_NAME(linfo, idx->by_addr[lo]);
+    *offset = addr - linfo->symtab.entries[idx->by_addr[lo]].value;
+
+    return 0;
+}
+
+
+static inline int
+addr_less (struct nk_link_info * linfo, uint32_t a, uint32_t b)
+{
+    return linfo->symtab.entries[a].value < linfo->symtab.entries[b].value;
+}
+
+
+static void
+sift_down (struct nk_link_info * linfo, uint32_t * a, uint32_t start, uint32_t n)
+{
+    uint32_t root = start, child, tmp;
+
+    while ((child = 2*root + 1) < n) {
+        if (child + 1 < n && addr_less(linfo, a[child], a[child+1])) {
+            child++;
+        }
+        if (!addr_less(linfo, a[root], a[child])) {
+            return;
+        }
+        tmp = a[root]; a[root] = a[child]; a[child] = tmp;
+        root = child;
+    }
+}
+
+
+// heapsort the symbol indices by address - no allocation needed
+static void
+sort_by_addr (struct nk_link_info * linfo, uint32_t * a, uint32_t n)
+{
+    uint32_t i, tmp;
+
+    if (n < 2) {
+        return;
+    }
+
+    for (i = n/2; i > 0; i--) {
+        sift_down(linfo, a, i-1, n);
+    }
+
+    for (i = n-1; i > 0; i--) {
+        tmp = a[0]; a[0] = a[i]; a[i] = tmp;
+        sift_down(linfo, a, 0, i);
+    }
+}
+
+
+static void
+free_index (struct symtab_index * idx)
+{
+    if (idx->bloom)   { free(idx->bloom); }
+    if (idx->buckets) { free(idx->buckets); }
+    if (idx->chain)   { free(idx->chain); }
+    if (idx->order)   { free(idx->order); }
+    if (idx->by_addr) { free(idx->by_addr); }
+    memset(idx, 0, sizeof(*idx));
+}
+
+
+static int
+build_index (struct nk_link_info * linfo)
+{
+    struct symtab_index * idx = &linfo->index;
+    uint32_t n = linfo->symtab.sym_count;
+    uint32_t * hashes = NULL;
+    uint32_t i, b;
+
+    if (!n) {
+        return -1;
+    }
+
+    // roughly what binutils does: a couple of symbols per bucket and
+    // a bloom filter with a handful of bits per symbol
+    idx->nbuckets    = n / 2 + 1;
+    idx->bloom_shift = 6;
+    idx->bloom_words = 1;
+    while (idx->bloom_words * 64 < n * 8) {
+        idx->bloom_words <<= 1;
+    }
+
+    idx->bloom   = malloc(sizeof(uint64_t) * idx->bloom_words);
+    idx->buckets = malloc(sizeof(uint32_t) * idx->nbuckets);
+    idx->chain   = malloc(sizeof(uint32_t) * n);
+    idx->order   = malloc(sizeof(uint32_t) * n);
+    idx->by_addr = malloc(sizeof(uint32_t) * n);
+    hashes       = malloc(sizeof(uint32_t) * n);
+
+    if (!idx->bloom || !idx->buckets || !idx->chain || !idx->order || !idx->by_addr || !hashes) {
+        ERROR("Could not allocate symbol table index\n");
+        goto out_err;
+    }
+
+    memset(idx->bloom, 0, sizeof(uint64_t) * idx->bloom_words);
+
+    // buckets[] first counts the members of each bucket...
+    memset(idx->buckets, 0, sizeof(uint32_t) * idx->nbuckets);
+
+    for (i = 0; i < n; i++) {
+        uint32_t h = gnu_hash(SYM_NAME(linfo, i));
+        hashes[i] = h;
+        idx->bloom[(h / 64) & (idx->bloom_words - 1)] |= (1ULL << (h % 64)) | (1ULL << ((h >> idx->bloom_shift) % 64));
+        idx->buckets[h % idx->nbuckets]++;
+        idx->by_addr[i] = i;
+    }
+
+    // ...then becomes the start of each bucket's run in the chain
+    uint32_t next = 0;
+    for (b = 0; b < idx->nbuckets; b++) {
+        uint32_t count = idx->buckets[b];
+        idx->buckets[b] = count ? next : (uint32_t)-1;
+        next += count;
+    }
+
+    // place each symbol in its bucket's run, using the order array
+    // temporarily as the fill cursor of the run
+    for (i = 0; i < n; i++) {
+        idx->chain[i] = (uint32_t)-1;
+    }
+
+    for (i = 0; i < n; i++) {
+        uint32_t slot = idx->buckets[hashes[i] % idx->nbuckets];
+        while (idx->chain[slot] != (uint32_t)-1) {
+            slot++;
+        }
+        idx->chain[slot] = hashes[i] & ~1U;
+        idx->order[slot] = i;
+    }
+
+    // mark the last entry of each run
+    for (b = 0; b < idx->nbuckets; b++) {
+        if (idx->buckets[b] == (uint32_t)-1) {
+            continue;
+        }
+        for (i = idx->buckets[b]; i + 1 < n && (hashes[idx->order[i+1]] % idx->nbuckets) == b; i++) {
+        }
+        idx->chain[i] |= 1;
+    }
+
+    sort_by_addr(linfo, idx->by_addr, n);
+
+    free(hashes);
+
+    DEBUG("Built symbol index: %u symbols, %u buckets, %u bloom words\n",
+          n, idx->nbuckets, idx->bloom_words);
+
+    return 0;
+
+out_err:
+    if (hashes) {
+        free(hashes);
+    }
+    free_index(idx);
+    return -1;
+}
+
+
 /*
  * @name is the string containing the symbol name
  * @addr will be filled in with the resolved address of the symbol on success
@@ -64,25 +340,14 @@ resolve_symbol (struct nk_link_info * linfo,
 
         DEBUG("Looking up symbol (%s):\n", name);
 
-        for (int i = 0; i < linfo->symtab.sym_count; i++) {
-
-            int sym_offset = linfo->symtab.entries[i].offset;
+        if (nk_linker_lookup_symbol(linfo, name, addr) == 0) {
 
-            if (strncmp(name, &(linfo->symtab.strtab[sym_offset]), MAX_SYM_LEN) == 0) {
+            DEBUG("-->name:           %s\n", name);
+            DEBUG("-->PLT entry addr: %016llx\n", addr);
+            DEBUG("-->PLT entry value: %016llx\n", addr[0]);
+            DEBUG("Symbol value resolved to %p\n", (void*)*addr);
 
-                DEBUG("-->name:           %s\n", name);
-                DEBUG("-->GOT entry addr: %016llx\n", linfo->symtab.entries[i].value);
-                DEBUG("-->PLT entry addr: %016llx\n", addr);
-
-                *addr = linfo->symtab.entries[i].value;
-
-                DEBUG("-->PLT entry value: %016llx\n", addr[0]);
-
-                DEBUG("Symbol value resolved to %p\n", (void*)*addr);
-
-                return 0;
-            }
-            
+            return 0;
         }
 
         ERROR("Could not resolve symbol (%s)\n", name);
@@ -122,6 +387,8 @@ nk_link_prog (struct nk_link_info * linfo, struct nk_prog_info * prog)
     uint64_t * addr = NULL;
     uint64_t value  = 0;
 
+    uint64_t start = rdtsc();
+
     DEBUG("Linking prog (%p)\n", prog);
 
     for (int i = 1; i < secnum; i++) {
@@ -179,6 +446,12 @@ nk_link_prog (struct nk_link_info * linfo, struct nk_prog_info * prog)
         resolve_symbol(linfo, prog, name, addr, value);
     }
 
+    linfo->stats.last_link_relocs = dynenum + pltenum;
+    linfo->stats.last_link_cycles = rdtsc() - start;
+
+    INFO("Linked %lu relocations in %lu cycles\n",
+         linfo->stats.last_link_relocs, linfo->stats.last_link_cycles);
+
     return 0;
 }
 
@@ -254,9 +527,65 @@ nk_linker_init (struct naut_info * naut)
 
     if (!linfo->ready) {
         WARN("No symbol table found...linker will not work properly\n");
+    } else if (build_index(linfo)) {
+        WARN("Could not index symbol table...falling back to linear lookups\n");
     }
 
     naut->sys.linker_info = linfo;
 
     return 0;
 }
+
+
+static int
+handle_linker (char * buf, void * priv)
+{
+    struct nk_link_info * linfo = nk_get_nautilus_info()->sys.linker_info;
+    uint64_t start, hashed, linear, addr;
+    uint32_t i, n, miss = 0;
+
+    if (!linfo || !linfo->ready) {
+        nk_vc_printf("No kernel symbol table is loaded\n");
+        return 0;
+    }
+
+    n = linfo->symtab.sym_count;
+
+    nk_vc_printf("%u kernel symbols, %u buckets, %u bloom words\n",
+                 n, linfo->index.nbuckets, linfo->index.bloom_words);
+    nk_vc_printf("lookups: %lu (bloom rejects %lu, chain probes %lu, strcmps %lu)\n",
+                 linfo->stats.lookups, linfo->stats.bloom_rejects,
+                 linfo->stats.chain_probes, linfo->stats.strcmps);
+    nk_vc_printf("last link: %lu relocations in %lu cycles\n",
+                 linfo->stats.last_link_relocs, linfo->stats.last_link_cycles);
+
+    if (strncmp(buf, "linker bench", 12)) {
+        return 0;
+    }
+
+    // resolve every kernel symbol both ways, as a large program would
+    start = rdtsc();
+    for (i = 0; i < n; i++) {
+        miss += !!nk_linker_lookup_symbol(linfo, SYM_NAME(linfo, i), &addr);
+    }
+    hashed = rdtsc() - start;
+
+    start = rdtsc();
+    for (i = 0; i < n; i++) {
+        miss += !!linear_lookup(linfo, SYM_NAME(linfo, i), &addr);
+    }
+    linear = rdtsc() - start;
+
+    nk_vc_printf("resolving %u symbols: hashed %lu cycles (%lu/sym), linear %lu cycles (%lu/sym), %u misses\n",
+                 n, hashed, hashed / n, linear, linear / n, miss);
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl linker_impl = {
+    .cmd      = "linker",
+    .help_str = "linker [bench]",
+    .handler  = handle_linker,
+};
+nk_register_shell_cmd(linker_impl);
@@ -26,6 +26,7 @@
 #include <nautilus/loader.h>
 #include <nautilus/fs.h>
 #include <nautilus/shell.h>
+#include <nautilus/cpu.h>
 
 #ifndef NAUT_CONFIG_DEBUG_LOADER
 #undef DEBUG_PRINT
@@ -354,36 +355,53 @@ parse_multiboot_header (void *data, uint64_t size, mb_data_t *mb)
 #define MB_LOAD (2*PAGE_SIZE_4KB)
 
 // load executable from file, do not run
+//
+// If the file system can hand us the file's data directly (it is on
+// a ramdisk and laid out contiguously), we parse the header in place
+// and fill the image with a single copy from the backing store.
+// Otherwise, we read the header through the file system and then read
+// only the file-backed part of the image directly into place.  Either
+// way, only the BSS is zeroed.
 struct nk_exec *nk_load_exec(char *path)
 {
     nk_fs_fd_t fd=FS_BAD_FD;
     void *page = 0;
+    void *hdr = 0;
+    void *src = 0;
     struct nk_exec *e = 0;
+    uint64_t start_cycles = rdtsc();
      
     DEBUG("Loading executable at path %s\n", path);
 
-    if (!(page = malloc(MB_LOAD))) { 
-        ERROR("Failed to allocate temporary space for loading file %s\n",path);
-        goto out_bad;
-    }
-
-    memset(page,0,MB_LOAD);
-    
     if (FS_FD_ERR(fd = nk_fs_open(path,O_RDONLY,0666))) { 
         ERROR("Executable file %s could not be opened\n", path);
         goto out_bad;
     }
 
-    if (nk_fs_read(fd,page,MB_LOAD)!=MB_LOAD) { 
-        ERROR("Could not read first page of file %s\n", path);
-        goto out_bad;
+    if (nk_fs_map(fd,0,MB_LOAD,&hdr)) { 
+
+        DEBUG("Cannot map header of %s, reading it instead\n", path);
+
+        if (!(page = malloc(MB_LOAD))) { 
+            ERROR("Failed to allocate temporary space for loading file %s\n",path);
+            goto out_bad;
+        }
+
+        memset(page,0,MB_LOAD);
+
+        if (nk_fs_read(fd,page,MB_LOAD)!=MB_LOAD) { 
+            ERROR("Could not read first page of file %s\n", path);
+            goto out_bad;
+        }
+
+        hdr = page;
     }
 
     // the MB header should be in the first 2 pages by construction
 
     mb_data_t m;
 
-    if (parse_multiboot_header(page, MB_LOAD, &m)) { 
+    if (parse_multiboot_header(hdr, MB_LOAD, &m)) { 
         ERROR("Cannot parse multiboot kernel header from first page of %s\n", path);
         goto out_bad;
     }
@@ -403,7 +421,8 @@ struct nk_exec *nk_load_exec(char *path)
     }
     
     uint64_t load_start, load_end, bss_end;
-    uint64_t blob_size;
+    uint64_t blob_size, file_bytes;
+    ssize_t n;
 
     // although these are target addresses, we assume 
     // we can use them as offsets as well.   The next page we load
@@ -415,6 +434,7 @@ struct nk_exec *nk_load_exec(char *path)
 #define ALIGN_UP(x) (((x) % PAGE_SIZE_4KB) ? PAGE_SIZE_4KB*(1 + (x)/PAGE_SIZE_4KB) : (x))
 
     blob_size = ALIGN_UP(bss_end - load_start + 1);
+    file_bytes = load_end - load_start;
 
     DEBUG("Load continuing... start=0x%lx, end=0x%lx, bss_end=0x%lx, blob_size=0x%lx\n",
 	  load_start, load_end, bss_end, blob_size);
@@ -438,27 +458,38 @@ struct nk_exec *nk_load_exec(char *path)
     
     e->blob_size = blob_size;
     e->entry_offset = m.entry->entry_addr - PAGE_SIZE_4KB; 
-    
-    // now copy it to memory
-    ssize_t n;
-    
-    
-    if ((n = nk_fs_read(fd,e->blob,e->blob_size))<0) {
-        ERROR("Unable to read blob from %s\n", path);
-        goto out_bad;
+
+    // the image is private to this exec, so even a resident
+    // file has to be copied once 
+    if (!nk_fs_map(fd,MB_LOAD,file_bytes,&src)) { 
+        DEBUG("Copying 0x%lx bytes of mapped file data from %p\n", file_bytes, src);
+        memcpy(e->blob,src,file_bytes);
+        n = file_bytes;
+    } else {
+        if (nk_fs_seek(fd,MB_LOAD,0)!=MB_LOAD) { 
+            ERROR("Unable to seek past header of %s\n", path);
+            goto out_bad;
+        }
+        if ((n = nk_fs_read(fd,e->blob,file_bytes))<0) {
+            ERROR("Unable to read blob from %s\n", path);
+            goto out_bad;
+        }
     }
 
-    DEBUG("Tried to read 0x%lx byte blob, got 0x%lx bytes\n", e->blob_size, n);
+    DEBUG("Tried to read 0x%lx bytes of file data, got 0x%lx bytes\n", file_bytes, n);
     
     DEBUG("Successfully loaded executable %s\n",path);
 
-    memset(e->blob+(load_end-load_start),0,bss_end-load_end);
+    // BSS, and anything the file came up short on
+    memset(e->blob+n,0,blob_size-n);
 
     DEBUG("Cleared BSS\n");
 
     nk_fs_close(fd);
     DEBUG("file closed\n");
-    free(page);
+    if (page) { free(page); }
+
+    DEBUG("Loaded %s (%s) in %lu cycles\n", path, src ? "mapped" : "read", rdtsc()-start_cycles);
 
     return e;
 	
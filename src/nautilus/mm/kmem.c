@@ -36,6 +36,7 @@
 #include <nautilus/intrinsics.h>
 #include <nautilus/percpu.h>
 #include <nautilus/shell.h>
+#include <nautilus/trace.h>
 
 #include <dev/gpio.h>
 
@@ -470,6 +471,10 @@ static void     *boot_start;
 static void     *boot_end;
 static uint64_t  boot_flags;
 
+// flags given to every newly allocated block, for example
+// so that a concurrent collector can allocate "black"
+static uint64_t  new_block_flags = 0;
+
 void kmem_inform_boot_allocation(void *low, void *high)
 {
     KMEM_DEBUG("Handling boot range %p-%p\n", low, high);
@@ -555,6 +560,7 @@ _kmem_malloc (size_t size, int cpu, int zero)
         if (hdr) {
 	    hdr->addr = block;
             hdr->zone = zone;
+	    hdr->flags = new_block_flags;
 	    // force a software barrier here, since our next write must come last
 	    __asm__ __volatile__ ("" :::"memory");
 	    hdr->order = order; // allocation complete
@@ -579,6 +585,8 @@ _kmem_malloc (size_t size, int cpu, int zero)
     }
 
     KMEM_DEBUG("malloc succeeded: size %lu order %lu -> 0x%lx\n",size, order, block);
+
+    NK_TRACE(KMEM_MALLOC, size, cpu, block);
  
     if (zero) { 
 	memset(block,0,1ULL << hdr->order);
@@ -880,6 +888,13 @@ int  kmem_set_block_flags(void *block_addr, uint64_t flags)
     }
 }
 
+// set the flags that subsequently allocated blocks start with
+void kmem_set_new_block_flags(uint64_t flags)
+{
+    new_block_flags = flags;
+    __sync_synchronize();
+}
+
 // applies only to allocated blocks
 int  kmem_mask_all_blocks_flags(uint64_t mask, int or)
 {
@@ -87,6 +87,8 @@ int nk_net_dev_get_characteristics(struct nk_net_dev *dev, struct nk_net_dev_cha
     struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
 
     DEBUG("get characteristics of %s\n",d->name);
+    // drivers only fill in what they know about
+    memset(c,0,sizeof(*c));
     return di->get_characteristics(d->state,c);
 }
 
@@ -123,12 +125,40 @@ static int generic_cond_check(void* state)
 }
 
 
-int nk_net_dev_send_packet(struct nk_net_dev *dev, 
-			   uint8_t *src, 
-			   uint64_t len, 
-			   nk_dev_request_type_t type,
-			   void (*callback)(nk_net_dev_status_t status, void *state),
-			   void *state)
+// Hand a request to the device, using its offload-aware entry point
+// when we have info and it has one
+static int post_receive(struct nk_dev *d, struct nk_net_dev_int *di, uint8_t *dest, uint64_t len, struct nk_net_dev_pkt_info *info, void (*callback)(nk_net_dev_status_t, void *), void *context)
+{
+    if (info && di->post_receive_info) {
+	return di->post_receive_info(d->state,dest,len,info,callback,context);
+    }
+    if (info) {
+	memset(info,0,sizeof(*info));
+    }
+    return di->post_receive(d->state,dest,len,callback,context);
+}
+
+static int post_send(struct nk_dev *d, struct nk_net_dev_int *di, uint8_t *src, uint64_t len, struct nk_net_dev_pkt_info *info, void (*callback)(nk_net_dev_status_t, void *), void *context)
+{
+    if (info && di->post_send_info) {
+	return di->post_send_info(d->state,src,len,info,callback,context);
+    }
+    // the queue is only a hint, so a device without queues can ignore it
+    if (info && (info->flags & ~NK_NET_PKT_QUEUE)) {
+	DEBUG("%s cannot offload (flags=%x)\n",d->name,info->flags);
+	return -1;
+    }
+    return di->post_send(d->state,src,len,callback,context);
+}
+
+
+int nk_net_dev_send_packet_info(struct nk_net_dev *dev, 
+				uint8_t *src, 
+				uint64_t len, 
+				struct nk_net_dev_pkt_info *info,
+				nk_dev_request_type_t type,
+				void (*callback)(nk_net_dev_status_t status, void *state),
+				void *state)
 {
     struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
     struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
@@ -139,7 +169,7 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
 	    DEBUG("packet send not possible\n");
 	    return -1;
 	} else {
-	    return di->post_send(d->state,src,len,callback,state);
+	    return post_send(d,di,src,len,info,callback,state);
 	}
 	break;
     case NK_DEV_REQ_BLOCKING:
@@ -155,7 +185,7 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
 	    o.dev = dev;
 
 	    if (type==NK_DEV_REQ_NONBLOCKING) { 
-		if (di->post_send(d->state,src,len,0,0)) { 
+		if (post_send(d,di,src,len,info,0,0)) { 
 		    ERROR("Failed to launch send\n");
 		    return -1;
 		} else {
@@ -163,7 +193,7 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
 		    return 0;
 		}
 	    } else {
-		if (di->post_send(d->state,src,len,generic_send_callback,(void*)&o)) { 
+		if (post_send(d,di,src,len,info,generic_send_callback,(void*)&o)) { 
 		    ERROR("Failed to launch send\n");
 		    return -1;
 		} else {
@@ -183,12 +213,63 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
     }
 }
 
-int nk_net_dev_receive_packet(struct nk_net_dev *dev, 
-			      uint8_t *dest, 
-			      uint64_t len, 
+int nk_net_dev_send_packet_sg(struct nk_net_dev *dev,
+			      struct nk_net_dev_seg *segs,
+			      uint32_t num_segs,
+			      struct nk_net_dev_pkt_info *info,
 			      nk_dev_request_type_t type,
 			      void (*callback)(nk_net_dev_status_t status, void *state),
 			      void *state)
+{
+    struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
+    struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
+    DEBUG("send gathered packet on %s (segs=%u, type=%lx)\n", d->name,num_segs,type);
+
+    if (!di->post_send_sg) {
+	DEBUG("gathered send not possible\n");
+	return -1;
+    }
+
+    switch (type) {
+    case NK_DEV_REQ_CALLBACK:
+	return di->post_send_sg(d->state,segs,num_segs,info,callback,state);
+	break;
+    case NK_DEV_REQ_NONBLOCKING:
+	if (di->post_send_sg(d->state,segs,num_segs,info,0,0)) {
+	    ERROR("Failed to launch send\n");
+	    return -1;
+	}
+	return 0;
+	break;
+    case NK_DEV_REQ_BLOCKING: {
+	volatile struct op o;
+
+	o.completed = 0;
+	o.status = 0;
+	o.dev = dev;
+
+	if (di->post_send_sg(d->state,segs,num_segs,info,generic_send_callback,(void*)&o)) {
+	    ERROR("Failed to launch send\n");
+	    return -1;
+	}
+	while (!o.completed) {
+	    nk_dev_wait((struct nk_dev *)dev, generic_cond_check, (void*)&o);
+	}
+	return o.status;
+    }
+	break;
+    default:
+	return -1;
+    }
+}
+
+int nk_net_dev_receive_packet_info(struct nk_net_dev *dev, 
+				   uint8_t *dest, 
+				   uint64_t len, 
+				   struct nk_net_dev_pkt_info *info,
+				   nk_dev_request_type_t type,
+				   void (*callback)(nk_net_dev_status_t status, void *state),
+				   void *state)
 {
     struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
     struct nk_net_dev_int *di = (struct nk_net_dev_int *)(d->interface);
@@ -200,7 +281,7 @@ int nk_net_dev_receive_packet(struct nk_net_dev *dev,
 	    DEBUG("packet receive not possible\n");
 	    return -1;
 	} else {
-	    return di->post_receive(d->state,dest,len,callback,state);
+	    return post_receive(d,di,dest,len,info,callback,state);
 	}
 	break;
     case NK_DEV_REQ_BLOCKING:
@@ -216,7 +297,7 @@ int nk_net_dev_receive_packet(struct nk_net_dev *dev,
 	    o.dev = dev;
 
 	    if (type==NK_DEV_REQ_NONBLOCKING) { 
-		if (di->post_receive(d->state,dest,len,0,0)) { 
+		if (post_receive(d,di,dest,len,info,0,0)) { 
 		    ERROR("Failed to post receive\n");
 		    return -1;
 		} else {
@@ -224,7 +305,7 @@ int nk_net_dev_receive_packet(struct nk_net_dev *dev,
 		    return 0;
 		}
 	    } else {
-		if (di->post_receive(d->state,dest,len,generic_receive_callback,(void*)&o)) { 
+		if (post_receive(d,di,dest,len,info,generic_receive_callback,(void*)&o)) { 
 		    ERROR("Failed to post receive\n");
 		    return -1;
 		} else {
@@ -242,3 +323,65 @@ int nk_net_dev_receive_packet(struct nk_net_dev *dev,
 	return -1;
     }
 }
+
+int nk_net_dev_receive_packet(struct nk_net_dev *dev, 
+			      uint8_t *dest, 
+			      uint64_t len, 
+			      nk_dev_request_type_t type,
+			      void (*callback)(nk_net_dev_status_t status, void *state),
+			      void *state)
+{
+    return nk_net_dev_receive_packet_info(dev,dest,len,0,type,callback,state);
+}
+
+int nk_net_dev_send_packet(struct nk_net_dev *dev, 
+			   uint8_t *src, 
+			   uint64_t len, 
+			   nk_dev_request_type_t type,
+			   void (*callback)(nk_net_dev_status_t status, void *state),
+			   void *state)
+{
+    return nk_net_dev_send_packet_info(dev,src,len,0,type,callback,state);
+}
+
+
+int nk_net_dev_complete_csum(uint8_t *frame, uint64_t len, struct nk_net_dev_pkt_info *info)
+{
+    uint64_t sum = 0;
+    uint64_t i;
+
+    if (!(info->flags & NK_NET_PKT_CSUM_PARTIAL)) {
+	return 0;
+    }
+
+    if (info->csum_start + info->csum_offset + 2 > len) {
+	DEBUG("partial checksum beyond end of frame\n");
+	return -1;
+    }
+
+    // the checksum field holds the pseudo-header sum, so it is
+    // simply included in the one's complement sum of the rest
+    for (i = info->csum_start; i + 1 < len; i += 2) {
+	sum += ((uint16_t)frame[i] << 8) | frame[i+1];
+    }
+    if (i < len) {
+	sum += (uint16_t)frame[i] << 8;
+    }
+    while (sum >> 16) {
+	sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    sum = ~sum & 0xffff;
+    if (!sum) {
+	// 0 means "no checksum" to UDP, and is the same as 0xffff to everyone else
+	sum = 0xffff;
+    }
+
+    frame[info->csum_start + info->csum_offset] = sum >> 8;
+    frame[info->csum_start + info->csum_offset + 1] = sum & 0xff;
+
+    info->flags &= ~NK_NET_PKT_CSUM_PARTIAL;
+    info->flags |= NK_NET_PKT_CSUM_VALID;
+
+    return 0;
+}
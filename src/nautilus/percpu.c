@@ -0,0 +1,82 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2015, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/percpu.h>
+#include <nautilus/smp.h>
+#include <nautilus/mm.h>
+
+//
+// Per-CPU variable areas
+//
+// The linker lays out all NK_DEFINE_PER_CPU variables as a TLS
+// segment whose template is [__per_cpu_start, __per_cpu_data_end)
+// (initialized data) followed by zeroed data.   Using the x64 TLS
+// model, the linker resolves each variable to a fixed negative offset
+// from the thread pointer, which for us is %gs, the struct cpu.   So
+// each CPU's copy of the segment sits immediately below its struct cpu:
+//
+//   [ pad | per-CPU variables ... | struct cpu ... ]
+//                                 ^
+//                                 %gs
+//
+
+extern char __per_cpu_start[], __per_cpu_data_end[];
+
+// The linker script places this first in the segment, so its
+// offset from %gs is the negative of the size of the area.  Its
+// alignment forces the whole segment to cache line alignment.
+__thread uint64_t __per_cpu_first
+  __attribute__((used, section(".tdata.percpu.first"), aligned(CPU_CACHE_LINE_SIZE))) = 0;
+
+
+unsigned long
+nk_per_cpu_area_size (void)
+{
+    return -__per_cpu_offset(__per_cpu_first);
+}
+
+
+struct cpu *
+nk_per_cpu_alloc_cpu (void)
+{
+    unsigned long area = nk_per_cpu_area_size();
+    unsigned long data = __per_cpu_data_end - __per_cpu_start;
+    unsigned long pad  = (CPU_CACHE_LINE_SIZE - (area % CPU_CACHE_LINE_SIZE)) % CPU_CACHE_LINE_SIZE;
+    char *block;
+    struct cpu *core;
+
+    block = mm_boot_alloc_aligned(pad + area + sizeof(struct cpu), CPU_CACHE_LINE_SIZE);
+
+    if (!block) {
+        ERROR_PRINT("Could not allocate CPU struct and per-CPU area\n");
+        return NULL;
+    }
+
+    core = (struct cpu *)(block + pad + area);
+
+    // initialized per-CPU data, then zeroed per-CPU data
+    memcpy((char*)core - area, __per_cpu_start, data);
+    memset((char*)core - area + data, 0, area - data);
+
+    memset(core, 0, sizeof(struct cpu));
+    core->self = core;
+
+    return core;
+}
@@ -507,6 +507,58 @@ intel_disable_ctr (perf_event_t * event)
 }
 
 
+/*
+ * Writes to the legacy IA32_PMCx MSRs only take the low 32 bits
+ * and sign-extend them, so periods must be below 2^31
+ */
+static void
+intel_sample_arm (perf_event_t * event, uint64_t period)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+    uint8_t idx = event->assigned_idx;
+    pmc_ctl_intel_t ctl;
+
+    ctl.val = 0;
+    ctl.usr  = 1;
+    ctl.os   = 1;
+    ctl.intr = 1;
+    ctl.event_select = event->attrs.intel_attrs->id;
+    ctl.unit_mask    = event->attrs.intel_attrs->umask;
+
+    intel_write_ctl(idx, ctl.val);
+    intel_write_ctr(idx, -period);
+
+    if (pmc->version_id >= 2) {
+        msr_write(IA32_PERF_GLOBAL_OVF_CTRL, 1ULL << idx);
+        msr_write(IA32_PERF_GLOBAL_CTRL, msr_read(IA32_PERF_GLOBAL_CTRL) | (1ULL << idx));
+    }
+
+    ctl.en = 1;
+
+    intel_write_ctl(idx, ctl.val);
+}
+
+
+static void
+intel_sample_rearm (perf_event_t * event, uint64_t period)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+
+    intel_write_ctr(event->assigned_idx, -period);
+
+    if (pmc->version_id >= 2) {
+        msr_write(IA32_PERF_GLOBAL_OVF_CTRL, 1ULL << event->assigned_idx);
+    }
+}
+
+
+static void
+intel_sample_disarm (perf_event_t * event)
+{
+    intel_write_ctl(event->assigned_idx, 0);
+}
+
+
 static int
 intel_pmc_init (pmc_info_t * pmc)
 {
@@ -658,6 +710,42 @@ amd_disable_ctr (perf_event_t * event)
 }
 
 
+static void
+amd_sample_arm (perf_event_t * event, uint64_t period)
+{
+    uint8_t idx = event->assigned_idx;
+    pmc_ctl_amd_t ctl;
+
+    ctl.val = 0;
+    ctl.usr = 1;
+    ctl.os  = 1;
+    ctl.int_enable    = 1;
+    ctl.event_select0 = event->attrs.amd_attrs->id;
+    ctl.unit_mask     = event->attrs.amd_attrs->umask;
+
+    amd_write_ctl(idx, ctl.val);
+    amd_write_ctr(idx, -period & AMD_PERF_CTR_MASK);
+
+    ctl.en = 1;
+
+    amd_write_ctl(idx, ctl.val);
+}
+
+
+static void
+amd_sample_rearm (perf_event_t * event, uint64_t period)
+{
+    amd_write_ctr(event->assigned_idx, -period & AMD_PERF_CTR_MASK);
+}
+
+
+static void
+amd_sample_disarm (perf_event_t * event)
+{
+    amd_write_ctl(event->assigned_idx, 0);
+}
+
+
 static struct pmc_ops amd_ops = {
 	.init        = amd_pmc_init,
 	.read_ctr    = amd_read_ctr,
@@ -667,6 +755,9 @@ static struct pmc_ops amd_ops = {
     .unbind_ctr  = amd_unbind_ctr,
     .enable_ctr  = amd_enable_ctr,
     .disable_ctr = amd_disable_ctr,
+    .sample_arm    = amd_sample_arm,
+    .sample_rearm  = amd_sample_rearm,
+    .sample_disarm = amd_sample_disarm,
     .version     = amd_get_pmc_version,
     .msr_cnt     = amd_get_pmc_msr_count,
     .msr_width   = amd_get_pmc_msr_bitwidth,
@@ -681,6 +772,9 @@ static struct pmc_ops intel_ops = {
     .unbind_ctr  = intel_unbind_ctr,
     .enable_ctr  = intel_enable_ctr,
     .disable_ctr = intel_disable_ctr,
+    .sample_arm    = intel_sample_arm,
+    .sample_rearm  = intel_sample_rearm,
+    .sample_disarm = intel_sample_disarm,
     .version     = intel_get_pmc_version,
     .msr_cnt     = intel_get_pmc_msr_count,
     .msr_width   = intel_get_pmc_msr_bitwidth,
@@ -0,0 +1,624 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/irq.h>
+#include <nautilus/idt.h>
+#include <nautilus/percpu.h>
+#include <nautilus/smp.h>
+#include <nautilus/thread.h>
+#include <nautilus/linker.h>
+#include <nautilus/pmc.h>
+#include <nautilus/mm.h>
+#include <nautilus/shell.h>
+#include <dev/apic.h>
+
+/*
+ * PMC Sampling
+ * ============
+ *
+ * nk_pmc_sample_start() takes one PMC slot for the event and arms it
+ * on every CPU to overflow every "period" events.  The overflow raises
+ * the LAPIC performance counter interrupt, where we append the
+ * interrupted RIP, the frame pointer chain of the interrupted code,
+ * and the current thread's tid to this CPU's sample buffer, re-arm
+ * the counter, and leave.  Each buffer has exactly one writer (its
+ * CPU, in interrupt context) and is fill-once, so recording takes no
+ * locks and the report can read any prefix of it at any time.
+ *
+ * The interrupt is an ordinary fixed-vector interrupt, so overflows
+ * that happen with interrupts off are attributed to the point where
+ * interrupts are next enabled.
+ *
+ * The report symbolizes samples with the kernel symbol table and
+ * aggregates them by function (self and inclusive), by call chain,
+ * and by thread.
+ */
+
+#define PMC_DEBUG(fmt, args...) DEBUG_PRINT("PMC: " fmt, ##args)
+#define PMC_ERR(fmt, args...)   ERROR_PRINT("PMC: " fmt, ##args)
+
+#ifndef NAUT_CONFIG_DEBUG_PMC
+#undef PMC_DEBUG
+#define PMC_DEBUG(fmt, args...)
+#endif
+
+#define DEFAULT_PERIOD  250000
+#define DEFAULT_SAMPLES 16384
+#define DEFAULT_TOP     20
+
+NK_DEFINE_PER_CPU(struct nk_pmc_sample_buf *, nk_pmc_sample_buf);
+
+static volatile int     sampling = 0;
+static perf_event_t   * sample_event = NULL;
+static uint64_t         sample_period = 0;
+
+
+static inline int
+fp_ok (uint64_t fp, uint64_t prev, uint64_t lo, uint64_t hi)
+{
+    return fp > prev && !(fp & 0x7) && fp >= lo && fp + 16 <= hi;
+}
+
+
+// Walk the interrupted code's frame pointers, staying within the
+// current thread's stack and moving strictly upward
+static uint32_t
+sample_chain (uint64_t rbp, uint64_t * chain)
+{
+    nk_thread_t * t = get_cur_thread();
+    uint64_t lo, hi, prev = 0;
+    uint32_t n = 0;
+
+    if (!t || !t->stack) {
+        return 0;
+    }
+
+    lo = (uint64_t)t->stack;
+    hi = lo + t->stack_size;
+
+    while (n < NK_PMC_SAMPLE_DEPTH && fp_ok(rbp, prev, lo, hi)) {
+        uint64_t ret = ((uint64_t *)rbp)[1];
+        if (!ret) {
+            break;
+        }
+        chain[n++] = ret;
+        prev = rbp;
+        rbp  = ((uint64_t *)rbp)[0];
+    }
+
+    return n;
+}
+
+
+int
+nk_pmc_sample_intr (excp_entry_t * excp)
+{
+    struct nk_regs * r = (struct nk_regs*)((char*)excp - 128);
+    struct nk_pmc_sample_buf * b = this_cpu_read(nk_pmc_sample_buf);
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+    struct apic_dev * apic = per_cpu_get(apic);
+
+    if (sampling && b) {
+
+        b->count++;
+
+        if (b->head < b->size) {
+            struct nk_pmc_sample * s = &b->samples[b->head];
+            nk_thread_t * t = get_cur_thread();
+
+            s->rip   = excp->rip;
+            s->tid   = t ? t->tid : NK_PMC_SAMPLE_NO_THREAD;
+            s->depth = sample_chain(r->rbp, s->chain);
+
+            // publish
+            __asm__ __volatile__ ("" : : : "memory");
+            b->head++;
+        } else {
+            b->dropped++;
+        }
+    }
+
+    if (sampling && sample_event) {
+        pmc->ops->sample_rearm(sample_event, sample_period);
+        // Intel masks the LVT entry on delivery
+        apic_write(apic, APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_PC_INT_VEC);
+    }
+
+    IRQ_HANDLER_END();
+
+    return 0;
+}
+
+
+static void
+arm_cpu (void * arg)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+    struct apic_dev * apic = per_cpu_get(apic);
+
+    apic_write(apic, APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_PC_INT_VEC);
+    pmc->ops->sample_arm(sample_event, sample_period);
+}
+
+
+static void
+disarm_cpu (void * arg)
+{
+    pmc_info_t * pmc = nk_get_nautilus_info()->sys.pmc_info;
+    struct apic_dev * apic = per_cpu_get(apic);
+
+    pmc->ops->sample_disarm(sample_event);
+    apic_write(apic, APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_LVT_DISABLED | APIC_PC_INT_VEC);
+}
+
+
+int
+nk_pmc_sample_start (uint32_t event_id, uint64_t period, uint64_t samples_per_cpu)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    pmc_info_t * pmc = sys->pmc_info;
+    uint64_t size = sizeof(struct nk_pmc_sample_buf) + samples_per_cpu * sizeof(struct nk_pmc_sample);
+    int i;
+
+    if (!pmc || !pmc->valid || !pmc->ops->sample_arm) {
+        PMC_ERR("Cannot sample, PMC subsystem disabled\n");
+        return -1;
+    }
+
+    if (sampling) {
+        PMC_ERR("Already sampling\n");
+        return -1;
+    }
+
+    if (!period || period >= (1ULL << 31)) {
+        PMC_ERR("Sampling period must be between 1 and 2^31\n");
+        return -1;
+    }
+
+    sample_event = nk_pmc_create(event_id);
+
+    if (!sample_event || !sample_event->bound) {
+        PMC_ERR("Could not get a counter for event 0x%02x\n", event_id);
+        if (sample_event) {
+            nk_pmc_destroy(sample_event);
+            sample_event = NULL;
+        }
+        return -1;
+    }
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        struct nk_pmc_sample_buf ** bp = cpu_ptr(sys->cpus[i], nk_pmc_sample_buf);
+        struct nk_pmc_sample_buf * old = *bp;
+        struct nk_pmc_sample_buf * b;
+
+        *bp = NULL;
+
+        if (old) {
+            free(old);
+        }
+
+        b = malloc_specific(size, i);
+
+        if (!b) {
+            PMC_ERR("Could not allocate sample buffer for cpu %d\n", i);
+            continue;
+        }
+
+        memset(b, 0, sizeof(struct nk_pmc_sample_buf));
+        b->size = samples_per_cpu;
+
+        *bp = b;
+    }
+
+    sample_period = period;
+    sampling = 1;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        smp_xcall(i, arm_cpu, NULL, 1);
+    }
+
+    PMC_DEBUG("Sampling %s every %lu events in slot %d\n",
+              sample_event->name, period, sample_event->assigned_idx);
+
+    return 0;
+}
+
+
+int
+nk_pmc_sample_stop (void)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    int i;
+
+    if (!sampling) {
+        return -1;
+    }
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        smp_xcall(i, disarm_cpu, NULL, 1);
+    }
+
+    sampling = 0;
+
+    nk_pmc_destroy(sample_event);
+    sample_event = NULL;
+
+    return 0;
+}
+
+
+/*
+ * Report
+ */
+
+struct agg {
+    uint64_t key;    // 0 => empty
+    uint64_t count;
+};
+
+struct chain_agg {
+    uint64_t key;    // hash of fns, 0 => empty
+    uint64_t count;
+    uint32_t n;
+    uint64_t fns[NK_PMC_SAMPLE_DEPTH + 1];
+};
+
+
+static inline uint64_t
+agg_hash (uint64_t key)
+{
+    return key * 0x9e3779b97f4a7c15ULL;
+}
+
+
+static struct agg *
+agg_find (struct agg * t, uint64_t size, uint64_t key)
+{
+    uint64_t h = agg_hash(key) >> 32;
+    uint64_t n;
+
+    for (n = 0; n < size; n++, h++) {
+        struct agg * a = &t[h & (size - 1)];
+        if (a->key == key) {
+            return a;
+        }
+        if (!a->key) {
+            a->key = key;
+            return a;
+        }
+    }
+
+    return NULL;
+}
+
+
+static struct chain_agg *
+chain_find (struct chain_agg * t, uint64_t size, uint64_t * fns, uint32_t n)
+{
+    uint64_t key = 1;
+    uint64_t h, i;
+    uint32_t j;
+
+    for (j = 0; j < n; j++) {
+        key = agg_hash(key ^ fns[j]);
+    }
+
+    key |= 1;
+
+    for (i = 0, h = key >> 32; i < size; i++, h++) {
+        struct chain_agg * c = &t[h & (size - 1)];
+        if (!c->key) {
+            c->key = key;
+            c->n   = n;
+            memcpy(c->fns, fns, n * sizeof(uint64_t));
+            return c;
+        }
+        if (c->key == key && c->n == n && !memcmp(c->fns, fns, n * sizeof(uint64_t))) {
+            return c;
+        }
+    }
+
+    return NULL;
+}
+
+
+// address of the function containing addr, or addr itself
+static uint64_t
+func_of (struct nk_link_info * linfo, uint64_t addr)
+{
+    char * name;
+    uint64_t off;
+
+    if (nk_linker_addr_to_symbol(linfo, addr, &name, &off)) {
+        return addr;
+    }
+
+    return addr - off;
+}
+
+
+static void
+print_func (struct nk_link_info * linfo, uint64_t addr)
+{
+    char * name;
+    uint64_t off;
+
+    if (!nk_linker_addr_to_symbol(linfo, addr, &name, &off)) {
+        nk_vc_printf("%s", name);
+    } else {
+        nk_vc_printf("%p", (void*)addr);
+    }
+}
+
+
+// move the largest remaining entry to position i
+#define SELECT_TOP(a, n, i)                                  \
+    do {                                                     \
+        uint64_t __j, __m = (i);                             \
+        for (__j = (i) + 1; __j < (n); __j++) {              \
+            if ((a)[__j]->count > (a)[__m]->count) {         \
+                __m = __j;                                   \
+            }                                                \
+        }                                                    \
+        typeof((a)[0]) __t = (a)[i];                         \
+        (a)[i] = (a)[__m];                                   \
+        (a)[__m] = __t;                                      \
+    } while (0)
+
+
+static void
+report_agg (struct nk_link_info * linfo, char * what, struct agg * t, uint64_t size,
+            uint64_t total, unsigned top, int is_func)
+{
+    struct agg ** a = malloc(size * sizeof(struct agg *));
+    uint64_t i, n = 0;
+
+    if (!a) {
+        PMC_ERR("Could not allocate report space\n");
+        return;
+    }
+
+    for (i = 0; i < size; i++) {
+        if (t[i].key) {
+            a[n++] = &t[i];
+        }
+    }
+
+    nk_vc_printf("Top %s:\n", what);
+
+    for (i = 0; i < n && i < top; i++) {
+        uint64_t pct;
+        SELECT_TOP(a, n, i);
+        pct = (a[i]->count * 10000) / total;
+        nk_vc_printf("  %3lu.%02lu%% %10lu  ", pct / 100, pct % 100, a[i]->count);
+        if (is_func) {
+            print_func(linfo, a[i]->key);
+        } else if (a[i]->key == 1) {
+            nk_vc_printf("(no thread)");
+        } else {
+            nk_vc_printf("thread %lu", a[i]->key - 2);
+        }
+        nk_vc_printf("\n");
+    }
+
+    free(a);
+}
+
+
+static void
+report_chains (struct nk_link_info * linfo, struct chain_agg * t, uint64_t size,
+               uint64_t total, unsigned top)
+{
+    struct chain_agg ** a = malloc(size * sizeof(struct chain_agg *));
+    uint64_t i, n = 0;
+    uint32_t j;
+
+    if (!a) {
+        PMC_ERR("Could not allocate report space\n");
+        return;
+    }
+
+    for (i = 0; i < size; i++) {
+        if (t[i].key) {
+            a[n++] = &t[i];
+        }
+    }
+
+    nk_vc_printf("Top call chains:\n");
+
+    for (i = 0; i < n && i < top; i++) {
+        uint64_t pct;
+        SELECT_TOP(a, n, i);
+        pct = (a[i]->count * 10000) / total;
+        nk_vc_printf("  %3lu.%02lu%% %10lu  ", pct / 100, pct % 100, a[i]->count);
+        for (j = 0; j < a[i]->n; j++) {
+            if (j) {
+                nk_vc_printf(" <- ");
+            }
+            print_func(linfo, a[i]->fns[j]);
+        }
+        nk_vc_printf("\n");
+    }
+
+    free(a);
+}
+
+
+void
+nk_pmc_sample_report (unsigned top)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    struct nk_link_info * linfo = sys->linker_info;
+    uint64_t total = 0, dropped = 0, intrs = 0, lost = 0;
+    uint64_t size, i;
+    struct agg * self = NULL, * incl = NULL, * thr = NULL;
+    struct chain_agg * chains = NULL;
+    int c;
+
+    // snapshot the heads; samples past them may still be landing
+    uint64_t heads[sys->num_cpus];
+
+    for (c = 0; c < sys->num_cpus; c++) {
+        struct nk_pmc_sample_buf * b = *cpu_ptr(sys->cpus[c], nk_pmc_sample_buf);
+        heads[c] = b ? *(volatile uint64_t *)&b->head : 0;
+        total   += heads[c];
+        dropped += b ? b->dropped : 0;
+        intrs   += b ? b->count : 0;
+    }
+
+    nk_vc_printf("%lu samples (%lu interrupts, %lu dropped, buffers full)%s\n",
+                 total, intrs, dropped, sampling ? ", still sampling" : "");
+
+    if (!total) {
+        return;
+    }
+
+    // tables at most half full
+    for (size = 256; size < 2 * total && size < (1ULL << 16); size <<= 1) { }
+
+    self   = malloc(size * sizeof(struct agg));
+    incl   = malloc(size * sizeof(struct agg));
+    thr    = malloc(size * sizeof(struct agg));
+    chains = malloc(size * sizeof(struct chain_agg));
+
+    if (!self || !incl || !thr || !chains) {
+        PMC_ERR("Could not allocate report tables\n");
+        goto out;
+    }
+
+    memset(self, 0, size * sizeof(struct agg));
+    memset(incl, 0, size * sizeof(struct agg));
+    memset(thr, 0, size * sizeof(struct agg));
+    memset(chains, 0, size * sizeof(struct chain_agg));
+
+    for (c = 0; c < sys->num_cpus; c++) {
+        struct nk_pmc_sample_buf * b = *cpu_ptr(sys->cpus[c], nk_pmc_sample_buf);
+
+        for (i = 0; i < heads[c]; i++) {
+            struct nk_pmc_sample * s = &b->samples[i];
+            uint64_t fns[NK_PMC_SAMPLE_DEPTH + 1];
+            struct agg * a;
+            struct chain_agg * ch;
+            uint32_t n, j, k;
+
+            // return addresses point after the call, which may be
+            // past the end of the calling function
+            fns[0] = func_of(linfo, s->rip);
+            for (n = 1; n <= s->depth && n <= NK_PMC_SAMPLE_DEPTH; n++) {
+                fns[n] = func_of(linfo, s->chain[n-1] - 1);
+            }
+
+            a = agg_find(self, size, fns[0]);
+            if (a) {
+                a->count++;
+            } else {
+                lost++;
+            }
+
+            // count each function once per sample, even if recursive
+            for (j = 0; j < n; j++) {
+                for (k = 0; k < j && fns[k] != fns[j]; k++) { }
+                if (k == j && (a = agg_find(incl, size, fns[j]))) {
+                    a->count++;
+                }
+            }
+
+            ch = chain_find(chains, size, fns, n);
+            if (ch) {
+                ch->count++;
+            }
+
+            // 1 is no thread, and +2 keeps tid 0 distinct from an empty slot
+            a = agg_find(thr, size, s->tid == NK_PMC_SAMPLE_NO_THREAD ? 1 : s->tid + 2);
+            if (a) {
+                a->count++;
+            }
+        }
+    }
+
+    if (lost) {
+        nk_vc_printf("%lu samples not aggregated (tables full)\n", lost);
+    }
+
+    report_agg(linfo, "functions (self)", self, size, total, top, 1);
+    report_agg(linfo, "functions (inclusive)", incl, size, total, top, 1);
+    report_chains(linfo, chains, size, total, top);
+    report_agg(linfo, "threads", thr, size, total, top, 0);
+
+ out:
+    if (self) {
+        free(self);
+    }
+    if (incl) {
+        free(incl);
+    }
+    if (thr) {
+        free(thr);
+    }
+    if (chains) {
+        free(chains);
+    }
+}
+
+
+static int
+handle_pmcsample (char * buf, void * priv)
+{
+    uint32_t id;
+    uint64_t period = DEFAULT_PERIOD;
+    uint64_t samples = DEFAULT_SAMPLES;
+    unsigned top = DEFAULT_TOP;
+
+    if (sscanf(buf, "pmcsample start %x %lu %lu", &id, &period, &samples) >= 1) {
+        if (nk_pmc_sample_start(id, period, samples)) {
+            nk_vc_printf("Could not start sampling\n");
+        } else {
+            nk_vc_printf("Sampling event 0x%02x every %lu events, %lu samples per cpu\n",
+                         id, period, samples);
+        }
+        return 0;
+    }
+
+    if (!strncmp(buf, "pmcsample stop", 14)) {
+        if (nk_pmc_sample_stop()) {
+            nk_vc_printf("Not sampling\n");
+        }
+        return 0;
+    }
+
+    if (!strncmp(buf, "pmcsample report", 16)) {
+        sscanf(buf, "pmcsample report %u", &top);
+        nk_pmc_sample_report(top);
+        return 0;
+    }
+
+    nk_vc_printf("pmcsample start event(hex) [period] [samples/cpu] | stop | report [top]\n");
+
+    return 0;
+}
+
+
+static struct shell_cmd_impl pmcsample_impl = {
+    .cmd      = "pmcsample",
+    .help_str = "pmcsample start event(hex) [period] [samples/cpu] | stop | report [top]",
+    .handler  = handle_pmcsample,
+};
+nk_register_shell_cmd(pmcsample_impl);
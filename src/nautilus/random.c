@@ -31,10 +31,11 @@
 #include <nautilus/mm.h>
 #include <dev/apic.h>
 
+NK_DEFINE_PER_CPU(struct nk_rand_info, nk_rand_state);
 
 void
 nk_rand_seed (uint64_t seed) {
-    struct nk_rand_info * rand = per_cpu_get(rand);
+    struct nk_rand_info * rand = this_cpu_ptr(nk_rand_state);
     uint8_t flags = spin_lock_irq_save(&rand->lock);
     rand->xi   = seed;
     rand->seed = seed;
@@ -51,7 +52,7 @@ nk_rand_seed (uint64_t seed) {
 void
 nk_rand_set_xi (uint64_t xi) 
 {
-    struct nk_rand_info * rand = per_cpu_get(rand);
+    struct nk_rand_info * rand = this_cpu_ptr(nk_rand_state);
     rand->xi = xi;
     rand->n++;
 }
@@ -71,7 +72,7 @@ static char
 get_rand_byte (void) 
 {
     struct apic_dev * apic = per_cpu_get(apic);
-    struct nk_rand_info * rand = per_cpu_get(rand);
+    struct nk_rand_info * rand = this_cpu_ptr(nk_rand_state);
     uint64_t cycles;
     uint32_t val;
     char b =  0xff;
@@ -113,14 +114,11 @@ nk_get_rand_bytes (uint8_t * buf, unsigned len)
 int
 nk_rand_init (struct cpu * cpu) 
 {
-    cpu->rand = malloc(sizeof(struct nk_rand_info));
-    if (!cpu->rand) {
-        ERROR_PRINT("Could not allocate CPU random info\n");
-        return -1;
-    }
-    memset(cpu->rand, 0, sizeof(struct nk_rand_info));
+    struct nk_rand_info * rand = cpu_ptr(cpu, nk_rand_state);
+
+    memset(rand, 0, sizeof(struct nk_rand_info));
 
-    spinlock_init(&cpu->rand->lock);
+    spinlock_init(&rand->lock);
 
     return 0;
 }
@@ -61,6 +61,7 @@
 #include <nautilus/random.h>
 #include <nautilus/backtrace.h>
 #include <nautilus/shell.h>
+#include <nautilus/trace.h>
 #include <dev/apic.h>
 #include <dev/gpio.h>
 
@@ -88,6 +89,11 @@
 // in the future these will be determined at boot time
 #define GRANULARITY 2000
 
+// most gang windows reserved on one cpu
+#define GANG_MAX     16
+// releases whose dispatches a gang can be tracking at once
+#define GANG_WINDOWS 8
+
 
 #define INSTRUMENT    0
 
@@ -183,6 +189,14 @@ static volatile int scheduler_ready = 0;
 static volatile uint64_t sync_count=0;
 static volatile uint64_t tsc_start=-1ULL;
 
+// TSC offset probing after the TSCs are restarted
+// probe_cpu is the AP currently being probed by the BSP
+// probe_state is 1 when the BSP has sent a ping, 2 when the AP has replied
+#define TSC_PROBE_ROUNDS 32
+static volatile int      tsc_probe_cpu=-1;
+static volatile int      tsc_probe_state=0;
+static volatile uint64_t tsc_probe_remote=0;
+
 // only one core can do a world stop at a time
 // this lock is also used to signal that we are starting
 // or ending a world stop
@@ -322,6 +336,9 @@ typedef struct nk_sched_percpu_state {
 
     uint64_t reinject_count;  // how many timer/kick interrupts I've had to reinject
 
+    struct nk_sched_gang *gangs[GANG_MAX];  // gang windows reserved on this cpu
+    uint64_t              num_gangs;
+
 #if INSTRUMENT
     uint64_t resched_fast_num;
     uint64_t resched_fast_sum;
@@ -459,6 +476,14 @@ typedef struct nk_sched_percpu_state {
 #define DUMP_RT(s,p)
 #endif
 
+// Once arrived, a gang member is ordered by its release instead of
+// its deadline, which puts it ahead of every other RT thread during
+// its window (admission keeps gang windows on a cpu from overlapping)
+#define GANG_RELEASE(t) ((t)->deadline - (t)->constraints.periodic.period)
+#define GANG_WINDOW_END(t) (GANG_RELEASE(t) + (t)->constraints.periodic.slice)
+#define RT_KEY(t) ((t)->gang ? GANG_RELEASE(t) : (t)->deadline)
+#define QUEUE_KEY(q,t) ((q)->type==RUNNABLE_QUEUE ? RT_KEY(t) : (t)->deadline)
+
 //
 // Per-thread state (abstracted from overall thread context
 // which remains in struct nk_thread).  thread.[ch] are responsible
@@ -510,6 +535,9 @@ typedef struct nk_sched_thread_state {
     uint64_t miss_time_sum;   // sum of missed time
     uint64_t miss_time_sum2;  // sum of squares of missed time
 
+    struct nk_sched_gang *gang;  // gang this (periodic) thread belongs to, if any
+    uint64_t gang_arrival;       // last arrival whose dispatch was recorded
+
     // the thread context itself
     struct nk_thread *thread;
 
@@ -518,6 +546,29 @@ typedef struct nk_sched_thread_state {
 
 } rt_thread ;
 
+struct nk_sched_gang {
+    spinlock_t lock;       // protects the dispatch tracking and stats
+    struct nk_sched_constraints constraints;
+    volatile uint64_t release;   // first release, fixed by the first join, 0 before
+    volatile uint64_t refcount;  // creator + members
+    volatile uint64_t members;
+
+    uint64_t dispatches;
+    uint64_t latency_sum;
+    uint64_t latency_max;
+    uint64_t releases;
+    uint64_t skew_sum;
+    uint64_t skew_max;
+
+    // dispatches of the most recent releases, indexed by period number
+    struct {
+	uint64_t release;
+	uint64_t first;
+	uint64_t last;
+	uint64_t count;
+    } window[GANG_WINDOWS];
+};
+
 static void       rt_thread_dump(rt_thread *thread, char *prefix);
 static int        rt_thread_admit(rt_scheduler *scheduler, rt_thread *thread, uint64_t now);
 static int        rt_thread_check_deadlines(rt_thread *t, rt_scheduler *scheduler, uint64_t now);
@@ -537,6 +588,8 @@ static void           set_timer(rt_scheduler *scheduler,
 
 static void           handle_special_switch(rt_status what, int have_lock, uint8_t flags, void (*release_callback)(void*), void *release_state);
 
+static void           gang_leave(rt_thread *r);
+
 static inline uint64_t get_min_per(rt_priority_queue *runnable, rt_priority_queue *queue, rt_thread *thread);
 static inline uint64_t get_avg_per(rt_priority_queue *runnable, rt_priority_queue *pending, rt_thread *thread);
 static inline uint64_t get_periodic_util_rms_limit(uint64_t count);
@@ -595,7 +648,7 @@ static void print_thread(rt_thread *r, void *priv)
 	    nk_vc_printf(" sporadic(%utp, %llu)", r->constraints.interrupt_priority_class,CO(r->constraints.sporadic.size));
 	    break;
 	case PERIODIC:
-	    nk_vc_printf(" periodic(%utp, %llu,%llu)", r->constraints.interrupt_priority_class,CO(r->constraints.periodic.period), CO(r->constraints.periodic.slice));
+	    nk_vc_printf(" periodic(%utp, %llu,%llu)%s", r->constraints.interrupt_priority_class,CO(r->constraints.periodic.period), CO(r->constraints.periodic.slice), r->gang ? " gang" : "");
 	    break;
 	}
 
@@ -723,13 +776,15 @@ void nk_sched_dump_time(int cpu_arg)
 	    struct apic_dev *apic = sys->cpus[cpu]->apic;
 	    struct tsc_info *tsc = &sys->cpus[cpu]->sched_state->tsc;
 			 
-            nk_vc_printf("%dc %luhz %luppt %lucpu %lucpt %uts %uct %lutc %lust %lustc %ldstr %ldstrc\n",
+            nk_vc_printf("%dc %luhz %luppt %lucpu %lucpt %uts %uct %lutc %lust %lustc %ldstr %ldstrc %ldto %s\n",
 			 cpu, apic->bus_freq_hz, apic->ps_per_tick,
 			 apic->cycles_per_us, apic->cycles_per_tick,
 			 apic->timer_set, apic->current_ticks, apic->timer_count,
 			 tsc->sync_time, tsc->sync_time_cycles,
 			 tsc->sync_time - tsc0->sync_time,
-			 tsc->sync_time_cycles - tsc0->sync_time_cycles);
+			 tsc->sync_time_cycles - tsc0->sync_time_cycles,
+			 apic->tsc_offset,
+			 apic->tsc_deadline ? "deadline" : "oneshot");
 	}
     }
 }
@@ -1371,6 +1426,12 @@ int nk_sched_make_runnable(struct nk_thread *thread, int cpu, int admit)
 
 void nk_sched_exit(spinlock_t *lock_to_release)
 {
+    rt_thread *r = get_cur_thread()->sched_state;
+
+    if (r->gang) {
+	gang_leave(r);
+    }
+
     handle_special_switch(EXITING,0,0,lock_to_release ? (void (*)(void*))spin_unlock : 0 ,(void*)lock_to_release);
     // we should not come back!
     panic("Returned to finished thread!\n");
@@ -1673,7 +1734,7 @@ static int rt_priority_queue_enqueue(rt_priority_queue *queue, rt_thread *thread
     queue->threads[pos] = thread;
 
     // update heap
-    while (queue->threads[parent(pos)]->deadline > thread->deadline 
+    while (QUEUE_KEY(queue,queue->threads[parent(pos)]) > QUEUE_KEY(queue,thread)
 	   && pos != parent(pos))  {
 	queue->threads[pos] = queue->threads[parent(pos)];
 	pos = parent(pos);
@@ -1723,12 +1784,12 @@ static rt_thread* rt_priority_queue_dequeue(rt_priority_queue *queue)
 	child = left_child(now);
 
 	if (child < queue->size && 
-	    queue->threads[right_child(now)]->deadline < queue->threads[left_child(now)]->deadline)  {
+	    QUEUE_KEY(queue,queue->threads[right_child(now)]) < QUEUE_KEY(queue,queue->threads[left_child(now)]))  {
 	    
 	    child = right_child(now);
 	}
             
-	if (last->deadline > queue->threads[child]->deadline) {
+	if (QUEUE_KEY(queue,last) > QUEUE_KEY(queue,queue->threads[child])) {
 	    queue->threads[now] = queue->threads[child];
 	} else {
 	    break;
@@ -1797,6 +1858,172 @@ static void rt_thread_dump(rt_thread *thread, char *pre)
 }
 
 
+//
+// Gangs
+//
+// A gang's window is [release + k*period, release + k*period + slice)
+// on the common timeline.  Each cpu with a member keeps the gang in
+// its table of reserved windows, which admission checks new gangs
+// against.  Reservations and the member count are changed only with
+// the local lock of the member's cpu held.
+//
+
+static uint64_t gang_gcd(uint64_t a, uint64_t b)
+{
+    while (b) {
+	uint64_t t = a % b;
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+// Do the windows [o1+k*p1, o1+k*p1+s1) and [o2+j*p2, o2+j*p2+s2) ever
+// overlap?  The differences of their starts are exactly (o2-o1) mod
+// gcd(p1,p2) plus multiples of the gcd, so only the two differences
+// nearest zero need checking
+static int gang_windows_overlap(uint64_t o1, uint64_t p1, uint64_t s1,
+				uint64_t o2, uint64_t p2, uint64_t s2)
+{
+    uint64_t g = gang_gcd(p1,p2);
+    uint64_t r = (o2 % g + g - o1 % g) % g;
+
+    return r < s1 || g - r < s2;
+}
+
+static int gang_conflicts(rt_scheduler *s, uint64_t offset, struct nk_sched_constraints *c)
+{
+    int i;
+
+    for (i=0;i<s->num_gangs;i++) {
+	struct nk_sched_gang *h = s->gangs[i];
+	if (gang_windows_overlap(offset, c->periodic.period, c->periodic.slice,
+				 h->release, h->constraints.periodic.period,
+				 h->constraints.periodic.slice)) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+static uint64_t gang_slot_offset(struct nk_sched_gang *g, int slot)
+{
+    uint64_t offset = (g->constraints.periodic.period / NK_SCHED_GANG_SLOTS) * slot;
+
+    return offset - offset % GRANULARITY;
+}
+
+// reserve the gang's window on this cpu for a new member
+// local lock held
+static int gang_reserve(rt_scheduler *s, struct nk_sched_gang *g)
+{
+    if (s->num_gangs == GANG_MAX) {
+	DEBUG("Too many gangs on this cpu\n");
+	return -1;
+    }
+
+    if (gang_conflicts(s, g->release, &g->constraints)) {
+	DEBUG("Gang window conflicts with another gang on this cpu\n");
+	return -1;
+    }
+
+    s->gangs[s->num_gangs++] = g;
+    atomic_inc(g->refcount);
+    atomic_inc(g->members);
+
+    return 0;
+}
+
+// local lock held
+static void gang_unreserve(rt_scheduler *s, struct nk_sched_gang *g)
+{
+    int i;
+
+    for (i=0;i<s->num_gangs;i++) {
+	if (s->gangs[i] == g) {
+	    s->gangs[i] = s->gangs[--s->num_gangs];
+	    atomic_dec(g->members);
+	    return;
+	}
+    }
+
+    ERROR("Gang %p has no reservation on this cpu\n",g);
+}
+
+// the first release at or after now
+static uint64_t gang_first_release(struct nk_sched_gang *g, uint64_t now)
+{
+    uint64_t period = g->constraints.periodic.period;
+    uint64_t release = g->release;
+
+    if (release < now) {
+	release += ((now - release + period - 1) / period) * period;
+    }
+
+    return release;
+}
+
+// push the next arrival of a member that has missed its window to
+// the first release after now
+static inline void gang_skip_missed(rt_thread *t, uint64_t now)
+{
+    uint64_t period = t->constraints.periodic.period;
+
+    if (t->deadline <= now) {
+	t->deadline += ((now - t->deadline) / period + 1) * period;
+    }
+}
+
+// note the first dispatch of a member at the given release
+// called from the scheduler with interrupts off
+static void gang_record_dispatch(struct nk_sched_gang *g, uint64_t release, uint64_t now)
+{
+    uint64_t latency = now > release ? now - release : 0;
+    uint64_t skew;
+    int i = (release / g->constraints.periodic.period) % GANG_WINDOWS;
+
+    spin_lock(&g->lock);
+
+    g->dispatches++;
+    g->latency_sum += latency;
+    g->latency_max = MAX(g->latency_max, latency);
+
+    if (g->window[i].release != release) {
+	g->window[i].release = release;
+	g->window[i].first = now;
+	g->window[i].last = now;
+	g->window[i].count = 0;
+    }
+
+    g->window[i].first = MIN(g->window[i].first, now);
+    g->window[i].last = MAX(g->window[i].last, now);
+
+    if (++g->window[i].count == g->members) {
+	skew = g->window[i].last - g->window[i].first;
+	g->releases++;
+	g->skew_sum += skew;
+	g->skew_max = MAX(g->skew_max, skew);
+    }
+
+    spin_unlock(&g->lock);
+}
+
+// the calling thread leaves its gang, which it can do only from
+// thread context as it may drop the last reference
+static void gang_leave(rt_thread *r)
+{
+    LOCAL_LOCK_CONF;
+    rt_scheduler *s = per_cpu_get(sched_state);
+    struct nk_sched_gang *g = r->gang;
+
+    LOCAL_LOCK(s);
+    gang_unreserve(s,g);
+    r->gang = 0;
+    LOCAL_UNLOCK(s);
+
+    nk_sched_gang_put(g);
+}
+
 static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
 {
     struct sys_info *sys = per_cpu_get(system);
@@ -1825,6 +2052,11 @@ static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
 	    ASSERT(thread->constraints.periodic.slice >= thread->run_time);
 	    remaining_time = thread->constraints.periodic.slice - thread->run_time;
 	    next_preempt = now + remaining_time;
+	    if (thread->gang) {
+		// the window closes at the same absolute time on
+		// every member's cpu, whatever slice is left
+		next_preempt = MIN(next_preempt, GANG_WINDOW_END(thread));
+	    }
 	    break;
 	}
 	thread->start_time = now;
@@ -1836,6 +2068,25 @@ static void set_timer(rt_scheduler *scheduler, rt_thread *thread, uint64_t now)
 
     scheduler->tsc.start_time = now;
     scheduler->tsc.set_time = MIN(next_arrival,next_preempt);
+
+    if (apic->tsc_deadline) { 
+	// the set time is absolute, and so is the deadline, so
+	// there is no need to reference the current time.  A set time
+	// that has already passed results in an immediate interrupt.
+	uint64_t deadline = scheduler->tsc.set_time + scheduler->slack;
+
+	if (deadline < scheduler->tsc.set_time) {
+	    // the "infinite" set time
+	    deadline = -1;
+	} else {
+	    // back to this core's TSC
+	    deadline = apic_ns_to_tsc(apic, deadline) - apic->tsc_offset;
+	}
+
+	apic_update_deadline_timer(apic, deadline, IF_EARLIER);
+
+	return;
+    }
     
   
     // the set time has been computed based on the "now" argument
@@ -2297,7 +2548,7 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 	    if (HAVE_RT(scheduler)) {
 		// are we special or is there a higher priority task?
 		if (CUR_IS_SPECIAL ||
-		    (rt_c->deadline > PEEK_RT(scheduler)->deadline)) {
+		    (RT_KEY(rt_c) > RT_KEY(PEEK_RT(scheduler)))) {
 		    // if so, we need to preempt this one
 		    rt_n = GET_NEXT_RT(scheduler);
 		    if (rt_n != NULL) {
@@ -2376,11 +2627,13 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 	    goto out_good;
 	}
 	// Check to see if we are done with this period of the task
-	if (rt_c->run_time >= rt_c->constraints.periodic.slice) {
+	// (or, for a gang member, if its window has closed)
+	if (rt_c->run_time >= rt_c->constraints.periodic.slice ||
+	    (rt_c->gang && !changing && now >= GANG_WINDOW_END(rt_c))) {
 	    DEBUG("Current task complete (slice=%llu, run_time=%llu)\n",
 		  rt_c->constraints.periodic.slice, rt_c->run_time);
 	    // if we are done with this period, sanity check deadlines
-	    if (rt_thread_check_deadlines(rt_c,scheduler,now)) {
+	    if (rt_thread_check_deadlines(rt_c,scheduler,now) && !rt_c->gang) {
 		DEBUG("Missed Deadline - immediate re-arrival\n");
 		// deadline update here is relative to when this task
 		// SHOULD have completed, not relative to the current time
@@ -2407,6 +2660,12 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 		DEBUG("Deadline met\n");
 		// Note that the current deadline is in fact the arrival 
 		// deadline for the next arrival
+		if (rt_c->gang) {
+		    // a gang member that has missed its window waits
+		    // for the next release instead of running out of
+		    // step with the rest of the gang
+		    gang_skip_missed(rt_c,now);
+		}
 		if (CUR_IS_NOT_SPECIAL) {
 		    DEBUG("Deadline met - enqueuing to pending\n");
 		    rt_c->thread->status=NK_THR_SUSPENDED;
@@ -2449,7 +2708,7 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 		// if we just changed constraints, then we could now be on
 		// the run queue since we pumped the pending queue
 		if (CUR_IS_SPECIAL ||
-		    (rt_c->deadline > PEEK_RT(scheduler)->deadline)) {
+		    (RT_KEY(rt_c) > RT_KEY(PEEK_RT(scheduler)))) {
 		    rt_n = GET_NEXT_RT(scheduler);
 		    if (rt_n != NULL) {
 			// only make us runnable again if we are being prempted
@@ -2554,6 +2813,12 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 	//DEBUG("Thread %llu exit complete\n", rt_c->thread->tid);
 	rt_c->exit_time = now;
     }
+
+    if (rt_n->gang && rt_n->arrival_count != rt_n->gang_arrival) {
+	// first dispatch of this arrival
+	rt_n->gang_arrival = rt_n->arrival_count;
+	gang_record_dispatch(rt_n->gang, GANG_RELEASE(rt_n), now);
+    }
     
     if (going_to_sleep) {
 	//	DEBUG("%llu sleep complete\n", rt_c->thread->tid);
@@ -2600,6 +2865,8 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 	      rt_n->thread->tid, rt_n->thread->name,
 	      my_cpu_id());
 
+	NK_TRACE(SCHED_SWITCH, rt_c->thread->tid, rt_n->thread->tid, rt_n->thread->status);
+
 	rt_n->switch_in_count++;
 	      
 	// we are switching threads, start accounting for the new one
@@ -2654,7 +2921,7 @@ struct nk_thread *nk_sched_need_resched()
     return _sched_need_resched(0,0);
 }
 
-int nk_sched_thread_change_constraints(struct nk_sched_constraints *constraints)
+static int _sched_thread_change_constraints(struct nk_sched_constraints *constraints, struct nk_sched_gang *gang)
 {
     LOCAL_LOCK_CONF;
     struct sys_info *sys = per_cpu_get(system);
@@ -2662,12 +2929,22 @@ int nk_sched_thread_change_constraints(struct nk_sched_constraints *constraints)
     struct nk_thread *t = get_cur_thread();
     rt_thread *r = t->sched_state;
     struct nk_sched_constraints old;
+    struct nk_sched_constraints orig = r->constraints;
+    struct nk_sched_gang *old_gang = r->gang;
 
 
     DEBUG("Changing constraints of %llu \"%s\"\n", t->tid,t->name);
 
     LOCAL_LOCK(scheduler);
 
+    if (old_gang) {
+	// give up the old gang's window so that it does not count
+	// against the new constraints, but keep our reference until
+	// they are admitted, so that we can rejoin if they are not
+	gang_unreserve(scheduler,old_gang);
+	r->gang = 0;
+    }
+
     if (r->constraints.type != APERIODIC && 
 	constraints->type != APERIODIC) {
 
@@ -2698,18 +2975,27 @@ int nk_sched_thread_change_constraints(struct nk_sched_constraints *constraints)
 
     old = r->constraints;
     r->constraints = *constraints;
+    // admission reserves the gang's window if there is one
+    r->gang = gang;
 
     // we assume from here that we are aperiodic changing to other
 
     if (_sched_make_runnable(t,t->current_cpu,1,1)) {
 	DEBUG("Failed to re-admit %llu \"%s\" with new constraints\n" , t->tid,t->name);
-	// failed to admit task, bring it back up as aperiodic
-	// again.   This should just work
-	r->constraints = old;
-	if (_sched_make_runnable(t,t->current_cpu,1,1)) {
-	    // very bad...
-	    panic("Failed to recover to aperiodic when changing constraints\n");
-	    goto out_bad;
+	// failed to admit task, so rejoin the old gang with the
+	// old constraints if it had one, and otherwise (or if that
+	// fails too) bring it back up as aperiodic again, which
+	// should just work
+	r->constraints = orig;
+	r->gang = old_gang;
+	if (!old_gang || _sched_make_runnable(t,t->current_cpu,1,1)) {
+	    r->constraints = old;
+	    r->gang = 0;
+	    if (_sched_make_runnable(t,t->current_cpu,1,1)) {
+		// very bad...
+		panic("Failed to recover to aperiodic when changing constraints\n");
+		goto out_bad;
+	    }
 	}
 	DEBUG("Readmitted %llu \"%s\" with old constraints\n" , t->tid,t->name);
 	// we are now aperioidic
@@ -2742,9 +3028,124 @@ int nk_sched_thread_change_constraints(struct nk_sched_constraints *constraints)
  out_bad:
     LOCAL_UNLOCK(scheduler);
  out_bad_no_unlock:
+    // a rejoin took its own reference
+    nk_sched_gang_put(old_gang);
     return -1;
 
  out_good_no_unlock:
+    // we are out of the old gang, and may drop the last reference
+    nk_sched_gang_put(old_gang);
+    return 0;
+}
+
+int nk_sched_thread_change_constraints(struct nk_sched_constraints *constraints)
+{
+    return _sched_thread_change_constraints(constraints,0);
+}
+
+struct nk_sched_gang *nk_sched_gang_create(struct nk_sched_constraints *constraints)
+{
+    struct nk_sched_gang *g;
+
+    if (constraints->type != PERIODIC) {
+	ERROR("Gangs must be periodic\n");
+	return 0;
+    }
+
+    g = MALLOC(sizeof(*g));
+
+    if (!g) {
+	ERROR("Failed to allocate gang\n");
+	return 0;
+    }
+
+    ZERO(g);
+    spinlock_init(&g->lock);
+    g->constraints = *constraints;
+    g->refcount = 1;
+
+    return g;
+}
+
+void nk_sched_gang_put(struct nk_sched_gang *gang)
+{
+    if (gang && !atomic_dec_val(gang->refcount)) {
+	DEBUG("Freeing gang %p\n",gang);
+	FREE(gang);
+    }
+}
+
+uint64_t nk_sched_gang_free_slots(struct nk_sched_gang *gang)
+{
+    LOCAL_LOCK_CONF;
+    rt_scheduler *s = per_cpu_get(sched_state);
+    struct nk_sched_periodic_constraints *p = &gang->constraints.periodic;
+    uint64_t per_res = s->cfg.util_limit - s->cfg.aperiodic_reservation - s->cfg.sporadic_reservation;
+    uint64_t cur_util, cur_count;
+    uint64_t slots = 0;
+    int i;
+
+    LOCAL_LOCK(s);
+
+    // same utilization test as admission, which will still have
+    // the final say
+    get_periodic_util(s,&cur_util,&cur_count);
+
+    if (cur_util + (p->slice*UTIL_ONE)/p->period < 
+	MIN(get_periodic_util_rms_limit(cur_count+1),per_res)) {
+	for (i=0;i<NK_SCHED_GANG_SLOTS;i++) {
+	    if (!gang_conflicts(s, gang_slot_offset(gang,i), &gang->constraints)) {
+		slots |= 1ULL << i;
+	    }
+	}
+    }
+
+    LOCAL_UNLOCK(s);
+
+    return slots;
+}
+
+int nk_sched_thread_join_gang(struct nk_sched_gang *gang, int slot, uint64_t after)
+{
+    uint64_t period = gang->constraints.periodic.period;
+    uint64_t start = after + gang->constraints.periodic.phase;
+    uint64_t release = start - start % period + gang_slot_offset(gang,slot);
+
+    if (slot < 0 || slot >= NK_SCHED_GANG_SLOTS) {
+	ERROR("Bad gang slot %d\n",slot);
+	return -1;
+    }
+
+    if (release < start) {
+	release += period;
+    }
+
+    // the first member to get here sets the window for everyone
+    atomic_cmpswap(gang->release, 0, release);
+
+    return _sched_thread_change_constraints(&gang->constraints, gang);
+}
+
+int nk_sched_thread_get_gang_stats(struct nk_sched_gang_stats *stats)
+{
+    rt_thread *r = get_cur_thread()->sched_state;
+    struct nk_sched_gang *g = r->gang;
+    uint8_t flags;
+
+    if (!g) {
+	return -1;
+    }
+
+    flags = spin_lock_irq_save(&g->lock);
+    stats->members = g->members;
+    stats->dispatches = g->dispatches;
+    stats->latency_sum = g->latency_sum;
+    stats->latency_max = g->latency_max;
+    stats->releases = g->releases;
+    stats->skew_sum = g->skew_sum;
+    stats->skew_max = g->skew_max;
+    spin_unlock_irq_restore(&g->lock,flags);
+
     return 0;
 }
 
@@ -3252,11 +3653,10 @@ static inline void rt_thread_update_aperiodic(rt_thread *t, rt_scheduler *schedu
 // in nanoseconds
 static uint64_t cur_time()
 {
-    struct sys_info *sys = per_cpu_get(system);
-    struct apic_dev *apic = sys->cpus[my_cpu_id()]->apic;
-    uint64_t c = rdtsc();
-    uint64_t t = apic_cycles_to_realtime(apic, c);
-    return t;
+    struct apic_dev *apic = per_cpu_get(apic);
+    // this core's TSC, adjusted to the BSP's, and converted
+    // to ns with a multiply and shift
+    return apic_tsc_to_ns(apic, rdtsc() + apic->tsc_offset);
 }
 
 uint64_t nk_sched_get_realtime() 
@@ -3446,11 +3846,21 @@ static int rt_thread_admit(rt_scheduler *scheduler, rt_thread *thread, uint64_t
 
 
 	if (cur_util+this_util < our_limit) { 
+	    if (thread->gang && gang_reserve(scheduler,thread->gang)) {
+		DEBUG("Rejected PERIODIC gang thread\n");
+		return -1;
+	    }
 	    // admit task
 	    reset_state(thread);
 	    reset_stats(thread);
-	    // the next arrival of this thread will be at this time
-	    thread->deadline = now + thread->constraints.periodic.phase;
+	    if (thread->gang) {
+		// gang members arrive at the gang's next release
+		thread->deadline = gang_first_release(thread->gang,now);
+		thread->gang_arrival = 0;
+	    } else {
+		// the next arrival of this thread will be at this time
+		thread->deadline = now + thread->constraints.periodic.phase;
+	    }
 	    DEBUG("Admitting PERIODIC thread\n");
 	    return 0;
 	} else {
@@ -4182,11 +4592,60 @@ void nk_sched_start()
 
     msr_write(IA32_TIME_STAMP_COUNTER,tsc_start);
 
+    // The TSC writes are not simultaneous, so we now measure
+    // each AP's remaining offset from the BSP using ping-pongs, one
+    // AP at a time.   The round with the shortest round-trip gives
+    // the tightest estimate.
+    if (my_cpu->is_bsp) {
+	int cpu, i;
+	for (cpu=0;cpu<num_cpus;cpu++) {
+	    uint64_t t0, t2, best_rtt=-1ULL;
+	    sint64_t best_off=0;
+	    if (cpu==my_cpu->id) { 
+		continue;
+	    }
+	    tsc_probe_cpu = cpu;
+	    for (i=0;i<TSC_PROBE_ROUNDS;i++) { 
+		t0 = rdtsc();
+		tsc_probe_state = 1;
+		while (tsc_probe_state!=2) {
+		    // spin
+		}
+		t2 = rdtsc();
+		if (t2-t0 < best_rtt) { 
+		    best_rtt = t2-t0;
+		    best_off = (sint64_t)(tsc_probe_remote - (t0 + (t2-t0)/2));
+		}
+	    }
+	    sys->cpus[cpu]->apic->tsc_offset = -best_off;
+	    DEBUG("CPU %d TSC offset is %ld cycles (rtt %lu cycles)\n",cpu,-best_off,best_rtt);
+	    tsc_probe_state = 0;
+	    mbarrier();
+	}
+	tsc_probe_cpu = num_cpus;
+    } else {
+	int i;
+	while (tsc_probe_cpu!=my_cpu->id) {
+	    // spin
+	}
+	for (i=0;i<TSC_PROBE_ROUNDS;i++) { 
+	    while (tsc_probe_state!=1) {
+		// spin
+	    }
+	    tsc_probe_remote = rdtsc();
+	    tsc_probe_state = 2;
+	}
+	// wait for the BSP to record our offset
+	while (tsc_probe_cpu==my_cpu->id) {
+	    // spin
+	}
+    }
+
     cur_cycles = rdtsc();
 
     my_cpu->sched_state->tsc.sync_time_cycles = cur_cycles;
 
-    my_cpu->sched_state->tsc.sync_time = apic_cycles_to_realtime(apic,cur_cycles);
+    my_cpu->sched_state->tsc.sync_time = apic_cycles_to_realtime(apic,cur_cycles+apic->tsc_offset);
 
     DEBUG("Time restarted at %lu cycles (currently %lu cycles / %lu ns)\n", tsc_start, cur_cycles, my_cpu->sched_state->tsc.sync_time);
 
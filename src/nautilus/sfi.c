@@ -28,6 +28,7 @@
 #include <nautilus/paging.h>
 #include <nautilus/cpuid.h>
 #include <nautilus/mm.h>
+#include <nautilus/percpu.h>
 #include <dev/apic.h>
 #include <dev/ioapic.h>
 
@@ -166,11 +167,9 @@ parse_sfi_cpu (struct sfi_cpu_tbl * tbl, struct sys_info * sys)
             panic("CPU count exceeded max (check your .config)\n");
         }
 
-		new_cpu = mm_boot_alloc(sizeof(struct cpu));
-        if (!new_cpu) {
+        if (!(new_cpu = nk_per_cpu_alloc_cpu())) {
             panic("Couldn't allocate new CPU struct (%u)\n", sys->num_cpus);
         }
-        memset(new_cpu, 0, sizeof(struct cpu));
 
         if (apicid == get_my_apicid()) { 
             new_cpu->is_bsp = 1;
@@ -37,6 +37,7 @@
 #include <nautilus/mm.h>
 #include <nautilus/fpu.h>
 #include <nautilus/percpu.h>
+#include <nautilus/trace.h>
 #include <dev/ioapic.h>
 #include <dev/apic.h>
 
@@ -554,6 +555,8 @@ smp_xcall (cpu_id_t cpu_id,
 
     SMP_DEBUG("Initiating SMP XCALL from core %u to core %u\n", my_cpu_id(), cpu_id);
 
+    NK_TRACE(XCALL, cpu_id, fun, wait);
+
     if (cpu_id > nk_get_num_cpus()) {
         ERROR_PRINT("Attempt to execute xcall on invalid cpu (%u)\n", cpu_id);
         return -1;
@@ -0,0 +1,280 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2015, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/percpu.h>
+#include <nautilus/smp.h>
+#include <nautilus/shell.h>
+#include <nautilus/trace.h>
+#include <dev/apic.h>
+
+#ifndef NAUT_CONFIG_DEBUG_TRACE
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define INFO(fmt, args...)  INFO_PRINT("trace: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("trace: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("trace: " fmt, ##args)
+
+NK_DEFINE_PER_CPU(struct nk_trace_buf *, nk_trace_buf);
+
+volatile int nk_trace_enabled = 0;
+
+#define NK_TRACE_FMT(name, fmt) fmt,
+static const char *event_fmt[NK_TRACE_NUM_EVENTS] = {
+    NK_TRACE_EVENTS(NK_TRACE_FMT)
+};
+#undef NK_TRACE_FMT
+
+#define NK_TRACE_NAME(name, fmt) #name,
+static const char *event_name[NK_TRACE_NUM_EVENTS] = {
+    NK_TRACE_EVENTS(NK_TRACE_NAME)
+};
+#undef NK_TRACE_NAME
+
+#define BUF_SIZE (sizeof(struct nk_trace_buf) + NK_TRACE_ENTRIES*sizeof(struct nk_trace_rec))
+
+int
+nk_trace_init (void)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    int i;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        struct nk_trace_buf *b = malloc_specific(BUF_SIZE, i);
+        if (!b) {
+            ERROR("Cannot allocate trace buffer for cpu %d\n", i);
+            return -1;
+        }
+        memset(b, 0, BUF_SIZE);
+        b->cpu = i;
+        *cpu_ptr(sys->cpus[i], nk_trace_buf) = b;
+    }
+
+    nk_trace_enabled = 1;
+
+    INFO("%lu records per cpu, %s when full\n", NK_TRACE_ENTRIES,
+#ifdef NAUT_CONFIG_TRACE_OVERWRITE
+         "overwriting"
+#else
+         "dropping"
+#endif
+        );
+
+    return 0;
+}
+
+void
+nk_trace_deinit (void)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    int i;
+
+    nk_trace_enabled = 0;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        struct nk_trace_buf **b = cpu_ptr(sys->cpus[i], nk_trace_buf);
+        struct nk_trace_buf *old = *b;
+        *b = 0;
+        if (old) {
+            free(old);
+        }
+    }
+}
+
+
+// Copy out the unread records of a buffer, oldest first.  The
+// owning CPU may still be writing, so we validate each record's
+// sequence number before and after the copy.  Returns the number
+// of records copied, and accumulates the number lost.
+static uint64_t
+drain_buf (struct nk_trace_buf *b, struct nk_trace_rec *out, uint64_t *lost)
+{
+    uint64_t head = *(volatile uint64_t *)&b->head;
+    uint64_t tail = b->tail;
+    uint64_t n = 0;
+    uint64_t s;
+
+    if (head - tail > NK_TRACE_ENTRIES) {
+        // overwritten before we got to them
+        *lost += head - tail - NK_TRACE_ENTRIES;
+        tail = head - NK_TRACE_ENTRIES;
+    }
+
+    for (s = tail; s < head; s++) {
+        volatile struct nk_trace_rec *r = &b->recs[s & NK_TRACE_MASK];
+
+        if (r->seq != s + 1) {
+#ifdef NAUT_CONFIG_TRACE_OVERWRITE
+            (*lost)++;
+            continue;
+#else
+            // still being written - pick it up next time
+            break;
+#endif
+        }
+
+        out[n] = *(struct nk_trace_rec *)r;
+
+        __asm__ __volatile__ ("" : : : "memory");
+
+        if (r->seq != s + 1) {
+            (*lost)++;
+            continue;
+        }
+
+        n++;
+    }
+
+    // releases the slots to the writer when we are dropping
+    b->tail = s;
+
+    return n;
+}
+
+
+static void
+dump_trace (int discard)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    struct apic_dev *apic = per_cpu_get(apic);
+    int ncpus = sys->num_cpus;
+    struct nk_trace_rec *recs[ncpus];
+    uint64_t count[ncpus];
+    uint64_t pos[ncpus];
+    uint64_t lost = 0, total = 0;
+    uint64_t first_tsc = -1ULL;
+    int was_enabled = nk_trace_enabled;
+    int i;
+
+    // we do not want to trace ourselves
+    nk_trace_enabled = 0;
+
+    for (i = 0; i < ncpus; i++) {
+        struct nk_trace_buf *b = *cpu_ptr(sys->cpus[i], nk_trace_buf);
+        recs[i] = 0;
+        count[i] = 0;
+        pos[i] = 0;
+        if (!b) {
+            continue;
+        }
+        recs[i] = malloc(NK_TRACE_ENTRIES * sizeof(struct nk_trace_rec));
+        if (!recs[i]) {
+            ERROR("Cannot allocate drain space for cpu %d\n", i);
+            continue;
+        }
+        count[i] = drain_buf(b, recs[i], &lost);
+        total += count[i];
+        if (count[i] && recs[i][0].tsc < first_tsc) {
+            first_tsc = recs[i][0].tsc;
+        }
+    }
+
+    if (!discard) {
+        // merge the per-cpu streams by TSC
+        while (1) {
+            int best = -1;
+            for (i = 0; i < ncpus; i++) {
+                if (pos[i] < count[i] &&
+                    (best < 0 || recs[i][pos[i]].tsc < recs[best][pos[best]].tsc)) {
+                    best = i;
+                }
+            }
+            if (best < 0) {
+                break;
+            }
+
+            struct nk_trace_rec *r = &recs[best][pos[best]++];
+            uint64_t delta = r->tsc - first_tsc;
+
+            nk_vc_printf("%3u %12lu.%03lu us %-14s ", r->cpu,
+                         apic_tsc_to_ns(apic, delta) / 1000,
+                         apic_tsc_to_ns(apic, delta) % 1000,
+                         r->event < NK_TRACE_NUM_EVENTS ? event_name[r->event] : "UNKNOWN");
+            if (r->event < NK_TRACE_NUM_EVENTS) {
+                nk_vc_printf((char *)event_fmt[r->event], r->arg[0], r->arg[1], r->arg[2]);
+            }
+            nk_vc_printf("\n");
+        }
+    }
+
+    for (i = 0; i < ncpus; i++) {
+        if (recs[i]) {
+            free(recs[i]);
+        }
+    }
+
+    nk_vc_printf("%lu records %s, %lu lost to overwrite or in-flight writes\n",
+                 total, discard ? "discarded" : "shown", lost);
+
+    nk_trace_enabled = was_enabled;
+}
+
+
+static void
+dump_stats (void)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    int i;
+
+    nk_vc_printf("tracing is %s, %lu records per cpu\n",
+                 nk_trace_enabled ? "on" : "off", NK_TRACE_ENTRIES);
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        struct nk_trace_buf *b = *cpu_ptr(sys->cpus[i], nk_trace_buf);
+        if (b) {
+            nk_vc_printf("cpu %3d: %lu written, %lu unread, %lu dropped\n",
+                         i, b->head, b->head - b->tail, b->dropped);
+        }
+    }
+}
+
+
+static int
+handle_trace (char * buf, void * priv)
+{
+    char what[16];
+
+    if (sscanf(buf, "trace %15s", what) != 1) {
+        dump_trace(0);
+        return 0;
+    }
+
+    if (!strcmp(what, "on")) {
+        nk_trace_enabled = 1;
+    } else if (!strcmp(what, "off")) {
+        nk_trace_enabled = 0;
+    } else if (!strcmp(what, "clear")) {
+        dump_trace(1);
+    } else if (!strcmp(what, "stats")) {
+        dump_stats();
+    } else {
+        nk_vc_printf("unknown trace request '%s'\n", what);
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl trace_impl = {
+    .cmd      = "trace",
+    .help_str = "trace [on|off|clear|stats]",
+    .handler  = handle_trace,
+};
+nk_register_shell_cmd(trace_impl);
@@ -26,6 +26,7 @@
 #include <nautilus/spinlock.h>
 #include <nautilus/netdev.h>
 #include <nautilus/scheduler.h>
+#include <nautilus/shell.h>
 #include <net/collective/ethernet/ethernet_collective.h>
 
 #ifndef NAUT_CONFIG_DEBUG_NET_COLLECTIVE_ETHERNET
@@ -37,35 +38,63 @@
 #define DEBUG(fmt, args...) DEBUG_PRINT("ether_col: " fmt, ##args)
 #define INFO(fmt, args...) INFO_PRINT("ether_col: " fmt, ##args)
 
-// Fast L2 collective communication, currently just barriers and rings
-// Also currently assumes no packet loss
-// Also currently assumes synchrony barrier
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
 
-// This is a work in progress
+// Fast L2 collective communication
+// Currently assumes no packet loss, except that a ring token is regenerated
+// Every node must make the same sequence of collective calls
 
-typedef enum {COLLECTIVE_IDLE=0, COLLECTIVE_BARRIER, COLLECTIVE_RING} mode_t;
-typedef enum {BARRIER_IDLE=0, BARRIER_UP, BARRIER_DOWN} barrier_state_t;
-typedef enum {RING_IDLE=0, RING_RECEIVE_LEFT} ring_state_t;
+// Everything runs over messages between ranks.  A message is split into
+// fragments of at most frag_len bytes, each in its own packet, tagged
+// with the operation's sequence number, the sender's rank, and the step
+// of the operation it belongs to.  Receives stay posted with the agent,
+// and arriving packets are stashed in the collective's inbox, from which
+// an operation takes the fragments it is waiting for in whatever order
+// they come.  Fragments are consumed as they arrive, so large payloads
+// are pipelined: a reduction combines each fragment as it comes in, and
+// a broadcast hands each fragment on to the next ranks before the rest
+// of the message has arrived.
+
+typedef enum {COLLECTIVE_IDLE=0, COLLECTIVE_BARRIER, COLLECTIVE_RING, COLLECTIVE_DATA} mode_t;
 
 // collective message types
 #define COLLECTIVE_RING_TYPE    0x1
 #define COLLECTIVE_BARRIER_TYPE 0x2
+#define COLLECTIVE_DATA_TYPE    0x3
+
+// receives kept posted with the agent
+#define COLLECTIVE_RECV_POSTED  4
+
+// Algorithm selection, by message size in bytes
+#define ALLREDUCE_RING_MIN   NAUT_CONFIG_NET_COLLECTIVE_ETHERNET_ALLREDUCE_RING_MIN
+#define ALLGATHER_RING_MIN   NAUT_CONFIG_NET_COLLECTIVE_ETHERNET_ALLGATHER_RING_MIN
+#define BROADCAST_CHAIN_MIN  NAUT_CONFIG_NET_COLLECTIVE_ETHERNET_BROADCAST_CHAIN_MIN
+
+typedef enum {ALG_AUTO=0, ALG_RECURSIVE_DOUBLING, ALG_RING, ALG_BINOMIAL, ALG_CHAIN} alg_t;
 
+// Follows the subtype and length in every packet.  It is sized so that
+// the payload after it starts 32 bytes into the frame, keeping typed
+// data aligned for the reductions
+typedef struct data_hdr {
+    uint32_t seq;      // operation
+    uint16_t src;      // sending rank
+    uint16_t step;     // stage of the operation
+    uint32_t offset;   // of this fragment in the message
+    uint16_t pad;
+} __packed data_hdr_t;
+
+#define DATA_PAYLOAD_OFFSET (ETHERNET_HEADER_LEN + 4 + sizeof(data_hdr_t))
 
 struct nk_net_ethernet_collective {
     mode_t   current_mode;            // what operation we are handling
-    
-    // for barrier operations
-    barrier_state_t barrier_state;
-    uint32_t curlevel;
-    uint32_t maxlevel;
-    
-    // for ring operations
-    ring_state_t ring_state;
-    int          initiator;
-    void        *token;
-    uint64_t     token_len;
 
+    uint32_t seq;                     // current (or last) operation
+    uint64_t frag_len;                // most message bytes in one packet
+    uint64_t timeout_ns;              // give up on a receive after this, 0 = never
+
+    spinlock_t        inbox_lock;
+    struct list_head  inbox;          // received packets not yet consumed
+    uint64_t          inbox_count;
 
     // the network device to use - this is supplied by an ethernet agent
     // it must support the ethernet agent send/receive packet interface
@@ -100,7 +129,7 @@ static inline void encode_packet(nk_ethernet_packet_t *p, ethernet_mac_addr_t de
 static inline int decode_packet(nk_ethernet_packet_t *p, ethernet_mac_addr_t dest, ethernet_mac_addr_t src, uint16_t basetype, uint16_t subtype, void *data, uint16_t *len)
 {
     uint16_t t;
-    
+
     t = ntohs(p->header.type);
 
     if (t!=basetype) {
@@ -113,7 +142,7 @@ static inline int decode_packet(nk_ethernet_packet_t *p, ethernet_mac_addr_t des
 	return -1;
     }
 
-    
+
     // matching packet, so decode
     memcpy(dest,p->header.dst,6);
     memcpy(src,p->header.src,6);
@@ -123,7 +152,7 @@ static inline int decode_packet(nk_ethernet_packet_t *p, ethernet_mac_addr_t des
     if (t < *len) {
 	*len = t;
     }
-    
+
     memcpy(data, p->data+4, *len);
 
     return 0;
@@ -136,7 +165,7 @@ static inline int decode_packet(nk_ethernet_packet_t *p, ethernet_mac_addr_t des
 static inline int decode_packet_in_place(nk_ethernet_packet_t *p, ethernet_mac_addr_t **dest, ethernet_mac_addr_t **src, uint16_t basetype, uint16_t subtype, void **data, uint16_t *len)
 {
     uint16_t t;
-    
+
     t = ntohs(p->header.type);
 
     if (t!=basetype) {
@@ -158,351 +187,784 @@ static inline int decode_packet_in_place(nk_ethernet_packet_t *p, ethernet_mac_a
     return 0;
 }
 
-#if 0
 
-typedef struct barrier_data {
-    uint8_t  dir;  // 0=UP, 1=DOWN
-    uint32_t level;
-} __packed barrier_data_t;
+//
+// Messages
+//
 
-uint32_t log2_ceil(uint32_t n)
+static void recv_callback(nk_net_dev_status_t status,
+			  nk_ethernet_packet_t *packet,
+			  void *state)
 {
-    return 32-(__builtin_clz(n)+1);
+    struct nk_net_ethernet_collective *col = (struct nk_net_ethernet_collective *)state;
+    uint8_t flags;
+
+    if (status!=NK_NET_DEV_STATUS_SUCCESS) {
+	ERROR("Receive failure\n");
+    } else {
+	flags = spin_lock_irq_save(&col->inbox_lock);
+	list_add_tail(&packet->node,&col->inbox);
+	col->inbox_count++;
+	spin_unlock_irq_restore(&col->inbox_lock,flags);
+    }
+
+    // keep the receive posted
+    if (nk_net_ethernet_agent_device_receive_packet(col->netdev,
+						    0,
+						    NK_DEV_REQ_CALLBACK,
+						    recv_callback,
+						    col)) {
+	ERROR("Cannot repost receive\n");
+    }
 }
 
-uint32_t pow2(uint32_t n)
+// take the packet of the current operation from src at step out of the
+// inbox, if it has arrived, dropping any left over from earlier operations
+static nk_ethernet_packet_t *take_packet(struct nk_net_ethernet_collective *col,
+					 uint16_t subtype, uint32_t src, uint32_t step,
+					 data_hdr_t **hdr, void **data, uint16_t *len)
 {
-    return 2<<n;
+    struct list_head *cur, *temp;
+    struct list_head stale;
+    nk_ethernet_packet_t *p, *found = 0;
+    ethernet_mac_addr_t *d, *s;
+    uint8_t flags;
+    void *body;
+    uint16_t body_len;
+    data_hdr_t *h;
+
+    INIT_LIST_HEAD(&stale);
+
+    flags = spin_lock_irq_save(&col->inbox_lock);
+    list_for_each_safe(cur,temp,&col->inbox) {
+	p = list_entry(cur,nk_ethernet_packet_t,node);
+	if (decode_packet_in_place(p,&d,&s,col->type,subtype,&body,&body_len)) {
+	    // some other kind of message, which may still be wanted
+	    continue;
+	}
+	if (body_len < sizeof(data_hdr_t)) {
+	    list_move(cur,&stale);
+	    col->inbox_count--;
+	    continue;
+	}
+	h = (data_hdr_t *)body;
+	if ((sint32_t)(h->seq - col->seq) < 0) {
+	    list_move(cur,&stale);
+	    col->inbox_count--;
+	    continue;
+	}
+	if (h->seq == col->seq && h->src == src && h->step == step) {
+	    list_del_init(cur);
+	    col->inbox_count--;
+	    found = p;
+	    *hdr = h;
+	    *data = body + sizeof(data_hdr_t);
+	    *len = body_len - sizeof(data_hdr_t);
+	    break;
+	}
+    }
+    spin_unlock_irq_restore(&col->inbox_lock,flags);
+
+    list_for_each_safe(cur,temp,&stale) {
+	list_del_init(cur);
+	DEBUG("Dropping stale packet\n");
+	nk_net_ethernet_release_packet(list_entry(cur,nk_ethernet_packet_t,node));
+    }
+
+    return found;
 }
 
-static void barrier_recv_callback(nk_net_ethernet_dev_status_t status,
-				  nk_ethernet_packet_t *packet,
-				  void *state)
+static void drain_inbox(struct nk_net_ethernet_collective *col)
 {
+    struct list_head *cur, *temp;
 
-    struct nk_net_ethernet_collective *col = (struct nk_net_ethernet_collective *)state;
+    list_for_each_safe(cur,temp,&col->inbox) {
+	list_del_init(cur);
+	nk_net_ethernet_release_packet(list_entry(cur,nk_ethernet_packet_t,node));
+    }
+    col->inbox_count = 0;
+}
 
-    ethernet_mac_addr_t *dest, *src;
-    uint16_t subtype;
-    char buf[5];
-    uint32_t level;
-    uint8_t dir;
-    barrier_data_t *bar;
-    uint16_t barlen;
-    
-    if (status!=NK_NET_ETHERNET_DEV_STATUS_SUCCESS) {
-	ERROR("Receive failure - the barrier may be dead..\n");
-	return;
+static int send_frag(struct nk_net_ethernet_collective *col, uint16_t subtype,
+		     uint32_t dst, uint32_t step, uint64_t offset, void *data, uint64_t len)
+{
+    nk_ethernet_packet_t *p = nk_net_ethernet_alloc_packet(-1);
+    data_hdr_t h = { .seq = col->seq, .src = col->my_node, .step = step, .offset = offset, .pad = 0 };
+    uint16_t body_len = sizeof(h) + len;
+
+    if (!p) {
+	ERROR("Cannot allocate packet\n");
+	return -1;
     }
 
-    if (decode_packet_in_place(packet,
-			       &dest,
-			       &src,
-			       col->type,
-			       COLLECTIVE_BARRIER_TYPE,
-			       &bar,
-			       &barlen)) {
-	DEBUG("Packet does not match current operation\n");
-	return;
+    memcpy(p->header.dst,col->macs[dst],6);
+    memcpy(p->header.src,col->macs[col->my_node],6);
+    p->header.type = htons(col->type);
+    memcpy(p->data,&subtype,2);
+    memcpy(p->data+2,&body_len,2);
+    memcpy(p->data+4,&h,sizeof(h));
+    memcpy(p->raw+DATA_PAYLOAD_OFFSET,data,len);
+    p->len = DATA_PAYLOAD_OFFSET + len;
+
+    if (nk_net_ethernet_agent_device_send_packet(col->netdev,
+						 p,
+						 NK_DEV_REQ_NONBLOCKING,
+						 0, 0)) {
+	ERROR("Cannot launch packet\n");
+	nk_net_ethernet_release_packet(p);
+	return -1;
     }
 
-    if (col->barrier_state == BARRIER_UP) {
-	if (bar->dir!=0) {
-	    DEBUG("Discarding barrier packet for wrong direction...\n");
-	    nk_net_ethernet_release_packet(p);
-	    return;
+    return 0;
+}
+
+// the data is copied out by the time this returns, so the caller can
+// change it while the packets are in flight.  A message always has at
+// least one packet, so an empty message works as a signal
+static int send_msg(struct nk_net_ethernet_collective *col, uint16_t subtype,
+		    uint32_t dst, uint32_t step, void *buf, uint64_t len)
+{
+    uint64_t off = 0;
+    uint64_t n;
+
+    do {
+	n = MIN(len - off, col->frag_len);
+	if (send_frag(col,subtype,dst,step,off,buf+off,n)) {
+	    return -1;
 	}
+	off += n;
+    } while (off < len);
+
+    return 0;
+}
+
+// what to do with each fragment of a message as it arrives
+typedef int (*frag_fn_t)(struct nk_net_ethernet_collective *col, void *state,
+			 uint64_t offset, void *data, uint64_t len);
 
-	if (bar->level != (col->curlevel+1)) {
-	    DEBUG("Discarding barrier packet for wrong level...\n");
+// receive a message of len bytes from src at step, handing each fragment
+// to fn.  Gives up if nothing arrives for timeout_ns (0 = wait forever)
+static int recv_msg(struct nk_net_ethernet_collective *col, uint16_t subtype,
+		    uint32_t src, uint32_t step, uint64_t len,
+		    frag_fn_t fn, void *state, uint64_t timeout_ns)
+{
+    uint64_t got = 0;
+    uint64_t start = nk_sched_get_realtime();
+    nk_ethernet_packet_t *p;
+    data_hdr_t *h;
+    void *data;
+    uint16_t n;
+    int rc;
+
+    do {
+	if (!(p = take_packet(col,subtype,src,step,&h,&data,&n))) {
+	    if (timeout_ns && nk_sched_get_realtime() - start > timeout_ns) {
+		DEBUG("Timed out waiting for rank %u step %u of operation %u\n",src,step,col->seq);
+		return -1;
+	    }
+	    asm volatile ("pause");
+	    continue;
+	}
+	if (h->offset + n > len) {
+	    ERROR("Fragment from rank %u is outside the message\n",src);
 	    nk_net_ethernet_release_packet(p);
-	    return;
+	    return -1;
+	}
+	rc = fn(col,state,h->offset,data,n);
+	nk_net_ethernet_release_packet(p);
+	if (rc) {
+	    return -1;
 	}
+	got += n;
+	start = nk_sched_get_realtime();
+    } while (got < len);
 
-	col->curlevel = bar->level;
+    return 0;
+}
 
-	if (col->curlevel == col->maxlevel) {
-	    // We are at the top of the tree and need to send the first packet down
-	    // we will reuse
-	    bar->dir=1;
-	    bar->
-    
-	subtype!=COLLECTIVE_BARRIER_TYPE) {
-	// failed or not a packet for me, do another receive
-	if (nk_net_ethernet_dev_receive_packet(col->netdev,
-				      col->recv_buf,
-				      col->token_len+PACKET_HEADER_LEN,
-				      NK_DEV_REQ_CALLBACK,
-				      barrier_recv_callback,
-				      col)) {
-	    ERROR("Cannot re-initiate receive\n");
-	    return;
-	}
-	return;
+static int frag_copy(struct nk_net_ethernet_collective *col, void *state,
+		     uint64_t offset, void *data, uint64_t len)
+{
+    memcpy(state+offset,data,len);
+    return 0;
+}
+
+static int begin_op(struct nk_net_ethernet_collective *col, mode_t mode)
+{
+    if (!__sync_bool_compare_and_swap(&col->current_mode,COLLECTIVE_IDLE,mode)) {
+	DEBUG("Collective operation already in progress\n");
+	return -1;
+    }
+    col->seq++;
+    return 0;
+}
+
+static int end_op(struct nk_net_ethernet_collective *col, int rc)
+{
+    col->current_mode = COLLECTIVE_IDLE;
+    return rc;
+}
+
+#define LEFT(col)  (((col)->my_node + (col)->num_nodes - 1) % (col)->num_nodes)
+#define RIGHT(col) (((col)->my_node + 1) % (col)->num_nodes)
+
+
+//
+// Typed reductions
+//
+
+static uint64_t type_size(nk_net_ethernet_collective_type_t type)
+{
+    switch (type) {
+    case NK_NET_ETHERNET_COLLECTIVE_INT32:
+    case NK_NET_ETHERNET_COLLECTIVE_UINT32:
+	return 4;
+    case NK_NET_ETHERNET_COLLECTIVE_INT64:
+    case NK_NET_ETHERNET_COLLECTIVE_UINT64:
+    case NK_NET_ETHERNET_COLLECTIVE_DOUBLE:
+	return 8;
+    default:
+	return 0;
     }
+}
 
-    level = *(uint32_t*)buf;
-    dir = (uint8_t) buf[4];
-    
-    if ((level != col->curlevel) ||
-	(dir==0 && col->barrier_state!=BARRIER_UP) ||
-	(dir!=0 && col->barrier_state!=BARRIER_DOWN)) {
-	// uh oh
-	    ERROR("Received level %u %s message, but we are currently at level %u %s\n",
-		  level, dir==0 ? "UP" : "DOWN",
-		  col->curlevel,
-		  col->barrier_state==BARRIER_UP ? "UP" : "DOWN");
-	    return;
-    }
-
-    if (col->barrier_state==BARRIER_UP) {
-	if ((0x1UL << level) >= col->num_nodes
-	
-	if ((col->my_node >> (level+1))&0x1) {
-	    // we are a sender in this round
-	
-    
-		  
-    if (!col->initiator) {
-	// if we aren't the source of the token, we need to send it to our neighbor
-	int len = encode_packet(col->send_buf,
-				col->macs[(col->my_node + 1) % col->num_nodes],
-				col->macs[col->my_node],
-				COLLECTIVE_RING_TYPE,
-				col->token,
-				col->token_len);
-	if (nk_net_ethernet_dev_send_packet(col->netdev,
-				   col->send_buf,
-				   len,
-				   NK_DEV_REQ_NONBLOCKING,
-				   0, 0)) {
-	    ERROR("Cannot launch packet mid ring\n");
-	    return;
-	}
+static int check_type_op(nk_net_ethernet_collective_type_t type, nk_net_ethernet_collective_op_t op)
+{
+    if (!type_size(type)) {
+	ERROR("Unknown type %d\n",type);
+	return -1;
+    }
+    if (op > NK_NET_ETHERNET_COLLECTIVE_BOR ||
+	(type==NK_NET_ETHERNET_COLLECTIVE_DOUBLE && op >= NK_NET_ETHERNET_COLLECTIVE_BAND)) {
+	ERROR("Operation %d is not possible on type %d\n",op,type);
+	return -1;
     }
+    return 0;
+}
 
-    // now we are done
+#define COMBINE_LOOP(T,expr) { T *x = (T *)acc; T *y = (T *)in; for (i=0;i<n;i++) { x[i] = (expr); } }
 
-    col->ring_state = RING_IDLE;
-    col->current_mode = COLLECTIVE_IDLE;
+#define COMBINE_ARITH(T)						\
+    switch (op) {							\
+    case NK_NET_ETHERNET_COLLECTIVE_SUM: COMBINE_LOOP(T, x[i] + y[i]); break; \
+    case NK_NET_ETHERNET_COLLECTIVE_MIN: COMBINE_LOOP(T, x[i] < y[i] ? x[i] : y[i]); break; \
+    case NK_NET_ETHERNET_COLLECTIVE_MAX: COMBINE_LOOP(T, x[i] > y[i] ? x[i] : y[i]); break; \
+    default: break;							\
+    }
+
+#define COMBINE_INT(T)							\
+    switch (op) {							\
+    case NK_NET_ETHERNET_COLLECTIVE_BAND: COMBINE_LOOP(T, x[i] & y[i]); break; \
+    case NK_NET_ETHERNET_COLLECTIVE_BOR: COMBINE_LOOP(T, x[i] | y[i]); break; \
+    default: COMBINE_ARITH(T); break;					\
+    }
+
+// acc[i] = acc[i] op in[i] for n elements
+static void combine(void *acc, void *in, uint64_t n,
+		    nk_net_ethernet_collective_type_t type,
+		    nk_net_ethernet_collective_op_t op)
+{
+    uint64_t i;
+
+    switch (type) {
+    case NK_NET_ETHERNET_COLLECTIVE_INT32:  COMBINE_INT(sint32_t); break;
+    case NK_NET_ETHERNET_COLLECTIVE_UINT32: COMBINE_INT(uint32_t); break;
+    case NK_NET_ETHERNET_COLLECTIVE_INT64:  COMBINE_INT(sint64_t); break;
+    case NK_NET_ETHERNET_COLLECTIVE_UINT64: COMBINE_INT(uint64_t); break;
+    case NK_NET_ETHERNET_COLLECTIVE_DOUBLE: COMBINE_ARITH(double); break;
+    }
 }
 
+struct combine_state {
+    void *base;
+    nk_net_ethernet_collective_type_t type;
+    nk_net_ethernet_collective_op_t   op;
+};
+
+static int frag_combine(struct nk_net_ethernet_collective *col, void *state,
+			uint64_t offset, void *data, uint64_t len)
+{
+    struct combine_state *c = (struct combine_state *)state;
+    uint64_t size = type_size(c->type);
+
+    if ((offset | len) % size) {
+	ERROR("Fragment is not a whole number of elements\n");
+	return -1;
+    }
+
+    combine(c->base+offset,data,len/size,c->type,c->op);
 
-// The actual barrier can be executed as many times as desired
+    return 0;
+}
+
+
+//
+// Barrier
+//
+
+// dissemination: in round k everyone signals the rank 2^k to its right
+// and waits for the rank 2^k to its left, so after ceil(log2 n) rounds
+// everyone has heard, indirectly, from everyone
 int nk_net_ethernet_collective_barrier(struct nk_net_ethernet_collective *col)
 {
+    uint32_t n = col->num_nodes;
+    uint32_t r = col->my_node;
+    uint32_t d, k;
+    int rc = 0;
 
-    if (col->num_nodes == 1) {
+    if (n == 1) {
 	return 0;
     }
 
-    if (!__sync_bool_compare_and_swap(&col->current_mode,COLLECTIVE_IDLE,COLLECTIVE_BARRIER)) {
-	DEBUG("Collective operation already in progress\n");
+    if (begin_op(col,COLLECTIVE_BARRIER)) {
 	return -1;
     }
 
-    
+    for (d=1, k=0; d<n && !rc; d<<=1, k++) {
+	rc = send_msg(col,COLLECTIVE_BARRIER_TYPE,(r+d)%n,k,0,0) ||
+	    recv_msg(col,COLLECTIVE_BARRIER_TYPE,(r+n-d)%n,k,0,frag_copy,0,col->timeout_ns);
+    }
 
-    col->curlevel = 0;  // leaves
-    col->maxlevel = log2_ceil(col->num_nodes); 
-    col->barrier_state = BARRIER_UP;
-    
-    if (!(col->my_node % pow2(col->curlevel+1))) {
-	// even nodes receive (from right odd node)
-	col->curlevel = 1;
-	if (nk_net_ethernet_agent_device_receive_packet(col->netdev,
-							0,
-							NK_DEV_REQ_CALLBACK,
-							barrier_recv_callback,
-							col)) {
-	    ERROR("Cannot initiate receive\n");
-	    return -1;
+    return end_op(col,rc ? -1 : 0);
+}
+
+
+//
+// Ring
+//
+
+#define REGEN_DELAY_NS 10000000
+
+// circulate a token among the nodes in the barrier
+// for two nodes, this is a ping-pong
+int nk_net_ethernet_collective_ring(struct nk_net_ethernet_collective *col, void *token, uint64_t token_len, int initiate)
+{
+    int rc = -1;
+
+    if (token_len>NET_ETHERNET_COLLECTIVE_MAX_TOKEN_LEN) {
+	DEBUG("token length unsupported\n");
+	return -1;
+    }
+
+    if (col->num_nodes == 1) {
+	return 0;
+    }
+
+    if (begin_op(col,COLLECTIVE_RING)) {
+	return -1;
+    }
+
+    if (initiate) {
+	uint64_t start = nk_sched_get_realtime();
+	// relaunch the token if we have been waiting too long for it
+	// to come back around.  Extra copies are dropped as stale.  This
+	// also makes the ring a way to wait for every node to show up
+	while (rc) {
+	    if (send_msg(col,COLLECTIVE_RING_TYPE,RIGHT(col),0,token,token_len)) {
+		DEBUG("Initiator cannot launch packet\n");
+		break;
+	    }
+	    rc = recv_msg(col,COLLECTIVE_RING_TYPE,LEFT(col),0,token_len,frag_copy,token,REGEN_DELAY_NS);
+	    if (rc && col->timeout_ns && nk_sched_get_realtime() - start > col->timeout_ns) {
+		DEBUG("Token did not come back\n");
+		break;
+	    }
 	}
     } else {
-	// odd nodes
-	// will send to left shark
-	nk_ethernet_packet_t *p = nk_net_ethernet_alloc_packet(-1);
+	rc = recv_msg(col,COLLECTIVE_RING_TYPE,LEFT(col),0,token_len,frag_copy,token,col->timeout_ns) ||
+	    send_msg(col,COLLECTIVE_RING_TYPE,RIGHT(col),0,token,token_len);
+    }
+
+    return end_op(col,rc ? -1 : 0);
+}
+
+
+//
+// Broadcast
+//
 
-	if (!p) {
-	    ERROR("Cannot allocate packet\n");
+#define MAX_CHILDREN 32
+
+struct forward_state {
+    void     *base;
+    uint32_t  num_children;
+    uint32_t  children[MAX_CHILDREN];
+};
+
+// keep the fragment and hand it on right away
+static int frag_forward(struct nk_net_ethernet_collective *col, void *state,
+			uint64_t offset, void *data, uint64_t len)
+{
+    struct forward_state *f = (struct forward_state *)state;
+    uint32_t i;
+
+    memcpy(f->base+offset,data,len);
+
+    for (i=0;i<f->num_children;i++) {
+	if (send_frag(col,COLLECTIVE_DATA_TYPE,f->children[i],0,offset,data,len)) {
 	    return -1;
 	}
+    }
 
-	barrier_data_t b = {.dir=0, .level=col->curlevel+1 };
-	
-	encode_packet(p,
-		      col->macs[col->my_node - pow2(col->curlevel)],
-		      col->macs[col->my_node],
-		      col->type,
-		      COLLECTIVE_BARRIER_TYPE,
-		      &b,
-		      sizeof(b));
-	
-	if (nk_net_ethernet_agent_device_send_packet(col->netdev,
-						     p,
-						     NK_DEV_REQ_NONBLOCKING,
-						     0, 0)) {
-	    DEBUG("Initiator cannot launch packet\n");
-	    return -1;
+    return 0;
+}
+
+// A binomial tree (ceil(log2 n) steps) or, for large payloads, a chain
+// (n-1 steps), which is better once the payload is many fragments long
+// since every node then sends it only once.  Either way the ranks
+// below the root forward each fragment as it arrives
+static int broadcast(struct nk_net_ethernet_collective *col, void *buf, uint64_t len, uint32_t root, alg_t alg)
+{
+    uint32_t n = col->num_nodes;
+    uint32_t vr = (col->my_node + n - root) % n;
+    uint32_t parent = -1;
+    uint32_t mask;
+    struct forward_state f = { .base = buf, .num_children = 0 };
+    uint32_t i;
+
+    if (alg == ALG_AUTO) {
+	alg = (n > 2 && len >= BROADCAST_CHAIN_MIN) ? ALG_CHAIN : ALG_BINOMIAL;
+    }
+
+    // parent and children, as ranks relative to the root
+    if (alg == ALG_CHAIN) {
+	if (vr) {
+	    parent = vr - 1;
+	}
+	if (vr + 1 < n) {
+	    f.children[f.num_children++] = vr + 1;
+	}
+    } else {
+	for (mask=1; mask<n; mask<<=1) {
+	    if (vr & mask) {
+		parent = vr - mask;
+		break;
+	    }
+	}
+	// the biggest subtree goes first
+	for (mask>>=1; mask>0; mask>>=1) {
+	    if (vr + mask < n) {
+		f.children[f.num_children++] = vr + mask;
+	    }
 	}
     }
 
-    uint64_t start = nk_sched_get_realtime();
-    
-    // wait for completion
-    while (__sync_fetch_and_or(&col->current_mode,0)==COLLECTIVE_BARRIER) {
-	// barriers do not regenerate...
+    for (i=0;i<f.num_children;i++) {
+	f.children[i] = (f.children[i] + root) % n;
+    }
+
+    if (parent != -1) {
+	return recv_msg(col,COLLECTIVE_DATA_TYPE,(parent + root) % n,0,len,frag_forward,&f,col->timeout_ns);
+    }
+
+    for (i=0;i<f.num_children;i++) {
+	if (send_msg(col,COLLECTIVE_DATA_TYPE,f.children[i],0,buf,len)) {
+	    return -1;
+	}
     }
 
     return 0;
 }
 
-#else
-	    
-int nk_net_ethernet_collective_barrier(struct nk_net_ethernet_collective *col)
+int nk_net_ethernet_collective_broadcast(struct nk_net_ethernet_collective *col, void *buf, uint64_t len, uint32_t root)
 {
-    return -1;
+    if (root >= col->num_nodes) {
+	ERROR("Root %u is not in the collective\n",root);
+	return -1;
+    }
+
+    if (col->num_nodes == 1) {
+	return 0;
+    }
+
+    if (begin_op(col,COLLECTIVE_DATA)) {
+	return -1;
+    }
+
+    return end_op(col,broadcast(col,buf,len,root,ALG_AUTO));
 }
 
-#endif
-	    
-// Data in a ring packet:   token
+
+//
+// Reduce
 //
 
-static void ring_recv_callback(nk_net_dev_status_t status,
-			       nk_ethernet_packet_t *packet,
-			       void *state)
+// binomial tree, combining each fragment from a child as it arrives
+static int reduce(struct nk_net_ethernet_collective *col, void *buf, uint64_t count,
+		  nk_net_ethernet_collective_type_t type,
+		  nk_net_ethernet_collective_op_t op, uint32_t root)
 {
-    struct nk_net_ethernet_collective *col = (struct nk_net_ethernet_collective *)state;
+    uint32_t n = col->num_nodes;
+    uint32_t vr = (col->my_node + n - root) % n;
+    uint64_t len = count * type_size(type);
+    struct combine_state c = { .base = buf, .type = type, .op = op };
+    uint32_t mask;
+
+    for (mask=1; mask<n; mask<<=1) {
+	if (vr & mask) {
+	    return send_msg(col,COLLECTIVE_DATA_TYPE,(vr - mask + root) % n,0,buf,len);
+	}
+	if (vr + mask < n &&
+	    recv_msg(col,COLLECTIVE_DATA_TYPE,(vr + mask + root) % n,0,len,frag_combine,&c,col->timeout_ns)) {
+	    return -1;
+	}
+    }
 
-    ethernet_mac_addr_t *dest, *src;
-    uint16_t subtype;
-    void *token;
-    uint16_t token_len;
+    return 0;
+}
 
-    
-    if (status!=NK_NET_DEV_STATUS_SUCCESS) {
-	ERROR("Receive failure - the token will have to be regenerated\n");
-	return;
+int nk_net_ethernet_collective_reduce(struct nk_net_ethernet_collective *col,
+				      void *send, void *recv, uint64_t count,
+				      nk_net_ethernet_collective_type_t type,
+				      nk_net_ethernet_collective_op_t op,
+				      uint32_t root)
+{
+    if (check_type_op(type,op)) {
+	return -1;
     }
 
-    if (decode_packet_in_place(packet,
-			       &dest,
-			       &src,
-			       col->type,
-			       COLLECTIVE_RING_TYPE,
-			       &token,
-			       &token_len)) {
-	DEBUG("Packet does not match current operation\n");
-	return;
+    if (root >= col->num_nodes) {
+	ERROR("Root %u is not in the collective\n",root);
+	return -1;
     }
 
-    DEBUG("Received token packet\n");
+    if (send != recv) {
+	memcpy(recv,send,count*type_size(type));
+    }
 
-    if (token_len<col->token_len) {
-	token_len = col->token_len;
+    if (col->num_nodes == 1) {
+	return 0;
+    }
+
+    if (begin_op(col,COLLECTIVE_DATA)) {
+	return -1;
     }
-    
-    memcpy(col->token,token,token_len);
-    
-    if (!col->initiator) {
-	// we will send the same packet to our neighbor;
 
-	memcpy(packet->header.dst, col->macs[(col->my_node + 1) % col->num_nodes], 6);
+    return end_op(col,reduce(col,recv,count,type,op,root));
+}
 
-	memcpy(packet->header.src,col->macs[col->my_node], 6);
 
-	// all else is the same
+//
+// Allreduce
+//
+
+// Recursive doubling, ceil(log2 n) exchanges of the whole payload.  If
+// n is not a power of two, the first 2*(n-p) ranks (p being the largest
+// power of two below n) pair up beforehand, the even one handing its
+// data to the odd one, which stands in for both and hands back the
+// result at the end
+#define RD_UNFOLD_STEP 0xffff
 
-	if (nk_net_ethernet_agent_device_send_packet(col->netdev,
-						     packet,
-						     NK_DEV_REQ_NONBLOCKING,
-						     0, 0)) {
-	    ERROR("Cannot launch packet mid ring\n");
-	    return;
+static int allreduce_rd(struct nk_net_ethernet_collective *col, void *buf, uint64_t count,
+			nk_net_ethernet_collective_type_t type,
+			nk_net_ethernet_collective_op_t op)
+{
+    uint32_t n = col->num_nodes;
+    uint32_t r = col->my_node;
+    uint64_t len = count * type_size(type);
+    struct combine_state c = { .base = buf, .type = type, .op = op };
+    uint32_t p2, rem, mask, k, pv, partner;
+    int vr;
+
+    for (p2=1; p2*2<=n; p2*=2) {
+    }
+    rem = n - p2;
+
+    if (r < 2*rem) {
+	if (!(r & 1)) {
+	    if (send_msg(col,COLLECTIVE_DATA_TYPE,r+1,0,buf,len)) {
+		return -1;
+	    }
+	    vr = -1;
+	} else {
+	    if (recv_msg(col,COLLECTIVE_DATA_TYPE,r-1,0,len,frag_combine,&c,col->timeout_ns)) {
+		return -1;
+	    }
+	    vr = r / 2;
 	}
+    } else {
+	vr = r - rem;
     }
 
-    // now we are done
+    if (vr >= 0) {
+	for (mask=1, k=1; mask<p2; mask<<=1, k++) {
+	    pv = vr ^ mask;
+	    partner = pv < rem ? pv*2 + 1 : pv + rem;
+	    if (send_msg(col,COLLECTIVE_DATA_TYPE,partner,k,buf,len) ||
+		recv_msg(col,COLLECTIVE_DATA_TYPE,partner,k,len,frag_combine,&c,col->timeout_ns)) {
+		return -1;
+	    }
+	}
+    }
 
-    col->ring_state = RING_IDLE;
-    col->current_mode = COLLECTIVE_IDLE;
+    if (r < 2*rem) {
+	if (r & 1) {
+	    return send_msg(col,COLLECTIVE_DATA_TYPE,r-1,RD_UNFOLD_STEP,buf,len);
+	} else {
+	    return recv_msg(col,COLLECTIVE_DATA_TYPE,r+1,RD_UNFOLD_STEP,len,frag_copy,buf,col->timeout_ns);
+	}
+    }
+
+    return 0;
 }
 
+// start of chunk i of count elements split n ways, in bytes
+#define CHUNK(i) (((count*(i))/n)*size)
 
-#define REGEN_DELAY_NS 10000000
-// circulate a token among the nodes in the barrier
-// for two nodes, this is a ping-pong
-int nk_net_ethernet_collective_ring(struct nk_net_ethernet_collective *col, void *token, uint64_t token_len, int initiate)
+// Ring: a reduce-scatter, after which rank r has the result for chunk
+// r+1, then an allgather of the chunks.  2(n-1) steps, but each rank
+// only sends 2(n-1)/n of the payload, so this wins for large payloads
+static int allreduce_ring(struct nk_net_ethernet_collective *col, void *buf, uint64_t count,
+			  nk_net_ethernet_collective_type_t type,
+			  nk_net_ethernet_collective_op_t op)
 {
-    if (token_len>NET_ETHERNET_COLLECTIVE_MAX_TOKEN_LEN) {
-	DEBUG("token length unsupported\n");
-	return -1;
+    uint32_t n = col->num_nodes;
+    uint32_t r = col->my_node;
+    uint64_t size = type_size(type);
+    struct combine_state c = { .type = type, .op = op };
+    uint32_t s, sc, rc;
+
+    for (s=0; s<n-1; s++) {
+	sc = (r + n - s) % n;
+	rc = (r + 2*n - s - 1) % n;
+	c.base = buf + CHUNK(rc);
+	if (send_msg(col,COLLECTIVE_DATA_TYPE,RIGHT(col),s,buf+CHUNK(sc),CHUNK(sc+1)-CHUNK(sc)) ||
+	    recv_msg(col,COLLECTIVE_DATA_TYPE,LEFT(col),s,CHUNK(rc+1)-CHUNK(rc),frag_combine,&c,col->timeout_ns)) {
+	    return -1;
+	}
     }
 
-    if (col->num_nodes == 1) {
-	return 0;
+    for (s=0; s<n-1; s++) {
+	sc = (r + 1 + n - s) % n;
+	rc = (r + n - s) % n;
+	if (send_msg(col,COLLECTIVE_DATA_TYPE,RIGHT(col),n+s,buf+CHUNK(sc),CHUNK(sc+1)-CHUNK(sc)) ||
+	    recv_msg(col,COLLECTIVE_DATA_TYPE,LEFT(col),n+s,CHUNK(rc+1)-CHUNK(rc),frag_copy,buf+CHUNK(rc),col->timeout_ns)) {
+	    return -1;
+	}
     }
 
-    if (!__sync_bool_compare_and_swap(&col->current_mode,COLLECTIVE_IDLE,COLLECTIVE_RING)) {
-	DEBUG("Collective operation already in progress\n");
+    return 0;
+}
+
+static int allreduce(struct nk_net_ethernet_collective *col, void *buf, uint64_t count,
+		     nk_net_ethernet_collective_type_t type,
+		     nk_net_ethernet_collective_op_t op, alg_t alg)
+{
+    if (alg == ALG_AUTO) {
+	alg = (col->num_nodes > 2 && count >= col->num_nodes &&
+	       count * type_size(type) >= ALLREDUCE_RING_MIN) ? ALG_RING : ALG_RECURSIVE_DOUBLING;
+    }
+
+    if (alg == ALG_RING) {
+	return allreduce_ring(col,buf,count,type,op);
+    } else {
+	return allreduce_rd(col,buf,count,type,op);
+    }
+}
+
+int nk_net_ethernet_collective_allreduce(struct nk_net_ethernet_collective *col,
+					 void *send, void *recv, uint64_t count,
+					 nk_net_ethernet_collective_type_t type,
+					 nk_net_ethernet_collective_op_t op)
+{
+    if (check_type_op(type,op)) {
 	return -1;
     }
 
-    col->initiator = initiate;
-    col->token = token;
-    col->token_len = token_len;
+    if (send != recv) {
+	memcpy(recv,send,count*type_size(type));
+    }
 
+    if (col->num_nodes == 1) {
+	return 0;
+    }
 
-    col->ring_state = RING_RECEIVE_LEFT;
-    
-    // everyone posts receive for left
-    if (nk_net_ethernet_agent_device_receive_packet(col->netdev,
-						    0,
-						    NK_DEV_REQ_CALLBACK,
-						    ring_recv_callback,
-						    col)) {
-	ERROR("Cannot initiate receive\n");
+    if (begin_op(col,COLLECTIVE_DATA)) {
 	return -1;
     }
 
- do_initiate:
-    // initiator also launches the first packet
-    if (initiate) {
-	nk_ethernet_packet_t *p = nk_net_ethernet_alloc_packet(-1);
+    return end_op(col,allreduce(col,recv,count,type,op,ALG_AUTO));
+}
+
+
+//
+// Allgather
+//
 
-	if (!p) {
-	    ERROR("Cannot allocate packet\n");
+// Recursive doubling, for power of two n: in step k everyone swaps the
+// 2^k blocks it has with the rank 2^k away
+static int allgather_rd(struct nk_net_ethernet_collective *col, void *buf, uint64_t len)
+{
+    uint32_t n = col->num_nodes;
+    uint32_t r = col->my_node;
+    uint32_t mask, k, partner;
+
+    for (mask=1, k=0; mask<n; mask<<=1, k++) {
+	partner = r ^ mask;
+	if (send_msg(col,COLLECTIVE_DATA_TYPE,partner,k,buf+(r & ~(mask-1))*len,mask*len) ||
+	    recv_msg(col,COLLECTIVE_DATA_TYPE,partner,k,mask*len,frag_copy,buf+(partner & ~(mask-1))*len,col->timeout_ns)) {
 	    return -1;
 	}
-	
-	encode_packet(p,
-		      col->macs[(col->my_node + 1) % col->num_nodes],
-		      col->macs[col->my_node],
-		      col->type,
-		      COLLECTIVE_RING_TYPE,
-		      token,
-		      token_len);
-	
-	if (nk_net_ethernet_agent_device_send_packet(col->netdev,
-						     p,
-						     NK_DEV_REQ_NONBLOCKING,
-						     0, 0)) {
-	    DEBUG("Initiator cannot launch packet\n");
+    }
+
+    return 0;
+}
+
+// Ring: in step s everyone hands the block it got in step s-1 to the right
+static int allgather_ring(struct nk_net_ethernet_collective *col, void *buf, uint64_t len)
+{
+    uint32_t n = col->num_nodes;
+    uint32_t r = col->my_node;
+    uint32_t s, sb, rb;
+
+    for (s=0; s<n-1; s++) {
+	sb = (r + n - s) % n;
+	rb = (r + 2*n - s - 1) % n;
+	if (send_msg(col,COLLECTIVE_DATA_TYPE,RIGHT(col),s,buf+sb*len,len) ||
+	    recv_msg(col,COLLECTIVE_DATA_TYPE,LEFT(col),s,len,frag_copy,buf+rb*len,col->timeout_ns)) {
 	    return -1;
 	}
     }
 
-    uint64_t start = nk_sched_get_realtime();
-    
-    // wait for completion
-    while (__sync_fetch_and_or(&col->current_mode,0)==COLLECTIVE_RING) {
-	if ((nk_sched_get_realtime()-start) > REGEN_DELAY_NS) {
-	    // relaunch the packet if we have been waiting too long
-	    goto do_initiate;
-	}
+    return 0;
+}
+
+static int allgather(struct nk_net_ethernet_collective *col, void *buf, uint64_t len, alg_t alg)
+{
+    uint32_t n = col->num_nodes;
+
+    if (alg == ALG_AUTO) {
+	alg = (!(n & (n-1)) && n*len < ALLGATHER_RING_MIN) ? ALG_RECURSIVE_DOUBLING : ALG_RING;
+    }
+
+    if (alg == ALG_RECURSIVE_DOUBLING && !(n & (n-1))) {
+	return allgather_rd(col,buf,len);
+    } else {
+	return allgather_ring(col,buf,len);
     }
+}
+
+int nk_net_ethernet_collective_allgather(struct nk_net_ethernet_collective *col,
+					 void *send, uint64_t len, void *recv)
+{
+    if (send != recv + col->my_node*len) {
+	memcpy(recv + col->my_node*len,send,len);
+    }
+
+    if (col->num_nodes == 1) {
+	return 0;
+    }
+
+    if (begin_op(col,COLLECTIVE_DATA)) {
+	return -1;
+    }
+
+    return end_op(col,allgather(col,recv,len,ALG_AUTO));
+}
 
+int nk_net_ethernet_collective_set_timeout(struct nk_net_ethernet_collective *col, uint64_t timeout_ns)
+{
+    col->timeout_ns = timeout_ns;
     return 0;
 }
 
@@ -525,6 +987,10 @@ struct nk_net_ethernet_collective *nk_net_ethernet_collective_create(struct nk_n
     
     col->num_nodes = num_nodes;
     col->type = type;
+    // whole 8 byte elements per fragment
+    col->frag_len = (MAX_ETHERNET_PACKET_DATA_LEN - 4 - sizeof(data_hdr_t)) & ~0x7UL;
+    spinlock_init(&col->inbox_lock);
+    INIT_LIST_HEAD(&col->inbox);
 
     if (!(col->netdev = nk_net_ethernet_agent_register_type(agent, type))) {
 	ERROR("Cannot register with agent for type %x\n",type);
@@ -534,6 +1000,7 @@ struct nk_net_ethernet_collective *nk_net_ethernet_collective_create(struct nk_n
 
     if (nk_net_dev_get_characteristics(col->netdev, &col->netchar)) {
 	ERROR("Failed to get network characterstics\n");
+	nk_net_ethernet_agent_unregister(col->netdev);
 	free(col);
 	return 0;
     }
@@ -553,6 +1020,23 @@ struct nk_net_ethernet_collective *nk_net_ethernet_collective_create(struct nk_n
 	return 0;
     }
 
+    for (i=0;i<COLLECTIVE_RECV_POSTED;i++) {
+	if (nk_net_ethernet_agent_device_receive_packet(col->netdev,
+							0,
+							NK_DEV_REQ_CALLBACK,
+							recv_callback,
+							col)) {
+	    ERROR("Cannot post receive\n");
+	    nk_net_ethernet_agent_unregister(col->netdev);
+	    drain_inbox(col);
+	    free(col);
+	    return 0;
+	}
+    }
+
+    DEBUG("Created collective of %u nodes, I am rank %u, %lu bytes per fragment\n",
+	  num_nodes,col->my_node,col->frag_len);
+
     return col;
 }
 	      
@@ -563,13 +1047,228 @@ int nk_net_ethernet_collective_destroy(struct nk_net_ethernet_collective *col)
     if (col->current_mode != COLLECTIVE_IDLE) {
 	return -1;
     } else {
+	// nothing more can arrive once we are unregistered
 	nk_net_ethernet_agent_unregister(col->netdev);
+	drain_inbox(col);
 	free(col);
 	return 0;
     }
 }
 
 
+//
+// Multi-instance test
+//
+// Every instance on the network runs the same command, for example
+//
+//   ethcol net-agent-0 100000 52:54:00:12:34:56 52:54:00:12:34:57
+//
+// using QEMU instances on a common socket netdev.  A packet sent to an
+// instance that has not created the collective yet is lost, so rank 0
+// (the first mac) should be started last.  Each instance checks the
+// results of every operation against what it can compute locally
+//
+
+static int parse_mac(char *s, ethernet_mac_addr_t mac)
+{
+    return sscanf(s,"%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+		  &mac[0],&mac[1],&mac[2],&mac[3],&mac[4],&mac[5])==6 ? 0 : -1;
+}
+
+#define TEST_MAX_NODES 32
+
+#define TEST_TIME(name,ok,expr)						\
+    {									\
+	uint64_t _s = nk_sched_get_realtime();				\
+	int _rc = (expr);						\
+	uint64_t _e = nk_sched_get_realtime();				\
+	nk_vc_printf("%-24s %10lu ns  %s\n", name, _e-_s,		\
+		     _rc ? "FAILED" : (ok) ? "ok" : "WRONG");		\
+	fail |= _rc || !(ok);						\
+    }
+
+static int check_bcast(uint8_t *buf, uint64_t len, uint32_t root)
+{
+    uint64_t i;
+    for (i=0;i<len;i++) {
+	if (buf[i] != (uint8_t)(i*7 + root)) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+static int check_sum(sint64_t *buf, uint64_t count, uint32_t n)
+{
+    uint64_t i;
+    for (i=0;i<count;i++) {
+	// sum over ranks r of (i+r)
+	if (buf[i] != (sint64_t)(n*i + n*(n-1)/2)) {
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+static int check_gather(sint64_t *buf, uint64_t count, uint32_t n)
+{
+    uint64_t i;
+    uint32_t r;
+    for (r=0;r<n;r++) {
+	for (i=0;i<count;i++) {
+	    if (buf[r*count+i] != (sint64_t)(r*1000000 + i)) {
+		return 0;
+	    }
+	}
+    }
+    return 1;
+}
+
+static int test_collective(struct nk_net_ethernet_collective *col, uint64_t bytes)
+{
+    uint32_t n = col->num_nodes;
+    uint32_t r = col->my_node;
+    uint32_t root = n-1;
+    uint64_t count = (bytes + 7) / 8;
+    uint64_t i;
+    int fail = 0;
+
+    uint8_t  *buf = malloc(bytes);
+    sint64_t *vec = malloc(count*8);
+    sint64_t *res = malloc(count*8*n);
+
+    if (!buf || !vec || !res) {
+	nk_vc_printf("cannot allocate test buffers\n");
+	free(buf); free(vec); free(res);
+	return -1;
+    }
+
+#define FILL_BCAST() for (i=0;i<bytes;i++) { buf[i] = r==root ? (uint8_t)(i*7 + root) : 0; }
+#define FILL_VEC()   for (i=0;i<count;i++) { vec[i] = i + r; }
+
+    TEST_TIME("barrier", 1, nk_net_ethernet_collective_barrier(col));
+
+    FILL_BCAST();
+    TEST_TIME("broadcast binomial", check_bcast(buf,bytes,root),
+	      begin_op(col,COLLECTIVE_DATA) || end_op(col,broadcast(col,buf,bytes,root,ALG_BINOMIAL)));
+
+    FILL_BCAST();
+    TEST_TIME("broadcast chain", check_bcast(buf,bytes,root),
+	      begin_op(col,COLLECTIVE_DATA) || end_op(col,broadcast(col,buf,bytes,root,ALG_CHAIN)));
+
+    FILL_BCAST();
+    TEST_TIME("broadcast", check_bcast(buf,bytes,root),
+	      nk_net_ethernet_collective_broadcast(col,buf,bytes,root));
+
+    FILL_VEC();
+    TEST_TIME("allreduce rec doubling", check_sum(vec,count,n),
+	      begin_op(col,COLLECTIVE_DATA) ||
+	      end_op(col,allreduce(col,vec,count,NK_NET_ETHERNET_COLLECTIVE_INT64,
+				   NK_NET_ETHERNET_COLLECTIVE_SUM,ALG_RECURSIVE_DOUBLING)));
+
+    FILL_VEC();
+    TEST_TIME("allreduce ring", check_sum(vec,count,n),
+	      begin_op(col,COLLECTIVE_DATA) ||
+	      end_op(col,allreduce(col,vec,count,NK_NET_ETHERNET_COLLECTIVE_INT64,
+				   NK_NET_ETHERNET_COLLECTIVE_SUM,ALG_RING)));
+
+    FILL_VEC();
+    TEST_TIME("allreduce", check_sum(res,count,n),
+	      nk_net_ethernet_collective_allreduce(col,vec,res,count,
+						   NK_NET_ETHERNET_COLLECTIVE_INT64,
+						   NK_NET_ETHERNET_COLLECTIVE_SUM));
+
+    FILL_VEC();
+    TEST_TIME("reduce", r!=root || check_sum(res,count,n),
+	      nk_net_ethernet_collective_reduce(col,vec,res,count,
+						NK_NET_ETHERNET_COLLECTIVE_INT64,
+						NK_NET_ETHERNET_COLLECTIVE_SUM,root));
+
+    for (i=0;i<count;i++) { vec[i] = r*1000000 + i; }
+    TEST_TIME("allgather", check_gather(res,count,n),
+	      nk_net_ethernet_collective_allgather(col,vec,count*8,res));
+
+    for (i=0;i<count;i++) { vec[i] = r*1000000 + i; }
+    memset(res,0,count*8*n);
+    memcpy(res+r*count,vec,count*8);
+    TEST_TIME("allgather ring", check_gather(res,count,n),
+	      begin_op(col,COLLECTIVE_DATA) || end_op(col,allgather(col,res,count*8,ALG_RING)));
+
+    free(buf); free(vec); free(res);
+
+    return fail;
+}
+
+static int handle_ethcol(char *buf, void *priv)
+{
+    char agentname[32];
+    char macstr[18];
+    ethernet_mac_addr_t macs[TEST_MAX_NODES];
+    struct nk_net_ethernet_agent *agent;
+    struct nk_net_ethernet_collective *col;
+    uint64_t bytes;
+    uint32_t n = 0;
+    int pos, len;
+    int rc;
+
+    if (sscanf(buf,"ethcol %31s %lu%n",agentname,&bytes,&pos)!=2) {
+	nk_vc_printf("ethcol agent bytes mac0 mac1 ...\n");
+	return 0;
+    }
+
+    while (n<TEST_MAX_NODES && sscanf(buf+pos," %17s%n",macstr,&len)==1) {
+	if (parse_mac(macstr,macs[n])) {
+	    nk_vc_printf("bad mac %s\n",macstr);
+	    return 0;
+	}
+	n++;
+	pos += len;
+    }
+
+    if (n<2) {
+	nk_vc_printf("need at least two macs\n");
+	return 0;
+    }
+
+    if (!(agent = nk_net_ethernet_agent_find(agentname))) {
+	nk_vc_printf("no agent %s\n",agentname);
+	return 0;
+    }
+
+    if (!(col = nk_net_ethernet_collective_create(agent,NET_ETHERNET_COLLECTIVE_DEFAULT_TYPE,n,macs))) {
+	nk_vc_printf("cannot create collective\n");
+	return 0;
+    }
+
+    nk_vc_printf("rank %u of %u, %lu bytes, waiting for the others\n",col->my_node,n,bytes);
+
+    // rank 0 keeps relaunching the token until it comes back around
+    if (nk_net_ethernet_collective_ring(col,&bytes,sizeof(bytes),col->my_node==0)) {
+	nk_vc_printf("peers did not show up\n");
+	nk_net_ethernet_collective_destroy(col);
+	return 0;
+    }
+
+    // after that, do not hang forever if a peer goes away
+    nk_net_ethernet_collective_set_timeout(col,10000000000UL);
+
+    rc = test_collective(col,bytes);
+
+    nk_vc_printf("%s\n", rc ? "FAILED" : "passed");
+
+    nk_net_ethernet_collective_destroy(col);
+
+    return 0;
+}
+
+static struct shell_cmd_impl ethcol_impl = {
+    .cmd      = "ethcol",
+    .help_str = "ethcol agent bytes mac0 mac1 ... (run on every instance)",
+    .handler  = handle_ethcol,
+};
+nk_register_shell_cmd(ethcol_impl);
+
+
 int nk_net_ethernet_collective_init()
 {
     INFO("inited\n");
@@ -581,4 +1280,3 @@ void nk_net_ethernet_collective_deinit()
     INFO("deinited\n");
 }
 
-
@@ -25,11 +25,24 @@
 #include <nautilus/list.h>
 #include <nautilus/spinlock.h>
 #include <nautilus/netdev.h>
+#include <nautilus/thread.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/hashtable.h>
+#include <nautilus/shell.h>
 #include <net/ethernet/ethernet_packet.h>
 #include <net/ethernet/ethernet_agent.h>
+#include <test/test.h>
 
-// right now this is a trivial implementation that just has a single pool
-// in the future, this could expand to a per-cpu pool
+// The agent is sharded by cpu.  Operations come from per-cpu caches, and
+// received packets are matched to devices against an immutable table of
+// them, so that neither sends nor receives take a shared lock.
+//
+// With one shard, a received packet is delivered on the cpu that the
+// device completed it on, which spreads the work when the device has a
+// queue per cpu.  With more, packets are hashed by flow to a shard, and
+// handed from the completing cpu to the shard's thread over a ring that
+// only that pair of cpus uses.  A flow always lands on the same shard
+// through the same ring, so its packets stay in order.
 
 
 #define MAX_AGENT_NAME 32
@@ -37,6 +50,9 @@
 // number of received packets that match to store
 #define MAX_DEV_RECEIVE_QUEUE 64
 
+// most free ops each cpu keeps
+#define OP_CACHE_MAX 256
+
 #ifndef NAUT_CONFIG_DEBUG_NET_ETHERNET_AGENT
 #undef DEBUG_PRINT
 #define DEBUG_PRINT(fmt, args...) 
@@ -58,32 +74,135 @@
 #define DEV_LOCK(d) _dev_lock_flags = spin_lock_irq_save(&d->lock)
 #define DEV_UNLOCK(d) spin_unlock_irq_restore(&d->lock, _dev_lock_flags)
 
-#define OP_FREE_LIST_LOCK_CONF uint8_t _op_free_list_lock_flags
-#define OP_FREE_LIST_LOCK() _op_free_list_lock_flags = spin_lock_irq_save(&op_free_list_lock)
-#define OP_FREE_LIST_UNLOCK() spin_unlock_irq_restore(&op_free_list_lock, _op_free_list_lock_flags)
+#define COMPILER_BARRIER() __asm__ __volatile__ ("" : : : "memory")
+
+
+// A single producer, single consumer ring of pointers.  The producer
+// only writes tail and the consumer only writes head, so neither side
+// locks.  Each side is one cpu with interrupts off.
+struct agent_ring {
+    void              **slots;
+    uint32_t          mask;
+    volatile uint32_t head __attribute__((aligned(64)));
+    volatile uint32_t tail __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
 
+static inline int ring_full(struct agent_ring *r)
+{
+    return r->tail - r->head > r->mask;
+}
 
+static inline int ring_push(struct agent_ring *r, void *x)
+{
+    uint32_t t = r->tail;
+
+    if (t - r->head > r->mask) {
+	return -1;
+    }
+    r->slots[t & r->mask] = x;
+    // the slot must be filled before the consumer can see it
+    COMPILER_BARRIER();
+    r->tail = t + 1;
+    return 0;
+}
 
+// the slot at the head stays ours until ring_drop()
+static inline void *ring_peek(struct agent_ring *r)
+{
+    uint32_t h = r->head;
+
+    if (h == r->tail) {
+	return 0;
+    }
+    COMPILER_BARRIER();
+    return r->slots[h & r->mask];
+}
+
+static inline void ring_drop(struct agent_ring *r)
+{
+    COMPILER_BARRIER();
+    r->head++;
+}
+
+static inline void *ring_pop(struct agent_ring *r)
+{
+    void *x = ring_peek(r);
+
+    if (x) {
+	ring_drop(r);
+    }
+    return x;
+}
+
+static int ring_init(struct agent_ring *r, uint32_t size)
+{
+    uint32_t n = 1;
+
+    while (n < size) {
+	n <<= 1;
+    }
+    r->slots = malloc(n * sizeof(void *));
+    if (!r->slots) {
+	return -1;
+    }
+    r->mask = n - 1;
+    r->head = r->tail = 0;
+    return 0;
+}
+
+
+struct nk_net_ethernet_agent_net_dev;
+
+// an immutable snapshot of an agent's devices, replaced whenever one is
+// registered or unregistered
+struct agent_dev_table {
+    int                                   num_devs;
+    struct nk_net_ethernet_agent_net_dev *devs[0];
+};
+
+struct agent_shard {
+    struct nk_net_ethernet_agent *agent;
+    int                          cpu;
+    // packets steered to us, one ring for each cpu that completes receives
+    struct agent_ring           *rings;
+    nk_wait_queue_t             *wq;
+    volatile int                 kick;
+    int                          started;
+    uint64_t                     delivered;
+    uint64_t                     dropped;   // a ring was full
+} __attribute__((aligned(64)));
+
+struct agent_cpu {
+    // odd while this cpu is matching a packet against the device table
+    volatile uint64_t            seq;
+    uint64_t                     received;  // completed by the device here
+    uint64_t                     steered;   // and handed to another shard
+} __attribute__((aligned(64)));
 
 struct nk_net_ethernet_agent {
-    spinlock_t         lock;
+    spinlock_t         lock;  // for registration and state changes
     struct list_head   node; // for agent list
 
-    enum { STOPPED=0, RUNNING} state;
+    volatile enum { STOPPED=0, RUNNING} state;
 
     char               name[MAX_AGENT_NAME];
     struct nk_net_dev *netdev;
 
     struct list_head   dev_list;
+    struct agent_dev_table * volatile devs;
 
     uint64_t           send_queue_size;
     uint64_t           recv_queue_size;
 
-    // number of outstanding sends and receives handed to NIC
-    uint64_t           send_queue_num;
-    uint64_t           recv_queue_num;
+    // receives are kept posted on each of the device's queues
+    uint64_t           num_queues;
+    uint64_t           recv_queue_per_queue;
+    volatile uint64_t  recv_queue_num[NK_NET_DEV_MAX_QUEUES];
 
-    // eventually this will have a hash table for faster match by type
+    int                num_cpus;
+    struct agent_cpu  *cpus;
+    int                num_shards;
+    struct agent_shard *shards;
 };
 
 static spinlock_t       agent_list_lock;
@@ -109,32 +228,50 @@ struct netdev_op
     
 };
 
-static spinlock_t       op_free_list_lock;
-static struct list_head op_free_list;
+// ops are cached per cpu, and used with interrupts off since
+// completions allocate and free them from interrupt context.  An op
+// freed on a different cpu than it was allocated on joins that cpu's
+// cache.
+struct op_cache {
+    struct list_head      free;
+    uint64_t              count;
+} __attribute__((aligned(64)));
+
+static struct op_cache  *op_caches;
 
 
 static inline void free_op(struct netdev_op *o)
 {
-    OP_FREE_LIST_LOCK_CONF;
+    struct op_cache *c;
+    uint8_t flags;
     
-    OP_FREE_LIST_LOCK();
-    list_add(&o->node,&op_free_list);
-    OP_FREE_LIST_UNLOCK();
+    flags = irq_disable_save();
+    c = &op_caches[my_cpu_id()];
+    if (c->count < OP_CACHE_MAX) {
+	list_add(&o->node,&c->free);
+	c->count++;
+	o = 0;
+    }
+    irq_enable_restore(flags);
+    if (o) {
+	free(o);
+    }
 }
 
 static inline struct netdev_op *alloc_op()
 {
-    OP_FREE_LIST_LOCK_CONF;
-    struct list_head *n;
+    struct op_cache *c;
     struct netdev_op *o = 0;
+    uint8_t flags;
     
-    OP_FREE_LIST_LOCK();
-    if (!list_empty(&op_free_list)) {
-	n = op_free_list.next;
-	list_del_init(n);
-	o = list_entry(n,struct netdev_op,node);
+    flags = irq_disable_save();
+    c = &op_caches[my_cpu_id()];
+    if (!list_empty(&c->free)) {
+	o = list_first_entry(&c->free,struct netdev_op,node);
+	list_del_init(&o->node);
+	c->count--;
     }
-    OP_FREE_LIST_UNLOCK();
+    irq_enable_restore(flags);
     if (!o) {
 	o = (struct netdev_op *) malloc(sizeof(*o));
 	if (o) {
@@ -167,9 +304,59 @@ struct nk_net_ethernet_agent_net_dev {
     void                        *filter_state;
 };
 
+static void shard_thread(void *in, void **out);
+
+static int start_shard(struct agent_shard *s)
+{
+    int i;
+
+    if (s->started) {
+	return 0;
+    }
+
+    s->rings = malloc(s->agent->num_cpus * sizeof(struct agent_ring));
+    if (!s->rings) {
+	ERROR("Cannot allocate rings for shard %d of %s\n", s->cpu, s->agent->name);
+	return -1;
+    }
+    memset(s->rings, 0, s->agent->num_cpus * sizeof(struct agent_ring));
+    for (i = 0; i < s->agent->num_cpus; i++) {
+	if (ring_init(&s->rings[i], NAUT_CONFIG_NET_ETHERNET_AGENT_RING_SIZE)) {
+	    ERROR("Cannot allocate rings for shard %d of %s\n", s->cpu, s->agent->name);
+	    goto out_bad;
+	}
+    }
+
+    s->wq = nk_wait_queue_create(0);
+    if (!s->wq) {
+	ERROR("Cannot allocate wait queue for shard %d of %s\n", s->cpu, s->agent->name);
+	goto out_bad;
+    }
+
+    if (nk_thread_start(shard_thread, s, 0, 1, TSTACK_DEFAULT, 0, s->cpu)) {
+	ERROR("Cannot start shard %d of %s\n", s->cpu, s->agent->name);
+	nk_wait_queue_destroy(s->wq);
+	s->wq = 0;
+	goto out_bad;
+    }
+
+    s->started = 1;
+    return 0;
+
+ out_bad:
+    for (i = 0; i < s->agent->num_cpus; i++) {
+	free(s->rings[i].slots);
+    }
+    free(s->rings);
+    s->rings = 0;
+    return -1;
+}
+
 struct nk_net_ethernet_agent *nk_net_ethernet_agent_create(struct nk_net_dev *dev, char *name, uint64_t send_queue_size, uint64_t receive_queue_size)
 {
     AGENT_LIST_LOCK_CONF;
+    struct nk_net_dev_characteristics c;
+    int i;
 
     if (!dev) {
 	ERROR("Cannot find net device with name %s\n",name);
@@ -193,6 +380,33 @@ struct nk_net_ethernet_agent *nk_net_ethernet_agent_create(struct nk_net_dev *de
     a->send_queue_size = send_queue_size;
     a->recv_queue_size = receive_queue_size;
 
+    memset(&c,0,sizeof(c));
+    nk_net_dev_get_characteristics(dev,&c);
+    a->num_queues = c.num_queues ? c.num_queues : 1;
+    if (a->num_queues > NK_NET_DEV_MAX_QUEUES) {
+	a->num_queues = NK_NET_DEV_MAX_QUEUES;
+    }
+    a->recv_queue_per_queue = (receive_queue_size + a->num_queues - 1) / a->num_queues;
+
+    a->num_cpus = nk_get_num_cpus();
+    a->cpus = malloc(a->num_cpus * sizeof(struct agent_cpu));
+    a->shards = malloc(a->num_cpus * sizeof(struct agent_shard));
+    if (!a->cpus || !a->shards) {
+	ERROR("Cannot allocate shards for agent %s\n", a->name);
+	free(a->cpus);
+	free(a->shards);
+	free(a);
+	return 0;
+    }
+    memset(a->cpus, 0, a->num_cpus * sizeof(struct agent_cpu));
+    memset(a->shards, 0, a->num_cpus * sizeof(struct agent_shard));
+    for (i = 0; i < a->num_cpus; i++) {
+	a->shards[i].agent = a;
+	a->shards[i].cpu = i;
+    }
+    a->num_shards = 1;
+    nk_net_ethernet_agent_set_shards(a, NAUT_CONFIG_NET_ETHERNET_AGENT_SHARDS);
+
     AGENT_LIST_LOCK();
     list_add(&a->node,&agent_list);
     AGENT_LIST_UNLOCK();
@@ -205,52 +419,89 @@ struct nk_net_ethernet_agent *nk_net_ethernet_agent_create(struct nk_net_dev *de
 struct nk_net_ethernet_agent *nk_net_ethernet_agent_find(char *name)
 {
     struct list_head *cur;
-    struct nk_net_ethernet_agent *a;
+    struct nk_net_ethernet_agent *a, *found;
     
     AGENT_LIST_LOCK_CONF;
 
-    a=0;
+    found=0;
     
     AGENT_LIST_LOCK();
     list_for_each(cur,&agent_list) {
 	a = list_entry(cur,struct nk_net_ethernet_agent,node);
-	if (a) {
+	if (!strcmp(a->name,name)) {
+	    found = a;
 	    break;
 	}
     }
     AGENT_LIST_UNLOCK();
 
-    return a;
+    return found;
 }
 
+int nk_net_ethernet_agent_set_shards(struct nk_net_ethernet_agent *a, int num_shards)
+{
+    int i;
+
+    if (num_shards <= 0 || num_shards > a->num_cpus) {
+	num_shards = a->num_cpus;
+    }
+
+    if (a->state!=STOPPED) {
+	ERROR("Shards of agent %s can only be changed while it is stopped\n", a->name);
+	return -1;
+    }
+
+    // a single shard delivers inline and needs no thread
+    if (num_shards > 1) {
+	for (i = 0; i < num_shards; i++) {
+	    if (start_shard(&a->shards[i])) {
+		return -1;
+	    }
+	}
+    }
+
+    a->num_shards = num_shards;
+
+    DEBUG("agent %s now has %d shards\n", a->name, num_shards);
+
+    return 0;
+}
 
 
 static void recv_callback(nk_net_dev_status_t status, void *state);
 
 
-// called with agent lock held
-static void queue_receives(struct nk_net_ethernet_agent *a)
+// keep the receive queue of device queue q topped up
+static void queue_receives(struct nk_net_ethernet_agent *a, uint16_t q)
 {
-    while (a->recv_queue_num < a->recv_queue_size) {
+    while (1) {
+	if (__sync_fetch_and_add(&a->recv_queue_num[q],1) >= a->recv_queue_per_queue) {
+	    __sync_fetch_and_sub(&a->recv_queue_num[q],1);
+	    break;
+	}
+
 	nk_ethernet_packet_t *p = nk_net_ethernet_alloc_packet(-1);
 	if (!p) {
 	    ERROR("Starting agent with fewer receives queued than desired\n");
+	    __sync_fetch_and_sub(&a->recv_queue_num[q],1);
 	    break;
 	}
 
 	p->metadata = a;
-
-	if (nk_net_dev_receive_packet(a->netdev,
-				      p->raw,
-				      MAX_ETHERNET_PACKET_LEN,
-				      NK_DEV_REQ_CALLBACK,
-				      recv_callback,
-				      p)) {
+	p->info.flags = NK_NET_PKT_QUEUE;
+	p->info.queue = q;
+
+	if (nk_net_dev_receive_packet_info(a->netdev,
+					   p->raw,
+					   MAX_ETHERNET_PACKET_LEN,
+					   &p->info,
+					   NK_DEV_REQ_CALLBACK,
+					   recv_callback,
+					   p)) {
 	    ERROR("Failed to queue receive - agent started with fewer receives queued than desired..\n");
 	    nk_net_ethernet_release_packet(p);
+	    __sync_fetch_and_sub(&a->recv_queue_num[q],1);
 	    break;
-	} else {
-	    a->recv_queue_num++;
 	}
     }
 }
@@ -262,14 +513,19 @@ static int type_filter(nk_ethernet_packet_t *p, void *state)
     return ntohs(p->header.type)==type;
 }
 
-// assumes agent is locked
+// called with the cpu's seq odd, so the table cannot be freed under us
 static struct nk_net_ethernet_agent_net_dev *match_device(struct nk_net_ethernet_agent *a, nk_ethernet_packet_t *p)
 {
-    struct list_head *cur=0;
+    struct agent_dev_table *t = a->devs;
     struct nk_net_ethernet_agent_net_dev *d;
+    int i;
 
-    list_for_each(cur,&a->dev_list) {
-	d = list_entry(cur,struct nk_net_ethernet_agent_net_dev, devnode);
+    if (!t) {
+	return 0;
+    }
+
+    for (i=0;i<t->num_devs;i++) {
+	d = t->devs[i];
 	if (d->filter && d->filter(p,d->filter_state)) {
 	    return d;
 	}
@@ -278,6 +534,48 @@ static struct nk_net_ethernet_agent_net_dev *match_device(struct nk_net_ethernet
 
 }
 
+// Publish a new device table built from the device list, and wait out
+// any cpu still matching against the old one before freeing it.
+// Called with the agent lock held, and never from a receive callback.
+static int update_devices(struct nk_net_ethernet_agent *a)
+{
+    struct agent_dev_table *t, *old;
+    struct list_head *cur;
+    uint64_t seq;
+    int i, n=0;
+
+    list_for_each(cur,&a->dev_list) {
+	n++;
+    }
+
+    t = malloc(sizeof(*t) + n * sizeof(t->devs[0]));
+    if (!t) {
+	ERROR("Cannot allocate device table for %s\n",a->name);
+	return -1;
+    }
+
+    t->num_devs = 0;
+    list_for_each(cur,&a->dev_list) {
+	t->devs[t->num_devs++] = list_entry(cur,struct nk_net_ethernet_agent_net_dev,devnode);
+    }
+
+    old = a->devs;
+    a->devs = t;
+    mbarrier();
+
+    for (i=0;i<a->num_cpus;i++) {
+	seq = a->cpus[i].seq;
+	if (seq & 1) {
+	    while (a->cpus[i].seq == seq) {
+		asm volatile ("pause");
+	    }
+	}
+    }
+
+    free(old);
+    return 0;
+}
+
 static int complete_receive(struct nk_net_ethernet_agent_net_dev *d, nk_ethernet_packet_t *p)
 {
     struct list_head *n;
@@ -327,6 +625,126 @@ static int complete_receive(struct nk_net_ethernet_agent_net_dev *d, nk_ethernet
     }
 }
 
+// Hand a packet to the device whose filter it matches, on this cpu
+static void dispatch(struct nk_net_ethernet_agent *a, nk_ethernet_packet_t *p)
+{
+    struct nk_net_ethernet_agent_net_dev *d = 0;
+    struct agent_cpu *c;
+    uint8_t flags;
+
+    flags = irq_disable_save();
+    c = &a->cpus[my_cpu_id()];
+    c->seq++;
+    // the table must be read after the update sees us in it
+    mbarrier();
+
+    if (a->state==RUNNING) {
+	d = match_device(a,p);
+    }
+
+    if (!d) {
+	// no device found or we are not running, so just discard packet
+	DEBUG("dropping packet of type 0x%x\n",ntohs(p->header.type));
+	nk_net_ethernet_release_packet(p);
+    } else {
+	DEBUG("matched packet of type 0x%x to device %s\n",ntohs(p->header.type),d->netdev->dev.name);
+	if (complete_receive(d,p)) {
+	    DEBUG("Failed to complete receive on matched packet... dropping packet\n");
+	}
+	// up to receiver to release packet when they are done wit it
+    }
+
+    COMPILER_BARRIER();
+    c->seq++;
+    irq_enable_restore(flags);
+}
+
+// IPv4 packets are hashed by address pair and protocol, plus the ports
+// for TCP and UDP packets that are not fragments.  Anything else is
+// hashed by type and source address.
+static uint32_t flow_hash(nk_ethernet_packet_t *p)
+{
+    uint8_t *ip = p->data;
+    uint32_t ihl, h;
+
+    if (ntohs(p->header.type)==0x0800 && p->len >= ETHERNET_HEADER_LEN + 20) {
+	ihl = (ip[0] & 0xf) * 4;
+	h = *(uint32_t *)(ip+12) ^ *(uint32_t *)(ip+16) ^ ip[9];
+	if ((ip[9]==6 || ip[9]==17) &&
+	    !(ntohs(*(uint16_t *)(ip+6)) & 0x3fff) &&
+	    p->len >= ETHERNET_HEADER_LEN + ihl + 4) {
+	    h ^= *(uint32_t *)(ip+ihl);
+	}
+    } else {
+	h = p->header.type ^ *(uint32_t *)(p->header.src+2);
+    }
+
+    return nk_hash_long(h,32);
+}
+
+// Queue a packet for another shard.  It goes on the ring that only this
+// cpu feeds, so the packets of a flow reach the shard in order.
+static void steer(struct agent_shard *s, nk_ethernet_packet_t *p)
+{
+    struct nk_net_ethernet_agent *a = s->agent;
+    uint8_t flags;
+    int cpu;
+
+    flags = irq_disable_save();
+    cpu = my_cpu_id();
+    if (ring_push(&s->rings[cpu],p)) {
+	irq_enable_restore(flags);
+	// every feeding cpu counts here
+	__sync_fetch_and_add(&s->dropped,1);
+	DEBUG("shard %d is full - dropping packet\n",s->cpu);
+	nk_net_ethernet_release_packet(p);
+	return;
+    }
+    a->cpus[cpu].steered++;
+    irq_enable_restore(flags);
+
+    // pairs with the shard clearing kick before it looks at its rings
+    mbarrier();
+    if (!s->kick) {
+	s->kick = 1;
+	nk_wait_queue_wake_one(s->wq);
+    }
+}
+
+static int shard_cond(void *state)
+{
+    return ((struct agent_shard *)state)->kick;
+}
+
+static void shard_thread(void *in, void **out)
+{
+    struct agent_shard *s = (struct agent_shard *)in;
+    struct nk_net_ethernet_agent *a = s->agent;
+    nk_ethernet_packet_t *p;
+    char name[MAX_THREAD_NAME];
+    uint64_t n;
+    int i;
+
+    snprintf(name,MAX_THREAD_NAME,"%s-shard%d",a->name,s->cpu);
+    nk_thread_name(get_cur_thread(),name);
+
+    while (1) {
+	nk_wait_queue_sleep_extended(s->wq, shard_cond, s);
+	s->kick = 0;
+	mbarrier();
+	do {
+	    n = 0;
+	    for (i=0;i<a->num_cpus;i++) {
+		while ((p = ring_pop(&s->rings[i]))) {
+		    dispatch(a,p);
+		    n++;
+		}
+	    }
+	    s->delivered += n;
+	} while (n);
+    }
+}
+
 // A receive callback is generic for all ethernet packets since
 // we need to demux them to the caller.   Hence receives are handed
 // the packet that was just received with its metadata being the
@@ -336,41 +754,45 @@ static void recv_callback(nk_net_dev_status_t status,
 {
     nk_ethernet_packet_t *p = (nk_ethernet_packet_t*)state;
     struct nk_net_ethernet_agent *a = (struct nk_net_ethernet_agent *) p->metadata;
-    struct nk_net_ethernet_agent_net_dev *d = 0;
-    AGENT_LOCK_CONF;
+    struct agent_shard *s;
+    uint16_t q = 0;
     
+    // the packet may be gone once it is delivered
+    if ((p->info.flags & NK_NET_PKT_QUEUE) && p->info.queue < a->num_queues) {
+	q = p->info.queue;
+    }
+
     if (status!=NK_NET_DEV_STATUS_SUCCESS) {
 	// uhoh
 	ERROR("Receive failure for packet %p\n", p);
+	nk_net_ethernet_release_packet(p);
     } else {
 
-	AGENT_LOCK(a);
-	if (a->state==RUNNING) {
-	    d = match_device(a,p);
-	} else {
-	    d = 0;
+	// devices that report the frame length save receivers from parsing for it
+	if (p->info.len) {
+	    p->len = p->info.len;
 	}
-	AGENT_UNLOCK(a);
 
-	if (!d) {
-	    // no device found or we are not running, so just discard packet
-	    DEBUG("dropping packet of type 0x%x\n",ntohs(p->header.type));
-	    nk_net_ethernet_release_packet(p);
+	a->cpus[my_cpu_id()].received++;
+
+	s = 0;
+	if (a->num_shards > 1) {
+	    s = &a->shards[flow_hash(p) % a->num_shards];
+	}
+
+	if (s && s->cpu != my_cpu_id()) {
+	    steer(s,p);
 	} else {
-	    DEBUG("matched packet of type 0x%x to device %s\n",ntohs(p->header.type),d->netdev->dev.name);
-	    if (complete_receive(d,p)) {
-		DEBUG("Failed to complete receive on matched packet... dropping packet\n");
-	    }
-	    // up to receiver to release packet when they are done wit it
+	    dispatch(a,p);
 	}
     }
 
 
     // and queue more receives
-    AGENT_LOCK(a);
-    a->recv_queue_num--;
-    queue_receives(a);
-    AGENT_UNLOCK(a);
+    __sync_fetch_and_sub(&a->recv_queue_num[q],1);
+    if (a->state==RUNNING) {
+	queue_receives(a,q);
+    }
 }
 
 // Sends are multiplexed before this, so a send callback is handed the original op 
@@ -398,6 +820,8 @@ static void send_callback(nk_net_dev_status_t status,
 	    nk_net_ethernet_release_packet(p);
 	}
     }
+
+    free_op(o);
 }
 
 
@@ -413,6 +837,26 @@ static int get_characteristics(void *state, struct nk_net_dev_characteristics *c
 
 #define MIN(x,y) ((x)<(y) ? (x) : (y))
 
+// sends go straight through to the underlying device, along with any
+// offloads the packet asks for - a queue is only a hint
+static int device_send(struct nk_net_ethernet_agent *a, nk_ethernet_packet_t *p, struct netdev_op *o)
+{
+    void *dev_state = a->netdev->dev.state;
+    struct nk_net_dev_int *dev_int = (struct nk_net_dev_int *) a->netdev->dev.interface;
+
+    if (p->info.flags) {
+	if (dev_int->post_send_info) {
+	    return dev_int->post_send_info(dev_state, p->raw, p->len, &p->info, send_callback, o);
+	}
+	if (p->info.flags & ~NK_NET_PKT_QUEUE) {
+	    DEBUG("%s cannot offload\n",a->netdev->dev.name);
+	    return -1;
+	}
+    }
+
+    return dev_int->post_send(dev_state, p->raw, p->len, send_callback, o);
+}
+
 static inline int post_send_recv(void *state, uint8_t *buf, uint64_t len, void (*callback)(nk_net_dev_status_t status, void *context), void *context, int recv)
 {
     DEV_LOCK_CONF;
@@ -454,18 +898,21 @@ static inline int post_send_recv(void *state, uint8_t *buf, uint64_t len, void (
 	// the receive handler is responsible for queuing packets
 	return 0;
     } else {
-	// send goes straight through to the underlying device
-	void *dev_state = d->agent->netdev->dev.state;
-	struct nk_net_dev_int *dev_int = (struct nk_net_dev_int *) d->agent->netdev->dev.interface;
-
+	// the caller may reuse buf as soon as we return, so it is copied
 	o->packet = nk_net_ethernet_alloc_packet(-1);
 	if (!o->packet) {
+	    free_op(o);
 	    return -1;
 	}
 	memcpy(o->packet->raw,buf,len);
 	o->packet->len = len;
 
-	return dev_int->post_send(dev_state, o->packet->raw, o->packet->len, send_callback, o);
+	if (device_send(d->agent, o->packet, o)) {
+	    nk_net_ethernet_release_packet(o->packet);
+	    free_op(o);
+	    return -1;
+	}
+	return 0;
     }
 
     return 0;
@@ -522,11 +969,12 @@ static inline int post_send_recv_packet(void *state, nk_ethernet_packet_t *packe
 	// the receive handler is responsible for queuing packets
 	return 0;
     } else {
-	// send goes straight through to the underlying device
-	void *dev_state = d->agent->netdev->dev.state;
-	struct nk_net_dev_int *dev_int = (struct nk_net_dev_int *) d->agent->netdev->dev.interface;
-	
-	return dev_int->post_send(dev_state, o->packet->raw, o->packet->len, send_callback, o);
+	if (device_send(d->agent, o->packet, o)) {
+	    // the sender still owns the packet
+	    free_op(o);
+	    return -1;
+	}
+	return 0;
     }
 
     return 0;
@@ -610,6 +1058,13 @@ struct nk_net_dev *nk_net_ethernet_agent_register_filter(struct nk_net_ethernet_
     
     AGENT_LOCK(agent);
     list_add(&d->devnode,&agent->dev_list);
+    if (update_devices(agent)) {
+	list_del_init(&d->devnode);
+	AGENT_UNLOCK(agent);
+	nk_net_dev_unregister(d->netdev);
+	free(d);
+	return 0;
+    }
     AGENT_UNLOCK(agent);
 
     return d->netdev;
@@ -632,9 +1087,15 @@ int                nk_net_ethernet_agent_unregister(struct nk_net_dev *dev)
 
     AGENT_LOCK(agent);
     list_del_init(&netdev->devnode);
+    if (update_devices(agent)) {
+	list_add(&netdev->devnode,&agent->dev_list);
+	AGENT_UNLOCK(agent);
+	return -1;
+    }
     AGENT_UNLOCK(agent);
 
-    // now we have exclusive access to this device (no lock needed)
+    // no cpu can match the device any more, so now we have
+    // exclusive access to it (no lock needed)
     // so clear out the queues
     struct list_head *cur, *temp;
 
@@ -836,6 +1297,7 @@ int nk_net_ethernet_agent_device_receive_packet(struct nk_net_dev *dev,
 int nk_net_ethernet_agent_start(struct nk_net_ethernet_agent *a)
 {
     AGENT_LOCK_CONF;
+    uint16_t q;
 
     AGENT_LOCK(a);
 
@@ -845,12 +1307,14 @@ int nk_net_ethernet_agent_start(struct nk_net_ethernet_agent *a)
 	return -1;
     }
 
-    queue_receives(a);
-
     a->state=RUNNING;
 
     AGENT_UNLOCK(a);
 
+    for (q=0;q<a->num_queues;q++) {
+	queue_receives(a,q);
+    }
+
     return 0;
 }
 
@@ -878,15 +1342,380 @@ struct nk_net_dev *nk_net_ethernet_agent_get_underlying_device(struct nk_net_eth
     return agent->netdev;
 }
 
+static void show_agent(struct nk_net_ethernet_agent *a)
+{
+    int i;
+
+    nk_vc_printf("%s on %s: %s, %lu device queues, %d shards\n",
+		 a->name, a->netdev->dev.name,
+		 a->state==RUNNING ? "running" : "stopped",
+		 a->num_queues, a->num_shards);
+    for (i=0;i<a->num_cpus;i++) {
+	if (a->cpus[i].received || (a->num_shards > 1 && i < a->num_shards)) {
+	    nk_vc_printf("  cpu %3d: %lu received, %lu steered away, shard delivered %lu dropped %lu\n",
+			 i, a->cpus[i].received, a->cpus[i].steered,
+			 a->shards[i].delivered, a->shards[i].dropped);
+	}
+    }
+}
+
+static int handle_netagent(char * buf, void * priv)
+{
+    AGENT_LIST_LOCK_CONF;
+    struct nk_net_ethernet_agent *a;
+    struct list_head *cur;
+    char name[MAX_AGENT_NAME];
+    int n;
+
+    if (sscanf(buf,"netagent shards %31s %d",name,&n)==2) {
+	if (!(a = nk_net_ethernet_agent_find(name))) {
+	    nk_vc_printf("no agent %s\n",name);
+	    return 0;
+	}
+	if (nk_net_ethernet_agent_set_shards(a,n)) {
+	    nk_vc_printf("cannot change shards of %s (stop it first)\n",name);
+	    return 0;
+	}
+	show_agent(a);
+	return 0;
+    }
+
+    if (sscanf(buf,"netagent %31s",name)==1) {
+	if (!(a = nk_net_ethernet_agent_find(name))) {
+	    nk_vc_printf("no agent %s\n",name);
+	    return 0;
+	}
+	show_agent(a);
+	return 0;
+    }
+
+    AGENT_LIST_LOCK();
+    list_for_each(cur,&agent_list) {
+	show_agent(list_entry(cur,struct nk_net_ethernet_agent,node));
+    }
+    AGENT_LIST_UNLOCK();
+    return 0;
+}
+
+static struct shell_cmd_impl netagent_impl = {
+    .cmd      = "netagent",
+    .help_str = "netagent [agent] | netagent shards agent n (0 = one per cpu)",
+    .handler  = handle_netagent,
+};
+nk_register_shell_cmd(netagent_impl);
+
+
+// A loopback device for the benchmark that behaves like a NIC with a
+// single queue: frames sent from any cpu cross over to a thread on cpu
+// 0, which receives them and completes the sends, as the NIC's
+// interrupt handler would.  Each benchmark cpu sends UDP frames from a
+// port of its own, to be matched by a filter device of its own, and
+// waits for each to come back.  So the delivery work can only spread
+// out through the agent's shards.
+
+#define LO_SLOTS       256
+#define BENCH_PORT     9000
+#define BENCH_LEN      64
+
+struct lo_slot {
+    uint8_t                    *buf;
+    uint64_t                    len;
+    struct nk_net_dev_pkt_info *info;
+    void                       (*callback)(nk_net_dev_status_t, void *);
+    void                       *context;
+};
+
+static struct lo_dev {
+    struct nk_net_dev  *netdev;
+    int                 num_cpus;
+    // frames in flight, one ring per sending cpu, with its slots
+    struct agent_ring  *wire;
+    struct lo_slot     *sends;
+    // posted receive buffers
+    spinlock_t          lock;
+    struct lo_slot      recvs[LO_SLOTS];
+    uint32_t            recv_head;
+    uint32_t            recv_tail;
+    nk_wait_queue_t    *wq;
+    volatile int        kick;
+} lo;
+
+static int lo_get_characteristics(void *state, struct nk_net_dev_characteristics *c)
+{
+    memset(c,0,sizeof(*c));
+    memset(c->mac,0x02,ETHER_MAC_LEN);
+    c->min_tu = ETHERNET_HEADER_LEN;
+    c->max_tu = MAX_ETHERNET_PACKET_LEN;
+    c->num_queues = 1;
+    return 0;
+}
+
+static int lo_post_receive_info(void *state, uint8_t *dest, uint64_t len, struct nk_net_dev_pkt_info *info, void (*callback)(nk_net_dev_status_t, void *), void *context)
+{
+    struct lo_slot *r;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&lo.lock);
+    if (lo.recv_tail - lo.recv_head == LO_SLOTS) {
+	spin_unlock_irq_restore(&lo.lock,flags);
+	return -1;
+    }
+    r = &lo.recvs[lo.recv_tail++ % LO_SLOTS];
+    r->buf = dest;
+    r->len = len;
+    r->info = info;
+    r->callback = callback;
+    r->context = context;
+    spin_unlock_irq_restore(&lo.lock,flags);
+    return 0;
+}
+
+static int lo_post_receive(void *state, uint8_t *dest, uint64_t len, void (*callback)(nk_net_dev_status_t, void *), void *context)
+{
+    return lo_post_receive_info(state,dest,len,0,callback,context);
+}
+
+static int lo_post_send(void *state, uint8_t *src, uint64_t len, void (*callback)(nk_net_dev_status_t, void *), void *context)
+{
+    struct agent_ring *w;
+    struct lo_slot *s;
+    uint8_t flags;
+    int cpu;
+
+    flags = irq_disable_save();
+    cpu = my_cpu_id();
+    w = &lo.wire[cpu];
+    if (ring_full(w)) {
+	irq_enable_restore(flags);
+	return -1;
+    }
+    s = &lo.sends[cpu*LO_SLOTS + (w->tail & w->mask)];
+    s->buf = src;
+    s->len = len;
+    s->callback = callback;
+    s->context = context;
+    ring_push(w,s);
+    irq_enable_restore(flags);
+
+    mbarrier();
+    if (!lo.kick) {
+	lo.kick = 1;
+	nk_wait_queue_wake_one(lo.wq);
+    }
+    return 0;
+}
+
+static struct nk_net_dev_int lo_ops = {
+    .get_characteristics = lo_get_characteristics,
+    .post_receive        = lo_post_receive,
+    .post_send           = lo_post_send,
+    .post_receive_info   = lo_post_receive_info,
+};
+
+static int lo_cond(void *state)
+{
+    return lo.kick;
+}
+
+static void lo_thread(void *in, void **out)
+{
+    struct lo_slot *p, snd, rcv;
+    uint8_t flags;
+    int i, n, got;
+
+    nk_thread_name(get_cur_thread(),"agent-bench-lo");
+
+    while (1) {
+	nk_wait_queue_sleep_extended(lo.wq, lo_cond, 0);
+	lo.kick = 0;
+	mbarrier();
+	do {
+	    n = 0;
+	    for (i=0;i<lo.num_cpus;i++) {
+		while ((p = ring_peek(&lo.wire[i]))) {
+		    snd = *p;
+		    ring_drop(&lo.wire[i]);
+		    n++;
+
+		    flags = spin_lock_irq_save(&lo.lock);
+		    got = lo.recv_head != lo.recv_tail;
+		    if (got) {
+			rcv = lo.recvs[lo.recv_head++ % LO_SLOTS];
+		    }
+		    spin_unlock_irq_restore(&lo.lock,flags);
+
+		    if (got) {
+			memcpy(rcv.buf,snd.buf,snd.len);
+			if (rcv.info) {
+			    memset(rcv.info,0,sizeof(*rcv.info));
+			    rcv.info->len = snd.len;
+			}
+			if (rcv.callback) {
+			    rcv.callback(NK_NET_DEV_STATUS_SUCCESS,rcv.context);
+			}
+		    }
+		    if (snd.callback) {
+			snd.callback(NK_NET_DEV_STATUS_SUCCESS,snd.context);
+		    }
+		}
+	    }
+	} while (n);
+    }
+}
+
+static struct {
+    struct nk_net_ethernet_agent *agent;
+    struct nk_net_dev           **devs;   // one per cpu
+} bench;
+
+static int bench_filter(nk_ethernet_packet_t *p, void *state)
+{
+    return ntohs(p->header.type)==0x0800 &&
+	ntohs(*(uint16_t *)(p->data+20))==BENCH_PORT+(uint64_t)state;
+}
+
+static int bench_init(void)
+{
+    int i;
+
+    if (bench.agent) {
+	return 0;
+    }
+
+    lo.num_cpus = nk_get_num_cpus();
+    spinlock_init(&lo.lock);
+    lo.wire = malloc(lo.num_cpus * sizeof(struct agent_ring));
+    lo.sends = malloc(lo.num_cpus * LO_SLOTS * sizeof(struct lo_slot));
+    bench.devs = malloc(lo.num_cpus * sizeof(struct nk_net_dev *));
+    if (!lo.wire || !lo.sends || !bench.devs) {
+	ERROR("Cannot allocate benchmark loopback\n");
+	return -1;
+    }
+    for (i=0;i<lo.num_cpus;i++) {
+	if (ring_init(&lo.wire[i],LO_SLOTS)) {
+	    ERROR("Cannot allocate benchmark loopback\n");
+	    return -1;
+	}
+    }
+
+    if (!(lo.wq = nk_wait_queue_create(0)) ||
+	nk_thread_start(lo_thread, 0, 0, 1, TSTACK_DEFAULT, 0, 0)) {
+	ERROR("Cannot start benchmark loopback\n");
+	return -1;
+    }
+
+    if (!(lo.netdev = nk_net_dev_register("agent-bench-lo",0,&lo_ops,&lo)) ||
+	!(bench.agent = nk_net_ethernet_agent_create(lo.netdev,"agent-bench",LO_SLOTS,LO_SLOTS/2))) {
+	ERROR("Cannot create benchmark agent\n");
+	return -1;
+    }
+
+    for (i=0;i<lo.num_cpus;i++) {
+	if (!(bench.devs[i] = nk_net_ethernet_agent_register_filter(bench.agent,bench_filter,(void*)(uint64_t)i))) {
+	    ERROR("Cannot register benchmark device\n");
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+static int bench_setup(int shards)
+{
+    if (bench_init()) {
+	return -1;
+    }
+    if (bench.agent->state==RUNNING) {
+	nk_net_ethernet_agent_stop(bench.agent);
+    }
+    if (nk_net_ethernet_agent_set_shards(bench.agent,shards)) {
+	return -1;
+    }
+    return nk_net_ethernet_agent_start(bench.agent);
+}
+
+static int bench_setup_1(void **state)   { return bench_setup(1); }
+static int bench_setup_2(void **state)   { return bench_setup(2); }
+static int bench_setup_4(void **state)   { return bench_setup(4); }
+static int bench_setup_all(void **state) { return bench_setup(0); }
+
+// Send a frame through the agent and wait for it to come back
+static uint64_t agent_bench(void *state, int cpu)
+{
+    nk_ethernet_packet_t *p, *r;
+    uint64_t start, end;
+    uint8_t *ip;
+
+    start = rdtsc();
+
+    p = nk_net_ethernet_alloc_packet(-1);
+    if (!p) {
+	return 0;
+    }
+
+    memset(p->raw,0,BENCH_LEN);
+    memset(p->header.dst,0x02,ETHER_MAC_LEN);
+    memset(p->header.src,0x02,ETHER_MAC_LEN);
+    p->header.type = htons(0x0800);
+    ip = p->data;
+    ip[0] = 0x45;
+    ip[9] = 17;
+    *(uint32_t *)(ip+12) = htonl(0x0a000001);
+    *(uint32_t *)(ip+16) = htonl(0x0a000002);
+    *(uint16_t *)(ip+20) = htons(BENCH_PORT+cpu);
+    *(uint16_t *)(ip+22) = htons(BENCH_PORT);
+    p->len = BENCH_LEN;
+
+    if (nk_net_ethernet_agent_device_send_packet(bench.devs[cpu],p,NK_DEV_REQ_NONBLOCKING,0,0)) {
+	nk_net_ethernet_release_packet(p);
+	return 0;
+    }
+
+    if (!nk_net_ethernet_agent_device_receive_packet(bench.devs[cpu],&r,NK_DEV_REQ_BLOCKING,0,0)) {
+	nk_net_ethernet_release_packet(r);
+    }
+
+    end = rdtsc();
+
+    return end - start;
+}
+
+// The same round trip from every cpu at once, with the received frames
+// delivered by one shard (on cpu 0, where the loopback completes them),
+// by two, by four, or by one on every cpu
+#define AGENT_BENCH(n)						\
+    static struct nk_bench_impl agent_bench_##n##_impl = {	\
+	.name     = "ethernet_agent_shards_" #n,			\
+	.unit     = "cycles",						\
+	.flags    = NK_BENCH_MULTI_CPU,					\
+	.reps     = 10000,						\
+	.warmup   = 100,						\
+	.setup    = bench_setup_##n,					\
+	.run      = agent_bench,					\
+    };								\
+    nk_register_bench(agent_bench_##n##_impl);
+
+AGENT_BENCH(1)
+AGENT_BENCH(2)
+AGENT_BENCH(4)
+AGENT_BENCH(all)
+
 int  nk_net_ethernet_agent_init()
 {
-    uint64_t i;
+    uint64_t i, n = nk_get_num_cpus();
 
     spinlock_init(&agent_list_lock);
     INIT_LIST_HEAD(&agent_list);
 
-    spinlock_init(&op_free_list_lock);
-    INIT_LIST_HEAD(&op_free_list);
+    op_caches = malloc(n * sizeof(struct op_cache));
+    if (!op_caches) {
+	ERROR("Cannot allocate op caches\n");
+	return -1;
+    }
+    for (i=0;i<n;i++) {
+	INIT_LIST_HEAD(&op_caches[i].free);
+	op_caches[i].count = 0;
+    }
     
     INFO("inited\n");
 
@@ -895,6 +1724,18 @@ int  nk_net_ethernet_agent_init()
 
 void nk_net_ethernet_agent_deinit()
 {
+    struct netdev_op *o, *t;
+    uint64_t i, n = nk_get_num_cpus();
+
+    for (i=0;i<n;i++) {
+	list_for_each_entry_safe(o,t,&op_caches[i].free,node) {
+	    list_del_init(&o->node);
+	    free(o);
+	}
+    }
+    free(op_caches);
+    op_caches = 0;
+
     INFO("deinited\n");
 }
 
@@ -26,6 +26,10 @@
 #include <nautilus/list.h>
 #include <nautilus/spinlock.h>
 #include <nautilus/netdev.h>
+#include <nautilus/timer.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/atomic.h>
+#include <test/test.h>
 
 #include <net/ethernet/ethernet_arp.h>
 
@@ -56,27 +60,19 @@ static struct list_head  arper_list;
 static spinlock_t arp_cache_lock;
 
 struct addr_pair {
-    uint64_t            time_ns; // when this entry was made (for the ARP cache)
+    uint64_t            time_ns; // when this entry was made
     int                 state;
 #define FREE    0
 #define ALLOCED 1
-#define WAITING 2       // for ARP cache, outstanding request
 #define INUSE   3
     ipv4_addr_t         ip_addr;
     ethernet_mac_addr_t mac_addr;
 };
 
-// number of entries in the ARP cache
-#define MAX_ARP_CACHE_PAIRS 256
-
 // number of entries per interface (for multiple addresses)
 #define MAX_PAIRS 16
 
 
-#define ARP_ENTRY_TIMEOUT_S (14400ULL)
-#define ARP_ENTRY_TIMEOUT_NS (ARP_ENTRY_TIMEOUT_S * 1000000000ULL)
-
-
 struct nk_net_ethernet_arper {
     spinlock_t        lock;
     struct list_head  node;     // for inclusion in arper list
@@ -140,7 +136,439 @@ static void free_pair(struct addr_pair *pair)
 #define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
 #define MACLIST(x) (x)[0],(x)[1],(x)[2],(x)[3],(x)[4],(x)[5]
 
-static struct addr_pair *find_waiting_pair_in_cache_by_ip_addr(ipv4_addr_t ip);
+
+//
+// The ARP cache (neighbor cache) shared by all the arpers
+//
+// Entries live in a fixed pool and are chained into hash buckets.
+// Changes are made with the cache lock held, while lookups walk the
+// chains with no lock at all.  Each entry carries a sequence count
+// that is odd while the entry is being changed, so a lookup that
+// reads the same even count before and after copying the entry knows
+// the copy is consistent.  Entries are never freed, only unlinked and
+// reused, so a lookup can always follow the pointer it read, even if
+// the entry has since moved to another chain.  The worst that happens
+// is a lookup that misses, and a miss is resolved with the lock held.
+//
+// An entry is INCOMPLETE while we are waiting for an answer to a
+// request, REACHABLE once it has been confirmed by a packet from the
+// neighbor, and STALE when it has not been confirmed for a while.
+// A stale mapping is still used, but the next lookup of it sends a
+// request to revalidate it.  A timer ages entries from REACHABLE to
+// STALE, drops entries that have been stale for too long, and gives up
+// on INCOMPLETE ones that nobody answers.  No matter how many lookups
+// of an unresolved address there are, at most one request for it is
+// sent per retransmit interval.
+//
+
+// number of entries in the ARP cache
+#define ARP_CACHE_ENTRIES   1024
+#define ARP_CACHE_HASH_BITS 8
+#define ARP_CACHE_BUCKETS   (1 << ARP_CACHE_HASH_BITS)
+
+// how long a mapping is trusted before it goes stale
+#define ARP_REACHABLE_NS     (30ULL * 1000000000ULL)
+// how long a stale mapping is kept if it is not confirmed
+#define ARP_ENTRY_TIMEOUT_S (14400ULL)
+#define ARP_ENTRY_TIMEOUT_NS (ARP_ENTRY_TIMEOUT_S * 1000000000ULL)
+// time between requests for an unresolved address
+#define ARP_RETRANSMIT_NS    (1000000000ULL)
+// requests before we give up on an address
+#define ARP_MAX_REQUESTS     3
+// how often entries are aged
+#define ARP_AGE_INTERVAL_NS  (1000000000ULL)
+
+struct arp_entry {
+    volatile uint64_t   seq;          // odd => being changed
+    volatile int        state;
+#define ARP_FREE       0
+#define ARP_INCOMPLETE 1
+#define ARP_REACHABLE  2
+#define ARP_STALE      3
+    ipv4_addr_t         ip_addr;
+    ethernet_mac_addr_t mac_addr;
+    uint64_t            confirmed_ns; // last time the neighbor confirmed it
+    uint64_t            requested_ns; // last time we sent a request for it
+    uint32_t            requests;     // requests sent since last confirmed
+
+    struct arp_entry * volatile next; // in hash chain, or free list
+};
+
+static struct arp_entry arp_cache[ARP_CACHE_ENTRIES];
+static struct arp_entry * volatile arp_hash[ARP_CACHE_BUCKETS];
+static struct arp_entry *arp_free;
+
+static nk_timer_t      *arp_timer;
+static int              arp_aging;
+static nk_wait_queue_t *arp_waitq;
+
+// bumped whenever an address resolves or is given up on
+static volatile uint64_t arp_generation;
+// threads sleeping in nk_net_ethernet_arp_resolve()
+static volatile uint64_t arp_waiters;
+
+// x86 does not reorder loads with loads or stores with stores, so
+// the sequence counts only need the compiler to keep the order
+#define COMPILER_BARRIER() asm volatile ("" ::: "memory")
+
+static inline uint32_t arp_hash_ip(ipv4_addr_t ip)
+{
+    return (ip * 2654435761U) >> (32 - ARP_CACHE_HASH_BITS);
+}
+
+// lock must be held
+static inline void entry_write_begin(struct arp_entry *e)
+{
+    e->seq++;
+    COMPILER_BARRIER();
+}
+
+// lock must be held
+static inline void entry_write_end(struct arp_entry *e)
+{
+    COMPILER_BARRIER();
+    e->seq++;
+}
+
+// Lock-free lookup
+// 0 => found a usable mapping, which is copied to mac
+//      *stale is set if it is stale and due for revalidation
+// 1 => not found or not usable, use the slow path
+static int cache_lookup(ipv4_addr_t ip, ethernet_mac_addr_t mac, int *stale)
+{
+    struct arp_entry *e;
+    uint64_t seq, requested_ns;
+    ipv4_addr_t e_ip;
+    int state;
+    int i;
+
+    for (e = arp_hash[arp_hash_ip(ip)], i = 0;
+	 e && i < ARP_CACHE_ENTRIES;
+	 e = e->next, i++) {
+
+	seq = e->seq;
+	COMPILER_BARRIER();
+	e_ip = e->ip_addr;
+	state = e->state;
+	requested_ns = e->requested_ns;
+	memcpy(mac,e->mac_addr,ETHER_MAC_LEN);
+	COMPILER_BARRIER();
+
+	if ((seq & 1) || e->seq != seq) {
+	    // being changed under us
+	    return 1;
+	}
+
+	if (e_ip == ip) {
+	    if (state == ARP_REACHABLE) {
+		*stale = 0;
+		return 0;
+	    }
+	    if (state == ARP_STALE) {
+		*stale = nk_sched_get_realtime() - requested_ns >= ARP_RETRANSMIT_NS;
+		return 0;
+	    }
+	    return 1;
+	}
+    }
+
+    return 1;
+}
+
+// lock must be held
+static struct arp_entry *find_entry(ipv4_addr_t ip)
+{
+    struct arp_entry *e;
+
+    for (e = arp_hash[arp_hash_ip(ip)]; e; e = e->next) {
+	if (e->ip_addr == ip && e->state != ARP_FREE) {
+	    return e;
+	}
+    }
+    return 0;
+}
+
+// lock must be held
+static void unlink_entry(struct arp_entry *e)
+{
+    struct arp_entry * volatile *cur;
+
+    for (cur = &arp_hash[arp_hash_ip(e->ip_addr)]; *cur; cur = &(*cur)->next) {
+	if (*cur == e) {
+	    // e->next is left alone for any lookup standing on e
+	    *cur = e->next;
+	    return;
+	}
+    }
+}
+
+// lock must be held
+static void free_entry(struct arp_entry *e)
+{
+    unlink_entry(e);
+    entry_write_begin(e);
+    e->state = ARP_FREE;
+    entry_write_end(e);
+    // a lookup standing on e may wander onto the free list, where
+    // it finds nothing usable and falls back on the slow path
+    e->next = arp_free;
+    arp_free = e;
+}
+
+// lock must be held
+// the oldest stale entry, or, failing that, the oldest reachable one
+static struct arp_entry *find_victim()
+{
+    struct arp_entry *stale = 0, *reachable = 0;
+    int i;
+
+    for (i=0;i<ARP_CACHE_ENTRIES;i++) {
+	struct arp_entry *e = &arp_cache[i];
+	if (e->state == ARP_STALE) {
+	    if (!stale || e->confirmed_ns < stale->confirmed_ns) {
+		stale = e;
+	    }
+	} else if (e->state == ARP_REACHABLE) {
+	    if (!reachable || e->confirmed_ns < reachable->confirmed_ns) {
+		reachable = e;
+	    }
+	}
+    }
+    return stale ? stale : reachable;
+}
+
+// lock must be held
+// returns a new entry for ip, in the given state, linked into its chain
+static struct arp_entry *alloc_entry(ipv4_addr_t ip, int state)
+{
+    struct arp_entry *e;
+    uint32_t h;
+
+    if (arp_free) {
+	e = arp_free;
+	arp_free = e->next;
+    } else {
+	if (!(e = find_victim())) {
+	    // everything is waiting for a response
+	    return 0;
+	}
+	DEBUG("Evicting " IPSTR "\n", IPLIST(e->ip_addr));
+	unlink_entry(e);
+    }
+
+    h = arp_hash_ip(ip);
+
+    entry_write_begin(e);
+    e->ip_addr = ip;
+    e->state = state;
+    memset(e->mac_addr,0,ETHER_MAC_LEN);
+    e->confirmed_ns = 0;
+    e->requested_ns = 0;
+    e->requests = 0;
+    e->next = arp_hash[h];
+    entry_write_end(e);
+
+    // publish only once the entry is complete
+    COMPILER_BARRIER();
+    arp_hash[h] = e;
+
+    return e;
+}
+
+static void arp_wake()
+{
+    atomic_inc(arp_generation);
+    if (arp_waiters) {
+	nk_wait_queue_wake_all(arp_waitq);
+    }
+}
+
+// the neighbor at ip has told us it has mac
+// create => add it if we do not have it
+// returns nonzero if the mapping is not cached
+static int learn(ipv4_addr_t ip, ethernet_mac_addr_t mac, int create)
+{
+    struct arp_entry *e;
+    int resolved;
+
+    ARP_CACHE_LOCK_CONF;
+
+    if (!ip) {
+	// probe from a host that has no address yet
+	return -1;
+    }
+
+    ARP_CACHE_LOCK();
+
+    if (!(e = find_entry(ip))) {
+	if (!create || !(e = alloc_entry(ip,ARP_INCOMPLETE))) {
+	    ARP_CACHE_UNLOCK();
+	    DEBUG("Not caching " IPSTR "\n", IPLIST(ip));
+	    return -1;
+	}
+    }
+
+    resolved = e->state == ARP_INCOMPLETE;
+
+    entry_write_begin(e);
+    memcpy(e->mac_addr,mac,ETHER_MAC_LEN);
+    e->state = ARP_REACHABLE;
+    e->confirmed_ns = nk_sched_get_realtime();
+    e->requests = 0;
+    entry_write_end(e);
+
+    ARP_CACHE_UNLOCK();
+
+    DEBUG(IPSTR " is at " MACSTR "\n", IPLIST(ip), MACLIST(mac));
+
+    if (resolved) {
+	arp_wake();
+    }
+
+    return 0;
+}
+
+static void age_cache(void *state)
+{
+    uint64_t now = nk_sched_get_realtime();
+    int gave_up = 0;
+    int i;
+
+    ARP_CACHE_LOCK_CONF;
+
+    ARP_CACHE_LOCK();
+
+    for (i=0;i<ARP_CACHE_ENTRIES;i++) {
+	struct arp_entry *e = &arp_cache[i];
+	switch (e->state) {
+	case ARP_REACHABLE:
+	    if (now - e->confirmed_ns > ARP_REACHABLE_NS) {
+		entry_write_begin(e);
+		e->state = ARP_STALE;
+		entry_write_end(e);
+	    }
+	    break;
+	case ARP_STALE:
+	    if (now - e->confirmed_ns > ARP_ENTRY_TIMEOUT_NS) {
+		free_entry(e);
+	    }
+	    break;
+	case ARP_INCOMPLETE:
+	    // the last request went unanswered, or nobody is asking anymore
+	    if ((e->requests >= ARP_MAX_REQUESTS && now - e->requested_ns > ARP_RETRANSMIT_NS) ||
+		now - e->requested_ns > ARP_MAX_REQUESTS * ARP_RETRANSMIT_NS) {
+		DEBUG("Giving up on " IPSTR "\n", IPLIST(e->ip_addr));
+		free_entry(e);
+		gave_up = 1;
+	    }
+	    break;
+	default:
+	    break;
+	}
+    }
+
+    ARP_CACHE_UNLOCK();
+
+    if (gave_up || arp_waiters) {
+	// waiters also use this to retransmit
+	arp_wake();
+    }
+
+    nk_timer_reset(arp_timer, ARP_AGE_INTERVAL_NS);
+    nk_timer_start(arp_timer);
+}
+
+
+static int send_request(struct nk_net_ethernet_arper *arper, ipv4_addr_t sender_ip, ipv4_addr_t target_ip)
+{
+    nk_ethernet_packet_t *pk = nk_net_ethernet_alloc_packet(-1);
+
+    if (!pk) {
+	ERROR("Failed to allocate packet\n");
+	return -1;
+    }
+
+    memset(pk->header.dst,0xff,ETHER_MAC_LEN);
+
+    struct nk_net_dev_characteristics c;
+
+    nk_net_dev_get_characteristics(arper->netdev,&c);
+
+    memcpy(pk->header.src,c.mac,ETHER_MAC_LEN);
+
+    pk->header.type = htons(0x0806);
+
+    nk_net_ethernet_arp_reqresp_t *r = (nk_net_ethernet_arp_reqresp_t*)pk->data;
+
+    DEBUG("Constructing request for ip address 0x%x\n",target_ip);
+
+    r->htype = htons(1);
+    r->ptype = htons(0x0800);
+    r->hlen = 6;
+    r->plen = 4;
+    r->oper = htons(1); // request
+    memcpy(r->sha,c.mac,ETHER_MAC_LEN);
+    r->spa = htonl(sender_ip);
+    memset(r->tha,0,ETHER_MAC_LEN);
+    r->tpa = htonl(target_ip);
+
+    pk->len = 14 + 28;
+
+    // now launch packet - we don't need to wait or be informed
+    // eventually, we may get back a response, and that
+    // response will be via the receive callback
+    if (nk_net_ethernet_agent_device_send_packet(arper->netdev,
+						 pk,
+						 NK_DEV_REQ_NONBLOCKING,
+						 0, 0)) {
+	ERROR("Failed to launch ARP request\n");
+	nk_net_ethernet_release_packet(pk);
+	return -1;
+    }
+
+    DEBUG("ARP Request launched\n");
+
+    return 0;
+}
+
+// ask for ip on the arper's interface
+static int send_lookup_request(struct nk_net_ethernet_arper *arper, ipv4_addr_t ip)
+{
+    struct nk_net_dev_characteristics c;
+
+    nk_net_dev_get_characteristics(arper->netdev,&c);
+
+    ARPER_LOCK_CONF;
+
+    ARPER_LOCK(arper);
+    struct addr_pair *my_pair = find_pair_by_mac_addr(arper,c.mac);
+    ipv4_addr_t my_addr = my_pair ? my_pair->ip_addr : 0;
+    ARPER_UNLOCK(arper);
+
+    return send_request(arper,my_addr,ip);
+}
+
+// ask for ip on the arper's interface, or on all of them if arper is null
+static int send_lookup_requests(struct nk_net_ethernet_arper *arper, ipv4_addr_t ip)
+{
+    struct list_head *cur;
+    int rc = -1;
+
+    if (arper) {
+	return send_lookup_request(arper,ip);
+    }
+
+    ARPER_LIST_LOCK_CONF;
+    ARPER_LIST_LOCK();
+    list_for_each(cur,&arper_list) {
+	if (!send_lookup_request(list_entry(cur,struct nk_net_ethernet_arper, node),ip)) {
+	    rc = 0;
+	}
+    }
+    ARPER_LIST_UNLOCK();
+
+    return rc;
+}
 
 
 void recv_callback(nk_net_dev_status_t status,
@@ -161,9 +589,14 @@ void recv_callback(nk_net_dev_status_t status,
 
     if (r->htype!=htons(1) || r->ptype!=htons(0x0800)) {
 	DEBUG("Unsupported ARP (htype=%x ptype=%x)\n",r->htype,r->ptype);
+	nk_net_ethernet_release_packet(packet);
 	goto launch_receive;
     }
 
+    // a gratuitous ARP (request or response) announces the sender's
+    // mapping to everyone, so we preload it
+    int gratuitous = r->spa == r->tpa;
+
     if (r->oper==htons(1)) {  // ARP REQUEST
 	struct addr_pair *p;
 	
@@ -175,8 +608,13 @@ void recv_callback(nk_net_dev_status_t status,
 
 	ARPER_UNLOCK(a);
 	
-	if (!p) {
+	// someone asking for us is about to talk to us, so we
+	// will likely need their mapping too
+	learn(ntohl(r->spa),r->sha,gratuitous || p);
+
+	if (!p || gratuitous) {
 	    DEBUG("ARP reguest for " IPSTR " is ignored\n", IPLIST(ntohl(r->tpa)));
+	    nk_net_ethernet_release_packet(packet);
 	    goto launch_receive;
 	}
 
@@ -208,35 +646,23 @@ void recv_callback(nk_net_dev_status_t status,
 						     0, 0)) {
 	    ERROR("Failed to launch ARP response\n");
 	    // sender will just have to retry
+	    nk_net_ethernet_release_packet(packet);
 	}
 	// send side will delete packet
 	goto launch_receive;
 	
     } else if (r->oper==htons(2)) {  // ARP RESPONSE
 
-	struct addr_pair *p;
-	
 	DEBUG("ARP response for " IPSTR " mapped to " MACSTR "\n", IPLIST(ntohl(r->spa)),MACLIST(r->sha));
-	ARP_CACHE_LOCK_CONF;
-	
-	ARP_CACHE_LOCK();
 	
-	p = find_waiting_pair_in_cache_by_ip_addr(ntohl(r->spa));
-
-	if (p) {
-	    DEBUG("Pair found, current state %d\n",p->state);
-	    memcpy(p->mac_addr,r->sha,ETHER_MAC_LEN);
-	    p->time_ns = nk_sched_get_realtime();
-	    p->state = INUSE;
-	} else {
-	    DEBUG("Pair not found, avoiding cache update\n");
-	}
-
-	ARP_CACHE_UNLOCK();
+	// only update what we have asked about, unless it is gratuitous
+	learn(ntohl(r->spa),r->sha,gratuitous);
 	
+	nk_net_ethernet_release_packet(packet);
 	goto launch_receive;
     } else {
 	DEBUG("Unknown ARP operation\n");
+	nk_net_ethernet_release_packet(packet);
 	goto launch_receive;
     }
 
@@ -284,6 +710,12 @@ struct nk_net_ethernet_arper * nk_net_ethernet_arper_create(struct nk_net_ethern
     
     ARPER_LIST_LOCK();
     list_add(&a->node,&arper_list);
+    // the cache only needs aging once there is something to fill it
+    if (!arp_aging) {
+	arp_aging = 1;
+	nk_timer_set(arp_timer,ARP_AGE_INTERVAL_NS,NK_TIMER_CALLBACK,age_cache,0,0);
+	nk_timer_start(arp_timer);
+    }
     ARPER_LIST_UNLOCK();
 
     // now we issue a receive to get the ball rolling
@@ -339,6 +771,11 @@ int nk_net_ethernet_arper_add(struct nk_net_ethernet_arper *a, ipv4_addr_t ip_ad
 
     ARPER_UNLOCK(a);
 
+    // announce the new address so that neighbors can preload it
+    if (send_request(a,ip_addr,ip_addr)) {
+	DEBUG("Failed to announce " IPSTR "\n", IPLIST(ip_addr));
+    }
+
     return 0;
 }
 
@@ -368,256 +805,268 @@ int nk_net_ethernet_arper_remove(struct nk_net_ethernet_arper *a, uint32_t ip_ad
 }
 
 
-static struct addr_pair arp_cache[MAX_ARP_CACHE_PAIRS];
-
-// lock must be held
-static struct addr_pair *find_pair_in_cache_by_mac_addr(ethernet_mac_addr_t mac)
+int nk_net_ethernet_arp_preload(ipv4_addr_t ip_addr, ethernet_mac_addr_t mac_addr)
 {
-    int i;
-
-    for (i=0;i<MAX_ARP_CACHE_PAIRS;i++) {
-	if (arp_cache[i].state==INUSE && !memcmp(&arp_cache[i].mac_addr,mac,ETHER_MAC_LEN)) {
-	    return &arp_cache[i];
-	}
-    }
-    return 0;
+    return learn(ip_addr,mac_addr,1);
 }
 
-// lock must be held
-static struct addr_pair *find_oldest_pair_in_cache()
+int nk_net_ethernet_arp_lookup(struct nk_net_ethernet_arper *arper, ipv4_addr_t ip_addr, ethernet_mac_addr_t mac_addr)
 {
-    int i;
-    struct addr_pair *cur = 0;
-
-    for (i=0;i<MAX_ARP_CACHE_PAIRS;i++) {
-	if (arp_cache[i].state==INUSE) {
-	    if (!cur) {
-		cur = &arp_cache[i];
-	    } else {
-		if (cur->time_ns < arp_cache[i].time_ns) {
-		    cur = &arp_cache[i];
-		}
-	    }
+    struct arp_entry *e;
+    uint64_t now;
+    int stale;
+    
+    ARP_CACHE_LOCK_CONF;
+    
+    if (!cache_lookup(ip_addr,mac_addr,&stale)) {
+	if (!stale) {
+	    DEBUG("ARP request found in cache\n");
+	    return 0;
+	}
+	// revalidate it, unless someone beat us to it
+	now = nk_sched_get_realtime();
+	ARP_CACHE_LOCK();
+	e = find_entry(ip_addr);
+	stale = e && e->state == ARP_STALE && now - e->requested_ns >= ARP_RETRANSMIT_NS;
+	if (stale) {
+	    entry_write_begin(e);
+	    e->requested_ns = now;
+	    entry_write_end(e);
 	}
+	ARP_CACHE_UNLOCK();
+	if (stale) {
+	    DEBUG("ARP request found in cache but is stale - revalidating\n");
+	    send_lookup_requests(arper,ip_addr);
+	}
+	return 0;
     }
-    return cur;
-}
 
-// lock must be held
-static struct addr_pair *find_pair_in_cache_by_ip_addr(ipv4_addr_t ip)
-{
-    int i;
+    now = nk_sched_get_realtime();
 
-    for (i=0;i<MAX_ARP_CACHE_PAIRS;i++) {
-	if (arp_cache[i].state==INUSE && arp_cache[i].ip_addr==ip) {
-	    return &arp_cache[i];
-	}
-    }
-    return 0;
-}
+    ARP_CACHE_LOCK();
 
-// lock must be held
-static struct addr_pair *find_waiting_pair_in_cache_by_ip_addr(ipv4_addr_t ip)
-{
-    int i;
+    e = find_entry(ip_addr);
 
-    for (i=0;i<MAX_ARP_CACHE_PAIRS;i++) {
-	if (arp_cache[i].state==WAITING && arp_cache[i].ip_addr==ip) {
-	    return &arp_cache[i];
+    if (e) {
+	if (e->state == ARP_REACHABLE || e->state == ARP_STALE) {
+	    // lost a race with an update
+	    memcpy(mac_addr,e->mac_addr,ETHER_MAC_LEN);
+	    ARP_CACHE_UNLOCK();
+	    return 0;
+	}
+	// incomplete
+	if (e->requests >= ARP_MAX_REQUESTS) {
+	    ARP_CACHE_UNLOCK();
+	    DEBUG("ARP request for " IPSTR " has gone unanswered\n", IPLIST(ip_addr));
+	    return -1;
+	}
+	if (now - e->requested_ns < ARP_RETRANSMIT_NS) {
+	    ARP_CACHE_UNLOCK();
+	    DEBUG("ARP request for " IPSTR " already outstanding\n", IPLIST(ip_addr));
+	    return 1;
+	}
+    } else {
+	DEBUG("ARP request not found in cache\n");
+	if (!(e = alloc_entry(ip_addr,ARP_INCOMPLETE))) {
+	    ARP_CACHE_UNLOCK();
+	    ERROR("ARP cache is full of outstanding requests\n");
+	    return -1;
 	}
     }
-    return 0;
-}
 
-// lock must be held
-static struct addr_pair *alloc_pair_in_cache()
-{
-    int i;
+    entry_write_begin(e);
+    e->requested_ns = now;
+    e->requests++;
+    entry_write_end(e);
+    
+    ARP_CACHE_UNLOCK();
 
-    for (i=0;i<MAX_ARP_CACHE_PAIRS;i++) {
-	if (arp_cache[i].state==FREE) {
-	    arp_cache[i].state=ALLOCED;
-	    return &arp_cache[i];
-	}
+    // We now need to launch a request
+
+    if (send_lookup_requests(arper,ip_addr)) {
+	return -1;
     }
-    return 0;
+
+    return 1; // try again
 }
 
-// lock must be held
-static void free_pair_in_cache(struct addr_pair *pair)
+static int generation_changed(void *state)
 {
-    pair->state=FREE;
+    return arp_generation != (uint64_t)state;
 }
 
-static void time_out_cache()
+int nk_net_ethernet_arp_resolve(struct nk_net_ethernet_arper *arper, ipv4_addr_t ip_addr, ethernet_mac_addr_t mac_addr, uint64_t timeout_ns)
 {
-    int i;
+    uint64_t start = nk_sched_get_realtime();
+    uint64_t gen;
+    int rc;
 
-    uint64_t now = nk_sched_get_realtime();
+    while (1) {
+	gen = arp_generation;
 
-    if (now<ARP_ENTRY_TIMEOUT_NS) {
-	return;
-    }
+	rc = nk_net_ethernet_arp_lookup(arper,ip_addr,mac_addr);
+
+	if (rc<=0) {
+	    return rc;
+	}
 
-    for (i=0;i<MAX_ARP_CACHE_PAIRS;i++) {
-	if (arp_cache[i].time_ns<(now - ARP_ENTRY_TIMEOUT_NS)) {
-	    arp_cache[i].state=FREE;
+	if (timeout_ns && nk_sched_get_realtime() - start >= timeout_ns) {
+	    return 1;
 	}
+
+	// wait for a response, or for the aging timer, after which
+	// the lookup will send another request if one is due
+	atomic_inc(arp_waiters);
+	nk_wait_queue_sleep_extended(arp_waitq,generation_changed,(void*)gen);
+	atomic_dec(arp_waiters);
     }
 }
 
-static struct addr_pair *select_victim()
+void nk_net_ethernet_arp_dump()
 {
-    struct addr_pair *p;
+    static const char *states[] = { "free", "incomplete", "reachable", "stale" };
+    uint64_t now = nk_sched_get_realtime();
+    struct arp_entry *e;
+    int i;
 
-    p = alloc_pair_in_cache();
+    ARP_CACHE_LOCK_CONF;
 
-    if (!p) {
-	time_out_cache();
-	p = alloc_pair_in_cache();
-	if (!p) {
-	    p = find_oldest_pair_in_cache();
-	    if (!p) { 
-		  uint64_t r;
-		  nk_get_rand_bytes((uint8_t*)&r,sizeof(r));
-		  p = &arp_cache[r % MAX_ARP_CACHE_PAIRS];
-	    }
+    ARP_CACHE_LOCK();
+    for (i=0;i<ARP_CACHE_BUCKETS;i++) {
+	for (e = arp_hash[i]; e; e = e->next) {
+	    nk_vc_printf(IPSTR " " MACSTR " %-10s confirmed %lu ms ago, %u requests\n",
+			 IPLIST(e->ip_addr), MACLIST(e->mac_addr), states[e->state],
+			 e->confirmed_ns ? (now - e->confirmed_ns)/1000000 : 0, e->requests);
 	}
     }
-
-    p->state = ALLOCED;
-
-    return p;
+    ARP_CACHE_UNLOCK();
 }
 
-int nk_net_ethernet_arp_lookup(struct nk_net_ethernet_arper *arper, ipv4_addr_t ip_addr, ethernet_mac_addr_t mac_addr)
-{
-    if (!arper) {
-	int count=0;
-	int rc=0;
-	struct list_head *cur;
-
-	ARPER_LIST_LOCK_CONF;
-	ARPER_LIST_LOCK();
-
-	list_for_each(cur,&arper_list) {
-	    count++;
-	    struct nk_net_ethernet_arper *a = list_entry(cur,struct nk_net_ethernet_arper, node);
-	    int thisrc;
-	    thisrc = nk_net_ethernet_arp_lookup(a,ip_addr,mac_addr);
-	    if (!thisrc) {
-		rc = 0;
-		goto out;
-	    } else if (thisrc<0) {
-		rc = -1;
-		goto out;
-	    } else {
-		rc|=thisrc;
-	    }
-	}
 
-    out:
-	ARPER_LIST_UNLOCK();
-	
-	return count==0 ? -1 : rc;
-    }
-	
+//
+// Lookup cost with every cpu looking up at once, through the lock-free
+// fast path and, for comparison, with the cache lock held
+//
 
-    uint64_t now = nk_sched_get_realtime();
-    
-    ARP_CACHE_LOCK_CONF;
-    
-    ARP_CACHE_LOCK();
+#define BENCH_ENTRIES 256
+#define BENCH_BASE    0x0a010000
 
-    struct addr_pair *p = find_pair_in_cache_by_ip_addr(ip_addr);
+static int bench_setup(void **state)
+{
+    ethernet_mac_addr_t mac = { 0x02, 0, 0, 0, 0, 0 };
+    uint32_t i;
 
-    
-    if (p) {
-	if (now <= ARP_ENTRY_TIMEOUT_NS || (p->time_ns > (now - ARP_ENTRY_TIMEOUT_NS))) {
-	    // we have an entry and it is new enough
-	    memcpy(mac_addr,p->mac_addr,ETHER_MAC_LEN);
-	    ARP_CACHE_UNLOCK();
-	    DEBUG("ARP request found in cache\n");
-	    return 0;
-	} else {
-	    DEBUG("ARP request found in cache but is too old\n");
-	    // continue to launch packet
+    for (i=0;i<BENCH_ENTRIES;i++) {
+	mac[4] = i >> 8;
+	mac[5] = i;
+	if (nk_net_ethernet_arp_preload(BENCH_BASE+i,mac)) {
+	    return -1;
 	}
-    } else {
-	DEBUG("ARP request not found in cache - selecting victim\n");
-	p = select_victim();
     }
 
-    p->ip_addr = ip_addr;
-    p->state = WAITING;
-    
-    ARP_CACHE_UNLOCK();
-
-    // We now need to launch a request
-
-    
-    nk_ethernet_packet_t *pk = nk_net_ethernet_alloc_packet(-1);
-    
-    if (!pk) {
-	ERROR("Failed to allocate packet\n");
-	return -1;
-    }
+    return 0;
+}
 
-    memset(pk->header.dst,0xff,ETHER_MAC_LEN);
+static void bench_teardown(void *state)
+{
+    struct arp_entry *e;
+    uint32_t i;
 
-    struct nk_net_dev_characteristics c;
-    
-    nk_net_dev_get_characteristics(arper->netdev,&c);
+    ARP_CACHE_LOCK_CONF;
 
-    ARPER_LOCK_CONF;
+    ARP_CACHE_LOCK();
+    for (i=0;i<BENCH_ENTRIES;i++) {
+	if ((e = find_entry(BENCH_BASE+i))) {
+	    free_entry(e);
+	}
+    }
+    ARP_CACHE_UNLOCK();
+}
 
-    ARPER_LOCK(arper);
-    struct addr_pair *my_pair = find_pair_by_mac_addr(arper,c.mac);
-    ipv4_addr_t my_addr = my_pair ? my_pair->ip_addr : 0;
-    ARPER_UNLOCK(arper);
-    
-    memcpy(pk->header.src,c.mac,ETHER_MAC_LEN);
+static uint64_t bench_lookup(void *state, int cpu)
+{
+    static uint32_t next[NAUT_CONFIG_MAX_CPUS];
+    ethernet_mac_addr_t mac;
+    uint64_t start, end;
 
-    pk->header.type = htons(0x0806);
+    start = rdtsc();
+    nk_net_ethernet_arp_lookup(0,BENCH_BASE + (next[cpu]++ % BENCH_ENTRIES),mac);
+    end = rdtsc();
 
-    nk_net_ethernet_arp_reqresp_t *r = (nk_net_ethernet_arp_reqresp_t*)pk->data;
+    return end - start;
+}
 
-    DEBUG("Constructing request for ip address 0x%x\n",ip_addr);
-    
-    r->htype = htons(1);
-    r->ptype = htons(0x0800);
-    r->hlen = 6;
-    r->plen = 4;
-    r->oper = htons(1); // request
-    memcpy(r->sha,c.mac,ETHER_MAC_LEN);
-    r->spa = htonl(my_addr);
-    memset(r->tha,0,ETHER_MAC_LEN);
-    r->tpa = htonl(ip_addr);
+static uint64_t bench_lookup_locked(void *state, int cpu)
+{
+    static uint32_t next[NAUT_CONFIG_MAX_CPUS];
+    ethernet_mac_addr_t mac;
+    struct arp_entry *e;
+    uint64_t start, end;
 
-    pk->len = 14 + 28;
+    ARP_CACHE_LOCK_CONF;
 
-    // now launch packet - we don't need to wait or be informed
-    // eventually, we may get back a response, and that
-    // response will be via the receive callback
-    if (nk_net_ethernet_agent_device_send_packet(arper->netdev,
-						 pk,
-						 NK_DEV_REQ_NONBLOCKING,
-						 0, 0)) {
-	    ERROR("Failed to launch ARP request\n");
-	    return -1;
+    start = rdtsc();
+    ARP_CACHE_LOCK();
+    if ((e = find_entry(BENCH_BASE + (next[cpu]++ % BENCH_ENTRIES)))) {
+	memcpy(mac,e->mac_addr,ETHER_MAC_LEN);
     }
+    ARP_CACHE_UNLOCK();
+    end = rdtsc();
 
-    DEBUG("ARP Request launched\n");
-
-    return 1; // try again
+    return end - start;
 }
 
+static struct nk_bench_impl arp_lookup_impl = {
+    .name     = "ethernet_arp_lookup",
+    .unit     = "cycles",
+    .flags    = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,
+    .reps     = 100000,
+    .warmup   = 1000,
+    .setup    = bench_setup,
+    .run      = bench_lookup,
+    .teardown = bench_teardown,
+};
+nk_register_bench(arp_lookup_impl);
+
+static struct nk_bench_impl arp_lookup_locked_impl = {
+    .name     = "ethernet_arp_lookup_locked",
+    .unit     = "cycles",
+    .flags    = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,
+    .reps     = 100000,
+    .warmup   = 1000,
+    .setup    = bench_setup,
+    .run      = bench_lookup_locked,
+    .teardown = bench_teardown,
+};
+nk_register_bench(arp_lookup_locked_impl);
+
 
 int  nk_net_ethernet_arp_init()
 {
+    int i;
+
     spinlock_init(&arper_list_lock);
     INIT_LIST_HEAD(&arper_list);
 
+    spinlock_init(&arp_cache_lock);
+
+    arp_free = 0;
+    for (i=ARP_CACHE_ENTRIES-1;i>=0;i--) {
+	arp_cache[i].next = arp_free;
+	arp_free = &arp_cache[i];
+    }
+
+    if (!(arp_waitq = nk_wait_queue_create("arp"))) {
+	ERROR("Cannot create wait queue\n");
+	return -1;
+    }
+
+    if (!(arp_timer = nk_timer_create("arp-aging"))) {
+	ERROR("Cannot create timer\n");
+	nk_wait_queue_destroy(arp_waitq);
+	return -1;
+    }
+
     INFO("inited\n");
 
     return 0;
@@ -640,8 +1089,9 @@ void nk_net_ethernet_arp_deinit()
 	
     ARPER_LIST_UNLOCK();
 
+    nk_timer_cancel(arp_timer);
+    nk_timer_destroy(arp_timer);
+    nk_wait_queue_destroy(arp_waitq);
+
     INFO("deinited\n");
 }
-	
-
-
@@ -25,20 +25,27 @@
 #include <nautilus/list.h>
 #include <nautilus/spinlock.h>
 #include <nautilus/netdev.h>
+#include <nautilus/shell.h>
 #include <net/ethernet/ethernet_packet.h>
+#include <test/test.h>
 
-// right now this is a trivial implementation that just has a single pool
-// in the future, this could expand to a per-cpu pool
+// Packets are carved out of page-backed slabs, and handed out through
+// per-CPU caches of magazines (arrays of packets), backed by a shared
+// depot of full and empty magazines.  A CPU allocates from and releases
+// to its own cache with interrupts off and without locking, and visits
+// the depot only to trade a whole magazine.  A packet released on a
+// different CPU than it was allocated on just joins that CPU's cache.
+//
+// Slabs are not returned to the kernel until deinit, so the pool stays
+// at its high-water mark.
 
+#define POOL_INIT_SIZE   (NAUT_CONFIG_NET_ETHERNET_PACKET_POOL_SIZE)
+#define MAG_SIZE         (NAUT_CONFIG_NET_ETHERNET_PACKET_MAGAZINE_SIZE)
 
-// not currently a Kconfig option
-#define NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE 256
-
-#define NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE 256
-
-#define POOL_INIT_START  (NAUT_CONFIG_NET_ETHERNET_INIT_POOL_SIZE)
-#define POOL_INIT_LOW    (POOL_INIT_START/2)
-#define POOL_INIT_HIGH   (POOL_INIT_LOW*3)
+// the allocator rounds up to a power of two, so we fill one exactly
+#define SLAB_SIZE        (256*1024)
+#define SLAB_PACKETS     (SLAB_SIZE/sizeof(nk_ethernet_packet_t))
+#define MAX_SLABS        1024
 
 #ifndef NAUT_CONFIG_DEBUG_NET_ETHERNET_PACKET
 #undef DEBUG_PRINT
@@ -49,76 +56,238 @@
 #define DEBUG(fmt, args...) DEBUG_PRINT("ethernet_packet: " fmt, ##args)
 #define INFO(fmt, args...) INFO_PRINT("ethernet_packet: " fmt, ##args)
 
-static spinlock_t       lock;
-static struct list_head free_list;
-// the invariant here is that high=2*low
-static uint64_t         free_list_len, free_list_low, free_list_high;
+#define DEPOT_LOCK_CONF uint8_t _depot_lock_flags
+#define DEPOT_LOCK() _depot_lock_flags = spin_lock_irq_save(&depot.lock)
+#define DEPOT_UNLOCK() spin_unlock_irq_restore(&depot.lock, _depot_lock_flags)
+
+struct magazine {
+    struct list_head      node;    // in the depot
+    uint64_t              count;
+    nk_ethernet_packet_t  *pkts[MAG_SIZE];
+};
+
+struct pkt_cache {
+    struct magazine  *loaded;      // we allocate from and release to this one
+    struct magazine  *prev;        // and swap with this one before going to the depot
+    uint64_t         allocs;
+    uint64_t         releases;
+    uint64_t         depot_trips;
+} __attribute__((aligned(64)));
+
+struct slab {
+    nk_ethernet_packet_t *start;
+    nk_ethernet_packet_t *end;
+};
+
+static struct {
+    spinlock_t        lock;
+    struct list_head  full;
+    struct list_head  empty;
+    uint64_t          num_full;
+    uint64_t          num_empty;
+    uint64_t          num_packets;
+} depot;
 
-// called with lock held
-static void try_grow_if_needed()
+static struct pkt_cache *caches;
+static int              num_caches;
+
+// every slab, so deinit can free them
+static struct slab      slabs[MAX_SLABS];
+static volatile uint64_t num_slabs;
+
+
+static struct magazine *mag_alloc(void)
 {
-    if (free_list_len<free_list_low) {
-	// We will set a new midpoint at double the old midpoint
-	// and we will double the upper and lower control thresholds
-	uint64_t needed = ((2*free_list_high-2*free_list_low)/2)-free_list_len;
-	uint64_t i;
-
-	for (i=0;i<needed;i++) {
-	    nk_ethernet_packet_t *p = malloc(sizeof(nk_ethernet_packet_t));
-	    if (!p) {
-		break;
-	    }
-	    INIT_LIST_HEAD(&p->node);
-	    list_add_tail(&p->node,&free_list);
-	    p->alloc_cpu = -1;
-	    p->refcount = 0;
-	    free_list_len++;
+    struct magazine *m = malloc(sizeof(struct magazine));
+
+    if (m) {
+	INIT_LIST_HEAD(&m->node);
+	m->count = 0;
+    }
+    return m;
+}
+
+// called with depot lock held
+static struct magazine *depot_get(struct list_head *l, uint64_t *n)
+{
+    struct magazine *m;
+
+    if (list_empty(l)) {
+	return 0;
+    }
+    m = list_first_entry(l, struct magazine, node);
+    list_del_init(&m->node);
+    (*n)--;
+    return m;
+}
+
+// called with depot lock held
+static void depot_put(struct list_head *l, uint64_t *n, struct magazine *m)
+{
+    list_add(&m->node, l);
+    (*n)++;
+}
+
+// Carve a new slab into magazines of packets, along with as many
+// empty magazines, so that releases always find somewhere to go
+static int grow(int cpu)
+{
+    DEPOT_LOCK_CONF;
+    nk_ethernet_packet_t *pkts;
+    struct list_head full, empty;
+    uint64_t i, nmags = (SLAB_PACKETS + MAG_SIZE - 1) / MAG_SIZE;
+    struct magazine *m = 0;
+
+    pkts = malloc_specific(SLAB_SIZE, cpu);
+    if (!pkts) {
+	ERROR("Cannot allocate packet slab\n");
+	return -1;
+    }
+
+    INIT_LIST_HEAD(&full);
+    INIT_LIST_HEAD(&empty);
+
+    for (i = 0; i < 2*nmags; i++) {
+	if (!(m = mag_alloc())) {
+	    ERROR("Cannot allocate magazines for packet slab\n");
+	    goto out_err;
+	}
+	list_add(&m->node, i < nmags ? &full : &empty);
+    }
+
+    m = list_first_entry(&full, struct magazine, node);
+    for (i = 0; i < SLAB_PACKETS; i++) {
+	nk_ethernet_packet_t *p = &pkts[i];
+	INIT_LIST_HEAD(&p->node);
+	p->alloc_cpu = cpu;
+	p->refcount = 0;
+	if (m->count == MAG_SIZE) {
+	    m = list_next_entry(&m->node, struct magazine, node);
 	}
+	m->pkts[m->count++] = p;
+    }
+
+    DEPOT_LOCK();
+    if (num_slabs < MAX_SLABS) {
+	slabs[num_slabs].start = pkts;
+	slabs[num_slabs].end = pkts + SLAB_PACKETS;
+	__sync_synchronize();
+	num_slabs++;
+    }
+    list_splice_init(&full, &depot.full);
+    list_splice_init(&empty, &depot.empty);
+    depot.num_full += nmags;
+    depot.num_empty += nmags;
+    depot.num_packets += SLAB_PACKETS;
+    DEPOT_UNLOCK();
 
-	// we may not be able to allocate that many...
-	// i now contains the number we actually allocated, so now update
-	// the control thresholds to match
+    DEBUG("grew pool by %lu packets\n", SLAB_PACKETS);
 
-	free_list_low = free_list_len/2;
-	free_list_high = free_list_len*2;
+    return 0;
+
+ out_err:
+    list_splice_init(&empty, &full);
+    while (!list_empty(&full)) {
+	m = list_first_entry(&full, struct magazine, node);
+	list_del_init(&m->node);
+	free(m);
     }
+    free(pkts);
+    return -1;
 }
-	
-nk_ethernet_packet_t *nk_net_ethernet_alloc_packet(int cpu)
+
+// The loaded magazine is empty.  Swap in the previous one if it has
+// packets, otherwise trade an empty magazine for a full one at the depot.
+// Called with interrupts off.
+static void cache_reload(struct pkt_cache *c)
 {
-    struct list_head *cur=0;
-    nk_ethernet_packet_t *p=0;
-    int first=1;
+    DEPOT_LOCK_CONF;
+    struct magazine *m;
 
- retry:
-    spin_lock(&lock);
-    if (!list_empty(&free_list)) {
-	cur = free_list.next;
-	list_del_init(cur);
-	free_list_len--;
+    if (c->prev->count) {
+	m = c->loaded; c->loaded = c->prev; c->prev = m;
+	return;
     }
-    try_grow_if_needed();
-    spin_unlock(&lock);
-    
-    if (!cur) {
-	if (first) {
-	    first=0;
-	    goto retry;
-	} else {
-	    ERROR("Failed to grow packet pool?!\n");
-	    p = (nk_ethernet_packet_t *)malloc_specific(sizeof(nk_ethernet_packet_t),cpu);
+
+    DEPOT_LOCK();
+    m = depot_get(&depot.full, &depot.num_full);
+    if (m) {
+	depot_put(&depot.empty, &depot.num_empty, c->prev);
+	c->prev = c->loaded;
+	c->loaded = m;
+	c->depot_trips++;
+    }
+    DEPOT_UNLOCK();
+}
+
+// The loaded magazine is full.  Swap in the previous one if it is
+// empty, otherwise trade a full magazine for an empty one at the depot.
+// Called with interrupts off.  Returns -1 if there is nowhere to put packets.
+static int cache_unload(struct pkt_cache *c)
+{
+    DEPOT_LOCK_CONF;
+    struct magazine *m;
+
+    if (!c->prev->count) {
+	m = c->loaded; c->loaded = c->prev; c->prev = m;
+	return 0;
+    }
+
+    DEPOT_LOCK();
+    m = depot_get(&depot.empty, &depot.num_empty);
+    DEPOT_UNLOCK();
+
+    if (!m) {
+	// cannot happen as grow() keeps enough empties around, but
+	// better to allocate than to lose the packet
+	m = mag_alloc();
+	if (!m) {
+	    return -1;
 	}
-    } else {
-	p = list_entry(cur,nk_ethernet_packet_t, node);
     }
 
-    if (!p) {
-	ERROR("Failed to allocate packet!\n");
-	return p;
+    DEPOT_LOCK();
+    depot_put(&depot.full, &depot.num_full, c->prev);
+    DEPOT_UNLOCK();
+
+    c->prev = c->loaded;
+    c->loaded = m;
+    c->depot_trips++;
+
+    return 0;
+}
+
+nk_ethernet_packet_t *nk_net_ethernet_alloc_packet(int cpu)
+{
+    nk_ethernet_packet_t *p=0;
+    struct pkt_cache *c;
+    uint8_t flags;
+    int grown=0;
+
+    while (!p) {
+	flags = irq_disable_save();
+	c = &caches[my_cpu_id()];
+	if (!c->loaded->count) {
+	    cache_reload(c);
+	}
+	if (c->loaded->count) {
+	    p = c->loaded->pkts[--c->loaded->count];
+	    c->allocs++;
+	}
+	irq_enable_restore(flags);
+
+	if (!p) {
+	    // others may beat us to the new slab, so we try a few times
+	    if (grown++ == 3 || grow(cpu)) {
+		ERROR("Failed to allocate packet!\n");
+		return 0;
+	    }
+	}
     }
 
     INIT_LIST_HEAD(&p->node);
     p->refcount = 1;
+    memset(&p->info,0,sizeof(p->info));
 
     return p;
     
@@ -131,57 +300,153 @@ void nk_net_ethernet_acquire_packet(nk_ethernet_packet_t *p)
 
 void nk_net_ethernet_release_packet(nk_ethernet_packet_t *p)
 {
+    struct pkt_cache *c;
+    uint8_t flags;
+
     if (__sync_fetch_and_sub(&p->refcount,1)==1) {
 	// the packet is now ready to be freed
-	spin_lock(&lock);
-	if (free_list_len<free_list_high) {
-	    // add it to the front of the list since it's probably all in
-	    // cache now, and so the next allocator will be able to take advantage
-	    list_add(&p->node,&free_list);
-	    free_list_len++;
-	    spin_unlock(&lock);
-	} else {
-	    spin_unlock(&lock);
-	    // just free it - we already have too many packets
-	    free(p);
-	    // we would possibly shrink the pool here...
+	flags = irq_disable_save();
+	c = &caches[my_cpu_id()];
+	if (c->loaded->count == MAG_SIZE && cache_unload(c)) {
+	    irq_enable_restore(flags);
+	    ERROR("Nowhere to put packet %p - leaking it\n", p);
+	    return;
 	}
+	// it goes on top, since it's probably all in cache now, and so
+	// the next allocator will be able to take advantage
+	c->loaded->pkts[c->loaded->count++] = p;
+	c->releases++;
+	irq_enable_restore(flags);
     }
 }
-	
 
+static int handle_netpkt(char * buf, void * priv)
+{
+    DEPOT_LOCK_CONF;
+    int i;
+
+    if (!caches) {
+	nk_vc_printf("packet pool not initialized\n");
+	return 0;
+    }
+
+    DEPOT_LOCK();
+    nk_vc_printf("%lu packets in %lu slabs, depot has %lu full and %lu empty magazines of %d\n",
+		 depot.num_packets, num_slabs, depot.num_full, depot.num_empty, MAG_SIZE);
+    DEPOT_UNLOCK();
+
+    for (i = 0; i < num_caches; i++) {
+	struct pkt_cache *c = &caches[i];
+	nk_vc_printf("cpu %3d: %lu+%lu cached, %lu allocs, %lu releases, %lu depot trips\n",
+		     i, c->loaded->count, c->prev->count, c->allocs, c->releases, c->depot_trips);
+    }
 
+    return 0;
+}
+
+static struct shell_cmd_impl netpkt_impl = {
+    .cmd      = "netpkt",
+    .help_str = "netpkt (packet pool statistics)",
+    .handler  = handle_netpkt,
+};
+nk_register_shell_cmd(netpkt_impl);
+
+
+// Allocate and release a packet.  Run on all CPUs at once, this shows
+// how packet turnover scales, which the old global pool did not.
+static uint64_t packet_bench(void * state, int cpu)
+{
+    uint64_t start, end;
+    nk_ethernet_packet_t *p;
+
+    start = rdtsc();
+    p = nk_net_ethernet_alloc_packet(-1);
+    if (p) {
+	nk_net_ethernet_release_packet(p);
+    }
+    end = rdtsc();
+
+    return end - start;
+}
+
+static struct nk_bench_impl packet_bench_impl = {
+    .name     = "ethernet_packet",
+    .unit     = "cycles",
+    .flags    = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,
+    .reps     = 10000,
+    .warmup   = 100,
+    .run      = packet_bench,
+};
+nk_register_bench(packet_bench_impl);
 
 
 int  nk_net_ethernet_packet_init()
 {
     uint64_t i;
 
-    spinlock_init(&lock);
-    INIT_LIST_HEAD(&free_list);
+    spinlock_init(&depot.lock);
+    INIT_LIST_HEAD(&depot.full);
+    INIT_LIST_HEAD(&depot.empty);
+    depot.num_full = depot.num_empty = depot.num_packets = 0;
+    num_slabs = 0;
 
-    free_list_len = 0;
-    free_list_low = POOL_INIT_LOW;
-    free_list_high = POOL_INIT_HIGH;
+    num_caches = nk_get_num_cpus();
+    caches = malloc(num_caches * sizeof(struct pkt_cache));
+    if (!caches) {
+	ERROR("Cannot allocate packet caches\n");
+	return -1;
+    }
+    memset(caches, 0, num_caches * sizeof(struct pkt_cache));
 
-    try_grow_if_needed();
+    for (i = 0; i < num_caches; i++) {
+	caches[i].loaded = mag_alloc();
+	caches[i].prev = mag_alloc();
+	if (!caches[i].loaded || !caches[i].prev) {
+	    ERROR("Cannot allocate packet magazines\n");
+	    return -1;
+	}
+    }
+
+    while (depot.num_packets < POOL_INIT_SIZE) {
+	if (grow(-1)) {
+	    break;
+	}
+    }
     
-    INFO("inited and seeded with %lu packets of size %lu (low=%lu, high=%lu)\n",free_list_len, MAX_ETHERNET_PACKET_LEN, free_list_low, free_list_high);
+    INFO("inited and seeded with %lu packets of size %lu (%lu per slab, %d per magazine)\n",
+	 depot.num_packets, MAX_ETHERNET_PACKET_LEN, SLAB_PACKETS, MAG_SIZE);
 
     return 0;
 }
 
 void nk_net_ethernet_packet_deinit()
 {
-    spin_lock(&lock);
-    struct list_head *cur, *tmp;
+    DEPOT_LOCK_CONF;
+    struct magazine *m;
+    uint64_t i;
 
-    list_for_each_safe(cur,tmp,&free_list) {
-	nk_ethernet_packet_t *p= list_entry(cur,nk_ethernet_packet_t,node);
-	list_del_init(cur);
-	free(p);
+    // outstanding packets become invalid
+    DEPOT_LOCK();
+    while ((m = depot_get(&depot.full, &depot.num_full))) {
+	free(m);
     }
-    INFO("deinited\n");
-}
+    while ((m = depot_get(&depot.empty, &depot.num_empty))) {
+	free(m);
+    }
+    for (i = 0; i < num_slabs; i++) {
+	free(slabs[i].start);
+    }
+    num_slabs = 0;
+    depot.num_packets = 0;
+    DEPOT_UNLOCK();
 
+    for (i = 0; i < num_caches; i++) {
+	free(caches[i].loaded);
+	free(caches[i].prev);
+    }
+    free(caches);
+    caches = 0;
+    num_caches = 0;
 
+    INFO("deinited\n");
+}
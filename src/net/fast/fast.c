@@ -0,0 +1,2624 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+#include <nautilus/nautilus.h>
+#include <nautilus/list.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/netdev.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/timer.h>
+#include <nautilus/shell.h>
+#include <test/test.h>
+#include <net/ethernet/ethernet_packet.h>
+#include <net/ethernet/ethernet_agent.h>
+#include <net/ethernet/ethernet_arp.h>
+#include <net/fast/fast.h>
+
+#ifndef NAUT_CONFIG_DEBUG_NET_FAST
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("net_fast: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("net_fast: " fmt, ##args)
+#define INFO(fmt, args...) INFO_PRINT("net_fast: " fmt, ##args)
+
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+
+#define IPSTR "%u.%u.%u.%u"
+#define IPLIST(x) ((x)>>24)&0xff, ((x)>>16)&0xff, ((x)>>8)&0xff, (x)&0xff
+
+// How it fits together
+//
+// Every endpoint is in the demultiplexing tables of an interface,
+// which are kept per cpu.  A connection is in the table of the cpu its
+// segments arrive on, which, with an agent sharded by flow, is always
+// the same one.  When they start arriving elsewhere, the connection
+// moves over, so steady state lookups only ever touch the local table.
+// Listeners and UDP sockets, which any cpu may need, are in all of
+// them.
+//
+// A received frame is handled to completion where it lands: it is
+// validated, looked up, run through TCP, and its data handed to the
+// application, which typically answers from the callback.  To keep a
+// connection's callbacks in order without holding a lock across them,
+// whoever is handling a connection "owns" it, and frames for it that
+// arrive meanwhile wait on its backlog for the owner to get to them.
+//
+// Frames to our own address never touch the device.  The sender
+// delivers them itself, unless it is already delivering, in which case
+// they are queued for the delivery loop further up its stack.  So a
+// request and its reply run to completion in the sender's call, without
+// recursing, and without a thread switch.
+//
+// The TCP is minimal: in-order receive only (anything else is dropped
+// and answered with a duplicate ACK), go-back-N retransmission on a
+// backed-off timeout, and no congestion control.  It is meant for
+// request/response traffic within a cluster, not for the wide area.
+
+#define FAST_BUCKET_BITS    8
+#define FAST_BUCKETS        (1 << FAST_BUCKET_BITS)
+
+// receives kept posted with the agent
+#define FAST_RECV_POSTED    16
+
+// ports we pick, which stay clear of LWIP's (0xc000 and up)
+#define FAST_PORT_MIN       32768
+#define FAST_PORT_MAX       49151
+
+// payloads smaller than this are copied, as that is cheaper than a gather
+#define FAST_GATHER_MIN     256
+
+#define FAST_TTL            64
+#define FAST_RESOLVE_NS     1000000000ULL
+
+#define TCP_MSS             1460
+#define TCP_DEFAULT_MSS     536
+#define TCP_WND             65535    // we consume data as it arrives
+#define TCP_TICK_NS         10000000ULL
+#define TCP_RTO_NS          200000000ULL
+#define TCP_RTO_MAX_NS      8000000000ULL
+#define TCP_RETRIES         8
+#define TCP_SYN_RETRIES     5
+#define TCP_TIME_WAIT_NS    1000000000ULL
+#define TCP_OUTPUT_SEGS     16
+
+#define ETHERTYPE_IPV4      0x0800
+#define IP_PROTO_TCP        6
+#define IP_PROTO_UDP        17
+#define IP_DF               0x4000
+#define IP_FRAG_MASK        0x3fff
+#define LOOPBACK_NET        0x7f000000
+#define LOOPBACK_MASK       0xff000000
+
+#define TCP_FIN             0x01
+#define TCP_SYN             0x02
+#define TCP_RST             0x04
+#define TCP_PSH             0x08
+#define TCP_ACK             0x10
+
+#define SEQ_LT(a,b)  ((sint32_t)((a)-(b)) < 0)
+#define SEQ_LEQ(a,b) ((sint32_t)((a)-(b)) <= 0)
+#define SEQ_GT(a,b)  ((sint32_t)((a)-(b)) > 0)
+#define SEQ_GEQ(a,b) ((sint32_t)((a)-(b)) >= 0)
+
+typedef struct ip_hdr {
+    uint8_t     vhl;
+    uint8_t     tos;
+    uint16_t    len;
+    uint16_t    id;
+    uint16_t    frag;
+    uint8_t     ttl;
+    uint8_t     proto;
+    uint16_t    csum;
+    ipv4_addr_t src;
+    ipv4_addr_t dst;
+} __packed ip_hdr_t;
+
+typedef struct udp_hdr {
+    uint16_t    sport;
+    uint16_t    dport;
+    uint16_t    len;
+    uint16_t    csum;
+} __packed udp_hdr_t;
+
+typedef struct tcp_hdr {
+    uint16_t    sport;
+    uint16_t    dport;
+    uint32_t    seq;
+    uint32_t    ack;
+    uint8_t     off;
+    uint8_t     flags;
+    uint16_t    wnd;
+    uint16_t    csum;
+    uint16_t    urg;
+} __packed tcp_hdr_t;
+
+#define IP_OFFSET   ETHERNET_HEADER_LEN
+#define L4_OFFSET   (IP_OFFSET + sizeof(ip_hdr_t))
+#define UDP_HLEN    (L4_OFFSET + sizeof(udp_hdr_t))
+#define TCP_HLEN    (L4_OFFSET + sizeof(tcp_hdr_t))
+#define TCP_OPT_MSS 4
+
+enum { PROTO_UDP = 0, PROTO_TCP = 1 };
+
+struct fast_sock;
+
+struct fast_bind {
+    struct list_head  node;
+    struct fast_sock *sock;
+};
+
+// What the tables point to, at the start of sockets and connections
+struct fast_sock {
+    int                    proto;    // PROTO_*
+    uint16_t               lport;
+    ipv4_addr_t            rip;      // 0 => any, for listeners and UDP
+    uint16_t               rport;
+    uint64_t               refcount;
+    struct nk_net_fast_if *fi;
+    int                    home;     // cpu whose table has it, -1 => all
+    struct fast_bind      *binds;    // one, or one per cpu
+    void                   (*destroy)(struct fast_sock *s);
+};
+
+struct fast_cpu {
+    spinlock_t        lock;
+    struct list_head  buckets[FAST_BUCKETS];
+    uint64_t          received;
+    uint64_t          migrated;      // connections pulled in from another cpu
+} __attribute__((aligned(64)));
+
+struct nk_net_fast_if {
+    char                          name[DEV_NAME_LEN];
+    struct list_head              node;
+
+    ipv4_addr_t                   ip;
+    ipv4_addr_t                   netmask;
+    ipv4_addr_t                   gateway;
+    ethernet_mac_addr_t           mac;
+
+    struct nk_net_ethernet_agent *agent;     // 0 => loopback only
+    struct nk_net_dev            *agentdev;  // our filter on the agent
+    struct nk_net_dev            *netdev;    // the device under it, for gathers
+    int                           tx_sg;
+    int                           tx_csum;
+    uint32_t                      mss;
+    uint32_t                      max_udp;
+
+    int                           num_cpus;
+    struct fast_cpu              *cpus;
+
+    // how many endpoints use each port, for the agent's filter
+    uint16_t                     *port_users[2];
+
+    spinlock_t                    lock;      // ports, connections
+    uint16_t                      next_port;
+    uint64_t                      num_socks;
+    struct list_head              conns;
+
+    // frames to ourselves
+    spinlock_t                    lo_lock;
+    struct list_head              lo_queue;
+    int                           lo_draining;
+
+    volatile int                  dying;
+
+    uint64_t                      rx_dropped;
+    uint64_t                      rx_bad;
+    uint64_t                      tx_failed;
+    uint64_t                      rexmits;
+};
+
+struct nk_net_fast_udp {
+    struct fast_sock        sock;   // must be first
+    nk_net_fast_udp_recv_t  recv;
+    void                   *state;
+    volatile int            closed;
+    // the last peer heard from, which a reply goes to without a lookup
+    spinlock_t              peer_lock;
+    ipv4_addr_t             peer_ip;
+    ethernet_mac_addr_t     peer_mac;
+};
+
+typedef enum {
+    TCP_CLOSED=0,
+    TCP_LISTEN,
+    TCP_SYN_SENT,
+    TCP_SYN_RCVD,
+    TCP_ESTABLISHED,
+    TCP_FIN_WAIT_1,
+    TCP_FIN_WAIT_2,
+    TCP_CLOSE_WAIT,
+    TCP_CLOSING,
+    TCP_LAST_ACK,
+    TCP_TIME_WAIT
+} tcp_state_t;
+
+static char *tcp_state_names[] = { "CLOSED", "LISTEN", "SYN_SENT", "SYN_RCVD", "ESTABLISHED",
+				   "FIN_WAIT_1", "FIN_WAIT_2", "CLOSE_WAIT", "CLOSING",
+				   "LAST_ACK", "TIME_WAIT" };
+
+// events for the owner of a connection to deliver
+#define EV_ACCEPT    0x1
+#define EV_CONNECTED 0x2
+#define EV_EOF       0x4
+#define EV_CLOSED    0x8
+
+// A buffer handed to send, referenced by the send queue until it is
+// acknowledged, and by each gather of it the device has not finished
+struct tx_buf {
+    struct list_head         node;
+    struct nk_net_fast_tcp  *c;
+    uint8_t                 *buf;
+    uint32_t                 len;
+    uint32_t                 seq;   // of buf[0]
+    uint64_t                 refcount;
+};
+
+struct nk_net_fast_tcp {
+    struct fast_sock            sock;      // must be first
+    struct fast_bind            bind;
+    struct list_head            node;      // the interface's connections
+    spinlock_t                  lock;
+
+    tcp_state_t                 state;
+    ethernet_mac_addr_t         rmac;      // next hop
+    int                         loopback;
+
+    // send side
+    uint32_t                    iss;
+    uint32_t                    snd_una;
+    uint32_t                    snd_nxt;
+    uint32_t                    snd_end;   // after the last byte queued
+    uint32_t                    snd_wnd;
+    uint32_t                    mss;
+    int                         syn_pending;
+    int                         fin_queued;  // the FIN is at snd_end
+    int                         probe;       // the window is closed, poke it
+    struct list_head            sndq;        // tx_bufs not yet acknowledged
+    struct list_head            done;        // ... and those that now are
+    uint64_t                    rto_ns;
+    uint64_t                    rtx_at;      // 0 => no timer
+    int                         retries;
+
+    // receive side
+    uint32_t                    rcv_nxt;
+    int                         ack_now;
+    uint64_t                    time_wait_until;
+
+    // the application, and delivering to it
+    struct nk_net_fast_tcp_ops  ops;
+    void                       *arg;       // the application's state
+    struct nk_net_fast_tcp     *listener;    // until accepted
+    int                         accepted;    // the application has it
+    int                         app_closed;
+    int                         finished;    // out of the tables
+    int                         owned;
+    struct nk_thread           *owner;
+    struct list_head            backlog;
+    int                         events;
+    int                         error;
+};
+
+static spinlock_t       fast_lock;
+static struct list_head fast_ifs;
+static int              fast_timer_running;
+
+
+//
+// Checksums
+//
+// These sum in memory order, so the (folded) result can be stored
+// straight into a header field
+//
+static inline uint64_t csum_add(uint64_t sum, void *buf, uint32_t len)
+{
+    uint8_t *p = (uint8_t *)buf;
+
+    while (len >= 8) {
+	sum += (uint64_t)*(uint32_t *)p + *(uint32_t *)(p+4);
+	p += 8;
+	len -= 8;
+    }
+    while (len >= 2) {
+	sum += *(uint16_t *)p;
+	p += 2;
+	len -= 2;
+    }
+    if (len) {
+	sum += *p;
+    }
+    return sum;
+}
+
+static inline uint16_t csum_fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static inline uint64_t csum_pseudo(ip_hdr_t *ip, uint8_t proto, uint32_t len)
+{
+    return (uint64_t)ip->src + ip->dst + htons((uint16_t)proto) + htons((uint16_t)len);
+}
+
+// Fill in the TCP or UDP checksum, at offset field of the header at l4,
+// for the header and the data after it, which need not be contiguous
+// with it.  A device that offloads checksums is left to do the summing
+static void l4_csum(struct nk_net_fast_if *fi, ip_hdr_t *ip, uint8_t proto,
+		    void *l4, uint32_t hlen, uint32_t field_off,
+		    void *data, uint32_t len, struct nk_net_dev_pkt_info *info)
+{
+    uint16_t *field = (uint16_t *)((uint8_t *)l4 + field_off);
+    uint64_t sum = csum_pseudo(ip,proto,hlen+len);
+    uint16_t csum;
+
+    if (fi->tx_csum) {
+	*field = csum_fold(sum);
+	info->flags = NK_NET_PKT_CSUM_PARTIAL;
+	info->csum_start = L4_OFFSET;
+	info->csum_offset = field_off;
+	return;
+    }
+
+    *field = 0;
+    sum = csum_add(sum,l4,hlen);
+    sum = csum_add(sum,data,len);
+    csum = ~csum_fold(sum);
+    if (!csum && proto == IP_PROTO_UDP) {
+	csum = 0xffff;   // 0 means there is none
+    }
+    *field = csum;
+}
+
+
+//
+// Addresses and frames
+//
+static inline int is_loopback(struct nk_net_fast_if *fi, ipv4_addr_t ip)
+{
+    return !fi->agent || ip == fi->ip || (ip & LOOPBACK_MASK) == LOOPBACK_NET;
+}
+
+static inline int is_local(struct nk_net_fast_if *fi, ipv4_addr_t ip)
+{
+    return ip == fi->ip || (ip & LOOPBACK_MASK) == LOOPBACK_NET;
+}
+
+static inline ipv4_addr_t next_hop(struct nk_net_fast_if *fi, ipv4_addr_t ip)
+{
+    if ((ip & fi->netmask) == (fi->ip & fi->netmask) || !fi->gateway) {
+	return ip;
+    } else {
+	return fi->gateway;
+    }
+}
+
+// Write the ethernet and IP headers of a frame carrying l4_len bytes
+static ip_hdr_t *build_ip(struct nk_net_fast_if *fi, uint8_t *frame, ethernet_mac_addr_t dmac,
+			  ipv4_addr_t dst, uint8_t proto, uint32_t l4_len)
+{
+    ip_hdr_t *ip = (ip_hdr_t *)(frame + IP_OFFSET);
+
+    memcpy(frame,dmac,ETHER_MAC_LEN);
+    memcpy(frame+ETHER_MAC_LEN,fi->mac,ETHER_MAC_LEN);
+    *(uint16_t *)(frame+2*ETHER_MAC_LEN) = htons(ETHERTYPE_IPV4);
+
+    ip->vhl = 0x45;
+    ip->tos = 0;
+    ip->len = htons((uint16_t)(sizeof(ip_hdr_t) + l4_len));
+    ip->id = 0;        // never fragmented, see RFC 6864
+    ip->frag = htons(IP_DF);
+    ip->ttl = FAST_TTL;
+    ip->proto = proto;
+    ip->csum = 0;
+    // talking to 127/8 is done from the same address
+    ip->src = htonl((dst & LOOPBACK_MASK) == LOOPBACK_NET ? dst : fi->ip);
+    ip->dst = htonl(dst);
+    ip->csum = ~csum_fold(csum_add(0,ip,sizeof(ip_hdr_t)));
+
+    return ip;
+}
+
+static void fast_input(struct nk_net_fast_if *fi, nk_ethernet_packet_t *p, int from_lo);
+
+// Deliver a frame to ourselves.  Only the outermost delivery on the
+// interface runs the loop, so a reply sent from a callback is queued
+// behind the frame that caused it instead of being handled inside it
+static void lo_xmit(struct nk_net_fast_if *fi, nk_ethernet_packet_t *p)
+{
+    uint8_t flags;
+
+    p->info.flags = NK_NET_PKT_CSUM_VALID;
+
+    flags = spin_lock_irq_save(&fi->lo_lock);
+    list_add_tail(&p->node,&fi->lo_queue);
+    if (fi->lo_draining) {
+	spin_unlock_irq_restore(&fi->lo_lock,flags);
+	return;
+    }
+    fi->lo_draining = 1;
+    while (!list_empty(&fi->lo_queue)) {
+	p = list_first_entry(&fi->lo_queue,nk_ethernet_packet_t,node);
+	list_del_init(&p->node);
+	spin_unlock_irq_restore(&fi->lo_lock,flags);
+	fast_input(fi,p,1);
+	nk_net_ethernet_release_packet(p);
+	flags = spin_lock_irq_save(&fi->lo_lock);
+    }
+    fi->lo_draining = 0;
+    spin_unlock_irq_restore(&fi->lo_lock,flags);
+}
+
+// Send a complete frame, which we give up either way
+static int xmit(struct nk_net_fast_if *fi, nk_ethernet_packet_t *p, int loopback)
+{
+    if (loopback) {
+	lo_xmit(fi,p);
+	return 0;
+    }
+    if (nk_net_ethernet_agent_device_send_packet(fi->agentdev,p,NK_DEV_REQ_NONBLOCKING,0,0)) {
+	DEBUG("Failed to send frame\n");
+	nk_net_ethernet_release_packet(p);
+	atomic_inc(fi->tx_failed);
+	return -1;
+    }
+    return 0;
+}
+
+
+//
+// Ports and the demultiplexing tables
+//
+static inline uint32_t sock_hash(int proto, uint16_t lport, ipv4_addr_t rip, uint16_t rport)
+{
+    uint32_t h = (rip ^ ((uint32_t)rport << 16) ^ lport ^ ((uint32_t)proto << 31)) * 0x9e3779b1;
+    return h >> (32 - FAST_BUCKET_BITS);
+}
+
+static inline int sock_match(struct fast_sock *s, int proto, uint16_t lport, ipv4_addr_t rip, uint16_t rport)
+{
+    return s->lport == lport && s->rip == rip && s->rport == rport && s->proto == proto;
+}
+
+static struct fast_sock *table_find(struct fast_cpu *c, int proto, uint16_t lport, ipv4_addr_t rip, uint16_t rport)
+{
+    struct fast_bind *b;
+
+    list_for_each_entry(b,&c->buckets[sock_hash(proto,lport,rip,rport)],node) {
+	if (sock_match(b->sock,proto,lport,rip,rport)) {
+	    return b->sock;
+	}
+    }
+    return 0;
+}
+
+static inline void sock_get(struct fast_sock *s)
+{
+    atomic_inc(s->refcount);
+}
+
+static inline void sock_put(struct fast_sock *s)
+{
+    if (!atomic_dec_val(s->refcount)) {
+	s->destroy(s);
+    }
+}
+
+// Find who gets a segment, and take a reference to it.  A connection
+// that is not in the local table may be in another cpu's, in which
+// case it moves here
+static struct fast_sock *demux(struct nk_net_fast_if *fi, int proto, uint16_t lport, ipv4_addr_t rip, uint16_t rport)
+{
+    int cpu = my_cpu_id();
+    struct fast_cpu *c = &fi->cpus[cpu];
+    struct fast_cpu *r;
+    struct fast_sock *s;
+    uint8_t flags;
+    int i;
+
+    if (proto == PROTO_TCP) {
+	flags = spin_lock_irq_save(&c->lock);
+	c->received++;
+	if ((s = table_find(c,proto,lport,rip,rport))) {
+	    sock_get(s);
+	    spin_unlock_irq_restore(&c->lock,flags);
+	    return s;
+	}
+	spin_unlock_irq_restore(&c->lock,flags);
+
+	for (i=0;i<fi->num_cpus;i++) {
+	    if (i == cpu) {
+		continue;
+	    }
+	    r = &fi->cpus[i];
+	    flags = irq_disable_save();
+	    // the tables are locked in cpu order
+	    if (i < cpu) {
+		spin_lock(&r->lock);
+		spin_lock(&c->lock);
+	    } else {
+		spin_lock(&c->lock);
+		spin_lock(&r->lock);
+	    }
+	    if ((s = table_find(r,proto,lport,rip,rport)) ||
+		(s = table_find(c,proto,lport,rip,rport))) {
+		if (s->home == i) {
+		    list_del(&s->binds[0].node);
+		    list_add(&s->binds[0].node,&c->buckets[sock_hash(proto,lport,rip,rport)]);
+		    s->home = cpu;
+		    c->migrated++;
+		    DEBUG("Moved connection on port %u from cpu %d to cpu %d\n",lport,i,cpu);
+		}
+		sock_get(s);
+	    }
+	    spin_unlock(&r->lock);
+	    spin_unlock(&c->lock);
+	    irq_enable_restore(flags);
+	    if (s) {
+		return s;
+	    }
+	}
+    }
+
+    flags = spin_lock_irq_save(&c->lock);
+    if (proto == PROTO_UDP) {
+	c->received++;
+    }
+    if ((s = table_find(c,proto,lport,0,0))) {
+	sock_get(s);
+    }
+    spin_unlock_irq_restore(&c->lock,flags);
+
+    return s;
+}
+
+// A connection goes in the local table, anything else in all of them
+// The table holds a reference
+static void bind_sock(struct nk_net_fast_if *fi, struct fast_sock *s)
+{
+    uint32_t h = sock_hash(s->proto,s->lport,s->rip,s->rport);
+    uint8_t flags;
+    int i;
+
+    sock_get(s);
+
+    if (s->rip) {
+	flags = irq_disable_save();
+	s->home = my_cpu_id();
+	spin_lock(&fi->cpus[s->home].lock);
+	list_add(&s->binds[0].node,&fi->cpus[s->home].buckets[h]);
+	spin_unlock(&fi->cpus[s->home].lock);
+	irq_enable_restore(flags);
+    } else {
+	s->home = -1;
+	for (i=0;i<fi->num_cpus;i++) {
+	    s->binds[i].sock = s;
+	    flags = spin_lock_irq_save(&fi->cpus[i].lock);
+	    list_add(&s->binds[i].node,&fi->cpus[i].buckets[h]);
+	    spin_unlock_irq_restore(&fi->cpus[i].lock,flags);
+	}
+    }
+}
+
+// The caller must still have a reference besides the table's
+static void unbind_sock(struct nk_net_fast_if *fi, struct fast_sock *s)
+{
+    uint8_t flags;
+    int i, cpu;
+
+    if (s->rip) {
+	// it may be moving while we look
+	while (1) {
+	    cpu = s->home;
+	    flags = spin_lock_irq_save(&fi->cpus[cpu].lock);
+	    if (s->home == cpu) {
+		list_del_init(&s->binds[0].node);
+		spin_unlock_irq_restore(&fi->cpus[cpu].lock,flags);
+		break;
+	    }
+	    spin_unlock_irq_restore(&fi->cpus[cpu].lock,flags);
+	}
+    } else {
+	for (i=0;i<fi->num_cpus;i++) {
+	    flags = spin_lock_irq_save(&fi->cpus[i].lock);
+	    list_del_init(&s->binds[i].node);
+	    spin_unlock_irq_restore(&fi->cpus[i].lock,flags);
+	}
+    }
+
+    sock_put(s);
+}
+
+// Claim a port, or pick one if port is 0.  Listeners and UDP sockets
+// need the port to themselves, while connections accepted by a listener
+// share its port.  Returns the port, or 0 if it is taken
+static uint16_t port_claim(struct nk_net_fast_if *fi, int proto, uint16_t port, int shared)
+{
+    uint16_t *users = fi->port_users[proto];
+    uint8_t flags;
+    int i;
+
+    flags = spin_lock_irq_save(&fi->lock);
+    if (!port) {
+	for (i=0;i<=FAST_PORT_MAX-FAST_PORT_MIN;i++) {
+	    if (fi->next_port < FAST_PORT_MIN || fi->next_port > FAST_PORT_MAX) {
+		fi->next_port = FAST_PORT_MIN;
+	    }
+	    if (!users[fi->next_port]) {
+		port = fi->next_port++;
+		break;
+	    }
+	    fi->next_port++;
+	}
+    } else if (users[port] && !shared) {
+	port = 0;
+    }
+    if (port) {
+	users[port]++;
+	fi->num_socks++;
+    }
+    spin_unlock_irq_restore(&fi->lock,flags);
+
+    return port;
+}
+
+static void port_release(struct nk_net_fast_if *fi, int proto, uint16_t port)
+{
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&fi->lock);
+    fi->port_users[proto][port]--;
+    fi->num_socks--;
+    spin_unlock_irq_restore(&fi->lock,flags);
+}
+
+
+//
+// UDP
+//
+static void udp_free(struct fast_sock *s)
+{
+    free(s->binds);
+    free(s);
+}
+
+static void udp_input(struct nk_net_fast_if *fi, nk_ethernet_packet_t *p, ip_hdr_t *ip,
+		      udp_hdr_t *u, uint32_t len, int csum_ok, int from_lo)
+{
+    struct nk_net_fast_udp *s;
+    ipv4_addr_t src = ntohl(ip->src);
+    uint8_t flags;
+
+    if (len < sizeof(udp_hdr_t) || ntohs(u->len) < sizeof(udp_hdr_t) || ntohs(u->len) > len) {
+	atomic_inc(fi->rx_bad);
+	return;
+    }
+    len = ntohs(u->len);
+
+    if (!csum_ok && u->csum &&
+	csum_fold(csum_add(csum_pseudo(ip,IP_PROTO_UDP,len),u,len)) != 0xffff) {
+	DEBUG("Bad UDP checksum\n");
+	atomic_inc(fi->rx_bad);
+	return;
+    }
+
+    if (!(s = (struct nk_net_fast_udp *)demux(fi,PROTO_UDP,ntohs(u->dport),0,0))) {
+	atomic_inc(fi->rx_dropped);
+	return;
+    }
+
+    if (!s->closed) {
+	if (!from_lo && s->peer_ip != src) {
+	    flags = spin_lock_irq_save(&s->peer_lock);
+	    s->peer_ip = src;
+	    memcpy(s->peer_mac,p->header.src,ETHER_MAC_LEN);
+	    spin_unlock_irq_restore(&s->peer_lock,flags);
+	    if (next_hop(fi,src) == src) {
+		nk_net_ethernet_arp_preload(src,p->header.src);
+	    }
+	}
+	s->recv(s,src,ntohs(u->sport),u+1,len-sizeof(udp_hdr_t),s->state);
+    }
+
+    sock_put(&s->sock);
+}
+
+struct nk_net_fast_udp *nk_net_fast_udp_open(struct nk_net_fast_if *fi,
+					     uint16_t port,
+					     nk_net_fast_udp_recv_t recv,
+					     void *state)
+{
+    struct nk_net_fast_udp *s;
+
+    if (!recv) {
+	ERROR("A UDP socket needs a receive callback\n");
+	return 0;
+    }
+
+    s = malloc(sizeof(*s));
+    if (!s) {
+	ERROR("Cannot allocate UDP socket\n");
+	return 0;
+    }
+    memset(s,0,sizeof(*s));
+
+    s->sock.binds = malloc(sizeof(struct fast_bind)*fi->num_cpus);
+    if (!s->sock.binds) {
+	ERROR("Cannot allocate UDP socket\n");
+	free(s);
+	return 0;
+    }
+
+    if (!(port = port_claim(fi,PROTO_UDP,port,0))) {
+	ERROR("UDP port is in use\n");
+	free(s->sock.binds);
+	free(s);
+	return 0;
+    }
+
+    s->sock.proto = PROTO_UDP;
+    s->sock.lport = port;
+    s->sock.fi = fi;
+    s->sock.refcount = 1;
+    s->sock.destroy = udp_free;
+    s->recv = recv;
+    s->state = state;
+    spinlock_init(&s->peer_lock);
+
+    bind_sock(fi,&s->sock);
+
+    DEBUG("Opened UDP socket on port %u of %s\n",port,fi->name);
+
+    return s;
+}
+
+uint16_t nk_net_fast_udp_port(struct nk_net_fast_udp *s)
+{
+    return s->sock.lport;
+}
+
+int nk_net_fast_udp_sendto(struct nk_net_fast_udp *s,
+			   ipv4_addr_t ip,
+			   uint16_t port,
+			   void *data,
+			   uint32_t len)
+{
+    struct nk_net_fast_if *fi = s->sock.fi;
+    ethernet_mac_addr_t mac;
+    nk_ethernet_packet_t *p;
+    ip_hdr_t *iph;
+    udp_hdr_t *u;
+    int lo = is_loopback(fi,ip);
+    uint8_t flags;
+    int rc;
+
+    if (len > fi->max_udp) {
+	ERROR("UDP payload of %u bytes is too large\n",len);
+	return -1;
+    }
+
+    if (!lo) {
+	rc = 1;
+	if (s->peer_ip == ip) {
+	    flags = spin_lock_irq_save(&s->peer_lock);
+	    if (s->peer_ip == ip) {
+		memcpy(mac,s->peer_mac,ETHER_MAC_LEN);
+		rc = 0;
+	    }
+	    spin_unlock_irq_restore(&s->peer_lock,flags);
+	}
+	if (rc && (rc = nk_net_ethernet_arp_lookup(0,next_hop(fi,ip),mac))) {
+	    DEBUG("Cannot yet resolve " IPSTR "\n", IPLIST(ip));
+	    return rc;
+	}
+    } else {
+	memcpy(mac,fi->mac,ETHER_MAC_LEN);
+    }
+
+    if (!(p = nk_net_ethernet_alloc_packet(-1))) {
+	ERROR("Cannot allocate packet\n");
+	return -1;
+    }
+
+    iph = build_ip(fi,p->raw,mac,ip,IP_PROTO_UDP,sizeof(udp_hdr_t)+len);
+    u = (udp_hdr_t *)(p->raw + L4_OFFSET);
+    u->sport = htons(s->sock.lport);
+    u->dport = htons(port);
+    u->len = htons((uint16_t)(sizeof(udp_hdr_t)+len));
+    u->csum = 0;
+    memcpy(u+1,data,len);
+    p->len = UDP_HLEN + len;
+
+    if (!lo) {
+	l4_csum(fi,iph,IP_PROTO_UDP,u,sizeof(udp_hdr_t),offsetof(udp_hdr_t,csum),u+1,len,&p->info);
+    }
+
+    return xmit(fi,p,lo);
+}
+
+int nk_net_fast_udp_close(struct nk_net_fast_udp *s)
+{
+    struct nk_net_fast_if *fi = s->sock.fi;
+
+    s->closed = 1;
+    unbind_sock(fi,&s->sock);
+    port_release(fi,PROTO_UDP,s->sock.lport);
+
+    DEBUG("Closed UDP socket on port %u of %s\n",s->sock.lport,fi->name);
+
+    sock_put(&s->sock);
+
+    return 0;
+}
+
+
+//
+// TCP
+//
+static void tcp_free(struct fast_sock *s)
+{
+    free(s);
+}
+
+static struct nk_net_fast_tcp *tcp_alloc(struct nk_net_fast_if *fi, struct nk_net_fast_tcp_ops *ops, void *state)
+{
+    struct nk_net_fast_tcp *c = malloc(sizeof(*c));
+
+    if (!c) {
+	ERROR("Cannot allocate TCP connection\n");
+	return 0;
+    }
+    memset(c,0,sizeof(*c));
+
+    c->sock.proto = PROTO_TCP;
+    c->sock.fi = fi;
+    c->sock.refcount = 1;    // the application's
+    c->sock.binds = &c->bind;
+    c->sock.destroy = tcp_free;
+    c->bind.sock = &c->sock;
+    INIT_LIST_HEAD(&c->bind.node);
+    INIT_LIST_HEAD(&c->node);
+    spinlock_init(&c->lock);
+    INIT_LIST_HEAD(&c->sndq);
+    INIT_LIST_HEAD(&c->done);
+    INIT_LIST_HEAD(&c->backlog);
+    c->ops = *ops;
+    c->arg = state;
+    c->rto_ns = TCP_RTO_NS;
+    c->mss = TCP_DEFAULT_MSS;
+
+    return c;
+}
+
+static uint32_t tcp_iss()
+{
+    static uint32_t salt;
+    return (uint32_t)(rdtsc() >> 4) + atomic_add(salt,64000);
+}
+
+// Put a new connection in the tables and on the timer list
+static void tcp_start(struct nk_net_fast_tcp *c)
+{
+    struct nk_net_fast_if *fi = c->sock.fi;
+    uint8_t flags;
+
+    bind_sock(fi,&c->sock);
+
+    flags = spin_lock_irq_save(&fi->lock);
+    list_add_tail(&c->node,&fi->conns);
+    spin_unlock_irq_restore(&fi->lock,flags);
+}
+
+static void tx_put(struct tx_buf *tb)
+{
+    struct nk_net_fast_tcp *c = tb->c;
+
+    if (!atomic_dec_val(tb->refcount)) {
+	if (c->ops.sent) {
+	    c->ops.sent(c,tb->buf,c->arg);
+	}
+	free(tb);
+	sock_put(&c->sock);
+    }
+}
+
+// The connection is over.  Called with the lock held, and a reference
+// besides the table's
+static void tcp_finish(struct nk_net_fast_tcp *c, int error)
+{
+    struct nk_net_fast_if *fi = c->sock.fi;
+    struct nk_net_fast_tcp *l;
+    uint8_t flags;
+
+    if (c->finished) {
+	return;
+    }
+
+    DEBUG("Connection " IPSTR ":%u <-> %u finished in %s (error %d)\n",
+	  IPLIST(c->sock.rip),c->sock.rport,c->sock.lport,tcp_state_names[c->state],error);
+
+    c->finished = 1;
+    c->state = TCP_CLOSED;
+    c->rtx_at = 0;
+    while (!list_empty(&c->sndq)) {
+	list_move_tail(c->sndq.next,&c->done);
+    }
+
+    unbind_sock(fi,&c->sock);
+
+    flags = spin_lock_irq_save(&fi->lock);
+    list_del_init(&c->node);
+    spin_unlock_irq_restore(&fi->lock,flags);
+
+    port_release(fi,PROTO_TCP,c->sock.lport);
+
+    if (!c->accepted) {
+	// the application never got it
+	c->app_closed = 1;
+	c->events = 0;
+	if ((l = c->listener)) {
+	    c->listener = 0;
+	    sock_put(&l->sock);
+	}
+	sock_put(&c->sock);
+    } else if (!c->app_closed) {
+	c->events |= EV_CLOSED;
+	c->error = error;
+    }
+}
+
+static void tcp_reset_frame(struct nk_net_fast_if *fi, nk_ethernet_packet_t *p, int from_lo);
+
+// Handle a segment for a connection, with its lock held
+// In-order data is left in *data and *len for the caller to hand up
+// Returns nonzero if the segment should be answered with a reset, which
+// the caller sends once the lock is dropped
+static int tcp_process(struct nk_net_fast_tcp *c, nk_ethernet_packet_t *p, void **data, uint32_t *len)
+{
+    ip_hdr_t *ip = (ip_hdr_t *)(p->raw + IP_OFFSET);
+    tcp_hdr_t *t = (tcp_hdr_t *)((uint8_t *)ip + (ip->vhl & 0xf)*4);
+    uint32_t off = (t->off >> 4)*4;
+    uint8_t *payload = (uint8_t *)t + off;
+    uint32_t plen = ntohs(ip->len) - (ip->vhl & 0xf)*4 - off;
+    uint32_t seq = ntohl(t->seq);
+    uint32_t ack = ntohl(t->ack);
+    uint8_t flags = t->flags;
+    uint8_t *opt;
+    struct tx_buf *tb, *tmp;
+    int fin_acked = 0;
+
+    *len = 0;
+
+    if (c->finished) {
+	return 0;
+    }
+
+    if (c->state == TCP_SYN_SENT) {
+	if ((flags & TCP_ACK) && ack != c->iss+1) {
+	    return !(flags & TCP_RST);
+	}
+	if (flags & TCP_RST) {
+	    if (flags & TCP_ACK) {
+		tcp_finish(c,-1);
+	    }
+	    return 0;
+	}
+	if (!(flags & TCP_SYN) || !(flags & TCP_ACK)) {
+	    // no simultaneous opens
+	    return 0;
+	}
+	for (opt = (uint8_t *)(t+1); opt + TCP_OPT_MSS <= payload; ) {
+	    if (opt[0] == 0) {
+		break;
+	    } else if (opt[0] == 1) {
+		opt++;
+	    } else if (opt[0] == 2 && opt[1] == TCP_OPT_MSS) {
+		c->mss = MIN(c->sock.fi->mss, ((uint32_t)opt[2]<<8) | opt[3]);
+		break;
+	    } else if (opt[1] < 2) {
+		break;
+	    } else {
+		opt += opt[1];
+	    }
+	}
+	c->rcv_nxt = seq + 1;
+	c->snd_una = ack;
+	c->snd_wnd = ntohs(t->wnd);
+	c->state = TCP_ESTABLISHED;
+	c->retries = 0;
+	c->rto_ns = TCP_RTO_NS;
+	c->rtx_at = 0;
+	c->ack_now = 1;
+	c->events |= EV_CONNECTED;
+	return 0;
+    }
+
+    if (flags & TCP_RST) {
+	// only an exact hit counts, see RFC 5961
+	if (seq == c->rcv_nxt) {
+	    tcp_finish(c,c->state == TCP_TIME_WAIT ? 0 : -1);
+	}
+	return 0;
+    }
+
+    if (flags & TCP_SYN) {
+	// most likely our SYN+ACK was lost
+	if (c->state == TCP_SYN_RCVD && seq + 1 == c->rcv_nxt) {
+	    c->syn_pending = 1;
+	} else {
+	    c->ack_now = 1;
+	}
+	return 0;
+    }
+
+    if (!(flags & TCP_ACK)) {
+	return 0;
+    }
+
+    if (c->state == TCP_SYN_RCVD) {
+	if (ack != c->iss+1) {
+	    return 1;
+	}
+	c->snd_una = ack;
+	c->state = TCP_ESTABLISHED;
+	c->retries = 0;
+	c->rto_ns = TCP_RTO_NS;
+	c->rtx_at = 0;
+	c->events |= EV_ACCEPT;
+    }
+
+    if (SEQ_GT(ack,c->snd_una) && SEQ_LEQ(ack,c->snd_nxt)) {
+	c->snd_una = ack;
+	list_for_each_entry_safe(tb,tmp,&c->sndq,node) {
+	    if (SEQ_GT(tb->seq+tb->len,ack)) {
+		break;
+	    }
+	    list_move_tail(&tb->node,&c->done);
+	}
+	if (c->fin_queued && ack == c->snd_end+1) {
+	    fin_acked = 1;
+	}
+	c->retries = 0;
+	c->rto_ns = TCP_RTO_NS;
+	c->rtx_at = c->snd_una != c->snd_nxt ? nk_sched_get_realtime() + c->rto_ns : 0;
+    } else if (SEQ_GT(ack,c->snd_nxt)) {
+	c->ack_now = 1;
+	return 0;
+    }
+    c->snd_wnd = ntohs(t->wnd);
+    if (c->snd_wnd) {
+	c->probe = 0;
+    }
+
+    if (fin_acked) {
+	switch (c->state) {
+	case TCP_FIN_WAIT_1:
+	    c->state = TCP_FIN_WAIT_2;
+	    break;
+	case TCP_CLOSING:
+	    c->state = TCP_TIME_WAIT;
+	    c->time_wait_until = nk_sched_get_realtime() + TCP_TIME_WAIT_NS;
+	    break;
+	case TCP_LAST_ACK:
+	    tcp_finish(c,0);
+	    return 0;
+	default:
+	    break;
+	}
+    }
+
+    if (!plen && !(flags & TCP_FIN)) {
+	return 0;
+    }
+
+    if (seq != c->rcv_nxt) {
+	if (SEQ_LT(seq,c->rcv_nxt) && SEQ_GT(seq+plen,c->rcv_nxt)) {
+	    // partly old, keep the new part
+	    payload += c->rcv_nxt - seq;
+	    plen -= c->rcv_nxt - seq;
+	    seq = c->rcv_nxt;
+	} else {
+	    // old or out of order
+	    c->ack_now = 1;
+	    return 0;
+	}
+    }
+
+    if (plen) {
+	if (c->state != TCP_ESTABLISHED && c->state != TCP_FIN_WAIT_1 && c->state != TCP_FIN_WAIT_2) {
+	    return 0;
+	}
+	*data = payload;
+	*len = plen;
+	c->rcv_nxt += plen;
+	c->ack_now = 1;
+    }
+
+    if (flags & TCP_FIN) {
+	c->rcv_nxt++;
+	c->ack_now = 1;
+	c->events |= EV_EOF;
+	switch (c->state) {
+	case TCP_ESTABLISHED:
+	    c->state = TCP_CLOSE_WAIT;
+	    break;
+	case TCP_FIN_WAIT_1:
+	    c->state = TCP_CLOSING;
+	    break;
+	case TCP_FIN_WAIT_2:
+	    c->state = TCP_TIME_WAIT;
+	    c->time_wait_until = nk_sched_get_realtime() + TCP_TIME_WAIT_NS;
+	    break;
+	default:
+	    break;
+	}
+    }
+
+    return 0;
+}
+
+struct tcp_seg {
+    uint32_t       seq;
+    uint32_t       ack;
+    uint16_t       wnd;
+    uint8_t        flags;
+    uint8_t        mss_opt;
+    uint8_t       *data;
+    uint32_t       len;
+    struct tx_buf *tb;      // gathered from, with a reference
+};
+
+// Decide what goes out next, with the lock held
+static int tcp_segments(struct nk_net_fast_tcp *c, struct tcp_seg *segs, int max)
+{
+    struct nk_net_fast_if *fi = c->sock.fi;
+    struct tx_buf *tb;
+    uint32_t win_end, off, len;
+    int n = 0;
+
+    if (c->finished) {
+	return 0;
+    }
+
+    if (c->state == TCP_SYN_SENT || c->state == TCP_SYN_RCVD) {
+	if (c->syn_pending) {
+	    segs[0].seq = c->iss;
+	    segs[0].ack = c->state == TCP_SYN_RCVD ? c->rcv_nxt : 0;
+	    segs[0].flags = TCP_SYN | (c->state == TCP_SYN_RCVD ? TCP_ACK : 0);
+	    segs[0].mss_opt = 1;
+	    segs[0].len = 0;
+	    segs[0].tb = 0;
+	    segs[0].wnd = TCP_WND;
+	    c->syn_pending = 0;
+	    c->snd_nxt = c->iss + 1;
+	    c->rtx_at = nk_sched_get_realtime() + c->rto_ns;
+	    return 1;
+	}
+	return 0;
+    }
+
+    if (c->state != TCP_TIME_WAIT && c->state != TCP_FIN_WAIT_2) {
+	win_end = c->snd_una + (c->probe ? 1 : c->snd_wnd);
+	list_for_each_entry(tb,&c->sndq,node) {
+	    while (n < max && SEQ_LT(c->snd_nxt,tb->seq+tb->len) && SEQ_LT(c->snd_nxt,win_end)) {
+		if (SEQ_LT(c->snd_nxt,tb->seq)) {
+		    break;
+		}
+		off = c->snd_nxt - tb->seq;
+		len = MIN(tb->len - off, c->mss);
+		len = MIN(len, win_end - c->snd_nxt);
+		segs[n].seq = c->snd_nxt;
+		segs[n].flags = TCP_ACK | (off + len == tb->len ? TCP_PSH : 0);
+		segs[n].mss_opt = 0;
+		segs[n].data = tb->buf + off;
+		segs[n].len = len;
+		segs[n].tb = 0;
+		if (fi->tx_sg && !c->loopback && len >= FAST_GATHER_MIN) {
+		    atomic_inc(tb->refcount);
+		    segs[n].tb = tb;
+		}
+		c->snd_nxt += len;
+		n++;
+	    }
+	    if (n == max || SEQ_GEQ(c->snd_nxt,win_end)) {
+		break;
+	    }
+	}
+
+	if (n < max && c->fin_queued && c->snd_nxt == c->snd_end) {
+	    segs[n].seq = c->snd_end;
+	    segs[n].flags = TCP_FIN | TCP_ACK;
+	    segs[n].mss_opt = 0;
+	    segs[n].len = 0;
+	    segs[n].tb = 0;
+	    c->snd_nxt = c->snd_end + 1;
+	    n++;
+	    if (c->state == TCP_ESTABLISHED) {
+		c->state = TCP_FIN_WAIT_1;
+	    } else if (c->state == TCP_CLOSE_WAIT) {
+		c->state = TCP_LAST_ACK;
+	    }
+	}
+    }
+
+    if (!n && c->ack_now) {
+	segs[0].seq = c->snd_nxt;
+	segs[0].flags = TCP_ACK;
+	segs[0].mss_opt = 0;
+	segs[0].len = 0;
+	segs[0].tb = 0;
+	n = 1;
+    }
+
+    if (n) {
+	int i;
+	for (i=0;i<n;i++) {
+	    segs[i].ack = c->rcv_nxt;
+	    segs[i].wnd = TCP_WND;
+	}
+	c->ack_now = 0;
+    }
+
+    if (!c->rtx_at && (c->snd_una != c->snd_nxt || (c->snd_end != c->snd_nxt && !c->snd_wnd))) {
+	c->rtx_at = nk_sched_get_realtime() + c->rto_ns;
+    }
+
+    return n;
+}
+
+static void gather_done(nk_net_dev_status_t status, void *state)
+{
+    nk_ethernet_packet_t *p = (nk_ethernet_packet_t *)state;
+    struct tx_buf *tb = (struct tx_buf *)p->metadata;
+
+    nk_net_ethernet_release_packet(p);
+    tx_put(tb);
+}
+
+static void tcp_xmit(struct nk_net_fast_tcp *c, struct tcp_seg *seg)
+{
+    struct nk_net_fast_if *fi = c->sock.fi;
+    uint32_t hlen = sizeof(tcp_hdr_t) + (seg->mss_opt ? TCP_OPT_MSS : 0);
+    struct nk_net_dev_seg sg[2];
+    nk_ethernet_packet_t *p;
+    ip_hdr_t *ip;
+    tcp_hdr_t *t;
+    uint8_t *opt;
+
+    if (!(p = nk_net_ethernet_alloc_packet(-1))) {
+	ERROR("Cannot allocate packet\n");
+	if (seg->tb) {
+	    tx_put(seg->tb);
+	}
+	return;
+    }
+
+    ip = build_ip(fi,p->raw,c->loopback ? fi->mac : c->rmac,c->sock.rip,IP_PROTO_TCP,hlen+seg->len);
+    t = (tcp_hdr_t *)(p->raw + L4_OFFSET);
+    t->sport = htons(c->sock.lport);
+    t->dport = htons(c->sock.rport);
+    t->seq = htonl(seg->seq);
+    t->ack = htonl(seg->ack);
+    t->off = (hlen/4) << 4;
+    t->flags = seg->flags;
+    t->wnd = htons(seg->wnd);
+    t->csum = 0;
+    t->urg = 0;
+    if (seg->mss_opt) {
+	opt = (uint8_t *)(t+1);
+	opt[0] = 2;
+	opt[1] = TCP_OPT_MSS;
+	opt[2] = fi->mss >> 8;
+	opt[3] = fi->mss & 0xff;
+    }
+    p->len = L4_OFFSET + hlen;
+
+    if (seg->tb) {
+	// the payload goes straight from the application's buffer
+	l4_csum(fi,ip,IP_PROTO_TCP,t,hlen,offsetof(tcp_hdr_t,csum),seg->data,seg->len,&p->info);
+	p->metadata = seg->tb;
+	sg[0].addr = p->raw;
+	sg[0].len = p->len;
+	sg[1].addr = seg->data;
+	sg[1].len = seg->len;
+	if (nk_net_dev_send_packet_sg(fi->netdev,sg,2,&p->info,NK_DEV_REQ_CALLBACK,gather_done,p)) {
+	    DEBUG("Failed to send gathered segment\n");
+	    atomic_inc(fi->tx_failed);
+	    nk_net_ethernet_release_packet(p);
+	    tx_put(seg->tb);
+	}
+	return;
+    }
+
+    if (seg->len) {
+	memcpy(p->raw + p->len,seg->data,seg->len);
+	p->len += seg->len;
+    }
+    if (!c->loopback) {
+	l4_csum(fi,ip,IP_PROTO_TCP,t,hlen,offsetof(tcp_hdr_t,csum),(uint8_t *)t+hlen,seg->len,&p->info);
+    }
+
+    xmit(fi,p,c->loopback);
+}
+
+// Send whatever can go out
+static void tcp_output(struct nk_net_fast_tcp *c)
+{
+    struct tcp_seg segs[TCP_OUTPUT_SEGS];
+    uint8_t flags;
+    int i, n;
+
+    do {
+	flags = spin_lock_irq_save(&c->lock);
+	n = tcp_segments(c,segs,TCP_OUTPUT_SEGS);
+	spin_unlock_irq_restore(&c->lock,flags);
+	for (i=0;i<n;i++) {
+	    tcp_xmit(c,&segs[i]);
+	}
+    } while (n == TCP_OUTPUT_SEGS);
+}
+
+static void tcp_events(struct nk_net_fast_tcp *c, int ev, int error)
+{
+    struct tcp_seg rst = { .flags = TCP_RST | TCP_ACK };
+    struct nk_net_fast_tcp *l;
+    uint8_t flags;
+
+    if (ev & EV_ACCEPT) {
+	flags = spin_lock_irq_save(&c->lock);
+	l = c->listener;
+	c->listener = 0;
+	spin_unlock_irq_restore(&c->lock,flags);
+	if (l) {
+	    if (!l->app_closed && !l->ops.accept(c,l->arg,&c->arg)) {
+		flags = spin_lock_irq_save(&c->lock);
+		c->accepted = 1;
+		if (c->finished && !c->app_closed) {
+		    // it went away while being accepted
+		    ev |= EV_CLOSED;
+		    error = c->error;
+		}
+		spin_unlock_irq_restore(&c->lock,flags);
+	    } else {
+		DEBUG("Connection on port %u refused\n",c->sock.lport);
+		flags = spin_lock_irq_save(&c->lock);
+		tcp_finish(c,-1);
+		rst.seq = c->snd_una;
+		rst.ack = c->rcv_nxt;
+		spin_unlock_irq_restore(&c->lock,flags);
+		tcp_xmit(c,&rst);
+	    }
+	    sock_put(&l->sock);
+	}
+	if (!c->accepted) {
+	    return;
+	}
+    }
+
+    if ((ev & EV_CONNECTED) && !c->app_closed && c->ops.connected) {
+	c->ops.connected(c,c->arg);
+    }
+    if ((ev & EV_EOF) && !c->app_closed && c->ops.recv) {
+	c->ops.recv(c,0,0,c->arg);
+    }
+    if ((ev & EV_CLOSED) && !c->app_closed && c->ops.closed) {
+	c->ops.closed(c,error,c->arg);
+    }
+}
+
+// Hand p (if any) to c, and then run everything that is pending for
+// it, unless someone else already is, in which case p waits for them
+static void tcp_deliver(struct nk_net_fast_tcp *c, nk_ethernet_packet_t *p)
+{
+    struct list_head done;
+    struct tx_buf *tb, *tmp;
+    void *data = 0;
+    uint32_t len;
+    uint8_t flags;
+    int ev, err, reset;
+
+    INIT_LIST_HEAD(&done);
+
+    flags = spin_lock_irq_save(&c->lock);
+    if (p) {
+	nk_net_ethernet_acquire_packet(p);
+	list_add_tail(&p->node,&c->backlog);
+    }
+    if (c->owned) {
+	spin_unlock_irq_restore(&c->lock,flags);
+	return;
+    }
+    c->owned = 1;
+    c->owner = get_cur_thread();
+
+    while (1) {
+	if (!list_empty(&c->done)) {
+	    list_splice_init(&c->done,&done);
+	    spin_unlock_irq_restore(&c->lock,flags);
+	    list_for_each_entry_safe(tb,tmp,&done,node) {
+		list_del(&tb->node);
+		tx_put(tb);
+	    }
+	    flags = spin_lock_irq_save(&c->lock);
+	    continue;
+	}
+	if (c->events) {
+	    ev = c->events;
+	    err = c->error;
+	    c->events = 0;
+	    spin_unlock_irq_restore(&c->lock,flags);
+	    tcp_events(c,ev,err);
+	    tcp_output(c);
+	    flags = spin_lock_irq_save(&c->lock);
+	    continue;
+	}
+	if (!list_empty(&c->backlog)) {
+	    p = list_first_entry(&c->backlog,nk_ethernet_packet_t,node);
+	    list_del_init(&p->node);
+	    reset = tcp_process(c,p,&data,&len);
+	    ev = c->events;
+	    err = c->error;
+	    c->events = 0;
+	    spin_unlock_irq_restore(&c->lock,flags);
+	    if (reset) {
+		tcp_reset_frame(c->sock.fi,p,c->loopback);
+	    }
+	    // an accept or connect comes before the data, and EOF after it
+	    tcp_events(c,ev & ~(EV_EOF | EV_CLOSED),err);
+	    if (len && c->accepted && !c->app_closed && c->ops.recv) {
+		c->ops.recv(c,data,len,c->arg);
+	    }
+	    tcp_events(c,ev & (EV_EOF | EV_CLOSED),err);
+	    nk_net_ethernet_release_packet(p);
+	    tcp_output(c);
+	    flags = spin_lock_irq_save(&c->lock);
+	    continue;
+	}
+	break;
+    }
+
+    c->owned = 0;
+    c->owner = 0;
+    spin_unlock_irq_restore(&c->lock,flags);
+}
+
+// Answer a segment that has nowhere to go
+static void tcp_reset(struct nk_net_fast_if *fi, nk_ethernet_packet_t *in, ip_hdr_t *inip,
+		      tcp_hdr_t *in_t, uint32_t dlen, int from_lo)
+{
+    nk_ethernet_packet_t *p;
+    ip_hdr_t *ip;
+    tcp_hdr_t *t;
+
+    if (in_t->flags & TCP_RST) {
+	return;
+    }
+
+    if (!(p = nk_net_ethernet_alloc_packet(-1))) {
+	return;
+    }
+
+    ip = build_ip(fi,p->raw,from_lo ? fi->mac : in->header.src,ntohl(inip->src),IP_PROTO_TCP,sizeof(tcp_hdr_t));
+    t = (tcp_hdr_t *)(p->raw + L4_OFFSET);
+    t->sport = in_t->dport;
+    t->dport = in_t->sport;
+    if (in_t->flags & TCP_ACK) {
+	t->seq = in_t->ack;
+	t->ack = 0;
+	t->flags = TCP_RST;
+    } else {
+	t->seq = 0;
+	t->ack = htonl(ntohl(in_t->seq) + dlen + !!(in_t->flags & TCP_SYN) + !!(in_t->flags & TCP_FIN));
+	t->flags = TCP_RST | TCP_ACK;
+    }
+    t->off = (sizeof(tcp_hdr_t)/4) << 4;
+    t->wnd = 0;
+    t->csum = 0;
+    t->urg = 0;
+    p->len = TCP_HLEN;
+    if (!from_lo) {
+	l4_csum(fi,ip,IP_PROTO_TCP,t,sizeof(tcp_hdr_t),offsetof(tcp_hdr_t,csum),0,0,&p->info);
+    }
+
+    xmit(fi,p,from_lo);
+}
+
+static void tcp_reset_frame(struct nk_net_fast_if *fi, nk_ethernet_packet_t *p, int from_lo)
+{
+    ip_hdr_t *ip = (ip_hdr_t *)(p->raw + IP_OFFSET);
+    tcp_hdr_t *t = (tcp_hdr_t *)((uint8_t *)ip + (ip->vhl & 0xf)*4);
+
+    tcp_reset(fi,p,ip,t,ntohs(ip->len) - (ip->vhl & 0xf)*4 - (t->off >> 4)*4,from_lo);
+}
+
+// A SYN for a listener makes a new connection, which the application
+// is offered once the handshake completes
+static void tcp_listen_input(struct nk_net_fast_if *fi, struct nk_net_fast_tcp *l, nk_ethernet_packet_t *p,
+			     ip_hdr_t *ip, tcp_hdr_t *t, uint32_t dlen, int from_lo)
+{
+    struct nk_net_fast_tcp *c;
+    uint8_t *opt, *end = (uint8_t *)t + (t->off >> 4)*4;
+
+    if (t->flags & TCP_RST) {
+	return;
+    }
+    if ((t->flags & TCP_ACK) || !(t->flags & TCP_SYN) || l->app_closed) {
+	tcp_reset(fi,p,ip,t,dlen,from_lo);
+	return;
+    }
+
+    if (!(c = tcp_alloc(fi,&l->ops,0))) {
+	return;
+    }
+
+    if (!port_claim(fi,PROTO_TCP,l->sock.lport,1)) {
+	free(c);
+	return;
+    }
+
+    c->sock.lport = l->sock.lport;
+    c->sock.rip = ntohl(ip->src);
+    c->sock.rport = ntohs(t->sport);
+    c->loopback = from_lo;
+    memcpy(c->rmac,p->header.src,ETHER_MAC_LEN);
+
+    for (opt = (uint8_t *)(t+1); opt + TCP_OPT_MSS <= end; ) {
+	if (opt[0] == 0) {
+	    break;
+	} else if (opt[0] == 1) {
+	    opt++;
+	} else if (opt[0] == 2 && opt[1] == TCP_OPT_MSS) {
+	    c->mss = ((uint32_t)opt[2]<<8) | opt[3];
+	    break;
+	} else if (opt[1] < 2) {
+	    break;
+	} else {
+	    opt += opt[1];
+	}
+    }
+    c->mss = MIN(c->mss,fi->mss);
+
+    c->state = TCP_SYN_RCVD;
+    c->rcv_nxt = ntohl(t->seq) + 1;
+    c->iss = tcp_iss();
+    c->snd_una = c->iss;
+    c->snd_nxt = c->iss;
+    c->snd_end = c->iss + 1;
+    c->snd_wnd = ntohs(t->wnd);
+    c->syn_pending = 1;
+
+    sock_get(&l->sock);
+    c->listener = l;
+
+    tcp_start(c);
+
+    DEBUG("SYN from " IPSTR ":%u on port %u\n",IPLIST(c->sock.rip),c->sock.rport,c->sock.lport);
+
+    tcp_output(c);
+}
+
+static void tcp_input(struct nk_net_fast_if *fi, nk_ethernet_packet_t *p, ip_hdr_t *ip,
+		      tcp_hdr_t *t, uint32_t len, int csum_ok, int from_lo)
+{
+    struct nk_net_fast_tcp *c;
+    uint32_t off = (t->off >> 4)*4;
+
+    if (len < sizeof(tcp_hdr_t) || off < sizeof(tcp_hdr_t) || off > len) {
+	atomic_inc(fi->rx_bad);
+	return;
+    }
+
+    if (!csum_ok && csum_fold(csum_add(csum_pseudo(ip,IP_PROTO_TCP,len),t,len)) != 0xffff) {
+	DEBUG("Bad TCP checksum\n");
+	atomic_inc(fi->rx_bad);
+	return;
+    }
+
+    c = (struct nk_net_fast_tcp *)demux(fi,PROTO_TCP,ntohs(t->dport),ntohl(ip->src),ntohs(t->sport));
+
+    if (!c) {
+	atomic_inc(fi->rx_dropped);
+	tcp_reset(fi,p,ip,t,len-off,from_lo);
+	return;
+    }
+
+    if (c->state == TCP_LISTEN) {
+	tcp_listen_input(fi,c,p,ip,t,len-off,from_lo);
+    } else {
+	tcp_deliver(c,p);
+    }
+
+    sock_put(&c->sock);
+}
+
+static void fast_input(struct nk_net_fast_if *fi, nk_ethernet_packet_t *p, int from_lo)
+{
+    ip_hdr_t *ip = (ip_hdr_t *)(p->raw + IP_OFFSET);
+    int csum_ok = p->info.flags & (NK_NET_PKT_CSUM_VALID | NK_NET_PKT_CSUM_PARTIAL);
+    uint32_t ihl, len;
+
+    if (p->len < L4_OFFSET || p->header.type != htons(ETHERTYPE_IPV4) || (ip->vhl >> 4) != 4) {
+	goto bad;
+    }
+
+    ihl = (ip->vhl & 0xf)*4;
+    len = ntohs(ip->len);
+
+    if (ihl < sizeof(ip_hdr_t) || len < ihl || IP_OFFSET + len > p->len ||
+	(ntohs(ip->frag) & IP_FRAG_MASK)) {
+	goto bad;
+    }
+
+    if (!csum_ok && csum_fold(csum_add(0,ip,ihl)) != 0xffff) {
+	goto bad;
+    }
+
+    if (from_lo ? !is_local(fi,ntohl(ip->dst)) : ntohl(ip->dst) != fi->ip) {
+	atomic_inc(fi->rx_dropped);
+	return;
+    }
+
+    switch (ip->proto) {
+    case IP_PROTO_UDP:
+	udp_input(fi,p,ip,(udp_hdr_t *)((uint8_t *)ip + ihl),len - ihl,csum_ok,from_lo);
+	break;
+    case IP_PROTO_TCP:
+	tcp_input(fi,p,ip,(tcp_hdr_t *)((uint8_t *)ip + ihl),len - ihl,csum_ok,from_lo);
+	break;
+    default:
+	atomic_inc(fi->rx_dropped);
+	break;
+    }
+    return;
+
+ bad:
+    DEBUG("Dropping malformed frame\n");
+    atomic_inc(fi->rx_bad);
+}
+
+struct nk_net_fast_tcp *nk_net_fast_tcp_listen(struct nk_net_fast_if *fi,
+					       uint16_t port,
+					       struct nk_net_fast_tcp_ops *ops,
+					       void *state)
+{
+    struct nk_net_fast_tcp *l;
+
+    if (!ops->accept) {
+	ERROR("A listener needs an accept callback\n");
+	return 0;
+    }
+
+    if (!(l = tcp_alloc(fi,ops,state))) {
+	return 0;
+    }
+
+    l->sock.binds = malloc(sizeof(struct fast_bind)*fi->num_cpus);
+    if (!l->sock.binds) {
+	ERROR("Cannot allocate listener\n");
+	free(l);
+	return 0;
+    }
+
+    if (!(port = port_claim(fi,PROTO_TCP,port,0))) {
+	ERROR("TCP port is in use\n");
+	free(l->sock.binds);
+	free(l);
+	return 0;
+    }
+
+    l->sock.lport = port;
+    l->sock.destroy = udp_free;     // same shape
+    l->state = TCP_LISTEN;
+    l->accepted = 1;
+
+    bind_sock(fi,&l->sock);
+
+    DEBUG("Listening on TCP port %u of %s\n",port,fi->name);
+
+    return l;
+}
+
+struct nk_net_fast_tcp *nk_net_fast_tcp_connect(struct nk_net_fast_if *fi,
+						ipv4_addr_t ip,
+						uint16_t port,
+						struct nk_net_fast_tcp_ops *ops,
+						void *state)
+{
+    struct nk_net_fast_tcp *c;
+
+    if (!(c = tcp_alloc(fi,ops,state))) {
+	return 0;
+    }
+
+    c->loopback = is_loopback(fi,ip);
+
+    if (!c->loopback && nk_net_ethernet_arp_resolve(0,next_hop(fi,ip),c->rmac,FAST_RESOLVE_NS)) {
+	ERROR("Cannot resolve " IPSTR "\n",IPLIST(ip));
+	free(c);
+	return 0;
+    }
+
+    if (!(c->sock.lport = port_claim(fi,PROTO_TCP,0,0))) {
+	ERROR("Out of ports\n");
+	free(c);
+	return 0;
+    }
+
+    c->sock.rip = ip;
+    c->sock.rport = port;
+    c->accepted = 1;
+    c->state = TCP_SYN_SENT;
+    c->iss = tcp_iss();
+    c->snd_una = c->iss;
+    c->snd_nxt = c->iss;
+    c->snd_end = c->iss + 1;
+    c->mss = fi->mss;
+    c->syn_pending = 1;
+
+    tcp_start(c);
+
+    DEBUG("Connecting to " IPSTR ":%u from port %u\n",IPLIST(ip),port,c->sock.lport);
+
+    tcp_output(c);
+
+    return c;
+}
+
+int nk_net_fast_tcp_send(struct nk_net_fast_tcp *c, void *buf, uint32_t len)
+{
+    struct tx_buf *tb;
+    uint8_t flags;
+    int ready;
+
+    if (!len) {
+	return 0;
+    }
+
+    if (!(tb = malloc(sizeof(*tb)))) {
+	ERROR("Cannot allocate send\n");
+	return -1;
+    }
+
+    flags = spin_lock_irq_save(&c->lock);
+    if (c->app_closed || c->finished || c->fin_queued ||
+	(c->state != TCP_SYN_SENT && c->state != TCP_ESTABLISHED && c->state != TCP_CLOSE_WAIT)) {
+	spin_unlock_irq_restore(&c->lock,flags);
+	free(tb);
+	return -1;
+    }
+    tb->c = c;
+    tb->buf = (uint8_t *)buf;
+    tb->len = len;
+    tb->seq = c->snd_end;
+    tb->refcount = 1;
+    sock_get(&c->sock);
+    c->snd_end += len;
+    list_add_tail(&tb->node,&c->sndq);
+    ready = c->state != TCP_SYN_SENT;
+    spin_unlock_irq_restore(&c->lock,flags);
+
+    if (ready) {
+	tcp_output(c);
+    }
+
+    return 0;
+}
+
+uint32_t nk_net_fast_tcp_unacked(struct nk_net_fast_tcp *c)
+{
+    // the SYN takes up the first sequence number
+    return SEQ_GT(c->snd_una,c->iss) ? c->snd_end - c->snd_una : c->snd_end - c->iss - 1;
+}
+
+int nk_net_fast_tcp_close(struct nk_net_fast_tcp *c)
+{
+    struct nk_net_fast_if *fi = c->sock.fi;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&c->lock);
+
+    if (c->app_closed) {
+	spin_unlock_irq_restore(&c->lock,flags);
+	ERROR("Connection closed twice\n");
+	return -1;
+    }
+
+    c->app_closed = 1;
+    c->events = 0;
+
+    switch (c->state) {
+    case TCP_LISTEN:
+	spin_unlock_irq_restore(&c->lock,flags);
+	unbind_sock(fi,&c->sock);
+	port_release(fi,PROTO_TCP,c->sock.lport);
+	DEBUG("Stopped listening on port %u of %s\n",c->sock.lport,fi->name);
+	sock_put(&c->sock);
+	return 0;
+    case TCP_SYN_SENT:
+	tcp_finish(c,0);
+	break;
+    case TCP_ESTABLISHED:
+    case TCP_CLOSE_WAIT:
+	c->fin_queued = 1;
+	break;
+    default:
+	break;
+    }
+
+    // a callback running elsewhere finishes before we return
+    while (c->owned && c->owner != get_cur_thread()) {
+	spin_unlock_irq_restore(&c->lock,flags);
+	nk_yield();
+	flags = spin_lock_irq_save(&c->lock);
+    }
+
+    spin_unlock_irq_restore(&c->lock,flags);
+
+    tcp_output(c);
+
+    sock_put(&c->sock);
+
+    return 0;
+}
+
+// A connection's timer has gone off
+static void tcp_timeout(struct nk_net_fast_tcp *c, uint64_t now)
+{
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&c->lock);
+
+    if (c->finished) {
+	spin_unlock_irq_restore(&c->lock,flags);
+	return;
+    }
+
+    if (c->state == TCP_TIME_WAIT) {
+	if (now >= c->time_wait_until) {
+	    tcp_finish(c,0);
+	}
+    } else if (c->rtx_at && now >= c->rtx_at) {
+	c->rtx_at = 0;
+	if (++c->retries > (c->state == TCP_SYN_SENT || c->state == TCP_SYN_RCVD ? TCP_SYN_RETRIES : TCP_RETRIES)) {
+	    DEBUG("Connection to " IPSTR ":%u timed out\n",IPLIST(c->sock.rip),c->sock.rport);
+	    tcp_finish(c,-1);
+	} else {
+	    c->rto_ns = MIN(c->rto_ns*2,TCP_RTO_MAX_NS);
+	    if (c->state == TCP_SYN_SENT || c->state == TCP_SYN_RCVD) {
+		c->syn_pending = 1;
+	    } else {
+		// go back and resend everything unacknowledged
+		c->snd_nxt = c->snd_una;
+		c->probe = !c->snd_wnd;
+	    }
+	    atomic_inc(c->sock.fi->rexmits);
+	}
+    }
+
+    spin_unlock_irq_restore(&c->lock,flags);
+
+    tcp_deliver(c,0);
+    tcp_output(c);
+}
+
+#define TIMER_BATCH 64
+
+static void fast_timer(void *in, void **out)
+{
+    struct nk_net_fast_tcp *due[TIMER_BATCH];
+    struct nk_net_fast_if *fi;
+    struct nk_net_fast_tcp *c;
+    uint64_t now;
+    uint8_t flags, flags2;
+    int i, n;
+
+    nk_thread_name(get_cur_thread(),"net-fast-timer");
+
+    while (1) {
+	nk_sleep(TCP_TICK_NS);
+
+	do {
+	    now = nk_sched_get_realtime();
+	    n = 0;
+	    flags = spin_lock_irq_save(&fast_lock);
+	    list_for_each_entry(fi,&fast_ifs,node) {
+		flags2 = spin_lock_irq_save(&fi->lock);
+		list_for_each_entry(c,&fi->conns,node) {
+		    if (n == TIMER_BATCH) {
+			break;
+		    }
+		    if ((c->rtx_at && now >= c->rtx_at) ||
+			(c->state == TCP_TIME_WAIT && now >= c->time_wait_until)) {
+			sock_get(&c->sock);
+			due[n++] = c;
+		    }
+		}
+		spin_unlock_irq_restore(&fi->lock,flags2);
+	    }
+	    spin_unlock_irq_restore(&fast_lock,flags);
+
+	    for (i=0;i<n;i++) {
+		tcp_timeout(due[i],now);
+		sock_put(&due[i]->sock);
+	    }
+	} while (n == TIMER_BATCH);
+    }
+}
+
+
+//
+// Interfaces
+//
+static int fast_filter(nk_ethernet_packet_t *p, void *state)
+{
+    struct nk_net_fast_if *fi = (struct nk_net_fast_if *)state;
+    ip_hdr_t *ip = (ip_hdr_t *)(p->raw + IP_OFFSET);
+    uint16_t *l4;
+
+    if (p->header.type != htons(ETHERTYPE_IPV4) || ip->dst != htonl(fi->ip) ||
+	(ntohs(ip->frag) & IP_FRAG_MASK)) {
+	return 0;
+    }
+
+    l4 = (uint16_t *)((uint8_t *)ip + (ip->vhl & 0xf)*4);
+
+    switch (ip->proto) {
+    case IP_PROTO_UDP:
+	return fi->port_users[PROTO_UDP][ntohs(l4[1])] != 0;
+    case IP_PROTO_TCP:
+	return fi->port_users[PROTO_TCP][ntohs(l4[1])] != 0;
+    default:
+	return 0;
+    }
+}
+
+static void recv_callback(nk_net_dev_status_t status,
+			  nk_ethernet_packet_t *packet,
+			  void *state)
+{
+    struct nk_net_fast_if *fi = (struct nk_net_fast_if *)state;
+
+    if (status!=NK_NET_DEV_STATUS_SUCCESS) {
+	ERROR("Receive failure\n");
+    } else {
+	fast_input(fi,packet,0);
+    }
+
+    nk_net_ethernet_release_packet(packet);
+
+    if (fi->dying) {
+	return;
+    }
+
+    if (nk_net_ethernet_agent_device_receive_packet(fi->agentdev,
+						    0,
+						    NK_DEV_REQ_CALLBACK,
+						    recv_callback,
+						    fi)) {
+	ERROR("Cannot repost receive\n");
+    }
+}
+
+static void if_free(struct nk_net_fast_if *fi)
+{
+    free(fi->port_users[PROTO_UDP]);
+    free(fi->port_users[PROTO_TCP]);
+    free(fi->cpus);
+    free(fi);
+}
+
+struct nk_net_fast_if *nk_net_fast_if_create(char *name,
+					     struct nk_net_ethernet_agent *agent,
+					     ipv4_addr_t ip,
+					     ipv4_addr_t netmask,
+					     ipv4_addr_t gateway)
+{
+    struct nk_net_dev_characteristics c;
+    struct nk_net_fast_if *fi;
+    uint8_t flags;
+    int i, j, start_timer;
+
+    if (nk_net_fast_if_find(name)) {
+	ERROR("Interface %s already exists\n",name);
+	return 0;
+    }
+
+    fi = malloc(sizeof(*fi));
+    if (!fi) {
+	ERROR("Cannot allocate interface\n");
+	return 0;
+    }
+    memset(fi,0,sizeof(*fi));
+
+    strncpy(fi->name,name,DEV_NAME_LEN);
+    fi->name[DEV_NAME_LEN-1] = 0;
+    fi->ip = ip;
+    fi->netmask = netmask;
+    fi->gateway = gateway;
+    fi->agent = agent;
+    fi->mss = TCP_MSS;
+    fi->max_udp = MAX_ETHERNET_PACKET_DATA_LEN - sizeof(ip_hdr_t) - sizeof(udp_hdr_t);
+    fi->num_cpus = nk_get_num_cpus();
+    fi->next_port = FAST_PORT_MIN;
+    spinlock_init(&fi->lock);
+    spinlock_init(&fi->lo_lock);
+    INIT_LIST_HEAD(&fi->conns);
+    INIT_LIST_HEAD(&fi->lo_queue);
+
+    fi->cpus = malloc(sizeof(struct fast_cpu)*fi->num_cpus);
+    fi->port_users[PROTO_UDP] = malloc(sizeof(uint16_t)*65536);
+    fi->port_users[PROTO_TCP] = malloc(sizeof(uint16_t)*65536);
+
+    if (!fi->cpus || !fi->port_users[PROTO_UDP] || !fi->port_users[PROTO_TCP]) {
+	ERROR("Cannot allocate interface\n");
+	if_free(fi);
+	return 0;
+    }
+
+    memset(fi->port_users[PROTO_UDP],0,sizeof(uint16_t)*65536);
+    memset(fi->port_users[PROTO_TCP],0,sizeof(uint16_t)*65536);
+
+    for (i=0;i<fi->num_cpus;i++) {
+	memset(&fi->cpus[i],0,sizeof(struct fast_cpu));
+	spinlock_init(&fi->cpus[i].lock);
+	for (j=0;j<FAST_BUCKETS;j++) {
+	    INIT_LIST_HEAD(&fi->cpus[i].buckets[j]);
+	}
+    }
+
+    if (agent) {
+	fi->netdev = nk_net_ethernet_agent_get_underlying_device(agent);
+	if (nk_net_dev_get_characteristics(fi->netdev,&c)) {
+	    ERROR("Cannot get device characteristics\n");
+	    if_free(fi);
+	    return 0;
+	}
+	memcpy(fi->mac,c.mac,ETHER_MAC_LEN);
+	fi->tx_sg = !!(c.offloads & NK_NET_DEV_OFFLOAD_SG);
+	fi->tx_csum = !!(c.offloads & NK_NET_DEV_OFFLOAD_TX_CSUM);
+	if (c.max_tu > sizeof(ip_hdr_t) + sizeof(tcp_hdr_t)) {
+	    fi->mss = MIN(fi->mss, c.max_tu - sizeof(ip_hdr_t) - sizeof(tcp_hdr_t));
+	    fi->max_udp = MIN(fi->max_udp, c.max_tu - sizeof(ip_hdr_t) - sizeof(udp_hdr_t));
+	}
+
+	if (!(fi->agentdev = nk_net_ethernet_agent_register_filter(agent,fast_filter,fi))) {
+	    ERROR("Cannot register with agent\n");
+	    if_free(fi);
+	    return 0;
+	}
+
+	for (i=0;i<FAST_RECV_POSTED;i++) {
+	    if (nk_net_ethernet_agent_device_receive_packet(fi->agentdev,
+							    0,
+							    NK_DEV_REQ_CALLBACK,
+							    recv_callback,
+							    fi)) {
+		ERROR("Cannot post receive\n");
+		fi->dying = 1;
+		nk_net_ethernet_agent_unregister(fi->agentdev);
+		if_free(fi);
+		return 0;
+	    }
+	}
+    }
+
+    flags = spin_lock_irq_save(&fast_lock);
+    list_add_tail(&fi->node,&fast_ifs);
+    start_timer = !fast_timer_running;
+    fast_timer_running = 1;
+    spin_unlock_irq_restore(&fast_lock,flags);
+
+    if (start_timer && nk_thread_start(fast_timer,0,0,1,TSTACK_DEFAULT,0,-1)) {
+	ERROR("Cannot start TCP timer thread - retransmission will not work\n");
+    }
+
+    INFO("interface %s is " IPSTR "/" IPSTR " (gateway " IPSTR ") on %s%s%s\n",
+	 fi->name,IPLIST(ip),IPLIST(netmask),IPLIST(gateway),
+	 agent ? fi->netdev->dev.name : "loopback only",
+	 fi->tx_sg ? ", gathering" : "",
+	 fi->tx_csum ? ", checksum offload" : "");
+
+    return fi;
+}
+
+struct nk_net_fast_if *nk_net_fast_if_find(char *name)
+{
+    struct nk_net_fast_if *fi, *found = 0;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&fast_lock);
+    list_for_each_entry(fi,&fast_ifs,node) {
+	if (!strncmp(fi->name,name,DEV_NAME_LEN)) {
+	    found = fi;
+	    break;
+	}
+    }
+    spin_unlock_irq_restore(&fast_lock,flags);
+
+    return found;
+}
+
+int nk_net_fast_if_destroy(struct nk_net_fast_if *fi)
+{
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&fast_lock);
+    if (fi->num_socks) {
+	spin_unlock_irq_restore(&fast_lock,flags);
+	ERROR("Interface %s is still in use\n",fi->name);
+	return -1;
+    }
+    list_del(&fi->node);
+    spin_unlock_irq_restore(&fast_lock,flags);
+
+    fi->dying = 1;
+    if (fi->agentdev) {
+	nk_net_ethernet_agent_unregister(fi->agentdev);
+    }
+
+    INFO("interface %s destroyed\n",fi->name);
+
+    if_free(fi);
+
+    return 0;
+}
+
+void nk_net_fast_dump()
+{
+    struct nk_net_fast_if *fi;
+    struct nk_net_fast_tcp *c;
+    uint64_t received, migrated;
+    uint8_t flags, flags2;
+    int i;
+
+    flags = spin_lock_irq_save(&fast_lock);
+    list_for_each_entry(fi,&fast_ifs,node) {
+	received = migrated = 0;
+	for (i=0;i<fi->num_cpus;i++) {
+	    received += fi->cpus[i].received;
+	    migrated += fi->cpus[i].migrated;
+	}
+	nk_vc_printf("%s: " IPSTR "/" IPSTR " gw " IPSTR " on %s mss %u%s%s\n",
+		     fi->name,IPLIST(fi->ip),IPLIST(fi->netmask),IPLIST(fi->gateway),
+		     fi->agent ? fi->netdev->dev.name : "loopback",fi->mss,
+		     fi->tx_sg ? " sg" : "",fi->tx_csum ? " csum" : "");
+	nk_vc_printf("  %lu endpoints, %lu received, %lu dropped, %lu bad, %lu send failures, %lu retransmits, %lu moves\n",
+		     fi->num_socks,received,fi->rx_dropped,fi->rx_bad,fi->tx_failed,fi->rexmits,migrated);
+	flags2 = spin_lock_irq_save(&fi->lock);
+	list_for_each_entry(c,&fi->conns,node) {
+	    nk_vc_printf("  tcp %u <-> " IPSTR ":%u %s cpu %d unacked %u\n",
+			 c->sock.lport,IPLIST(c->sock.rip),c->sock.rport,
+			 tcp_state_names[c->state],c->sock.home,nk_net_fast_tcp_unacked(c));
+	}
+	spin_unlock_irq_restore(&fi->lock,flags2);
+    }
+    spin_unlock_irq_restore(&fast_lock,flags);
+}
+
+
+//
+// Echo servers and ping clients, for the shell and the benchmarks
+//
+struct echo_buf {
+    uint32_t len;
+    uint8_t  data[0];
+};
+
+static void udp_echo_recv(struct nk_net_fast_udp *s, ipv4_addr_t ip, uint16_t port, void *data, uint32_t len, void *state)
+{
+    nk_net_fast_udp_sendto(s,ip,port,data,len);
+}
+
+static int tcp_echo_accept(struct nk_net_fast_tcp *c, void *listener_state, void **state)
+{
+    *state = 0;
+    return 0;
+}
+
+static void tcp_echo_recv(struct nk_net_fast_tcp *c, void *data, uint32_t len, void *state)
+{
+    void *buf;
+
+    if (!len) {
+	nk_net_fast_tcp_close(c);
+	return;
+    }
+    // the data is gone after we return, and the send is zero-copy
+    if (!(buf = malloc(len))) {
+	return;
+    }
+    memcpy(buf,data,len);
+    if (nk_net_fast_tcp_send(c,buf,len)) {
+	free(buf);
+    }
+}
+
+static void tcp_echo_sent(struct nk_net_fast_tcp *c, void *buf, void *state)
+{
+    free(buf);
+}
+
+static void tcp_echo_closed(struct nk_net_fast_tcp *c, int error, void *state)
+{
+    nk_net_fast_tcp_close(c);
+}
+
+static struct nk_net_fast_tcp_ops tcp_echo_ops = {
+    .accept = tcp_echo_accept,
+    .recv   = tcp_echo_recv,
+    .sent   = tcp_echo_sent,
+    .closed = tcp_echo_closed,
+};
+
+// A client that bounces messages off an echo server
+struct ping {
+    struct nk_net_fast_udp *udp;
+    struct nk_net_fast_tcp *tcp;
+    ipv4_addr_t             ip;
+    uint16_t                port;
+    uint8_t                *buf;
+    uint32_t                len;
+    volatile uint32_t       received;
+    volatile int            sent;
+    volatile int            connected;
+    volatile int            closed;
+};
+
+static void ping_udp_recv(struct nk_net_fast_udp *s, ipv4_addr_t ip, uint16_t port, void *data, uint32_t len, void *state)
+{
+    struct ping *p = (struct ping *)state;
+    p->received += len;
+}
+
+static void ping_tcp_connected(struct nk_net_fast_tcp *c, void *state)
+{
+    ((struct ping *)state)->connected = 1;
+}
+
+static void ping_tcp_recv(struct nk_net_fast_tcp *c, void *data, uint32_t len, void *state)
+{
+    struct ping *p = (struct ping *)state;
+    if (len) {
+	p->received += len;
+    } else {
+	p->closed = 1;
+    }
+}
+
+static void ping_tcp_sent(struct nk_net_fast_tcp *c, void *buf, void *state)
+{
+    ((struct ping *)state)->sent = 1;
+}
+
+static void ping_tcp_closed(struct nk_net_fast_tcp *c, int error, void *state)
+{
+    ((struct ping *)state)->closed = 1;
+}
+
+static struct nk_net_fast_tcp_ops ping_tcp_ops = {
+    .connected = ping_tcp_connected,
+    .recv      = ping_tcp_recv,
+    .sent      = ping_tcp_sent,
+    .closed    = ping_tcp_closed,
+};
+
+#define PING_TIMEOUT_NS 1000000000ULL
+
+static int ping_wait(volatile uint32_t *have, uint32_t want, volatile int *failed)
+{
+    uint64_t start = nk_sched_get_realtime();
+
+    while (*have < want) {
+	if ((failed && *failed) || nk_sched_get_realtime() - start > PING_TIMEOUT_NS) {
+	    return -1;
+	}
+	nk_yield();
+    }
+    return 0;
+}
+
+static int ping_open(struct ping *p, struct nk_net_fast_if *fi, int tcp, ipv4_addr_t ip, uint16_t port, uint32_t len)
+{
+    memset(p,0,sizeof(*p));
+    p->ip = ip;
+    p->port = port;
+    p->len = len;
+
+    if (!(p->buf = malloc(len))) {
+	return -1;
+    }
+    memset(p->buf,0x5a,len);
+
+    if (!tcp) {
+	if (!(p->udp = nk_net_fast_udp_open(fi,0,ping_udp_recv,p))) {
+	    free(p->buf);
+	    return -1;
+	}
+	return 0;
+    }
+
+    if (!(p->tcp = nk_net_fast_tcp_connect(fi,ip,port,&ping_tcp_ops,p))) {
+	free(p->buf);
+	return -1;
+    }
+    if (ping_wait((volatile uint32_t *)&p->connected,1,&p->closed)) {
+	nk_net_fast_tcp_close(p->tcp);
+	free(p->buf);
+	return -1;
+    }
+    return 0;
+}
+
+// one round trip
+static int ping_once(struct ping *p)
+{
+    int rc;
+
+    p->received = 0;
+
+    if (p->udp) {
+	while ((rc = nk_net_fast_udp_sendto(p->udp,p->ip,p->port,p->buf,p->len)) > 0) {
+	    nk_yield();
+	}
+	return rc ? rc : ping_wait(&p->received,p->len,0);
+    }
+
+    // the buffer is reused, so wait until the stack is done with it
+    p->sent = 0;
+    if (nk_net_fast_tcp_send(p->tcp,p->buf,p->len)) {
+	return -1;
+    }
+    if (ping_wait(&p->received,p->len,&p->closed)) {
+	return -1;
+    }
+    return ping_wait((volatile uint32_t *)&p->sent,1,&p->closed);
+}
+
+static void ping_close(struct ping *p)
+{
+    if (p->udp) {
+	nk_net_fast_udp_close(p->udp);
+    }
+    if (p->tcp) {
+	nk_net_fast_tcp_close(p->tcp);
+	// the buffer may still be queued
+	ping_wait((volatile uint32_t *)&p->sent,1,0);
+    }
+    free(p->buf);
+}
+
+
+//
+// Benchmarks: request/response over loopback, to compare with LWIP
+//
+#define BENCH_PORT   7007
+#define BENCH_LEN    64
+
+static struct {
+    struct nk_net_fast_if  *fi;
+    struct nk_net_fast_udp *udp_echo;
+    struct nk_net_fast_tcp *tcp_echo;
+    struct ping             ping;
+} bench;
+
+static int bench_setup(int tcp)
+{
+    if (!bench.fi && !(bench.fi = nk_net_fast_if_find("fast-bench"))) {
+	if (!(bench.fi = nk_net_fast_if_create("fast-bench",0,0x7f000001,0xff000000,0))) {
+	    return -1;
+	}
+    }
+    if (!tcp && !bench.udp_echo &&
+	!(bench.udp_echo = nk_net_fast_udp_open(bench.fi,BENCH_PORT,udp_echo_recv,0))) {
+	return -1;
+    }
+    if (tcp && !bench.tcp_echo &&
+	!(bench.tcp_echo = nk_net_fast_tcp_listen(bench.fi,BENCH_PORT,&tcp_echo_ops,0))) {
+	return -1;
+    }
+    return ping_open(&bench.ping,bench.fi,tcp,0x7f000001,BENCH_PORT,BENCH_LEN);
+}
+
+static int bench_setup_udp(void **state)
+{
+    return bench_setup(0);
+}
+
+static int bench_setup_tcp(void **state)
+{
+    return bench_setup(1);
+}
+
+static uint64_t bench_rr(void *state, int cpu)
+{
+    uint64_t start, end;
+
+    start = rdtsc();
+    if (ping_once(&bench.ping)) {
+	ERROR("Benchmark round trip failed\n");
+    }
+    end = rdtsc();
+
+    return end - start;
+}
+
+static void bench_teardown(void *state)
+{
+    ping_close(&bench.ping);
+}
+
+static struct nk_bench_impl udp_rr_impl = {
+    .name     = "net_fast_udp_rr",
+    .unit     = "cycles",
+    .flags    = NK_BENCH_PER_CPU,
+    .reps     = 10000,
+    .warmup   = 100,
+    .setup    = bench_setup_udp,
+    .run      = bench_rr,
+    .teardown = bench_teardown,
+};
+nk_register_bench(udp_rr_impl);
+
+static struct nk_bench_impl tcp_rr_impl = {
+    .name     = "net_fast_tcp_rr",
+    .unit     = "cycles",
+    .flags    = NK_BENCH_PER_CPU,
+    .reps     = 10000,
+    .warmup   = 100,
+    .setup    = bench_setup_tcp,
+    .run      = bench_rr,
+    .teardown = bench_teardown,
+};
+nk_register_bench(tcp_rr_impl);
+
+
+//
+// Shell
+//
+static int handle_fastnet(char *buf, void *priv)
+{
+    char name[DEV_NAME_LEN], agentname[DEV_NAME_LEN], proto[8];
+    uint32_t ip[4], nm[4], gw[4], port, count, len;
+    struct nk_net_ethernet_agent *agent = 0;
+    struct nk_net_fast_if *fi;
+    struct ping p;
+    uint64_t start, end, t, min = -1, max = 0, sum = 0;
+    uint32_t i, lost = 0;
+    int tcp;
+
+    if (sscanf(buf,"fastnet add %s %s %u.%u.%u.%u %u.%u.%u.%u %u.%u.%u.%u",name,agentname,
+	       &ip[0],&ip[1],&ip[2],&ip[3],&nm[0],&nm[1],&nm[2],&nm[3],&gw[0],&gw[1],&gw[2],&gw[3])==14) {
+	if (strcmp(agentname,"lo") && !(agent = nk_net_ethernet_agent_find(agentname))) {
+	    nk_vc_printf("Cannot find agent %s\n",agentname);
+	    return 0;
+	}
+	if (!nk_net_fast_if_create(name,agent,
+				   ip[0]<<24 | ip[1]<<16 | ip[2]<<8 | ip[3],
+				   nm[0]<<24 | nm[1]<<16 | nm[2]<<8 | nm[3],
+				   gw[0]<<24 | gw[1]<<16 | gw[2]<<8 | gw[3])) {
+	    nk_vc_printf("Failed to create interface\n");
+	}
+	return 0;
+    }
+
+    if (sscanf(buf,"fastnet echo %s %7s %u",name,proto,&port)==3) {
+	if (!(fi = nk_net_fast_if_find(name))) {
+	    nk_vc_printf("No interface %s\n",name);
+	    return 0;
+	}
+	if (!strcmp(proto,"udp") ? !nk_net_fast_udp_open(fi,port,udp_echo_recv,0) :
+	    !nk_net_fast_tcp_listen(fi,port,&tcp_echo_ops,0)) {
+	    nk_vc_printf("Failed to start echo server\n");
+	} else {
+	    nk_vc_printf("%s echo server on port %u of %s\n",proto,port,name);
+	}
+	return 0;
+    }
+
+    if (sscanf(buf,"fastnet ping %s %7s %u.%u.%u.%u %u %u %u",name,proto,
+	       &ip[0],&ip[1],&ip[2],&ip[3],&port,&count,&len)==9) {
+	if (!(fi = nk_net_fast_if_find(name))) {
+	    nk_vc_printf("No interface %s\n",name);
+	    return 0;
+	}
+	tcp = !strcmp(proto,"tcp");
+	if (!len || ping_open(&p,fi,tcp,ip[0]<<24 | ip[1]<<16 | ip[2]<<8 | ip[3],port,len)) {
+	    nk_vc_printf("Failed to reach the echo server\n");
+	    return 0;
+	}
+	for (i=0;i<count;i++) {
+	    start = nk_sched_get_realtime();
+	    if (ping_once(&p)) {
+		lost++;
+		if (tcp) {
+		    break;
+		}
+		continue;
+	    }
+	    end = nk_sched_get_realtime();
+	    t = end - start;
+	    sum += t;
+	    min = t < min ? t : min;
+	    max = t > max ? t : max;
+	}
+	ping_close(&p);
+	if (i == lost) {
+	    nk_vc_printf("No replies\n");
+	} else {
+	    nk_vc_printf("%u round trips of %u bytes, %u lost: min %lu avg %lu max %lu ns, %lu msgs/s\n",
+			 i - lost,len,lost,min,sum/(i-lost),max,
+			 sum ? (i-lost)*1000000000ULL/sum : 0);
+	}
+	return 0;
+    }
+
+    if (sscanf(buf,"fastnet del %s",name)==1) {
+	if (!(fi = nk_net_fast_if_find(name)) || nk_net_fast_if_destroy(fi)) {
+	    nk_vc_printf("Cannot remove interface %s\n",name);
+	}
+	return 0;
+    }
+
+    if (!strcmp(buf,"fastnet") || !strcmp(buf,"fastnet show")) {
+	nk_net_fast_dump();
+	return 0;
+    }
+
+    nk_vc_printf("unknown fastnet command\n");
+
+    return 0;
+}
+
+static struct shell_cmd_impl fastnet_impl = {
+    .cmd      = "fastnet",
+    .help_str = "fastnet [show] | fastnet add name agent|lo ip netmask gw | fastnet del name |\n"
+                "  fastnet echo name udp|tcp port | fastnet ping name udp|tcp ip port count len",
+    .handler  = handle_fastnet,
+};
+nk_register_shell_cmd(fastnet_impl);
+
+
+int nk_net_fast_init()
+{
+    spinlock_init(&fast_lock);
+    INIT_LIST_HEAD(&fast_ifs);
+    INFO("inited\n");
+    return 0;
+}
+
+void nk_net_fast_deinit()
+{
+    if (!list_empty(&fast_ifs)) {
+	ERROR("Deiniting with interfaces still present\n");
+	return;
+    }
+    spinlock_deinit(&fast_lock);
+    INFO("deinited\n");
+}
@@ -0,0 +1,473 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xstack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2018, Peter Dinda <pdinda@northwestern.edu>
+ * Copyright (c) 2018, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * Author: Peter Dinda <pdinda@northwestern.edu>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+
+//
+// The same request/response benchmarks as net_fast_*_rr, run through
+// LWIP's raw API and its netconn API, so the three can be compared
+// on one machine.  All of them go over 127.0.0.1 with 64 byte messages
+//
+
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/timer.h>
+#include <test/test.h>
+#include <net/lwip/lwip.h>
+
+#include "lwip/tcpip.h"
+#include "lwip/udp.h"
+#include "lwip/tcp.h"
+#include "lwip/api.h"
+
+#ifndef NAUT_CONFIG_DEBUG_NET_FAST
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+// LWIP's arch.h has its own
+#undef ERROR
+#undef DEBUG
+#undef INFO
+#define ERROR(fmt, args...) ERROR_PRINT("net_fast_lwip: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("net_fast_lwip: " fmt, ##args)
+#define INFO(fmt, args...) INFO_PRINT("net_fast_lwip: " fmt, ##args)
+
+#define RAW_PORT      7008
+#define NETCONN_PORT  7009
+#define BENCH_LEN     64
+#define WAIT_NS       1000000000ULL
+
+static uint8_t msg[BENCH_LEN];
+
+static int lwip_up()
+{
+    struct nk_net_lwip_config conf = { .dns_ip = 0x08080808 };
+
+    memset(msg,0x5a,BENCH_LEN);
+
+    return nk_net_lwip_start(&conf);
+}
+
+static int wait_for(volatile uint32_t *have, uint32_t want)
+{
+    uint64_t start = nk_sched_get_realtime();
+
+    while (*have < want) {
+	if (nk_sched_get_realtime() - start > WAIT_NS) {
+	    ERROR("Timed out waiting for a reply\n");
+	    return -1;
+	}
+	nk_yield();
+    }
+    return 0;
+}
+
+
+//
+// Raw API: callbacks in LWIP's thread, requests from ours
+//
+static struct udp_pcb   *raw_udp_server;
+static struct udp_pcb   *raw_udp_client;
+static struct tcp_pcb   *raw_tcp_server;
+static struct tcp_pcb   *raw_tcp_client;
+static volatile uint32_t raw_received;
+static volatile uint32_t raw_connected;
+
+static void raw_udp_echo(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    udp_sendto(pcb,p,addr,port);
+    pbuf_free(p);
+}
+
+static void raw_udp_reply(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    raw_received += p->tot_len;
+    pbuf_free(p);
+}
+
+static err_t raw_tcp_echo(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+    struct pbuf *q;
+
+    if (!p) {
+	tcp_close(pcb);
+	return ERR_OK;
+    }
+    for (q=p;q;q=q->next) {
+	tcp_write(pcb,q->payload,q->len,TCP_WRITE_FLAG_COPY);
+    }
+    tcp_recved(pcb,p->tot_len);
+    tcp_output(pcb);
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+static err_t raw_tcp_accept(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    if (err != ERR_OK || !pcb) {
+	return ERR_VAL;
+    }
+    tcp_nagle_disable(pcb);
+    tcp_recv(pcb,raw_tcp_echo);
+    return ERR_OK;
+}
+
+static err_t raw_tcp_reply(void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+    if (p) {
+	raw_received += p->tot_len;
+	tcp_recved(pcb,p->tot_len);
+	pbuf_free(p);
+    }
+    return ERR_OK;
+}
+
+static err_t raw_tcp_connected(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    raw_connected = 1;
+    return ERR_OK;
+}
+
+static int raw_udp_setup(void **state)
+{
+    if (lwip_up()) {
+	return -1;
+    }
+
+    LOCK_TCPIP_CORE();
+    if (!raw_udp_server) {
+	if ((raw_udp_server = udp_new())) {
+	    udp_bind(raw_udp_server,IP_ADDR_ANY,RAW_PORT);
+	    udp_recv(raw_udp_server,raw_udp_echo,0);
+	}
+    }
+    if ((raw_udp_client = udp_new())) {
+	udp_recv(raw_udp_client,raw_udp_reply,0);
+    }
+    UNLOCK_TCPIP_CORE();
+
+    if (!raw_udp_server || !raw_udp_client) {
+	ERROR("Cannot create UDP pcbs\n");
+	return -1;
+    }
+    return 0;
+}
+
+static uint64_t raw_udp_run(void *state, int cpu)
+{
+    ip_addr_t lo;
+    struct pbuf *p;
+    uint64_t start, end;
+
+    IP_ADDR4(&lo,127,0,0,1);
+
+    start = rdtsc();
+    raw_received = 0;
+    LOCK_TCPIP_CORE();
+    if ((p = pbuf_alloc(PBUF_TRANSPORT,BENCH_LEN,PBUF_RAM))) {
+	memcpy(p->payload,msg,BENCH_LEN);
+	udp_sendto(raw_udp_client,p,&lo,RAW_PORT);
+	pbuf_free(p);
+    }
+    UNLOCK_TCPIP_CORE();
+    wait_for(&raw_received,BENCH_LEN);
+    end = rdtsc();
+
+    return end - start;
+}
+
+static void raw_udp_teardown(void *state)
+{
+    LOCK_TCPIP_CORE();
+    if (raw_udp_client) {
+	udp_remove(raw_udp_client);
+	raw_udp_client = 0;
+    }
+    UNLOCK_TCPIP_CORE();
+}
+
+static int raw_tcp_setup(void **state)
+{
+    struct tcp_pcb *pcb;
+    ip_addr_t lo;
+    err_t err = ERR_MEM;
+
+    if (lwip_up()) {
+	return -1;
+    }
+
+    IP_ADDR4(&lo,127,0,0,1);
+
+    LOCK_TCPIP_CORE();
+    if (!raw_tcp_server && (pcb = tcp_new())) {
+	if (tcp_bind(pcb,IP_ADDR_ANY,RAW_PORT) == ERR_OK &&
+	    (raw_tcp_server = tcp_listen(pcb))) {
+	    tcp_accept(raw_tcp_server,raw_tcp_accept);
+	} else {
+	    tcp_close(pcb);
+	}
+    }
+    raw_connected = 0;
+    if (raw_tcp_server && (raw_tcp_client = tcp_new())) {
+	tcp_nagle_disable(raw_tcp_client);
+	tcp_recv(raw_tcp_client,raw_tcp_reply);
+	err = tcp_connect(raw_tcp_client,&lo,RAW_PORT,raw_tcp_connected);
+    }
+    UNLOCK_TCPIP_CORE();
+
+    if (err != ERR_OK || wait_for(&raw_connected,1)) {
+	ERROR("Cannot connect to raw TCP echo server\n");
+	return -1;
+    }
+    return 0;
+}
+
+static uint64_t raw_tcp_run(void *state, int cpu)
+{
+    uint64_t start, end;
+
+    start = rdtsc();
+    raw_received = 0;
+    LOCK_TCPIP_CORE();
+    tcp_write(raw_tcp_client,msg,BENCH_LEN,TCP_WRITE_FLAG_COPY);
+    tcp_output(raw_tcp_client);
+    UNLOCK_TCPIP_CORE();
+    wait_for(&raw_received,BENCH_LEN);
+    end = rdtsc();
+
+    return end - start;
+}
+
+static void raw_tcp_teardown(void *state)
+{
+    LOCK_TCPIP_CORE();
+    if (raw_tcp_client) {
+	tcp_recv(raw_tcp_client,0);
+	tcp_close(raw_tcp_client);
+	raw_tcp_client = 0;
+    }
+    UNLOCK_TCPIP_CORE();
+}
+
+
+//
+// Netconn API: echo servers are threads blocked in netconn_recv
+//
+static int netconn_servers_started;
+
+static void netconn_udp_server(void *in, void **out)
+{
+    struct netconn *conn;
+    struct netbuf *buf;
+
+    nk_thread_name(get_cur_thread(),"lwip-bench-udp");
+
+    if (!(conn = netconn_new(NETCONN_UDP)) || netconn_bind(conn,IP_ADDR_ANY,NETCONN_PORT) != ERR_OK) {
+	ERROR("Cannot start netconn UDP echo server\n");
+	return;
+    }
+    while (1) {
+	if (netconn_recv(conn,&buf) == ERR_OK) {
+	    netconn_sendto(conn,buf,netbuf_fromaddr(buf),netbuf_fromport(buf));
+	    netbuf_delete(buf);
+	}
+    }
+}
+
+static void netconn_tcp_server(void *in, void **out)
+{
+    struct netconn *conn, *c;
+    struct netbuf *buf;
+    void *data;
+    u16_t len;
+
+    nk_thread_name(get_cur_thread(),"lwip-bench-tcp");
+
+    if (!(conn = netconn_new(NETCONN_TCP)) || netconn_bind(conn,IP_ADDR_ANY,NETCONN_PORT) != ERR_OK ||
+	netconn_listen(conn) != ERR_OK) {
+	ERROR("Cannot start netconn TCP echo server\n");
+	return;
+    }
+    while (1) {
+	if (netconn_accept(conn,&c) != ERR_OK) {
+	    continue;
+	}
+	LOCK_TCPIP_CORE();
+	tcp_nagle_disable(c->pcb.tcp);
+	UNLOCK_TCPIP_CORE();
+	while (netconn_recv(c,&buf) == ERR_OK) {
+	    do {
+		netbuf_data(buf,&data,&len);
+		netconn_write(c,data,len,NETCONN_COPY);
+	    } while (netbuf_next(buf) >= 0);
+	    netbuf_delete(buf);
+	}
+	netconn_close(c);
+	netconn_delete(c);
+    }
+}
+
+static struct netconn *netconn_client;
+
+static int netconn_setup(enum netconn_type type)
+{
+    ip_addr_t lo;
+
+    if (lwip_up()) {
+	return -1;
+    }
+
+    if (!netconn_servers_started) {
+	if (nk_thread_start(netconn_udp_server,0,0,1,TSTACK_DEFAULT,0,-1) ||
+	    nk_thread_start(netconn_tcp_server,0,0,1,TSTACK_DEFAULT,0,-1)) {
+	    ERROR("Cannot start netconn echo servers\n");
+	    return -1;
+	}
+	netconn_servers_started = 1;
+	// let them get to their recv/accept
+	nk_sleep(10000000ULL);
+    }
+
+    IP_ADDR4(&lo,127,0,0,1);
+
+    if (!(netconn_client = netconn_new(type))) {
+	ERROR("Cannot create netconn\n");
+	return -1;
+    }
+    if (type == NETCONN_UDP) {
+	return 0;
+    }
+    if (netconn_connect(netconn_client,&lo,NETCONN_PORT) != ERR_OK) {
+	ERROR("Cannot connect to netconn TCP echo server\n");
+	netconn_delete(netconn_client);
+	netconn_client = 0;
+	return -1;
+    }
+    LOCK_TCPIP_CORE();
+    tcp_nagle_disable(netconn_client->pcb.tcp);
+    UNLOCK_TCPIP_CORE();
+    return 0;
+}
+
+static int netconn_udp_setup(void **state)
+{
+    return netconn_setup(NETCONN_UDP);
+}
+
+static int netconn_tcp_setup(void **state)
+{
+    return netconn_setup(NETCONN_TCP);
+}
+
+static uint64_t netconn_udp_run(void *state, int cpu)
+{
+    struct netbuf *out, *in;
+    ip_addr_t lo;
+    uint64_t start, end;
+
+    IP_ADDR4(&lo,127,0,0,1);
+
+    start = rdtsc();
+    if ((out = netbuf_new())) {
+	netbuf_ref(out,msg,BENCH_LEN);
+	netconn_sendto(netconn_client,out,&lo,NETCONN_PORT);
+	netbuf_delete(out);
+	if (netconn_recv(netconn_client,&in) == ERR_OK) {
+	    netbuf_delete(in);
+	}
+    }
+    end = rdtsc();
+
+    return end - start;
+}
+
+static uint64_t netconn_tcp_run(void *state, int cpu)
+{
+    struct netbuf *in;
+    uint32_t got = 0;
+    uint64_t start, end;
+
+    start = rdtsc();
+    netconn_write(netconn_client,msg,BENCH_LEN,NETCONN_COPY);
+    while (got < BENCH_LEN && netconn_recv(netconn_client,&in) == ERR_OK) {
+	got += netbuf_len(in);
+	netbuf_delete(in);
+    }
+    end = rdtsc();
+
+    return end - start;
+}
+
+static void netconn_teardown(void *state)
+{
+    if (netconn_client) {
+	netconn_close(netconn_client);
+	netconn_delete(netconn_client);
+	netconn_client = 0;
+    }
+}
+
+
+static struct nk_bench_impl raw_udp_impl = {
+    .name     = "net_lwip_raw_udp_rr",
+    .unit     = "cycles",
+    .reps     = 10000,
+    .warmup   = 100,
+    .setup    = raw_udp_setup,
+    .run      = raw_udp_run,
+    .teardown = raw_udp_teardown,
+};
+nk_register_bench(raw_udp_impl);
+
+static struct nk_bench_impl raw_tcp_impl = {
+    .name     = "net_lwip_raw_tcp_rr",
+    .unit     = "cycles",
+    .reps     = 10000,
+    .warmup   = 100,
+    .setup    = raw_tcp_setup,
+    .run      = raw_tcp_run,
+    .teardown = raw_tcp_teardown,
+};
+nk_register_bench(raw_tcp_impl);
+
+static struct nk_bench_impl netconn_udp_impl = {
+    .name     = "net_lwip_netconn_udp_rr",
+    .unit     = "cycles",
+    .reps     = 10000,
+    .warmup   = 100,
+    .setup    = netconn_udp_setup,
+    .run      = netconn_udp_run,
+    .teardown = netconn_teardown,
+};
+nk_register_bench(netconn_udp_impl);
+
+static struct nk_bench_impl netconn_tcp_impl = {
+    .name     = "net_lwip_netconn_tcp_rr",
+    .unit     = "cycles",
+    .reps     = 10000,
+    .warmup   = 100,
+    .setup    = netconn_tcp_setup,
+    .run      = netconn_tcp_run,
+    .teardown = netconn_teardown,
+};
+nk_register_bench(netconn_tcp_impl);
@@ -36,6 +36,7 @@
 #include <nautilus/chardev.h>
 #include <nautilus/vc.h>
 #include <nautilus/timer.h>
+#include <nautilus/msg_queue.h>
 
 
 
@@ -220,6 +220,105 @@ memp_overflow_check_all(void)
 #endif /* MEMP_OVERFLOW_CHECK >= 2 */
 #endif /* MEMP_OVERFLOW_CHECK */
 
+#if MEMP_USE_PCPU_CACHE
+#if MEMP_PCPU_CACHE_SIZE < 2
+#error "MEMP_PCPU_CACHE_SIZE must be at least 2"
+#endif
+
+/* The most free elements of a pool one CPU may hold, chosen so that the
+ * caches of all CPUs together hold at most a quarter of the pool, and so
+ * cannot strand it.  Pools too small for a cache of 2 on every CPU are
+ * not cached. */
+static u16_t
+memp_cache_cap(const struct memp_desc *desc)
+{
+  u32_t cap = desc->num / (4 * sys_arch_num_cpus());
+  return cap > MEMP_PCPU_CACHE_SIZE ? MEMP_PCPU_CACHE_SIZE : (u16_t)cap;
+}
+
+#define MEMP_CACHED(desc) (memp_cache_cap(desc) >= 2)
+
+/* Take an element from this CPU's cache, refilling half of it from the
+ * shared list when it runs dry.  Interrupts are off so the cache cannot
+ * change under us, the shared list is only touched under SYS_ARCH_PROTECT. */
+static struct memp *
+memp_cache_get(const struct memp_desc *desc)
+{
+  struct memp_cache *c;
+  struct memp *memp = NULL;
+  u16_t cap = memp_cache_cap(desc);
+  sys_prot_t local;
+  SYS_ARCH_DECL_PROTECT(old_level);
+
+  local = sys_arch_local_protect();
+  c = &desc->cache[sys_arch_cpu()];
+  if (c->count == 0) {
+    SYS_ARCH_PROTECT(old_level);
+    while ((c->count < cap / 2) && (*desc->tab != NULL)) {
+      c->elems[c->count++] = *desc->tab;
+      *desc->tab = (*desc->tab)->next;
+    }
+    SYS_ARCH_UNPROTECT(old_level);
+  }
+  if (c->count > 0) {
+    memp = c->elems[--c->count];
+  }
+  sys_arch_local_unprotect(local);
+  return memp;
+}
+
+/* Return an element to this CPU's cache, spilling half of it to the
+ * shared list when it is full */
+static void
+memp_cache_put(const struct memp_desc *desc, struct memp *memp)
+{
+  struct memp_cache *c;
+  u16_t cap = memp_cache_cap(desc);
+  sys_prot_t local;
+  SYS_ARCH_DECL_PROTECT(old_level);
+
+  local = sys_arch_local_protect();
+  c = &desc->cache[sys_arch_cpu()];
+  if (c->count >= cap) {
+    SYS_ARCH_PROTECT(old_level);
+    while (c->count > cap / 2) {
+      struct memp *m = c->elems[--c->count];
+      m->next = *desc->tab;
+      *desc->tab = m;
+    }
+    SYS_ARCH_UNPROTECT(old_level);
+  }
+  c->elems[c->count++] = memp;
+  sys_arch_local_unprotect(local);
+}
+
+static void *
+do_memp_malloc_cached(const struct memp_desc *desc)
+{
+  struct memp *memp = memp_cache_get(desc);
+
+  if (memp == NULL) {
+    LWIP_DEBUGF(MEMP_DEBUG | LWIP_DBG_LEVEL_SERIOUS, ("memp_malloc: out of memory in pool %s\n", desc->desc));
+#if MEMP_STATS
+    __sync_fetch_and_add(&desc->stats->err, 1);
+#endif
+    return NULL;
+  }
+  LWIP_ASSERT("memp_malloc: memp properly aligned",
+              ((mem_ptr_t)memp % MEM_ALIGNMENT) == 0);
+#if MEMP_STATS
+  {
+    /* the high water mark may be slightly stale, it is only a statistic */
+    mem_size_t used = __sync_add_and_fetch(&desc->stats->used, 1);
+    if (used > desc->stats->max) {
+      desc->stats->max = used;
+    }
+  }
+#endif
+  return ((u8_t*)memp + MEMP_SIZE);
+}
+#endif /* MEMP_USE_PCPU_CACHE */
+
 /**
  * Initialize custom memory pool.
  * Related functions: memp_malloc_pool, memp_free_pool
@@ -236,6 +335,11 @@ memp_init_pool(const struct memp_desc *desc)
   struct memp *memp;
 
   *desc->tab = NULL;
+#if MEMP_USE_PCPU_CACHE
+  for (i = 0; i < MEMP_PCPU_CACHE_CPUS; ++i) {
+    desc->cache[i].count = 0;
+  }
+#endif /* MEMP_USE_PCPU_CACHE */
   memp = (struct memp*)LWIP_MEM_ALIGN(desc->base);
   /* create a linked list of memp elements */
   for (i = 0; i < desc->num; ++i) {
@@ -297,6 +401,12 @@ do_memp_malloc_pool_fn(const struct memp_desc *desc, const char* file, const int
   struct memp *memp;
   SYS_ARCH_DECL_PROTECT(old_level);
 
+#if MEMP_USE_PCPU_CACHE
+  if (MEMP_CACHED(desc)) {
+    return do_memp_malloc_cached(desc);
+  }
+#endif /* MEMP_USE_PCPU_CACHE */
+
 #if MEMP_MEM_MALLOC
   memp = (struct memp *)mem_malloc(MEMP_SIZE + MEMP_ALIGN_SIZE(desc->size));
   SYS_ARCH_PROTECT(old_level);
@@ -415,6 +525,16 @@ do_memp_free_pool(const struct memp_desc* desc, void *mem)
   /* cast through void* to get rid of alignment warnings */
   memp = (struct memp *)(void *)((u8_t*)mem - MEMP_SIZE);
 
+#if MEMP_USE_PCPU_CACHE
+  if (MEMP_CACHED(desc)) {
+#if MEMP_STATS
+    __sync_fetch_and_sub(&desc->stats->used, 1);
+#endif
+    memp_cache_put(desc, memp);
+    return;
+  }
+#endif /* MEMP_USE_PCPU_CACHE */
+
   SYS_ARCH_PROTECT(old_level);
 
 #if MEMP_OVERFLOW_CHECK == 1
@@ -93,8 +93,12 @@ int nk_net_lwip_start(struct nk_net_lwip_config *conf)
 {
 
     config = *conf;
-    
-    tcpip_init(donefunc,0);
+
+    // the stack may already be running, for example because
+    // a benchmark needed it before the shell started it
+    if (!done) {
+	tcpip_init(donefunc,0);
+    }
 
     while (!done) {}
 
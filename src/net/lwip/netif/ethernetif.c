@@ -51,11 +51,13 @@
 
 #include "lwip/def.h"
 #include "lwip/mem.h"
+#include "lwip/memp.h"
 #include "lwip/pbuf.h"
 #include "lwip/stats.h"
 #include "lwip/snmp.h"
 #include "lwip/ethip6.h"
 #include "lwip/etharp.h"
+#include "lwip/prot/ip.h"
 #include "netif/ppp/pppoe.h"
 
 /* Define those to better describe your network interface. */
@@ -63,6 +65,8 @@
 #define IFNAME1 'P'
 #define SEND_QUEUE_SIZE 15
 #define RECEIVE_QUEUE_SIZE 15
+/* received frames lwIP may hold on to at once without copying */
+#define RX_PBUFS 512
 
 
 /**
@@ -74,10 +78,25 @@
 struct ethernetif {
     //struct eth_addr *ethaddr;
     struct nk_net_dev* device;
+    struct nk_net_dev* netdev;   // the device under the agent, for gathered sends
     /* Add whatever per-interface state that is needed here. */
     char *name;
+    int tx_csum;   // device completes TCP/UDP checksums for us
+    int tx_sg;     // device can gather a frame from a pbuf chain
 };
 
+/**
+ * A received frame handed to lwIP in place.  The pbuf points into the
+ * ethernet packet, and giving up its last reference releases the packet.
+ */
+struct rx_pbuf {
+    struct pbuf_custom pc;
+    nk_ethernet_packet_t *pk;
+};
+
+LWIP_MEMPOOL_DECLARE(RX_PBUF, RX_PBUFS, sizeof(struct rx_pbuf), "ethernetif RX pbuf")
+static int rx_pool_inited = 0;
+
 /* Forward declarations. */
 static void  ethernetif_input(struct netif *netif, nk_ethernet_packet_t *pk);
 
@@ -106,7 +125,10 @@ static void recv_callback(nk_net_dev_status_t status,
 		   void *state)
 {
     DEBUG("recv_callback\n");
-    parse_packet(packet);
+    if (!packet->info.len) {
+	// device did not tell us the length
+	parse_packet(packet);
+    }
     /*
     int i=0;
     printk("%d\n",packet->len);
@@ -123,9 +145,14 @@ static void recv_callback(nk_net_dev_status_t status,
 	ERROR("Bad packet receive - reissuing a receive\n");
 	goto launch_receive;
     }
+    // lwIP can only check whole checksums
+    if (nk_net_dev_complete_csum(packet->raw, packet->len, &packet->info)) {
+	nk_net_ethernet_release_packet(packet);
+	goto launch_receive;
+    }
     //DEBUG("recv callback ipdev: %p\n", ethernetif->device);	
+    // lwIP now owns the packet and releases it when done
     ethernetif_input(netif, packet);
-    nk_net_ethernet_release_packet(packet);//realse packet
 
 launch_receive:
 
@@ -170,6 +197,8 @@ low_level_init(struct netif *netif)
     struct nk_net_dev *ipdev = nk_net_ethernet_agent_register_filter(agent, type_netif_filter, 0);//filter function to always return true
     
     ethernetif->device = ipdev;
+    ethernetif->netdev = netDevice;
+    ethernetif->tx_sg = !!(c.offloads & NK_NET_DEV_OFFLOAD_SG);
     
     /* set MAC hardware address length */
     netif->hwaddr_len =ETHARP_HWADDR_LEN;
@@ -178,6 +207,14 @@ low_level_init(struct netif *netif)
     
     netif->mtu = c.max_tu;
 
+#if LWIP_CHECKSUM_CTRL_PER_NETIF
+    if (c.offloads & NK_NET_DEV_OFFLOAD_TX_CSUM) {
+	// lwIP leaves TCP and UDP checksums to us, see low_level_output
+	ethernetif->tx_csum = 1;
+	NETIF_SET_CHECKSUM_CTRL(netif, NETIF_CHECKSUM_ENABLE_ALL & ~(NETIF_CHECKSUM_GEN_TCP | NETIF_CHECKSUM_GEN_UDP));
+    }
+#endif
+
     /* don't set NETIF_FLAG_ETHARP if this device is not an ethernet one */
     netif->flags = NETIF_FLAG_BROADCAST | NETIF_FLAG_ETHARP | NETIF_FLAG_LINK_UP;
 
@@ -205,6 +242,119 @@ low_level_init(struct netif *netif)
   /* Do whatever else is needed to initialize interface. */
 }
 
+/**
+ * Hand the TCP or UDP checksum of an outgoing IPv4 frame to the device.
+ * lwIP left the checksum field zero, and the device expects it to hold
+ * the pseudo-header sum.  Anything else, including fragments, which
+ * the device cannot checksum, goes out as is - a zero UDP checksum
+ * just means there is none.
+ *
+ * Only the first hlen of the len bytes of the frame need be contiguous.
+ * Returns -1 if the headers do not fit in them.
+ */
+static int
+offload_csum(u8_t *frame, u32_t hlen, u32_t len, struct nk_net_dev_pkt_info *info)
+{
+    u8_t *ip = frame + ETHERNET_HEADER_LEN;
+    u32_t ihl, tot_len, l4_len, sum, i;
+    u16_t offset;
+
+    if (len < ETHERNET_HEADER_LEN + 20) {
+	return 0;
+    }
+    if (hlen < ETHERNET_HEADER_LEN + 20) {
+	return -1;
+    }
+    if (frame[12] != 0x08 || frame[13] != 0x00) {
+	return 0;
+    }
+
+    ihl = (ip[0] & 0xf) * 4;
+    tot_len = ((u32_t)ip[2] << 8) | ip[3];
+
+    if (((ip[6] & 0x3f) | ip[7]) || ETHERNET_HEADER_LEN + tot_len > len || tot_len < ihl) {
+	return 0;   // fragment or malformed
+    }
+
+    switch (ip[9]) {
+    case IP_PROTO_TCP: offset = 16; break;
+    case IP_PROTO_UDP: offset = 6; break;
+    default: return 0;
+    }
+
+    l4_len = tot_len - ihl;
+    if (l4_len < offset + 2) {
+	return 0;
+    }
+    if (ETHERNET_HEADER_LEN + ihl + offset + 2 > hlen) {
+	return -1;
+    }
+
+    sum = ip[9] + l4_len;
+    for (i = 12; i < 20; i += 2) {
+	sum += ((u32_t)ip[i] << 8) | ip[i+1];
+    }
+    while (sum >> 16) {
+	sum = (sum & 0xffff) + (sum >> 16);
+    }
+
+    ip[ihl + offset] = sum >> 8;
+    ip[ihl + offset + 1] = sum & 0xff;
+
+    info->flags = NK_NET_PKT_CSUM_PARTIAL;
+    info->csum_start = ETHERNET_HEADER_LEN + ihl;
+    info->csum_offset = offset;
+
+    return 0;
+}
+
+static void
+gather_done(nk_net_dev_status_t status, void *context)
+{
+    pbuf_free((struct pbuf *)context);
+}
+
+/**
+ * Send a pbuf chain without copying it by having the device gather it.
+ * We hold a reference until the device is done with it, which also keeps
+ * TCP from rewriting a segment that is still in flight.
+ * Returns -1 if the chain cannot be sent this way.
+ */
+static int
+gather_output(struct ethernetif *ethernetif, struct pbuf *p)
+{
+    struct nk_net_dev_seg segs[NK_NET_DEV_MAX_SEGS];
+    struct nk_net_dev_pkt_info info;
+    struct pbuf *q;
+    u32_t n = 0;
+
+    for (q = p; q != NULL; q = q->next) {
+	if (!q->len) {
+	    continue;
+	}
+	if (n == NK_NET_DEV_MAX_SEGS) {
+	    return -1;
+	}
+	segs[n].addr = q->payload;
+	segs[n].len = q->len;
+	n++;
+    }
+
+    memset(&info, 0, sizeof(info));
+    if (ethernetif->tx_csum &&
+	offload_csum(segs[0].addr, segs[0].len, p->tot_len, &info)) {
+	return -1;
+    }
+
+    pbuf_ref(p);
+    if (nk_net_dev_send_packet_sg(ethernetif->netdev, segs, n, &info, NK_DEV_REQ_CALLBACK, gather_done, p)) {
+	pbuf_free(p);
+	return -1;
+    }
+
+    return 0;
+}
+
 /**
  * This function should do the actual transmission of the packet. The packet is
  * contained in the pbuf that is passed to the function. This pbuf
@@ -233,9 +383,18 @@ low_level_output(struct netif *netif, struct pbuf *p)
 #if ETH_PAD_SIZE
   pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
 #endif
+
+    if (ethernetif->tx_sg && !gather_output(ethernetif, p)) {
+	goto sent;
+    }
   
     nk_ethernet_packet_t *pk = nk_net_ethernet_alloc_packet(-1);
     u32_t len = 0;
+
+    if (!pk) {
+	ERROR("Cannot allocate packet for send\n");
+	return ERR_MEM;
+    }
     
   for (q = p; q != NULL; q = q->next) {
     /* Send the data from the pbuf to the interface, one pbuf at a
@@ -247,11 +406,16 @@ low_level_output(struct netif *netif, struct pbuf *p)
   }
     pk->len = len;
 
+    if (ethernetif->tx_csum) {
+	offload_csum(pk->raw, pk->len, pk->len, &pk->info);
+    }
+
     if(nk_net_ethernet_agent_device_send_packet(ethernetif->device, pk, NK_DEV_REQ_NONBLOCKING, 0, 0)){
 	ERROR("Fail to send a packet\n");
     	return ERR_MEM;	
     }
 
+ sent:
   //signal that packet should be sent();
   MIB2_STATS_NETIF_ADD(netif, ifoutoctets, p->tot_len);
   if (((u8_t*)p->payload)[0] & 1) {
@@ -272,65 +436,70 @@ low_level_output(struct netif *netif, struct pbuf *p)
   return ERR_OK;
 }
 
+/* lwIP gave up the last reference to a frame we handed it in place */
+static void
+rx_pbuf_free(struct pbuf *p)
+{
+  struct rx_pbuf *rp = (struct rx_pbuf *)p;
+
+  nk_net_ethernet_release_packet(rp->pk);
+  LWIP_MEMPOOL_FREE(RX_PBUF, rp);
+}
+
 /**
- * Should allocate a pbuf and transfer the bytes of the incoming
- * packet from the interface into the pbuf.
+ * Wrap the incoming packet in a pbuf, which takes over the packet.  We
+ * only copy it into a pbuf chain from the pool if we run out of wrappers.
  *
  * @param netif the lwip network interface structure for this ethernetif
  * @return a pbuf filled with the received packet (including MAC header)
- *         NULL on memory error
+ *         NULL on memory error, in which case the packet is released
  */
 static struct pbuf *
 low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
 {
-  struct ethernetif *ethernetif = netif->state;
-  struct nk_net_dev *netDevice = ethernetif -> device;
-  struct pbuf *p, *q;
+  struct pbuf *p = NULL, *q;
+  struct rx_pbuf *rp;
   u32_t len, now_index;
   now_index=0;
   /* Obtain the size of the packet and put it into the "len"
      variable. */
 
   len = pk->len;
-  /*u32_t i;
-  DEBUG("\n");
-  for (i=0; i<len; i++){
-      DEBUG("%c ",pk->raw[i]);
+
+#if !ETH_PAD_SIZE
+  rp = (struct rx_pbuf *)LWIP_MEMPOOL_ALLOC(RX_PBUF);
+  if (rp != NULL) {
+    rp->pk = pk;
+    rp->pc.custom_free_function = rx_pbuf_free;
+    p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, &rp->pc, pk->raw, len);
   }
-  DEBUG("\n");*/
-#if ETH_PAD_SIZE
-  len += ETH_PAD_SIZE; /* allow room for Ethernet padding */
 #endif
-  //len += 42;
-  /* We allocate a pbuf chain of pbufs from the pool. */
-  p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
-
-  if (p != NULL) {
 
+  if (p == NULL) {
 #if ETH_PAD_SIZE
-    pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
+    len += ETH_PAD_SIZE; /* allow room for Ethernet padding */
 #endif
+    /* We allocate a pbuf chain of pbufs from the pool. */
+    p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
 
-    /* We iterate over the pbuf chain until we have read the entire
-     * packet into the pbuf. */
-    for (q = p; q != NULL; q = q->next) {
-      /* Read enough bytes to fill this pbuf in the chain. The
-       * available data in the pbuf is given by the q->len
-       * variable.
-       * This does not necessarily have to be a memcpy, you can also preallocate
-       * pbufs for a DMA-enabled MAC and after receiving truncate it to the
-       * actually received size. In this case, ensure the tot_len member of the
-       * pbuf is the sum of the chained pbuf len members.
-       */
-      //read data into(q->payload, q->len);
+    if (p != NULL) {
+#if ETH_PAD_SIZE
+      pbuf_header(p, -ETH_PAD_SIZE); /* drop the padding word */
+#endif
+      /* We iterate over the pbuf chain until we have read the entire
+       * packet into the pbuf. */
+      for (q = p; q != NULL; q = q->next) {
         memcpy(q->payload, pk->raw+now_index, q->len);
         now_index+=q->len;
+      }
+#if ETH_PAD_SIZE
+      pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
+#endif
     }
-      
-    
-    nk_net_ethernet_release_packet(pk);      
-
+    nk_net_ethernet_release_packet(pk);
+  }
 
+  if (p != NULL) {
     MIB2_STATS_NETIF_ADD(netif, ifinoctets, p->tot_len);
     if (((u8_t*)p->payload)[0] & 1) {
       /* broadcast or multicast packet*/
@@ -339,9 +508,6 @@ low_level_input(struct netif *netif, nk_ethernet_packet_t *pk)
       /* unicast packet*/
       MIB2_STATS_NETIF_INC(netif, ifinucastpkts);
     }
-#if ETH_PAD_SIZE
-    pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
-#endif
 
     LINK_STATS_INC(link.recv);
   } else {
@@ -424,7 +590,14 @@ ethernetif_init(struct netif *netif)
   
   MIB2_INIT_NETIF(netif, snmp_ifType_ethernet_csmacd, LINK_SPEED_OF_YOUR_NETIF_IN_BPS);
 
+  if (!rx_pool_inited) {
+    LWIP_MEMPOOL_INIT(RX_PBUF);
+    rx_pool_inited = 1;
+  }
+
   ethernetif->name = (char*) netif->state;
+  ethernetif->tx_csum = 0;
+  ethernetif->tx_sg = 0;
   netif->state = ethernetif;
   netif->name[0] = IFNAME0;
   netif->name[1] = IFNAME1;
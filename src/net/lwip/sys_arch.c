@@ -62,7 +62,7 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/semaphore.h>
-#include <nautilus/msg_queue.h>
+#include <nautilus/waitqueue.h>
 #include <nautilus/timer.h>
 #include <nautilus/errno.h>
 #include <nautilus/spinlock.h>
@@ -211,6 +211,197 @@ void sys_mutex_set_invalid(sys_mutex_t *mutex)
 }
 
 
+/*
+  Mailboxes are bounded multi-producer/multi-consumer rings in the
+  style of Vyukov's bounded queue.  Every slot carries a sequence
+  number telling producers and consumers whether it is theirs on the
+  current lap, so a post or fetch is a CAS on the tail or head plus
+  a release store.  No lock is involved, which makes sys_mbox_trypost()
+  usable from interrupt context, where drivers hand frames to
+  tcpip_input().  Threads only touch a wait queue when the ring is
+  empty (fetch) or full (post), and the other side only pays for a
+  wakeup when someone has announced itself as sleeping.
+*/
+
+struct sys_mbox_slot {
+    volatile u64_t seq;
+    void          *msg;
+};
+
+struct sys_mbox {
+    u64_t            mask;
+    nk_wait_queue_t *fetch_waitq;
+    nk_wait_queue_t *post_waitq;
+    volatile u64_t   fetch_sleepers;
+    volatile u64_t   post_sleepers;
+
+    volatile u64_t   head __attribute__((aligned(64)));  // next slot to fetch
+    volatile u64_t   tail __attribute__((aligned(64)));  // next slot to post
+
+    struct sys_mbox_slot slots[] __attribute__((aligned(64)));
+};
+
+static int mbox_try_push(struct sys_mbox *m, void *msg)
+{
+    u64_t pos = __atomic_load_n(&m->tail,__ATOMIC_RELAXED);
+    struct sys_mbox_slot *s;
+    sint64_t diff;
+
+    while (1) {
+	s = &m->slots[pos & m->mask];
+	diff = (sint64_t)__atomic_load_n(&s->seq,__ATOMIC_ACQUIRE) - (sint64_t)pos;
+	if (diff==0) {
+	    // slot is free on this lap, claim it (a failed CAS reloads pos)
+	    if (__atomic_compare_exchange_n(&m->tail,&pos,pos+1,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) {
+		break;
+	    }
+	} else if (diff<0) {
+	    // consumer has not yet freed the slot from the previous lap
+	    return -1;
+	} else {
+	    pos = __atomic_load_n(&m->tail,__ATOMIC_RELAXED);
+	}
+    }
+
+    s->msg = msg;
+    __atomic_store_n(&s->seq,pos+1,__ATOMIC_RELEASE);
+    return 0;
+}
+
+static int mbox_try_pull(struct sys_mbox *m, void **msg)
+{
+    u64_t pos = __atomic_load_n(&m->head,__ATOMIC_RELAXED);
+    struct sys_mbox_slot *s;
+    sint64_t diff;
+
+    while (1) {
+	s = &m->slots[pos & m->mask];
+	diff = (sint64_t)__atomic_load_n(&s->seq,__ATOMIC_ACQUIRE) - (sint64_t)(pos+1);
+	if (diff==0) {
+	    if (__atomic_compare_exchange_n(&m->head,&pos,pos+1,0,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) {
+		break;
+	    }
+	} else if (diff<0) {
+	    // producer has not filled the slot yet
+	    return -1;
+	} else {
+	    pos = __atomic_load_n(&m->head,__ATOMIC_RELAXED);
+	}
+    }
+
+    *msg = s->msg;
+    // free the slot for the producer on the next lap
+    __atomic_store_n(&s->seq,pos+m->mask+1,__ATOMIC_RELEASE);
+    return 0;
+}
+
+static int mbox_nonempty(struct sys_mbox *m)
+{
+    u64_t pos = __atomic_load_n(&m->head,__ATOMIC_RELAXED);
+    return (sint64_t)(m->slots[pos & m->mask].seq - (pos+1)) >= 0;
+}
+
+static int mbox_nonfull(struct sys_mbox *m)
+{
+    u64_t pos = __atomic_load_n(&m->tail,__ATOMIC_RELAXED);
+    return (sint64_t)(m->slots[pos & m->mask].seq - pos) >= 0;
+}
+
+// The full barrier pairs with the sleeper's atomic increment of
+// its counter before it rechecks the ring under the wait queue lock,
+// so either we see the sleeper or the sleeper sees our update
+static inline void mbox_wake(volatile u64_t *sleepers, nk_wait_queue_t *wq)
+{
+    __sync_synchronize();
+    if (*sleepers) {
+	nk_wait_queue_wake_one(wq);
+    }
+}
+
+static int mbox_push(struct sys_mbox *m, void *msg)
+{
+    if (mbox_try_push(m,msg)) {
+	return -1;
+    }
+    mbox_wake(&m->fetch_sleepers,m->fetch_waitq);
+    return 0;
+}
+
+static int mbox_pull(struct sys_mbox *m, void **msg)
+{
+    if (mbox_try_pull(m,msg)) {
+	return -1;
+    }
+    mbox_wake(&m->post_sleepers,m->post_waitq);
+    return 0;
+}
+
+struct mbox_op {
+    struct sys_mbox *m;
+    nk_timer_t      *timer;
+    int              fetch;
+};
+
+static int mbox_ready(void *s)
+{
+    struct mbox_op *o = (struct mbox_op *)s;
+    return o->fetch ? mbox_nonempty(o->m) : mbox_nonfull(o->m);
+}
+
+static int mbox_timer_fired(void *s)
+{
+    struct mbox_op *o = (struct mbox_op *)s;
+    return __sync_fetch_and_or(&o->timer->state,0)==NK_TIMER_SIGNALLED;
+}
+
+// blocking fetch (fetch=1) or post (fetch=0), timeout_ns==0 waits forever
+// returns 0 on success, 1 on timeout, -1 on error
+static int mbox_wait(struct sys_mbox *m, void **msg, u64_t timeout_ns, int fetch)
+{
+    volatile u64_t *sleepers = fetch ? &m->fetch_sleepers : &m->post_sleepers;
+    nk_wait_queue_t *wq = fetch ? m->fetch_waitq : m->post_waitq;
+    struct mbox_op o = { m, 0, fetch };
+    u64_t start = nk_sched_get_realtime();
+    u64_t now = start;
+
+    while (1) {
+	if (fetch ? !mbox_pull(m,msg) : !mbox_push(m,*msg)) {
+	    return 0;
+	}
+
+	if (timeout_ns && (now-start) >= timeout_ns) {
+	    return 1;
+	}
+
+	__sync_fetch_and_add(sleepers,1);
+
+	if (!timeout_ns) {
+	    nk_wait_queue_sleep_extended(wq,mbox_ready,&o);
+	} else {
+	    nk_wait_queue_t *queues[2] = { wq, 0 };
+	    int (*condchecks[2])(void *) = { mbox_ready, mbox_timer_fired };
+	    void *states[2] = { &o, &o };
+
+	    o.timer = nk_timer_get_thread_default();
+
+	    if (!o.timer ||
+		nk_timer_set(o.timer, timeout_ns - (now-start), NK_TIMER_WAIT_ONE, 0, 0, 0) ||
+		nk_timer_start(o.timer)) {
+		ERROR("Cannot set up mbox timeout\n");
+		__sync_fetch_and_sub(sleepers,1);
+		return -1;
+	    }
+
+	    queues[1] = o.timer->waitq;
+	    nk_wait_queue_sleep_extended_multiple(2,queues,condchecks,states);
+	    nk_timer_cancel(o.timer);
+	}
+
+	__sync_fetch_and_sub(sleepers,1);
+	now = nk_sched_get_realtime();
+    }
+}
+
 int sys_mbox_valid(sys_mbox_t *mbox)
 {
     DEBUG("Is mb %p valid ? mb->mq=%p\n", mbox, mbox ? mbox->mq : 0);
@@ -220,22 +411,56 @@ int sys_mbox_valid(sys_mbox_t *mbox)
     return rc;
 }
 
+static void mbox_destroy(struct sys_mbox *m)
+{
+    if (m->fetch_waitq) {
+	nk_wait_queue_destroy(m->fetch_waitq);
+    }
+    if (m->post_waitq) {
+	nk_wait_queue_destroy(m->post_waitq);
+    }
+    free(m);
+}
+
 err_t sys_mbox_new(sys_mbox_t *mb, int size)
 {
+    struct sys_mbox *m;
+    u64_t n, i;
+
     DEBUG("Mbox new %p size=%d\n",mb,size);
 
     if (size<=0) {
 	size = 256;
 	DEBUG("Corrected to %d\n",size);
     }
-    
-    mb->mq = nk_msg_queue_create(0,size,NK_MSG_QUEUE_DEFAULT,0);
 
-    if(!mb->mq) {
+    // ring indices wrap with a mask
+    for (n=2; n<size; n<<=1) { }
+
+    m = malloc(sizeof(*m) + n*sizeof(struct sys_mbox_slot));
+
+    if (!m) {
+	return ERR_MEM;
+    }
+
+    memset(m,0,sizeof(*m));
+    m->mask = n-1;
+    for (i=0;i<n;i++) {
+	m->slots[i].seq = i;
+	m->slots[i].msg = 0;
+    }
+
+    m->fetch_waitq = nk_wait_queue_create(0);
+    m->post_waitq = nk_wait_queue_create(0);
+
+    if (!m->fetch_waitq || !m->post_waitq) {
+	mbox_destroy(m);
 	return ERR_MEM;
     }
 
-    DEBUG("Mbox new %p size=%d succeeded\n",mb,size);
+    mb->mq = m;
+
+    DEBUG("Mbox new %p size=%d (%lu slots) succeeded\n",mb,size,n);
 
     return ERR_OK;
 }
@@ -246,7 +471,7 @@ void sys_mbox_free(sys_mbox_t *mb)
 
     DEBUG("Mbox free %p\n",mb);
 
-    nk_msg_queue_release(mb->mq);
+    mbox_destroy(mb->mq);
 
     mb->mq=0;
 
@@ -259,7 +484,9 @@ void sys_mbox_post(sys_mbox_t *mb, void *msg)
     
     LWIP_ASSERT("invalid mbox", sys_mbox_valid(mb) );
 
-    nk_msg_queue_push(mb->mq,msg);
+    if (mbox_wait(mb->mq,&msg,0,0)) {
+	ERROR("Unexpected mbox failure\n");
+    }
 }
 
 
@@ -269,7 +496,7 @@ err_t sys_mbox_trypost(sys_mbox_t *mb, void *msg)
 
     LWIP_ASSERT("invalid mbox", sys_mbox_valid(mb) );
     
-    if (nk_msg_queue_try_push(mb->mq,msg)) {
+    if (mbox_push(mb->mq,msg)) {
 	DEBUG("Mbox try post %p %p Failed\n",mb,msg);
 	return ERR_MEM;
     } else {
@@ -288,43 +515,32 @@ u32_t sys_arch_mbox_fetch(sys_mbox_t *mb, void **msg, u32_t timeout)
 
     DEBUG("Mbox fetch %p timeout=%u\n",mb,timeout);
     
-    if (timeout==0) {
-	nk_msg_queue_pull(mb->mq,msg);
-	end = nk_sched_get_realtime();
+    int flag = mbox_wait(mb->mq,msg,timeout*NS_PER_MS,1);
+    end = nk_sched_get_realtime();
+    if (flag>0) {
+	DEBUG("Mbox fetch %p timed out\n",mb);
+	return SYS_ARCH_TIMEOUT;
+    } else if (flag==0) {
 	DEBUG("Mbox fetch %p %p succeeded time=%u\n",mb,*msg, CEIL_DIV(end-start,NS_PER_MS));
 	return CEIL_DIV(end-start,NS_PER_MS);
     } else {
-	int flag = nk_msg_queue_pull_timeout(mb->mq,msg,timeout*NS_PER_MS);
-	end = nk_sched_get_realtime();
-	if (flag>0) {
-	    DEBUG("Mbox fetch %p timed out\n",mb);
-	    return SYS_ARCH_TIMEOUT;
-	} else if (flag==0) {
-	    DEBUG("Mbox fetch %p %p succeeded time=%u\n",mb,*msg, CEIL_DIV(end-start,NS_PER_MS));
-	    return CEIL_DIV(end-start,NS_PER_MS);
-	} else {
-	    ERROR("Unexpected mbox failure\n");
-	    return SYS_ARCH_TIMEOUT;
-	}
+	ERROR("Unexpected mbox failure\n");
+	return SYS_ARCH_TIMEOUT;
     }
 }
 
 u32_t sys_arch_mbox_tryfetch(sys_mbox_t *mb, void **msg)
 {
-    uint64_t start = nk_sched_get_realtime();
-    uint64_t end;
-
     DEBUG("Mbox try fetch %p\n",mb);
     
     LWIP_ASSERT("invalid mbox", sys_mbox_valid(mb));
     
-    if (nk_msg_queue_try_pull(mb->mq,msg)) {
+    if (mbox_pull(mb->mq,msg)) {
 	DEBUG("Mbox try fetch %p failed\n",mb);
 	return SYS_MBOX_EMPTY;
     } else {
-	end = nk_sched_get_realtime();
 	DEBUG("Mbox try fetch %p %p succeeded\n",mb,*msg);
-	return CEIL_DIV(end-start,NS_PER_MS);;
+	return 0;
     }
 }
 
@@ -332,7 +548,7 @@ void sys_mbox_set_invalid(sys_mbox_t *mb)
 {
     DEBUG("Mbox set invalid %p\n",mb);
     if (mb->mq) { 
-	nk_msg_queue_release(mb->mq);
+	mbox_destroy(mb->mq);
 	mb->mq=0;
     }
 }
@@ -371,6 +587,26 @@ void sys_arch_unprotect(sys_prot_t pval)
     //DEBUG("Unprotect\n");
 }
 
+u32_t sys_arch_cpu(void)
+{
+    return my_cpu_id();
+}
+
+u32_t sys_arch_num_cpus(void)
+{
+    return nk_get_num_cpus();
+}
+
+sys_prot_t sys_arch_local_protect(void)
+{
+    return (sys_prot_t) (uint64_t) irq_disable_save();
+}
+
+void sys_arch_local_unprotect(sys_prot_t pval)
+{
+    irq_enable_restore((uint8_t) (uint64_t) pval);
+}
+
 //void sys_msleep(u32_t ms)
 //{
 //    nk_sleep(ms*NS_PER_MS);
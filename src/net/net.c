@@ -134,6 +134,24 @@ handle_net (char * buf, void * priv)
         return 0;
     }      
 
+    if (!strncasecmp(buf,"net arp show",12)) {
+        nk_net_ethernet_arp_dump();
+        return 0;
+    }
+
+    if (sscanf(buf,"net arp resolve %u.%u.%u.%u",&ip[0],&ip[1],&ip[2],&ip[3])==4) {
+        ipv4_addr_t ipv4 = ip[0]<<24 | ip[1]<<16 | ip[2]<<8 | ip[3];
+        ethernet_mac_addr_t mac;
+        int rc = nk_net_ethernet_arp_resolve(0,ipv4,mac,0);
+        if (rc) {
+            nk_vc_printf("Resolution of %u.%u.%u.%u failed\n",ip[0],ip[1],ip[2],ip[3]);
+        } else {
+            nk_vc_printf("Lookup of %u.%u.%u.%u is %02x:%02x:%02x:%02x:%02x:%02x\n",
+                    ip[0],ip[1],ip[2],ip[3], mac[0],mac[1],mac[2],mac[3],mac[4],mac[5]);
+        }
+        return 0;
+    }
+
     if (sscanf(buf,"net arp ask %u.%u.%u.%u",&ip[0],&ip[1],&ip[2],&ip[3])==4) {
         ipv4_addr_t ipv4 = ip[0]<<24 | ip[1]<<16 | ip[2]<<8 | ip[3];
         ethernet_mac_addr_t mac;
@@ -7,6 +7,10 @@
 #include <nautilus/thread.h>
 #include <nautilus/barrier.h>
 #include <nautilus/scheduler.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/list.h>
+#include <nautilus/atomic.h>
 
 #include <rt/ndpc/ndpc_preempt_threads.h>
 
@@ -27,14 +31,207 @@
 */
 
 
+/*
+  Threads created with ndpc_create_preempt_thread() are run by a pool
+  of detached worker threads that are reused from one creation to the
+  next.  Every created thread is handed to a worker of its own (an idle
+  one if there is one, a new one otherwise), so created threads can
+  still block on each other, as they could if they were real threads.
+  Workers that finish go back on the idle list unless it is already
+  full, in which case they exit.
+
+  The thread_id_t of a created thread is its task, tagged with the low
+  bit so we can tell it apart from the nk_thread_t of a forked thread.
+  Created threads that ask to be bound to a CPU get a thread of their
+  own, since the workers are not bound.
+*/
+
+#define POOL_MAX_IDLE       (2*nk_get_num_cpus())
+#define POOL_STACK_SIZE     (16*4096)
+
+#define TASK_TAG            0x1ULL
+#define IS_TASK(id)         (((uint64_t)(id)) & TASK_TAG)
+#define TASK_TO_ID(t)       ((thread_id_t)(((uint64_t)(t)) | TASK_TAG))
+#define ID_TO_TASK(id)      ((struct task *)(((uint64_t)(id)) & ~TASK_TAG))
+
+struct task {
+    thread_func_t    func;
+    void            *input;
+    void           **output;
+    void            *result;   // used if caller gives no output pointer
+    nk_thread_t     *parent;   // the creator, who may join with us
+    volatile int     done;
+    struct list_head node;     // on the list of outstanding tasks
+};
+
+struct worker {
+    nk_thread_id_t   tid;
+    nk_wait_queue_t *wq;
+    struct task * volatile task;
+    struct list_head node;     // on the idle list
+};
+
 static struct global_state {
-    nk_barrier_t barrier;
+    nk_barrier_t     barrier;
+
+    spinlock_t       lock;     // protects everything below
+    int              num_idle;
+    struct list_head idle;     // idle workers
+    struct list_head tasks;    // created but not yet joined tasks
+    nk_wait_queue_t *join_wq;  // joiners wait here for tasks to finish
+    uint64_t         num_workers;
+
+    // global critical section
+    nk_thread_t     *gcs_owner;
+    int              gcs_depth;
 } global;
 
+static int pool_inited = 0;
+
+static int pool_init()
+{
+    if (pool_inited) {
+	return 0;
+    }
+
+    spinlock_init(&global.lock);
+    INIT_LIST_HEAD(&global.idle);
+    INIT_LIST_HEAD(&global.tasks);
+    global.num_idle = 0;
+    global.num_workers = 0;
+
+    global.join_wq = nk_wait_queue_create("ndpc-join");
+    if (!global.join_wq) {
+	ERROR("Failed to create join wait queue\n");
+	return -1;
+    }
+
+    pool_inited = 1;
+    return 0;
+}
+
 int ndpc_init_preempt_threads()
 {
     DEBUG("Init preempt threads\n");
     nk_barrier_init(&global.barrier,nk_get_num_cpus());
+    return pool_init();
+}
+
+static int task_is_done(void *state)
+{
+    return ((struct task *)state)->done;
+}
+
+static int worker_has_task(void *state)
+{
+    return ((struct worker *)state)->task != 0;
+}
+
+static void run_task(struct task *t)
+{
+    t->func(t->input, t->output ? t->output : &t->result);
+
+    __sync_synchronize();
+    t->done = 1;
+    nk_wait_queue_wake_all(global.join_wq);
+}
+
+// return 1 if the worker should keep going
+static int worker_park(struct worker *w)
+{
+    uint8_t flags = spin_lock_irq_save(&global.lock);
+
+    if (global.num_idle >= POOL_MAX_IDLE) {
+	global.num_workers--;
+	spin_unlock_irq_restore(&global.lock, flags);
+	return 0;
+    }
+
+    w->task = 0;
+    list_add(&w->node, &global.idle);
+    global.num_idle++;
+
+    spin_unlock_irq_restore(&global.lock, flags);
+
+    while (!w->task) {
+	nk_wait_queue_sleep_extended(w->wq, worker_has_task, w);
+    }
+
+    return 1;
+}
+
+static void worker(void *in, void **out)
+{
+    struct worker *w = (struct worker *)in;
+
+    nk_thread_name(get_cur_thread(),"ndpc-worker");
+
+    do {
+	run_task(w->task);
+    } while (worker_park(w));
+
+    nk_wait_queue_destroy(w->wq);
+    free(w);
+}
+
+static void bound_task(void *in, void **out)
+{
+    run_task((struct task *)in);
+}
+
+static int start_task(struct task *t, proc_bind_t proc_bind, stack_size_t stack_size)
+{
+    struct worker *w = 0;
+    nk_thread_id_t tid;
+    uint8_t flags;
+
+    if (proc_bind >= 0) {
+	return nk_thread_start(bound_task, t, 0, 1, stack_size ? stack_size : POOL_STACK_SIZE, &tid, proc_bind);
+    }
+
+    flags = spin_lock_irq_save(&global.lock);
+    if (!list_empty(&global.idle)) {
+	w = list_first_entry(&global.idle, struct worker, node);
+	list_del_init(&w->node);
+	global.num_idle--;
+    }
+    spin_unlock_irq_restore(&global.lock, flags);
+
+    if (w) {
+	// worker is parked, or about to be
+	w->task = t;
+	nk_wait_queue_wake_all(w->wq);
+	return 0;
+    }
+
+    // no one is idle, so grow the pool
+    w = malloc(sizeof(*w));
+    if (!w) {
+	ERROR("Failed to allocate worker\n");
+	return -1;
+    }
+    memset(w,0,sizeof(*w));
+
+    w->wq = nk_wait_queue_create("ndpc-worker");
+    if (!w->wq) {
+	ERROR("Failed to allocate worker wait queue\n");
+	free(w);
+	return -1;
+    }
+
+    w->task = t;
+
+    // workers are detached so that nk_join_all_children() does
+    // not try to wait for them
+    if (nk_thread_start(worker, w, 0, 1, POOL_STACK_SIZE, &w->tid, CPU_ANY)) {
+	ERROR("Failed to start worker\n");
+	nk_wait_queue_destroy(w->wq);
+	free(w);
+	return -1;
+    }
+
+    atomic_inc(global.num_workers);
+
     return 0;
 }
 
@@ -46,14 +243,65 @@ int ndpc_create_preempt_thread(thread_func_t func,
 			       thread_id_t *thread_id)
 
 {
+    struct task *t;
+    uint8_t flags;
+
     DEBUG("create_preempt_thread\n");
-    return nk_thread_start((nk_thread_fun_t) func,
-			   input,
-			   output,
-			   0, // is not detached ?
-			   stack_size,
-			   thread_id,
-			   proc_bind);
+
+    if (pool_init()) {
+	return -1;
+    }
+
+    t = malloc(sizeof(*t));
+    if (!t) {
+	ERROR("Failed to allocate task\n");
+	return -1;
+    }
+    memset(t,0,sizeof(*t));
+
+    t->func = func;
+    t->input = input;
+    t->output = output;
+    t->parent = get_cur_thread();
+
+    flags = spin_lock_irq_save(&global.lock);
+    list_add_tail(&t->node, &global.tasks);
+    spin_unlock_irq_restore(&global.lock, flags);
+
+    if (start_task(t, proc_bind, stack_size)) {
+	flags = spin_lock_irq_save(&global.lock);
+	list_del(&t->node);
+	spin_unlock_irq_restore(&global.lock, flags);
+	free(t);
+	return -1;
+    }
+
+    if (thread_id) {
+	*thread_id = TASK_TO_ID(t);
+    }
+
+    return 0;
+}
+
+// wait for a created thread to finish and release it
+static void *join_task(struct task *t)
+{
+    void *out;
+    uint8_t flags;
+
+    while (!t->done) {
+	nk_wait_queue_sleep_extended(global.join_wq, task_is_done, t);
+    }
+
+    out = t->output ? *t->output : t->result;
+
+    flags = spin_lock_irq_save(&global.lock);
+    list_del(&t->node);
+    spin_unlock_irq_restore(&global.lock, flags);
+
+    free(t);
+
+    return out;
 }
 
 // ndpc_fork_preempt_thread() implemented in the lowlevel file
@@ -92,6 +340,11 @@ void *ndpc_join_preempt_thread(thread_id_t thread_id)
     void *out;
 
     DEBUG("join_preempt_thread(%lu)\n", thread_id);
+    if (IS_TASK(thread_id)) {
+	out = join_task(ID_TO_TASK(thread_id));
+	DEBUG("join_preempt_thread(%lu) succeeded, returning %p\n", thread_id,out);
+	return out;
+    }
     if (nk_join(thread_id, &out)) {
 	DEBUG("join_preempt_thread(%lu) failed, returning null\n", thread_id);
 	return 0;
@@ -109,7 +362,28 @@ static int _fork_join_cb(void *out)
 // Wait for any threads forked or launched by the caller
 void ndpc_join_child_preempt_threads()
 {
+    nk_thread_t *me = get_cur_thread();
+    struct task *t;
+    uint8_t flags;
+
     DEBUG("join_child_preempt_threads() start\n");
+
+    // first the threads we created
+    while (pool_inited) {
+	flags = spin_lock_irq_save(&global.lock);
+	list_for_each_entry(t, &global.tasks, node) {
+	    if (t->parent == me) {
+		break;
+	    }
+	}
+	spin_unlock_irq_restore(&global.lock, flags);
+	if (&t->node == &global.tasks) {
+	    break;
+	}
+	join_task(t);
+    }
+
+    // and then the ones we forked
     nk_join_all_children(_fork_join_cb);
     DEBUG("join_child_preempt_threads() end\n");
 }
@@ -127,30 +401,59 @@ int ndpc_barrier()
 }
 
 // no preemption on this core, other cores continue
+// these nest, and are cheap - just the per-cpu preemption count
 int ndpc_enter_local_critical_section()
 {
-    ERROR("ndpc_enter_local_critical_section NOT IMPLEMENTED\n");
-    return -1; // need to implement
-
+    preempt_disable();
+    return 0;
 }
+
 int ndpc_leave_local_critical_section()
 {
-    ERROR("ndpc_leave_local_critical_section NOT IMPLEMENTED\n");
-    return -1; // need to implement
-
+    preempt_enable();
+    return 0;
 }
 
 // no preemption on this core, other cores stop
+//
+// This is the scheduler's world stop: the other cores are kicked
+// with an IPI and park in the scheduler with interrupts off until
+// we restart the world, so no one polls for the request.  Interrupts
+// are also off on this core for the duration.  Sections nest within
+// the same thread.
 int ndpc_enter_global_critical_section()
 {
-    ERROR("ndpc_enter_global_critical_section NOT IMPLEMENTED\n");
-    return -1; // need to implement
+    nk_thread_t *me = get_cur_thread();
+
+    if (global.gcs_owner == me) {
+	global.gcs_depth++;
+	return 0;
+    }
+
+    nk_sched_stop_world();
+
+    global.gcs_owner = me;
+    global.gcs_depth = 1;
+
+    return 0;
 }
 
 int ndpc_leave_global_critical_section() 
 {
-    ERROR("ndpc_leave_global_critical_section NOT IMPLEMENTED\n");
-    return -1; // need to implement
+    if (global.gcs_owner != get_cur_thread()) {
+	ERROR("leaving a global critical section we are not in\n");
+	return -1;
+    }
+
+    if (--global.gcs_depth) {
+	return 0;
+    }
+
+    global.gcs_owner = 0;
+
+    nk_sched_start_world();
+
+    return 0;
 }
 
 
@@ -4,6 +4,7 @@
 
 #include <math.h>
 #include "defins.h"
+#include "parallel.h"
 #include <cvl.h>
 
 /* This file has lots of ugly C preprocessor macros for generating
@@ -124,6 +125,8 @@
 
 /* --------------Function definition macros --------------------*/
 
+#ifndef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
+
 #define onefuntmp(_name, _funct, _srctype, _desttype)       \
     void _name (d, s, len, scratch)                         \
     vec_p d, s, scratch;                                    \
@@ -175,6 +178,108 @@
     make_no_scratch(_name)                                  \
     make_inplace(_name,INPLACE_1|INPLACE_2|INPLACE_3)
 
+/* random() has global state, so the random op always runs serially */
+#define onefunser onefun
+
+#else /* NAUT_CONFIG_NESL_RT_CVL_PARALLEL */
+
+/* Parallel versions.  The vector is split into chunks by cvl_par_for()
+ * and each chunk is a plain loop that the compiler turns into SSE
+ * (or AVX, see the Makefile) code, so no manual unrolling here.
+ * Chunks never overlap, so in-place operation is fine as long as the
+ * source and destination elements are the same size.  When they are
+ * not (e.g. double->int conversion in place), a later chunk's output
+ * would overlap an earlier chunk's input, so we run those serially.
+ */
+#define par_elwise(_name, _srctype, _desttype, _same, _v)       \
+    if (sizeof(_srctype) != sizeof(_desttype) && (_same)) {     \
+        GLUE(_name,_chunk)(0, (_v).len, 0, &(_v));              \
+    } else {                                                    \
+        cvl_par_for((_v).len, GLUE(_name,_chunk), &(_v));       \
+    }
+
+#define onefun(_name, _funct, _srctype, _desttype)          \
+    static void GLUE(_name,_chunk)(int lo, int hi, int chunk, void *state) \
+    {                                                       \
+        struct cvl_par_vecs *v = (struct cvl_par_vecs *) state; \
+        _desttype *dest = (_desttype *) v->d;               \
+        _srctype *src = (_srctype *) v->s1;                 \
+        int i;                                              \
+        for (i = lo; i < hi; i++) {                         \
+            dest[i] = _funct(src[i]);                       \
+        }                                                   \
+    }                                                       \
+    void _name (d, s, len, scratch)                         \
+    vec_p d, s, scratch;                                    \
+    int len;                                                \
+    {                                                       \
+        struct cvl_par_vecs v = { .d = d, .s1 = s, .len = len }; \
+        par_elwise(_name, _srctype, _desttype, d == s, v)   \
+    }                                                       \
+    make_no_scratch(_name)                                  \
+    make_inplace(_name,INPLACE_1)
+
+#define onefuntmp onefun
+
+#define onefunser(_name, _funct, _srctype, _desttype)       \
+    void _name (d, s, len, scratch)                         \
+    vec_p d, s, scratch;                                    \
+    int len;                                                \
+    {                                                       \
+        register _desttype *dest = (_desttype *) d;         \
+        register _srctype *src = (_srctype *) s;            \
+        unroll1d1s(_funct, len, _desttype)		    \
+    }                                                       \
+    make_no_scratch(_name)                                  \
+    make_inplace(_name,INPLACE_1)
+
+#define twofun(_name, _funct, _srctype, _desttype)          \
+    static void GLUE(_name,_chunk)(int lo, int hi, int chunk, void *state) \
+    {                                                       \
+        struct cvl_par_vecs *v = (struct cvl_par_vecs *) state; \
+        _desttype *dest = (_desttype *) v->d;               \
+        _srctype *src1 = (_srctype *) v->s1;                \
+        _srctype *src2 = (_srctype *) v->s2;                \
+        int i;                                              \
+        for (i = lo; i < hi; i++) {                         \
+            dest[i] = _funct(src1[i], src2[i]);             \
+        }                                                   \
+    }                                                       \
+    void _name (d, s1, s2, len, scratch)                    \
+    vec_p d, s1, s2, scratch;                               \
+    int len;                                                \
+    {                                                       \
+        struct cvl_par_vecs v = { .d = d, .s1 = s1, .s2 = s2, .len = len }; \
+        par_elwise(_name, _srctype, _desttype, d == s1 || d == s2, v) \
+    }                                                       \
+    make_no_scratch(_name)                                  \
+    make_inplace(_name,INPLACE_1|INPLACE_2)
+
+#define selfun(_name, _funct, _type)                        \
+    static void GLUE(_name,_chunk)(int lo, int hi, int chunk, void *state) \
+    {                                                       \
+        struct cvl_par_vecs *v = (struct cvl_par_vecs *) state; \
+        _type *dest = (_type *) v->d;                       \
+        cvl_bool *src1 = (cvl_bool *) v->s1;                \
+        _type *src2 = (_type *) v->s2;                      \
+        _type *src3 = (_type *) v->s3;                      \
+        int i;                                              \
+        for (i = lo; i < hi; i++) {                         \
+            dest[i] = _funct(src1[i], src2[i], src3[i]);    \
+        }                                                   \
+    }                                                       \
+    void _name (d, s1, s2, s3, len, scratch)                \
+    vec_p d, s1, s2, s3, scratch;                           \
+    int len;                                                \
+    {                                                       \
+        struct cvl_par_vecs v = { .d = d, .s1 = s1, .s2 = s2, .s3 = s3, .len = len }; \
+        par_elwise(_name, cvl_bool, _type, d == s1, v)      \
+    }                                                       \
+    make_no_scratch(_name)                                  \
+    make_inplace(_name,INPLACE_1|INPLACE_2|INPLACE_3)
+
+#endif /* NAUT_CONFIG_NESL_RT_CVL_PARALLEL */
+
 #define make_two_zd(_basename, _funct)                     \
     twofun(GLUE(_basename,z), _funct, int, int)            \
     twofun(GLUE(_basename,d), _funct, double, double)
@@ -206,7 +311,7 @@ make_two_cvl_bool_zd(leq_wu, leq)
 twofun(lsh_wuz, lshift, int, int)
 twofun(rsh_wuz, rshift, int, int)
 twofun(mod_wuz, mod, int, int)
-onefun(rnd_wuz, cvlrand, int, int)
+onefunser(rnd_wuz, cvlrand, int, int)
 
 /* comparison functions: valid on all input types and returns a cvl_bool */
 make_two_cvl_bool_bzd(eql_wu, eq)
@@ -24,6 +24,7 @@
 #include <string.h>		/* for memmove declaration */
 #include <cvl.h>
 #include "defins.h"
+#include "parallel.h"
 
 /* -----------------------Timing functions-----------------------------*/
 /* returns number of seconds and microseconds in argument
@@ -296,4 +297,7 @@ int seed;
 void CVL_init ()
 {
   rnd_foz (0);
+#ifdef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
+  cvl_par_init ();
+#endif
 }
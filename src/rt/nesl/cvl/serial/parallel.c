@@ -75,3 +75,256 @@ int test_len_greater_num_proc_prime_spillover() {
 }
 /*END CHUNK_RANGE TESTS*/
 
+
+#ifdef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/atomic.h>
+#include <nautilus/cpu.h>
+#include <nautilus/mm.h>
+#include <cvl.h>
+
+#ifndef NAUT_CONFIG_NESL_RT_DEBUG
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+#define INFO(fmt, args...)     INFO_PRINT("cvl: " fmt, ##args)
+#define DEBUG(fmt, args...)    DEBUG_PRINT("cvl: " fmt, ##args)
+#define ERROR(fmt, args...)    ERROR_PRINT("cvl: " fmt, ##args)
+
+/* WORKER POOL
+ *
+ * Worker i (1 <= i < nworkers) is bound to CPU i, leaving CPU 0 to the
+ * caller that is running the VCODE interpreter.  Each worker has its own
+ * mailbox and wait queue so that a dispatch only touches the workers it
+ * is going to use.  Workers spin for a while after each job before going
+ * to sleep since VCODE programs tend to issue long runs of vector ops
+ * back to back.  The caller waits for the workers in the same way.
+ */
+
+#define CVL_PAR_SPIN_CYCLES 2000000ULL
+
+struct cvl_par_worker {
+    int               index;
+    nk_thread_id_t    tid;
+    nk_wait_queue_t  *wq;
+    volatile int      sleeping;
+    volatile uint64_t go;       /* bumped by the dispatcher for each job */
+    uint64_t          seen;     /* last job this worker has run */
+    cvl_par_fn_t      fn;
+    void             *state;
+    int               lo, hi;
+} __attribute__((aligned(64)));
+
+static struct cvl_par_pool {
+    int               inited;
+    int               nworkers;   /* including the caller */
+    int               grain;
+    spinlock_t        lock;       /* held by the current dispatcher */
+    volatile int      pending;    /* chunks of the current job still running */
+    nk_wait_queue_t  *wq;         /* the dispatcher sleeps here */
+    volatile int      waiting;
+    struct cvl_par_worker workers[CVL_PAR_MAX_CHUNKS];
+} pool;
+
+static int job_ready(void *state)
+{
+    struct cvl_par_worker *w = (struct cvl_par_worker *)state;
+    return w->go != w->seen;
+}
+
+static int job_done(void *state)
+{
+    return !pool.pending;
+}
+
+static void worker(void *in, void **out)
+{
+    struct cvl_par_worker *w = (struct cvl_par_worker *)in;
+    char name[32];
+
+    snprintf(name,32,"cvl-worker-%d",w->index);
+    nk_thread_name(get_cur_thread(),name);
+
+    DEBUG("worker %d running on cpu %d\n", w->index, my_cpu_id());
+
+    while (1) {
+	uint64_t start = rdtsc();
+
+	while (!job_ready(w) && (rdtsc() - start) < CVL_PAR_SPIN_CYCLES) {
+	    asm volatile ("pause");
+	}
+
+	while (!job_ready(w)) {
+	    w->sleeping = 1;
+	    mbarrier();
+	    nk_wait_queue_sleep_extended(w->wq, job_ready, w);
+	    w->sleeping = 0;
+	}
+
+	w->seen = w->go;
+	mbarrier();
+
+	w->fn(w->lo, w->hi, w->index, w->state);
+
+	if (!atomic_dec_val(pool.pending) && pool.waiting) {
+	    nk_wait_queue_wake_all(pool.wq);
+	}
+    }
+}
+
+int cvl_par_init(void)
+{
+    int i;
+    int n = nk_get_num_cpus();
+
+    if (pool.inited) {
+	return 0;
+    }
+
+#if NAUT_CONFIG_NESL_RT_CVL_WORKERS > 0
+    if (n > NAUT_CONFIG_NESL_RT_CVL_WORKERS) {
+	n = NAUT_CONFIG_NESL_RT_CVL_WORKERS;
+    }
+#endif
+    if (n > CVL_PAR_MAX_CHUNKS) {
+	n = CVL_PAR_MAX_CHUNKS;
+    }
+
+    spinlock_init(&pool.lock);
+    pool.grain = NAUT_CONFIG_NESL_RT_CVL_GRAIN;
+    pool.nworkers = 1;
+
+    pool.wq = nk_wait_queue_create("cvl-wq-0");
+    if (!pool.wq) {
+	ERROR("Failed to allocate wait queue for the caller, running serially\n");
+	n = 1;
+    }
+
+    for (i = 1; i < n; i++) {
+	struct cvl_par_worker *w = &pool.workers[i];
+	char name[32];
+
+	snprintf(name,32,"cvl-wq-%d",i);
+
+	w->index = i;
+	w->wq = nk_wait_queue_create(name);
+	if (!w->wq) {
+	    ERROR("Failed to allocate wait queue for worker %d\n",i);
+	    break;
+	}
+	if (nk_thread_start(worker, w, 0, 1, TSTACK_1MB, &w->tid, i)) {
+	    ERROR("Failed to start worker %d\n",i);
+	    nk_wait_queue_destroy(w->wq);
+	    break;
+	}
+	pool.nworkers++;
+    }
+
+    pool.inited = 1;
+
+    INFO("parallel CVL using %d workers, grain %d\n", pool.nworkers, pool.grain);
+
+    return 0;
+}
+
+int cvl_par_chunks(int len)
+{
+    int n;
+
+    if (!pool.inited || pool.nworkers < 2) {
+	return 1;
+    }
+
+    n = len / pool.grain;
+
+    if (n > pool.nworkers) {
+	n = pool.nworkers;
+    }
+
+    return n < 1 ? 1 : n;
+}
+
+void cvl_par_run(int len, int nchunks, cvl_par_fn_t fn, void *state)
+{
+    int i;
+    int vals[2];
+    uint64_t start;
+
+    if (nchunks < 2 || spin_try_lock(&pool.lock)) {
+	/* too small, or the pool is busy with another caller - just
+	   run the chunks in order ourselves */
+	for (i = 0; i < nchunks; i++) {
+	    chunk_range(vals, i, len, nchunks);
+	    if (vals[0] >= 0) {
+		fn(vals[0], vals[1], i, state);
+	    }
+	}
+	return;
+    }
+
+    pool.pending = nchunks - 1;
+
+    for (i = 1; i < nchunks; i++) {
+	struct cvl_par_worker *w = &pool.workers[i];
+
+	chunk_range(vals, i, len, nchunks);
+
+	w->fn = fn;
+	w->state = state;
+	w->lo = vals[0];
+	w->hi = vals[1];
+	mbarrier();
+	w->go++;
+	mbarrier();
+	if (w->sleeping) {
+	    nk_wait_queue_wake_all(w->wq);
+	}
+    }
+
+    chunk_range(vals, 0, len, nchunks);
+    fn(vals[0], vals[1], 0, state);
+
+    start = rdtsc();
+
+    while (pool.pending && (rdtsc() - start) < CVL_PAR_SPIN_CYCLES) {
+	asm volatile ("pause");
+    }
+
+    while (pool.pending) {
+	pool.waiting = 1;
+	mbarrier();
+	nk_wait_queue_sleep_extended(pool.wq, job_done, 0);
+	pool.waiting = 0;
+    }
+
+    spin_unlock(&pool.lock);
+}
+
+int *cvl_par_seg_starts(int *segd, int m)
+{
+    int *starts = (int *) cvl_par_alloc(sizeof(int)*m);
+
+    if (!starts) {
+	ERROR("Failed to allocate segment starts for %d segments\n", m);
+	return 0;
+    }
+
+    add_suz(starts, segd, m, CVL_SCRATCH_NULL);
+
+    return starts;
+}
+
+void *cvl_par_alloc(int size)
+{
+    return malloc(size);
+}
+
+void cvl_par_free(void *p)
+{
+    free(p);
+}
+
+#endif /* NAUT_CONFIG_NESL_RT_CVL_PARALLEL */
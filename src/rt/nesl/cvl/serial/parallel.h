@@ -3,5 +3,93 @@
 #include <assert.h>
 
 void chunk_range(int * vals, int index, int length, int num_procs);
-#endif 
 
+#ifdef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
+
+/* Parallel CVL support
+ *
+ * Vectors are split into at most CVL_PAR_MAX_CHUNKS contiguous chunks
+ * with chunk_range().  Chunk 0 is always run by the calling thread, and
+ * chunk i>0 by the worker pinned to the i-th CPU in the pool, so a
+ * given chunk of a given vector length always lands on the same CPU.
+ * Vectors shorter than two grains are run serially by the caller.
+ */
+
+#define CVL_PAR_MAX_CHUNKS 64
+
+/* work function: handles elements [lo,hi) of the vector as chunk "chunk" */
+typedef void (*cvl_par_fn_t)(int lo, int hi, int chunk, void *state);
+
+/* start the worker pool (idempotent, called from CVL_init) */
+int  cvl_par_init(void);
+
+/* number of chunks that a vector of length len will be split into */
+int  cvl_par_chunks(int len);
+
+/* run fn over [0,len) in exactly nchunks chunks and wait for all of
+ * them to finish; nchunks must come from cvl_par_chunks(len) */
+void cvl_par_run(int len, int nchunks, cvl_par_fn_t fn, void *state);
+
+/* the common case where the caller does not need per-chunk state */
+static inline void cvl_par_for(int len, cvl_par_fn_t fn, void *state)
+{
+    int nchunks = cvl_par_chunks(len);
+
+    if (nchunks <= 1) {
+	fn(0, len, 0, state);
+    } else {
+	cvl_par_run(len, nchunks, fn, state);
+    }
+}
+
+/* Segment helpers for the segmented scans and reduces.  starts[] is
+ * the index of the first element of each segment (an exclusive add
+ * scan of the segment descriptor); free it with cvl_par_free() */
+int *cvl_par_seg_starts(int *segd, int m);
+
+/* temporary memory for the parallel versions */
+void *cvl_par_alloc(int size);
+void cvl_par_free(void *p);
+
+/* last segment that starts at or before pos (the one containing pos) */
+static inline int cvl_par_seg_containing(int *starts, int m, int pos)
+{
+    int lo = 0, hi = m;
+
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+	if (starts[mid] <= pos) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return lo - 1;
+}
+
+/* first segment that starts at or after pos */
+static inline int cvl_par_seg_from(int *starts, int m, int pos)
+{
+    int lo = 0, hi = m;
+
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+	if (starts[mid] < pos) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
+	}
+    }
+    return lo;
+}
+
+/* vector arguments of an elementwise or permute operation, handed to
+ * the per-chunk work functions */
+struct cvl_par_vecs {
+    void *d, *s1, *s2, *s3, *s4;
+    int   len;
+};
+
+#endif /* NAUT_CONFIG_NESL_RT_CVL_PARALLEL */
+
+#endif
@@ -14,6 +14,7 @@
 
 #include <cvl.h>
 #include <limits.h>
+#include "parallel.h"
 
 /* ------------------------ Radix Rank ----------------------------- */
 
@@ -46,7 +47,7 @@
 #define BitsForPassMask	~(~0 << BitsPerPass)
 #define bits(_x,_k) 	((((unsigned)_x) >> _k) & BitsForPassMask)
 
-static void field_rank(result, source, tmp, n)
+static void field_rank_serial(result, source, tmp, n)
 int *result, *tmp; 
 unsigned int *source;
 int n;
@@ -70,6 +71,99 @@ int n;
     }
 }
 
+#ifndef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
+#define field_rank field_rank_serial
+#else
+/* Parallel radix rank.  Each pass is done in three steps:
+ *   1. each chunk histograms its part of the current permutation
+ *   2. the caller turns the histograms into a starting offset for each
+ *      (bucket, chunk) pair, bucket-major, so the rank stays stable
+ *   3. each chunk moves its part to the offsets it was given
+ * Instead of copying back into tmp after each pass, the two buffers
+ * swap roles.  As in the serial version, the final permutation ends
+ * up in tmp.
+ */
+struct field_rank_par {
+    unsigned int *source;
+    int *from, *to;
+    int startbit;
+    int (*count)[NumBuckets];
+};
+
+static void field_rank_hist(int lo, int hi, int c, void *state)
+{
+    struct field_rank_par *p = (struct field_rank_par *)state;
+    int *count = p->count[c];
+    int i, j;
+
+    for (j = 0; j < NumBuckets; j++)
+	count[j] = 0;
+    for (i = lo; i < hi; i++)
+	count[bits(p->source[p->from[i]], p->startbit)]++;
+}
+
+static void field_rank_move(int lo, int hi, int c, void *state)
+{
+    struct field_rank_par *p = (struct field_rank_par *)state;
+    int *offset = p->count[c];
+    int i;
+
+    for (i = lo; i < hi; i++)
+	p->to[offset[bits(p->source[p->from[i]], p->startbit)]++] = p->from[i];
+}
+
+static void field_rank_copy(int lo, int hi, int c, void *state)
+{
+    struct field_rank_par *p = (struct field_rank_par *)state;
+    int i;
+
+    for (i = lo; i < hi; i++)
+	p->to[i] = p->from[i];
+}
+
+static void field_rank(result, source, tmp, n)
+int *result, *tmp; 
+unsigned int *source;
+int n;
+{
+  struct field_rank_par p;
+  int nc = cvl_par_chunks(n);
+  int *swap;
+  int c, j, sum;
+
+  if (nc <= 1 ||
+      !(p.count = cvl_par_alloc(sizeof(int)*NumBuckets*nc))) {
+      field_rank_serial(result, source, tmp, n);
+      return;
+  }
+
+  p.source = source;
+  p.from = tmp;
+  p.to = result;
+
+  for (p.startbit = 0; p.startbit < BitsPerWord; p.startbit += BitsPerPass)
+    {
+      cvl_par_run(n, nc, field_rank_hist, &p);
+      for (sum = 0, j = 0; j < NumBuckets; j++) {
+	for (c = 0; c < nc; c++) {
+	  int cnt = p.count[c][j];
+	  p.count[c][j] = sum;
+	  sum += cnt;
+	}
+      }
+      cvl_par_run(n, nc, field_rank_move, &p);
+      swap = p.from; p.from = p.to; p.to = swap;
+    }
+
+  if (p.from != tmp) {		/* odd number of passes */
+      p.to = tmp;
+      cvl_par_run(n, nc, field_rank_copy, &p);
+  }
+
+  cvl_par_free(p.count);
+}
+#endif /* NAUT_CONFIG_NESL_RT_CVL_PARALLEL */
+
 /* ---------------------- Integer Rank ----------------------------*/
 /* This function does all the integer ranks: up, down, segmented,
  * unsegmented.  Algorithm is: 
@@ -3,8 +3,376 @@
 */
 
 #include "defins.h"
+#include "parallel.h"
 #include <cvl.h>
 
+#ifdef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
+/* ------------------Parallel Versions--------------------------------*/
+
+/* These replace the serial templates below when the parallel CVL is
+ * configured.  Vectors shorter than two grains (see cvl_par_chunks())
+ * go straight to a serial loop.  Otherwise:
+ *
+ *   scans:   two-pass block algorithm.  The first pass reduces each
+ *            chunk, the caller scans the (at most CVL_PAR_MAX_CHUNKS)
+ *            chunk totals, and the second pass scans each chunk
+ *            starting from its carry-in.
+ *   reduces: each chunk reduces its part, the caller combines.
+ *
+ * The segmented versions split by element, not by segment, so that one
+ * huge segment or many tiny ones are handled equally well.  In the
+ * first pass of a segmented scan, a chunk only sums up its tail since
+ * the last segment start it contains, and notes whether it contains a
+ * segment start at all; a carry only flows through chunks that don't.
+ * A segmented reduce writes the segments that start in a chunk
+ * directly, and the caller folds in the head of any segment that
+ * started in an earlier chunk.  All the operators here are
+ * associative and commutative, so only the order in which doubles are
+ * added differs from the serial versions.
+ */
+
+#define simpscan(_name, _func, _type, _init)			\
+    struct GLUE(_name,_par) {					\
+	_type *d, *s;						\
+	_type part[CVL_PAR_MAX_CHUNKS];				\
+    };								\
+    static void GLUE(_name,_up)(int lo, int hi, int c, void *state)	\
+    {								\
+	struct GLUE(_name,_par) *p = (struct GLUE(_name,_par) *)state;	\
+	_type *src = p->s;					\
+	_type sum = _init;					\
+	int i;							\
+	for (i = lo; i < hi; i++) {				\
+	    sum = _func(sum, src[i]);				\
+	}							\
+	p->part[c] = sum;					\
+    }								\
+    static void GLUE(_name,_down)(int lo, int hi, int c, void *state)	\
+    {								\
+	struct GLUE(_name,_par) *p = (struct GLUE(_name,_par) *)state;	\
+	_type *dest = p->d;					\
+	_type *src = p->s;					\
+	_type tmp, sum = p->part[c];				\
+	int i;							\
+	for (i = lo; i < hi; i++) {				\
+	    tmp = sum; sum = _func(sum, src[i]); dest[i] = tmp;	\
+	}							\
+    }								\
+    void _name(d, s, len, scratch)				\
+    vec_p d, s, scratch;					\
+    int len;							\
+	{							\
+	struct GLUE(_name,_par) p;				\
+	int c, n = cvl_par_chunks(len);				\
+	_type tmp, sum = _init;					\
+	p.d = (_type *)d;					\
+	p.s = (_type *)s;					\
+	if (n <= 1) {						\
+	    p.part[0] = _init;					\
+	    GLUE(_name,_down)(0, len, 0, &p);			\
+	    return;						\
+	}							\
+	cvl_par_run(len, n, GLUE(_name,_up), &p);		\
+	for (c = 0; c < n; c++) {				\
+	    tmp = p.part[c]; p.part[c] = sum; sum = _func(sum, tmp);	\
+	}							\
+	cvl_par_run(len, n, GLUE(_name,_down), &p);		\
+	}							\
+    make_no_scratch(_name)					\
+    make_inplace(_name,INPLACE_1)
+
+#define simpsegscan(_name, _funct, _type, _init, _unseg)		\
+    struct GLUE(_name,_par) {						\
+	_type *d, *s;							\
+	int *segd, *starts;						\
+	int n, m;							\
+	_type part[CVL_PAR_MAX_CHUNKS];					\
+	int head[CVL_PAR_MAX_CHUNKS];					\
+    };									\
+    static void GLUE(_name,_up)(int lo, int hi, int c, void *state)	\
+    {									\
+	struct GLUE(_name,_par) *p = (struct GLUE(_name,_par) *)state;	\
+	int j = cvl_par_seg_containing(p->starts, p->m, hi-1);		\
+	int first = p->starts[j] > lo ? p->starts[j] : lo;		\
+	_type sum = (_type) _init;					\
+	int i;								\
+	for (i = first; i < hi; i++) {					\
+	    sum = _funct(sum, p->s[i]);					\
+	}								\
+	p->part[c] = sum;						\
+	p->head[c] = p->starts[j] >= lo;				\
+    }									\
+    static void GLUE(_name,_down)(int lo, int hi, int c, void *state)	\
+    {									\
+	struct GLUE(_name,_par) *p = (struct GLUE(_name,_par) *)state;	\
+	_type *dest = p->d;						\
+	_type *src = p->s;						\
+	int j = cvl_par_seg_containing(p->starts, p->m, lo);		\
+	_type tmp, sum = p->starts[j] == lo ? (_type) _init : p->part[c];	\
+	int i = lo, end;						\
+	while (i < hi) {						\
+	    end = j + 1 < p->m ? p->starts[j+1] : p->n;			\
+	    if (end > hi) { end = hi; }					\
+	    for (; i < end; i++) {					\
+		tmp = sum; sum = _funct(sum, src[i]); dest[i] = tmp;	\
+	    }								\
+	    j++;							\
+	    sum = (_type) _init;					\
+	}								\
+    }									\
+    void _name (d, s, sd, n, m, scratch)				\
+    vec_p d, s, sd, scratch;						\
+    int n, m;								\
+    { 									\
+	struct GLUE(_name,_par) p;					\
+	int c, nc;							\
+	_type sum = (_type) _init;					\
+									\
+	if (m == 1) {_unseg(d,s,n,scratch); return;}			\
+	nc = cvl_par_chunks(n);						\
+	if (nc <= 1 || !(p.starts = cvl_par_seg_starts((int *)sd, m))) {	\
+	    nc = 1;							\
+	}								\
+	if (nc == 1) {							\
+	    register _type *src_end = (_type *) s;			\
+	    register _type *src = (_type *)s;				\
+	    int *segd = (int *)sd;					\
+	    int *segd_end = (int *)sd + m;				\
+	    register _type *dest = (_type *)d;				\
+	    register _type tmp;						\
+	    while (segd < segd_end) {					\
+		src_end += *segd++;					\
+		sum = (_type) _init;					\
+		while (src < src_end) {					\
+		    tmp = sum;						\
+		    sum = _funct(sum, *src);				\
+		    *dest++ = tmp;					\
+		    src++;						\
+		}							\
+	    }								\
+	    return;							\
+	}								\
+	p.d = (_type *)d;						\
+	p.s = (_type *)s;						\
+	p.segd = (int *)sd;						\
+	p.n = n;							\
+	p.m = m;							\
+	cvl_par_run(n, nc, GLUE(_name,_up), &p);			\
+	for (c = 0; c < nc; c++) {					\
+	    _type in = sum;						\
+	    sum = p.head[c] ? p.part[c] : _funct(sum, p.part[c]);	\
+	    p.part[c] = in;						\
+	}								\
+	cvl_par_run(n, nc, GLUE(_name,_down), &p);			\
+	cvl_par_free(p.starts);						\
+    }									\
+    make_no_seg_scratch(_name)						\
+    make_inplace(_name,INPLACE_1)
+
+#define reduce(_name, _funct, _type, _identity)         \
+    struct GLUE(_name,_par) {				\
+	_type *s;					\
+	_type part[CVL_PAR_MAX_CHUNKS];			\
+    };							\
+    static void GLUE(_name,_chunk)(int lo, int hi, int c, void *state) \
+    {							\
+	struct GLUE(_name,_par) *p = (struct GLUE(_name,_par) *)state;	\
+	_type *src = p->s;				\
+	_type sum = _identity;				\
+	int i;						\
+	for (i = lo; i < hi; i++) {			\
+	    sum = _funct(sum, src[i]);			\
+	}						\
+	p->part[c] = sum;				\
+    }							\
+    _type _name(s, len, scratch)			\
+    vec_p s, scratch;					\
+    int len;						\
+    {							\
+      struct GLUE(_name,_par) p;			\
+      _type sum = _identity;				\
+      int c, n = cvl_par_chunks(len);			\
+      p.s = (_type *)s;					\
+      if (n <= 1) {					\
+	  GLUE(_name,_chunk)(0, len, 0, &p);		\
+	  return p.part[0];				\
+      }							\
+      cvl_par_run(len, n, GLUE(_name,_chunk), &p);	\
+      for (c = 0; c < n; c++) {				\
+	  sum = _funct(sum, p.part[c]);			\
+      }							\
+      return sum;					\
+    }							\
+    make_no_scratch(_name)				\
+    make_inplace(_name,INPLACE_NONE)
+
+#define segreduce(_name, _funct, _type, _identity, _unseg)	\
+    struct GLUE(_name,_par) {				\
+	_type *d, *s;					\
+	int *starts;					\
+	int n, m;					\
+	_type part[CVL_PAR_MAX_CHUNKS];			\
+	int pseg[CVL_PAR_MAX_CHUNKS];			\
+    };							\
+    static void GLUE(_name,_chunk)(int lo, int hi, int c, void *state) \
+    {							\
+	struct GLUE(_name,_par) *p = (struct GLUE(_name,_par) *)state;	\
+	_type *src = p->s;				\
+	int j = cvl_par_seg_containing(p->starts, p->m, lo);	\
+	int i = lo, end;				\
+	_type sum;					\
+							\
+	p->pseg[c] = -1;				\
+	if (p->starts[j] < lo) {			\
+	    /* tail of a segment owned by an earlier chunk */	\
+	    end = j + 1 < p->m ? p->starts[j+1] : p->n;	\
+	    if (end > hi) { end = hi; }			\
+	    sum = _identity;				\
+	    for (; i < end; i++) {			\
+		sum = _funct(sum, src[i]);		\
+	    }						\
+	    p->part[c] = sum;				\
+	    p->pseg[c] = j;				\
+	}						\
+	for (j = cvl_par_seg_from(p->starts, p->m, lo);	\
+	     j < p->m && (p->starts[j] < hi || hi == p->n); j++) {	\
+	    i = p->starts[j];				\
+	    end = j + 1 < p->m ? p->starts[j+1] : p->n;	\
+	    if (end > hi) { end = hi; }			\
+	    sum = _identity;				\
+	    for (; i < end; i++) {			\
+		sum = _funct(sum, src[i]);		\
+	    }						\
+	    p->d[j] = sum;				\
+	}						\
+    }							\
+    void _name (d, s, sd, n, m, scratch)		\
+    vec_p d, s, sd, scratch;				\
+    int n, m; 						\
+    {							\
+	struct GLUE(_name,_par) p;			\
+	int c, nc;					\
+							\
+	if (m == 1) {*(_type *)d = _unseg(s,n,scratch); return;}	\
+	nc = cvl_par_chunks(n);				\
+	if (nc <= 1 || !(p.starts = cvl_par_seg_starts((int *)sd, m))) {	\
+	    nc = 1;					\
+	}						\
+	if (nc == 1) {					\
+	    int *segd = (int *)sd;			\
+	    int *segd_end = (int *)sd + m;		\
+	    register _type *src = (_type *)s;		\
+	    register _type *src_end = (_type *)s;	\
+	    register _type sum;				\
+	    register _type *_dest = (_type *)d;		\
+	    while (segd < segd_end) {			\
+		src_end += *(segd++);			\
+		sum = _identity;			\
+		while (src < src_end)  {		\
+		    sum = _funct(sum, *src);		\
+		    src++;				\
+		}					\
+		*(_dest++) = sum;			\
+	    }						\
+	    return;					\
+	}						\
+	p.d = (_type *)d;				\
+	p.s = (_type *)s;				\
+	p.n = n;					\
+	p.m = m;					\
+	cvl_par_run(n, nc, GLUE(_name,_chunk), &p);	\
+	for (c = 1; c < nc; c++) {			\
+	    if (p.pseg[c] >= 0) {			\
+		p.d[p.pseg[c]] = _funct(p.d[p.pseg[c]], p.part[c]);	\
+	    }						\
+	}						\
+	cvl_par_free(p.starts);				\
+    }							\
+    make_no_seg_scratch(_name)				\
+    make_inplace(_name,INPLACE_NONE)
+
+#define make_distribute(_name, _type)		\
+    struct GLUE(_name,_par) {			\
+	_type *d;				\
+	_type v;				\
+    };						\
+    static void GLUE(_name,_chunk)(int lo, int hi, int c, void *state) \
+    {						\
+	struct GLUE(_name,_par) *p = (struct GLUE(_name,_par) *)state;	\
+	_type *dest = p->d;			\
+	_type v = p->v;				\
+	int i;					\
+	for (i = lo; i < hi; i++) {		\
+	    dest[i] = v;			\
+	}					\
+    }						\
+    void _name(d, v, len, scratch)		\
+    vec_p d, scratch;				\
+    _type v;					\
+    int len;					\
+    { 						\
+	struct GLUE(_name,_par) p;		\
+	p.d = (_type *)d;			\
+	p.v = v;				\
+	cvl_par_for(len, GLUE(_name,_chunk), &p);	\
+    }						\
+    make_no_scratch(_name)			\
+    make_inplace(_name,INPLACE_NONE)
+
+/* index vectors of permutes are permutations, so the scattered
+   writes from different chunks never collide */
+#define make_smpper(_name, _type)			\
+    static void GLUE(_name,_chunk)(int lo, int hi, int c, void *state) \
+    {							\
+	struct cvl_par_vecs *v = (struct cvl_par_vecs *)state;	\
+	int *indexp = (int *)v->s2;			\
+	_type *dest = (_type *)v->d;			\
+	_type *src = (_type *)v->s1;			\
+	int i;						\
+	for (i = lo; i < hi; i++) {			\
+	    dest[indexp[i]] = src[i];			\
+	}						\
+    }							\
+    void _name(d, s, i, len, scratch)			\
+    vec_p d, s, i, scratch;				\
+    int len;						\
+    {							\
+	struct cvl_par_vecs v = { .d = d, .s1 = s, .s2 = i, .len = len };	\
+	cvl_par_for(len, GLUE(_name,_chunk), &v);	\
+    }							\
+    make_no_scratch(_name)				\
+    make_inplace(_name,INPLACE_NONE)
+
+/* the destination may be the index vector, in which case we have to
+   run serially if the elements are of different sizes */
+#define make_bckper(_name, _type)			\
+    static void GLUE(_name,_chunk)(int lo, int hi, int c, void *state) \
+    {							\
+	struct cvl_par_vecs *v = (struct cvl_par_vecs *)state;	\
+	int *index = (int *)v->s2;			\
+	_type *dest = (_type *)v->d;			\
+	_type *src = (_type *)v->s1;			\
+	int i;						\
+	for (i = lo; i < hi; i++) {			\
+	    dest[i] = src[index[i]];			\
+	}						\
+    }							\
+	void _name(d, s, i, s_len, d_len, scratch)	\
+	vec_p d, s, i, scratch;				\
+	int s_len, d_len;				\
+	{						\
+	    struct cvl_par_vecs v = { .d = d, .s1 = s, .s2 = i, .len = d_len };	\
+	    if (sizeof(_type) != sizeof(int) && d == i) {	\
+		GLUE(_name,_chunk)(0, d_len, 0, &v);	\
+	    } else {					\
+		cvl_par_for(d_len, GLUE(_name,_chunk), &v);	\
+	    }						\
+	}						\
+	make_no2_scratch(_name)				\
+	make_inplace(_name,INPLACE_2)
+
+#endif /* NAUT_CONFIG_NESL_RT_CVL_PARALLEL */
+
 /* -----------------Unsegmented Scans----------------------------------*/
 
 /* simple scan template:
@@ -14,6 +382,7 @@
    _init = initial value (identity element)
    d and s should be vectors of the same size and type
 */
+#ifndef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
 #define simpscan(_name, _func, _type, _init)			\
     void _name(d, s, len, scratch)				\
     vec_p d, s, scratch;					\
@@ -26,6 +395,7 @@
 	}							\
     make_no_scratch(_name)					\
     make_inplace(_name,INPLACE_1)
+#endif
 
 simpscan(add_suz, plus, int, 0)		/* add scans */
 simpscan(add_sud, plus, double, (double) 0.0)
@@ -59,6 +429,7 @@ simpscan(xor_suz, xor, int, 0)		/* bitwise xor scan */
 
    d and s should be vectors of the same size and type
 */
+#ifndef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
 #define simpsegscan(_name, _funct, _type, _init, _unseg)		\
     void _name (d, s, sd, n, m, scratch)				\
     vec_p d, s, sd, scratch;						\
@@ -86,6 +457,7 @@ simpscan(xor_suz, xor, int, 0)		/* bitwise xor scan */
     }									\
     make_no_seg_scratch(_name)						\
     make_inplace(_name,INPLACE_1)
+#endif
 
 simpsegscan(add_sez, plus, int, 0, add_suz)		/* add scans */
 simpsegscan(add_sed, plus, double, (double) 0.0, add_sud)
@@ -111,6 +483,7 @@ simpsegscan(xor_sez, xor, int, 0, xor_suz)		/* bitwise xor scan */
 /* --------------------Reduce Functions--------------------------------*/
 /* reduce template */
 	
+#ifndef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
 #define reduce(_name, _funct, _type, _identity)         \
     _type _name(s, len, scratch)			\
     vec_p s, scratch;					\
@@ -123,6 +496,7 @@ simpsegscan(xor_sez, xor, int, 0, xor_suz)		/* bitwise xor scan */
     }							\
     make_no_scratch(_name)				\
     make_inplace(_name,INPLACE_NONE)
+#endif
 
 reduce(add_ruz, plus, int, 0)			/* add reduces */
 reduce(add_rud, plus, double, (double) 0.0)
@@ -152,6 +526,7 @@ reduce(xor_ruz, xor, int, 0)		/* bitwise xor reduce */
  *	sd = segment descriptor of source, with components n and m
  */
 /* see implementation note above */
+#ifndef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
 #define segreduce(_name, _funct, _type, _identity, _unseg)	\
     void _name (d, s, sd, n, m, scratch)		\
     vec_p d, s, sd, scratch;				\
@@ -177,6 +552,7 @@ reduce(xor_ruz, xor, int, 0)		/* bitwise xor reduce */
     }							\
     make_no_seg_scratch(_name)				\
     make_inplace(_name,INPLACE_NONE)
+#endif
 
 
 segreduce(add_rez, plus, int, 0, add_ruz)		/* add reduces */
@@ -294,6 +670,7 @@ make_seg_replace(rep_ved, double)
 /* ----------------Distribute-----------------------------------*/
 
 /* distribute v to length len, return in d */
+#ifndef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
 #define make_distribute(_name, _type)		\
     void _name(d, v, len, scratch)		\
     vec_p d, scratch;				\
@@ -305,6 +682,7 @@ make_seg_replace(rep_ved, double)
     }						\
     make_no_scratch(_name)			\
     make_inplace(_name,INPLACE_NONE)
+#endif
 
 make_distribute(dis_vuz, int)
 make_distribute(dis_vub, cvl_bool)
@@ -353,6 +731,7 @@ make_seg_distribute(dis_ved, double, dis_vud)
  *	len = length of vectors
  */
 
+#ifndef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
 #define make_smpper(_name, _type)			\
     void _name(d, s, i, len, scratch)			\
     vec_p d, s, i, scratch;				\
@@ -365,6 +744,7 @@ make_seg_distribute(dis_ved, double, dis_vud)
     }							\
     make_no_scratch(_name)				\
     make_inplace(_name,INPLACE_NONE)
+#endif
 
 make_smpper(smp_puz, int)
 make_smpper(smp_pub, cvl_bool)
@@ -413,6 +793,7 @@ make_seg_smpper(smp_ped, double, smp_pud)
  *	d_len = length of d and i
  */
 
+#ifndef NAUT_CONFIG_NESL_RT_CVL_PARALLEL
 #define make_bckper(_name, _type)			\
 	void _name(d, s, i, s_len, d_len, scratch)	\
 	vec_p d, s, i, scratch;				\
@@ -425,6 +806,7 @@ make_seg_smpper(smp_ped, double, smp_pud)
 	}						\
 	make_no2_scratch(_name)				\
 	make_inplace(_name,INPLACE_2)
+#endif
 
 make_bckper(bck_puz, int)
 make_bckper(bck_pub, cvl_bool)
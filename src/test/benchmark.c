@@ -51,6 +51,16 @@
 #include <nautilus/nemo.h>
 #include <nautilus/pmc.h>
 #include <nautilus/shell.h>
+#include <nautilus/waitqueue.h>
+#include <nautilus/smp.h>
+#include <nautilus/timer.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/rwlock.h>
+#include <nautilus/ticketlock.h>
+#ifdef NAUT_CONFIG_FIBER_ENABLE
+#include <nautilus/fiber.h>
+#endif
+#include <test/test.h>
 
 #endif
 
@@ -791,18 +801,7 @@ void time_ipi_send (void);
 void
 time_ipi_send(void)
 {
-    int i;
-    struct apic_dev * apic = per_cpu_get(apic);
-    uint64_t start, end;
-    for (i = 0; i < 100; i++) {
-        rdtscll(start);
-
-        apic_ipi(apic, 1, APIC_NULL_KICK_VEC);
-
-        rdtscll(end);
-
-        PRINT("TRIAL %u %llu\n", i, end-start);
-    }
+    nk_run_bench("ipi_send", 100, 10, my_cpu_id(), 0);
 }
 
 #define TRIALS 100
@@ -1048,37 +1047,7 @@ time_sync_event (void)
 }
 
 #ifndef __USER
-#if 0
-void page_alloc_test(void);
-void 
-page_alloc_test (void)
-{
-
-#define N 100
-
-	void * x[N];
-	int i, j;
 
-	for (j = 0; j < 10; j++) {
-		printk("Trial %u\n", j);
-
-		for (i = 0; i < N; i++) {
-
-			x[i] = (void*)nk_alloc_pages(16);
-		}
-
-		for (i = 0; i < N; i++) {
-			nk_free_pages(x[i], 16);
-		}
-
-		nk_dump_page_map();
-	}
-
-
-}
-#endif
-
-#undef N
 #define N 10000
 void malloc_test(void);
 void
@@ -1100,6 +1069,565 @@ malloc_test (void)
 
 }
 
+
+/*
+ * Cross-CPU xcall and wakeup throughput
+ *
+ * Both of these involve other CPUs writing to the target's struct
+ * cpu (xcall) or scheduler state (wakeup), so they are sensitive to
+ * false sharing with the target's hot local state.
+ */
+#define XCALL_BENCH_COUNT 10000
+
+static volatile uint64_t xcall_bench_hits;
+
+static void
+xcall_bench_func (void * arg)
+{
+    xcall_bench_hits++;
+}
+
+static void
+time_xcall_throughput (int cpu, uint64_t count)
+{
+    uint64_t i, start, end;
+
+    xcall_bench_hits = 0;
+
+    rdtscll(start);
+    for (i = 0; i < count; i++) {
+        if (smp_xcall(cpu, xcall_bench_func, NULL, 1)) {
+            PRINT("xcall to cpu %d failed\n", cpu);
+            return;
+        }
+    }
+    rdtscll(end);
+
+    PRINT("xcall: %lu synchronous calls to cpu %d, %lu cycles/call (%lu hits)\n",
+          count, cpu, (end-start)/count, xcall_bench_hits);
+}
+
+struct wake_bench {
+    nk_wait_queue_t  *wq[2];   // [0] = initiator sleeps, [1] = partner sleeps
+    volatile int      turn;    // which side should run
+    uint64_t          count;
+};
+
+static int
+wake_bench_mine (void * state)
+{
+    return ((struct wake_bench *)state)->turn == 0;
+}
+
+static int
+wake_bench_partners (void * state)
+{
+    return ((struct wake_bench *)state)->turn == 1;
+}
+
+static void
+wake_bench_partner (void * in, void ** out)
+{
+    struct wake_bench * w = (struct wake_bench *)in;
+    uint64_t i;
+
+    for (i = 0; i < w->count; i++) {
+        while (!wake_bench_partners(w)) {
+            nk_wait_queue_sleep_extended(w->wq[1], wake_bench_partners, w);
+        }
+        w->turn = 0;
+        nk_wait_queue_wake_all(w->wq[0]);
+    }
+}
+
+static void
+time_wakeup_throughput (int cpu, uint64_t count)
+{
+    struct wake_bench w;
+    nk_thread_id_t tid;
+    uint64_t i, start, end;
+
+    w.wq[0] = nk_wait_queue_create(0);
+    w.wq[1] = nk_wait_queue_create(0);
+    w.turn  = 0;
+    w.count = count;
+
+    if (!w.wq[0] || !w.wq[1]) {
+        PRINT("Cannot allocate wait queues\n");
+        goto out;
+    }
+
+    if (nk_thread_start(wake_bench_partner, &w, NULL, 0, TSTACK_DEFAULT, &tid, cpu)) {
+        PRINT("Cannot start partner thread on cpu %d\n", cpu);
+        goto out;
+    }
+
+    rdtscll(start);
+    for (i = 0; i < count; i++) {
+        w.turn = 1;
+        nk_wait_queue_wake_all(w.wq[1]);
+        while (!wake_bench_mine(&w)) {
+            nk_wait_queue_sleep_extended(w.wq[0], wake_bench_mine, &w);
+        }
+    }
+    rdtscll(end);
+
+    nk_join(tid, NULL);
+
+    PRINT("wakeup: %lu round trips with cpu %d, %lu cycles/round trip\n",
+          count, cpu, (end-start)/count);
+
+ out:
+    if (w.wq[0]) { nk_wait_queue_destroy(w.wq[0]); }
+    if (w.wq[1]) { nk_wait_queue_destroy(w.wq[1]); }
+}
+
+static int
+handle_xcall_bench (char * buf, void * priv)
+{
+    int cpu = 1;
+    uint64_t count = XCALL_BENCH_COUNT;
+
+    if (sscanf(buf, "xcallbench %d %lu", &cpu, &count) < 1) {
+        cpu = 1;
+    }
+
+    if (cpu < 0 || cpu >= nk_get_num_cpus() || cpu == my_cpu_id() || !count) {
+        nk_vc_printf("xcallbench [cpu] [count] - cpu must be another valid cpu\n");
+        return 0;
+    }
+
+    time_xcall_throughput(cpu, count);
+    time_wakeup_throughput(cpu, count);
+
+    return 0;
+}
+
+static struct shell_cmd_impl xcall_bench_impl = {
+    .cmd      = "xcallbench",
+    .help_str = "xcallbench [cpu] [count]",
+    .handler  = handle_xcall_bench,
+};
+nk_register_shell_cmd(xcall_bench_impl);
+
+/*
+ * Registered benchmarks (see test/test.h)
+ *
+ * Each of these times a single operation and returns its cost, so
+ * the harness can report the distribution rather than just an average.
+ */
+
+static inline uint64_t
+bench_peer (int cpu)
+{
+    return (cpu + 1) % nk_get_num_cpus();
+}
+
+
+static int
+bench_alloc_state (void ** state, uint64_t size)
+{
+    *state = malloc(size);
+    if (!*state) {
+        return -1;
+    }
+    memset(*state, 0, size);
+    return 0;
+}
+
+static void
+bench_free_state (void * state)
+{
+    free(state);
+}
+
+
+static int
+spinlock_bench_setup (void ** state)
+{
+    if (bench_alloc_state(state, sizeof(spinlock_t))) {
+        return -1;
+    }
+    spinlock_init((spinlock_t *)*state);
+    return 0;
+}
+
+static uint64_t
+spinlock_bench (void * state, int cpu)
+{
+    spinlock_t * l = (spinlock_t *)state;
+    uint64_t start, end;
+
+    rdtscll(start);
+    spin_lock(l);
+    spin_unlock(l);
+    rdtscll(end);
+
+    return end - start;
+}
+
+static struct nk_bench_impl spinlock_bench_impl = {
+    .name     = "spinlock",
+    .unit     = "cycles",
+    .flags    = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,
+    .reps     = SPINLOCK_LOOPS,
+    .setup    = spinlock_bench_setup,
+    .run      = spinlock_bench,
+    .teardown = bench_free_state,
+};
+nk_register_bench(spinlock_bench_impl);
+
+
+static int
+ticketlock_bench_setup (void ** state)
+{
+    if (bench_alloc_state(state, sizeof(nk_ticket_lock_t))) {
+        return -1;
+    }
+    nk_ticket_lock_init((nk_ticket_lock_t *)*state);
+    return 0;
+}
+
+static uint64_t
+ticketlock_bench (void * state, int cpu)
+{
+    nk_ticket_lock_t * l = (nk_ticket_lock_t *)state;
+    uint64_t start, end;
+
+    rdtscll(start);
+    nk_ticket_lock(l);
+    nk_ticket_unlock(l);
+    rdtscll(end);
+
+    return end - start;
+}
+
+static struct nk_bench_impl ticketlock_bench_impl = {
+    .name     = "ticketlock",
+    .unit     = "cycles",
+    .flags    = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,
+    .reps     = SPINLOCK_LOOPS,
+    .setup    = ticketlock_bench_setup,
+    .run      = ticketlock_bench,
+    .teardown = bench_free_state,
+};
+nk_register_bench(ticketlock_bench_impl);
+
+
+static int
+rwlock_bench_setup (void ** state)
+{
+    if (bench_alloc_state(state, sizeof(nk_rwlock_t))) {
+        return -1;
+    }
+    nk_rwlock_init((nk_rwlock_t *)*state);
+    return 0;
+}
+
+static uint64_t
+rwlock_rd_bench (void * state, int cpu)
+{
+    nk_rwlock_t * l = (nk_rwlock_t *)state;
+    uint64_t start, end;
+
+    rdtscll(start);
+    nk_rwlock_rd_lock(l);
+    nk_rwlock_rd_unlock(l);
+    rdtscll(end);
+
+    return end - start;
+}
+
+static uint64_t
+rwlock_wr_bench (void * state, int cpu)
+{
+    nk_rwlock_t * l = (nk_rwlock_t *)state;
+    uint64_t start, end;
+
+    rdtscll(start);
+    nk_rwlock_wr_lock(l);
+    nk_rwlock_wr_unlock(l);
+    rdtscll(end);
+
+    return end - start;
+}
+
+static struct nk_bench_impl rwlock_rd_bench_impl = {
+    .name     = "rwlock_rd",
+    .unit     = "cycles",
+    .flags    = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,
+    .reps     = SPINLOCK_LOOPS,
+    .setup    = rwlock_bench_setup,
+    .run      = rwlock_rd_bench,
+    .teardown = bench_free_state,
+};
+nk_register_bench(rwlock_rd_bench_impl);
+
+static struct nk_bench_impl rwlock_wr_bench_impl = {
+    .name     = "rwlock_wr",
+    .unit     = "cycles",
+    .flags    = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,
+    .reps     = SPINLOCK_LOOPS,
+    .setup    = rwlock_bench_setup,
+    .run      = rwlock_wr_bench,
+    .teardown = bench_free_state,
+};
+nk_register_bench(rwlock_wr_bench_impl);
+
+
+// malloc+free pairs; the 64K size stands in for the old page allocation test
+#define MALLOC_BENCH(size, sname)                          \
+static uint64_t                                            \
+malloc_bench_##sname (void * state, int cpu)               \
+{                                                          \
+    uint64_t start, end;                                   \
+    void * p;                                              \
+                                                           \
+    rdtscll(start);                                        \
+    p = malloc(size);                                      \
+    free(p);                                               \
+    rdtscll(end);                                          \
+                                                           \
+    return p ? end - start : NK_BENCH_FAILED;              \
+}                                                          \
+                                                           \
+static struct nk_bench_impl malloc_bench_##sname##_impl = { \
+    .name  = "malloc_" #sname,                             \
+    .unit  = "cycles",                                     \
+    .flags = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,        \
+    .run   = malloc_bench_##sname,                         \
+};                                                         \
+nk_register_bench(malloc_bench_##sname##_impl);
+
+MALLOC_BENCH(64, 64)
+MALLOC_BENCH(4096, 4k)
+MALLOC_BENCH(65536, 64k)
+
+
+static uint64_t
+xcall_round_trip_bench (void * state, int cpu)
+{
+    uint64_t start, end;
+
+    rdtscll(start);
+    smp_xcall(bench_peer(cpu), xcall_bench_func, NULL, 1);
+    rdtscll(end);
+
+    return end - start;
+}
+
+static struct nk_bench_impl xcall_round_trip_bench_impl = {
+    .name  = "xcall",
+    .unit  = "cycles",
+    .flags = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU | NK_BENCH_NEEDS_PEER,
+    .run   = xcall_round_trip_bench,
+};
+nk_register_bench(xcall_round_trip_bench_impl);
+
+
+static uint64_t
+ipi_send_bench (void * state, int cpu)
+{
+    struct apic_dev * apic = per_cpu_get(apic);
+    struct sys_info * sys = per_cpu_get(system);
+    uint64_t start, end;
+
+    rdtscll(start);
+    apic_ipi(apic, sys->cpus[bench_peer(cpu)]->lapic_id, APIC_NULL_KICK_VEC);
+    rdtscll(end);
+
+    return end - start;
+}
+
+static struct nk_bench_impl ipi_send_bench_impl = {
+    .name  = "ipi_send",
+    .unit  = "cycles",
+    .flags = NK_BENCH_PER_CPU | NK_BENCH_NEEDS_PEER,
+    .run   = ipi_send_bench,
+};
+nk_register_bench(ipi_send_bench_impl);
+
+
+/*
+ * Thread context switch: a partner thread on each CPU does nothing
+ * but yield, so a yield from the benchmark thread is a switch to
+ * the partner and back
+ */
+struct ctx_switch_bench {
+    volatile int stop;
+    int ncpus;
+    nk_thread_id_t tids[0];
+};
+
+static void
+ctx_switch_partner (void * in, void ** out)
+{
+    struct ctx_switch_bench * c = (struct ctx_switch_bench *)in;
+
+    while (!c->stop) {
+        nk_yield();
+    }
+}
+
+static int
+ctx_switch_bench_setup (void ** state)
+{
+    int ncpus = nk_get_num_cpus();
+    struct ctx_switch_bench * c;
+    int i;
+
+    if (bench_alloc_state(state, sizeof(*c) + ncpus * sizeof(nk_thread_id_t))) {
+        return -1;
+    }
+
+    c = (struct ctx_switch_bench *)*state;
+
+    for (i = 0; i < ncpus; i++) {
+        if (nk_thread_start(ctx_switch_partner, c, NULL, 0, TSTACK_DEFAULT, &c->tids[i], i)) {
+            break;
+        }
+    }
+
+    c->ncpus = i;
+
+    return 0;
+}
+
+static uint64_t
+ctx_switch_bench (void * state, int cpu)
+{
+    uint64_t start, end;
+
+    rdtscll(start);
+    nk_yield();
+    rdtscll(end);
+
+    return (end - start) / 2;
+}
+
+static void
+ctx_switch_bench_teardown (void * state)
+{
+    struct ctx_switch_bench * c = (struct ctx_switch_bench *)state;
+    int i;
+
+    c->stop = 1;
+
+    for (i = 0; i < c->ncpus; i++) {
+        nk_join(c->tids[i], NULL);
+    }
+
+    free(c);
+}
+
+static struct nk_bench_impl ctx_switch_bench_impl = {
+    .name     = "ctx_switch",
+    .unit     = "cycles",
+    .flags    = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,
+    .setup    = ctx_switch_bench_setup,
+    .run      = ctx_switch_bench,
+    .teardown = ctx_switch_bench_teardown,
+};
+nk_register_bench(ctx_switch_bench_impl);
+
+
+#ifdef NAUT_CONFIG_FIBER_ENABLE
+/*
+ * Fiber switch: two fibers on the benchmark's CPU yield back and forth,
+ * and the time between the first and last yield is divided among the
+ * switches.   Fiber creation is outside of the timed region.
+ */
+#define FIBER_BENCH_YIELDS 100
+
+struct fiber_switch_bench {
+    uint64_t start;
+    uint64_t end;
+    volatile int done;
+};
+
+static void
+fiber_switch_partner (void * in, void ** out)
+{
+    struct fiber_switch_bench * f = (struct fiber_switch_bench *)in;
+    int i;
+
+    for (i = 0; i < FIBER_BENCH_YIELDS; i++) {
+        if (!f->start) {
+            rdtscll(f->start);
+        }
+        nk_fiber_yield();
+    }
+
+    rdtscll(f->end);
+    __sync_fetch_and_add(&f->done, 1);
+}
+
+static uint64_t
+fiber_switch_bench (void * state, int cpu)
+{
+    struct fiber_switch_bench f;
+    nk_fiber_t * fib;
+    int i;
+
+    memset(&f, 0, sizeof(f));
+
+    for (i = 0; i < 2; i++) {
+        if (nk_fiber_start(fiber_switch_partner, &f, NULL, 0, cpu, &fib) < 0) {
+            PRINT("Cannot start fiber on cpu %d\n", cpu);
+            break;
+        }
+    }
+
+    while (f.done < i) {
+        nk_yield();
+    }
+
+    if (i < 2) {
+        return 0;
+    }
+
+    return (f.end - f.start) / (2 * FIBER_BENCH_YIELDS);
+}
+
+static struct nk_bench_impl fiber_switch_bench_impl = {
+    .name   = "fiber_switch",
+    .unit   = "cycles",
+    .flags  = NK_BENCH_PER_CPU,
+    .reps   = 100,
+    .warmup = 10,
+    .run    = fiber_switch_bench,
+};
+nk_register_bench(fiber_switch_bench_impl);
+#endif
+
+
+/*
+ * Timer latency: how late a 100 us sleep wakes up
+ */
+#define TIMER_BENCH_NS 100000ULL
+
+static uint64_t
+timer_latency_bench (void * state, int cpu)
+{
+    uint64_t start, end;
+
+    start = nk_sched_get_realtime();
+    nk_sleep(TIMER_BENCH_NS);
+    end = nk_sched_get_realtime();
+
+    return end - start > TIMER_BENCH_NS ? end - start - TIMER_BENCH_NS : 0;
+}
+
+static struct nk_bench_impl timer_latency_bench_impl = {
+    .name   = "timer_latency",
+    .unit   = "ns",
+    .flags  = NK_BENCH_PER_CPU | NK_BENCH_MULTI_CPU,
+    .reps   = 100,
+    .warmup = 5,
+    .run    = timer_latency_bench,
+};
+nk_register_bench(timer_latency_bench_impl);
+
 #endif
 
 void run_benchmarks(void);
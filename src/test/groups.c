@@ -26,9 +26,11 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/shell.h>
 #include <nautilus/atomic.h>
+#include <nautilus/scheduler.h>
 #include <nautilus/group.h>
 #include <nautilus/group_sched.h>
 #include <test/groups.h>
+#include <test/test.h>
 
 #define CPU_OFFSET 0 // skip CPU0 in tests
 #define TESTER_TOTAL 2
@@ -297,3 +299,488 @@ static struct shell_cmd_impl groups_impl = {
     .handler  = handle_groups,
 };
 nk_register_shell_cmd(groups_impl);
+
+
+/*
+ * Group benchmarks: n threads, one per cpu, join a group and time
+ * GROUP_BENCH_LOOPS back-to-back barriers or changes between two
+ * periodic constraints.  Each repetition reports the slowest member's
+ * average.  Members wait until the launcher has started all of them,
+ * and give up together if it could not.
+ */
+#define GROUP_BENCH_LOOPS  100
+#define GROUP_BENCH_PERIOD 1000000   // 1 ms
+#define GROUP_BENCH_SLICE  100000    // 100 us
+
+typedef struct group_bench {
+  int size;
+  int sched;    // change constraints instead of just a barrier
+  nk_thread_group_t *group;
+  volatile int started;   // set by the launcher once it is done
+  volatile int failed;
+  sint64_t worst;
+} group_bench_t;
+
+static void
+group_bench_member(void *in, void **out) {
+  group_bench_t *b = (group_bench_t *)in;
+  struct nk_sched_constraints periodic[2] = {
+    { .type = PERIODIC,
+      .interrupt_priority_class = 0x01,
+      .periodic.phase = 0,
+      .periodic.period = GROUP_BENCH_PERIOD,
+      .periodic.slice = GROUP_BENCH_SLICE },
+    { .type = PERIODIC,
+      .interrupt_priority_class = 0x01,
+      .periodic.phase = 0,
+      .periodic.period = GROUP_BENCH_PERIOD,
+      .periodic.slice = 2 * GROUP_BENCH_SLICE } };
+  struct nk_sched_constraints aperiodic = { .type = APERIODIC,
+                                            .interrupt_priority_class = 0x01,
+                                            .aperiodic.priority = DEFAULT_PRIORITY };
+  uint64_t start, end;
+  sint64_t worst;
+  int i;
+
+  if (nk_thread_group_join(b->group) < 0) {
+    ERROR("bench member failed to join group\n");
+    b->failed = 1;
+    return;
+  }
+
+  while (!b->started) {
+    nk_yield();
+  }
+
+  if (b->started != b->size) {
+    goto out;
+  }
+
+  while (nk_thread_group_get_size(b->group) != b->size) {
+    if (b->failed) {
+      goto out;
+    }
+  }
+
+  nk_thread_group_barrier(b->group);
+
+  start = rdtsc();
+  for (i = 0; i < GROUP_BENCH_LOOPS; i++) {
+    if (b->sched) {
+      // everyone gets the same answer
+      if (nk_group_sched_change_constraints(b->group, &periodic[i & 1])) {
+        ERROR("bench member failed to change constraints\n");
+        b->failed = 1;
+        break;
+      }
+    } else {
+      nk_thread_group_barrier(b->group);
+    }
+  }
+  end = rdtsc();
+
+  nk_thread_group_allreduce(b->group, NK_THREAD_GROUP_MAX,
+                            (end - start) / GROUP_BENCH_LOOPS, &worst);
+
+  // everyone has the same answer
+  b->worst = worst;
+
+  if (b->sched) {
+    nk_sched_thread_change_constraints(&aperiodic);
+  }
+
+ out:
+  nk_thread_group_leave(b->group);
+}
+
+static uint64_t
+group_bench(void *state, int sched) {
+  group_bench_t *b = (group_bench_t *)state;
+  nk_thread_id_t tids[b->size];
+  int i, started;
+
+  b->sched = sched;
+  b->worst = 0;
+  b->started = 0;
+  b->failed = 0;
+  b->group = nk_thread_group_create("group bench");
+
+  if (!b->group) {
+    return NK_BENCH_FAILED;
+  }
+
+  for (started = 0; started < b->size; started++) {
+    if (nk_thread_start(group_bench_member, b, NULL, 0, TSTACK_DEFAULT, &tids[started], started)) {
+      ERROR("Fail to start bench member on cpu %d\n", started);
+      break;
+    }
+  }
+
+  // releases the members, who give up unless all of them started
+  b->started = started ? started : -1;
+
+  for (i = 0; i < started; i++) {
+    nk_join(tids[i], NULL);
+  }
+
+  nk_thread_group_delete(b->group);
+
+  if (started != b->size || b->failed) {
+    return NK_BENCH_FAILED;
+  }
+
+  return b->worst;
+}
+
+static uint64_t
+group_barrier_bench(void *state, int cpu) {
+  return group_bench(state, 0);
+}
+
+static uint64_t
+group_sched_bench(void *state, int cpu) {
+  return group_bench(state, 1);
+}
+
+static int
+group_bench_setup(void **state, int size) {
+  group_bench_t *b = (group_bench_t *)MALLOC(sizeof(group_bench_t));
+
+  if (!b) {
+    return -1;
+  }
+
+  memset(b, 0, sizeof(group_bench_t));
+
+  b->size = size;
+  if (b->size > nk_get_num_cpus()) {
+    b->size = nk_get_num_cpus();
+    INFO("Only %d cpus, benchmarking a group of %d instead of %d\n", b->size, b->size, size);
+  }
+
+  *state = b;
+
+  return 0;
+}
+
+static void
+group_bench_teardown(void *state) {
+  FREE(state);
+}
+
+#define GROUP_BENCH(n)                                                  \
+static int                                                              \
+group_bench_setup_##n(void **state) {                                   \
+  return group_bench_setup(state, n);                                   \
+}                                                                       \
+static struct nk_bench_impl group_barrier_bench_##n##_impl = {          \
+  .name     = "group_barrier_" #n,                                      \
+  .unit     = "cycles",                                                 \
+  .flags    = NK_BENCH_ONCE | NK_BENCH_NEEDS_PEER,                      \
+  .reps     = 20,                                                       \
+  .warmup   = 2,                                                        \
+  .setup    = group_bench_setup_##n,                                    \
+  .run      = group_barrier_bench,                                      \
+  .teardown = group_bench_teardown,                                     \
+};                                                                      \
+nk_register_bench(group_barrier_bench_##n##_impl);                      \
+static struct nk_bench_impl group_sched_bench_##n##_impl = {            \
+  .name     = "group_sched_" #n,                                        \
+  .unit     = "cycles",                                                 \
+  .flags    = NK_BENCH_ONCE | NK_BENCH_NEEDS_PEER,                      \
+  .reps     = 20,                                                       \
+  .warmup   = 2,                                                        \
+  .setup    = group_bench_setup_##n,                                    \
+  .run      = group_sched_bench,                                        \
+  .teardown = group_bench_teardown,                                     \
+};                                                                      \
+nk_register_bench(group_sched_bench_##n##_impl);
+
+GROUP_BENCH(2)
+GROUP_BENCH(4)
+GROUP_BENCH(8)
+GROUP_BENCH(16)
+GROUP_BENCH(32)
+GROUP_BENCH(64)
+
+
+/*
+ * Bulk-synchronous stencil: n periodic threads, one per cpu, each
+ * average the cells of their part of a ring with its neighbors, with
+ * a barrier after every iteration.  The members either just adopt the
+ * same constraints or are dispatched as a gang.  Each repetition
+ * reports the slowest member's time for the iterations, and teardown
+ * summarizes the barrier waits (and, for gangs, the dispatch skew)
+ */
+#define GROUP_STENCIL_CELLS  1024      // per member
+#define GROUP_STENCIL_ITERS  200
+#define GROUP_STENCIL_PERIOD 1000000   // 1 ms
+#define GROUP_STENCIL_SLICE  500000    // 500 us
+
+#define MAX(x,y) ((x)>(y) ? (x) : (y))
+
+typedef struct group_stencil {
+  int size;
+  int gang;
+  nk_thread_group_t *group;
+  sint64_t *cells[2];
+  volatile int next_rank;
+  volatile int started;   // set by the launcher once it is done
+  volatile int failed;
+  sint64_t worst;
+
+  // summed over the repetitions
+  uint64_t runs;
+  nk_thread_group_stats_t wait;
+  struct nk_sched_gang_stats dispatch;
+} group_stencil_t;
+
+static void
+group_stencil_member(void *in, void **out) {
+  group_stencil_t *b = (group_stencil_t *)in;
+  struct nk_sched_constraints periodic = { .type = PERIODIC,
+                                           .interrupt_priority_class = 0x01,
+                                           .periodic.phase = 0,
+                                           .periodic.period = GROUP_STENCIL_PERIOD,
+                                           .periodic.slice = GROUP_STENCIL_SLICE };
+  struct nk_sched_constraints aperiodic = { .type = APERIODIC,
+                                            .interrupt_priority_class = 0x01,
+                                            .aperiodic.priority = DEFAULT_PRIORITY };
+  nk_thread_group_stats_t before, after;
+  struct nk_sched_gang_stats gs;
+  int rank = atomic_inc(b->next_rank);
+  int n = b->size * GROUP_STENCIL_CELLS;
+  int lo = rank * GROUP_STENCIL_CELLS;
+  int hi = lo + GROUP_STENCIL_CELLS;
+  uint64_t start, end;
+  sint64_t worst;
+  int i, j, rc;
+
+  if (nk_thread_group_join(b->group) < 0) {
+    ERROR("stencil member failed to join group\n");
+    b->failed = 1;
+    return;
+  }
+
+  while (!b->started) {
+    nk_yield();
+  }
+
+  if (b->started != b->size) {
+    goto out;
+  }
+
+  while (nk_thread_group_get_size(b->group) != b->size) {
+    if (b->failed) {
+      goto out;
+    }
+  }
+
+  nk_thread_group_barrier(b->group);
+
+  if (b->gang) {
+    rc = nk_group_sched_change_constraints_gang(b->group, &periodic);
+  } else {
+    rc = nk_group_sched_change_constraints(b->group, &periodic);
+  }
+
+  // everyone gets the same answer
+  if (rc) {
+    ERROR("stencil member failed to change constraints\n");
+    b->failed = 1;
+    goto out;
+  }
+
+  nk_thread_group_barrier(b->group);
+  if (!rank) {
+    nk_thread_group_get_stats(b->group, &before);
+  }
+  nk_thread_group_barrier(b->group);
+
+  start = nk_sched_get_realtime();
+  for (i = 0; i < GROUP_STENCIL_ITERS; i++) {
+    sint64_t *cur = b->cells[i & 1];
+    sint64_t *next = b->cells[(i + 1) & 1];
+    for (j = lo; j < hi; j++) {
+      next[j] = (cur[(j + n - 1) % n] + cur[j] + cur[(j + 1) % n]) / 3;
+    }
+    nk_thread_group_barrier(b->group);
+  }
+  end = nk_sched_get_realtime();
+
+  if (!rank) {
+    nk_thread_group_get_stats(b->group, &after);
+    b->wait.waits += after.waits - before.waits;
+    b->wait.wait_sum += after.wait_sum - before.wait_sum;
+    b->wait.wait_max = MAX(b->wait.wait_max, after.wait_max);
+    if (b->gang && !nk_sched_thread_get_gang_stats(&gs)) {
+      b->dispatch.dispatches += gs.dispatches;
+      b->dispatch.latency_sum += gs.latency_sum;
+      b->dispatch.latency_max = MAX(b->dispatch.latency_max, gs.latency_max);
+      b->dispatch.releases += gs.releases;
+      b->dispatch.skew_sum += gs.skew_sum;
+      b->dispatch.skew_max = MAX(b->dispatch.skew_max, gs.skew_max);
+    }
+  }
+
+  nk_thread_group_allreduce(b->group, NK_THREAD_GROUP_MAX, end - start, &worst);
+  b->worst = worst;
+
+  nk_sched_thread_change_constraints(&aperiodic);
+
+ out:
+  nk_thread_group_leave(b->group);
+}
+
+static uint64_t
+group_stencil(void *state, int gang) {
+  group_stencil_t *b = (group_stencil_t *)state;
+  nk_thread_id_t tids[b->size];
+  int i, started;
+
+  b->gang = gang;
+  b->worst = 0;
+  b->next_rank = 0;
+  b->started = 0;
+  b->failed = 0;
+  b->group = nk_thread_group_create("group stencil");
+
+  if (!b->group) {
+    return NK_BENCH_FAILED;
+  }
+
+  for (started = 0; started < b->size; started++) {
+    if (nk_thread_start(group_stencil_member, b, NULL, 0, TSTACK_DEFAULT, &tids[started], started)) {
+      ERROR("Fail to start stencil member on cpu %d\n", started);
+      break;
+    }
+  }
+
+  // releases the members, who give up unless all of them started
+  b->started = started ? started : -1;
+
+  for (i = 0; i < started; i++) {
+    nk_join(tids[i], NULL);
+  }
+
+  nk_thread_group_delete(b->group);
+
+  if (started != b->size || b->failed) {
+    return NK_BENCH_FAILED;
+  }
+
+  b->runs++;
+
+  return b->worst;
+}
+
+static uint64_t
+group_stencil_bench(void *state, int cpu) {
+  return group_stencil(state, 0);
+}
+
+static uint64_t
+group_stencil_gang_bench(void *state, int cpu) {
+  return group_stencil(state, 1);
+}
+
+static int
+group_stencil_setup(void **state, int size) {
+  group_stencil_t *b = (group_stencil_t *)MALLOC(sizeof(group_stencil_t));
+  int i;
+
+  if (!b) {
+    return -1;
+  }
+
+  memset(b, 0, sizeof(group_stencil_t));
+
+  b->size = size;
+  if (b->size > nk_get_num_cpus()) {
+    b->size = nk_get_num_cpus();
+    INFO("Only %d cpus, benchmarking a group of %d instead of %d\n", b->size, b->size, size);
+  }
+
+  b->cells[0] = (sint64_t *)MALLOC(b->size * GROUP_STENCIL_CELLS * sizeof(sint64_t));
+  b->cells[1] = (sint64_t *)MALLOC(b->size * GROUP_STENCIL_CELLS * sizeof(sint64_t));
+
+  if (!b->cells[0] || !b->cells[1]) {
+    ERROR("Fail to malloc stencil cells\n");
+    if (b->cells[0]) {
+      FREE(b->cells[0]);
+    }
+    if (b->cells[1]) {
+      FREE(b->cells[1]);
+    }
+    FREE(b);
+    return -1;
+  }
+
+  for (i = 0; i < b->size * GROUP_STENCIL_CELLS; i++) {
+    b->cells[0][i] = i;
+  }
+
+  *state = b;
+
+  return 0;
+}
+
+static void
+group_stencil_teardown(void *state) {
+  group_stencil_t *b = (group_stencil_t *)state;
+
+  if (b->wait.waits) {
+    INFO("stencil of %d: barrier wait avg %lu ns max %lu ns over %lu waits\n",
+         b->size, b->wait.wait_sum / b->wait.waits, b->wait.wait_max, b->wait.waits);
+  }
+
+  if (b->dispatch.dispatches) {
+    INFO("stencil of %d: gang dispatch latency avg %lu ns max %lu ns\n",
+         b->size, b->dispatch.latency_sum / b->dispatch.dispatches, b->dispatch.latency_max);
+  }
+
+  if (b->dispatch.releases) {
+    INFO("stencil of %d: gang dispatch skew avg %lu ns max %lu ns over %lu releases\n",
+         b->size, b->dispatch.skew_sum / b->dispatch.releases, b->dispatch.skew_max,
+         b->dispatch.releases);
+  }
+
+  FREE(b->cells[0]);
+  FREE(b->cells[1]);
+  FREE(b);
+}
+
+#define GROUP_STENCIL(n)                                                \
+static int                                                              \
+group_stencil_setup_##n(void **state) {                                 \
+  return group_stencil_setup(state, n);                                 \
+}                                                                       \
+static struct nk_bench_impl group_stencil_bench_##n##_impl = {          \
+  .name     = "group_stencil_" #n,                                      \
+  .unit     = "ns",                                                     \
+  .flags    = NK_BENCH_ONCE | NK_BENCH_NEEDS_PEER,                      \
+  .reps     = 10,                                                       \
+  .warmup   = 1,                                                        \
+  .setup    = group_stencil_setup_##n,                                  \
+  .run      = group_stencil_bench,                                      \
+  .teardown = group_stencil_teardown,                                   \
+};                                                                      \
+nk_register_bench(group_stencil_bench_##n##_impl);                      \
+static struct nk_bench_impl group_stencil_gang_bench_##n##_impl = {     \
+  .name     = "group_stencil_gang_" #n,                                 \
+  .unit     = "ns",                                                     \
+  .flags    = NK_BENCH_ONCE | NK_BENCH_NEEDS_PEER,                      \
+  .reps     = 10,                                                       \
+  .warmup   = 1,                                                        \
+  .setup    = group_stencil_setup_##n,                                  \
+  .run      = group_stencil_gang_bench,                                 \
+  .teardown = group_stencil_teardown,                                   \
+};                                                                      \
+nk_register_bench(group_stencil_gang_bench_##n##_impl);
+
+GROUP_STENCIL(2)
+GROUP_STENCIL(4)
+GROUP_STENCIL(8)
+GROUP_STENCIL(16)
+GROUP_STENCIL(32)
+GROUP_STENCIL(64)
@@ -1,5 +1,6 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/shell.h>
+#include <rt/ndpc/ndpc_preempt_threads.h>
 
 int ndpc_test_integral();
 int ndpc_test_fork();
@@ -11,17 +12,84 @@ int test_ndpc_manyfact();
 int test_ndpc_prod2();
 
 
+#define NDPC_TIME(x) ({ uint64_t __s = rdtsc(); x; nk_vc_printf("ndpc: %s took %lu cycles\n", #x, rdtsc()-__s); })
+
+// created threads bump a shared counter inside global and
+// local critical sections
+#define CRIT_THREADS 16
+#define CRIT_LOOPS   1000
+
+static volatile uint64_t crit_count;
+
+static int crit_func(void *input, void **output)
+{
+    int i;
+
+    for (i=0;i<CRIT_LOOPS;i++) {
+	ndpc_enter_global_critical_section();
+	ndpc_enter_local_critical_section();  // nests fine
+	crit_count++;
+	ndpc_leave_local_critical_section();
+	ndpc_leave_global_critical_section();
+    }
+
+    *output = (void*)(uint64_t)i;
+
+    return 0;
+}
+
+static int ndpc_test_critical()
+{
+    thread_id_t tid[CRIT_THREADS];
+    void *out[CRIT_THREADS];
+    int i, rc = 0;
+
+    ndpc_init_preempt_threads();
+
+    crit_count = 0;
+
+    for (i=0;i<CRIT_THREADS;i++) {
+	if (ndpc_create_preempt_thread(crit_func,0,&out[i],-1,0,&tid[i])) {
+	    nk_vc_printf("ndpc: cannot create thread %d\n",i);
+	    rc = -1;
+	    break;
+	}
+    }
+
+    // join the first explicitly, and the rest as children
+    if (i > 0 && ndpc_join_preempt_thread(tid[0]) != (void*)CRIT_LOOPS) {
+	nk_vc_printf("ndpc: bad output from thread 0\n");
+	rc = -1;
+    }
+
+    ndpc_join_child_preempt_threads();
+
+    if (crit_count != (uint64_t)i*CRIT_LOOPS) {
+	nk_vc_printf("ndpc: critical section test failed: count %lu, expected %lu\n",
+		     crit_count, (uint64_t)i*CRIT_LOOPS);
+	rc = -1;
+    } else {
+	nk_vc_printf("ndpc: critical section test passed\n");
+    }
+
+    ndpc_deinit_preempt_threads();
+
+    return rc;
+}
+
+
 int test_ndpc()
 {
    
-    ndpc_test_integral();
-    ndpc_test_fork();
-    ndpc_test_barrier_fork();
-
-    test_ndpc_fact();
-    test_ndpc_manyfact();
-    test_ndpc_apply();
-    test_ndpc_prod2();
+    NDPC_TIME(ndpc_test_integral());
+    NDPC_TIME(ndpc_test_fork());
+    NDPC_TIME(ndpc_test_barrier_fork());
+    NDPC_TIME(ndpc_test_critical());
+
+    NDPC_TIME(test_ndpc_fact());
+    NDPC_TIME(test_ndpc_manyfact());
+    NDPC_TIME(test_ndpc_apply());
+    NDPC_TIME(test_ndpc_prod2());
     
     return 0;
 }
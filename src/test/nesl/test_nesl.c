@@ -1,6 +1,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/shell.h>
 #include <rt/nesl/nesl.h>
+#include <rt/nesl/cvl.h>
 
 
 int 
@@ -25,3 +26,123 @@ static struct shell_cmd_impl nesl_impl = {
     .handler  = handle_nesl,
 };
 nk_register_shell_cmd(nesl_impl);
+
+
+// Check the CVL scans, reduces, permutes, and ranks against simple
+// reference loops on vectors large enough to be split up by the
+// parallel CVL
+
+void CVL_init();
+
+#define CVL_CHECK(cond, what) if (!(cond)) { nk_vc_printf("cvl: %s failed at %d\n", what, i); goto out; }
+
+int
+test_cvl (int n)
+{
+    int *a = malloc(sizeof(int)*n);
+    int *b = malloc(sizeof(int)*n);
+    int *perm = malloc(sizeof(int)*n);
+    int *segd = malloc(sizeof(int)*n);
+    int *scratch = malloc(2*sizeof(int)*n);
+    int i, j, k, m, sum, rc = -1;
+    uint64_t start, end;
+
+    if (!a || !b || !perm || !segd || !scratch) {
+	nk_vc_printf("cvl: cannot allocate test vectors\n");
+	goto out;
+    }
+
+    CVL_init();
+
+    for (i = 0; i < n; i++) {
+	a[i] = (i * 7919) % 1009 - 500;
+	perm[i] = (n - 1) - i;
+    }
+
+    // segments of varying (and sometimes zero) length
+    for (m = 0, i = 0; i < n; m++) {
+	int len = (m * 37) % 5000;
+	if (len > n - i) {
+	    len = n - i;
+	}
+	segd[m] = len;
+	i += len;
+    }
+
+    start = rdtsc();
+    add_suz(b, a, n, CVL_SCRATCH_NULL);
+    end = rdtsc();
+    for (sum = 0, i = 0; i < n; i++) {
+	CVL_CHECK(b[i] == sum, "add_suz");
+	sum += a[i];
+    }
+    CVL_CHECK(add_ruz(a, n, CVL_SCRATCH_NULL) == sum, "add_ruz");
+    nk_vc_printf("cvl: add scan of %d ints: %lu cycles\n", n, end - start);
+
+    add_sez(b, a, segd, n, m, CVL_SCRATCH_NULL);
+    for (i = 0, j = 0; j < m; j++) {
+	for (sum = 0, k = 0; k < segd[j]; k++, i++) {
+	    CVL_CHECK(b[i] == sum, "add_sez");
+	    sum += a[i];
+	}
+    }
+
+    add_rez(b, a, segd, n, m, CVL_SCRATCH_NULL);
+    for (i = 0, j = 0; j < m; j++) {
+	for (sum = 0, k = 0; k < segd[j]; k++, i++) {
+	    sum += a[i];
+	}
+	CVL_CHECK(b[j] == sum, "add_rez");
+    }
+
+    smp_puz(b, a, perm, n, CVL_SCRATCH_NULL);
+    for (i = 0; i < n; i++) {
+	CVL_CHECK(b[perm[i]] == a[i], "smp_puz");
+    }
+
+    start = rdtsc();
+    rku_luz(b, a, n, scratch);
+    end = rdtsc();
+    for (i = 0; i < n; i++) {
+	perm[b[i]] = i;
+    }
+    for (i = 1; i < n; i++) {
+	CVL_CHECK(a[perm[i-1]] < a[perm[i]] ||
+		  (a[perm[i-1]] == a[perm[i]] && perm[i-1] < perm[i]), "rku_luz");
+    }
+    nk_vc_printf("cvl: rank of %d ints: %lu cycles\n", n, end - start);
+
+    nk_vc_printf("cvl: all checks passed\n");
+    rc = 0;
+
+ out:
+    if (a) { free(a); }
+    if (b) { free(b); }
+    if (perm) { free(perm); }
+    if (segd) { free(segd); }
+    if (scratch) { free(scratch); }
+    return rc;
+}
+
+static int
+handle_cvl (char * buf, void * priv)
+{
+    int n = 1000000;
+
+    sscanf(buf, "cvltest %d", &n);
+
+    if (n < 1) {
+	nk_vc_printf("cvltest [n]\n");
+	return 0;
+    }
+
+    test_cvl(n);
+    return 0;
+}
+
+static struct shell_cmd_impl cvl_impl = {
+    .cmd      = "cvltest",
+    .help_str = "cvltest [n]",
+    .handler  = handle_cvl,
+};
+nk_register_shell_cmd(cvl_impl);
@@ -23,6 +23,9 @@
 #include <nautilus/shutdown.h>
 #include <nautilus/cmdline.h>
 #include <nautilus/hashtable.h>
+#include <nautilus/thread.h>
+#include <nautilus/smp.h>
+#include <nautilus/shell.h>
 #include <test/test.h>
 
 #ifndef NAUT_CONFIG_DEBUG_TESTS
@@ -140,10 +143,17 @@ __run_tests (struct naut_info * naut, int shutdown)
 }
 
 
+static int run_queued_benches(void);
+
 int
 nk_run_tests (struct naut_info * naut)
 {
-    int ret = __run_tests(naut, 1);
+    int ret = run_queued_benches();
+
+    if (ret == 0) {
+        ret = __run_tests(naut, 1);
+    }
+
     if (ret != 0) {
         shutdown_with_code(0xff);
     }
@@ -408,6 +418,512 @@ static struct nk_cmdline_impl all_cmdline_impl = {
 nk_register_cmdline_flag(all_cmdline_impl);
 
 
+/*
+ * Benchmark harness
+ *
+ * Each CPU taking part in a run gets a thread bound to it that does
+ * the warmup repetitions, then records each measured repetition in a
+ * sample array.  The samples are sorted and summarized, and a record
+ * is printed for each CPU (and, for multi-CPU runs, one for all of
+ * them together, with cpu "all").
+ */
+
+#define BENCH_DEFAULT_REPS   1000
+#define BENCH_DEFAULT_WARMUP 100
+#define BENCH_MAX_REPS       (1 << 20)
+
+struct bench_run {
+    struct nk_bench_impl * impl;
+    void * state;
+    int reps;
+    int warmup;
+    int nthreads;
+    volatile int arrived;
+    volatile int failed;   // some repetition returned NK_BENCH_FAILED
+};
+
+struct bench_thread {
+    struct bench_run * run;
+    int cpu;
+    uint64_t * samples;
+};
+
+struct bench_stats {
+    uint64_t min;
+    uint64_t median;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+    uint64_t mean;
+    uint64_t stddev;
+};
+
+
+static void
+bench_thread_func (void * in, void ** out)
+{
+    struct bench_thread * t = (struct bench_thread *)in;
+    struct bench_run * r = t->run;
+    int i;
+
+    // multi-CPU runs start together
+    __sync_fetch_and_add(&r->arrived, 1);
+    while (r->arrived < r->nthreads) {
+        asm volatile ("pause");
+    }
+
+    for (i = 0; i < r->warmup && !r->failed; i++) {
+        if (r->impl->run(r->state, t->cpu) == NK_BENCH_FAILED) {
+            r->failed = 1;
+        }
+    }
+
+    for (i = 0; i < r->reps && !r->failed; i++) {
+        t->samples[i] = r->impl->run(r->state, t->cpu);
+        if (t->samples[i] == NK_BENCH_FAILED) {
+            r->failed = 1;
+        }
+    }
+}
+
+
+static void
+bench_sort (uint64_t * a, int n)
+{
+    int gap, i, j;
+
+    for (gap = n / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < n; i++) {
+            uint64_t v = a[i];
+            for (j = i; j >= gap && a[j - gap] > v; j -= gap) {
+                a[j] = a[j - gap];
+            }
+            a[j] = v;
+        }
+    }
+}
+
+
+static uint64_t
+bench_isqrt (uint64_t x)
+{
+    uint64_t r = x, y;
+
+    if (x < 2) {
+        return x;
+    }
+
+    // Newton's method, starting above the root
+    y = (r + 1) / 2;
+    while (y < r) {
+        r = y;
+        y = (r + x / r) / 2;
+    }
+
+    return r;
+}
+
+
+static void
+bench_summarize (uint64_t * samples, int n, struct bench_stats * s)
+{
+    uint64_t sum = 0, var = 0, rem = 0;
+    int i;
+
+    bench_sort(samples, n);
+
+    for (i = 0; i < n; i++) {
+        sum += samples[i];
+    }
+
+    s->min    = samples[0];
+    s->median = samples[(n - 1) / 2];
+    s->p90    = samples[(uint64_t)(n - 1) * 90 / 100];
+    s->p99    = samples[(uint64_t)(n - 1) * 99 / 100];
+    s->max    = samples[n - 1];
+    s->mean   = sum / n;
+
+    for (i = 0; i < n; i++) {
+        uint64_t d = samples[i] > s->mean ? samples[i] - s->mean : s->mean - samples[i];
+        if (d > 0xffffffffULL) {
+            d = 0xffffffffULL;
+        }
+        // sum of d*d, divided by n once; each term goes in as quotient
+        // and remainder so neither the division truncates every term
+        // nor the sum overflows
+        var += d * d / n;
+        rem += d * d % n;
+        if (rem >= n) {
+            var += rem / n;
+            rem %= n;
+        }
+    }
+
+    s->stddev = bench_isqrt(var);
+}
+
+
+static void
+bench_report (struct bench_run * r, char * mode, int cpu, uint64_t * samples, int n, int json)
+{
+    struct bench_stats s;
+    char cpustr[16];
+
+    bench_summarize(samples, n, &s);
+
+    if (cpu < 0) {
+        strcpy(cpustr, "all");
+    } else {
+        snprintf(cpustr, sizeof(cpustr), "%d", cpu);
+    }
+
+    if (json) {
+        printk("BENCH_JSON {\"name\":\"%s\",\"mode\":\"%s\",\"cpu\":\"%s\",\"reps\":%d,"
+               "\"unit\":\"%s\",\"min\":%lu,\"median\":%lu,\"p90\":%lu,\"p99\":%lu,"
+               "\"max\":%lu,\"mean\":%lu,\"stddev\":%lu}\n",
+               r->impl->name, mode, cpustr, n, r->impl->unit,
+               s.min, s.median, s.p90, s.p99, s.max, s.mean, s.stddev);
+    } else {
+        printk("BENCH_CSV %s,%s,%s,%d,%s,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+               r->impl->name, mode, cpustr, n, r->impl->unit,
+               s.min, s.median, s.p90, s.p99, s.max, s.mean, s.stddev);
+    }
+}
+
+
+/*
+ * Run impl once, either on the single CPU cpu, or, if cpu < 0,
+ * concurrently on all CPUs
+ */
+static int
+bench_run_once (struct nk_bench_impl * impl, int reps, int warmup, int cpu, int json)
+{
+    int nthreads = cpu < 0 ? nk_get_num_cpus() : 1;
+    struct bench_thread * threads;
+    nk_thread_id_t * tids;
+    struct bench_run r;
+    uint64_t * all;
+    int started = 0;
+    int i, ret = -1;
+
+    memset(&r, 0, sizeof(r));
+    r.impl     = impl;
+    r.reps     = reps;
+    r.warmup   = warmup;
+    r.nthreads = nthreads;
+
+    threads = malloc(nthreads * sizeof(*threads));
+    tids    = malloc(nthreads * sizeof(*tids));
+
+    if (!threads || !tids) {
+        ERROR("Cannot allocate benchmark threads\n");
+        goto out;
+    }
+
+    memset(threads, 0, nthreads * sizeof(*threads));
+
+    for (i = 0; i < nthreads; i++) {
+        threads[i].run = &r;
+        threads[i].cpu = cpu < 0 ? i : cpu;
+        threads[i].samples = malloc(reps * sizeof(uint64_t));
+        if (!threads[i].samples) {
+            ERROR("Cannot allocate samples for benchmark %s\n", impl->name);
+            goto out;
+        }
+    }
+
+    if (impl->setup && impl->setup(&r.state)) {
+        ERROR("Setup failed for benchmark %s\n", impl->name);
+        goto out;
+    }
+
+    for (started = 0; started < nthreads; started++) {
+        if (nk_thread_start(bench_thread_func, &threads[started], NULL, 0, TSTACK_DEFAULT,
+                            &tids[started], threads[started].cpu)) {
+            ERROR("Cannot start benchmark thread on cpu %d\n", threads[started].cpu);
+            // release the ones already waiting at the start line
+            r.nthreads = started;
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++) {
+        nk_join(tids[i], NULL);
+    }
+
+    if (impl->teardown) {
+        impl->teardown(r.state);
+    }
+
+    if (started != nthreads) {
+        goto out;
+    }
+
+    if (r.failed) {
+        ERROR("A repetition of benchmark %s failed\n", impl->name);
+        goto out;
+    }
+
+    for (i = 0; i < nthreads; i++) {
+        bench_report(&r, cpu < 0 ? "multi" : "single", threads[i].cpu,
+                     threads[i].samples, reps, json);
+    }
+
+    if (cpu < 0) {
+        all = malloc(nthreads * reps * sizeof(uint64_t));
+        if (all) {
+            for (i = 0; i < nthreads; i++) {
+                memcpy(all + i * reps, threads[i].samples, reps * sizeof(uint64_t));
+            }
+            bench_report(&r, "multi", -1, all, nthreads * reps, json);
+            free(all);
+        }
+    }
+
+    ret = 0;
+
+out:
+    if (threads) {
+        for (i = 0; i < nthreads; i++) {
+            if (threads[i].samples) {
+                free(threads[i].samples);
+            }
+        }
+        free(threads);
+    }
+    if (tids) {
+        free(tids);
+    }
+    return ret;
+}
+
+
+static int
+bench_run_impl (struct nk_bench_impl * impl, int reps, int warmup, int cpu, int json)
+{
+    int ncpus = nk_get_num_cpus();
+    int ret = 0;
+    int i;
+
+    if (reps <= 0) {
+        reps = impl->reps ? impl->reps : BENCH_DEFAULT_REPS;
+    }
+    if (reps > BENCH_MAX_REPS) {
+        reps = BENCH_MAX_REPS;
+    }
+    if (warmup < 0) {
+        warmup = impl->warmup ? impl->warmup : BENCH_DEFAULT_WARMUP;
+    }
+
+    if ((impl->flags & NK_BENCH_NEEDS_PEER) && ncpus < 2) {
+        INFO("Skipping benchmark %s: needs at least two CPUs\n", impl->name);
+        return 0;
+    }
+
+    INFO("Running benchmark %s (%d reps, %d warmup)\n", impl->name, reps, warmup);
+
+    if (impl->flags & NK_BENCH_PER_CPU) {
+        if (cpu >= 0) {
+            ret |= bench_run_once(impl, reps, warmup, cpu, json);
+        } else {
+            for (i = 0; i < ncpus; i++) {
+                ret |= bench_run_once(impl, reps, warmup, i, json);
+            }
+        }
+    }
+
+    if ((impl->flags & NK_BENCH_MULTI_CPU) && cpu < 0) {
+        ret |= bench_run_once(impl, reps, warmup, -1, json);
+    }
+
+    if (impl->flags & NK_BENCH_ONCE) {
+        ret |= bench_run_once(impl, reps, warmup, cpu < 0 ? 0 : cpu, json);
+    }
+
+    return ret;
+}
+
+
+/*
+ * Run the benchmark called name ("all" for all of them).
+ * reps <= 0 and warmup < 0 select the benchmark's defaults,
+ * cpu < 0 selects all CPUs.
+ */
+int
+nk_run_bench (char * name, int reps, int warmup, int cpu, int json)
+{
+    extern struct nk_bench_impl * __start_benches[];
+    extern struct nk_bench_impl * __stop_benches[];
+    struct nk_bench_impl ** b;
+    int found = 0;
+    int ret = 0;
+
+    if (cpu >= (int)nk_get_num_cpus()) {
+        ERROR("No cpu %d\n", cpu);
+        return -1;
+    }
+
+    if (!json) {
+        printk("BENCH_CSV name,mode,cpu,reps,unit,min,median,p90,p99,max,mean,stddev\n");
+    }
+
+    for (b = __start_benches; b != __stop_benches; b++) {
+        if (!strcmp(name, "all") || !strcmp(name, (*b)->name)) {
+            found = 1;
+            if (bench_run_impl(*b, reps, warmup, cpu, json)) {
+                ERROR("Benchmark %s failed\n", (*b)->name);
+                ret = -1;
+            }
+        }
+    }
+
+    if (!found) {
+        ERROR("No benchmark '%s' found\n", name);
+        return -1;
+    }
+
+    return ret;
+}
+
+
+/*
+ * Benchmarks requested on the command line are run (before any tests)
+ * when the test harness runs at boot:
+ *
+ * multiboot2 /nautilus.bin -bench spinlock "1000 100 all json" -bench all
+ */
+struct bench_request {
+    struct list_head node;
+    char name[32];
+    int reps;
+    int warmup;
+    int cpu;
+    int json;
+};
+
+static LIST_HEAD(bench_requests);
+
+
+static void
+parse_bench_args (char * args, int * reps, int * warmup, int * cpu, int * json)
+{
+    char * tok;
+
+    *reps   = 0;
+    *warmup = -1;
+    *cpu    = -1;
+    *json   = 0;
+
+    // [reps] [warmup] [cpu|all] [csv|json]
+    if ((tok = strtok(args, " ")) == NULL) return;
+    *reps = atoi(tok);
+    if ((tok = strtok(NULL, " ")) == NULL) return;
+    *warmup = atoi(tok);
+    if ((tok = strtok(NULL, " ")) == NULL) return;
+    *cpu = strcmp(tok, "all") ? atoi(tok) : -1;
+    if ((tok = strtok(NULL, " ")) == NULL) return;
+    *json = !strcmp(tok, "json");
+}
+
+
+static int
+handle_bench_from_cmdline (char * args)
+{
+    struct bench_request * req;
+    char ** argv;
+    int argc = 0;
+    char joined[ARGMAX];
+    int i, len = 0;
+
+    parse_args(args, &argc, &argv);
+
+    req = malloc(sizeof(*req));
+    if (!req) {
+        ERROR("Cannot allocate benchmark request\n");
+        return -1;
+    }
+
+    strncpy(req->name, argv[0], sizeof(req->name) - 1);
+    req->name[sizeof(req->name) - 1] = 0;
+
+    joined[0] = 0;
+    for (i = 1; i < argc; i++) {
+        len += snprintf(joined + len, ARGMAX - len, "%s ", argv[i]);
+        if (len >= ARGMAX) {
+            break;
+        }
+    }
+
+    parse_bench_args(joined, &req->reps, &req->warmup, &req->cpu, &req->json);
+
+    list_add_tail(&req->node, &bench_requests);
+
+    return 0;
+}
+
+static struct nk_cmdline_impl bench_cmdline_impl = {
+    .name    = "bench",
+    .handler = handle_bench_from_cmdline,
+};
+nk_register_cmdline_flag(bench_cmdline_impl);
+
+
+static int
+run_queued_benches (void)
+{
+    struct bench_request * req, * tmp;
+    int ret = 0;
+
+    list_for_each_entry_safe(req, tmp, &bench_requests, node) {
+        if (nk_run_bench(req->name, req->reps, req->warmup, req->cpu, req->json)) {
+            ret = -1;
+        }
+        list_del(&req->node);
+        free(req);
+    }
+
+    return ret;
+}
+
+
+static int
+handle_bench (char * buf, void * priv)
+{
+    extern struct nk_bench_impl * __start_benches[];
+    extern struct nk_bench_impl * __stop_benches[];
+    struct nk_bench_impl ** b;
+    char name[32];
+    int reps, warmup, cpu, json;
+    int pos = 0;
+
+    if (sscanf(buf, "bench %31s%n", name, &pos) != 1 || !strcmp(name, "list")) {
+        for (b = __start_benches; b != __stop_benches; b++) {
+            nk_vc_printf("%-16s %-8s %s%s%s%s\n", (*b)->name, (*b)->unit,
+                         (*b)->flags & NK_BENCH_PER_CPU ? "single " : "",
+                         (*b)->flags & NK_BENCH_MULTI_CPU ? "multi " : "",
+                         (*b)->flags & NK_BENCH_ONCE ? "once " : "",
+                         (*b)->flags & NK_BENCH_NEEDS_PEER ? "(needs peer)" : "");
+        }
+        return 0;
+    }
+
+    parse_bench_args(buf + pos, &reps, &warmup, &cpu, &json);
+
+    if (nk_run_bench(name, reps, warmup, cpu, json)) {
+        nk_vc_printf("benchmark %s failed\n", name);
+    }
+
+    return 0;
+}
+
+static struct shell_cmd_impl bench_impl = {
+    .cmd      = "bench",
+    .help_str = "bench [list | name|all [reps] [warmup] [cpu|all] [csv|json]]",
+    .handler  = handle_bench,
+};
+nk_register_shell_cmd(bench_impl);
+
+
 static int
 handle_sample_test (int argc, char ** argv)
 {